@@ -10,11 +10,16 @@ use cap_std::fs::Dir;
 use cap_std_ext::prelude::{CapStdExtCommandExt, CapStdExtDirExt};
 use fn_error_context::context;
 use ostree_ext::{gio, glib};
+use rustix::fs::MetadataExt;
 use std::num::NonZeroUsize;
 use std::os::unix::io::AsRawFd;
 use std::os::unix::process::CommandExt;
-use std::path::Path;
+use std::path::{Path, PathBuf};
 use std::process::Command;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::mpsc::RecvTimeoutError;
+use std::sync::Arc;
+use std::time::Duration;
 
 // Links in the rootfs to /usr
 static USR_LINKS: &[&str] = &["lib", "lib32", "lib64", "bin", "sbin"];
@@ -53,7 +58,17 @@ pub(crate) struct Bubblewrap {
     child_argv0: Option<NonZeroUsize>,
     launcher: gio::SubprocessLauncher, // 🚀
 
-    rofiles_mounts: Vec<RoFilesMount>,
+    rofiles_mounts: Vec<Arc<RoFilesMount>>,
+    overlay_mounts: Vec<OverlayMount>,
+}
+
+/// State shared by the bwrap instances used to run a batch of scripts against
+/// the same rootfs.  Most of the fixed cost of running a script in `RoFiles`
+/// mode is starting (and later unmounting) the rofiles-fuse instances, so
+/// those are only set up once per session, and kept until it's dropped.
+pub(crate) struct BubblewrapSession {
+    rootfs_fd: Dir,
+    rofiles_mounts: Option<Vec<(&'static str, Arc<RoFilesMount>)>>,
 }
 
 // nspawn by default doesn't give us CAP_NET_ADMIN; see
@@ -68,6 +83,193 @@ fn running_in_nspawn() -> bool {
     std::env::var_os("container").as_deref() == Some(std::ffi::OsStr::new("systemd-nspawn"))
 }
 
+/// Set once mounting an overlayfs failed, so that we don't retry for every script.
+static OVERLAY_UNSUPPORTED: AtomicBool = AtomicBool::new(false);
+
+/// Prefix of the xattrs overlayfs uses for its own bookkeeping in the upper
+/// directory; these must not end up in the rootfs.
+const OVERLAY_XATTR_PREFIX: &[u8] = b"trusted.overlay.";
+
+/// A kernel overlayfs over a directory of the rootfs, as a cheaper alternative
+/// to rofiles-fuse: the data path doesn't go through a userspace daemon.  The
+/// lower layer is the rootfs directory itself, and every change lands in the
+/// upper directory instead, so the hardlinked files are never mutated in place.
+/// Once the script exits successfully, [`OverlayMount::reconcile`] applies the
+/// changes to the rootfs by replacing the changed files, which breaks their
+/// hardlinks the same way `rofiles-fuse --copyup` does.
+///
+/// The upper and work directories are in a temporary directory at the toplevel
+/// of the rootfs, so that the results can be renamed into place.
+struct OverlayMount {
+    /// The path in the rootfs, without leading `/`
+    path: String,
+    upper: PathBuf,
+    mountpoint: PathBuf,
+    mounted: bool,
+    /// Holds upper, work and the mount point; this is only an Option<T> so
+    /// we can leak it in drop() if unmounting fails.
+    tempdir: Option<tempfile::TempDir>,
+}
+
+impl OverlayMount {
+    /// Mount an overlayfs over `path` in the rootfs.
+    fn new(rootfs: &Dir, path: &str) -> Result<Self> {
+        let path = path.trim_start_matches('/');
+        let rootfs_path = std::fs::read_link(format!("/proc/self/fd/{}", rootfs.as_raw_fd()))?;
+        let tempdir = tempfile::Builder::new()
+            .prefix(".rpmostree-overlay")
+            .tempdir_in(&rootfs_path)?;
+        let lower = rootfs_path.join(path);
+        let upper = tempdir.path().join("upper");
+        let work = tempdir.path().join("work");
+        let mountpoint = tempdir.path().join("merged");
+        for d in [&upper, &work, &mountpoint] {
+            std::fs::create_dir(d)?;
+        }
+        let mut layers = Vec::new();
+        for (k, v) in [("lowerdir", &lower), ("upperdir", &upper), ("workdir", &work)] {
+            let v = v
+                .to_str()
+                .filter(|v| !v.contains([',', ':', '\\']))
+                .ok_or_else(|| anyhow::anyhow!("Unsupported path for overlayfs: {v:?}"))?;
+            layers.push(format!("{k}={v}"));
+        }
+        // No metacopy, since then a chmod would give us an upper file without
+        // its data; and no redirect_dir, so renaming a lower directory fails
+        // with EXDEV and gets done by copying it instead.
+        let options = format!("{},metacopy=off,redirect_dir=off,index=off", layers.join(","));
+        nix::mount::mount(
+            Some("overlay"),
+            &mountpoint,
+            Some("overlay"),
+            nix::mount::MsFlags::empty(),
+            Some(options.as_str()),
+        )
+        .with_context(|| format!("Mounting overlayfs on /{path}"))?;
+        Ok(Self {
+            path: path.to_string(),
+            upper,
+            mountpoint,
+            mounted: true,
+            tempdir: Some(tempdir),
+        })
+    }
+
+    /// Return the mount point path
+    fn path(&self) -> &Path {
+        &self.mountpoint
+    }
+
+    fn unmount(&mut self) -> Result<()> {
+        if self.mounted {
+            nix::mount::umount(&self.mountpoint)
+                .with_context(|| format!("Unmounting overlayfs on /{}", self.path))?;
+            self.mounted = false;
+        }
+        Ok(())
+    }
+
+    /// Unmount the overlay, and apply the changes in its upper directory to
+    /// the rootfs.
+    fn reconcile(&mut self, rootfs: &Dir) -> Result<()> {
+        self.unmount()?;
+        let upper = Dir::open_ambient_dir(&self.upper, cap_std::ambient_authority())?;
+        let target = rootfs.open_dir(&self.path)?;
+        reconcile_overlay_dir(&upper, &self.upper, &target)
+            .with_context(|| format!("Applying changes to /{}", self.path))
+    }
+}
+
+impl Drop for OverlayMount {
+    fn drop(&mut self) {
+        if self.mounted {
+            if let Err(e) = nix::mount::umount2(&self.mountpoint, nix::mount::MntFlags::MNT_DETACH)
+            {
+                systemd::journal::print(4, &format!("Unmounting overlayfs: {e}"));
+                // We cannot remove it while it's mounted; just leak it.
+                let _ = self.tempdir.take().map(|d| d.into_path());
+            }
+        }
+    }
+}
+
+/// Remove the overlayfs bookkeeping xattrs from `path`, e.g. the `origin` set
+/// on copy-up.
+fn strip_overlay_xattrs(path: &Path) -> Result<()> {
+    let size = rustix::fs::llistxattr(path, &mut [])?;
+    if size == 0 {
+        return Ok(());
+    }
+    let mut buf = vec![0 as std::ffi::c_char; size];
+    let size = rustix::fs::llistxattr(path, &mut buf)?;
+    let names: Vec<u8> = buf[..size].iter().map(|&c| c as u8).collect();
+    for name in names.split(|&c| c == 0) {
+        if name.starts_with(OVERLAY_XATTR_PREFIX) {
+            let name = std::ffi::CString::new(name)?;
+            rustix::fs::lremovexattr(path, name.as_c_str())?;
+        }
+    }
+    Ok(())
+}
+
+/// Whether the directory `path` in an upper directory hides the contents of
+/// the lower one.
+fn is_overlay_opaque(path: &Path) -> Result<bool> {
+    let mut buf = [0u8; 1];
+    match rustix::fs::lgetxattr(path, "trusted.overlay.opaque", &mut buf) {
+        Ok(n) => Ok(n == 1 && buf[0] == b'y'),
+        Err(rustix::io::Errno::NODATA) => Ok(false),
+        Err(e) => Err(e.into()),
+    }
+}
+
+/// Move the contents of the overlayfs upper directory `upper` (at `upper_path`)
+/// into `target`: whiteouts delete, files and symlinks replace, and directories
+/// are merged unless they're opaque.
+fn reconcile_overlay_dir(upper: &Dir, upper_path: &Path, target: &Dir) -> Result<()> {
+    // Collect first, since we move entries out from under the iterator.
+    let entries = upper.entries()?.collect::<std::io::Result<Vec<_>>>()?;
+    for entry in entries {
+        let name = entry.file_name();
+        let meta = entry.metadata()?;
+        let path = upper_path.join(&name);
+        if crate::composepost::is_overlay_whiteout(&meta) {
+            target.remove_all_optional(&name)?;
+            continue;
+        }
+        let existing = target.symlink_metadata_optional(&name)?;
+        if meta.is_dir() {
+            let merge = match existing {
+                Some(m) if m.is_dir() => !is_overlay_opaque(&path)?,
+                _ => false,
+            };
+            if !merge {
+                target.remove_all_optional(&name)?;
+                target.create_dir(&name)?;
+            }
+            let subdir = target.open_dir(&name)?;
+            reconcile_overlay_dir(&upper.open_dir(&name)?, &path, &subdir)?;
+            // Only ownership and mode are carried over for directories; any
+            // other xattrs (i.e. SELinux labels) are recomputed at commit time.
+            nix::unistd::fchown(
+                subdir.as_raw_fd(),
+                Some(nix::unistd::Uid::from_raw(meta.uid())),
+                Some(nix::unistd::Gid::from_raw(meta.gid())),
+            )?;
+            rustix::fs::fchmod(&subdir, rustix::fs::Mode::from_raw_mode(meta.mode() & 0o7777))?;
+        } else {
+            strip_overlay_xattrs(&path)?;
+            if existing.map(|m| m.is_dir()).unwrap_or_default() {
+                target.remove_all_optional(&name)?;
+            }
+            upper
+                .rename(&name, target, &name)
+                .with_context(|| format!("Renaming {name:?}"))?;
+        }
+    }
+    Ok(())
+}
+
 /// A wrapper for rofiles-fuse from ostree.  This protects the underlying
 /// hardlinked files from mutation.  The mount point is a temporary
 /// directory.
@@ -146,8 +348,36 @@ impl Drop for RoFilesMount {
     }
 }
 
+/// How long a cancelled child gets to exit on its own before it's killed.
+const CANCEL_GRACE_PERIOD: Duration = Duration::from_secs(5);
+
+/// Ask a child to exit with SIGTERM, and SIGKILL it if it's still around
+/// after [`CANCEL_GRACE_PERIOD`].  The signal goes to bwrap itself; since
+/// we use `--die-with-parent`, the sandbox goes down with it.
+fn child_terminate(child: &gio::Subprocess) {
+    child.send_signal(libc::SIGTERM);
+    let timeout = gio::Cancellable::new();
+    let (done, rx) = std::sync::mpsc::channel::<()>();
+    let timer = {
+        let timeout = timeout.clone();
+        std::thread::spawn(move || {
+            if let Err(RecvTimeoutError::Timeout) = rx.recv_timeout(CANCEL_GRACE_PERIOD) {
+                timeout.cancel();
+            }
+        })
+    };
+    let exited = child.wait(Some(&timeout)).is_ok();
+    drop(done);
+    let _ = timer.join();
+    if !exited {
+        child.force_exit();
+        let _ = child.wait(gio::Cancellable::NONE);
+    }
+}
+
 /// Helper wrapper that waits for a child and checks its exit status.
-/// Further if the wait is cancelled then the child is force killed.
+/// Further if the wait is cancelled then the child is terminated, so that
+/// we don't return before it's gone.
 fn child_wait_check(
     child: gio::Subprocess,
     cancellable: Option<&gio::Cancellable>,
@@ -159,7 +389,7 @@ fn child_wait_check(
             Ok(())
         }
         Err(e) => {
-            child.force_exit();
+            child_terminate(&child);
             Err(e)
         }
     }
@@ -266,6 +496,7 @@ impl Bubblewrap {
             launcher,
             child_argv0: None,
             rofiles_mounts: Vec::new(),
+            overlay_mounts: Vec::new(),
         })
     }
 
@@ -281,8 +512,10 @@ impl Bubblewrap {
                 ret.bind_read("etc", "/etc");
             }
             BubblewrapMutability::RoFiles => {
-                ret.setup_rofiles("/usr")?;
-                ret.setup_rofiles("/etc")?;
+                if !ret.setup_overlays()? {
+                    ret.setup_rofiles("/usr")?;
+                    ret.setup_rofiles("/etc")?;
+                }
             }
             BubblewrapMutability::MutateFreely => {
                 ret.bind_readwrite("usr", "/usr");
@@ -296,11 +529,53 @@ impl Bubblewrap {
     }
 
     fn setup_rofiles(&mut self, path: &str) -> Result<()> {
-        let mnt = RoFilesMount::new(&self.rootfs_fd, path)?;
+        let mnt = Arc::new(RoFilesMount::new(&self.rootfs_fd, path)?);
+        self.bind_rofiles(path, mnt);
+        Ok(())
+    }
+
+    /// Set up overlayfs mounts for `/usr` and `/etc` in place of rofiles-fuse,
+    /// returning `false` if that isn't possible here (we're not root, or the
+    /// kernel doesn't support it), or if `RPMOSTREE_ROFILES_FUSE` is set.
+    fn setup_overlays(&mut self) -> Result<bool> {
+        if OVERLAY_UNSUPPORTED.load(Ordering::Relaxed)
+            || rustix::process::getuid().as_raw() != 0
+            || std::env::var_os("RPMOSTREE_ROFILES_FUSE").is_some()
+        {
+            return Ok(false);
+        }
+        let mut mounts = Vec::new();
+        for path in ["/usr", "/etc"] {
+            match OverlayMount::new(&self.rootfs_fd, path) {
+                Ok(mnt) => mounts.push((path, mnt)),
+                Err(e) => {
+                    tracing::debug!("Falling back to rofiles-fuse: {e:#}");
+                    OVERLAY_UNSUPPORTED.store(true, Ordering::Relaxed);
+                    return Ok(false);
+                }
+            }
+        }
+        for (path, mnt) in mounts {
+            let mountpoint = mnt.path().to_str().expect("tempdir str").to_string();
+            self.bind_readwrite(&mountpoint, path);
+            self.overlay_mounts.push(mnt);
+        }
+        Ok(true)
+    }
+
+    /// Apply the changes made through the overlayfs mounts, if any, to the rootfs.
+    fn reconcile_overlays(&mut self) -> Result<()> {
+        for mut mnt in std::mem::take(&mut self.overlay_mounts) {
+            mnt.reconcile(&self.rootfs_fd)?;
+        }
+        Ok(())
+    }
+
+    /// Bind an (possibly shared) rofiles-fuse mount to `path`.
+    fn bind_rofiles(&mut self, path: &str, mnt: Arc<RoFilesMount>) {
         let tmpdir_path = mnt.path().to_str().expect("tempdir str");
         self.bind_readwrite(tmpdir_path, path);
         self.rofiles_mounts.push(mnt);
-        Ok(())
     }
 
     /// Access the underlying rootfs file descriptor (should only be used by C)
@@ -424,12 +699,16 @@ impl Bubblewrap {
     ) -> Result<glib::Bytes> {
         self.launcher.set_flags(gio::SubprocessFlags::STDOUT_PIPE);
         let (child, argv0) = self.spawn()?;
-        let (stdout, stderr) = child.communicate(None, cancellable)?;
+        let (stdout, stderr) = child.communicate(None, cancellable).map_err(|e| {
+            child_terminate(&child);
+            e
+        })?;
         // we never pipe just stderr, so we don't expect it to be captured
         assert!(stderr.is_none());
         let stdout = stdout.expect("stdout");
 
         child_wait_check(child, cancellable).context(argv0)?;
+        self.reconcile_overlays()?;
 
         Ok(stdout)
     }
@@ -438,6 +717,7 @@ impl Bubblewrap {
     fn run_inner(&mut self, cancellable: Option<&gio::Cancellable>) -> Result<()> {
         let (child, argv0) = self.spawn()?;
         child_wait_check(child, cancellable).context(argv0)?;
+        self.reconcile_overlays()?;
         Ok(())
     }
 
@@ -449,6 +729,49 @@ impl Bubblewrap {
     }
 }
 
+impl BubblewrapSession {
+    /// Create a bwrap instance with the provided level of mutability, reusing
+    /// the session's rofiles-fuse mounts.  Overlayfs mounts aren't shared,
+    /// since their changes are applied to the rootfs after each script; but
+    /// they're cheap to set up.
+    pub(crate) fn new_bwrap(
+        &mut self,
+        mutability: BubblewrapMutability,
+    ) -> CxxResult<Box<Bubblewrap>> {
+        if mutability != BubblewrapMutability::RoFiles {
+            return Ok(Box::new(Bubblewrap::new_with_mutability(
+                &self.rootfs_fd,
+                mutability,
+            )?));
+        }
+        let mut ret = Bubblewrap::new(&self.rootfs_fd)?;
+        if ret.setup_overlays()? {
+            return Ok(Box::new(ret));
+        }
+        if self.rofiles_mounts.is_none() {
+            let mut mounts = Vec::new();
+            for path in ["/usr", "/etc"] {
+                mounts.push((path, Arc::new(RoFilesMount::new(&self.rootfs_fd, path)?)));
+            }
+            self.rofiles_mounts = Some(mounts);
+        }
+        for (path, mnt) in self.rofiles_mounts.as_ref().unwrap() {
+            ret.bind_rofiles(path, Arc::clone(mnt));
+        }
+        Ok(Box::new(ret))
+    }
+}
+
+#[context("Creating bwrap session")]
+/// Create a new session for running many scripts in `rootfs_fd`
+pub(crate) fn bubblewrap_session_new(rootfs_fd: i32) -> CxxResult<Box<BubblewrapSession>> {
+    let rootfs_fd = unsafe { crate::ffiutil::ffi_dirfd(rootfs_fd)? };
+    Ok(Box::new(BubblewrapSession {
+        rootfs_fd,
+        rofiles_mounts: None,
+    }))
+}
+
 #[context("Creating bwrap instance")]
 /// Create a new Bubblewrap instance
 pub(crate) fn bubblewrap_new(rootfs_fd: i32) -> CxxResult<Box<Bubblewrap>> {
@@ -517,3 +840,42 @@ pub(crate) fn bubblewrap_selftest() -> CxxResult<()> {
     bwrap.run_inner(cancellable)?;
     Ok(())
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use cap_std_ext::cap_tempfile;
+
+    #[test]
+    fn test_reconcile_overlay_dir() -> Result<()> {
+        let upper = tempfile::tempdir()?;
+        let upper_dir = Dir::open_ambient_dir(upper.path(), cap_std::ambient_authority())?;
+        let target = cap_tempfile::tempdir(cap_std::ambient_authority())?;
+
+        target.create_dir("a")?;
+        target.write("a/old", "old")?;
+        target.write("replaced", "orig")?;
+        target.hard_link("replaced", &target, "hardlink")?;
+        target.create_dir("dir-replaced")?;
+        target.write("dir-replaced/gone", "gone")?;
+
+        upper_dir.create_dir("a")?;
+        upper_dir.write("a/new", "new")?;
+        upper_dir.write("replaced", "changed")?;
+        upper_dir.create_dir_all("b/c")?;
+        upper_dir.write("b/c/file", "file")?;
+        upper_dir.write("dir-replaced", "now a file")?;
+
+        reconcile_overlay_dir(&upper_dir, upper.path(), &target)?;
+
+        assert_eq!(target.read_to_string("a/old")?, "old");
+        assert_eq!(target.read_to_string("a/new")?, "new");
+        assert_eq!(target.read_to_string("replaced")?, "changed");
+        // The other link of the replaced file must be untouched
+        assert_eq!(target.read_to_string("hardlink")?, "orig");
+        assert_eq!(target.read_to_string("b/c/file")?, "file");
+        assert_eq!(target.read_to_string("dir-replaced")?, "now a file");
+        assert!(!upper_dir.try_exists("replaced")?);
+        Ok(())
+    }
+}
@@ -268,7 +268,7 @@ fn postprocess_useradd(rootfs_dfd: &cap_std::fs::Dir) -> Result<()> {
     Ok(())
 }
 
-fn is_overlay_whiteout(meta: &cap_std::fs::Metadata) -> bool {
+pub(crate) fn is_overlay_whiteout(meta: &cap_std::fs::Metadata) -> bool {
     (meta.mode() & libc::S_IFMT) == libc::S_IFCHR && meta.rdev() == 0
 }
 
@@ -103,6 +103,9 @@ struct MappingBuilder {
 
     /// Size according to RPM database
     rpmsize: u64,
+
+    /// Packages owning each path, read from the RPM database up front
+    file_owners: HashMap<Utf8PathBuf, Vec<Rc<str>>>,
 }
 
 impl MappingBuilder {
@@ -155,7 +158,16 @@ fn build_mapping_recurse(
                     continue;
                 }
 
-                let mut pkgs = ts.packages_providing_file(path.as_str())?;
+                // Fall back to the database for anything not in a package file list,
+                // e.g. paths that are only a Provides.
+                let mut pkgs = match state.file_owners.get(path.as_path()) {
+                    Some(owners) => owners.clone(),
+                    None => ts
+                        .packages_providing_file(path.as_str())?
+                        .into_iter()
+                        .map(|v| Rc::from(v.into_boxed_str()))
+                        .collect(),
+                };
                 // Let's be deterministic (but _unstable because we don't care about behavior of equal strings)
                 pkgs.sort_unstable();
                 // For now, we pick the alphabetically first package providing a file
@@ -164,7 +176,7 @@ fn build_mapping_recurse(
                     .next()
                     .map(|v| -> Result<_> {
                         // Safety: we should have the package in metadata
-                        let meta = state.packagemeta.get(v.as_str()).ok_or_else(|| {
+                        let meta = state.packagemeta.get(&*v).ok_or_else(|| {
                             anyhow::anyhow!("Internal error: missing pkgmeta for {}", &v)
                         })?;
                         Ok(Rc::clone(&meta.identifier))
@@ -258,6 +270,7 @@ pub fn container_encapsulate(args: Vec<String>) -> CxxResult<()> {
         multi_provider: Default::default(),
         skip: Default::default(),
         rpmsize: Default::default(),
+        file_owners: Default::default(),
     };
     // Insert metadata for unpackaged content.
     state.packagemeta.insert(ObjectSourceMeta {
@@ -294,6 +307,13 @@ pub fn container_encapsulate(args: Vec<String>) -> CxxResult<()> {
             highest_change_time = Some(pkgmeta.buildtime())
         }
         state.rpmsize += pkgmeta.size();
+        for path in q.package_files(name)? {
+            state
+                .file_owners
+                .entry(Utf8PathBuf::from(path))
+                .or_default()
+                .push(Rc::clone(&nevra));
+        }
         package_meta.insert(nevra, pkgmeta);
     }
 
@@ -3,6 +3,7 @@
 // SPDX-License-Identifier: Apache-2.0 OR MIT
 
 use anyhow::{bail, Context, Result};
+use ini::Ini;
 use os_release::OsRelease;
 use std::path;
 
@@ -14,6 +15,53 @@ mod repo;
 /// Default variant name used in User Agent
 const DEFAULT_VARIANT_ID: &str = "unknown";
 
+/// The daemon config, whose `Countme=` key has the daemon send the Count Me
+/// flag with its own metadata fetches instead
+const DAEMON_CONFIG: &str = "/etc/rpm-ostreed.conf";
+
+/// Returns true if the daemon does the counting; see `DAEMON_CONFIG`
+fn daemon_counts() -> bool {
+    Ini::load_from_file(DAEMON_CONFIG)
+        .ok()
+        .and_then(|i| i.get_from(Some("Daemon"), "Countme").map(repo::is_true))
+        .unwrap_or(false)
+}
+
+/// The User Agent to count with. The format is:
+/// libdnf (NAME VERSION_ID; VARIANT_ID; OS.BASEARCH)
+/// libdnf (Fedora 31; server; Linux.x86_64)
+/// See `user_agent` option in:
+/// https://dnf.readthedocs.io/en/latest/conf_ref.html?highlight=user_agent#options-for-both-main-and-repo
+fn user_agent(release: &OsRelease) -> String {
+    let variant: &str = release
+        .extra
+        .get("VARIANT_ID")
+        .map_or(DEFAULT_VARIANT_ID, |s| s);
+    format!(
+        "rpm-ostree ({} {}; {}; {}.{})",
+        release.name,
+        release.version_id,
+        variant,
+        "Linux",
+        std::env::consts::ARCH
+    )
+}
+
+/// The IDs of the repos to count with, for the daemon. It leaves the counting
+/// windows to libdnf, which sends the flag at most once per window per repo.
+pub(crate) fn countme_repo_ids() -> Result<Vec<String>> {
+    Ok(self::repo::all()?
+        .into_iter()
+        .filter(|r| r.count_me())
+        .map(|r| r.id().to_string())
+        .collect())
+}
+
+/// The User Agent for the daemon's metadata fetches when counting
+pub(crate) fn countme_user_agent() -> Result<String> {
+    Ok(user_agent(&OsRelease::new()?))
+}
+
 /// Send a request to 'url' with 'ua' as User Agent.
 /// This sends a GET request and discards the body as this is what is currently
 /// expected on the Fedora infrastructure side.
@@ -44,6 +92,11 @@ pub fn entrypoint(_args: &[&str]) -> Result<()> {
         bail!("Must run under an unprivileged user");
     }
 
+    if daemon_counts() {
+        println!("Skipping: Counted by rpm-ostreed with its metadata fetches");
+        return Ok(());
+    }
+
     // Load repo configs and keep only those enabled, with a metalink and countme=1
     let repos: Vec<_> = self::repo::all()?
         .into_iter()
@@ -65,24 +118,7 @@ pub fn entrypoint(_args: &[&str]) -> Result<()> {
 
     // Read /etc/os-release
     let release: OsRelease = OsRelease::new()?;
-    let variant: &str = release
-        .extra
-        .get("VARIANT_ID")
-        .map_or(DEFAULT_VARIANT_ID, |s| s);
-
-    // Setup User Agent. The format is:
-    // libdnf (NAME VERSION_ID; VARIANT_ID; OS.BASEARCH)
-    // libdnf (Fedora 31; server; Linux.x86_64)
-    // See `user_agent` option in:
-    // https://dnf.readthedocs.io/en/latest/conf_ref.html?highlight=user_agent#options-for-both-main-and-repo
-    let ua = format!(
-        "rpm-ostree ({} {}; {}; {}.{})",
-        release.name,
-        release.version_id,
-        variant,
-        "Linux",
-        std::env::consts::ARCH
-    );
+    let ua = user_agent(&release);
     println!("Using User Agent: {}", ua);
 
     // Compute the value to send as window counter
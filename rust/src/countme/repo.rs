@@ -18,13 +18,14 @@ pub const YUM_REPOS_D: &str = "/etc/yum.repos.d";
 pub struct Repo {
     // Not needed right now
     // name: String,
+    id: String,
     enabled: bool,
     count_me: bool,
     meta_link: String,
 }
 
 /// From https://github.com/rpm-software-management/libdnf/blob/45981d5f53980dac362900df65bcb2652aa8d7c7/libdnf/conf/OptionBool.hpp#L30-L31
-fn is_true(string: &str) -> bool {
+pub(crate) fn is_true(string: &str) -> bool {
     string == "1" || string == "yes" || string == "true" || string == "on"
 }
 
@@ -59,7 +60,8 @@ fn parse_repo_file(path: &PathBuf) -> Result<Vec<Repo>> {
             None => {
                 continue;
             }
-            Some(_s) => Repo {
+            Some(s) => Repo {
+                id: s.to_string(),
                 enabled: false,
                 count_me: false,
                 meta_link: "".to_string(),
@@ -87,6 +89,11 @@ fn parse_repo_file(path: &PathBuf) -> Result<Vec<Repo>> {
 }
 
 impl Repo {
+    /// The repo ID, i.e. the name of its section
+    pub fn id(&self) -> &str {
+        &self.id
+    }
+
     /// Returns true if this repo is
     /// - enabled
     /// - configured for sending a Count Me request
@@ -27,6 +27,11 @@
 //! `HistoryEntry` if the system booted into the same deployment multiple times
 //! in a row.
 //!
+//! The GVariants are appended to a log in that directory, with the pkglists
+//! stored once per commit rather than in every entry; see
+//! `rpmostree-history-log.h` for the format. Older deployments each have
+//! their own GVariant file instead.
+//!
 //! The algorithm is streaming, i.e. it yields entries as it finds them, rather
 //! than scanning the whole journal upfront. This can then be e.g. piped through
 //! a pager, stopped after N entries, etc...
@@ -38,9 +43,12 @@ use crate::ffi::HistoryEntry;
 use anyhow::{anyhow, Result};
 use cap_std::fs::{Dir, FileType};
 use cap_std_ext::cap_std;
+use cap_std_ext::prelude::CapStdExtDirExt;
 use fn_error_context::context;
-use std::collections::VecDeque;
+use std::collections::{HashMap, VecDeque};
+use std::io::Write;
 use std::ops::Deref;
+use std::os::unix::fs::FileExt;
 use std::path::Path;
 use systemd::journal::JournalRecord;
 
@@ -56,6 +64,18 @@ static RPMOSTREE_DEPLOY_MSG: &str = "9bddbda177cd44d891b1b561a8a0ce9e";
 
 static RPMOSTREE_HISTORY_DIR: &str = "/var/lib/rpm-ostree/history";
 
+// The history log; keep in sync with rpmostree-history-log.h
+static HISTORY_INDEX: &str = "index";
+const HISTORY_INDEX_MAGIC: &[u8; 8] = b"RPMOHIX\0";
+const HISTORY_INDEX_VERSION: u32 = 1;
+const HISTORY_INDEX_HEADER_SIZE: usize = 24;
+const HISTORY_INDEX_ENTRY_SIZE: usize = 96;
+/// The record offsets in an index entry: the deployment, then its pkglists.
+const HISTORY_INDEX_ENTRY_OFFSETS: std::ops::Range<usize> = 1..4;
+const HISTORY_RECORD_MAGIC: u32 = 0x52485231;
+const HISTORY_RECORD_HEADER_SIZE: usize = 16;
+const HISTORY_NO_RECORD: u64 = u64::MAX;
+
 /// Context object used to iterate through `HistoryEntry` events.
 // TODO use https://crates.io/crates/derivative to skip journal field
 #[allow(missing_debug_implementations)]
@@ -174,9 +194,92 @@ fn history_get_oldest_deployment_msg_timestamp() -> Result<Option<u64>> {
     Ok(None)
 }
 
+fn history_log_name(generation: u64) -> String {
+    format!("log.{}", generation)
+}
+
+fn read_le_u64(buf: &[u8], field: usize) -> u64 {
+    u64::from_le_bytes(buf[field * 8..(field + 1) * 8].try_into().unwrap())
+}
+
+/// Reads the record at `offset` in `log`, header included, as is.
+fn read_history_record(log: &std::fs::File, offset: u64) -> Result<Vec<u8>> {
+    let mut header = [0u8; HISTORY_RECORD_HEADER_SIZE];
+    log.read_exact_at(&mut header, offset)?;
+    if u32::from_le_bytes(header[0..4].try_into().unwrap()) != HISTORY_RECORD_MAGIC {
+        return Err(anyhow!("Invalid history record at offset {}", offset));
+    }
+    let compressed_size = u32::from_le_bytes(header[8..12].try_into().unwrap()) as usize;
+    let mut record = vec![0u8; HISTORY_RECORD_HEADER_SIZE + compressed_size];
+    log.read_exact_at(&mut record, offset)?;
+    Ok(record)
+}
+
+/// Drops the history log entries for deployments older than `oldest_ts`. Since the log is
+/// append-only, the records still in use are copied to the next generation of it, which the
+/// new index then points to. Returns the name of the log in use, or `None` if there's no
+/// valid index.
+fn history_log_compact(dir: &Dir, oldest_ts: u64) -> Result<Option<String>> {
+    if !dir.exists(HISTORY_INDEX) {
+        return Ok(None);
+    }
+    let index = dir.read(HISTORY_INDEX)?;
+    if index.len() < HISTORY_INDEX_HEADER_SIZE
+        || &index[0..8] != HISTORY_INDEX_MAGIC
+        || u32::from_le_bytes(index[8..12].try_into().unwrap()) != HISTORY_INDEX_VERSION
+    {
+        return Ok(None);
+    }
+    let generation = read_le_u64(&index, 2);
+    let log_name = history_log_name(generation);
+
+    // Like the C side, this ignores a trailing partial entry
+    let entries = index[HISTORY_INDEX_HEADER_SIZE..].chunks_exact(HISTORY_INDEX_ENTRY_SIZE);
+    let n_entries = entries.len();
+    let kept: Vec<&[u8]> = entries.filter(|e| read_le_u64(e, 0) >= oldest_ts).collect();
+    if kept.len() == n_entries {
+        return Ok(Some(log_name));
+    }
+
+    let new_generation = generation + 1;
+    let new_log_name = history_log_name(new_generation);
+    let old_log = dir.open(&log_name)?.into_std();
+    let mut new_log = std::io::BufWriter::new(dir.create(&new_log_name)?.into_std());
+    let mut new_end = 0u64;
+    // Pkglists are shared between entries, so only copy each once
+    let mut moved = HashMap::<u64, u64>::new();
+    let mut new_index = index[..HISTORY_INDEX_HEADER_SIZE].to_vec();
+    new_index[16..24].copy_from_slice(&new_generation.to_le_bytes());
+    for entry in kept {
+        let mut entry = entry.to_vec();
+        for field in HISTORY_INDEX_ENTRY_OFFSETS {
+            let offset = read_le_u64(&entry, field);
+            if offset == HISTORY_NO_RECORD {
+                continue;
+            }
+            let new_offset = match moved.get(&offset) {
+                Some(&new_offset) => new_offset,
+                None => {
+                    let record = read_history_record(&old_log, offset)?;
+                    new_log.write_all(&record)?;
+                    let new_offset = new_end;
+                    new_end += record.len() as u64;
+                    moved.insert(offset, new_offset);
+                    new_offset
+                }
+            };
+            entry[field * 8..(field + 1) * 8].copy_from_slice(&new_offset.to_le_bytes());
+        }
+        new_index.extend_from_slice(&entry);
+    }
+    new_log.into_inner()?.sync_all()?;
+    dir.atomic_write(HISTORY_INDEX, &new_index)?;
+    Ok(Some(new_log_name))
+}
+
 /// Gets the oldest deployment message in the journal, and nuke all the GVariant data files
-/// that correspond to deployments older than that one. Essentially, this binds pruning to
-/// journal pruning.
+/// and history log entries that correspond to deployments older than that one. Essentially,
+/// this binds pruning to journal pruning.
 #[context("Failed to prune history")]
 pub(crate) fn history_prune() -> CxxResult<()> {
     if !Path::new(RPMOSTREE_HISTORY_DIR).exists() {
@@ -187,10 +290,19 @@ pub(crate) fn history_prune() -> CxxResult<()> {
     // Cleanup any entry older than the oldest entry in the journal. Also nuke anything else that
     // doesn't belong here; we own this dir.
     let dir = Dir::open_ambient_dir(RPMOSTREE_HISTORY_DIR, cap_std::ambient_authority())?;
+    let log_name = match oldest_timestamp {
+        Some(oldest_ts) => history_log_compact(&dir, oldest_ts)?,
+        None => None,
+    };
     for entry in dir.entries()? {
         let entry = entry?;
         let ftype = entry.file_type()?;
         let fname = entry.file_name();
+        if let Some(log_name) = log_name.as_deref() {
+            if ftype == FileType::file() && (fname == HISTORY_INDEX || fname == log_name) {
+                continue;
+            }
+        }
         if let Some(oldest_ts) = oldest_timestamp {
             if ftype == FileType::file() {
                 if let Some(ts) = map_to_u64(fname.to_str().as_ref()) {
@@ -708,4 +820,67 @@ mod tests {
         ctx.assert_next_entry(2, 2, 1, 1);
         ctx.assert_eof();
     }
+
+    fn history_record(payload: &[u8]) -> Vec<u8> {
+        let mut record = HISTORY_RECORD_MAGIC.to_le_bytes().to_vec();
+        record.extend_from_slice(&(payload.len() as u32).to_le_bytes());
+        record.extend_from_slice(&(payload.len() as u32).to_le_bytes());
+        record.extend_from_slice(&[0u8; 4]);
+        record.extend_from_slice(payload);
+        record
+    }
+
+    fn history_index_entry(ts: u64, offsets: [u64; 3]) -> Vec<u8> {
+        let mut entry = ts.to_le_bytes().to_vec();
+        for offset in offsets {
+            entry.extend_from_slice(&offset.to_le_bytes());
+        }
+        entry.resize(HISTORY_INDEX_ENTRY_SIZE, 0);
+        entry
+    }
+
+    #[test]
+    fn test_history_log_compact() -> Result<()> {
+        let td = cap_std_ext::cap_tempfile::tempdir(cap_std::ambient_authority())?;
+        assert_eq!(history_log_compact(&td, 0)?, None);
+
+        let pkglist = history_record(b"pkglist");
+        let deploy1 = history_record(b"deploy1");
+        let deploy2 = history_record(b"deploy2");
+        let log = [&pkglist[..], &deploy1[..], &deploy2[..]].concat();
+        let (pkglist_offset, deploy1_offset) = (0, pkglist.len() as u64);
+        let deploy2_offset = deploy1_offset + deploy1.len() as u64;
+        td.write("log.0", &log)?;
+        let mut index = HISTORY_INDEX_MAGIC.to_vec();
+        index.extend_from_slice(&HISTORY_INDEX_VERSION.to_le_bytes());
+        index.extend_from_slice(&[0u8; 12]);
+        index.extend(history_index_entry(
+            10,
+            [deploy1_offset, pkglist_offset, HISTORY_NO_RECORD],
+        ));
+        index.extend(history_index_entry(
+            20,
+            [deploy2_offset, pkglist_offset, HISTORY_NO_RECORD],
+        ));
+        td.write(HISTORY_INDEX, &index)?;
+
+        // Nothing to drop
+        assert_eq!(history_log_compact(&td, 10)?.as_deref(), Some("log.0"));
+        assert_eq!(td.read(HISTORY_INDEX)?, index);
+
+        assert_eq!(history_log_compact(&td, 15)?.as_deref(), Some("log.1"));
+        let index = td.read(HISTORY_INDEX)?;
+        assert_eq!(read_le_u64(&index, 2), 1);
+        assert_eq!(
+            index.len(),
+            HISTORY_INDEX_HEADER_SIZE + HISTORY_INDEX_ENTRY_SIZE
+        );
+        let entry = &index[HISTORY_INDEX_HEADER_SIZE..];
+        assert_eq!(read_le_u64(entry, 0), 20);
+        let log = td.open("log.1")?.into_std();
+        assert_eq!(read_history_record(&log, read_le_u64(entry, 1))?, deploy2);
+        assert_eq!(read_history_record(&log, read_le_u64(entry, 2))?, pkglist);
+        assert_eq!(read_le_u64(entry, 3), HISTORY_NO_RECORD);
+        Ok(())
+    }
 }
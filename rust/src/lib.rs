@@ -148,6 +148,10 @@ pub mod ffi {
         fn setup_compat_var(&mut self) -> Result<()>;
 
         fn run(&mut self, cancellable: &GCancellable) -> Result<()>;
+
+        type BubblewrapSession;
+        fn bubblewrap_session_new(rootfs_fd: i32) -> Result<Box<BubblewrapSession>>;
+        fn new_bwrap(&mut self, mutability: BubblewrapMutability) -> Result<Box<Bubblewrap>>;
     }
 
     // builtins/apply_live.rs
@@ -360,6 +364,12 @@ pub mod ffi {
         value: String,
     }
 
+    // countme.rs
+    extern "Rust" {
+        fn countme_repo_ids() -> Result<Vec<String>>;
+        fn countme_user_agent() -> Result<String>;
+    }
+
     // daemon.rs
     extern "Rust" {
         fn daemon_sanitycheck_environment(sysroot: &OstreeSysroot) -> Result<()>;
@@ -510,6 +520,7 @@ pub mod ffi {
     // scripts.rs
     extern "Rust" {
         fn script_is_ignored(pkg: &str, script: &str) -> bool;
+        fn script_deferred_command(interp: &str, script: &str) -> String;
     }
 
     // testutils.rs
@@ -619,6 +630,7 @@ pub mod ffi {
         fn get_container(&self) -> bool;
         fn get_machineid_compat(&self) -> bool;
         fn get_etc_group_members(&self) -> Vec<String>;
+        fn get_parallel_post_scripts(&self) -> Vec<String>;
         fn get_boot_location_is_modules(&self) -> bool;
         fn get_ima(&self) -> bool;
         fn get_releasever(&self) -> String;
@@ -627,6 +639,7 @@ pub mod ffi {
         fn should_normalize_rpmdb(&self) -> bool;
         fn get_files_remove_regex(&self, package: &str) -> Vec<String>;
         fn get_checksum(&self, repo: &OstreeRepo) -> Result<String>;
+        fn get_install_checksum(&self, repo: &OstreeRepo) -> Result<String>;
         fn get_ostree_ref(&self) -> String;
         fn get_repo_packages(&self) -> &[RepoPackage];
         fn clear_repo_packages(&mut self);
@@ -746,6 +759,7 @@ pub mod ffi {
         type PasswdEntries;
         fn add_group_content(self: &mut PasswdEntries, rootfs: i32, path: &str) -> Result<()>;
         fn add_passwd_content(self: &mut PasswdEntries, rootfs: i32, path: &str) -> Result<()>;
+        fn refresh(self: &mut PasswdEntries, rootfs: i32) -> Result<()>;
         fn contains_group(self: &PasswdEntries, user: &str) -> bool;
         fn contains_user(self: &PasswdEntries, user: &str) -> bool;
         fn lookup_user_id(self: &PasswdEntries, user: &str) -> Result<u32>;
@@ -854,6 +868,15 @@ pub mod ffi {
             dest: &CxxString,
             allow_noent: bool,
         ) -> Result<UniquePtr<RPMDiff>>;
+        #[allow(missing_debug_implementations)]
+        type RPMDiffList;
+        fn len(&self) -> usize;
+        fn get(&self, i: usize) -> &RPMDiff;
+        fn rpmdb_diff_series(
+            repo: &OstreeRepo,
+            revs: &Vec<String>,
+            allow_noent: bool,
+        ) -> Result<UniquePtr<RPMDiffList>>;
 
         fn print(&self);
     }
@@ -907,6 +930,7 @@ pub mod ffi {
 
         // Methods on RpmTs
         fn packages_providing_file(self: &RpmTs, path: &str) -> Result<Vec<String>>;
+        fn package_files(self: &RpmTs, name: &str) -> Result<Vec<String>>;
         fn package_meta(self: &RpmTs, name: &str) -> Result<UniquePtr<PackageMeta>>;
 
         // Methods on PackageMeta
@@ -945,6 +969,7 @@ pub(crate) use compose::*;
 mod composepost;
 pub mod countme;
 pub(crate) use composepost::*;
+pub(crate) use countme::{countme_repo_ids, countme_user_agent};
 mod core;
 use crate::core::*;
 mod capstdext;
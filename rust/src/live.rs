@@ -22,6 +22,7 @@ use ostree_ext::diff::FileTreeDiff;
 use ostree_ext::{gio, glib, ostree};
 use rayon::prelude::*;
 use std::borrow::Cow;
+use std::ffi::CString;
 use std::os::unix::io::AsRawFd;
 use std::path::{Path, PathBuf};
 
@@ -120,6 +121,122 @@ fn subpath(diff: &FileTreeDiff, p: &Path) -> Option<PathBuf> {
     }
 }
 
+/// A regular file from the target commit that we copy into place directly
+/// from its object, rather than through a checkout.
+#[derive(Debug)]
+struct FileCopy {
+    /// Destination, relative to the target directory
+    path: PathBuf,
+    /// Path of the content object, relative to the repository
+    object: String,
+    uid: u32,
+    gid: u32,
+    mode: u32,
+    xattrs: Vec<(CString, Vec<u8>)>,
+}
+
+/// Look up the content objects of the regular files among `paths` in `commit`.
+/// This only reads the dirtree objects, not the deployment. Any other paths
+/// (e.g. symlinks) are returned separately, to go through a checkout.
+fn plan_file_copies<'a>(
+    repo: &ostree::Repo,
+    diff: &FileTreeDiff,
+    commit: &str,
+    paths: impl Iterator<Item = &'a String>,
+) -> Result<(Vec<FileCopy>, Vec<&'a String>)> {
+    let cancellable = gio::Cancellable::NONE;
+    let (root, _) = repo.read_commit(commit, cancellable)?;
+    let mut copies = Vec::new();
+    let mut others = Vec::new();
+    for p in paths {
+        let sub = subpath(diff, Path::new(p)).expect("subpath");
+        let sub = sub.strip_prefix("/").unwrap_or(&sub);
+        let f = root.resolve_relative_path(sub);
+        let f = f.downcast_ref::<ostree::RepoFile>().expect("repofile");
+        f.ensure_resolved()?;
+        let checksum = f.checksum();
+        let (_, info, xattrs) = repo.load_file(&checksum, cancellable)?;
+        let info = info.expect("fileinfo");
+        if info.file_type() != gio::FileType::Regular {
+            others.push(p);
+            continue;
+        }
+        let xattrs = xattrs
+            .map(|v| {
+                v.iter()
+                    .map(|x| -> Result<_> {
+                        let name = x.child_value(0);
+                        let name = name.data().split(|&b| b == 0).next().unwrap_or_default();
+                        let value = x.child_value(1).data().to_vec();
+                        Ok((CString::new(name)?, value))
+                    })
+                    .collect::<Result<Vec<_>>>()
+            })
+            .transpose()?
+            .unwrap_or_default();
+        copies.push(FileCopy {
+            path: Path::new(p).strip_prefix("/")?.to_path_buf(),
+            object: format!("objects/{}/{}.file", &checksum[..2], &checksum[2..]),
+            uid: info.attribute_uint32("unix::uid"),
+            gid: info.attribute_uint32("unix::gid"),
+            mode: info.attribute_uint32("unix::mode"),
+            xattrs,
+        });
+    }
+    Ok((copies, others))
+}
+
+/// Copy a file's content from `src` to `dest`, as a reflink if possible.
+fn copy_file_contents(src: &cap_std::fs::File, dest: &mut cap_std::fs::File) -> Result<()> {
+    use rustix::io::Errno;
+    if rustix::fs::ioctl_ficlone(&*dest, src).is_ok() {
+        return Ok(());
+    }
+    let mut remaining = src.metadata()?.len();
+    let mut copied = false;
+    while remaining > 0 {
+        let chunk = remaining.min(1 << 30) as usize;
+        match rustix::fs::copy_file_range(src, None, &*dest, None, chunk) {
+            Ok(0) => anyhow::bail!("Unexpected EOF"),
+            Ok(n) => {
+                remaining -= n as u64;
+                copied = true;
+            }
+            // Not supported between these filesystems; do it the slow way
+            Err(e) if !copied && [Errno::XDEV, Errno::INVAL, Errno::NOSYS].contains(&e) => {
+                std::io::copy(&mut &*src, dest)?;
+                return Ok(());
+            }
+            Err(e) => return Err(e.into()),
+        }
+    }
+    Ok(())
+}
+
+/// Write `f` into place under `destdir`, replacing any existing file.
+fn copy_file(repodir: &Dir, destdir: &Dir, f: &FileCopy) -> Result<()> {
+    use nix::sys::stat::{fchmod, Mode};
+    use nix::unistd::{fchown, Gid, Uid};
+    let src = repodir.open(&f.object)?;
+    let parent = match f.path.parent() {
+        Some(p) if !p.as_os_str().is_empty() => destdir.open_dir(p)?,
+        _ => destdir.try_clone()?,
+    };
+    let name = f.path.file_name().expect("filename");
+    let mut tmpf = cap_std_ext::cap_tempfile::TempFile::new(&parent)?;
+    copy_file_contents(&src, &mut tmpf)?;
+    let fd = tmpf.as_raw_fd();
+    fchown(fd, Some(Uid::from_raw(f.uid)), Some(Gid::from_raw(f.gid)))?;
+    // After the chown, which would drop setuid bits
+    fchmod(fd, Mode::from_bits_truncate(f.mode & 0o7777))?;
+    for (k, v) in f.xattrs.iter() {
+        rustix::fs::fsetxattr(&*tmpf, k.as_c_str(), v, rustix::fs::XattrFlags::empty())
+            .with_context(|| format!("Setting xattr {:?}", k))?;
+    }
+    tmpf.replace(name)?;
+    Ok(())
+}
+
 /// Given a diff, apply it to the target directory, which should be a checkout of the source commit.
 fn apply_diff(repo: &ostree::Repo, diff: &FileTreeDiff, commit: &str, destdir: &Dir) -> Result<()> {
     if !diff.changed_dirs.is_empty() {
@@ -140,19 +257,21 @@ fn apply_diff(repo: &ostree::Repo, diff: &FileTreeDiff, commit: &str, destdir: &
         repo.checkout_at(Some(&opts), destdir.as_raw_fd(), t, commit, cancellable)
             .with_context(|| format!("Checking out added dir {:?}", d))?;
     }
-    for d in diff.added_files.iter().map(Path::new) {
-        opts.subpath = subpath(diff, d);
-        repo.checkout_at(
-            Some(&opts),
-            destdir.as_raw_fd(),
-            relpath_dir(d)?,
-            commit,
-            cancellable,
-        )
-        .with_context(|| format!("Checking out added file {:?}", d))?;
-    }
-    // Changed files in existing directories
-    for d in diff.changed_files.iter().map(Path::new) {
+    // Added files, and changed files in existing directories. In a bare repo
+    // the regular files are copied straight from their objects in parallel,
+    // as reflinks where the filesystem supports it; everything else goes
+    // through a checkout of its own.
+    let files = diff.added_files.iter().chain(diff.changed_files.iter());
+    let (copies, others) = if repo.mode() == ostree::RepoMode::Bare {
+        plan_file_copies(repo, diff, commit, files)?
+    } else {
+        (Vec::new(), files.collect())
+    };
+    let repodir = Dir::reopen_dir(unsafe { &rustix::fd::BorrowedFd::borrow_raw(repo.dfd()) })?;
+    copies.par_iter().try_for_each(|f| {
+        copy_file(&repodir, destdir, f).with_context(|| format!("Copying file {:?}", f.path))
+    })?;
+    for d in others.into_iter().map(Path::new) {
         opts.subpath = subpath(diff, d);
         repo.checkout_at(
             Some(&opts),
@@ -161,7 +280,7 @@ fn apply_diff(repo: &ostree::Repo, diff: &FileTreeDiff, commit: &str, destdir: &
             commit,
             cancellable,
         )
-        .with_context(|| format!("Checking out changed file {:?}", d))?;
+        .with_context(|| format!("Checking out file {:?}", d))?;
     }
     assert!(diff.changed_dirs.is_empty());
 
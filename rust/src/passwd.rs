@@ -741,6 +741,37 @@ impl PasswdDB {
 pub struct PasswdEntries {
     users: BTreeMap<String, (Uid, Gid)>,
     groups: BTreeMap<String, Gid>,
+    /// Files the entries were loaded from, see `refresh()`.
+    sources: Vec<PasswdSource>,
+}
+
+/// A `passwd` or `group` file loaded into `PasswdEntries`.
+#[derive(Debug)]
+struct PasswdSource {
+    path: String,
+    is_group: bool,
+    stamp: FileStamp,
+}
+
+/// What we compare to tell whether a file changed since it was parsed;
+/// shadow-utils replaces the files by renaming, which changes the inode.
+#[derive(Debug, PartialEq, Eq)]
+struct FileStamp {
+    dev: u64,
+    ino: u64,
+    size: u64,
+    mtime: (i64, i64),
+}
+
+impl FileStamp {
+    fn new(meta: &cap_std::fs::Metadata) -> Self {
+        Self {
+            dev: meta.dev(),
+            ino: meta.ino(),
+            size: meta.len(),
+            mtime: (meta.mtime(), meta.mtime_nsec()),
+        }
+    }
 }
 
 /// Create a new empty DB.
@@ -752,28 +783,62 @@ impl PasswdEntries {
     /// Add all groups from a given `group` file.
     pub fn add_group_content(&mut self, rootfs_dfd: i32, group_path: &str) -> CxxResult<()> {
         let rootfs = unsafe { crate::ffiutil::ffi_dirfd(rootfs_dfd)? };
-        let db = rootfs.open(group_path).map(BufReader::new)?;
-        let entries = nameservice::group::parse_group_content(db)?;
-
-        for group in entries {
-            let id = Gid::from_raw(group.gid);
-            self.groups.insert(group.name, id);
-        }
+        let stamp = self.load_file(rootfs.open(group_path)?, true)?;
+        self.sources.push(PasswdSource {
+            path: group_path.to_string(),
+            is_group: true,
+            stamp,
+        });
         Ok(())
     }
 
     /// Add all users from a given `passwd` file.
     pub fn add_passwd_content(&mut self, rootfs_dfd: i32, passwd_path: &str) -> CxxResult<()> {
         let rootfs = unsafe { crate::ffiutil::ffi_dirfd(rootfs_dfd)? };
-        let db = rootfs.open(passwd_path).map(BufReader::new)?;
-        let entries = nameservice::passwd::parse_passwd_content(db)?;
+        let stamp = self.load_file(rootfs.open(passwd_path)?, false)?;
+        self.sources.push(PasswdSource {
+            path: passwd_path.to_string(),
+            is_group: false,
+            stamp,
+        });
+        Ok(())
+    }
 
-        for user in entries {
-            let uid = Uid::from_raw(user.uid);
-            let gid = Gid::from_raw(user.gid);
-            self.users.insert(user.name, (uid, gid));
+    /// Reparse the files added so far which changed since, e.g. because a
+    /// scriptlet created users or groups in them. Entries are only ever added
+    /// or updated, as scriptlets don't remove any.
+    pub fn refresh(&mut self, rootfs_dfd: i32) -> CxxResult<()> {
+        let rootfs = unsafe { crate::ffiutil::ffi_dirfd(rootfs_dfd)? };
+        let mut sources = std::mem::take(&mut self.sources);
+        let r = sources.iter_mut().try_for_each(|source| -> Result<()> {
+            let f = match rootfs.open_optional(&source.path)? {
+                Some(f) => f,
+                None => return Ok(()),
+            };
+            if FileStamp::new(&f.metadata()?) != source.stamp {
+                source.stamp = self.load_file(f, source.is_group)?;
+            }
+            Ok(())
+        });
+        self.sources = sources;
+        Ok(r?)
+    }
+
+    /// Parse a `passwd` or `group` file into the entries, returning its stamp.
+    fn load_file(&mut self, f: cap_std::fs::File, is_group: bool) -> Result<FileStamp> {
+        let stamp = FileStamp::new(&f.metadata()?);
+        let db = BufReader::new(f);
+        if is_group {
+            for group in nameservice::group::parse_group_content(db)? {
+                self.groups.insert(group.name, Gid::from_raw(group.gid));
+            }
+        } else {
+            for user in nameservice::passwd::parse_passwd_content(db)? {
+                let ids = (Uid::from_raw(user.uid), Gid::from_raw(user.gid));
+                self.users.insert(user.name, ids);
+            }
         }
-        Ok(())
+        Ok(stamp)
     }
 
     /// Check whether the given username exists among user entries.
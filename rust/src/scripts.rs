@@ -84,3 +84,197 @@ pub(crate) fn script_is_ignored(pkg: &str, script: &str) -> bool {
     let pkgscript = format!("{}.{}", pkg, script);
     IGNORED_PKG_SCRIPTS.contains(pkgscript.as_str())
 }
+
+/// Scripts which only regenerate a system-wide cache, and so give the same
+/// result however many times they run; if several packages have one as their
+/// `%post`, we only need to run it once after all of them.
+///
+/// Each entry is a program and the arguments it may have (any of `flags`,
+/// followed by exactly `args` or, if it ends with `/`, one path under it).
+struct DeferrableCommand {
+    programs: &'static [&'static str],
+    flags: &'static [&'static str],
+    args: &'static [&'static str],
+}
+
+static DEFERRABLE_COMMANDS: &[DeferrableCommand] = &[
+    DeferrableCommand {
+        programs: &["/sbin/ldconfig", "/usr/sbin/ldconfig", "ldconfig"],
+        flags: &[],
+        args: &[],
+    },
+    DeferrableCommand {
+        programs: &["/usr/bin/update-mime-database", "update-mime-database"],
+        flags: &["-n"],
+        args: &["/usr/share/mime"],
+    },
+    DeferrableCommand {
+        programs: &["/usr/bin/glib-compile-schemas", "glib-compile-schemas"],
+        flags: &[],
+        args: &["/usr/share/glib-2.0/schemas"],
+    },
+    DeferrableCommand {
+        programs: &["/usr/bin/gtk-update-icon-cache", "gtk-update-icon-cache"],
+        flags: &[
+            "-f",
+            "--force",
+            "-q",
+            "--quiet",
+            "-t",
+            "--ignore-theme-index",
+        ],
+        args: &["/usr/share/icons/"],
+    },
+];
+
+/// Trailing bits of a shell command which just silence it.
+static IGNORED_SUFFIXES: &[&str] = &[
+    ">/dev/null 2>&1",
+    "> /dev/null 2>&1",
+    "&>/dev/null",
+    "&> /dev/null",
+    "2>/dev/null",
+    "2> /dev/null",
+    ">/dev/null",
+    "> /dev/null",
+];
+
+fn deferrable_args_match(cmd: &DeferrableCommand, args: &[&str]) -> bool {
+    let n_flags = args.iter().take_while(|a| cmd.flags.contains(a)).count();
+    let rest = &args[n_flags..];
+    match cmd.args {
+        [dir] if dir.ends_with('/') => {
+            matches!(rest, [path] if path.len() > dir.len() && path.starts_with(dir)
+                && !path.contains(".."))
+        }
+        expected => rest == expected,
+    }
+}
+
+/// If the script given by `interp` and `script` is just one of the
+/// [`DEFERRABLE_COMMANDS`], returns it as a canonical shell command to run
+/// later; otherwise returns an empty string.
+pub(crate) fn script_deferred_command(interp: &str, script: &str) -> String {
+    let script = script.trim();
+    // `%post -p /sbin/ldconfig`; nothing else is commonly used this way
+    if script.is_empty() {
+        let ldconfig = &DEFERRABLE_COMMANDS[0];
+        if ldconfig.programs.contains(&interp) {
+            return interp.to_string();
+        }
+        return String::new();
+    }
+    if !matches!(
+        interp,
+        "/bin/sh" | "/usr/bin/sh" | "/bin/bash" | "/usr/bin/bash"
+    ) {
+        return String::new();
+    }
+    let mut lines = script
+        .lines()
+        .map(str::trim)
+        .filter(|l| !l.is_empty() && !l.starts_with('#'));
+    let mut line = match (lines.next(), lines.next()) {
+        (Some(line), None) => line,
+        _ => return String::new(),
+    };
+
+    let mut ignore_errors = false;
+    loop {
+        let prev = line;
+        for suffix in [":", "true"] {
+            if let Some(rest) = line.strip_suffix(suffix) {
+                if let Some(rest) = rest.trim_end().strip_suffix("||") {
+                    line = rest.trim_end();
+                    ignore_errors = true;
+                }
+            }
+        }
+        for suffix in IGNORED_SUFFIXES {
+            match line.strip_suffix(suffix) {
+                Some(rest) if rest.ends_with(char::is_whitespace) => line = rest.trim_end(),
+                _ => {}
+            }
+        }
+        if line == prev {
+            break;
+        }
+    }
+    // Anything else the shell would interpret means it's not a simple command
+    if line.contains(|c: char| ";&|<>$`'\"\\(){}*?[]~!".contains(c)) {
+        return String::new();
+    }
+
+    let words: Vec<&str> = line.split_whitespace().collect();
+    let (program, args) = match words.split_first() {
+        Some(v) => v,
+        None => return String::new(),
+    };
+    let matched = DEFERRABLE_COMMANDS
+        .iter()
+        .any(|cmd| cmd.programs.contains(program) && deferrable_args_match(cmd, args));
+    if !matched {
+        return String::new();
+    }
+    let mut r = words.join(" ");
+    if ignore_errors {
+        r.push_str(" || :");
+    }
+    r
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_script_deferred_command() {
+        let sh = "/bin/sh";
+        let cases = [
+            ("/sbin/ldconfig", "", "/sbin/ldconfig"),
+            (sh, "/sbin/ldconfig\n", "/sbin/ldconfig"),
+            (
+                sh,
+                "# comment\n\n  /usr/sbin/ldconfig  \n",
+                "/usr/sbin/ldconfig",
+            ),
+            (
+                sh,
+                "/usr/bin/update-mime-database -n /usr/share/mime &> /dev/null || :",
+                "/usr/bin/update-mime-database -n /usr/share/mime || :",
+            ),
+            (
+                sh,
+                "glib-compile-schemas /usr/share/glib-2.0/schemas >/dev/null 2>&1 || true",
+                "glib-compile-schemas /usr/share/glib-2.0/schemas || :",
+            ),
+            (
+                sh,
+                "gtk-update-icon-cache --force --quiet /usr/share/icons/hicolor",
+                "gtk-update-icon-cache --force --quiet /usr/share/icons/hicolor",
+            ),
+        ];
+        for (interp, script, expected) in cases {
+            assert_eq!(
+                script_deferred_command(interp, script),
+                expected,
+                "{script}"
+            );
+        }
+
+        let not_deferrable = [
+            ("/usr/bin/python3", "/sbin/ldconfig"),
+            ("/bin/echo", ""),
+            (sh, "/sbin/ldconfig\nrm -rf /var/foo"),
+            (sh, "/sbin/ldconfig /opt/lib"),
+            (sh, "/sbin/ldconfig; touch /etc/foo"),
+            (sh, "glib-compile-schemas $DIR"),
+            (sh, "gtk-update-icon-cache /usr/share/icons/"),
+            (sh, "gtk-update-icon-cache /usr/share/icons/../../etc"),
+            (sh, "if [ $1 -eq 1 ]; then /sbin/ldconfig; fi"),
+        ];
+        for (interp, script) in not_deferrable {
+            assert_eq!(script_deferred_command(interp, script), "", "{script}");
+        }
+    }
+}
@@ -452,6 +452,7 @@ fn treefile_merge(dest: &mut TreeComposeConfig, src: &mut TreeComposeConfig) {
         initramfs_args,
         units,
         etc_group_members,
+        parallel_post_scripts,
         postprocess,
         add_files,
         remove_files,
@@ -1372,6 +1373,14 @@ impl Treefile {
             .unwrap_or_default()
     }
 
+    pub(crate) fn get_parallel_post_scripts(&self) -> Vec<String> {
+        self.parsed
+            .base
+            .parallel_post_scripts
+            .clone()
+            .unwrap_or_default()
+    }
+
     pub(crate) fn get_ima(&self) -> bool {
         self.parsed.base.ima.unwrap_or(false)
     }
@@ -1559,7 +1568,37 @@ impl Treefile {
         let mut hasher = glib::Checksum::new(glib::ChecksumType::Sha256).unwrap();
         self.parsed.hasher_update(&mut hasher)?;
         self.externals.hasher_update(&mut hasher)?;
+        self.ostree_layers_hasher_update(repo, &mut hasher)?;
+        Ok(hasher.string().expect("hash"))
+    }
 
+    /// Like `get_checksum()`, but leaving out everything which is only used when
+    /// postprocessing the installed rootfs (`postprocess`, `add-files`, etc.),
+    /// so that it identifies the result of installing (and running scripts).
+    pub(crate) fn get_install_checksum(&self, repo: &crate::ffi::OstreeRepo) -> CxxResult<String> {
+        let repo = &repo.glib_reborrow();
+        let mut hasher = glib::Checksum::new(glib::ChecksumType::Sha256).unwrap();
+        let mut parsed = self.parsed.clone();
+        let base = &mut parsed.base;
+        base.postprocess_script = None;
+        base.postprocess = None;
+        base.add_files = None;
+        base.remove_files = None;
+        base.units = None;
+        base.default_target = None;
+        base.mutate_os_release = None;
+        base.add_commit_metadata = None;
+        parsed.hasher_update(&mut hasher)?;
+        self.externals.install_hasher_update(&mut hasher)?;
+        self.ostree_layers_hasher_update(repo, &mut hasher)?;
+        Ok(hasher.string().expect("hash"))
+    }
+
+    fn ostree_layers_hasher_update(
+        &self,
+        repo: &ostree::Repo,
+        hasher: &mut glib::Checksum,
+    ) -> Result<()> {
         let it = self.parsed.base.ostree_layers.iter().flat_map(|x| x.iter());
         let it = it.chain(
             self.parsed
@@ -1578,7 +1617,7 @@ impl Treefile {
             let content_checksum = content_checksum.as_str();
             hasher.update(content_checksum.as_bytes());
         }
-        Ok(hasher.string().expect("hash"))
+        Ok(())
     }
 
     /// Perform sanity checks on externally provided input, such
@@ -2032,6 +2071,17 @@ impl TreefileExternals {
         Ok(())
     }
 
+    /// The externals which affect installation; see `get_install_checksum()`.
+    fn install_hasher_update(&self, hasher: &mut glib::Checksum) -> Result<()> {
+        if let Some(ref f) = self.passwd {
+            hash_file(hasher, f)?;
+        }
+        if let Some(ref f) = self.group {
+            hash_file(hasher, f)?;
+        }
+        Ok(())
+    }
+
     // Panic if there is externally referenced data.
     fn assert_empty(&self) {
         // can't use the Default trick here because we can't auto-derive Eq because of `File`
@@ -2525,6 +2575,8 @@ pub(crate) struct BaseComposeConfigFields {
     pub(crate) initramfs_args: Option<Vec<String>>,
     #[serde(skip_serializing_if = "Option::is_none")]
     pub(crate) readonly_executables: Option<bool>,
+    #[serde(skip_serializing_if = "Option::is_none")]
+    pub(crate) parallel_post_scripts: Option<Vec<String>>,
 
     // Tree layout options
     #[serde(skip_serializing_if = "Option::is_none")]
@@ -3057,6 +3109,16 @@ pub(crate) mod tests {
         }
     }
 
+    #[test]
+    fn basic_valid_parallel_post_scripts() {
+        let tf = new_test_tf_basic(VALID_PRELUDE).unwrap();
+        assert!(tf.get_parallel_post_scripts().is_empty());
+        let mut buf = String::from(VALID_PRELUDE);
+        buf.push_str("parallel-post-scripts: [glib2, systemd]");
+        let tf = new_test_tf_basic(buf.as_str()).unwrap();
+        assert_eq!(tf.get_parallel_post_scripts(), vec!["glib2", "systemd"]);
+    }
+
     #[test]
     fn digest_changes() {
         let mut input = Cursor::new(VALID_PRELUDE);
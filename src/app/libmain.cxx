@@ -66,8 +66,8 @@ static RpmOstreeCommand commands[] = {
     "Switch to a different tree", rpmostree_builtin_rebase },
   { "rollback", static_cast<RpmOstreeBuiltinFlags> (0), "Revert to the previously booted tree",
     rpmostree_builtin_rollback },
-  { "status", static_cast<RpmOstreeBuiltinFlags> (0), "Get the version of the booted system",
-    rpmostree_builtin_status },
+  { "status", static_cast<RpmOstreeBuiltinFlags> (RPM_OSTREE_BUILTIN_FLAG_DIRECT_READ),
+    "Get the version of the booted system", rpmostree_builtin_status },
   { "upgrade", static_cast<RpmOstreeBuiltinFlags> (RPM_OSTREE_BUILTIN_FLAG_SUPPORTS_PKG_INSTALLS),
     "Perform a system upgrade", rpmostree_builtin_upgrade },
   { "update",
@@ -96,6 +96,8 @@ static RpmOstreeCommand commands[] = {
     rpmostree_builtin_kargs },
   { "initramfs-etc", (RpmOstreeBuiltinFlags)0, "Add files to the initramfs",
     rpmostree_builtin_initramfs_etc },
+  { "batch", (RpmOstreeBuiltinFlags)0, "Run a list of commands over one daemon session",
+    rpmostree_builtin_batch },
   /* Rust-implemented commands; they're here so that they show up in `rpm-ostree
    * --help` alongside the other commands, but the command itself is fully
    *  handled Rust side. */
@@ -172,6 +174,31 @@ static GOptionEntry pkg_entries[]
           "Remove overlayed additional package", "PKG" },
         { NULL } };
 
+/* With RPMOSTREE_STARTUP_TRACE set in the environment, we print how long each
+ * stage of startup took to stderr; see startup_trace(). */
+static gboolean startup_trace_enabled;
+static gint64 startup_trace_start;
+static gint64 startup_trace_last;
+
+static void
+startup_trace_init (void)
+{
+  startup_trace_enabled = g_getenv ("RPMOSTREE_STARTUP_TRACE") != NULL;
+  startup_trace_start = startup_trace_last = g_get_monotonic_time ();
+}
+
+/* Report the time since the previous stage as spent in @stage */
+static void
+startup_trace (const char *stage)
+{
+  if (!startup_trace_enabled)
+    return;
+  const gint64 now = g_get_monotonic_time ();
+  g_printerr ("startup: %-24s %8.3f ms (total %.3f ms)\n", stage,
+              (now - startup_trace_last) / 1000.0, (now - startup_trace_start) / 1000.0);
+  startup_trace_last = now;
+}
+
 static int
 cmp_by_name (const void *a, const void *b)
 {
@@ -289,6 +316,7 @@ rpmostree_option_context_parse (GOptionContext *context, const GOptionEntry *mai
 
   if (!g_option_context_parse (context, argc, argv, error))
     return FALSE;
+  startup_trace ("option parsing");
 
   if (opt_version)
     {
@@ -312,8 +340,15 @@ rpmostree_option_context_parse (GOptionContext *context, const GOptionEntry *mai
   if ((flags & RPM_OSTREE_BUILTIN_FLAG_REQUIRES_ROOT) > 0)
     ROSCXX_TRY (client_require_root (), error);
 
-  CXX_TRY_VAR (is_ostree_container, rpmostreecxx::is_ostree_container (), error);
+  /* Only look for a container if it would make a difference */
   bool container_capable = (flags & RPM_OSTREE_BUILTIN_FLAG_CONTAINER_CAPABLE) > 0;
+  bool is_ostree_container = false;
+  if (use_daemon && container_capable)
+    {
+      CXX_TRY_VAR (is_container, rpmostreecxx::is_ostree_container (), error);
+      is_ostree_container = is_container;
+      startup_trace ("container check");
+    }
   if (use_daemon && !(is_ostree_container && container_capable))
     {
       if (out_sysroot_proxy == NULL)
@@ -330,13 +365,28 @@ rpmostree_option_context_parse (GOptionContext *context, const GOptionEntry *mai
             return rpmostreecxx::client_throw_non_ostree_host_error (error);
         }
 
+      /* Root can read the booted sysroot without the daemon; in that case
+       * *out_sysroot_proxy is left %NULL, and it's up to the command to call
+       * rpmostree_load_sysroot() if it turns out to need the daemon after all. */
+      const bool direct_read = (flags & RPM_OSTREE_BUILTIN_FLAG_DIRECT_READ) > 0
+                               && getuid () == 0 && !opt_sysroot && !opt_force_peer;
+
       /* root never needs to auth */
       if (getuid () != 0)
-        /* ignore errors; we print out a warning if we fail to spawn pkttyagent */
-        (void)rpmostree_polkit_agent_open ();
+        {
+          /* ignore errors; we print out a warning if we fail to spawn pkttyagent */
+          (void)rpmostree_polkit_agent_open ();
+          startup_trace ("polkit agent");
+        }
 
-      if (!rpmostree_load_sysroot (opt_sysroot, cancellable, out_sysroot_proxy, error))
-        return FALSE;
+      if (direct_read)
+        *out_sysroot_proxy = NULL;
+      else
+        {
+          if (!rpmostree_load_sysroot (opt_sysroot, cancellable, out_sysroot_proxy, error))
+            return FALSE;
+          startup_trace ("daemon connection");
+        }
     }
 
   if (out_install_pkgs)
@@ -467,6 +517,8 @@ namespace rpmostreecxx
 void
 early_main (void)
 {
+  startup_trace_init ();
+
   /* avoid gvfs (http://bugzilla.gnome.org/show_bug.cgi?id=526454) */
   g_setenv ("GIO_USE_VFS", "local", TRUE);
 
@@ -487,6 +539,8 @@ early_main (void)
    * `DnfSack` and Repo too. So just do this upfront. XXX: Clean up that API so it's always
    * attached to a context object. */
   dnf_context_set_config_file_path ("");
+
+  startup_trace ("early init");
 }
 
 // The C++ `main()`, invoked from Rust only for most CLI commands currently.
@@ -519,6 +573,7 @@ rpmostree_main (const rust::Slice<const rust::Str> args)
    * to the commands, but also have them take effect globally.
    */
   const char *command_name = rpmostree_subcommand_parse (&argc, argv);
+  startup_trace ("command lookup");
 
   RpmOstreeCommand *command = lookup_command (command_name);
   if (!command)
@@ -545,7 +600,9 @@ rpmostree_main (const rust::Slice<const rust::Str> args)
    */
   g_autoptr (GError) local_error = NULL;
   GError **error = &local_error;
-  if (!command->fn (argc, argv, &invocation, cancellable, error))
+  const gboolean ok = command->fn (argc, argv, &invocation, cancellable, error);
+  startup_trace ("command");
+  if (!ok)
     {
       if (invocation.exit_code == -1)
         invocation.exit_code = EXIT_FAILURE;
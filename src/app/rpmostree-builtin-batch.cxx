@@ -0,0 +1,256 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2 of the licence or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <gio/gio.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#include "rpmostree-builtins.h"
+#include "rpmostree-libbuiltin.h"
+
+#include <libglnx.h>
+
+static char *opt_file;
+static gboolean opt_keep_going;
+
+static GOptionEntry option_entries[]
+    = { { "file", 'f', 0, G_OPTION_ARG_FILENAME, &opt_file,
+          "Read commands from FILE instead of stdin", "FILE" },
+        { "keep-going", 'k', 0, G_OPTION_ARG_NONE, &opt_keep_going,
+          "Keep running commands after one fails", NULL },
+        { NULL } };
+
+/* Consecutive `install` and `uninstall` lines which only name packages are
+ * folded into a single command, so that they result in one deployment rather
+ * than one each. */
+typedef struct
+{
+  GPtrArray *install;   /* char* */
+  GPtrArray *uninstall; /* char* */
+} PendingPkgChange;
+
+static gboolean
+is_plain_pkg_change (char **argv, gboolean *out_is_install)
+{
+  if (g_strv_length (argv) < 2)
+    return FALSE;
+  if (g_str_equal (argv[0], "install"))
+    *out_is_install = TRUE;
+  else if (g_str_equal (argv[0], "uninstall"))
+    *out_is_install = FALSE;
+  else
+    return FALSE;
+  for (char **it = argv + 1; *it; it++)
+    {
+      if (**it == '-')
+        return FALSE;
+    }
+  return TRUE;
+}
+
+static gboolean
+str_ptr_array_contains (GPtrArray *arr, const char *s)
+{
+  for (guint i = 0; i < arr->len; i++)
+    {
+      if (g_str_equal (arr->pdata[i], s))
+        return TRUE;
+    }
+  return FALSE;
+}
+
+/* Run `rpm-ostree @argv` as a child. The batch process stays registered with
+ * the daemon for the whole run, so it doesn't idle exit or drop its caches
+ * between commands. We don't run the builtins in-process, since their option
+ * globals aren't reset from one invocation to the next. */
+static gboolean
+run_one (char **argv, int *out_exit_code, GError **error)
+{
+  g_autoptr (GPtrArray) child_argv = g_ptr_array_new ();
+  g_ptr_array_add (child_argv, (char *)"/proc/self/exe");
+  g_ptr_array_add (child_argv, (char *)"rpm-ostree");
+  for (char **it = argv; *it; it++)
+    g_ptr_array_add (child_argv, *it);
+  g_ptr_array_add (child_argv, NULL);
+
+  g_autofree char *cmdline = g_strjoinv (" ", argv);
+  g_print ("==> rpm-ostree %s\n", cmdline);
+
+  int wait_status;
+  if (!g_spawn_sync (NULL, (char **)child_argv->pdata, NULL,
+                     (GSpawnFlags)(G_SPAWN_FILE_AND_ARGV_ZERO | G_SPAWN_CHILD_INHERITS_STDIN),
+                     NULL, NULL, NULL, NULL, &wait_status, error))
+    return glnx_prefix_error (error, "Running '%s'", cmdline);
+
+  if (WIFEXITED (wait_status))
+    *out_exit_code = WEXITSTATUS (wait_status);
+  else
+    *out_exit_code = EXIT_FAILURE;
+  return TRUE;
+}
+
+static gboolean
+flush_pkg_change (PendingPkgChange *pending, int *out_exit_code, GError **error)
+{
+  *out_exit_code = EXIT_SUCCESS;
+  if (pending->install->len == 0 && pending->uninstall->len == 0)
+    return TRUE;
+
+  g_autoptr (GPtrArray) argv = g_ptr_array_new ();
+  if (pending->install->len > 0)
+    {
+      g_ptr_array_add (argv, (char *)"install");
+      for (guint i = 0; i < pending->install->len; i++)
+        g_ptr_array_add (argv, pending->install->pdata[i]);
+      for (guint i = 0; i < pending->uninstall->len; i++)
+        {
+          g_ptr_array_add (argv, (char *)"--uninstall");
+          g_ptr_array_add (argv, pending->uninstall->pdata[i]);
+        }
+    }
+  else
+    {
+      g_ptr_array_add (argv, (char *)"uninstall");
+      for (guint i = 0; i < pending->uninstall->len; i++)
+        g_ptr_array_add (argv, pending->uninstall->pdata[i]);
+    }
+  g_ptr_array_add (argv, NULL);
+
+  if (!run_one ((char **)argv->pdata, out_exit_code, error))
+    return FALSE;
+  g_ptr_array_set_size (pending->install, 0);
+  g_ptr_array_set_size (pending->uninstall, 0);
+  return TRUE;
+}
+
+gboolean
+rpmostree_builtin_batch (int argc, char **argv, RpmOstreeCommandInvocation *invocation,
+                         GCancellable *cancellable, GError **error)
+{
+  g_autoptr (GOptionContext) context = g_option_context_new ("");
+  glnx_unref_object RPMOSTreeSysroot *sysroot_proxy = NULL;
+
+  if (!rpmostree_option_context_parse (context, option_entries, &argc, &argv, invocation,
+                                       cancellable, NULL, NULL, &sysroot_proxy, error))
+    return FALSE;
+
+  if (argc > 1)
+    {
+      rpmostree_usage_error (context, "Too many arguments passed", error);
+      return FALSE;
+    }
+
+  g_autofree char *contents = NULL;
+  if (opt_file && !g_str_equal (opt_file, "-"))
+    {
+      contents = glnx_file_get_contents_utf8_at (AT_FDCWD, opt_file, NULL, cancellable, error);
+      if (!contents)
+        return FALSE;
+    }
+  else
+    {
+      contents = glnx_fd_readall_utf8 (STDIN_FILENO, NULL, cancellable, error);
+      if (!contents)
+        return glnx_prefix_error (error, "Reading stdin");
+    }
+
+  /* Parse everything up front, so a typo on the last line doesn't leave the
+   * system half-way through the batch. */
+  g_autoptr (GPtrArray) commands = g_ptr_array_new_with_free_func ((GDestroyNotify)g_strfreev);
+  g_auto (GStrv) lines = g_strsplit (contents, "\n", -1);
+  for (guint i = 0; lines[i] != NULL; i++)
+    {
+      const char *line = g_strstrip (lines[i]);
+      if (*line == '\0' || *line == '#')
+        continue;
+      char **cmd_argv = NULL;
+      if (!g_shell_parse_argv (line, NULL, &cmd_argv, error))
+        return glnx_prefix_error (error, "Parsing line %u", i + 1);
+      if (g_str_equal (cmd_argv[0], "batch"))
+        {
+          g_strfreev (cmd_argv);
+          return glnx_throw (error, "Line %u: batch commands can't be nested", i + 1);
+        }
+      g_ptr_array_add (commands, cmd_argv);
+    }
+
+  g_autoptr (GPtrArray) pending_install = g_ptr_array_new ();
+  g_autoptr (GPtrArray) pending_uninstall = g_ptr_array_new ();
+  PendingPkgChange pending = { pending_install, pending_uninstall };
+  int failed_exit_code = EXIT_SUCCESS;
+  /* Returns whether we should stop */
+  auto check_exit = [&failed_exit_code] (int exit_code) {
+    if (exit_code == EXIT_SUCCESS || exit_code == RPM_OSTREE_EXIT_UNCHANGED)
+      return false;
+    failed_exit_code = exit_code;
+    return !opt_keep_going;
+  };
+  for (guint i = 0; i < commands->len; i++)
+    {
+      auto cmd_argv = static_cast<char **> (commands->pdata[i]);
+      gboolean is_install = FALSE;
+      int exit_code;
+
+      if (is_plain_pkg_change (cmd_argv, &is_install))
+        {
+          /* Installing and removing the same package in one go would
+           * conflict; keep the original ordering in that case. */
+          GPtrArray *other = is_install ? pending.uninstall : pending.install;
+          gboolean conflicts = FALSE;
+          for (char **it = cmd_argv + 1; *it && !conflicts; it++)
+            conflicts = str_ptr_array_contains (other, *it);
+          if (conflicts)
+            {
+              if (!flush_pkg_change (&pending, &exit_code, error))
+                return FALSE;
+              if (check_exit (exit_code))
+                break;
+            }
+          for (char **it = cmd_argv + 1; *it; it++)
+            g_ptr_array_add (is_install ? pending.install : pending.uninstall, *it);
+          continue;
+        }
+
+      if (!flush_pkg_change (&pending, &exit_code, error))
+        return FALSE;
+      if (check_exit (exit_code))
+        break;
+      if (!run_one (cmd_argv, &exit_code, error))
+        return FALSE;
+      if (check_exit (exit_code))
+        break;
+    }
+
+  if (failed_exit_code == EXIT_SUCCESS || opt_keep_going)
+    {
+      int exit_code;
+      if (!flush_pkg_change (&pending, &exit_code, error))
+        return FALSE;
+      (void)check_exit (exit_code);
+    }
+
+  if (failed_exit_code != EXIT_SUCCESS)
+    {
+      invocation->exit_code = failed_exit_code;
+      return glnx_throw (error, "Batch command failed");
+    }
+
+  return TRUE;
+}
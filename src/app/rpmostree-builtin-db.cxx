@@ -20,6 +20,9 @@
 
 #include "config.h"
 
+#include <errno.h>
+#include <stdio.h>
+
 #include "rpmostree-db-builtins.h"
 #include "rpmostree-rpm-util.h"
 
@@ -78,6 +81,22 @@ rpmostree_db_option_context_parse (GOptionContext *context, const GOptionEntry *
   return TRUE;
 }
 
+/* For output written out as it's computed. If the reader went away (e.g.
+ * `| head`, or quitting the pager), there's no point in computing the rest;
+ * @out_closed is set rather than failing, and the caller should stop. */
+gboolean
+rpmostree_db_write_stdout (const GString *buf, gboolean *out_closed, GError **error)
+{
+  if (fwrite (buf->str, 1, buf->len, stdout) == buf->len)
+    return TRUE;
+  if (errno == EPIPE)
+    {
+      *out_closed = TRUE;
+      return TRUE;
+    }
+  return glnx_throw_errno_prefix (error, "Writing to stdout");
+}
+
 gboolean
 rpmostree_builtin_db (int argc, char **argv, RpmOstreeCommandInvocation *invocation,
                       GCancellable *cancellable, GError **error)
@@ -39,6 +39,7 @@ static char *opt_osname;
 static char *opt_deploy_index;
 static gboolean opt_lock_finalization;
 static gboolean opt_unchanged_exit_77;
+static gboolean opt_coalesce_staged;
 
 static GOptionEntry option_entries[] = {
   { "os", 0, 0, G_OPTION_ARG_STRING, &opt_osname, "Operation on provided OSNAME", "OSNAME" },
@@ -66,6 +67,10 @@ static GOptionEntry option_entries[] = {
     "Like --delete, but does nothing if the key is already missing", "KEY=VALUE" },
   { "unchanged-exit-77", 0, 0, G_OPTION_ARG_NONE, &opt_unchanged_exit_77,
     "If no kernel args changed, exit 77", NULL },
+  { "coalesce-staged", 0, 0, G_OPTION_ARG_NONE, &opt_coalesce_staged,
+    "If a deployment is already staged, change its kernel arguments in place instead of staging "
+    "a new deployment",
+    NULL },
   { "import-proc-cmdline", 0, 0, G_OPTION_ARG_NONE, &opt_import_proc_cmdline,
     "Instead of modifying old kernel arguments, we modify args from current /proc/cmdline (the "
     "booted deployment)",
@@ -275,6 +280,8 @@ rpmostree_builtin_kargs (int argc, char **argv, RpmOstreeCommandInvocation *invo
   g_variant_dict_insert (&dict, "reboot", "b", opt_reboot);
   g_variant_dict_insert (&dict, "initiating-command-line", "s", invocation->command_line);
   g_variant_dict_insert (&dict, "lock-finalization", "b", opt_lock_finalization);
+  if (opt_coalesce_staged)
+    g_variant_dict_insert (&dict, "coalesce-staged", "b", TRUE);
   g_autoptr (GVariant) options = NULL;
 
   if (opt_editor)
@@ -30,10 +30,13 @@
 
 static char *opt_osname;
 static char *opt_force;
+static gboolean opt_prefetch;
 
 static GOptionEntry option_entries[]
     = { { "os", 0, 0, G_OPTION_ARG_STRING, &opt_osname, "Operate on provided OSNAME", "OSNAME" },
         { "force", 'f', 0, G_OPTION_ARG_NONE, &opt_force, "Expire current cache", NULL },
+        { "prefetch", 0, 0, G_OPTION_ARG_NONE, &opt_prefetch,
+          "Background prefetch; skip if the network is metered", NULL },
         { NULL } };
 
 static GVariant *
@@ -42,6 +45,7 @@ get_args_variant (void)
   GVariantDict dict;
   g_variant_dict_init (&dict, NULL);
   g_variant_dict_insert (&dict, "force", "b", opt_force);
+  g_variant_dict_insert (&dict, "prefetch", "b", opt_prefetch);
   return g_variant_dict_end (&dict);
 }
 
@@ -70,7 +70,8 @@ impl_packagelist_from_commit (OstreeRepo *repo, const char *commit, GError **err
   if (!rsack)
     {
       if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
-        return g_variant_new_maybe ((GVariantType *)RPMOSTREE_SHLIB_IPC_PKGLIST, NULL);
+        return g_variant_ref_sink (
+            g_variant_new_maybe ((GVariantType *)RPMOSTREE_SHLIB_IPC_PKGLIST, NULL));
       g_propagate_error (error, util::move_nullify (local_error));
       return NULL;
     }
@@ -118,6 +119,22 @@ rpmostree_builtin_shlib_backend (int argc, char **argv, RpmOstreeCommandInvocati
       if (!ret)
         return FALSE;
     }
+  else if (g_str_equal (arg, "packagelist-from-commits"))
+    {
+      OstreeRepo *repo = ostree_repo_open_at (AT_FDCWD, ".", NULL, error);
+      if (!repo)
+        return FALSE;
+      g_auto (GVariantBuilder) builder;
+      g_variant_builder_init (&builder, (GVariantType *)"am" RPMOSTREE_SHLIB_IPC_PKGLIST);
+      for (int i = 2; i < argc; i++)
+        {
+          g_autoptr (GVariant) pkglist = impl_packagelist_from_commit (repo, argv[i], error);
+          if (!pkglist)
+            return glnx_prefix_error (error, "Commit %s", argv[i]);
+          g_variant_builder_add_value (&builder, pkglist);
+        }
+      ret = g_variant_ref_sink (g_variant_builder_end (&builder));
+    }
   else
     return glnx_throw (error, "unknown shlib-backend %s", arg);
 
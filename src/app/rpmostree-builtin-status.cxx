@@ -34,9 +34,13 @@
 #include "rpmostree-clientlib.h"
 #include "rpmostree-core.h"
 #include "rpmostree-ex-builtins.h"
+#include "rpmostree-history-log.h"
+#include "rpmostree-json-writer.h"
 #include "rpmostree-libbuiltin.h"
 #include "rpmostree-rpm-util.h"
 #include "rpmostree-util.h"
+#include "rpmostreed-daemon.h"
+#include "rpmostreed-deployment-utils.h"
 #include "rpmostreed-transaction-types.h"
 
 #include <libglnx.h>
@@ -317,12 +321,10 @@ get_last_auto_update_run (GDBusConnection *connection, AutoUpdateSdState *out_st
  * (and StatusText if found) is returned as a single string in `update_driver_state` if
  * ActiveState is not empty. */
 static gboolean
-get_update_driver_state (RPMOSTreeSysroot *sysroot_proxy, const char *update_driver_sd_unit,
+get_update_driver_state (GDBusConnection *connection, const char *update_driver_sd_unit,
                          const char **update_driver_state, GCancellable *cancellable,
                          GError **error)
 {
-  GDBusConnection *connection = g_dbus_proxy_get_connection (G_DBUS_PROXY (sysroot_proxy));
-
   const char *update_driver_objpath = NULL;
   if (!get_sd_unit_objpath (connection, "LoadUnit", g_variant_new ("(s)", update_driver_sd_unit),
                             &update_driver_objpath, cancellable, error))
@@ -375,15 +377,18 @@ get_update_driver_state (RPMOSTreeSysroot *sysroot_proxy, const char *update_dri
   return TRUE;
 }
 
+/* @sysroot_proxy is %NULL if we read the state directly, in which case we
+ * know there's no active transaction. */
 static gboolean
-print_daemon_state (RPMOSTreeSysroot *sysroot_proxy, GCancellable *cancellable, GError **error)
+print_daemon_state (RPMOSTreeSysroot *sysroot_proxy, GDBusConnection *connection,
+                    const char *policy, GCancellable *cancellable, GError **error)
 {
   glnx_unref_object RPMOSTreeTransaction *txn_proxy = NULL;
-  if (!rpmostree_transaction_connect_active (sysroot_proxy, NULL, &txn_proxy, cancellable, error))
+  if (sysroot_proxy
+      && !rpmostree_transaction_connect_active (sysroot_proxy, NULL, &txn_proxy, cancellable,
+                                                error))
     return FALSE;
 
-  const char *policy = rpmostree_sysroot_get_automatic_update_policy (sysroot_proxy);
-
   g_print ("State: %s\n", txn_proxy ? "busy" : "idle");
 
   rpmostreecxx::journal_print_staging_failure ();
@@ -403,7 +408,7 @@ print_daemon_state (RPMOSTreeSysroot *sysroot_proxy, GCancellable *cancellable,
       /* only try to get unit's StatusText if we're on the system bus */
       g_autofree const char *update_driver_state = NULL;
       g_autoptr (GError) local_error = NULL;
-      if (!get_update_driver_state (sysroot_proxy, update_driver_sd_unit, &update_driver_state,
+      if (!get_update_driver_state (connection, update_driver_sd_unit, &update_driver_state,
                                     cancellable, &local_error))
         g_printerr ("%s", local_error->message);
       else if (update_driver_state)
@@ -424,7 +429,6 @@ print_daemon_state (RPMOSTreeSysroot *sysroot_proxy, GCancellable *cancellable,
       AutoUpdateSdState state = AUTO_UPDATE_SDSTATE_TIMER_UNKNOWN;
       g_autofree char *last_run = NULL;
       g_print ("; ");
-      GDBusConnection *connection = g_dbus_proxy_get_connection (G_DBUS_PROXY (sysroot_proxy));
       if (!get_last_auto_update_run (connection, &state, &last_run, cancellable, error))
         return FALSE;
       switch (state)
@@ -566,7 +570,7 @@ print_live_pkgdiff (const char *live_target, RpmOstreeDiffPrintFormat format, gu
  *     and the verbose option is set.
  */
 static gboolean
-print_one_deployment (RPMOSTreeSysroot *sysroot_proxy, GVariant *child, gint index,
+print_one_deployment (const char *sysroot_path, GVariant *child, gint index,
                       gboolean have_any_live_overlay, gboolean have_multiple_stateroots,
                       const char *booted_osname, const char *cached_update_deployment_id,
                       GVariant *cached_update, gboolean *out_printed_cached_update, GError **error)
@@ -838,10 +842,9 @@ print_one_deployment (RPMOSTreeSysroot *sysroot_proxy, GVariant *child, gint ind
       if (out_printed_cached_update)
         *out_printed_cached_update = TRUE;
     }
-  else if (is_pending_deployment && sysroot_proxy)
+  else if (is_pending_deployment && sysroot_path)
     {
       /* No cached update, but we can still print a diff summary */
-      const char *sysroot_path = rpmostree_sysroot_get_path (sysroot_proxy);
       ROSCXX_TRY (print_treepkg_diff_from_sysroot_path (rust::Str (sysroot_path), diff_format,
                                                         max_key_len, NULL),
                   error);
@@ -1103,7 +1106,7 @@ print_one_deployment (RPMOSTreeSysroot *sysroot_proxy, GVariant *child, gint ind
  * two deployments, this code will be the generic fallback.
  */
 static gboolean
-print_deployments (RPMOSTreeSysroot *sysroot_proxy, GVariant *deployments, GVariant *cached_update,
+print_deployments (const char *sysroot_path, GVariant *deployments, GVariant *cached_update,
                    gboolean *out_printed_cached_update, GCancellable *cancellable, GError **error)
 {
   GVariantIter iter;
@@ -1171,7 +1174,7 @@ print_deployments (RPMOSTreeSysroot *sysroot_proxy, GVariant *deployments, GVari
       if (child == NULL)
         break;
 
-      if (!print_one_deployment (sysroot_proxy, child, index, have_any_live_overlay,
+      if (!print_one_deployment (sysroot_path, child, index, have_any_live_overlay,
                                  have_multiple_stateroots, booted_osname,
                                  cached_update_deployment_id, cached_update,
                                  out_printed_cached_update, error))
@@ -1182,6 +1185,93 @@ print_deployments (RPMOSTreeSysroot *sysroot_proxy, GVariant *deployments, GVari
   return TRUE;
 }
 
+/* Whether a system transaction holds the sysroot lock; this only tests for the
+ * lock, so as to never make a transaction starting concurrently fail. */
+static gboolean
+sysroot_is_locked (OstreeSysroot *sysroot, gboolean *out_locked, GError **error)
+{
+  *out_locked = FALSE;
+  glnx_autofd int fd = -1;
+  g_autoptr (GError) local_error = NULL;
+  if (!glnx_openat_rdonly (ostree_sysroot_get_fd (sysroot), "ostree/lock", TRUE, &fd,
+                           &local_error))
+    {
+      if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        return g_propagate_error (error, util::move_nullify (local_error)), FALSE;
+      return TRUE; /* Note early return */
+    }
+
+  /* ostree_sysroot_lock() takes an OFD lock */
+  struct flock fl = {};
+  fl.l_type = F_WRLCK;
+  fl.l_whence = SEEK_SET;
+  if (fcntl (fd, F_OFD_GETLK, &fl) < 0)
+    return glnx_throw_errno_prefix (error, "fcntl(F_OFD_GETLK)");
+  *out_locked = (fl.l_type != F_UNLCK);
+  return TRUE;
+}
+
+/* For root, read what we'd otherwise get from the daemon's properties
+ * straight from the booted sysroot, using the same code the daemon uses to
+ * generate them; this saves starting the daemon just to query it. While a
+ * transaction is active, the daemon's view is the one to show, so
+ * @out_deployments is left %NULL to tell the caller to ask it instead. */
+static gboolean
+load_status_direct (GVariant **out_deployments, GVariant **out_cached_update, char **out_policy,
+                    GCancellable *cancellable, GError **error)
+{
+  GLNX_AUTO_PREFIX_ERROR ("Reading sysroot", error);
+  *out_deployments = NULL;
+
+  g_autoptr (OstreeSysroot) sysroot = ostree_sysroot_new_default ();
+  if (!ostree_sysroot_initialize (sysroot, error))
+    return FALSE;
+  gboolean locked = FALSE;
+  if (!sysroot_is_locked (sysroot, &locked, error))
+    return FALSE;
+  if (locked)
+    return TRUE; /* Note early return */
+  if (!ostree_sysroot_load (sysroot, cancellable, error))
+    return FALSE;
+  OstreeRepo *repo = ostree_sysroot_repo (sysroot);
+
+  OstreeDeployment *booted = ostree_sysroot_get_booted_deployment (sysroot);
+  g_autofree char *booted_id = NULL;
+  if (booted)
+    {
+      auto bootedid_v = rpmostreecxx::deployment_generate_id (*booted);
+      booted_id = g_strdup (bootedid_v.c_str ());
+    }
+
+  g_auto (GVariantBuilder) builder;
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("aa{sv}"));
+  g_autoptr (GPtrArray) deployments = ostree_sysroot_get_deployments (sysroot);
+  for (guint i = 0; i < deployments->len; i++)
+    {
+      auto deployment = static_cast<OstreeDeployment *> (deployments->pdata[i]);
+      GVariant *variant = NULL;
+      if (!rpmostreed_deployment_generate_variant (sysroot, deployment, booted_id, repo, TRUE,
+                                                   NULL, &variant, error))
+        return glnx_prefix_error (error, "Reading deployment %u", i);
+      g_variant_builder_add_value (&builder, variant);
+    }
+
+  /* An outdated one is left for the daemon to delete */
+  g_autoptr (GVariant) cached_update = NULL;
+  gboolean outdated = FALSE;
+  if (booted && !rpmostreed_read_cached_update (booted, &cached_update, &outdated, error))
+    return FALSE;
+
+  RpmostreedAutomaticUpdatePolicy policy;
+  if (!rpmostreed_read_automatic_update_policy (&policy, error))
+    return FALSE;
+
+  *out_deployments = g_variant_ref_sink (g_variant_builder_end (&builder));
+  *out_cached_update = util::move_nullify (cached_update);
+  *out_policy = g_strdup (rpmostree_auto_update_policy_to_str (policy, NULL));
+  return TRUE;
+}
+
 gboolean
 rpmostree_builtin_status (int argc, char **argv, RpmOstreeCommandInvocation *invocation,
                           GCancellable *cancellable, GError **error)
@@ -1201,24 +1291,34 @@ rpmostree_builtin_status (int argc, char **argv, RpmOstreeCommandInvocation *inv
       return FALSE;
     }
 
-  if (!rpmostree_load_os_proxy (sysroot_proxy, NULL, cancellable, &os_proxy, error))
-    return FALSE;
+  g_autoptr (GVariant) deployments = NULL;
+  g_autoptr (GVariant) cached_update = NULL;
+  g_autofree char *policy = NULL;
+  if (!sysroot_proxy)
+    {
+      if (!load_status_direct (&deployments, &cached_update, &policy, cancellable, error))
+        return FALSE;
+      if (!deployments && !rpmostree_load_sysroot (NULL, cancellable, &sysroot_proxy, error))
+        return FALSE;
+    }
 
-  g_autoptr (GVariant) deployments = rpmostree_sysroot_dup_deployments (sysroot_proxy);
+  if (sysroot_proxy)
+    {
+      if (!rpmostree_load_os_proxy (sysroot_proxy, NULL, cancellable, &os_proxy, error))
+        return FALSE;
+
+      deployments = rpmostree_sysroot_dup_deployments (sysroot_proxy);
+      if (rpmostree_os_get_has_cached_update_rpm_diff (os_proxy))
+        cached_update = rpmostree_os_dup_cached_update (os_proxy);
+      policy = g_strdup (rpmostree_sysroot_get_automatic_update_policy (sysroot_proxy));
+    }
   g_assert (deployments);
-  g_autoptr (GVariant) cached_update = NULL;
-  if (rpmostree_os_get_has_cached_update_rpm_diff (os_proxy))
-    cached_update = rpmostree_os_dup_cached_update (os_proxy);
   g_autoptr (GVariant) driver_info = NULL;
   if (!get_driver_g_variant (&driver_info, error))
     return FALSE;
 
   if (opt_json || opt_jsonpath)
     {
-      glnx_unref_object JsonBuilder *builder = json_builder_new ();
-      json_builder_begin_object (builder);
-
-      json_builder_set_member_name (builder, "deployments");
       g_autoptr (GVariant) deployments_to_list = g_variant_ref (deployments);
       if (opt_only_booted)
         {
@@ -1241,60 +1341,74 @@ rpmostree_builtin_status (int argc, char **argv, RpmOstreeCommandInvocation *inv
           deployments_to_list = g_variant_ref_sink (g_variant_builder_end (filtered_deployments));
         }
 
-      json_builder_add_value (builder, json_gvariant_serialize (deployments_to_list));
-      json_builder_set_member_name (builder, "transaction");
-      GVariant *txn = get_active_txn (sysroot_proxy);
-      JsonNode *txn_node = txn ? json_gvariant_serialize (txn) : json_node_new (JSON_NODE_NULL);
-      json_builder_add_value (builder, txn_node);
-      json_builder_set_member_name (builder, "cached-update");
-      JsonNode *cached_update_node;
-      if (cached_update)
-        cached_update_node = json_gvariant_serialize (cached_update);
-      else
-        cached_update_node = json_node_new (JSON_NODE_NULL);
-      json_builder_add_value (builder, cached_update_node);
-      json_builder_set_member_name (builder, "update-driver");
-      JsonNode *update_driver_node
-          = driver_info ? json_gvariant_serialize (driver_info) : json_node_new (JSON_NODE_NULL);
-      json_builder_add_value (builder, update_driver_node);
-      json_builder_end_object (builder);
-
-      JsonNode *json_root = json_builder_get_root (builder);
-      glnx_unref_object JsonGenerator *generator = json_generator_new ();
-      json_generator_set_pretty (generator, TRUE);
+      /* The document is kept as a variant, which the JSON writer streams out
+       * directly; missing values are empty maybes, i.e. null. */
+      GVariant *txn = sysroot_proxy ? get_active_txn (sysroot_proxy) : NULL;
+      g_auto (GVariantBuilder) doc_builder;
+      g_variant_builder_init (&doc_builder, G_VARIANT_TYPE_VARDICT);
+      g_variant_builder_add (&doc_builder, "{sv}", "deployments", deployments_to_list);
+      g_variant_builder_add (&doc_builder, "{sv}", "transaction",
+                             g_variant_new_maybe (G_VARIANT_TYPE ("(sss)"), txn));
+      g_variant_builder_add (&doc_builder, "{sv}", "cached-update",
+                             g_variant_new_maybe (G_VARIANT_TYPE_VARDICT, cached_update));
+      g_variant_builder_add (&doc_builder, "{sv}", "update-driver",
+                             g_variant_new_maybe (G_VARIANT_TYPE_VARDICT, driver_info));
+      g_autoptr (GVariant) doc = g_variant_ref_sink (g_variant_builder_end (&doc_builder));
 
       if (opt_json)
-        json_generator_set_root (generator, json_root);
+        {
+          if (!rpmostree_json_write_gvariant (STDOUT_FILENO, doc, error))
+            return FALSE;
+        }
+      else if (rpmostree_json_path_is_simple (opt_jsonpath))
+        {
+          if (!rpmostree_json_write_gvariant_path (STDOUT_FILENO, doc, opt_jsonpath, error))
+            return FALSE;
+        }
       else
         {
+          /* Anything beyond member, index and wildcard steps needs the tree */
+          JsonNode *json_root = json_gvariant_serialize (doc);
           JsonNode *result = json_path_query (opt_jsonpath, json_root, error);
+          json_node_free (json_root);
           if (!result)
             {
               g_prefix_error (error, "While compiling jsonpath: ");
               return FALSE;
             }
+          glnx_unref_object JsonGenerator *generator = json_generator_new ();
+          json_generator_set_pretty (generator, TRUE);
           json_generator_set_root (generator, result);
           json_node_free (result);
-        }
-      json_node_free (json_root);
 
-      glnx_unref_object GOutputStream *stdout_gio = g_unix_output_stream_new (1, FALSE);
-      /* NB: watch out for the misleading API docs */
-      if (json_generator_to_stream (generator, stdout_gio, NULL, error) <= 0
-          || (error != NULL && *error != NULL))
-        return FALSE;
+          glnx_unref_object GOutputStream *stdout_gio = g_unix_output_stream_new (1, FALSE);
+          /* NB: watch out for the misleading API docs */
+          if (json_generator_to_stream (generator, stdout_gio, NULL, error) <= 0
+              || (error != NULL && *error != NULL))
+            return FALSE;
+        }
     }
   else
     {
-      if (!print_daemon_state (sysroot_proxy, cancellable, error))
+      g_autoptr (GDBusConnection) connection = NULL;
+      if (sysroot_proxy)
+        connection = (GDBusConnection *)g_object_ref (
+            g_dbus_proxy_get_connection (G_DBUS_PROXY (sysroot_proxy)));
+      else
+        {
+          connection = g_bus_get_sync (G_BUS_TYPE_SYSTEM, cancellable, error);
+          if (!connection)
+            return glnx_prefix_error (error, "Connecting to system bus");
+        }
+      if (!print_daemon_state (sysroot_proxy, connection, policy, cancellable, error))
         return FALSE;
 
+      const char *sysroot_path = sysroot_proxy ? rpmostree_sysroot_get_path (sysroot_proxy) : "/";
       gboolean printed_cached_update = FALSE;
-      if (!print_deployments (sysroot_proxy, deployments, cached_update, &printed_cached_update,
+      if (!print_deployments (sysroot_path, deployments, cached_update, &printed_cached_update,
                               cancellable, error))
         return FALSE;
 
-      const char *policy = rpmostree_sysroot_get_automatic_update_policy (sysroot_proxy);
       gboolean auto_updates_enabled = (!g_str_equal (policy, "none"));
       if (cached_update && !printed_cached_update && auto_updates_enabled)
         {
@@ -1341,11 +1455,21 @@ static GOptionEntry history_option_entries[]
            output", NULL }, */
         { NULL } };
 
-/* Read from history db, sets @out_deployment to NULL on ENOENT. */
+/* Read from history db, sets @out_deployment to NULL on ENOENT. Deployments
+ * created before the history log was introduced each have their own file. */
 static gboolean
-fetch_history_deployment_gvariant (const rpmostreecxx::HistoryEntry &entry,
+fetch_history_deployment_gvariant (RpmOstreeHistoryLog *log,
+                                   const rpmostreecxx::HistoryEntry &entry,
                                    GVariant **out_deployment, GError **error)
 {
+  if (log)
+    {
+      if (!rpmostree_history_log_lookup (log, entry.deploy_timestamp, out_deployment, error))
+        return FALSE;
+      if (*out_deployment)
+        return TRUE;
+    }
+
   g_autofree char *fn
       = g_strdup_printf ("%s/%" PRIu64, RPMOSTREE_HISTORY_DIR, entry.deploy_timestamp);
 
@@ -1381,10 +1505,11 @@ print_timestamp_and_relative (const char *key, guint64 t)
 }
 
 static gboolean
-print_history_entry (const rpmostreecxx::HistoryEntry &entry, GError **error)
+print_history_entry (RpmOstreeHistoryLog *log, const rpmostreecxx::HistoryEntry &entry,
+                     GError **error)
 {
   g_autoptr (GVariant) deployment = NULL;
-  if (!fetch_history_deployment_gvariant (entry, &deployment, error))
+  if (!fetch_history_deployment_gvariant (log, entry, &deployment, error))
     return FALSE;
 
   if (!opt_json)
@@ -1477,6 +1602,9 @@ rpmostree_ex_builtin_history (int argc, char **argv, RpmOstreeCommandInvocation
 
   /* XXX: enhance with option for going in reverse (oldest first) */
   CXX_TRY_VAR (history_ctx, rpmostreecxx::history_ctx_new (), error);
+  g_autoptr (RpmOstreeHistoryLog) log = NULL;
+  if (!rpmostree_history_log_open (RPMOSTREE_HISTORY_DIR, &log, error))
+    return FALSE;
 
   /* XXX: use pager here */
 
@@ -1486,7 +1614,7 @@ rpmostree_ex_builtin_history (int argc, char **argv, RpmOstreeCommandInvocation
       CXX_TRY_VAR (entry, history_ctx->next_entry (), error);
       if (entry.eof)
         break;
-      if (!print_history_entry (entry, error))
+      if (!print_history_entry (log, entry, error))
         return FALSE;
       at_least_one = TRUE;
     }
@@ -24,8 +24,13 @@
 
 #include "config.h"
 
+#include <gio/gunixoutputstream.h>
+#include <json-glib/json-glib.h>
+#include <string.h>
+
 #include "rpmostree-builtins.h"
 #include "rpmostree-cxxrs.h"
+#include "rpmostree-importer.h"
 #include "rpmostree-rpm-util.h"
 #include "rpmostree-scripts.h"
 
@@ -35,6 +40,7 @@
                                             GCancellable *cancellable, GError **error);
 BUILTIN (inject_pkglist)
 BUILTIN (script_shell)
+BUILTIN (bench_import)
 #undef BUILTIN
 
 static RpmOstreeCommand testutils_subcommands[]
@@ -42,6 +48,8 @@ static RpmOstreeCommand testutils_subcommands[]
           rpmostree_testutils_builtin_inject_pkglist },
         { "script-shell", RPM_OSTREE_BUILTIN_FLAG_LOCAL_CMD, NULL,
           rpmostree_testutils_builtin_script_shell },
+        { "bench-import", RPM_OSTREE_BUILTIN_FLAG_LOCAL_CMD, NULL,
+          rpmostree_testutils_builtin_bench_import },
         // Avoid adding other commands here - write them in Rust in testutils.rs
         { NULL, (RpmOstreeBuiltinFlags)0, NULL, NULL } };
 
@@ -58,6 +66,10 @@ rpmostree_builtin_testutils (int argc, char **argv, RpmOstreeCommandInvocation *
       else if (g_str_equal (argv[1], "script-shell"))
         return rpmostree_handle_subcommand (argc, argv, testutils_subcommands, invocation,
                                             cancellable, error);
+      /* The importer isn't exposed to Rust */
+      else if (g_str_equal (argv[1], "bench-import"))
+        return rpmostree_handle_subcommand (argc, argv, testutils_subcommands, invocation,
+                                            cancellable, error);
     }
   rust::Vec<rust::String> rustargv;
   for (int i = 0; i < argc; i++)
@@ -155,6 +167,203 @@ rpmostree_testutils_builtin_script_shell (int argc, char **argv,
   if (!glnx_opendirat (AT_FDCWD, rootpath, TRUE, &rootfs_dfd, error))
     return FALSE;
 
-  return rpmostree_run_script_in_bwrap_container (rootfs_dfd, NULL, TRUE, "testscript", NULL, NULL,
-                                                  NULL, NULL, STDIN_FILENO, cancellable, error);
+  return rpmostree_run_script_in_bwrap_container (rootfs_dfd, NULL, TRUE, NULL, "testscript", NULL,
+                                                  NULL, NULL, NULL, STDIN_FILENO, cancellable,
+                                                  error);
+}
+
+static gint
+compare_strs (gconstpointer a, gconstpointer b)
+{
+  return strcmp (*(const char *const *)a, *(const char *const *)b);
+}
+
+static double
+usec_to_secs (guint64 usec)
+{
+  return usec / (double)G_USEC_PER_SEC;
+}
+
+/* Import @path into @repo in its own transaction, adding its measurements
+ * to @builder and @totals. */
+static gboolean
+bench_import_one (OstreeRepo *repo, int dfd, const char *path, JsonBuilder *builder,
+                  RpmOstreeImporterStats *totals, guint64 *total_written, guint64 *total_deduped,
+                  GCancellable *cancellable, GError **error)
+{
+  glnx_autofd int fd = -1;
+  if (!glnx_openat_rdonly (dfd, path, TRUE, &fd, error))
+    return FALSE;
+  struct stat stbuf;
+  if (!glnx_fstat (fd, &stbuf, error))
+    return FALSE;
+
+  auto flags = rpmostreecxx::rpm_importer_flags_new_empty ();
+  g_autoptr (RpmOstreeImporter) importer
+      = rpmostree_importer_new_take_fd (&fd, repo, NULL, *flags, NULL, cancellable, error);
+  if (!importer)
+    return glnx_prefix_error (error, "Opening %s", path);
+  g_autofree char *nevra = rpmostree_importer_get_nevra (importer);
+
+  if (!ostree_repo_prepare_transaction (repo, NULL, cancellable, error))
+    return FALSE;
+  if (!rpmostree_importer_run (importer, NULL, NULL, cancellable, error))
+    return FALSE;
+  OstreeRepoTransactionStats txn_stats = {
+    0,
+  };
+  const guint64 commit_start = g_get_monotonic_time ();
+  if (!ostree_repo_commit_transaction (repo, &txn_stats, cancellable, error))
+    return FALSE;
+  const guint64 commit_usec = g_get_monotonic_time () - commit_start;
+
+  RpmOstreeImporterStats stats;
+  rpmostree_importer_get_stats (importer, &stats);
+  const guint64 written = txn_stats.content_objects_written + txn_stats.metadata_objects_written;
+  const guint64 deduped = (txn_stats.content_objects_total - txn_stats.content_objects_written)
+                          + (txn_stats.metadata_objects_total - txn_stats.metadata_objects_written)
+                          + stats.n_deduped;
+  const guint64 wall_usec = stats.wall_usec + commit_usec;
+
+  json_builder_begin_object (builder);
+  json_builder_set_member_name (builder, "nevra");
+  json_builder_add_string_value (builder, nevra);
+  json_builder_set_member_name (builder, "size");
+  json_builder_add_int_value (builder, stbuf.st_size);
+  json_builder_set_member_name (builder, "installed-size");
+  json_builder_add_int_value (builder, stats.installed_size);
+  json_builder_set_member_name (builder, "wall-secs");
+  json_builder_add_double_value (builder, usec_to_secs (wall_usec));
+  json_builder_set_member_name (builder, "decompress-secs");
+  json_builder_add_double_value (builder, usec_to_secs (stats.decompress_usec));
+  json_builder_set_member_name (builder, "hash-secs");
+  json_builder_add_double_value (builder, usec_to_secs (stats.cpu_usec));
+  json_builder_set_member_name (builder, "write-secs");
+  const guint64 offcpu_usec = stats.wall_usec - MIN (stats.cpu_usec, stats.wall_usec);
+  json_builder_add_double_value (builder, usec_to_secs (offcpu_usec + commit_usec));
+  json_builder_set_member_name (builder, "objects-written");
+  json_builder_add_int_value (builder, written);
+  json_builder_set_member_name (builder, "objects-deduped");
+  json_builder_add_int_value (builder, deduped);
+  json_builder_set_member_name (builder, "bytes-per-sec");
+  json_builder_add_double_value (builder,
+                                 stats.installed_size / MAX (usec_to_secs (wall_usec), 1e-6));
+  json_builder_end_object (builder);
+
+  totals->installed_size += stats.installed_size;
+  totals->wall_usec += wall_usec;
+  totals->cpu_usec += stats.cpu_usec;
+  totals->decompress_usec += stats.decompress_usec;
+  *total_written += written;
+  *total_deduped += deduped;
+  return TRUE;
+}
+
+/*
+Import each RPM in a directory, one at a time, into a bare-user repo (a
+scratch one unless given) and print how long each took as JSON. Decompression
+runs in its own thread; "hash-secs" is the CPU time of the importing thread,
+which is mostly checksumming, and "write-secs" the rest of its time plus the
+transaction commit, i.e. mostly waiting on writes.
+
+This is meant to catch regressions in importer throughput without a full
+compose.
+*/
+gboolean
+rpmostree_testutils_builtin_bench_import (int argc, char **argv,
+                                          RpmOstreeCommandInvocation *invocation,
+                                          GCancellable *cancellable, GError **error)
+{
+  if (argc < 2 || argc > 3)
+    return glnx_throw (error, "Usage: rpm-ostree testutils bench-import <RPMDIR> [REPO]");
+
+  const char *rpmdir = argv[1];
+  g_auto (GLnxTmpDir) tmpdir = {
+    0,
+  };
+  g_autoptr (OstreeRepo) repo = NULL;
+  if (argc == 3)
+    repo = ostree_repo_open_at (AT_FDCWD, argv[2], cancellable, error);
+  else
+    {
+      if (!glnx_mkdtemp ("rpmostree-bench-import-XXXXXX", 0700, &tmpdir, error))
+        return FALSE;
+      repo = ostree_repo_create_at (tmpdir.fd, "repo", OSTREE_REPO_MODE_BARE_USER, NULL,
+                                    cancellable, error);
+    }
+  if (!repo)
+    return FALSE;
+
+  glnx_autofd int dfd = -1;
+  if (!glnx_opendirat (AT_FDCWD, rpmdir, TRUE, &dfd, error))
+    return FALSE;
+  g_autoptr (GPtrArray) rpms = g_ptr_array_new_with_free_func (g_free);
+  g_auto (GLnxDirFdIterator) dfd_iter = {
+    FALSE,
+  };
+  if (!glnx_dirfd_iterator_init_at (dfd, ".", FALSE, &dfd_iter, error))
+    return FALSE;
+  while (TRUE)
+    {
+      struct dirent *dent = NULL;
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&dfd_iter, &dent, cancellable, error))
+        return FALSE;
+      if (!dent)
+        break;
+      if (dent->d_type == DT_REG && g_str_has_suffix (dent->d_name, ".rpm"))
+        g_ptr_array_add (rpms, g_strdup (dent->d_name));
+    }
+  g_ptr_array_sort (rpms, compare_strs);
+
+  glnx_unref_object JsonBuilder *builder = json_builder_new ();
+  json_builder_begin_object (builder);
+  json_builder_set_member_name (builder, "packages");
+  json_builder_begin_array (builder);
+  RpmOstreeImporterStats totals = {
+    0,
+  };
+  guint64 total_written = 0;
+  guint64 total_deduped = 0;
+  for (guint i = 0; i < rpms->len; i++)
+    {
+      auto path = static_cast<const char *> (rpms->pdata[i]);
+      if (!bench_import_one (repo, dfd, path, builder, &totals, &total_written, &total_deduped,
+                             cancellable, error))
+        return glnx_prefix_error (error, "Importing %s", path);
+    }
+  json_builder_end_array (builder);
+
+  json_builder_set_member_name (builder, "total");
+  json_builder_begin_object (builder);
+  json_builder_set_member_name (builder, "packages");
+  json_builder_add_int_value (builder, rpms->len);
+  json_builder_set_member_name (builder, "installed-size");
+  json_builder_add_int_value (builder, totals.installed_size);
+  json_builder_set_member_name (builder, "wall-secs");
+  json_builder_add_double_value (builder, usec_to_secs (totals.wall_usec));
+  json_builder_set_member_name (builder, "decompress-secs");
+  json_builder_add_double_value (builder, usec_to_secs (totals.decompress_usec));
+  json_builder_set_member_name (builder, "hash-secs");
+  json_builder_add_double_value (builder, usec_to_secs (totals.cpu_usec));
+  json_builder_set_member_name (builder, "objects-written");
+  json_builder_add_int_value (builder, total_written);
+  json_builder_set_member_name (builder, "objects-deduped");
+  json_builder_add_int_value (builder, total_deduped);
+  json_builder_set_member_name (builder, "bytes-per-sec");
+  json_builder_add_double_value (
+      builder, totals.installed_size / MAX (usec_to_secs (totals.wall_usec), 1e-6));
+  json_builder_end_object (builder);
+  json_builder_end_object (builder);
+
+  g_autoptr (JsonNode) root = json_builder_get_root (builder);
+  glnx_unref_object JsonGenerator *generator = json_generator_new ();
+  json_generator_set_pretty (generator, TRUE);
+  json_generator_set_root (generator, root);
+  glnx_unref_object GOutputStream *stdout_gio = g_unix_output_stream_new (STDOUT_FILENO, FALSE);
+  /* NB: watch out for the misleading API docs */
+  if (json_generator_to_stream (generator, stdout_gio, NULL, error) <= 0
+      || (error != NULL && *error != NULL))
+    return FALSE;
+  g_print ("\n");
+  return TRUE;
 }
@@ -39,6 +39,8 @@ typedef enum
   RPM_OSTREE_BUILTIN_FLAG_HIDDEN = 1 << 2,
   RPM_OSTREE_BUILTIN_FLAG_SUPPORTS_PKG_INSTALLS = 1 << 3,
   RPM_OSTREE_BUILTIN_FLAG_CONTAINER_CAPABLE = 1 << 4,
+  /* For root, the command reads the sysroot itself; see rpmostree_option_context_parse() */
+  RPM_OSTREE_BUILTIN_FLAG_DIRECT_READ = 1 << 5,
 } RpmOstreeBuiltinFlags;
 
 typedef struct RpmOstreeCommand RpmOstreeCommand;
@@ -61,6 +61,7 @@ BUILTINPROTO (testutils);
 BUILTINPROTO (ex);
 BUILTINPROTO (finalize_deployment);
 BUILTINPROTO (initramfs_etc);
+BUILTINPROTO (batch);
 
 #undef BUILTINPROTO
 
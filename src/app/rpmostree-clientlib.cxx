@@ -277,12 +277,24 @@ rpmostree_load_os_proxy (RPMOSTreeSysroot *sysroot_proxy, gchar *opt_osname,
                                     error);
 }
 
+/* At most this often, we redraw the progress bar; the daemon can send updates
+ * much faster than a terminal is worth redrawing */
+#define PROGRESS_REDRAW_INTERVAL_MS 100
+
 typedef struct
 {
   gboolean progress;
   GError *error;
   GMainLoop *loop;
   gboolean complete;
+
+  /* Non-ttys don't show the bar, so there's nothing to redraw */
+  gboolean is_tty;
+  /* Latest progress state not drawn yet; see transaction_progress_redraw() */
+  guint redraw_id;
+  gboolean have_pending_percent;
+  guint32 pending_percent;
+  GVariant *pending_download;
 } TransactionProgress;
 
 static TransactionProgress *
@@ -292,24 +304,71 @@ transaction_progress_new (void)
 
   self = g_slice_new0 (TransactionProgress);
   self->loop = g_main_loop_new (NULL, FALSE);
+  self->is_tty = glnx_stdout_is_tty ();
 
   return self;
 }
 
+/* Forget any progress state we haven't drawn yet */
+static void
+transaction_progress_drop_pending (TransactionProgress *self)
+{
+  if (self->redraw_id > 0)
+    {
+      g_source_remove (self->redraw_id);
+      self->redraw_id = 0;
+    }
+  self->have_pending_percent = FALSE;
+  g_clear_pointer (&self->pending_download, g_variant_unref);
+}
+
 static void
 transaction_progress_free (TransactionProgress *self)
 {
   if (self == NULL)
     return;
 
+  transaction_progress_drop_pending (self);
   g_main_loop_unref (self->loop);
   g_slice_free (TransactionProgress, self);
 }
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (TransactionProgress, transaction_progress_free)
 
+/* Draw the latest progress state, if we haven't yet */
+static void
+transaction_progress_flush (TransactionProgress *self)
+{
+  if (self->progress && self->have_pending_percent)
+    rpmostreecxx::console_progress_update (self->pending_percent);
+  if (self->progress && self->pending_download)
+    {
+      auto line = rpmostreecxx::client_render_download_progress (*self->pending_download);
+      rpmostreecxx::console_progress_set_message (line.c_str ());
+    }
+  transaction_progress_drop_pending (self);
+}
+
+static gboolean
+transaction_progress_redraw (gpointer user_data)
+{
+  auto self = static_cast<TransactionProgress *> (user_data);
+  self->redraw_id = 0;
+  transaction_progress_flush (self);
+  return G_SOURCE_REMOVE;
+}
+
+static void
+transaction_progress_schedule_redraw (TransactionProgress *self)
+{
+  if (self->redraw_id == 0)
+    self->redraw_id
+        = g_timeout_add (PROGRESS_REDRAW_INTERVAL_MS, transaction_progress_redraw, self);
+}
+
 static void
 transaction_progress_end (TransactionProgress *self)
 {
+  transaction_progress_drop_pending (self);
   if (self->progress)
     {
       rpmostreecxx::console_progress_end (rust::Str ());
@@ -350,6 +409,18 @@ on_transaction_progress (GDBusProxy *proxy, gchar *sender_name, gchar *signal_na
   if (rpmostree_global_quiet ())
     return;
 
+  /* Progress updates are only drawn on the redraw timer; anything else is
+   * shown right away, so draw what's pending before it to keep the order. */
+  const gboolean is_update = g_str_equal (signal_name, "PercentProgress")
+                             || g_str_equal (signal_name, "DownloadProgress");
+  if (!is_update)
+    {
+      if (g_str_equal (signal_name, "TaskEnd") || g_str_equal (signal_name, "ProgressEnd"))
+        transaction_progress_drop_pending (tp);
+      else
+        transaction_progress_flush (tp);
+    }
+
   if (g_strcmp0 (signal_name, "SignatureProgress") == 0)
     {
       /* We used to print the signature here, but doing so interferes with the
@@ -401,18 +472,27 @@ on_transaction_progress (GDBusProxy *proxy, gchar *sender_name, gchar *signal_na
           tp->progress = TRUE;
           rpmostreecxx::console_progress_begin_percent (message);
         }
-      rpmostreecxx::console_progress_update (percentage);
+      if (tp->is_tty)
+        {
+          tp->have_pending_percent = TRUE;
+          tp->pending_percent = percentage;
+          transaction_progress_schedule_redraw (tp);
+        }
     }
   else if (g_strcmp0 (signal_name, "DownloadProgress") == 0)
     {
-      auto line = rpmostreecxx::client_render_download_progress (*parameters);
       if (!tp->progress)
         {
+          auto line = rpmostreecxx::client_render_download_progress (*parameters);
           tp->progress = TRUE;
           rpmostreecxx::console_progress_begin_task (line.c_str ());
         }
-      else
-        rpmostreecxx::console_progress_set_message (line.c_str ());
+      else if (tp->is_tty)
+        {
+          g_clear_pointer (&tp->pending_download, g_variant_unref);
+          tp->pending_download = g_variant_ref (parameters);
+          transaction_progress_schedule_redraw (tp);
+        }
     }
 }
 
@@ -1142,8 +1222,13 @@ rpmostree_print_advisories (GVariant *advisories, gboolean verbose, guint max_ke
 
   const guint max_sev_len = strlen ("Important");
 
-  /* sort by severity */
-  g_ptr_array_sort (sec_advisories, compare_sec_advisories);
+  /* sort by severity; rpmostree_advisories_variant() already does, so this
+   * is only needed for updates cached by older versions */
+  gboolean sorted = TRUE;
+  for (guint i = 1; i < sec_advisories->len && sorted; i++)
+    sorted = compare_sec_advisories (&sec_advisories->pdata[i - 1], &sec_advisories->pdata[i]) <= 0;
+  if (!sorted)
+    g_ptr_array_sort (sec_advisories, compare_sec_advisories);
 
   for (guint i = 0; i < sec_advisories->len; i++)
     {
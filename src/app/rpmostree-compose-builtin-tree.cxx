@@ -44,6 +44,7 @@
 #include "rpmostree-package-variants.h"
 #include "rpmostree-postprocess.h"
 #include "rpmostree-rpm-util.h"
+#include "rpmostree-scripts.h"
 #include "rpmostree-util.h"
 
 #include "libglnx.h"
@@ -77,7 +78,16 @@ static gboolean opt_no_parent;
 static char *opt_write_lockfile_to;
 static char **opt_lockfiles;
 static gboolean opt_lockfile_strict;
+static gboolean opt_lockfile_exact;
+static gint64 opt_download_import_budget = -1;
+static int opt_max_downloads = -1;
+static int opt_max_downloads_per_repo = -1;
+static int opt_import_concurrency = -1;
+static gboolean opt_stream_downloads;
+static char *opt_shared_noarch_pkgcache;
+static int opt_metadata_max_age = -1;
 static char *opt_parent;
+static gboolean opt_low_memory_commit;
 
 static char *opt_extensions_output_dir;
 static char *opt_extensions_base_rev;
@@ -130,6 +140,24 @@ static GOptionEntry install_option_entries[]
           "FILE" },
         { "ex-lockfile-strict", 0, 0, G_OPTION_ARG_NONE, &opt_lockfile_strict,
           "With --ex-lockfile, only allow installing locked packages", NULL },
+        { "ex-lockfile-exact", 0, 0, G_OPTION_ARG_NONE, &opt_lockfile_exact,
+          "With --ex-lockfile, install exactly the locked packages (implies --ex-lockfile-strict)",
+          NULL },
+        { "ex-download-import-budget", 0, 0, G_OPTION_ARG_INT64, &opt_download_import_budget,
+          "Maximum bytes of downloaded RPMs waiting for import (0 for unlimited)", "BYTES" },
+        { "ex-max-downloads", 0, 0, G_OPTION_ARG_INT, &opt_max_downloads,
+          "Maximum number of concurrent package downloads across all repos", "N" },
+        { "ex-max-downloads-per-repo", 0, 0, G_OPTION_ARG_INT, &opt_max_downloads_per_repo,
+          "Maximum number of concurrent package downloads from a single repo", "N" },
+        { "ex-import-concurrency", 0, 0, G_OPTION_ARG_INT, &opt_import_concurrency,
+          "Number of packages to import in parallel (0 to adapt to throughput)", "N" },
+        { "ex-stream-downloads", 0, 0, G_OPTION_ARG_NONE, &opt_stream_downloads,
+          "Download RPMs to tmpfs for import rather than the package cache", NULL },
+        { "ex-shared-noarch-pkgcache", 0, 0, G_OPTION_ARG_STRING, &opt_shared_noarch_pkgcache,
+          "Share noarch package imports with composes for other architectures through REPO",
+          "REPO" },
+        { "ex-metadata-max-age", 0, 0, G_OPTION_ARG_INT, &opt_metadata_max_age,
+          "Reuse cached rpm-md fetched at most SECONDS ago instead of refreshing it", "SECONDS" },
         { NULL } };
 
 static GOptionEntry postprocess_option_entries[] = { { NULL } };
@@ -145,6 +173,8 @@ static GOptionEntry commit_option_entries[] = {
     "Write JSON to FILE containing information about the compose run", "FILE" },
   { "no-parent", 0, 0, G_OPTION_ARG_NONE, &opt_no_parent, "Always commit without a parent", NULL },
   { "parent", 0, 0, G_OPTION_ARG_STRING, &opt_parent, "Commit with specific parent", "REV" },
+  { "ex-low-memory-commit", 0, 0, G_OPTION_ARG_NONE, &opt_low_memory_commit,
+    "Write the tree bottom-up, keeping memory use proportional to its depth", NULL },
   { NULL }
 };
 
@@ -176,6 +206,9 @@ typedef struct
   OstreeRepo *build_repo;    /* unified mode: repo we build into */
   OstreeRepo *pkgcache_repo; /* unified mode: pkgcache repo where we import pkgs */
   OstreeRepoDevInoCache *devino_cache;
+  /* Set when the rootfs came from the install cache rather than assembly */
+  gboolean have_devino_stamp;
+  struct timespec devino_stamp;
   const char *ref;
   char *previous_checksum;
 
@@ -221,7 +254,7 @@ on_hifstate_percentage_changed (DnfState *hifstate, guint percentage, gpointer u
 }
 
 static gboolean
-inputhash_from_commit (OstreeRepo *repo, const char *sha256,
+inputhash_from_commit (OstreeRepo *repo, const char *sha256, const char *key,
                        char **out_value, /* inout Option<String> */
                        GError **error)
 {
@@ -232,7 +265,241 @@ inputhash_from_commit (OstreeRepo *repo, const char *sha256,
   g_autoptr (GVariant) commit_metadata = g_variant_get_child_value (commit_v, 0);
   g_assert (out_value);
   *out_value = NULL;
-  g_variant_lookup (commit_metadata, "rpmostree.inputhash", "s", out_value);
+  g_variant_lookup (commit_metadata, key, "s", out_value);
+  return TRUE;
+}
+
+static RpmOstreeSELinuxMode
+get_selinux_mode (RpmOstreeTreeComposeContext *self)
+{
+  auto selinux = (*self->treefile_rs)->get_selinux ();
+  auto selinux_label_version = (*self->treefile_rs)->get_selinux_label_version ();
+  if (selinux && selinux_label_version == 1)
+    return RPMOSTREE_SELINUX_MODE_V1;
+  else if (selinux)
+    return RPMOSTREE_SELINUX_MODE_V0;
+  return RPMOSTREE_SELINUX_MODE_DISABLED;
+}
+
+/* Refs in the pkgcache repo pointing to rootfs snapshots as of the end of
+ * installation (i.e. after scripts, before postprocessing), by install digest.
+ * With CI iterating on postprocessing against the same package set, this is
+ * most of the work of a compose. */
+#define INSTALL_CACHE_REF_PREFIX "rpmostree/install-cache/"
+
+static gint
+compare_strings (gconstpointer a, gconstpointer b)
+{
+  return strcmp (*(const char *const *)a, *(const char *const *)b);
+}
+
+static gboolean
+hash_rootfs_contents (RpmOstreeHasher *checksum, int dfd, const char *path,
+                      GCancellable *cancellable, GError **error)
+{
+  g_auto (GLnxDirFdIterator) dfd_iter = {
+    FALSE,
+  };
+  if (!glnx_dirfd_iterator_init_at (dfd, path, FALSE, &dfd_iter, error))
+    return FALSE;
+  g_autoptr (GPtrArray) names = g_ptr_array_new_with_free_func (g_free);
+  while (TRUE)
+    {
+      struct dirent *dent = NULL;
+      if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, cancellable, error))
+        return FALSE;
+      if (!dent)
+        break;
+      g_ptr_array_add (names, g_strdup (dent->d_name));
+    }
+  /* Directory order isn't stable */
+  g_ptr_array_sort (names, compare_strings);
+
+  for (guint i = 0; i < names->len; i++)
+    {
+      auto name = static_cast<const char *> (names->pdata[i]);
+      struct stat stbuf;
+      if (!glnx_fstatat (dfd_iter.fd, name, &stbuf, AT_SYMLINK_NOFOLLOW, error))
+        return FALSE;
+      g_autofree char *entry = g_strdup_printf ("%s/%s:%o:%u:%u", path, name, stbuf.st_mode,
+                                                stbuf.st_uid, stbuf.st_gid);
+      rpmostree_hasher_update (checksum, (const guint8 *)entry, strlen (entry) + 1);
+      if (S_ISDIR (stbuf.st_mode))
+        {
+          g_autofree char *subpath = g_build_filename (path, name, NULL);
+          if (!hash_rootfs_contents (checksum, dfd, subpath, cancellable, error))
+            return FALSE;
+        }
+      else if (S_ISLNK (stbuf.st_mode))
+        {
+          g_autofree char *target = glnx_readlinkat_malloc (dfd_iter.fd, name, cancellable, error);
+          if (!target)
+            return FALSE;
+          rpmostree_hasher_update (checksum, (const guint8 *)target, strlen (target) + 1);
+        }
+      else if (S_ISREG (stbuf.st_mode))
+        {
+          glnx_autofd int fd = -1;
+          if (!glnx_openat_rdonly (dfd_iter.fd, name, FALSE, &fd, error))
+            return FALSE;
+          g_autoptr (GBytes) data = glnx_fd_readall_bytes (fd, cancellable, error);
+          if (!data)
+            return FALSE;
+          gsize len;
+          auto buf = static_cast<const guint8 *> (g_bytes_get_data (data, &len));
+          rpmostree_hasher_update (checksum, buf, len);
+        }
+    }
+  return TRUE;
+}
+
+/* This identifies the rootfs at the end of installation: the parts of the
+ * treefile that installation uses, the solved package set, and whatever is in
+ * the rootfs beforehand (i.e. the passwd data we injected). */
+static char *
+compute_install_digest (RpmOstreeTreeComposeContext *self, int rootfs_dfd,
+                        GCancellable *cancellable, GError **error)
+{
+  g_autoptr (RpmOstreeHasher) checksum = rpmostree_hasher_new (G_CHECKSUM_SHA256);
+  /* Scripts run differently from one version to the next */
+  rpmostree_hasher_update (checksum, (const guint8 *)PACKAGE_VERSION, strlen (PACKAGE_VERSION));
+  rpmostree_hasher_update (checksum, (const guint8 *)(self->unified_core_and_fuse ? "1" : "0"), 1);
+
+  CXX_TRY_VAR (tf_checksum, (*self->treefile_rs)->get_install_checksum (*self->repo), error);
+  rpmostree_hasher_update (checksum, (const guint8 *)tf_checksum.data (), tf_checksum.size ());
+  DnfContext *dnfctx = rpmostree_context_get_dnf (self->corectx);
+  if (!rpmostree_dnf_add_checksum_goal (checksum, dnf_context_get_goal (dnfctx),
+                                        self->pkgcache_repo, error))
+    return NULL;
+  if (!hash_rootfs_contents (checksum, rootfs_dfd, ".", cancellable, error))
+    return NULL;
+
+  return g_strdup (rpmostree_hasher_get_string (checksum));
+}
+
+/* USER mode checkouts don't restore the ownership of directories and
+ * symlinks (files are hardlinks, and carry theirs in the objects), which the
+ * commit and the /var conversion pick up from disk. */
+static gboolean
+restore_install_cache_ownership (int rootfs_dfd, GFile *dir, const char *path,
+                                 GCancellable *cancellable, GError **error)
+{
+  g_autoptr (GFileEnumerator) direnum = g_file_enumerate_children (
+      dir, "standard::name,standard::type,unix::uid,unix::gid",
+      G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, cancellable, error);
+  if (!direnum)
+    return FALSE;
+  while (TRUE)
+    {
+      GFileInfo *info = NULL;
+      GFile *child = NULL;
+      if (!g_file_enumerator_iterate (direnum, &info, &child, cancellable, error))
+        return FALSE;
+      if (!info)
+        break;
+      const GFileType type = g_file_info_get_file_type (info);
+      if (type != G_FILE_TYPE_DIRECTORY && type != G_FILE_TYPE_SYMBOLIC_LINK)
+        continue;
+
+      g_autofree char *subpath = g_build_filename (path, g_file_info_get_name (info), NULL);
+      const uid_t uid = g_file_info_get_attribute_uint32 (info, "unix::uid");
+      const gid_t gid = g_file_info_get_attribute_uint32 (info, "unix::gid");
+      if ((uid != getuid () || gid != getgid ())
+          && fchownat (rootfs_dfd, subpath, uid, gid, AT_SYMLINK_NOFOLLOW) < 0)
+        return glnx_throw_errno_prefix (error, "fchownat(%s)", subpath);
+      if (type == G_FILE_TYPE_DIRECTORY
+          && !restore_install_cache_ownership (rootfs_dfd, child, subpath, cancellable, error))
+        return FALSE;
+    }
+  return TRUE;
+}
+
+/* Check out the cached install @rev over @rootfs_dfd, which has just the
+ * passwd data it was computed from. */
+static gboolean
+restore_install_cache (RpmOstreeTreeComposeContext *self, int rootfs_dfd, const char *rev,
+                       GCancellable *cancellable, GError **error)
+{
+  GLNX_AUTO_PREFIX_ERROR ("Restoring cached install", error);
+  g_print ("Using cached install %s\n", rev);
+
+  OstreeRepoCheckoutAtOptions opts = { OSTREE_REPO_CHECKOUT_MODE_USER,
+                                       OSTREE_REPO_CHECKOUT_OVERWRITE_UNION_FILES };
+  opts.devino_to_csum_cache = self->devino_cache;
+  opts.no_copy_fallback = TRUE;
+  /* Same as the package checkouts; see checkout_package() */
+  opts.force_copy_zerosized = !self->unified_core_and_fuse;
+  if (!ostree_repo_checkout_at (self->pkgcache_repo, &opts, rootfs_dfd, ".", rev, cancellable,
+                                error))
+    return FALSE;
+
+  g_autoptr (GFile) root = NULL;
+  if (!ostree_repo_read_commit (self->pkgcache_repo, rev, &root, NULL, cancellable, error))
+    return FALSE;
+  if (!restore_install_cache_ownership (rootfs_dfd, root, ".", cancellable, error))
+    return FALSE;
+
+  /* Scripts in postprocessing may modify the checked out files without FUSE;
+   * see rpmostree_context_get_devino_stamp() */
+  if (!rpmostree_ctime_stamp_at (rootfs_dfd, &self->devino_stamp, error))
+    return FALSE;
+  self->have_devino_stamp = TRUE;
+
+  g_autoptr (GVariant) commit = NULL;
+  if (!ostree_repo_load_commit (self->pkgcache_repo, rev, &commit, NULL, error))
+    return FALSE;
+  g_autoptr (GVariant) commit_metadata = g_variant_get_child_value (commit, 0);
+  g_autoptr (GVariant) script_timings
+      = g_variant_lookup_value (commit_metadata, RPMOSTREE_SCRIPTS_TIMING_KEY, NULL);
+  if (script_timings)
+    g_hash_table_replace (self->metadata, g_strdup (RPMOSTREE_SCRIPTS_TIMING_KEY),
+                          util::move_nullify (script_timings));
+  return TRUE;
+}
+
+/* Snapshot the assembled @rootfs_dfd into the install cache as @digest,
+ * replacing any previous one. */
+static gboolean
+write_install_cache (RpmOstreeTreeComposeContext *self, int rootfs_dfd, const char *digest,
+                     GCancellable *cancellable, GError **error)
+{
+  GLNX_AUTO_PREFIX_ERROR ("Caching install", error);
+
+  g_autoptr (GVariantDict) metadata_dict = g_variant_dict_new (NULL);
+  g_autoptr (GVariant) script_timings = rpmostree_context_get_script_timings (self->corectx);
+  if (script_timings)
+    g_variant_dict_insert_value (metadata_dict, RPMOSTREE_SCRIPTS_TIMING_KEY, script_timings);
+  g_autoptr (GVariant) metadata = g_variant_ref_sink (g_variant_dict_end (metadata_dict));
+
+  g_auto (RpmOstreeRepoAutoTransaction) txn = {
+    0,
+  };
+  if (!rpmostree_repo_auto_transaction_start (&txn, self->pkgcache_repo, FALSE, cancellable,
+                                              error))
+    return FALSE;
+
+  struct timespec devino_stamp;
+  gboolean have_devino_stamp = rpmostree_context_get_devino_stamp (self->corectx, &devino_stamp);
+  g_autofree char *rev = NULL;
+  if (!rpmostree_compose_commit_snapshot (rootfs_dfd, self->pkgcache_repo, get_selinux_mode (self),
+                                          self->devino_cache,
+                                          have_devino_stamp ? &devino_stamp : NULL,
+                                          rpmostree_context_get_deferred_ownership (self->corectx),
+                                          metadata, &rev, cancellable, error))
+    return FALSE;
+
+  g_autoptr (GHashTable) refs = NULL;
+  if (!ostree_repo_list_refs_ext (self->pkgcache_repo, INSTALL_CACHE_REF_PREFIX, &refs,
+                                  OSTREE_REPO_LIST_REFS_EXT_NONE, cancellable, error))
+    return FALSE;
+  GLNX_HASH_TABLE_FOREACH (refs, const char *, ref)
+    ostree_repo_transaction_set_ref (self->pkgcache_repo, NULL, ref, NULL);
+  g_autofree char *ref = g_strconcat (INSTALL_CACHE_REF_PREFIX, digest, NULL);
+  ostree_repo_transaction_set_ref (self->pkgcache_repo, NULL, ref, rev);
+
+  if (!ostree_repo_commit_transaction (self->pkgcache_repo, NULL, cancellable, error))
+    return FALSE;
+  txn.initialized = FALSE;
   return TRUE;
 }
 
@@ -337,6 +604,17 @@ install_packages (RpmOstreeTreeComposeContext *self, gboolean *out_unmodified,
   rpmostree_context_set_dnf_caching (self->corectx, opt_cache_only
                                                         ? RPMOSTREE_CONTEXT_DNF_CACHE_FOREVER
                                                         : RPMOSTREE_CONTEXT_DNF_CACHE_NEVER);
+  /* Build servers running many composes against the same repos can opt into
+   * a short freshness window, which also means the sack is rebuilt from the
+   * cached solv files rather than reimported. */
+  if (opt_metadata_max_age > 0)
+    rpmostree_context_set_dnf_max_cache_age (self->corectx, opt_metadata_max_age);
+
+  if (opt_max_downloads > 0 || opt_max_downloads_per_repo > 0)
+    rpmostree_context_set_download_concurrency (
+        self->corectx,
+        opt_max_downloads > 0 ? opt_max_downloads : RPMOSTREE_DEFAULT_MAX_DOWNLOADS,
+        MAX (opt_max_downloads_per_repo, 0));
 
   {
     g_autofree char *tmprootfs_abspath = glnx_fdrel_abspath (rootfs_dfd, ".");
@@ -372,16 +650,26 @@ install_packages (RpmOstreeTreeComposeContext *self, gboolean *out_unmodified,
           rpmostree_context_disable_rofiles (self->corectx);
         }
       else
-        {
-          self->unified_core_and_fuse = TRUE;
-          /* We also only enable the devino cache if we know we have the FUSE protection
-           * against mutation of the underlying files.
-           */
-          self->devino_cache = ostree_repo_devino_cache_new ();
-          rpmostree_context_set_devino_cache (self->corectx, self->devino_cache);
-        }
+        self->unified_core_and_fuse = TRUE;
+
+      /* Without the FUSE protection against mutation of the underlying files,
+       * the commit only trusts the cache for files that haven't changed since
+       * they were checked out; see rpmostree_context_get_devino_stamp().
+       */
+      self->devino_cache = ostree_repo_devino_cache_new ();
+      rpmostree_context_set_devino_cache (self->corectx, self->devino_cache);
 
       rpmostree_context_set_repos (self->corectx, self->build_repo, self->pkgcache_repo);
+
+      if (opt_shared_noarch_pkgcache && !opt_dry_run)
+        {
+          g_autoptr (OstreeRepo) shared_repo
+              = ostree_repo_create_at (AT_FDCWD, opt_shared_noarch_pkgcache,
+                                       OSTREE_REPO_MODE_BARE_USER, NULL, cancellable, error);
+          if (!shared_repo)
+            return glnx_prefix_error (error, "Opening shared noarch pkgcache");
+          rpmostree_context_set_shared_noarch_repo (self->corectx, shared_repo);
+        }
     }
   else
     {
@@ -397,8 +685,50 @@ install_packages (RpmOstreeTreeComposeContext *self, gboolean *out_unmodified,
         }
     }
 
+  /* This is what rpmostree_context_prepare() would do first anyway */
+  if (!rpmostree_context_download_metadata (
+          self->corectx, DNF_CONTEXT_SETUP_SACK_FLAG_LOAD_UPDATEINFO, cancellable, error))
+    return FALSE;
+  g_autofree char *presolve_inputhash
+      = rpmostree_context_get_presolve_digest (self->corectx, G_CHECKSUM_SHA256, error);
+  if (!presolve_inputhash)
+    return FALSE;
+  g_hash_table_replace (self->metadata, g_strdup ("rpmostree.presolve-inputhash"),
+                        g_variant_ref_sink (g_variant_new_string (presolve_inputhash)));
+
+  /* If the previous commit was made from the same depsolve inputs, we know
+   * its input state hash without depsolving; that's what the check below
+   * would compare anyway. We still need the transaction for a lockfile. */
+  if (self->previous_checksum && out_unmodified != NULL && !opt_previous_inputhash
+      && !opt_write_lockfile_to)
+    {
+      g_autofree char *previous_presolve_inputhash = NULL;
+      g_autofree char *previous_inputhash = NULL;
+      if (!inputhash_from_commit (self->repo, self->previous_checksum,
+                                  "rpmostree.presolve-inputhash", &previous_presolve_inputhash,
+                                  error))
+        return FALSE;
+      if (!inputhash_from_commit (self->repo, self->previous_checksum, "rpmostree.inputhash",
+                                  &previous_inputhash, error))
+        return FALSE;
+      if (previous_inputhash && g_strcmp0 (previous_presolve_inputhash, presolve_inputhash) == 0)
+        {
+          g_print ("Depsolve inputs unchanged\n");
+          g_print ("Input state hash: %s\n", previous_inputhash);
+          *out_new_inputhash = util::move_nullify (previous_inputhash);
+          *out_unmodified = TRUE;
+          return TRUE; /* NB: early return */
+        }
+    }
+
+  const gint64 depsolve_start_time = g_get_monotonic_time ();
   if (!rpmostree_context_prepare (self->corectx, cancellable, error))
     return FALSE;
+  {
+    g_autoptr (GPtrArray) pkgs = rpmostree_context_get_packages (self->corectx);
+    rpmostree_context_add_phase_timing (self->corectx, "depsolve", depsolve_start_time, 0,
+                                        pkgs->len);
+  }
 
   rpmostree_print_transaction (dnfctx);
 
@@ -436,7 +766,8 @@ install_packages (RpmOstreeTreeComposeContext *self, gboolean *out_unmodified,
   else if (self->previous_checksum && out_unmodified != NULL)
     {
       g_autofree char *previous_inputhash = NULL;
-      if (!inputhash_from_commit (self->repo, self->previous_checksum, &previous_inputhash, error))
+      if (!inputhash_from_commit (self->repo, self->previous_checksum, "rpmostree.inputhash",
+                                  &previous_inputhash, error))
         return FALSE;
 
       if (previous_inputhash)
@@ -456,15 +787,28 @@ install_packages (RpmOstreeTreeComposeContext *self, gboolean *out_unmodified,
 
   CXX_TRY ((*self->treefile_rs)->sanitycheck_externals (), error);
 
+  if (opt_download_import_budget >= 0)
+    rpmostree_context_set_download_import_budget (self->corectx, opt_download_import_budget);
+  if (opt_import_concurrency >= 0)
+    rpmostree_context_set_import_concurrency (self->corectx, opt_import_concurrency);
+  if (opt_stream_downloads)
+    rpmostree_context_set_stream_downloads (self->corectx, TRUE);
+
   /* --- Downloading packages --- */
-  if (!rpmostree_context_download (self->corectx, cancellable, error))
-    return FALSE;
+  /* In the unified core path we import too; pipeline the two, unless only
+   * the RPMs themselves were requested */
+  const gboolean pipeline_import = opt_unified_core && !opt_download_only_rpms;
+  if (!pipeline_import)
+    {
+      if (!rpmostree_context_download (self->corectx, cancellable, error))
+        return FALSE;
+    }
 
   if (opt_download_only || opt_download_only_rpms)
     {
-      if (opt_unified_core && !opt_download_only_rpms)
+      if (pipeline_import)
         {
-          if (!rpmostree_context_import (self->corectx, cancellable, error))
+          if (!rpmostree_context_download_and_import (self->corectx, cancellable, error))
             return FALSE;
         }
       return TRUE; /* 🔚 Early return */
@@ -477,9 +821,31 @@ install_packages (RpmOstreeTreeComposeContext *self, gboolean *out_unmodified,
                                         std::string (previous_ref), opt_unified_core),
               error);
 
-  if (opt_unified_core)
+  /* Restoring the ownership of directories requires privileges */
+  const gboolean use_install_cache
+      = opt_unified_core && opt_cachedir && !opt_force_nocache && getuid () == 0;
+  g_autofree char *install_digest = NULL;
+  g_autofree char *cached_install = NULL;
+  if (use_install_cache)
+    {
+      install_digest = compute_install_digest (self, rootfs_dfd, cancellable, error);
+      if (!install_digest)
+        return FALSE;
+      g_autofree char *ref = g_strconcat (INSTALL_CACHE_REF_PREFIX, install_digest, NULL);
+      if (!ostree_repo_resolve_rev (self->pkgcache_repo, ref, TRUE, &cached_install, error))
+        return FALSE;
+    }
+
+  if (cached_install)
+    {
+      const gint64 start_time = g_get_monotonic_time ();
+      if (!restore_install_cache (self, rootfs_dfd, cached_install, cancellable, error))
+        return FALSE;
+      rpmostree_context_add_phase_timing (self->corectx, "checkout", start_time, 0, 1);
+    }
+  else if (opt_unified_core)
     {
-      if (!rpmostree_context_import (self->corectx, cancellable, error))
+      if (!rpmostree_context_download_and_import (self->corectx, cancellable, error))
         return FALSE;
       rpmostree_context_set_tmprootfs_dfd (self->corectx, rootfs_dfd);
       if (!rpmostree_context_assemble (self->corectx, cancellable, error))
@@ -496,6 +862,10 @@ install_packages (RpmOstreeTreeComposeContext *self, gboolean *out_unmodified,
 
       if (!rpmostree_context_force_relabel (self->corectx, cancellable, error))
         return FALSE;
+
+      if (install_digest
+          && !write_install_cache (self, rootfs_dfd, install_digest, cancellable, error))
+        return FALSE;
     }
   else
     {
@@ -760,9 +1130,11 @@ rpm_ostree_compose_context_new (const char *treefile_pathstr, const char *basear
 
   if (opt_lockfiles)
     {
-      if (!rpmostree_context_set_lockfile (self->corectx, opt_lockfiles, opt_lockfile_strict,
-                                           error))
+      if (!rpmostree_context_set_lockfile (self->corectx, opt_lockfiles,
+                                           opt_lockfile_strict || opt_lockfile_exact, error))
         return FALSE;
+      if (opt_lockfile_exact)
+        rpmostree_context_set_lockfile_exact (self->corectx);
       g_print ("Loaded lockfiles:\n  %s\n", g_strjoinv ("\n  ", opt_lockfiles));
     }
 
@@ -1041,6 +1413,11 @@ impl_install_tree (RpmOstreeTreeComposeContext *self, gboolean *out_changed,
   if (!inject_advisories (self, cancellable, error))
     return FALSE;
 
+  /* So slow composes can be tracked down to the scripts responsible */
+  GVariant *script_timings = rpmostree_context_get_script_timings (self->corectx);
+  if (script_timings)
+    g_hash_table_insert (self->metadata, g_strdup (RPMOSTREE_SCRIPTS_TIMING_KEY), script_timings);
+
   rpmostree_context_prepare_commit (self->corectx);
 
   if (g_strcmp0 (g_getenv ("RPM_OSTREE_BREAK"), "post-yum") == 0)
@@ -1088,45 +1465,14 @@ impl_install_tree (RpmOstreeTreeComposeContext *self, gboolean *out_changed,
   return TRUE;
 }
 
-/* See canonical version of this in ot-builtin-pull.c */
-static void
-noninteractive_console_progress_changed (OstreeAsyncProgress *progress, gpointer user_data)
-{
-  /* We do nothing here - we just want the final status */
-}
-
 static gboolean
 pull_local_into_target_repo (OstreeRepo *src_repo, OstreeRepo *dest_repo, const char *checksum,
                              GCancellable *cancellable, GError **error)
 {
-  const char *refs[] = { checksum, NULL };
-
-  /* really should enhance the pull API so we can just pass the src OstreeRepo directly */
-  g_autofree char *src_repo_uri
-      = g_strdup_printf ("file:///proc/self/fd/%d", ostree_repo_get_dfd (src_repo));
-
-  g_auto (GLnxConsoleRef) console = {
-    0,
-  };
-  glnx_console_lock (&console);
-  g_autoptr (OstreeAsyncProgress) progress = ostree_async_progress_new_and_connect (
-      console.is_tty ? ostree_repo_pull_default_console_progress_changed
-                     : noninteractive_console_progress_changed,
-      &console);
-
-  /* no fancy flags here, so just use the old school simpler API */
-  if (!ostree_repo_pull (dest_repo, src_repo_uri, (char **)refs,
-                         static_cast<OstreeRepoPullFlags> (0), progress, cancellable, error))
+  /* Both repos are local and ours, so skip the pull machinery (fetcher,
+   * summary, per-object verification) and copy the objects directly */
+  if (!rpmostree_repo_import_commit (dest_repo, src_repo, checksum, cancellable, error))
     return glnx_prefix_error (error, "Failed to pull-local %s", checksum);
-
-  if (!console.is_tty)
-    {
-      const char *status = ostree_async_progress_get_status (progress);
-      if (status)
-        g_print ("%s\n", status);
-    }
-  ostree_async_progress_finish (progress);
-
   return TRUE;
 }
 
@@ -1154,11 +1500,13 @@ impl_commit_tree (RpmOstreeTreeComposeContext *self, GCancellable *cancellable,
     return FALSE;
   g_autoptr (GVariant) detached_metadata
       = rpmostree_composeutil_finalize_detached_metadata (self->detached_metadata);
+  const gint64 postprocess_start_time = g_get_monotonic_time ();
   if (!rpmostree_rootfs_postprocess_common (self->rootfs_dfd, cancellable, error))
     return FALSE;
   if (!rpmostreecxx::postprocess_final (self->rootfs_dfd, **self->treefile_rs,
                                         self->unified_core_and_fuse, cancellable, error))
     return FALSE;
+  rpmostree_context_add_phase_timing (self->corectx, "postprocess", postprocess_start_time, 0, 0);
 
   if (self->treefile_rs)
     {
@@ -1210,20 +1558,17 @@ impl_commit_tree (RpmOstreeTreeComposeContext *self, GCancellable *cancellable,
   if (!gpgkey.empty ())
     gpgkey_c = gpgkey.c_str ();
   auto container = (*self->treefile_rs)->get_container ();
-  RpmOstreeSELinuxMode selinux_mode;
-  {
-    auto selinux = (*self->treefile_rs)->get_selinux ();
-    auto selinux_label_version = (*self->treefile_rs)->get_selinux_label_version ();
-    if (selinux && selinux_label_version == 1)
-      selinux_mode = RPMOSTREE_SELINUX_MODE_V1;
-    else if (selinux)
-      selinux_mode = RPMOSTREE_SELINUX_MODE_V0;
-    else
-      selinux_mode = RPMOSTREE_SELINUX_MODE_DISABLED;
-  }
+  RpmOstreeSELinuxMode selinux_mode = get_selinux_mode (self);
+  struct timespec devino_stamp = self->devino_stamp;
+  gboolean have_devino_stamp = self->have_devino_stamp
+                               || rpmostree_context_get_devino_stamp (self->corectx, &devino_stamp);
+  const gint64 commit_start_time = g_get_monotonic_time ();
   if (!rpmostree_compose_commit (self->rootfs_dfd, self->build_repo, parent_revision, metadata,
                                  detached_metadata, gpgkey_c, container, selinux_mode,
-                                 self->devino_cache, &new_revision, cancellable, error))
+                                 opt_low_memory_commit, self->devino_cache,
+                                 have_devino_stamp ? &devino_stamp : NULL,
+                                 rpmostree_context_get_deferred_ownership (self->corectx),
+                                 &new_revision, cancellable, error))
     return glnx_prefix_error (error, "Writing commit");
   g_assert (new_revision != NULL);
 
@@ -1239,6 +1584,8 @@ impl_commit_tree (RpmOstreeTreeComposeContext *self, GCancellable *cancellable,
       statsp = &stats;
       rpmostreecxx::print_ostree_txn_stats (stats);
     }
+  rpmostree_context_add_phase_timing (self->corectx, "commit", commit_start_time,
+                                      stats.content_bytes_written, stats.content_objects_written);
 
   if (!opt_unified_core)
     g_assert (self->repo == self->build_repo);
@@ -1271,10 +1618,13 @@ impl_commit_tree (RpmOstreeTreeComposeContext *self, GCancellable *cancellable,
 
   /* Optionally write a JSON summary of this compose-commit run */
   if (opt_write_composejson_to)
-    if (!rpmostree_composeutil_write_composejson (self->repo, opt_write_composejson_to, statsp,
-                                                  new_revision, new_commit, new_ref, cancellable,
-                                                  error))
-      return glnx_prefix_error (error, "Failed to write composejson");
+    {
+      g_autoptr (GVariant) phase_timings = rpmostree_context_get_phase_timings (self->corectx);
+      if (!rpmostree_composeutil_write_composejson (self->repo, opt_write_composejson_to, statsp,
+                                                    new_revision, new_commit, new_ref,
+                                                    phase_timings, cancellable, error))
+        return glnx_prefix_error (error, "Failed to write composejson");
+    }
 
   if (opt_write_commitid_to)
     ROSCXX_TRY (write_commit_id (opt_write_commitid_to, new_revision), error);
@@ -1503,6 +1853,68 @@ rpmostree_compose_builtin_tree (int argc, char **argv, RpmOstreeCommandInvocatio
   return TRUE;
 }
 
+typedef struct
+{
+  int dfd;
+  GCancellable *cancellable;
+  GMutex lock;
+  GError *error;
+} CopyPackagesData;
+
+static void
+copy_package_worker (gpointer data, gpointer user_data)
+{
+  auto pkg = static_cast<DnfPackage *> (data);
+  auto cdata = static_cast<CopyPackagesData *> (user_data);
+  {
+    g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&cdata->lock);
+    if (cdata->error)
+      return;
+  }
+
+  const char *src = dnf_package_get_filename (pkg);
+  GLnxFileCopyFlags flags
+      = static_cast<GLnxFileCopyFlags> (GLNX_FILE_COPY_NOXATTRS | GLNX_FILE_COPY_NOCHOWN);
+  g_autoptr (GError) local_error = NULL;
+  if (!glnx_file_copy_at (AT_FDCWD, src, NULL, cdata->dfd, glnx_basename (src), flags,
+                          cdata->cancellable, &local_error))
+    {
+      g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&cdata->lock);
+      if (!cdata->error)
+        cdata->error = util::move_nullify (local_error);
+    }
+}
+
+/* Copy the RPMs of @pkgs into @dfd, each once, from multiple threads. */
+static gboolean
+copy_packages_to_dir (GPtrArray *pkgs, int dfd, GCancellable *cancellable, GError **error)
+{
+  CopyPackagesData cdata = { dfd, cancellable };
+  g_mutex_init (&cdata.lock);
+  GThreadPool *pool
+      = g_thread_pool_new (copy_package_worker, &cdata, g_get_num_processors (), TRUE, error);
+  if (!pool)
+    return FALSE;
+  g_autoptr (GHashTable) seen = g_hash_table_new (g_str_hash, g_str_equal);
+  gboolean pushed = TRUE;
+  for (guint i = 0; i < pkgs->len && pushed; i++)
+    {
+      auto pkg = static_cast<DnfPackage *> (pkgs->pdata[i]);
+      if (g_hash_table_add (seen, (gpointer)glnx_basename (dnf_package_get_filename (pkg))))
+        pushed = g_thread_pool_push (pool, pkg, error);
+    }
+  g_thread_pool_free (pool, !pushed, TRUE);
+  g_mutex_clear (&cdata.lock);
+  if (!pushed)
+    return FALSE;
+  if (cdata.error)
+    {
+      g_propagate_error (error, util::move_nullify (cdata.error));
+      return FALSE;
+    }
+  return TRUE;
+}
+
 gboolean
 rpmostree_compose_builtin_extensions (int argc, char **argv, RpmOstreeCommandInvocation *invocation,
                                       GCancellable *cancellable, GError **error)
@@ -1705,22 +2117,6 @@ rpmostree_compose_builtin_extensions (int argc, char **argv, RpmOstreeCommandInv
       return TRUE;
     }
 
-  if (!rpmostree_context_download (ctx, cancellable, error))
-    return FALSE;
-
-  g_autoptr (GPtrArray) extensions_pkgs = rpmostree_context_get_packages (ctx);
-  for (guint i = 0; i < extensions_pkgs->len; i++)
-    {
-      DnfPackage *pkg = (DnfPackage *)extensions_pkgs->pdata[i];
-      const char *src = dnf_package_get_filename (pkg);
-      const char *basename = glnx_basename (src);
-      GLnxFileCopyFlags flags
-          = static_cast<GLnxFileCopyFlags> (GLNX_FILE_COPY_NOXATTRS | GLNX_FILE_COPY_NOCHOWN);
-      if (!glnx_file_copy_at (AT_FDCWD, dnf_package_get_filename (pkg), NULL, output_dfd, basename,
-                              flags, cancellable, error))
-        return FALSE;
-    }
-
   /* This is hacky: for "development" extensions, we don't want any depsolving
    * against the base OS. Rather than awkwardly teach the core about this, we
    * just reuse its sack and keep all the functionality here. */
@@ -1742,22 +2138,20 @@ rpmostree_compose_builtin_extensions (int argc, char **argv, RpmOstreeCommandInv
       g_ptr_array_add (devel_pkgs_to_download, g_object_ref (found_pkg));
     }
 
-  rpmostree_set_repos_on_packages (dnfctx, devel_pkgs_to_download);
-
-  if (!rpmostree_download_packages (devel_pkgs_to_download, cancellable, error))
+  /* Fetch everything in one go, rather than the development packages after
+   * the rest; they often overlap. */
+  rpmostree_context_add_downloads (ctx, devel_pkgs_to_download);
+  if (!rpmostree_context_download (ctx, cancellable, error))
     return FALSE;
 
+  g_autoptr (GPtrArray) extensions_pkgs = rpmostree_context_get_packages (ctx);
+  g_autoptr (GPtrArray) output_pkgs = g_ptr_array_new ();
+  for (guint i = 0; i < extensions_pkgs->len; i++)
+    g_ptr_array_add (output_pkgs, extensions_pkgs->pdata[i]);
   for (guint i = 0; i < devel_pkgs_to_download->len; i++)
-    {
-      DnfPackage *pkg = (DnfPackage *)devel_pkgs_to_download->pdata[i];
-      const char *src = dnf_package_get_filename (pkg);
-      const char *basename = glnx_basename (src);
-      GLnxFileCopyFlags flags
-          = static_cast<GLnxFileCopyFlags> (GLNX_FILE_COPY_NOXATTRS | GLNX_FILE_COPY_NOCHOWN);
-      if (!glnx_file_copy_at (AT_FDCWD, dnf_package_get_filename (pkg), NULL, output_dfd, basename,
-                              flags, cancellable, error))
-        return FALSE;
-    }
+    g_ptr_array_add (output_pkgs, devel_pkgs_to_download->pdata[i]);
+  if (!copy_packages_to_dir (output_pkgs, output_dfd, cancellable, error))
+    return FALSE;
 
   // XXX: account for development extensions
   CXX_TRY (extensions->update_state_checksum (state_checksum, opt_extensions_output_dir), error);
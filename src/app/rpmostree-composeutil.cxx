@@ -41,6 +41,7 @@
 #include "rpmostree-libbuiltin.h"
 #include "rpmostree-package-variants.h"
 #include "rpmostree-rpm-util.h"
+#include "rpmostree-scripts.h"
 #include "rpmostree-util.h"
 
 gboolean
@@ -118,6 +119,13 @@ rpmostree_composeutil_finalize_metadata (GHashTable *metadata, int rootfs_dfd, G
     return FALSE;
   g_variant_builder_add (builder, "{sv}", "rpmostree.rpmdb.pkglist", rpmdb_v);
 
+  /* and the packages with file triggers, so clients layering on top don't
+   * need to look at every header to find them */
+  g_autoptr (GVariant) triggers_v = NULL;
+  if (!rpmostree_transfiletriggers_build_index (rootfs_dfd, &triggers_v, error))
+    return FALSE;
+  g_variant_builder_add (builder, "{sv}", RPMOSTREE_TRANSFILETRIGGERS_INDEX_KEY, triggers_v);
+
   return metadata_conversion_end (builder);
 }
 
@@ -134,14 +142,15 @@ rpmostree_composeutil_finalize_detached_metadata (GHashTable *detached_metadata)
 }
 
 /* Implements --write-composejson-to, and also prints values.
- * If `path` is NULL, we'll just print some data.
+ * If `path` is NULL, we'll just print some data. @phase_timings is
+ * from rpmostree_context_get_phase_timings(), and may be NULL.
  */
 gboolean
 rpmostree_composeutil_write_composejson (OstreeRepo *repo, const char *path,
                                          const OstreeRepoTransactionStats *stats,
                                          const char *new_revision, GVariant *new_commit,
-                                         const char *new_ref, GCancellable *cancellable,
-                                         GError **error)
+                                         const char *new_ref, GVariant *phase_timings,
+                                         GCancellable *cancellable, GError **error)
 {
   g_autoptr (GVariant) new_commit_inline_meta = g_variant_get_child_value (new_commit, 0);
 
@@ -199,6 +208,15 @@ rpmostree_composeutil_write_composejson (OstreeRepo *repo, const char *path,
     g_variant_builder_add (&builder, "{sv}", "rpm-ostree-inputhash",
                            g_variant_new_string (inputhash));
 
+  g_autoptr (GVariant) script_timings = g_variant_lookup_value (
+      new_commit_inline_meta, RPMOSTREE_SCRIPTS_TIMING_KEY, G_VARIANT_TYPE ("aa{sv}"));
+  if (script_timings)
+    g_variant_builder_add (&builder, "{sv}", "scripts-timing", script_timings);
+
+  /* Where the time went, for tracking regressions across builds */
+  if (phase_timings)
+    g_variant_builder_add (&builder, "{sv}", "phase-timing", phase_timings);
+
   g_autofree char *parent_revision = ostree_commit_get_parent (new_commit);
   if (path && parent_revision)
     {
@@ -40,7 +40,7 @@ GVariant *rpmostree_composeutil_finalize_detached_metadata (GHashTable *detached
 gboolean rpmostree_composeutil_write_composejson (OstreeRepo *repo, const char *path,
                                                   const OstreeRepoTransactionStats *stats,
                                                   const char *new_revision, GVariant *new_commit,
-                                                  const char *new_ref, GCancellable *cancellable,
-                                                  GError **error);
+                                                  const char *new_ref, GVariant *phase_timings,
+                                                  GCancellable *cancellable, GError **error);
 
 G_END_DECLS
@@ -20,12 +20,12 @@
 
 #include "config.h"
 
-#include <gio/gunixoutputstream.h>
 #include <glib-unix.h>
-#include <json-glib/json-glib.h>
 
 #include "rpmostree-db-builtins.h"
+#include "rpmostree-json-writer.h"
 #include "rpmostree-libbuiltin.h"
+#include "rpmostree-package-priv.h"
 #include "rpmostree-package-variants.h"
 #include "rpmostree-rpm-util.h"
 #include "rpmostree.h"
@@ -48,6 +48,152 @@ static GOptionEntry option_entries[] = {
   { NULL }
 };
 
+typedef struct
+{
+  gint i_from;
+  gint i_to;
+} ModifiedPair;
+
+/* State of print_diff_stream(). Only the differences for the current name
+ * are kept, since those get merged by version before being written out;
+ * everything before them already has been. */
+typedef struct
+{
+  RpmOstreePackageList *from;
+  RpmOstreePackageList *to;
+  const char *name;
+  GArray *removed; /* indices into @from */
+  GArray *added;   /* indices into @to */
+  GArray *modified;
+  GString *buf;
+  gboolean closed;
+  GError *error;
+} DiffStream;
+
+/* Like _rpm_ostree_package_list_cmp_at(), with -1 for the end of a list,
+ * which sorts last */
+static int
+diff_stream_cmp_end (RpmOstreePackageList *list_a, gint i_a, RpmOstreePackageList *list_b,
+                     gint i_b)
+{
+  if (i_b < 0)
+    return -1;
+  if (i_a < 0)
+    return +1;
+  return _rpm_ostree_package_list_cmp_at (list_a, i_a, list_b, i_b);
+}
+
+static void
+diff_stream_append (DiffStream *stream, char prefix, RpmOstreePackageList *list, gint i)
+{
+  g_string_append_c (stream->buf, prefix);
+  _rpm_ostree_package_list_append_nevra (list, i, stream->buf);
+  g_string_append_c (stream->buf, '\n');
+}
+
+static gboolean
+diff_stream_flush (DiffStream *stream)
+{
+  const guint an = stream->added->len;
+  const guint rn = stream->removed->len;
+  const guint mn = stream->modified->len;
+
+  g_string_truncate (stream->buf, 0);
+  guint cur_a = 0;
+  guint cur_r = 0;
+  guint cur_m = 0;
+  while (cur_a < an || cur_r < rn || cur_m < mn)
+    {
+      const gint i_a = cur_a < an ? g_array_index (stream->added, gint, cur_a) : -1;
+      const gint i_r = cur_r < rn ? g_array_index (stream->removed, gint, cur_r) : -1;
+      const ModifiedPair *m
+          = cur_m < mn ? &g_array_index (stream->modified, ModifiedPair, cur_m) : NULL;
+      const gint i_m = m ? m->i_from : -1;
+
+      if (diff_stream_cmp_end (stream->from, i_m, stream->from, i_r) < 0
+          && diff_stream_cmp_end (stream->from, i_m, stream->to, i_a) < 0)
+        {
+          diff_stream_append (stream, '!', stream->from, m->i_from);
+          diff_stream_append (stream, '=', stream->to, m->i_to);
+          cur_m++;
+        }
+      else if (diff_stream_cmp_end (stream->from, i_m, stream->from, i_r) >= 0
+               && diff_stream_cmp_end (stream->from, i_r, stream->to, i_a) < 0)
+        {
+          diff_stream_append (stream, '-', stream->from, i_r);
+          cur_r++;
+        }
+      else
+        {
+          diff_stream_append (stream, '+', stream->to, i_a);
+          cur_a++;
+        }
+    }
+  g_array_set_size (stream->added, 0);
+  g_array_set_size (stream->removed, 0);
+  g_array_set_size (stream->modified, 0);
+
+  if (!rpmostree_db_write_stdout (stream->buf, &stream->closed, &stream->error))
+    return FALSE;
+  return !stream->closed;
+}
+
+static gboolean
+diff_stream_add (gint i_from, gint i_to, gpointer user_data)
+{
+  auto stream = static_cast<DiffStream *> (user_data);
+  const char *name = i_from >= 0 ? rpm_ostree_package_list_get_name (stream->from, i_from)
+                                 : rpm_ostree_package_list_get_name (stream->to, i_to);
+  if (stream->name && !g_str_equal (name, stream->name) && !diff_stream_flush (stream))
+    return FALSE;
+  stream->name = name;
+
+  if (i_from >= 0 && i_to >= 0)
+    {
+      ModifiedPair pair = { i_from, i_to };
+      g_array_append_val (stream->modified, pair);
+    }
+  else if (i_from >= 0)
+    g_array_append_val (stream->removed, i_from);
+  else
+    g_array_append_val (stream->added, i_to);
+  return TRUE;
+}
+
+/* Prints the diff for scripts, in name then version order, as the pkglists
+ * are walked rather than once the whole diff is known, so that it shows up
+ * right away in a pager, and without the memory for the diff. */
+static gboolean
+print_diff_stream (OstreeRepo *repo, const char *from_checksum, const char *to_checksum,
+                   GCancellable *cancellable, GError **error)
+{
+  g_autoptr (GVariant) from_pkglist = NULL;
+  if (!_rpm_ostree_package_variant_list_for_commit (repo, from_checksum, FALSE, &from_pkglist,
+                                                    cancellable, error))
+    return FALSE;
+  g_autoptr (GVariant) to_pkglist = NULL;
+  if (!_rpm_ostree_package_variant_list_for_commit (repo, to_checksum, FALSE, &to_pkglist,
+                                                    cancellable, error))
+    return FALSE;
+
+  g_autoptr (RpmOstreePackageList) from = _rpm_ostree_package_list_new_unindexed (from_pkglist);
+  g_autoptr (RpmOstreePackageList) to = _rpm_ostree_package_list_new_unindexed (to_pkglist);
+  g_autoptr (GArray) removed = g_array_new (FALSE, FALSE, sizeof (gint));
+  g_autoptr (GArray) added = g_array_new (FALSE, FALSE, sizeof (gint));
+  g_autoptr (GArray) modified = g_array_new (FALSE, FALSE, sizeof (ModifiedPair));
+  g_autoptr (GString) buf = g_string_new ("");
+  DiffStream stream = { from, to, NULL, removed, added, modified, buf, FALSE, NULL };
+  _rpm_ostree_package_list_diff_foreach (from, to, diff_stream_add, &stream);
+  if (!stream.error && !stream.closed)
+    (void)diff_stream_flush (&stream);
+  if (stream.error)
+    {
+      g_propagate_error (error, stream.error);
+      return FALSE;
+    }
+  return TRUE;
+}
+
 static gboolean
 print_diff (OstreeRepo *repo, const char *from_desc, const char *from_checksum, const char *to_desc,
             const char *to_checksum, GCancellable *cancellable, GError **error)
@@ -69,8 +215,13 @@ print_diff (OstreeRepo *repo, const char *from_desc, const char *from_checksum,
   g_autoptr (GPtrArray) modified_from = NULL;
   g_autoptr (GPtrArray) modified_to = NULL;
 
+  if (is_diff_format)
+    {
+      if (!print_diff_stream (repo, from_checksum, to_checksum, cancellable, error))
+        return FALSE;
+    }
   /* we still use the old API for changelogs; should enhance libdnf for this */
-  if (!is_diff_format && opt_changelogs)
+  else if (opt_changelogs)
     {
       g_autoptr (RpmRevisionData) rpmrev1
           = rpmrev_new (repo, from_checksum, NULL, cancellable, error);
@@ -90,11 +241,8 @@ print_diff (OstreeRepo *repo, const char *from_desc, const char *from_checksum,
                                &modified_to, cancellable, error))
         return FALSE;
 
-      if (is_diff_format)
-        rpmostree_diff_print (removed, added, modified_from, modified_to);
-      else
-        rpmostree_diff_print_formatted (RPMOSTREE_DIFF_PRINT_FORMAT_FULL_MULTILINE, NULL, 0,
-                                        removed, added, modified_from, modified_to);
+      rpmostree_diff_print_formatted (RPMOSTREE_DIFF_PRINT_FORMAT_FULL_MULTILINE, NULL, 0,
+                                      removed, added, modified_from, modified_to);
     }
 
   if (opt_advisories)
@@ -126,22 +274,6 @@ get_checksum_from_deployment (OstreeRepo *repo, OstreeDeployment *deployment, ch
   return TRUE;
 }
 
-static gboolean
-print_deployment_diff (OstreeRepo *repo, const char *from_desc, OstreeDeployment *from,
-                       const char *to_desc, OstreeDeployment *to, GCancellable *cancellable,
-                       GError **error)
-{
-  g_autofree char *from_checksum = NULL;
-  if (!get_checksum_from_deployment (repo, from, &from_checksum, error))
-    return FALSE;
-
-  g_autofree char *to_checksum = NULL;
-  if (!get_checksum_from_deployment (repo, to, &to_checksum, error))
-    return FALSE;
-
-  return print_diff (repo, from_desc, from_checksum, to_desc, to_checksum, cancellable, error);
-}
-
 gboolean
 rpmostree_db_builtin_diff (int argc, char **argv, RpmOstreeCommandInvocation *invocation,
                            GCancellable *cancellable, GError **error)
@@ -208,17 +340,29 @@ rpmostree_db_builtin_diff (int argc, char **argv, RpmOstreeCommandInvocation *in
           g_autoptr (OstreeDeployment) pending = NULL;
           g_autoptr (OstreeDeployment) rollback = NULL;
           ostree_sysroot_query_deployments_for (sysroot, NULL, &pending, &rollback);
+          OstreeDeployment *from = NULL;
+          OstreeDeployment *to = NULL;
           if (pending)
             {
-              return print_deployment_diff (repo, "booted deployment", booted, "pending deployment",
-                                            pending, cancellable, error);
+              from_desc = "booted deployment";
+              from = booted;
+              to_desc = "pending deployment";
+              to = pending;
             }
-          if (rollback)
+          else if (rollback)
             {
-              return print_deployment_diff (repo, "rollback deployment", rollback,
-                                            "booted deployment", booted, cancellable, error);
+              from_desc = "rollback deployment";
+              from = rollback;
+              to_desc = "booted deployment";
+              to = booted;
             }
-          return glnx_throw (error, "No pending or rollback deployment to diff against");
+          else
+            return glnx_throw (error, "No pending or rollback deployment to diff against");
+
+          if (!get_checksum_from_deployment (repo, from, &from_checksum, error))
+            return FALSE;
+          if (!get_checksum_from_deployment (repo, to, &to_checksum, error))
+            return FALSE;
         }
       else
         {
@@ -252,6 +396,8 @@ rpmostree_db_builtin_diff (int argc, char **argv, RpmOstreeCommandInvocation *in
       g_variant_builder_add (&builder, "{sv}", "ostree-commit-to",
                              g_variant_new_string (to_checksum));
 
+      /* This shares the diff cache with the daemon, so diffs between
+       * deployments are usually already there from `status` or `upgrade`. */
       g_autoptr (GVariant) diffv = NULL;
       if (!rpm_ostree_db_diff_variant (repo, from_checksum, to_checksum, FALSE, &diffv, cancellable,
                                        error))
@@ -261,20 +407,9 @@ rpmostree_db_builtin_diff (int argc, char **argv, RpmOstreeCommandInvocation *in
                    rpmostreecxx::calculate_advisories_diff (*repo, from_checksum, to_checksum),
                    error);
       g_variant_builder_add (&builder, "{sv}", "advisories", adv_diff);
-      g_autoptr (GVariant) metadata = g_variant_builder_end (&builder);
-
-      JsonNode *node = json_gvariant_serialize (metadata);
-      glnx_unref_object JsonGenerator *generator = json_generator_new ();
-      json_generator_set_pretty (generator, TRUE);
-      json_generator_set_root (generator, node);
-
-      glnx_unref_object GOutputStream *stdout_gio = g_unix_output_stream_new (1, FALSE);
-      /* NB: watch out for the misleading API docs */
-      if (json_generator_to_stream (generator, stdout_gio, cancellable, error) <= 0
-          || (error != NULL && *error != NULL))
-        return FALSE;
+      g_autoptr (GVariant) metadata = g_variant_ref_sink (g_variant_builder_end (&builder));
 
-      return TRUE;
+      return rpmostree_json_write_gvariant (STDOUT_FILENO, metadata, error);
     }
 
   return print_diff (repo, from_desc, from_checksum, to_desc, to_checksum, cancellable, error);
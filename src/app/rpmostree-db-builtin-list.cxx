@@ -21,6 +21,7 @@
 #include "config.h"
 
 #include "rpmostree-db-builtins.h"
+#include "rpmostree-package-priv.h"
 #include "rpmostree-rpm-util.h"
 
 static gboolean opt_advisories;
@@ -33,6 +34,17 @@ static gboolean
 _builtin_db_list (OstreeRepo *repo, GPtrArray *revs, const GPtrArray *patterns,
                   GCancellable *cancellable, GError **error)
 {
+  /* Fetch the lists for any old commits in one go rather than one by one */
+  if (!patterns && revs->len > 1)
+    {
+      g_ptr_array_add (revs, NULL);
+      gboolean prefetched = _rpm_ostree_package_list_prefetch (
+          repo, (const char *const *)revs->pdata, cancellable, error);
+      g_ptr_array_remove_index (revs, revs->len - 1);
+      if (!prefetched)
+        return FALSE;
+    }
+
   for (guint num = 0; num < revs->len; num++)
     {
       auto rev = static_cast<const char *> (revs->pdata[num]);
@@ -46,18 +58,29 @@ _builtin_db_list (OstreeRepo *repo, GPtrArray *revs, const GPtrArray *patterns,
       else
         printf ("ostree commit: %s\n", rev);
 
-      /* in the common case where no patterns are provided, use the smarter db_query API */
+      /* in the common case where no patterns are provided, walk the pkglist in
+       * place, writing each package out as we go */
       if (!patterns)
         {
-          g_autoptr (GPtrArray) packages
-              = rpm_ostree_db_query_all (repo, checksum, cancellable, error);
-          if (!packages)
+          g_autoptr (GVariant) pkglist_v = NULL;
+          if (!_rpm_ostree_package_variant_list_for_commit (repo, checksum, FALSE, &pkglist_v,
+                                                            cancellable, error))
             return FALSE;
+          g_autoptr (RpmOstreePackageList) packages
+              = _rpm_ostree_package_list_new_unindexed (pkglist_v);
 
-          for (guint i = 0; i < packages->len; i++)
+          const guint n = rpm_ostree_package_list_get_length (packages);
+          g_autoptr (GString) line = g_string_new ("");
+          gboolean closed = FALSE;
+          for (guint i = 0; i < n; i++)
             {
-              auto package = static_cast<RpmOstreePackage *> (g_ptr_array_index (packages, i));
-              g_print (" %s\n", rpm_ostree_package_get_nevra (package));
+              g_string_assign (line, " ");
+              _rpm_ostree_package_list_append_nevra (packages, i, line);
+              g_string_append_c (line, '\n');
+              if (!rpmostree_db_write_stdout (line, &closed, error))
+                return FALSE;
+              if (closed)
+                return TRUE; /* Note early return */
             }
         }
       else
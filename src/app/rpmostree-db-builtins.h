@@ -40,4 +40,6 @@ gboolean rpmostree_db_option_context_parse (GOptionContext *context,
                                             OstreeRepo **out_repo, GCancellable *cancellable,
                                             GError **error);
 
+gboolean rpmostree_db_write_stdout (const GString *buf, gboolean *out_closed, GError **error);
+
 G_END_DECLS
@@ -0,0 +1,441 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2 of the licence or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "rpmostree-json-writer.h"
+#include "rpmostree-util.h"
+
+#include <libglnx.h>
+
+/* Flush once we have this much buffered */
+#define JSON_WRITER_FLUSH_SIZE (64 * 1024)
+
+/* Matches JsonGenerator's default for pretty output */
+#define JSON_INDENT 2
+
+struct JsonWriter
+{
+  int fd;
+  GString *buf;
+  GError *error; /* first write error, if any */
+
+  JsonWriter (int fd) : fd (fd), buf (g_string_sized_new (JSON_WRITER_FLUSH_SIZE)), error (NULL) {}
+  ~JsonWriter ()
+  {
+    g_string_free (buf, TRUE);
+    g_clear_error (&error);
+  }
+
+  void
+  flush ()
+  {
+    if (buf->len > 0 && !error && glnx_loop_write (fd, buf->str, buf->len) < 0)
+      (void)glnx_throw_errno_prefix (&error, "Writing JSON");
+    g_string_truncate (buf, 0);
+  }
+
+  void
+  maybe_flush ()
+  {
+    if (buf->len >= JSON_WRITER_FLUSH_SIZE)
+      flush ();
+  }
+
+  gboolean
+  finish (GError **out_error)
+  {
+    flush ();
+    if (error)
+      {
+        g_propagate_error (out_error, util::move_nullify (error));
+        return FALSE;
+      }
+    return TRUE;
+  }
+};
+
+static void
+write_indent (JsonWriter &w, guint level)
+{
+  for (guint i = 0; i < level * JSON_INDENT; i++)
+    g_string_append_c (w.buf, ' ');
+}
+
+/* Same escaping as JsonGenerator */
+static void
+write_string (JsonWriter &w, const char *str)
+{
+  g_string_append_c (w.buf, '"');
+  for (const char *p = str; *p; p++)
+    {
+      const guchar c = *p;
+      switch (c)
+        {
+        case '"':
+          g_string_append (w.buf, "\\\"");
+          break;
+        case '\\':
+          g_string_append (w.buf, "\\\\");
+          break;
+        case '\b':
+          g_string_append (w.buf, "\\b");
+          break;
+        case '\f':
+          g_string_append (w.buf, "\\f");
+          break;
+        case '\n':
+          g_string_append (w.buf, "\\n");
+          break;
+        case '\r':
+          g_string_append (w.buf, "\\r");
+          break;
+        case '\t':
+          g_string_append (w.buf, "\\t");
+          break;
+        default:
+          if (c < 0x20)
+            g_string_append_printf (w.buf, "\\u%04x", c);
+          else
+            g_string_append_c (w.buf, c);
+        }
+    }
+  g_string_append_c (w.buf, '"');
+}
+
+static gboolean
+is_object (GVariant *value)
+{
+  return g_variant_is_of_type (value, G_VARIANT_TYPE_DICTIONARY);
+}
+
+/* Object member names; json_gvariant_serialize() stringifies basic keys */
+static char *
+dict_key_to_string (GVariant *key)
+{
+  if (g_variant_is_of_type (key, G_VARIANT_TYPE_STRING)
+      || g_variant_is_of_type (key, G_VARIANT_TYPE_OBJECT_PATH)
+      || g_variant_is_of_type (key, G_VARIANT_TYPE_SIGNATURE))
+    return g_variant_dup_string (key, NULL);
+  return g_variant_print (key, FALSE);
+}
+
+/* Variants and maybes don't have a JSON representation of their own; return
+ * a ref to the value they hold, or %NULL for null. */
+static GVariant *
+unwrap (GVariant *value)
+{
+  g_autoptr (GVariant) v = g_variant_ref (value);
+  while (TRUE)
+    {
+      if (g_variant_is_of_type (v, G_VARIANT_TYPE_VARIANT))
+        {
+          GVariant *child = g_variant_get_variant (v);
+          g_variant_unref (v);
+          v = child;
+        }
+      else if (g_variant_is_of_type (v, G_VARIANT_TYPE_MAYBE))
+        {
+          GVariant *child = g_variant_get_maybe (v);
+          g_variant_unref (v);
+          v = child;
+          if (!v)
+            return NULL;
+        }
+      else
+        return util::move_nullify (v);
+    }
+}
+
+static void write_value (JsonWriter &w, GVariant *value, guint level);
+
+static void
+write_member (JsonWriter &w, const char *name, GVariant *value, guint level)
+{
+  write_indent (w, level);
+  if (name)
+    {
+      write_string (w, name);
+      g_string_append (w.buf, " : ");
+    }
+  write_value (w, value, level);
+}
+
+static void
+write_container (JsonWriter &w, GVariant *value, guint level)
+{
+  const gboolean object = is_object (value);
+  g_string_append (w.buf, object ? "{\n" : "[\n");
+  const gsize n = g_variant_n_children (value);
+  for (gsize i = 0; i < n; i++)
+    {
+      g_autoptr (GVariant) child = g_variant_get_child_value (value, i);
+      if (object)
+        {
+          g_autoptr (GVariant) key = g_variant_get_child_value (child, 0);
+          g_autoptr (GVariant) member = g_variant_get_child_value (child, 1);
+          g_autofree char *name = dict_key_to_string (key);
+          write_member (w, name, member, level + 1);
+        }
+      else
+        write_member (w, NULL, child, level + 1);
+      g_string_append (w.buf, i + 1 < n ? ",\n" : "\n");
+      w.maybe_flush ();
+    }
+  write_indent (w, level);
+  g_string_append_c (w.buf, object ? '}' : ']');
+}
+
+static void
+write_value (JsonWriter &w, GVariant *value, guint level)
+{
+  g_autoptr (GVariant) v = unwrap (value);
+  if (!v)
+    {
+      g_string_append (w.buf, "null");
+      return;
+    }
+
+  switch (g_variant_classify (v))
+    {
+    case G_VARIANT_CLASS_BOOLEAN:
+      g_string_append (w.buf, g_variant_get_boolean (v) ? "true" : "false");
+      break;
+    case G_VARIANT_CLASS_BYTE:
+      g_string_append_printf (w.buf, "%u", (guint)g_variant_get_byte (v));
+      break;
+    case G_VARIANT_CLASS_INT16:
+      g_string_append_printf (w.buf, "%d", (int)g_variant_get_int16 (v));
+      break;
+    case G_VARIANT_CLASS_UINT16:
+      g_string_append_printf (w.buf, "%u", (guint)g_variant_get_uint16 (v));
+      break;
+    case G_VARIANT_CLASS_INT32:
+      g_string_append_printf (w.buf, "%d", g_variant_get_int32 (v));
+      break;
+    case G_VARIANT_CLASS_UINT32:
+      g_string_append_printf (w.buf, "%u", g_variant_get_uint32 (v));
+      break;
+    case G_VARIANT_CLASS_HANDLE:
+      g_string_append_printf (w.buf, "%d", g_variant_get_handle (v));
+      break;
+    case G_VARIANT_CLASS_INT64:
+      g_string_append_printf (w.buf, "%" G_GINT64_FORMAT, g_variant_get_int64 (v));
+      break;
+    case G_VARIANT_CLASS_UINT64:
+      /* JSON integers are int64 to json-glib too */
+      g_string_append_printf (w.buf, "%" G_GINT64_FORMAT, (gint64)g_variant_get_uint64 (v));
+      break;
+    case G_VARIANT_CLASS_DOUBLE:
+      {
+        char buf[G_ASCII_DTOSTR_BUF_SIZE];
+        g_string_append (w.buf, g_ascii_dtostr (buf, sizeof (buf), g_variant_get_double (v)));
+        break;
+      }
+    case G_VARIANT_CLASS_STRING:
+    case G_VARIANT_CLASS_OBJECT_PATH:
+    case G_VARIANT_CLASS_SIGNATURE:
+      write_string (w, g_variant_get_string (v, NULL));
+      break;
+    case G_VARIANT_CLASS_ARRAY:
+    case G_VARIANT_CLASS_TUPLE:
+      write_container (w, v, level);
+      break;
+    case G_VARIANT_CLASS_DICT_ENTRY:
+      {
+        /* A lone dict entry is an object with a single member */
+        g_autoptr (GVariant) key = g_variant_get_child_value (v, 0);
+        g_autoptr (GVariant) member = g_variant_get_child_value (v, 1);
+        g_autofree char *name = dict_key_to_string (key);
+        g_string_append (w.buf, "{\n");
+        write_member (w, name, member, level + 1);
+        g_string_append_c (w.buf, '\n');
+        write_indent (w, level);
+        g_string_append_c (w.buf, '}');
+        break;
+      }
+    default:
+      g_assert_not_reached ();
+    }
+}
+
+gboolean
+rpmostree_json_write_gvariant (int fd, GVariant *value, GError **error)
+{
+  JsonWriter w (fd);
+  write_value (w, value, 0);
+  return w.finish (error);
+}
+
+/* JSONPath support is limited to what can be matched in a single walk of the
+ * variant without looking ahead or back: member names, array indices and
+ * wildcards, e.g. `$.deployments[0].checksum` or `$.deployments[*]['id']`.
+ * Recursive descent, slices and filter expressions need the JSON tree. */
+struct PathStep
+{
+  enum
+  {
+    MEMBER,
+    INDEX,
+    WILDCARD,
+  } type;
+  std::string name;
+  gsize index;
+};
+
+static gboolean
+parse_path (const char *path, std::vector<PathStep> &steps)
+{
+  const char *p = path;
+  if (*p++ != '$')
+    return FALSE;
+  while (*p)
+    {
+      PathStep step = { PathStep::WILDCARD, "", 0 };
+      if (p[0] == '.' && p[1] == '*')
+        p += 2;
+      else if (p[0] == '.')
+        {
+          const char *end = p + 1 + strcspn (p + 1, ".[]*?@():,'\"$ ");
+          if (end == p + 1)
+            return FALSE;
+          step.type = PathStep::MEMBER;
+          step.name = std::string (p + 1, end);
+          p = end;
+        }
+      else if (p[0] == '[' && p[1] == '*' && p[2] == ']')
+        p += 3;
+      else if (p[0] == '[' && (p[1] == '\'' || p[1] == '"'))
+        {
+          const char *end = strchr (p + 2, p[1]);
+          if (!end || end[1] != ']')
+            return FALSE;
+          step.type = PathStep::MEMBER;
+          step.name = std::string (p + 2, end);
+          p = end + 2;
+        }
+      else if (p[0] == '[' && g_ascii_isdigit (p[1]))
+        {
+          char *end = NULL;
+          step.type = PathStep::INDEX;
+          step.index = g_ascii_strtoull (p + 1, &end, 10);
+          if (*end != ']')
+            return FALSE;
+          p = end + 1;
+        }
+      else
+        return FALSE;
+      steps.push_back (step);
+    }
+  return TRUE;
+}
+
+/* Whether rpmostree_json_write_gvariant_path() supports @path */
+gboolean
+rpmostree_json_path_is_simple (const char *path)
+{
+  std::vector<PathStep> steps;
+  return parse_path (path, steps);
+}
+
+static void
+write_match (JsonWriter &w, GVariant *value, gboolean *first)
+{
+  if (!*first)
+    g_string_append (w.buf, ",\n");
+  *first = FALSE;
+  write_member (w, NULL, value, 1);
+  w.maybe_flush ();
+}
+
+static void
+match_path (JsonWriter &w, GVariant *value, const std::vector<PathStep> &steps, guint i,
+            gboolean *first)
+{
+  if (i == steps.size ())
+    {
+      write_match (w, value, first);
+      return;
+    }
+
+  g_autoptr (GVariant) v = unwrap (value);
+  if (!v)
+    return;
+  const GVariantClass klass = g_variant_classify (v);
+  if (klass != G_VARIANT_CLASS_ARRAY && klass != G_VARIANT_CLASS_TUPLE)
+    return;
+
+  const PathStep &step = steps[i];
+  const gboolean object = is_object (v);
+  const gsize n = g_variant_n_children (v);
+  if (step.type == PathStep::INDEX)
+    {
+      if (!object && step.index < n)
+        {
+          g_autoptr (GVariant) child = g_variant_get_child_value (v, step.index);
+          match_path (w, child, steps, i + 1, first);
+        }
+      return;
+    }
+
+  for (gsize j = 0; j < n; j++)
+    {
+      g_autoptr (GVariant) child = g_variant_get_child_value (v, j);
+      if (!object)
+        {
+          if (step.type == PathStep::WILDCARD)
+            match_path (w, child, steps, i + 1, first);
+          continue;
+        }
+
+      g_autoptr (GVariant) member = g_variant_get_child_value (child, 1);
+      if (step.type == PathStep::MEMBER)
+        {
+          g_autoptr (GVariant) key = g_variant_get_child_value (child, 0);
+          g_autofree char *name = dict_key_to_string (key);
+          if (step.name != name)
+            continue;
+        }
+      match_path (w, member, steps, i + 1, first);
+    }
+}
+
+/* Like json_path_query() on the JSON for @value, for paths where
+ * rpmostree_json_path_is_simple() holds: the matches are written as a JSON
+ * array as they're found. */
+gboolean
+rpmostree_json_write_gvariant_path (int fd, GVariant *value, const char *path, GError **error)
+{
+  std::vector<PathStep> steps;
+  if (!parse_path (path, steps))
+    return glnx_throw (error, "Unsupported JSONPath expression: %s", path);
+
+  JsonWriter w (fd);
+  gboolean first = TRUE;
+  g_string_append (w.buf, "[\n");
+  match_path (w, value, steps, 0, &first);
+  if (!first)
+    g_string_append_c (w.buf, '\n');
+  g_string_append_c (w.buf, ']');
+  return w.finish (error);
+}
@@ -0,0 +1,37 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2 of the licence or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* These write @value as pretty-printed JSON straight to @fd, in the form
+ * json_gvariant_serialize() and JsonGenerator would give, but without ever
+ * building the JSON tree; output is flushed as it goes.
+ */
+
+gboolean rpmostree_json_write_gvariant (int fd, GVariant *value, GError **error);
+
+gboolean rpmostree_json_path_is_simple (const char *path);
+
+gboolean rpmostree_json_write_gvariant_path (int fd, GVariant *value, const char *path,
+                                             GError **error);
+
+G_END_DECLS
@@ -26,85 +26,169 @@
 #include <libglnx.h>
 #include <rpmostree.h>
 
-/**
- * package_to_variant
- * @package: RpmOstreePackage
- *
- * Returns: A floating GVariant of (sss) where values are
- * (package name, evr, arch)
- */
+/* Returns a floating GVariant of (sss) where values are (package name, evr,
+ * arch) for entry @i of @list; @evr_buf is scratch space. */
 static GVariant *
-package_variant_new (RpmOstreePackage *package)
+package_variant_new (RpmOstreePackageList *list, guint i, GString *evr_buf)
 {
-  return g_variant_new ("(sss)", rpm_ostree_package_get_name (package),
-                        rpm_ostree_package_get_evr (package),
-                        rpm_ostree_package_get_arch (package));
+  g_string_truncate (evr_buf, 0);
+  const char *epoch = rpm_ostree_package_list_get_epoch (list, i);
+  /* we follow the libdnf convention here of explicit 0 --> skip over */
+  if (!g_str_equal (epoch, "0"))
+    g_string_append_printf (evr_buf, "%s:", epoch);
+  g_string_append_printf (evr_buf, "%s-%s", rpm_ostree_package_list_get_version (list, i),
+                          rpm_ostree_package_list_get_release (list, i));
+  return g_variant_new ("(sss)", rpm_ostree_package_list_get_name (list, i), evr_buf->str,
+                        rpm_ostree_package_list_get_arch (list, i));
 }
 
-static GVariant *
-build_diff_variant (const gchar *name, guint type, RpmOstreePackage *old_package,
-                    RpmOstreePackage *new_package)
+/* Entries of the diff, as indices into the package lists; -1 for none */
+typedef struct
 {
-  GVariantBuilder options_builder;
-  GVariantBuilder builder;
-  g_variant_builder_init (&options_builder, G_VARIANT_TYPE ("a{sv}"));
+  gint old_i;
+  gint new_i;
+} DiffEntry;
 
-  if (old_package)
+typedef struct
+{
+  RpmOstreePackageList *old_list;
+  RpmOstreePackageList *new_list;
+  /* One per RpmOstreePackageDiffTypes */
+  GArray *by_type[RPM_OSTREE_PACKAGE_DOWNGRADED + 1];
+} DiffData;
+
+static gboolean
+diff_add_entry (gint old_i, gint new_i, gpointer user_data)
+{
+  auto data = static_cast<DiffData *> (user_data);
+  RpmOstreePackageDiffTypes type;
+  if (old_i < 0)
+    type = RPM_OSTREE_PACKAGE_ADDED;
+  else if (new_i < 0)
+    type = RPM_OSTREE_PACKAGE_REMOVED;
+  else if (_rpm_ostree_package_list_cmp_at (data->old_list, old_i, data->new_list, new_i) > 0)
+    type = RPM_OSTREE_PACKAGE_DOWNGRADED;
+  else
+    type = RPM_OSTREE_PACKAGE_UPGRADED;
+  DiffEntry entry = { old_i, new_i };
+  g_array_append_val (data->by_type[type], entry);
+  return TRUE;
+}
+
+/* Diffs between two commits never change, so we keep them in the repo,
+ * named <from>-<to> after the commit checksums. Each is a serialized
+ * RPMOSTREE_DB_DIFF_VARIANT_FORMAT. */
+static GVariant *
+load_cached_diff (OstreeRepo *repo, const char *name)
+{
+  const char *path = glnx_strjoina (RPMOSTREE_DB_DIFF_CACHE_DIR "/", name);
+  glnx_autofd int fd = -1;
+  g_autoptr (GError) local_error = NULL;
+  if (!glnx_openat_rdonly (ostree_repo_get_dfd (repo), path, TRUE, &fd, &local_error))
     {
-      g_variant_builder_add (&options_builder, "{sv}", "PreviousPackage",
-                             package_variant_new (old_package));
+      if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        g_debug ("Ignoring cached diff %s: %s", name, local_error->message);
+      return NULL;
     }
-
-  if (new_package)
+  g_autoptr (GBytes) data = glnx_fd_readall_bytes (fd, NULL, &local_error);
+  if (!data)
     {
-      g_variant_builder_add (&options_builder, "{sv}", "NewPackage",
-                             package_variant_new (new_package));
+      g_debug ("Ignoring cached diff %s: %s", name, local_error->message);
+      return NULL;
     }
-
-  g_variant_builder_init (&builder, G_VARIANT_TYPE_TUPLE);
-  g_variant_builder_add (&builder, "s", name);
-  g_variant_builder_add (&builder, "u", type);
-  g_variant_builder_add_value (&builder, g_variant_builder_end (&options_builder));
-  return g_variant_ref_sink (g_variant_builder_end (&builder));
+  g_autoptr (GVariant) diff = g_variant_ref_sink (
+      g_variant_new_from_bytes (RPMOSTREE_DB_DIFF_VARIANT_FORMAT, data, FALSE));
+  if (!g_variant_is_normal_form (diff))
+    {
+      g_debug ("Ignoring corrupted cached diff %s", name);
+      return NULL;
+    }
+  return util::move_nullify (diff);
 }
 
-static int
-rpm_ostree_db_diff_variant_compare_by_name (const void *v1, const void *v2)
-
+static void
+store_cached_diff (OstreeRepo *repo, const char *name, GVariant *diff)
 {
-  GVariant **v1pp = (GVariant **)v1;
-  GVariant *variant1 = *v1pp;
-  GVariant **v2pp = (GVariant **)v2;
-  GVariant *variant2 = *v2pp;
-
-  const char *name1 = NULL;
-  const char *name2 = NULL;
-  g_variant_get_child (variant1, 0, "&s", &name1);
-  g_variant_get_child (variant2, 0, "&s", &name2);
-
-  g_assert (name1);
-  g_assert (name2);
-  return strcmp (name1, name2);
+  int repo_dfd = ostree_repo_get_dfd (repo);
+  g_autoptr (GError) local_error = NULL;
+  if (!glnx_shutil_mkdir_p_at (repo_dfd, RPMOSTREE_DB_DIFF_CACHE_DIR, 0755, NULL, &local_error)
+      || !glnx_file_replace_contents_at (
+          repo_dfd, glnx_strjoina (RPMOSTREE_DB_DIFF_CACHE_DIR "/", name),
+          (const guint8 *)g_variant_get_data (diff), g_variant_get_size (diff),
+          GLNX_FILE_REPLACE_NODATASYNC, NULL, &local_error))
+    g_debug ("Not caching diff %s: %s", name, local_error->message);
 }
 
-static int
-rpm_ostree_db_diff_variant_compare_by_type (const void *v1, const void *v2)
-
+/* Drop the whole diff cache; this is done by cleanup, after which some of
+ * the commits may be gone. */
+gboolean
+rpm_ostree_db_diff_variant_cache_clear (OstreeRepo *repo, GCancellable *cancellable,
+                                        GError **error)
 {
-  GVariant **v1pp = (GVariant **)v1;
-  GVariant *variant1 = *v1pp;
-  GVariant **v2pp = (GVariant **)v2;
-  GVariant *variant2 = *v2pp;
+  return glnx_shutil_rm_rf_at (ostree_repo_get_dfd (repo), RPMOSTREE_DB_DIFF_CACHE_DIR,
+                               cancellable, error);
+}
 
-  guint type1;
-  guint type2;
-  g_variant_get_child (variant1, 1, "u", &type1);
-  g_variant_get_child (variant2, 1, "u", &type2);
+static gboolean
+compute_diff_variant (OstreeRepo *repo, const char *from_rev, const char *to_rev,
+                      gboolean allow_noent, GVariant **out_variant, GCancellable *cancellable,
+                      GError **error)
+{
+  g_autoptr (GVariant) old_pkglist = NULL;
+  if (!_rpm_ostree_package_variant_list_for_commit (repo, from_rev, allow_noent, &old_pkglist,
+                                                    cancellable, error))
+    return glnx_prefix_error (error, "Failed to load package list");
+  g_autoptr (GVariant) new_pkglist = NULL;
+  if (old_pkglist
+      && !_rpm_ostree_package_variant_list_for_commit (repo, to_rev, allow_noent, &new_pkglist,
+                                                       cancellable, error))
+    return glnx_prefix_error (error, "Failed to load package list");
+
+  if (!old_pkglist || !new_pkglist)
+    {
+      g_assert (allow_noent);
+      *out_variant = NULL;
+      return TRUE; /* Note early return */
+    }
 
-  if (type1 == type2)
-    return rpm_ostree_db_diff_variant_compare_by_name (v1, v2);
+  /* Both lists are sorted by name, so walking them once gives each type's
+   * entries in name order; the diff is ordered by type, then name. */
+  g_autoptr (RpmOstreePackageList) old_list = _rpm_ostree_package_list_new (old_pkglist);
+  g_autoptr (RpmOstreePackageList) new_list = _rpm_ostree_package_list_new (new_pkglist);
+  DiffData data = { old_list, new_list, {} };
+  for (guint type = 0; type < G_N_ELEMENTS (data.by_type); type++)
+    data.by_type[type] = g_array_new (FALSE, FALSE, sizeof (DiffEntry));
+  _rpm_ostree_package_list_diff_foreach (old_list, new_list, diff_add_entry, &data);
+
+  g_autoptr (GString) evr_buf = g_string_new ("");
+  g_auto (GVariantBuilder) builder;
+  g_variant_builder_init (&builder, RPMOSTREE_DB_DIFF_VARIANT_FORMAT);
+  for (guint type = 0; type < G_N_ELEMENTS (data.by_type); type++)
+    {
+      g_autoptr (GArray) entries = data.by_type[type];
+      for (guint i = 0; i < entries->len; i++)
+        {
+          const DiffEntry *entry = &g_array_index (entries, DiffEntry, i);
+          const char *name = entry->old_i >= 0
+                                 ? rpm_ostree_package_list_get_name (old_list, entry->old_i)
+                                 : rpm_ostree_package_list_get_name (new_list, entry->new_i);
+          g_variant_builder_open (&builder, G_VARIANT_TYPE ("(sua{sv})"));
+          g_variant_builder_add (&builder, "s", name);
+          g_variant_builder_add (&builder, "u", type);
+          g_variant_builder_open (&builder, G_VARIANT_TYPE ("a{sv}"));
+          if (entry->old_i >= 0)
+            g_variant_builder_add (&builder, "{sv}", "PreviousPackage",
+                                   package_variant_new (old_list, entry->old_i, evr_buf));
+          if (entry->new_i >= 0)
+            g_variant_builder_add (&builder, "{sv}", "NewPackage",
+                                   package_variant_new (new_list, entry->new_i, evr_buf));
+          g_variant_builder_close (&builder);
+          g_variant_builder_close (&builder);
+        }
+    }
 
-  return type1 - type2;
+  *out_variant = g_variant_ref_sink (g_variant_builder_end (&builder));
+  return TRUE;
 }
 
 /**
@@ -125,66 +209,26 @@ rpm_ostree_db_diff_variant (OstreeRepo *repo, const char *from_rev, const char *
                             gboolean allow_noent, GVariant **out_variant, GCancellable *cancellable,
                             GError **error)
 {
-  int flags = 0;
-  if (allow_noent)
-    flags |= RPM_OSTREE_DB_DIFF_EXT_ALLOW_NOENT;
-
-  g_autoptr (GPtrArray) removed = NULL;
-  g_autoptr (GPtrArray) added = NULL;
-  g_autoptr (GPtrArray) modified_old = NULL;
-  g_autoptr (GPtrArray) modified_new = NULL;
-  if (!rpm_ostree_db_diff_ext (repo, from_rev, to_rev, (RpmOstreeDbDiffExtFlags)flags, &removed,
-                               &added, &modified_old, &modified_new, cancellable, error))
+  g_autofree char *from_checksum = NULL;
+  if (!ostree_repo_resolve_rev (repo, from_rev, FALSE, &from_checksum, error))
+    return FALSE;
+  g_autofree char *to_checksum = NULL;
+  if (!ostree_repo_resolve_rev (repo, to_rev, FALSE, &to_checksum, error))
     return FALSE;
 
-  if (allow_noent && !removed)
-    {
-      *out_variant = NULL;
-      return TRUE; /* Note early return */
-    }
-
-  g_assert_cmpuint (modified_old->len, ==, modified_new->len);
-
-  g_autoptr (GPtrArray) found = g_ptr_array_new_with_free_func ((GDestroyNotify)g_variant_unref);
-
-  for (guint i = 0; i < modified_old->len; i++)
-    {
-      guint type = RPM_OSTREE_PACKAGE_UPGRADED;
-      auto oldpkg = static_cast<RpmOstreePackage *> (modified_old->pdata[i]);
-      auto newpkg = static_cast<RpmOstreePackage *> (modified_new->pdata[i]);
-
-      if (rpm_ostree_package_cmp (oldpkg, newpkg) > 0)
-        type = RPM_OSTREE_PACKAGE_DOWNGRADED;
-
-      const char *name = rpm_ostree_package_get_name (oldpkg);
-      g_ptr_array_add (found, build_diff_variant (name, type, oldpkg, newpkg));
-    }
-
-  for (guint i = 0; i < removed->len; i++)
-    {
-      guint type = RPM_OSTREE_PACKAGE_REMOVED;
-      auto pkg = static_cast<RpmOstreePackage *> (removed->pdata[i]);
-      const char *name = rpm_ostree_package_get_name (pkg);
-      g_ptr_array_add (found, build_diff_variant (name, type, pkg, NULL));
-    }
-
-  for (guint i = 0; i < added->len; i++)
+  g_autofree char *name = g_strconcat (from_checksum, "-", to_checksum, NULL);
+  g_autoptr (GVariant) diff = load_cached_diff (repo, name);
+  if (!diff)
     {
-      guint type = RPM_OSTREE_PACKAGE_ADDED;
-      auto pkg = static_cast<RpmOstreePackage *> (added->pdata[i]);
-      const char *name = rpm_ostree_package_get_name (pkg);
-      g_ptr_array_add (found, build_diff_variant (name, type, NULL, pkg));
+      if (!compute_diff_variant (repo, from_checksum, to_checksum, allow_noent, &diff,
+                                 cancellable, error))
+        return FALSE;
+      /* We don't remember missing rpmdbs; that's rare */
+      if (diff)
+        store_cached_diff (repo, name, diff);
     }
 
-  g_ptr_array_sort (found, rpm_ostree_db_diff_variant_compare_by_type);
-
-  GVariantBuilder builder;
-  g_variant_builder_init (&builder, RPMOSTREE_DB_DIFF_VARIANT_FORMAT);
-  for (guint i = 0; i < found->len; i++)
-    g_variant_builder_add_value (&builder, (GVariant *)found->pdata[i]);
-
-  *out_variant = g_variant_builder_end (&builder);
-  g_variant_ref_sink (*out_variant);
+  *out_variant = util::move_nullify (diff);
   return TRUE;
 }
 
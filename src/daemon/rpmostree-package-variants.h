@@ -27,6 +27,10 @@ G_BEGIN_DECLS
 
 #define RPMOSTREE_DB_DIFF_VARIANT_FORMAT G_VARIANT_TYPE ("a(sua{sv})")
 
+/* Where diffs computed by rpm_ostree_db_diff_variant() are kept, relative to
+ * the repo */
+#define RPMOSTREE_DB_DIFF_CACHE_DIR "extensions/rpmostree/rpmdiff-cache"
+
 typedef enum
 {
   RPM_OSTREE_PACKAGE_ADDED,
@@ -39,6 +43,9 @@ gboolean rpm_ostree_db_diff_variant (OstreeRepo *repo, const char *from_rev, con
                                      gboolean allow_noent, GVariant **out_variant,
                                      GCancellable *cancellable, GError **error);
 
+gboolean rpm_ostree_db_diff_variant_cache_clear (OstreeRepo *repo, GCancellable *cancellable,
+                                                 GError **error);
+
 G_END_DECLS
 
 #ifdef __cplusplus
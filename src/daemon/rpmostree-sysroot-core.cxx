@@ -25,17 +25,24 @@
 #include <libglnx.h>
 #include <memory>
 #include <string>
+#include <sys/mount.h>
+#include <sys/statvfs.h>
 #include <systemd/sd-journal.h>
 
+#include "rpmostree-checkout-plan.h"
 #include "rpmostree-core.h"
 #include "rpmostree-cxxrs.h"
+#include "rpmostree-db.h"
 #include "rpmostree-kernel.h"
 #include "rpmostree-origin.h"
 #include "rpmostree-output.h"
+#include "rpmostree-package-variants.h"
 #include "rpmostree-postprocess.h"
 #include "rpmostree-rpm-util.h"
 #include "rpmostree-sysroot-core.h"
 #include "rpmostree-sysroot-upgrader.h"
+#include "rpmostreed-daemon.h"
+#include "rpmostreed-sysroot.h"
 
 #include "ostree-repo.h"
 
@@ -52,7 +59,7 @@
  * collection of layered package refs.
  */
 static gboolean
-add_package_refs_to_set (RpmOstreeRefSack *rsack, GHashTable *referenced_pkgs,
+add_package_refs_to_set (RpmOstreeRefSack *rsack, GPtrArray *referenced_pkgs,
                          GCancellable *cancellable, GError **error)
 {
   g_autoptr (GPtrArray) pkglist = NULL;
@@ -69,14 +76,116 @@ add_package_refs_to_set (RpmOstreeRefSack *rsack, GHashTable *referenced_pkgs,
       for (guint i = 0; i < pkglist->len; i++)
         {
           auto pkg = static_cast<DnfPackage *> (pkglist->pdata[i]);
-          g_autofree char *pkgref = rpmostree_get_cache_branch_pkg (pkg);
-          g_hash_table_add (referenced_pkgs, util::move_nullify (pkgref));
+          g_ptr_array_add (referenced_pkgs, rpmostree_get_cache_branch_pkg (pkg));
         }
     }
 
   return TRUE;
 }
 
+/* Like add_package_refs_to_set(), but from the rpmdb package list in the
+ * metadata of @commit, which is much cheaper than loading its rpmdb. Sets
+ * @out_found to FALSE if the commit predates that metadata. */
+static gboolean
+add_commit_package_refs_to_set (OstreeRepo *repo, const char *commit, GPtrArray *referenced_pkgs,
+                                gboolean *out_found, GError **error)
+{
+  g_autoptr (GVariant) commit_v = NULL;
+  if (!ostree_repo_load_commit (repo, commit, &commit_v, NULL, error))
+    return FALSE;
+  g_autoptr (GVariant) metadata = g_variant_get_child_value (commit_v, 0);
+  g_autoptr (GVariantDict) metadata_dict = g_variant_dict_new (metadata);
+  g_autoptr (GVariant) pkglist = g_variant_dict_lookup_value (
+      metadata_dict, "rpmostree.rpmdb.pkglist", G_VARIANT_TYPE ("a(sssss)"));
+  *out_found = pkglist != NULL;
+  if (!pkglist)
+    return TRUE;
+
+  GVariantIter iter;
+  g_variant_iter_init (&iter, pkglist);
+  const char *name, *epoch, *version, *release, *arch;
+  while (g_variant_iter_next (&iter, "(&s&s&s&s&s)", &name, &epoch, &version, &release, &arch))
+    {
+      /* Same as dnf_package_get_evr(), which omits a zero epoch */
+      g_autofree char *evr = g_ascii_strtoull (epoch, NULL, 10) == 0
+                                 ? g_strdup_printf ("%s-%s", version, release)
+                                 : g_strdup_printf ("%s:%s-%s", epoch, version, release);
+      g_ptr_array_add (referenced_pkgs, rpmostree_get_cache_branch_for_n_evr_a (name, evr, arch));
+    }
+  return TRUE;
+}
+
+/* Deployment checksum -> GPtrArray of the pkgcache refs it holds; commits
+ * are immutable, so this never needs invalidating, only pruning. */
+static GHashTable *pkgcache_refs_cache;
+G_LOCK_DEFINE_STATIC (pkgcache_refs_cache);
+
+/* The pkgcache refs of all the packages in @deployment. */
+static GPtrArray *
+get_deployment_package_refs (OstreeSysroot *sysroot, OstreeRepo *repo,
+                             OstreeDeployment *deployment, GCancellable *cancellable,
+                             GError **error)
+{
+  const char *csum = ostree_deployment_get_csum (deployment);
+  {
+    G_LOCK (pkgcache_refs_cache);
+    GPtrArray *refs = NULL;
+    if (pkgcache_refs_cache)
+      refs = static_cast<GPtrArray *> (g_hash_table_lookup (pkgcache_refs_cache, csum));
+    if (refs)
+      g_ptr_array_ref (refs);
+    G_UNLOCK (pkgcache_refs_cache);
+    if (refs)
+      return refs;
+  }
+
+  g_autoptr (GPtrArray) refs = g_ptr_array_new_with_free_func (g_free);
+  gboolean found = FALSE;
+  if (!add_commit_package_refs_to_set (repo, csum, refs, &found, error))
+    return NULL;
+  if (!found)
+    {
+      /* Older commit; fall back to the rpmdb */
+      g_autoptr (RpmOstreeRefSack) rsack = rpmostreed_sysroot_get_refsack_for_deployment (
+          rpmostreed_sysroot_get (), sysroot, deployment, error);
+      if (rsack == NULL)
+        return NULL;
+      if (!add_package_refs_to_set (rsack, refs, cancellable, error))
+        return NULL;
+    }
+
+  G_LOCK (pkgcache_refs_cache);
+  if (!pkgcache_refs_cache)
+    pkgcache_refs_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                 (GDestroyNotify)g_ptr_array_unref);
+  g_hash_table_replace (pkgcache_refs_cache, g_strdup (csum), g_ptr_array_ref (refs));
+  G_UNLOCK (pkgcache_refs_cache);
+  return util::move_nullify (refs);
+}
+
+/* Drop cached refs for deployments that no longer exist */
+static void
+prune_pkgcache_refs_cache (GPtrArray *deployments)
+{
+  G_LOCK (pkgcache_refs_cache);
+  if (pkgcache_refs_cache)
+    {
+      GHashTableIter iter;
+      g_hash_table_iter_init (&iter, pkgcache_refs_cache);
+      gpointer key;
+      while (g_hash_table_iter_next (&iter, &key, NULL))
+        {
+          gboolean live = FALSE;
+          for (guint i = 0; i < deployments->len && !live; i++)
+            live = g_str_equal (
+                key, ostree_deployment_get_csum ((OstreeDeployment *)deployments->pdata[i]));
+          if (!live)
+            g_hash_table_iter_remove (&iter);
+        }
+    }
+  G_UNLOCK (pkgcache_refs_cache);
+}
+
 /* Loop over all deployments, gathering all referenced NEVRAs for
  * layered packages.  Then delete any cached pkg refs that aren't in
  * that set.
@@ -90,6 +199,7 @@ generate_pkgcache_refs (OstreeSysroot *sysroot, OstreeRepo *repo, guint *out_n_f
       g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 
   g_autoptr (GPtrArray) deployments = ostree_sysroot_get_deployments (sysroot);
+  prune_pkgcache_refs_cache (deployments);
   for (guint i = 0; i < deployments->len; i++)
     {
       auto deployment = static_cast<OstreeDeployment *> (deployments->pdata[i]);
@@ -109,19 +219,12 @@ generate_pkgcache_refs (OstreeSysroot *sysroot, OstreeRepo *repo, guint *out_n_f
        */
       if (base_commit)
         {
-          g_autofree char *deployment_dirpath
-              = ostree_sysroot_get_deployment_dirpath (sysroot, deployment);
-
-          /* We could do this via the commit object, but it's faster
-           * to reuse the existing rpmdb checkout.
-           */
-          g_autoptr (RpmOstreeRefSack) rsack = rpmostree_get_refsack_for_root (
-              ostree_sysroot_get_fd (sysroot), deployment_dirpath, error);
-          if (rsack == NULL)
-            return FALSE;
-
-          if (!add_package_refs_to_set (rsack, referenced_pkgs, cancellable, error))
+          g_autoptr (GPtrArray) refs
+              = get_deployment_package_refs (sysroot, repo, deployment, cancellable, error);
+          if (!refs)
             return glnx_prefix_error (error, "Deployment index=%d", i);
+          for (guint j = 0; j < refs->len; j++)
+            g_hash_table_add (referenced_pkgs, g_strdup ((const char *)refs->pdata[j]));
         }
 
       /* also add any inactive local replacements */
@@ -186,14 +289,87 @@ syscore_regenerate_refs (OstreeSysroot *sysroot, OstreeRepo *repo, guint *out_n_
   return TRUE;
 }
 
-/* Clean up to match the current deployments. This used to be a private static,
- * but is now used by the cleanup txn.
- */
-gboolean
-rpmostree_syscore_cleanup (OstreeSysroot *sysroot, OstreeRepo *repo, GCancellable *cancellable,
-                           GError **error)
+/* The set of commits that refs point to */
+static gboolean
+get_ref_targets (OstreeRepo *repo, GHashTable **out_targets, GCancellable *cancellable,
+                 GError **error)
+{
+  g_autoptr (GHashTable) refs = NULL;
+  if (!ostree_repo_list_refs_ext (repo, NULL, &refs, OSTREE_REPO_LIST_REFS_EXT_NONE, cancellable,
+                                  error))
+    return FALSE;
+  g_autoptr (GHashTable) targets = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  GLNX_HASH_TABLE_FOREACH_V (refs, const char *, csum)
+    g_hash_table_add (targets, g_strdup (csum));
+  *out_targets = util::move_nullify (targets);
+  return TRUE;
+}
+
+/* Whether any of the commits the refs pointed to at the last prune is no
+ * longer a ref target. If not, the refs only gained commits since then,
+ * so the prune can't find anything newly unreachable and we skip the
+ * (expensive) traversal. Objects that were never reachable from a ref,
+ * e.g. from a failed deployment, are left for the next full prune. */
+static gboolean
+prune_needed (OstreeRepo *repo, GHashTable *targets, gboolean *out_needed,
+              GCancellable *cancellable, GError **error)
+{
+  *out_needed = TRUE;
+  glnx_autofd int fd = -1;
+  g_autoptr (GError) local_error = NULL;
+  if (!glnx_openat_rdonly (ostree_repo_get_dfd (repo), RPMOSTREE_PRUNE_STAMP_PATH, TRUE, &fd,
+                           &local_error))
+    {
+      if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        return TRUE;
+      g_propagate_error (error, util::move_nullify (local_error));
+      return FALSE;
+    }
+
+  g_autoptr (GBytes) data = glnx_fd_readall_bytes (fd, cancellable, error);
+  if (!data)
+    return FALSE;
+  g_autoptr (GVariant) stamp
+      = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE ("as"), data, FALSE));
+  if (!g_variant_is_normal_form (stamp))
+    return TRUE;
+
+  GVariantIter iter;
+  g_variant_iter_init (&iter, stamp);
+  const char *csum;
+  while (g_variant_iter_next (&iter, "&s", &csum))
+    {
+      if (!g_hash_table_contains (targets, csum))
+        return TRUE;
+    }
+  *out_needed = FALSE;
+  return TRUE;
+}
+
+static gboolean
+write_prune_stamp (OstreeRepo *repo, GHashTable *targets, GCancellable *cancellable,
+                   GError **error)
+{
+  g_auto (GVariantBuilder) builder;
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("as"));
+  GLNX_HASH_TABLE_FOREACH (targets, const char *, csum)
+    g_variant_builder_add (&builder, "s", csum);
+  g_autoptr (GVariant) stamp = g_variant_ref_sink (g_variant_builder_end (&builder));
+  int repo_dfd = ostree_repo_get_dfd (repo); /* borrowed */
+  if (!glnx_shutil_mkdir_p_at (repo_dfd, "extensions/rpmostree", 0755, cancellable, error))
+    return FALSE;
+  return glnx_file_replace_contents_at (repo_dfd, RPMOSTREE_PRUNE_STAMP_PATH,
+                                        (const guint8 *)g_variant_get_data (stamp),
+                                        g_variant_get_size (stamp), GLNX_FILE_REPLACE_NODATASYNC,
+                                        cancellable, error);
+}
+
+/* Everything in a cleanup short of pruning the repo: drop the refs,
+ * checkouts and images the current deployments don't need. */
+static gboolean
+syscore_cleanup_refs (OstreeSysroot *sysroot, OstreeRepo *repo, guint *out_n_pkgcache_freed,
+                      GCancellable *cancellable, GError **error)
 {
-  GLNX_AUTO_PREFIX_ERROR ("syscore cleanup", error);
   int repo_dfd = ostree_repo_get_dfd (repo); /* borrowed */
 
   /* Basic cleanup without pruning */
@@ -207,8 +383,7 @@ rpmostree_syscore_cleanup (OstreeSysroot *sysroot, OstreeRepo *repo, GCancellabl
   ROSCXX_TRY (history_prune (), error);
 
   /* Regenerate all refs */
-  guint n_pkgcache_freed = 0;
-  if (!syscore_regenerate_refs (sysroot, repo, &n_pkgcache_freed, cancellable, error))
+  if (!syscore_regenerate_refs (sysroot, repo, out_n_pkgcache_freed, cancellable, error))
     return FALSE;
 
   /* Refs for the live state */
@@ -221,16 +396,70 @@ rpmostree_syscore_cleanup (OstreeSysroot *sysroot, OstreeRepo *repo, GCancellabl
                                 image_pruned.layers);
     }
 
-  /* And do a prune */
-  guint64 freed_space;
-  gint n_objects_total, n_objects_pruned;
-  {
-    g_autoptr (GHashTable) reachable = ostree_repo_traverse_new_reachable ();
-    OstreeRepoPruneOptions opts = { OSTREE_REPO_PRUNE_FLAGS_REFS_ONLY, reachable };
-    if (!ostree_sysroot_cleanup_prune_repo (sysroot, &opts, &n_objects_total, &n_objects_pruned,
-                                            &freed_space, cancellable, error))
-      return glnx_prefix_error (error, "pruning");
-  }
+  return TRUE;
+}
+
+/* Prune the objects no ref points to any more, along with the caches of
+ * pruned commits. This is the I/O heavy part of a cleanup, and is safe to
+ * cancel. */
+gboolean
+rpmostree_syscore_prune (OstreeSysroot *sysroot, OstreeRepo *repo, guint64 *out_freed_space,
+                         GCancellable *cancellable, GError **error)
+{
+  GLNX_AUTO_PREFIX_ERROR ("pruning", error);
+
+  /* Only if any ref target went away since the last prune */
+  guint64 freed_space = 0;
+  g_autoptr (GHashTable) ref_targets = NULL;
+  if (!get_ref_targets (repo, &ref_targets, cancellable, error))
+    return FALSE;
+  gboolean do_prune = TRUE;
+  if (!prune_needed (repo, ref_targets, &do_prune, cancellable, error))
+    return FALSE;
+  if (do_prune)
+    {
+      gint n_objects_total, n_objects_pruned;
+      g_autoptr (GHashTable) reachable = ostree_repo_traverse_new_reachable ();
+      OstreeRepoPruneOptions opts = { OSTREE_REPO_PRUNE_FLAGS_REFS_ONLY, reachable };
+      if (!ostree_sysroot_cleanup_prune_repo (sysroot, &opts, &n_objects_total, &n_objects_pruned,
+                                              &freed_space, cancellable, error))
+        return FALSE;
+      if (!write_prune_stamp (repo, ref_targets, cancellable, error))
+        return glnx_prefix_error (error, "Writing prune stamp");
+    }
+  else
+    g_debug ("No ref targets removed since last prune; skipping");
+
+  /* The commits we just pruned may have had checkout plans or sack caches */
+  if (!rpmostree_checkout_plan_prune (repo, NULL, cancellable, error))
+    return FALSE;
+  if (!rpmostree_initramfs_cache_prune (repo, cancellable, error))
+    return FALSE;
+  if (!rpmostree_solv_cache_prune (repo, cancellable, error))
+    return FALSE;
+  if (!rpm_ostree_db_diff_variant_cache_clear (repo, cancellable, error))
+    return FALSE;
+
+  *out_freed_space = freed_space;
+  return TRUE;
+}
+
+/* Clean up to match the current deployments. This used to be a private static,
+ * but is now used by the cleanup txn.
+ */
+gboolean
+rpmostree_syscore_cleanup (OstreeSysroot *sysroot, OstreeRepo *repo, GCancellable *cancellable,
+                           GError **error)
+{
+  GLNX_AUTO_PREFIX_ERROR ("syscore cleanup", error);
+
+  guint n_pkgcache_freed = 0;
+  if (!syscore_cleanup_refs (sysroot, repo, &n_pkgcache_freed, cancellable, error))
+    return FALSE;
+
+  guint64 freed_space = 0;
+  if (!rpmostree_syscore_prune (sysroot, repo, &freed_space, cancellable, error))
+    return FALSE;
 
   if (n_pkgcache_freed > 0 || freed_space > 0)
     {
@@ -241,6 +470,267 @@ rpmostree_syscore_cleanup (OstreeSysroot *sysroot, OstreeRepo *repo, GCancellabl
 
   return TRUE;
 }
+
+/* The cleanup at the end of a deployment. With the DeferredCleanup daemon
+ * option, the prune is left for the daemon to do once it's idle. */
+gboolean
+rpmostree_syscore_deploy_cleanup (OstreeSysroot *sysroot, OstreeRepo *repo,
+                                  GCancellable *cancellable, GError **error)
+{
+  RpmostreedDaemon *daemon = rpmostreed_daemon_get ();
+  if (!rpmostreed_get_deferred_cleanup (daemon))
+    return rpmostree_syscore_cleanup (sysroot, repo, cancellable, error);
+
+  GLNX_AUTO_PREFIX_ERROR ("syscore cleanup", error);
+
+  guint n_pkgcache_freed = 0;
+  if (!syscore_cleanup_refs (sysroot, repo, &n_pkgcache_freed, cancellable, error))
+    return FALSE;
+  if (n_pkgcache_freed > 0)
+    rpmostree_output_message ("Freed pkgcache branches: %u", n_pkgcache_freed);
+
+  rpmostreed_daemon_defer_cleanup (daemon);
+  return TRUE;
+}
+
+static gboolean
+prewarm_deployment (OstreeSysroot *sysroot, OstreeRepo *repo, OstreeDeployment *deployment,
+                    GCancellable *cancellable, GError **error)
+{
+  RpmostreedSysroot *rsysroot = rpmostreed_sysroot_get ();
+  const char *csum = ostree_deployment_get_csum (deployment);
+
+  /* This writes the libsolv cache of the deployment's rpmdb */
+  g_autoptr (RpmOstreeRefSack) rsack
+      = rpmostreed_sysroot_get_refsack_for_deployment (rsysroot, sysroot, deployment, error);
+  if (!rsack)
+    return FALSE;
+
+  gboolean is_layered = FALSE;
+  if (!rpmostree_deployment_get_layered_info (repo, deployment, &is_layered, NULL, NULL, NULL,
+                                              NULL, NULL, NULL, NULL, error))
+    return FALSE;
+  if (is_layered)
+    {
+      /* And that of the base layer's, for the next layering operation */
+      g_autoptr (GError) local_error = NULL;
+      g_autoptr (RpmOstreeRefSack) base_rsack = rpmostreed_sysroot_get_refsack_for_commit (
+          rsysroot, repo, csum, TRUE, cancellable, &local_error);
+      if (!base_rsack && !g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        {
+          g_propagate_error (error, util::move_nullify (local_error));
+          return FALSE;
+        }
+    }
+
+  /* For commits without pkglist metadata, this fills the package list cache */
+  g_autoptr (GPtrArray) pkgs = rpm_ostree_db_query_all (repo, csum, cancellable, error);
+  if (!pkgs)
+    return FALSE;
+
+  return TRUE;
+}
+
+/* Build the caches that the first status or layering operation would
+ * otherwise build lazily for @deployment, while we're up anyway rather
+ * than on the next boot: the libsolv caches of its rpmdbs and its package
+ * list. The daemon's own deployment variants are regenerated when it
+ * notices the new deployment. This is best-effort; it never fails the
+ * deployment itself. */
+void
+rpmostree_syscore_prewarm_deployment (OstreeSysroot *sysroot, OstreeRepo *repo,
+                                      OstreeDeployment *deployment, GCancellable *cancellable)
+{
+  g_autoptr (GError) local_error = NULL;
+  if (!prewarm_deployment (sysroot, repo, deployment, cancellable, &local_error))
+    sd_journal_print (LOG_WARNING, "Failed to prewarm caches for deployment %s.%d: %s",
+                      ostree_deployment_get_csum (deployment),
+                      ostree_deployment_get_deployserial (deployment), local_error->message);
+}
+
+/* The kernel and initramfs of a deployment, and the directory relative to
+ * /boot and names under which ostree installs them when writing the
+ * bootloader config */
+typedef struct
+{
+  int deployment_dfd;
+  char *bootcsumdir;
+  char *srcs[2];
+  char *names[2];
+} BootFiles;
+
+static void
+boot_files_clear (BootFiles *files)
+{
+  glnx_close_fd (&files->deployment_dfd);
+  g_free (files->bootcsumdir);
+  for (guint i = 0; i < G_N_ELEMENTS (files->srcs); i++)
+    {
+      g_free (files->srcs[i]);
+      g_free (files->names[i]);
+    }
+}
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (BootFiles, boot_files_clear)
+
+/* Where ostree puts @deployment's boot files is only predictable for the
+ * /usr/lib/modules layout; for the legacy ones, @out_found is FALSE. */
+static gboolean
+get_boot_files (OstreeSysroot *sysroot, OstreeDeployment *deployment, BootFiles *out_files,
+                gboolean *out_found, GCancellable *cancellable, GError **error)
+{
+  *out_found = FALSE;
+  g_autofree char *deployment_path = ostree_sysroot_get_deployment_dirpath (sysroot, deployment);
+  glnx_autofd int deployment_dfd = -1;
+  if (!glnx_opendirat (ostree_sysroot_get_fd (sysroot), deployment_path, TRUE, &deployment_dfd,
+                       error))
+    return FALSE;
+  g_autoptr (GVariant) kernel_state = rpmostree_find_kernel (deployment_dfd, cancellable, error);
+  if (!kernel_state)
+    return FALSE;
+  const char *kver, *bootdir, *kernel_path, *initramfs_path;
+  g_variant_get (kernel_state, "(&s&s&sm&s)", &kver, &bootdir, &kernel_path, &initramfs_path);
+  if (!g_str_has_prefix (bootdir, "usr/lib/modules/") || !initramfs_path)
+    return TRUE;
+
+  out_files->deployment_dfd = glnx_steal_fd (&deployment_dfd);
+  out_files->bootcsumdir
+      = g_strdup_printf ("ostree/%s-%s", ostree_deployment_get_osname (deployment),
+                         ostree_deployment_get_bootcsum (deployment));
+  out_files->srcs[0] = g_strdup (kernel_path);
+  out_files->names[0] = g_strconcat ("vmlinuz-", kver, NULL);
+  out_files->srcs[1] = g_strdup (initramfs_path);
+  out_files->names[1] = g_strconcat ("initramfs-", kver, ".img", NULL);
+  *out_found = TRUE;
+  return TRUE;
+}
+
+static gboolean
+preinstall_boot_file (int src_dfd, const char *src_path, int dest_dfd, const char *name,
+                      GError **error)
+{
+  if (!glnx_fstatat_allow_noent (dest_dfd, name, NULL, 0, error))
+    return FALSE;
+  if (errno == 0)
+    return TRUE;
+
+  glnx_autofd int src_fd = -1;
+  if (!glnx_openat_rdonly (src_dfd, src_path, TRUE, &src_fd, error))
+    return FALSE;
+  g_auto (GLnxTmpfile) tmpf = {
+    0,
+  };
+  if (!glnx_open_tmpfile_linkable_at (dest_dfd, ".", O_WRONLY | O_CLOEXEC, &tmpf, error))
+    return FALSE;
+  if (glnx_regfile_copy_bytes (src_fd, tmpf.fd, (off_t)-1) < 0)
+    return glnx_throw_errno_prefix (error, "Copying %s", src_path);
+  if (fchmod (tmpf.fd, 0644) < 0)
+    return glnx_throw_errno_prefix (error, "fchmod");
+  /* ostree only checks that the file exists, so it must be complete */
+  if (fsync (tmpf.fd) < 0)
+    return glnx_throw_errno_prefix (error, "fsync");
+  return glnx_link_tmpfile_at (&tmpf, GLNX_LINK_TMPFILE_NOREPLACE_IGNORE_EXIST, dest_dfd, name,
+                               error);
+}
+
+static gboolean
+preinstall_boot_files (OstreeSysroot *sysroot, OstreeDeployment *deployment,
+                       GCancellable *cancellable, GError **error)
+{
+  g_auto (BootFiles) files = {
+    -1,
+  };
+  gboolean found = FALSE;
+  if (!get_boot_files (sysroot, deployment, &files, &found, cancellable, error))
+    return FALSE;
+  if (!found)
+    return TRUE;
+
+  glnx_autofd int boot_dfd = -1;
+  if (!glnx_opendirat (ostree_sysroot_get_fd (sysroot), "boot", TRUE, &boot_dfd, error))
+    return FALSE;
+  /* Like ostree does when writing the bootloader config; we're in our own
+   * mount namespace. */
+  struct statvfs stvfs;
+  if (fstatvfs (boot_dfd, &stvfs) < 0)
+    return glnx_throw_errno_prefix (error, "fstatvfs(/boot)");
+  if ((stvfs.f_flag & ST_RDONLY) && ostree_sysroot_is_booted (sysroot)
+      && mount ("/boot", "/boot", NULL, MS_REMOUNT | MS_SILENT, NULL) < 0)
+    return glnx_throw_errno_prefix (error, "Remounting /boot read-write");
+
+  if (!glnx_shutil_mkdir_p_at (boot_dfd, files.bootcsumdir, 0775, cancellable, error))
+    return FALSE;
+  glnx_autofd int bootcsum_dfd = -1;
+  if (!glnx_opendirat (boot_dfd, files.bootcsumdir, TRUE, &bootcsum_dfd, error))
+    return FALSE;
+  for (guint i = 0; i < G_N_ELEMENTS (files.srcs); i++)
+    {
+      if (!preinstall_boot_file (files.deployment_dfd, files.srcs[i], bootcsum_dfd,
+                                 files.names[i], error))
+        return glnx_prefix_error (error, "Installing %s", files.names[i]);
+    }
+  if (fsync (bootcsum_dfd) < 0)
+    return glnx_throw_errno_prefix (error, "fsync(%s)", files.bootcsumdir);
+  return TRUE;
+}
+
+/* Finalizing a staged deployment happens on the way to the reboot, so do what
+ * we can of it ahead of time: install its kernel and initramfs where ostree
+ * will look for them in /boot. ostree then skips copying and syncing those,
+ * which is most of the I/O at shutdown. See also
+ * rpmostree_syscore_verify_preinstalled_boot(). Best-effort like
+ * rpmostree_syscore_prewarm_deployment(). */
+void
+rpmostree_syscore_preinstall_boot (OstreeSysroot *sysroot, OstreeDeployment *deployment,
+                                   GCancellable *cancellable)
+{
+  g_autoptr (GError) local_error = NULL;
+  if (!preinstall_boot_files (sysroot, deployment, cancellable, &local_error))
+    sd_journal_print (LOG_WARNING, "Failed to preinstall kernel for deployment %s.%d: %s",
+                      ostree_deployment_get_csum (deployment),
+                      ostree_deployment_get_deployserial (deployment), local_error->message);
+}
+
+/* Before letting @deployment be finalized, check that the kernel and
+ * initramfs installed by rpmostree_syscore_preinstall_boot() still match
+ * those of the deployment; ostree would use them as is. Any that don't are
+ * removed, so that ostree installs them again. */
+gboolean
+rpmostree_syscore_verify_preinstalled_boot (OstreeSysroot *sysroot, OstreeDeployment *deployment,
+                                            GCancellable *cancellable, GError **error)
+{
+  g_auto (BootFiles) files = {
+    -1,
+  };
+  gboolean found = FALSE;
+  if (!get_boot_files (sysroot, deployment, &files, &found, cancellable, error))
+    return FALSE;
+  if (!found)
+    return TRUE;
+
+  g_autofree char *bootcsum_path = g_build_filename ("boot", files.bootcsumdir, NULL);
+  glnx_autofd int bootcsum_dfd = -1;
+  if (!glnx_opendirat (ostree_sysroot_get_fd (sysroot), bootcsum_path, TRUE, &bootcsum_dfd,
+                       NULL))
+    return TRUE; /* Nothing preinstalled */
+  for (guint i = 0; i < G_N_ELEMENTS (files.srcs); i++)
+    {
+      struct stat src_stbuf, dest_stbuf;
+      if (!glnx_fstatat_allow_noent (bootcsum_dfd, files.names[i], &dest_stbuf, 0, error))
+        return FALSE;
+      if (errno == ENOENT)
+        continue;
+      if (!glnx_fstatat (files.deployment_dfd, files.srcs[i], &src_stbuf, 0, error))
+        return FALSE;
+      if (src_stbuf.st_size == dest_stbuf.st_size)
+        continue;
+      sd_journal_print (LOG_WARNING, "Preinstalled %s/%s is out of date; removing",
+                        bootcsum_path, files.names[i]);
+      if (!glnx_unlinkat (bootcsum_dfd, files.names[i], 0, error))
+        return FALSE;
+    }
+  return TRUE;
+}
+
 /* This is like ostree_sysroot_get_merge_deployment() except we explicitly
  * ignore the magical "booted" behavior. For rpm-ostree we're trying something
  * different now where we are a bit more stateful and pick up changes from the
@@ -363,7 +853,7 @@ rpmostree_syscore_write_deployment (OstreeSysroot *sysroot, OstreeDeployment *ne
                                                flags, cancellable, error))
     return FALSE;
 
-  if (!rpmostree_syscore_cleanup (sysroot, repo, cancellable, error))
+  if (!rpmostree_syscore_deploy_cleanup (sysroot, repo, cancellable, error))
     return FALSE;
 
   return TRUE;
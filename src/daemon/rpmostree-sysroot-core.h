@@ -32,6 +32,8 @@ G_BEGIN_DECLS
 #define RPMOSTREE_TMP_ROOTFS_DIR RPMOSTREE_TMP_PRIVATE_DIR "/commit"
 /* The legacy dir, which we will just delete if we find it */
 #define RPMOSTREE_OLD_TMP_ROOTFS_DIR "extensions/rpmostree/commit"
+/* The commits the refs pointed to as of the last prune */
+#define RPMOSTREE_PRUNE_STAMP_PATH "extensions/rpmostree/prune-stamp"
 
 /* Really, this is an OSTree API, but let's consider it hidden for now like the
  * /run/ostree/staged-deployment path and company. */
@@ -40,6 +42,24 @@ G_BEGIN_DECLS
 gboolean rpmostree_syscore_cleanup (OstreeSysroot *sysroot, OstreeRepo *repo,
                                     GCancellable *cancellable, GError **error);
 
+gboolean rpmostree_syscore_deploy_cleanup (OstreeSysroot *sysroot, OstreeRepo *repo,
+                                           GCancellable *cancellable, GError **error);
+
+gboolean rpmostree_syscore_prune (OstreeSysroot *sysroot, OstreeRepo *repo,
+                                  guint64 *out_freed_space, GCancellable *cancellable,
+                                  GError **error);
+
+void rpmostree_syscore_prewarm_deployment (OstreeSysroot *sysroot, OstreeRepo *repo,
+                                           OstreeDeployment *deployment,
+                                           GCancellable *cancellable);
+
+void rpmostree_syscore_preinstall_boot (OstreeSysroot *sysroot, OstreeDeployment *deployment,
+                                        GCancellable *cancellable);
+
+gboolean rpmostree_syscore_verify_preinstalled_boot (OstreeSysroot *sysroot,
+                                                     OstreeDeployment *deployment,
+                                                     GCancellable *cancellable, GError **error);
+
 OstreeDeployment *rpmostree_syscore_get_origin_merge_deployment (OstreeSysroot *self,
                                                                  const char *osname);
 
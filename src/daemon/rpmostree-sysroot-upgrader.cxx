@@ -28,8 +28,11 @@
 #include <libglnx.h>
 #include <systemd/sd-journal.h>
 
+#include "rpmostree-checkout-plan.h"
 #include "rpmostree-core.h"
 #include "rpmostree-cxxrs.h"
+#include "rpmostree-db.h"
+#include "rpmostree-history-log.h"
 #include "rpmostree-kernel.h"
 #include "rpmostree-origin.h"
 #include "rpmostree-output.h"
@@ -112,6 +115,7 @@ struct RpmOstreeSysrootUpgrader
   gboolean layering_initialized; /* Whether layering_type is known */
   RpmOstreeSysrootUpgraderLayeringType layering_type;
   gboolean layering_changed; /* Whether changes to layering should result in a new commit */
+  gboolean layering_reused;  /* Whether final_revision is reused as is, see prep_local_assembly() */
   gboolean pkgs_imported;    /* Whether pkgs to be layered have been downloaded & imported */
   char *base_revision;       /* Non-layered replicated commit */
   char *final_revision;      /* Computed by layering; if NULL, only using base_revision */
@@ -401,6 +405,43 @@ rpmostree_sysroot_upgrader_get_sack (RpmOstreeSysrootUpgrader *self, GError **er
   return self->rpmmd_sack;
 }
 
+/* Print a summary of the package changes from the current base to @new_rev,
+ * from the rpmdb package list in its commit metadata; this works with just
+ * the commit object. It's informational only, so errors are just logged. */
+static void
+print_early_base_diff (RpmOstreeSysrootUpgrader *self, const char *new_rev,
+                       GCancellable *cancellable)
+{
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (GVariant) commit = NULL;
+  if (!ostree_repo_load_commit (self->repo, new_rev, &commit, NULL, &local_error))
+    {
+      g_debug ("Loading new base commit: %s", local_error->message);
+      return;
+    }
+  g_autoptr (GVariant) metadata = g_variant_get_child_value (commit, 0);
+  g_autoptr (GVariantDict) metadata_dict = g_variant_dict_new (metadata);
+  if (!g_variant_dict_contains (metadata_dict, "rpmostree.rpmdb.pkglist"))
+    return;
+
+  g_autoptr (GPtrArray) removed = NULL;
+  g_autoptr (GPtrArray) added = NULL;
+  g_autoptr (GPtrArray) modified_old = NULL;
+  g_autoptr (GPtrArray) modified_new = NULL;
+  if (!rpm_ostree_db_diff_ext (self->repo, self->base_revision, new_rev,
+                               RPM_OSTREE_DB_DIFF_EXT_ALLOW_NOENT, &removed, &added, &modified_old,
+                               &modified_new, cancellable, &local_error))
+    {
+      g_debug ("Diffing new base: %s", local_error->message);
+      return;
+    }
+  if (!removed)
+    return;
+
+  rpmostree_output_message ("New base %.7s: %u changed, %u removed, %u added", new_rev,
+                            modified_new->len, removed->len, added->len);
+}
+
 /*
  * Like ostree_sysroot_upgrader_pull(), but also handles the `baserefspec` we
  * use when doing layered packages.
@@ -466,38 +507,63 @@ rpmostree_sysroot_upgrader_pull_base (RpmOstreeSysrootUpgrader *self, const char
         g_assert (self->origin_merge_deployment);
         if (origin_remote && !synthetic && !is_commit)
           {
-            g_autoptr (GVariantBuilder) optbuilder
-                = g_variant_builder_new (G_VARIANT_TYPE ("a{sv}"));
-            if (dir_to_pull && *dir_to_pull)
-              g_variant_builder_add (optbuilder, "{s@v}", "subdir",
-                                     g_variant_new_variant (g_variant_new_string (dir_to_pull)));
-            g_variant_builder_add (optbuilder, "{s@v}", "flags",
-                                   g_variant_new_variant (g_variant_new_int32 (flags)));
+            /* For a full pull, first fetch just the commit: that's enough to
+             * know what we're getting, and to tell the user before the
+             * (possibly long) content pull. */
+            const gboolean metadata_first = !check && !(dir_to_pull && *dir_to_pull);
+            auto build_opts = [&] (OstreeRepoPullFlags pull_flags) {
+              g_autoptr (GVariantBuilder) optbuilder
+                  = g_variant_builder_new (G_VARIANT_TYPE ("a{sv}"));
+              if (dir_to_pull && *dir_to_pull)
+                g_variant_builder_add (optbuilder, "{s@v}", "subdir",
+                                       g_variant_new_variant (g_variant_new_string (dir_to_pull)));
+              g_variant_builder_add (optbuilder, "{s@v}", "flags",
+                                     g_variant_new_variant (g_variant_new_int32 (pull_flags)));
             /* Add the timestamp check, unless disabled. The option was added in
              * libostree v2017.11 */
-            if (!allow_older)
-              {
+              if (!allow_older)
                 g_variant_builder_add (optbuilder, "{s@v}", "timestamp-check",
                                        g_variant_new_variant (g_variant_new_boolean (TRUE)));
-                /* XXX: Short-term hack until we switch to timestamp-check-from-rev:
-                 * https://github.com/coreos/rpm-ostree/pull/2094. This ensures that
-                 * timestamp-check is comparing against our deployment csum's timestamp, not
-                 * whatever the ref is pointing to.
-                 */
-                if (override_commit
-                    && !ostree_repo_set_ref_immediate (self->repo, origin_remote, origin_ref,
-                                                       self->base_revision, cancellable, error))
+              g_variant_builder_add (optbuilder, "{s@v}", "refs",
+                                     g_variant_new_variant (
+                                         g_variant_new_strv ((const char *const *)&origin_ref, 1)));
+              if (override_commit)
+                g_variant_builder_add (optbuilder, "{s@v}", "override-commit-ids",
+                                       g_variant_new_variant (g_variant_new_strv (
+                                           (const char *const *)&override_commit, 1)));
+              return g_variant_ref_sink (g_variant_builder_end (optbuilder));
+            };
+
+            /* XXX: Short-term hack until we switch to timestamp-check-from-rev:
+             * https://github.com/coreos/rpm-ostree/pull/2094. This ensures that
+             * timestamp-check is comparing against our deployment csum's timestamp, not
+             * whatever the ref is pointing to.
+             */
+            if (!allow_older && override_commit
+                && !ostree_repo_set_ref_immediate (self->repo, origin_remote, origin_ref,
+                                                   self->base_revision, cancellable, error))
+              return FALSE;
+
+            if (metadata_first)
+              {
+                g_autoptr (GVariant) commit_opts = build_opts (
+                    (OstreeRepoPullFlags)(flags | OSTREE_REPO_PULL_FLAGS_COMMIT_ONLY));
+                if (!ostree_repo_pull_with_options (self->repo, origin_remote, commit_opts, NULL,
+                                                    cancellable, error))
+                  return glnx_prefix_error (error, "While pulling %s",
+                                            override_commit ?: origin_ref);
+
+                g_autofree char *pulled_rev = NULL;
+                if (override_commit)
+                  pulled_rev = g_strdup (override_commit);
+                else if (!ostree_repo_resolve_rev (self->repo, r.refspec.c_str (), FALSE,
+                                                   &pulled_rev, error))
                   return FALSE;
+                if (!g_str_equal (pulled_rev, self->base_revision))
+                  print_early_base_diff (self, pulled_rev, cancellable);
               }
-            g_variant_builder_add (
-                optbuilder, "{s@v}", "refs",
-                g_variant_new_variant (g_variant_new_strv ((const char *const *)&origin_ref, 1)));
-            if (override_commit)
-              g_variant_builder_add (optbuilder, "{s@v}", "override-commit-ids",
-                                     g_variant_new_variant (g_variant_new_strv (
-                                         (const char *const *)&override_commit, 1)));
-
-            g_autoptr (GVariant) opts = g_variant_ref_sink (g_variant_builder_end (optbuilder));
+
+            g_autoptr (GVariant) opts = build_opts (flags);
             if (!ostree_repo_pull_with_options (self->repo, origin_remote, opts, progress,
                                                 cancellable, error))
               return glnx_prefix_error (error, "While pulling %s", override_commit ?: origin_ref);
@@ -538,14 +604,13 @@ rpmostree_sysroot_upgrader_pull_base (RpmOstreeSysrootUpgrader *self, const char
   return TRUE;
 }
 
+/* Check out @rev as the tmprootfs, replacing whatever was there */
 static gboolean
-checkout_base_tree (RpmOstreeSysrootUpgrader *self, GCancellable *cancellable, GError **error)
+checkout_tmprootfs (RpmOstreeSysrootUpgrader *self, const char *rev, GCancellable *cancellable,
+                    GError **error)
 {
-  if (self->tmprootfs_dfd != -1)
-    return TRUE; /* already checked out! */
-
   /* let's give the user some feedback so they don't think we're blocked */
-  auto msg = g_strdup_printf ("Checking out tree %.7s", self->base_revision);
+  auto msg = g_strdup_printf ("Checking out tree %.7s", rev);
   auto task = rpmostreecxx::progress_begin_task (msg);
 
   int repo_dfd = ostree_repo_get_dfd (self->repo); /* borrowed */
@@ -568,12 +633,25 @@ checkout_base_tree (RpmOstreeSysrootUpgrader *self, GCancellable *cancellable, G
   if (!glnx_shutil_rm_rf_at (repo_dfd, RPMOSTREE_TMP_ROOTFS_DIR, cancellable, error))
     return FALSE;
 
-  /* NB: we let ostree create the dir for us so that the root dir has the
+  /* NB: we let the checkout create the dir for us so that the root dir has the
    * correct xattrs (e.g. selinux label) */
+  glnx_close_fd (&self->tmprootfs_dfd);
+  g_clear_pointer (&self->devino_cache, ostree_repo_devino_cache_unref);
   self->devino_cache = ostree_repo_devino_cache_new ();
   OstreeRepoCheckoutAtOptions checkout_options = { .devino_to_csum_cache = self->devino_cache };
-  if (!ostree_repo_checkout_at (self->repo, &checkout_options, repo_dfd, RPMOSTREE_TMP_ROOTFS_DIR,
-                                self->base_revision, cancellable, error))
+  /* We're checking out into the repo itself, so hardlinks always work. Saying
+   * so lets us go through the base commit's checkout plan, which is kept
+   * across runs: relayering on the same base (the common case for package
+   * changes) then skips walking the commit's dirtrees entirely. Zero-sized
+   * files are copied like ostree does for deployments, so that they don't
+   * run into the link limit. */
+  if (ostree_repo_get_mode (self->repo) == OSTREE_REPO_MODE_BARE)
+    {
+      checkout_options.no_copy_fallback = TRUE;
+      checkout_options.force_copy_zerosized = TRUE;
+    }
+  if (!rpmostree_checkout_plan_checkout_at (self->repo, &checkout_options, repo_dfd,
+                                            RPMOSTREE_TMP_ROOTFS_DIR, rev, cancellable, error))
     return FALSE;
 
   if (!glnx_opendirat (repo_dfd, RPMOSTREE_TMP_ROOTFS_DIR, FALSE, &self->tmprootfs_dfd, error))
@@ -582,6 +660,15 @@ checkout_base_tree (RpmOstreeSysrootUpgrader *self, GCancellable *cancellable, G
   return TRUE;
 }
 
+static gboolean
+checkout_base_tree (RpmOstreeSysrootUpgrader *self, GCancellable *cancellable, GError **error)
+{
+  if (self->tmprootfs_dfd != -1)
+    return TRUE; /* already checked out! */
+
+  return checkout_tmprootfs (self, self->base_revision, cancellable, error);
+}
+
 /* Optimization: use the already checked out base rpmdb of the pending deployment if the
  * base layer matches. Returns FALSE on error, TRUE otherwise. Check self->rsack to
  * determine if it worked. */
@@ -615,12 +702,35 @@ try_load_base_rsack_from_pending (RpmOstreeSysrootUpgrader *self, GCancellable *
       = ostree_sysroot_get_deployment_dirpath (self->sysroot, self->origin_merge_deployment);
 
   /* this may not actually populate the rsack if it's an old deployment */
-  if (!rpmostree_get_base_refsack_for_root (sysroot_fd, path, &self->rsack, cancellable, error))
+  if (!rpmostree_get_base_refsack_for_root (sysroot_fd, path, repo, base_rev, &self->rsack,
+                                            cancellable, error))
     return FALSE;
 
   return TRUE;
 }
 
+/* With LowMemory, log the peak RSS of the daemon during @phase, i.e. since the
+ * previous call; the high water mark is reset each time. */
+static void
+log_peak_rss (const char *phase)
+{
+  if (!rpmostreed_get_low_memory (rpmostreed_daemon_get ()))
+    return;
+
+  g_autofree char *status
+      = glnx_file_get_contents_utf8_at (AT_FDCWD, "/proc/self/status", NULL, NULL, NULL);
+  const char *hwm = status ? strstr (status, "\nVmHWM:") : NULL;
+  if (hwm)
+    {
+      guint64 kb = g_ascii_strtoull (hwm + strlen ("\nVmHWM:"), NULL, 10);
+      sd_journal_print (LOG_INFO, "Peak RSS during %s: %" G_GUINT64_FORMAT " kB", phase, kb);
+    }
+
+  glnx_autofd int fd = open ("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+  if (fd < 0 || write (fd, "5", 1) != 1)
+    g_debug ("Failed to reset peak RSS: %s", g_strerror (errno));
+}
+
 static gboolean
 load_base_rsack (RpmOstreeSysrootUpgrader *self, GCancellable *cancellable, GError **error)
 {
@@ -633,7 +743,10 @@ load_base_rsack (RpmOstreeSysrootUpgrader *self, GCancellable *cancellable, GErr
       if (!checkout_base_tree (self, cancellable, error))
         return FALSE;
 
-      self->rsack = rpmostree_get_refsack_for_root (self->tmprootfs_dfd, ".", error);
+      /* It's a checkout of the base commit, so its sack can come from the cache */
+      self->rsack = rpmostree_get_refsack_for_commit_root (
+          self->tmprootfs_dfd, ".", ostree_sysroot_repo (self->sysroot), self->base_revision,
+          error);
       if (self->rsack == NULL)
         return FALSE;
     }
@@ -915,6 +1028,50 @@ prepare_context_for_assembly (RpmOstreeSysrootUpgrader *self, const char *tmproo
 }
 
 /* Initialize libdnf context from our configuration */
+/* A digest of everything the layering depsolve and assembly depend on: the
+ * base commit, the origin, the enabled rpm-md repos' configuration and
+ * metadata, and our own version. Must be called after the metadata is
+ * downloaded. */
+static char *
+compute_layering_input_digest (RpmOstreeSysrootUpgrader *self)
+{
+  g_autoptr (RpmOstreeHasher) checksum = rpmostree_hasher_new (G_CHECKSUM_SHA512);
+  rpmostree_hasher_update (checksum, (const guint8 *)PACKAGE_VERSION, strlen (PACKAGE_VERSION) + 1);
+  rpmostree_hasher_update (checksum, (const guint8 *)self->base_revision,
+                           strlen (self->base_revision) + 1);
+
+  g_autoptr (GKeyFile) origin_kf = rpmostree_origin_dup_keyfile (self->computed_origin);
+  gsize len = 0;
+  g_autofree char *origin_data = g_key_file_to_data (origin_kf, &len, NULL);
+  rpmostree_hasher_update (checksum, (const guint8 *)origin_data, len + 1);
+
+  rpmostree_dnf_add_checksum_repos (checksum, rpmostree_context_get_dnf (self->ctx));
+
+  return g_strdup (rpmostree_hasher_get_string (checksum));
+}
+
+/* If @digest is what the previous layered commit was made from, we know
+ * the depsolve and assembly would give the same result, and can just
+ * reuse it. */
+static gboolean
+layering_inputs_unchanged (RpmOstreeSysrootUpgrader *self, const char *digest,
+                           gboolean *out_unchanged, GError **error)
+{
+  *out_unchanged = FALSE;
+  if (!self->final_revision)
+    return TRUE;
+
+  g_autoptr (GVariant) prev_commit = NULL;
+  if (!ostree_repo_load_commit (self->repo, self->final_revision, &prev_commit, NULL, error))
+    return FALSE;
+  g_autoptr (GVariant) metadata = g_variant_get_child_value (prev_commit, 0);
+  g_autoptr (GVariantDict) metadata_dict = g_variant_dict_new (metadata);
+  const char *prev_digest = NULL;
+  if (g_variant_dict_lookup (metadata_dict, "rpmostree.input-sha512", "&s", &prev_digest))
+    *out_unchanged = g_str_equal (prev_digest, digest);
+  return TRUE;
+}
+
 static gboolean
 prep_local_assembly (RpmOstreeSysrootUpgrader *self, GCancellable *cancellable, GError **error)
 {
@@ -934,6 +1091,7 @@ prep_local_assembly (RpmOstreeSysrootUpgrader *self, GCancellable *cancellable,
     return FALSE;
 
   self->ctx = rpmostree_context_new_client (self->repo);
+  rpmostree_context_set_countme (self->ctx, rpmostreed_get_countme (rpmostreed_daemon_get ()));
 
   g_autofree char *tmprootfs_abspath = glnx_fdrel_abspath (self->tmprootfs_dfd, ".");
 
@@ -953,13 +1111,44 @@ prep_local_assembly (RpmOstreeSysrootUpgrader *self, GCancellable *cancellable,
 
   if (rpmostree_origin_has_any_packages (self->computed_origin))
     {
-      if (!rpmostree_context_prepare (self->ctx, cancellable, error))
+      /* Client-side layering rarely needs the filelists; they're fetched
+       * only if the depsolve turns out to need them. */
+      rpmostree_context_set_lazy_filelists (self->ctx, TRUE);
+      const gboolean low_memory = rpmostreed_get_low_memory (rpmostreed_daemon_get ());
+      rpmostree_context_set_low_memory (self->ctx, low_memory);
+      rpmostree_context_set_pkgcache_remote (
+          self->ctx, rpmostreed_get_pkgcache_remote (rpmostreed_daemon_get ()));
+      /* This is what rpmostree_context_prepare() would do first anyway */
+      if (!rpmostree_context_download_metadata (
+              self->ctx, DNF_CONTEXT_SETUP_SACK_FLAG_LOAD_UPDATEINFO, cancellable, error))
         return FALSE;
       self->layering_type = RPMOSTREE_SYSROOT_UPGRADER_LAYERING_RPMMD_REPOS;
+      log_peak_rss ("rpm-md load");
+
+      /* keep a ref on it in case the level higher up needs it; it's only used
+       * for advisories, which we don't have in low memory mode */
+      if (!low_memory)
+        self->rpmmd_sack = (DnfSack *)g_object_ref (
+            dnf_context_get_sack (rpmostree_context_get_dnf (self->ctx)));
+
+      g_autofree char *input_digest = compute_layering_input_digest (self);
+      gboolean unchanged = FALSE;
+      if (!layering_inputs_unchanged (self, input_digest, &unchanged, error))
+        return FALSE;
+      if (unchanged)
+        {
+          /* Note early return; nothing to depsolve or assemble */
+          rpmostree_output_message ("Layering inputs unchanged; reusing %.7s",
+                                    self->final_revision);
+          self->layering_reused = TRUE;
+          self->layering_changed = FALSE;
+          return TRUE;
+        }
 
-      /* keep a ref on it in case the level higher up needs it */
-      self->rpmmd_sack
-          = (DnfSack *)g_object_ref (dnf_context_get_sack (rpmostree_context_get_dnf (self->ctx)));
+      rpmostree_context_set_input_digest (self->ctx, input_digest);
+      if (!rpmostree_context_prepare (self->ctx, cancellable, error))
+        return FALSE;
+      log_peak_rss ("depsolve");
     }
   else
     {
@@ -977,7 +1166,17 @@ prep_local_assembly (RpmOstreeSysrootUpgrader *self, GCancellable *cancellable,
   if (self->flags & RPMOSTREE_SYSROOT_UPGRADER_FLAGS_DRY_RUN)
     {
       if (rpmostree_origin_has_any_packages (self->computed_origin))
-        rpmostree_print_transaction (rpmostree_context_get_dnf (self->ctx));
+        {
+          rpmostree_print_transaction (rpmostree_context_get_dnf (self->ctx));
+          gboolean kernel_changed = FALSE;
+          if (!rpmostree_context_print_cost_estimate (self->ctx, &kernel_changed, cancellable,
+                                                      error))
+            return FALSE;
+          const gboolean regenerate_initramfs
+              = kernel_changed || rpmostree_origin_get_regenerate_initramfs (self->computed_origin);
+          rpmostree_output_message ("  Initramfs regeneration: %s",
+                                    regenerate_initramfs ? "yes" : "no");
+        }
     }
 
   /* If the current state has layering, compare the depsolved set for changes. */
@@ -1011,6 +1210,127 @@ prep_local_assembly (RpmOstreeSysrootUpgrader *self, GCancellable *cancellable,
   return TRUE;
 }
 
+/* The NEVRAs in the rpmdb package list embedded in commit @rev, or NULL if
+ * it doesn't have one. */
+static gboolean
+load_commit_rpmdb_nevras (OstreeRepo *repo, const char *rev, GHashTable **out_nevras,
+                          GError **error)
+{
+  g_autoptr (GVariant) commit = NULL;
+  if (!ostree_repo_load_commit (repo, rev, &commit, NULL, error))
+    return FALSE;
+  g_autoptr (GVariant) metadata = g_variant_get_child_value (commit, 0);
+  g_autoptr (GVariantDict) metadata_dict = g_variant_dict_new (metadata);
+  g_autoptr (GVariant) pkglist = g_variant_dict_lookup_value (
+      metadata_dict, "rpmostree.rpmdb.pkglist", G_VARIANT_TYPE ("a(sssss)"));
+  *out_nevras = NULL;
+  if (!pkglist)
+    return TRUE;
+
+  g_autoptr (GHashTable) nevras = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  GVariantIter iter;
+  g_variant_iter_init (&iter, pkglist);
+  const char *name, *epoch, *version, *release, *arch;
+  while (g_variant_iter_next (&iter, "(&s&s&s&s&s)", &name, &epoch, &version, &release, &arch))
+    g_hash_table_add (nevras,
+                      rpmostree_custom_nevra_strdup (name, g_ascii_strtoull (epoch, NULL, 10),
+                                                     version, release, arch,
+                                                     PKG_NEVRA_FLAGS_NEVRA));
+  *out_nevras = util::move_nullify (nevras);
+  return TRUE;
+}
+
+/* See the IncrementalLayering daemon option. If the only change since the
+ * previous layered deployment is that packages were added on top of the same
+ * base, replace the base tree checkout with a checkout of the previous layered
+ * commit and tell the context which packages it already has. Anything else
+ * (updated or removed layered packages, overrides, etc.) goes through the
+ * regular full assembly, which is the only way to get rid of what the scripts
+ * of removed packages did.
+ */
+static gboolean
+maybe_relayer_incrementally (RpmOstreeSysrootUpgrader *self, gboolean *out_relayered,
+                             GCancellable *cancellable, GError **error)
+{
+  *out_relayered = FALSE;
+  if (!rpmostreed_get_incremental_layering (rpmostreed_daemon_get ())
+      || !self->origin_merge_deployment)
+    return TRUE;
+
+  CXX_TRY_VAR (is_live,
+               rpmostreecxx::has_live_apply_state (*self->sysroot, *self->origin_merge_deployment),
+               error);
+  if (is_live)
+    return TRUE;
+
+  CXX_TRY_VAR (layeredmeta,
+               rpmostreecxx::deployment_layeredmeta_load (*self->repo,
+                                                          *self->origin_merge_deployment),
+               error);
+  if (!layeredmeta.is_layered || !g_str_equal (layeredmeta.base_commit.c_str (),
+                                               self->base_revision))
+    return TRUE;
+
+  /* Things the assembly does to the whole tree rather than per package */
+  if ((*self->treefile)->get_cliwrap () || (*self->treefile)->get_cliwrap_binaries ().size () > 0
+      || (*self->treefile)->get_ostree_layers ().size () > 0
+      || rpmostree_origin_get_local_fileoverride_packages (self->computed_origin).size () > 0)
+    return TRUE;
+
+  HyGoal goal = dnf_context_get_goal (rpmostree_context_get_dnf (self->ctx));
+  g_autoptr (GPtrArray) overrides = dnf_goal_get_packages (
+      goal, DNF_PACKAGE_INFO_UPDATE, DNF_PACKAGE_INFO_DOWNGRADE, DNF_PACKAGE_INFO_REMOVE,
+      DNF_PACKAGE_INFO_OBSOLETE, -1);
+  if (overrides->len > 0)
+    return TRUE;
+
+  const char *prev_rev = ostree_deployment_get_csum (self->origin_merge_deployment);
+  g_autoptr (GHashTable) base_nevras = NULL;
+  g_autoptr (GHashTable) prev_nevras = NULL;
+  if (!load_commit_rpmdb_nevras (self->repo, self->base_revision, &base_nevras, error))
+    return FALSE;
+  if (!load_commit_rpmdb_nevras (self->repo, prev_rev, &prev_nevras, error))
+    return FALSE;
+  if (!base_nevras || !prev_nevras)
+    return TRUE;
+
+  /* Every base package should still be there untouched, i.e. no overrides */
+  GLNX_HASH_TABLE_FOREACH (base_nevras, const char *, nevra)
+    {
+      if (!g_hash_table_contains (prev_nevras, nevra))
+        return TRUE;
+    }
+
+  /* ...and every previously layered package should be in the new set */
+  g_autoptr (GPtrArray) overlays = dnf_goal_get_packages (goal, DNF_PACKAGE_INFO_INSTALL, -1);
+  g_autoptr (GHashTable) overlay_nevras = g_hash_table_new (g_str_hash, g_str_equal);
+  for (guint i = 0; i < overlays->len; i++)
+    {
+      auto pkg = static_cast<DnfPackage *> (overlays->pdata[i]);
+      g_hash_table_add (overlay_nevras, (gpointer)dnf_package_get_nevra (pkg));
+    }
+  g_autoptr (GHashTable) layered_nevras
+      = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  GLNX_HASH_TABLE_FOREACH (prev_nevras, const char *, nevra)
+    {
+      if (g_hash_table_contains (base_nevras, nevra))
+        continue;
+      if (!g_hash_table_contains (overlay_nevras, nevra))
+        return TRUE;
+      g_hash_table_add (layered_nevras, g_strdup (nevra));
+    }
+  if (g_hash_table_size (layered_nevras) >= overlays->len)
+    return TRUE;
+
+  sd_journal_print (LOG_INFO, "Layering %u new packages onto %s",
+                    overlays->len - g_hash_table_size (layered_nevras), prev_rev);
+  if (!checkout_tmprootfs (self, prev_rev, cancellable, error))
+    return FALSE;
+  rpmostree_context_set_layered_nevras (self->ctx, layered_nevras);
+  *out_relayered = TRUE;
+  return TRUE;
+}
+
 /* Overlay pkgs, run scripts, and commit final rootfs to ostree */
 static gboolean
 perform_local_assembly (RpmOstreeSysrootUpgrader *self, GCancellable *cancellable, GError **error)
@@ -1018,15 +1338,27 @@ perform_local_assembly (RpmOstreeSysrootUpgrader *self, GCancellable *cancellabl
   g_assert (self->layering_initialized);
   g_assert (self->pkgs_imported);
 
-  /* If we computed no layering is required, we're done */
-  if (self->layering_type == RPMOSTREE_SYSROOT_UPGRADER_LAYERING_NONE)
+  /* If we computed no layering is required, or the previous layered commit
+   * is still what we'd make, we're done */
+  if (self->layering_type == RPMOSTREE_SYSROOT_UPGRADER_LAYERING_NONE || self->layering_reused)
     return TRUE;
 
   /* this should've been checked by rpmostree_sysroot_upgrader_prep_layering */
   g_assert (!rpmostreed_get_lock_layering (rpmostreed_daemon_get ()));
 
+  const char *checkout_rev = self->base_revision;
+  if (self->layering_type == RPMOSTREE_SYSROOT_UPGRADER_LAYERING_RPMMD_REPOS)
+    {
+      gboolean relayered = FALSE;
+      if (!maybe_relayer_incrementally (self, &relayered, cancellable, error))
+        return FALSE;
+      if (relayered)
+        checkout_rev = ostree_deployment_get_csum (self->origin_merge_deployment);
+    }
+
   rpmostree_context_set_devino_cache (self->ctx, self->devino_cache);
   rpmostree_context_set_tmprootfs_dfd (self->ctx, self->tmprootfs_dfd);
+  rpmostree_context_set_base_commit (self->ctx, checkout_rev);
 
   if (self->layering_type == RPMOSTREE_SYSROOT_UPGRADER_LAYERING_RPMMD_REPOS)
     {
@@ -1057,6 +1389,8 @@ perform_local_assembly (RpmOstreeSysrootUpgrader *self, GCancellable *cancellabl
   const char *kver = NULL;
   const char *kernel_path = NULL;
   const char *initramfs_path = NULL;
+  g_autofree char *initramfs_cache_key = NULL; /* set if we ran dracut */
+  g_autofree char *initramfs_boot_checksum = NULL;
   if (kernel_or_initramfs_changed)
     {
       kernel_state = rpmostree_find_kernel (self->tmprootfs_dfd, cancellable, error);
@@ -1128,16 +1462,52 @@ perform_local_assembly (RpmOstreeSysrootUpgrader *self, GCancellable *cancellabl
       /* NB: We only use the real root's /etc if initramfs regeneration is explicitly
        * requested. IOW, just replacing the kernel still gets use stock settings, like the
        * server side. */
-      if (!rpmostree_run_dracut (self->tmprootfs_dfd, (const char *const *)initramfs_args->pdata,
-                                 kver, initramfs_path,
-                                 rpmostree_origin_get_regenerate_initramfs (self->computed_origin),
-                                 NULL, &initramfs_tmpf, cancellable, error))
-        return FALSE;
+      const gboolean use_root_etc
+          = rpmostree_origin_get_regenerate_initramfs (self->computed_origin);
+      g_autofree char *boot_checksum = NULL;
+
+      /* If we've generated an initramfs from exactly these inputs before, reuse it. We
+       * don't know what the --rebuild fallback's source initramfs has in it, so there
+       * we always regenerate. */
+      if (!initramfs_path)
+        {
+          initramfs_cache_key = rpmostree_initramfs_cache_key (
+              self->tmprootfs_dfd, self->base_revision,
+              (const char *const *)initramfs_args->pdata, kver, use_root_etc, cancellable, error);
+          if (!initramfs_cache_key)
+            return FALSE;
+          if (!rpmostree_initramfs_cache_lookup (self->repo, initramfs_cache_key,
+                                                 self->tmprootfs_dfd, &initramfs_tmpf,
+                                                 &boot_checksum, cancellable, error))
+            return FALSE;
+          if (initramfs_tmpf.initialized)
+            {
+              rpmostree_output_message ("Reusing initramfs generated from the same inputs");
+              g_clear_pointer (&initramfs_cache_key, g_free);
+            }
+        }
+
+      if (!initramfs_tmpf.initialized)
+        {
+          /* Start the boot checksum with the kernel; dracut's output is added
+           * to it as it's written. */
+          g_autoptr (RpmOstreeHasher) checksum = rpmostree_hasher_new (G_CHECKSUM_SHA256);
+          if (!_rpmostree_util_update_checksum_from_file (checksum, self->tmprootfs_dfd,
+                                                          kernel_path, cancellable, error))
+            return FALSE;
+          if (!rpmostree_run_dracut (self->tmprootfs_dfd,
+                                     (const char *const *)initramfs_args->pdata, kver,
+                                     initramfs_path, use_root_etc, NULL, checksum, &initramfs_tmpf,
+                                     cancellable, error))
+            return FALSE;
+          boot_checksum = g_strdup (rpmostree_hasher_get_string (checksum));
+        }
 
       if (!rpmostree_finalize_kernel (self->tmprootfs_dfd, bootdir, kver, kernel_path,
-                                      &initramfs_tmpf, RPMOSTREE_FINALIZE_KERNEL_AUTO, cancellable,
-                                      error))
+                                      &initramfs_tmpf, boot_checksum,
+                                      RPMOSTREE_FINALIZE_KERNEL_AUTO, cancellable, error))
         return glnx_prefix_error (error, "Finalizing kernel");
+      initramfs_boot_checksum = util::move_nullify (boot_checksum);
     }
 
   if (!rpmostree_context_commit (self->ctx, self->base_revision,
@@ -1145,6 +1515,11 @@ perform_local_assembly (RpmOstreeSysrootUpgrader *self, GCancellable *cancellabl
                                  cancellable, error))
     return glnx_prefix_error (error, "Committing");
 
+  if (initramfs_cache_key
+      && !rpmostree_initramfs_cache_store (self->repo, initramfs_cache_key, self->final_revision,
+                                           kver, initramfs_boot_checksum, cancellable, error))
+    return FALSE;
+
   /* Ensure we aren't holding any references to the tmpdir now that we're done;
    * rpmostree_sysroot_upgrader_deploy() eventually calls
    * rpmostree_syscore_cleanup() which deletes 🗑 the tmpdir.  See also similar
@@ -1152,6 +1527,7 @@ perform_local_assembly (RpmOstreeSysrootUpgrader *self, GCancellable *cancellabl
    */
   g_clear_object (&self->ctx);
   glnx_close_fd (&self->tmprootfs_dfd);
+  log_peak_rss ("assembly");
 
   return TRUE;
 }
@@ -1189,6 +1565,9 @@ rpmostree_sysroot_upgrader_prep_layering (RpmOstreeSysrootUpgrader *self,
     return FALSE;
   if (!finalize_overlays (self, cancellable, error))
     return FALSE;
+  /* The base sack isn't needed past this point */
+  if (rpmostreed_get_low_memory (rpmostreed_daemon_get ()))
+    g_clear_pointer (&self->rsack, rpmostree_refsack_unref);
 
   /* Now, it's possible all requested packages are in the new tree, so we have
    * another optimization here for that case. This is a bit tricky: assuming we
@@ -1223,15 +1602,14 @@ rpmostree_sysroot_upgrader_import_pkgs (RpmOstreeSysrootUpgrader *self, GCancell
   self->pkgs_imported = TRUE;
 
   /* any layering actually required? */
-  if (self->layering_type == RPMOSTREE_SYSROOT_UPGRADER_LAYERING_NONE)
+  if (self->layering_type == RPMOSTREE_SYSROOT_UPGRADER_LAYERING_NONE || self->layering_reused)
     return TRUE;
 
   if (self->layering_type == RPMOSTREE_SYSROOT_UPGRADER_LAYERING_RPMMD_REPOS)
     {
-      if (!rpmostree_context_download (self->ctx, cancellable, error))
-        return FALSE;
-      if (!rpmostree_context_import (self->ctx, cancellable, error))
+      if (!rpmostree_context_download_and_import (self->ctx, cancellable, error))
         return FALSE;
+      log_peak_rss ("package import");
     }
 
   return TRUE;
@@ -1257,7 +1635,7 @@ write_history (RpmOstreeSysrootUpgrader *self, OstreeDeployment *new_deployment,
 {
   g_autoptr (GVariant) deployment_variant = NULL;
   if (!rpmostreed_deployment_generate_variant (self->sysroot, new_deployment, NULL, self->repo,
-                                               FALSE, &deployment_variant, error))
+                                               FALSE, NULL, &deployment_variant, error))
     return FALSE;
 
   g_autofree char *deployment_dirpath
@@ -1266,22 +1644,16 @@ write_history (RpmOstreeSysrootUpgrader *self, OstreeDeployment *new_deployment,
   if (!glnx_fstatat (ostree_sysroot_get_fd (self->sysroot), deployment_dirpath, &stbuf, 0, error))
     return FALSE;
 
-  g_autofree char *fn = g_strdup_printf ("%s/%ld", RPMOSTREE_HISTORY_DIR, stbuf.st_ctime);
-  if (!glnx_shutil_mkdir_p_at (AT_FDCWD, RPMOSTREE_HISTORY_DIR, 0775, cancellable, error))
-    return FALSE;
-
-  /* Write out GVariant to a file. One obvious question here is: why not keep this in the
-   * journal itself since it supports binary data? We *could* do this, and it would simplify
-   * querying and pruning, but IMO I find binary data in journal messages not appealing and
-   * it breaks the expectation that journal messages should be somewhat easily
+  /* Append the GVariant to the history log. One obvious question here is: why not keep this
+   * in the journal itself since it supports binary data? We *could* do this, and it would
+   * simplify querying and pruning, but IMO I find binary data in journal messages not
+   * appealing and it breaks the expectation that journal messages should be somewhat easily
    * introspectable. We could also serialize it to JSON first, though we wouldn't be able to
    * re-use the printing code in `status.c` as is. Note also the GVariant can be large (e.g.
-   * we include the full `rpmostree.rpmdb.pkglist` in there). */
-
-  if (!glnx_file_replace_contents_at (
-          AT_FDCWD, fn, static_cast<const guint8 *> (g_variant_get_data (deployment_variant)),
-          g_variant_get_size (deployment_variant), static_cast<GLnxFileReplaceFlags> (0),
-          cancellable, error))
+   * we include the full `rpmostree.rpmdb.pkglist` in there), which is why the log stores
+   * pkglists once per commit, and compressed. */
+  if (!rpmostree_history_log_append (RPMOSTREE_HISTORY_DIR, stbuf.st_ctime, deployment_variant,
+                                     cancellable, error))
     return FALSE;
 
   g_autofree char *version = NULL;
@@ -1465,7 +1837,7 @@ rpmostree_sysroot_upgrader_deploy (RpmOstreeSysrootUpgrader *self,
        * do the prune.  The stage_tree() API above should have loaded our new deployment
        * into the set.
        */
-      if (!rpmostree_syscore_cleanup (self->sysroot, self->repo, cancellable, error))
+      if (!rpmostree_syscore_deploy_cleanup (self->sysroot, self->repo, cancellable, error))
         return FALSE;
     }
   else
@@ -1475,6 +1847,10 @@ rpmostree_sysroot_upgrader_deploy (RpmOstreeSysrootUpgrader *self,
         return FALSE;
     }
 
+  rpmostree_syscore_prewarm_deployment (self->sysroot, self->repo, new_deployment, cancellable);
+  if (use_staging)
+    rpmostree_syscore_preinstall_boot (self->sysroot, new_deployment, cancellable);
+
   if (out_deployment)
     *out_deployment = util::move_nullify (new_deployment);
   return TRUE;
@@ -19,6 +19,7 @@
 #include "config.h"
 
 #include "rpmostree-origin.h"
+#include "rpmostree-sysroot-core.h"
 #include "rpmostree-util.h"
 #include "rpmostreed-daemon.h"
 #include "rpmostreed-sysroot.h"
@@ -26,7 +27,10 @@
 #include "rpmostreed-utils.h"
 
 #include <libglnx.h>
+#include <malloc.h>
 #include <stdio.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <systemd/sd-daemon.h>
 #include <systemd/sd-journal.h>
 #include <systemd/sd-login.h>
@@ -38,6 +42,11 @@
 #define DAEMON_CONFIG_GROUP "Daemon"
 #define EXPERIMENTAL_CONFIG_GROUP "Experimental"
 
+/* From linux/ioprio.h */
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
 struct RpmOstreeClient;
 static struct RpmOstreeClient *client_new (RpmostreedDaemon *self, const char *address,
                                            const char *id);
@@ -68,14 +77,32 @@ struct _RpmostreedDaemon
   gboolean rebooting;
   GDBusProxy *bus_proxy;
   GSource *idle_exit_source;
+  /* See on_idle_trim() */
+  guint idle_trim_id;
+  gboolean idle_trimmed;
+  guint64 idle_trim_rss_before; /* kB */
+  guint64 idle_trim_rss_after;  /* kB */
   guint rerender_status_id;
   RpmostreedSysroot *sysroot;
   gchar *sysroot_path;
 
+  /* See rpmostreed_daemon_defer_cleanup() */
+  gint deferred_cleanup_pending; /* atomic */
+  GThread *deferred_cleanup_thread;
+  GCancellable *deferred_cleanup_cancellable;
+
   /* Settings from the config file */
   guint idle_exit_timeout;
   RpmostreedAutomaticUpdatePolicy auto_update_policy;
   gboolean lock_layering;
+  gboolean incremental_layering;
+  gboolean deferred_cleanup;
+  gboolean low_memory;
+  guint progress_update_rate;
+  char *metrics_textfile;
+  char *pkgcache_remote;
+  guint idle_cache_budget;
+  gboolean countme;
 
   GDBusConnection *connection;
   GDBusObjectManagerServer *object_manager;
@@ -162,6 +189,8 @@ daemon_finalize (GObject *object)
 {
   RpmostreedDaemon *self = RPMOSTREED_DAEMON (object);
 
+  rpmostreed_daemon_finish_deferred_cleanup (self);
+
   g_clear_object (&self->object_manager);
   self->object_manager = NULL;
 
@@ -173,10 +202,14 @@ daemon_finalize (GObject *object)
   g_object_unref (self->connection);
   g_hash_table_unref (self->bus_clients);
   g_clear_pointer (&self->idle_exit_source, (GDestroyNotify)g_source_unref);
+  if (self->idle_trim_id > 0)
+    g_source_remove (self->idle_trim_id);
   if (self->rerender_status_id > 0)
     g_source_remove (self->rerender_status_id);
 
   g_free (self->sysroot_path);
+  g_free (self->metrics_textfile);
+  g_free (self->pkgcache_remote);
   G_OBJECT_CLASS (rpmostreed_daemon_parent_class)->finalize (object);
 
   _daemon_instance = NULL;
@@ -401,6 +434,53 @@ rpmostreed_get_lock_layering (RpmostreedDaemon *self)
   return self->lock_layering;
 }
 
+gboolean
+rpmostreed_get_incremental_layering (RpmostreedDaemon *self)
+{
+  return self->incremental_layering;
+}
+
+gboolean
+rpmostreed_get_deferred_cleanup (RpmostreedDaemon *self)
+{
+  return self->deferred_cleanup;
+}
+
+gboolean
+rpmostreed_get_low_memory (RpmostreedDaemon *self)
+{
+  return self->low_memory;
+}
+
+guint
+rpmostreed_get_progress_update_rate (RpmostreedDaemon *self)
+{
+  return self->progress_update_rate;
+}
+
+/* The Prometheus textfile to write metrics to after each transaction, or NULL */
+const char *
+rpmostreed_get_metrics_textfile (RpmostreedDaemon *self)
+{
+  return self->metrics_textfile;
+}
+
+/* Whether to send Count Me with our own metadata fetches; see
+ * rpmostree_context_set_countme() */
+gboolean
+rpmostreed_get_countme (RpmostreedDaemon *self)
+{
+  return self->countme;
+}
+
+/* The remote serving pre-imported pkgcache branches, or NULL; see
+ * rpmostree_context_set_pkgcache_remote() */
+const char *
+rpmostreed_get_pkgcache_remote (RpmostreedDaemon *self)
+{
+  return self->pkgcache_remote;
+}
+
 /* in-place version of g_ascii_strdown */
 static inline void
 ascii_strdown_inplace (char *str)
@@ -409,6 +489,40 @@ ascii_strdown_inplace (char *str)
     *c = g_ascii_tolower (*c);
 }
 
+static gboolean
+get_config_auto_update_policy (GKeyFile *config, RpmostreedAutomaticUpdatePolicy *out_policy,
+                               GError **error)
+{
+  /* default to off for now; we will change it to "check" in a later release */
+  *out_policy = RPMOSTREED_AUTOMATIC_UPDATE_POLICY_NONE;
+
+  g_autofree char *auto_update_policy_str = get_config_str (config, "AutomaticUpdatePolicy", NULL);
+  if (auto_update_policy_str)
+    {
+      ascii_strdown_inplace (auto_update_policy_str);
+      if (!rpmostree_str_to_auto_update_policy (auto_update_policy_str, out_policy, error))
+        return FALSE;
+    }
+  return TRUE;
+}
+
+/* The AutomaticUpdatePolicy the daemon would use after a reload, for clients
+ * that read the system state directly rather than through the daemon. */
+gboolean
+rpmostreed_read_automatic_update_policy (RpmostreedAutomaticUpdatePolicy *out_policy,
+                                         GError **error)
+{
+  g_autoptr (GKeyFile) config = g_key_file_new ();
+  g_autoptr (GError) local_error = NULL;
+  if (!g_key_file_load_from_file (config, RPMOSTREED_CONF, (GKeyFileFlags)0, &local_error))
+    {
+      if (!g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        return g_propagate_error (error, util::move_nullify (local_error)), FALSE;
+      g_clear_pointer (&config, g_key_file_unref);
+    }
+  return get_config_auto_update_policy (config, out_policy, error);
+}
+
 gboolean
 rpmostreed_daemon_reload_config (RpmostreedDaemon *self, gboolean *out_changed, GError **error)
 {
@@ -420,21 +534,24 @@ rpmostreed_daemon_reload_config (RpmostreedDaemon *self, gboolean *out_changed,
    * follow-up requests are more responsive */
   guint64 idle_exit_timeout = get_config_uint64 (config, "IdleExitTimeout", 60);
 
-  /* default to off for now; we will change it to "check" in a later release */
-  RpmostreedAutomaticUpdatePolicy auto_update_policy = RPMOSTREED_AUTOMATIC_UPDATE_POLICY_NONE;
-
-  g_autofree char *auto_update_policy_str = get_config_str (config, "AutomaticUpdatePolicy", NULL);
-  if (auto_update_policy_str)
-    {
-      ascii_strdown_inplace (auto_update_policy_str);
-      if (!rpmostree_str_to_auto_update_policy (auto_update_policy_str, &auto_update_policy, error))
-        return FALSE;
-    }
+  RpmostreedAutomaticUpdatePolicy auto_update_policy;
+  if (!get_config_auto_update_policy (config, &auto_update_policy, error))
+    return FALSE;
 
   /* don't update changed for these; it's contained to RpmostreedDaemon so no other objects
    * need to be reloaded if it changes */
   self->idle_exit_timeout = idle_exit_timeout;
   self->lock_layering = get_config_bool (config, "LockLayering", FALSE);
+  self->incremental_layering = get_config_bool (config, "IncrementalLayering", FALSE);
+  self->deferred_cleanup = get_config_bool (config, "DeferredCleanup", FALSE);
+  self->low_memory = get_config_bool (config, "LowMemory", FALSE);
+  self->progress_update_rate = get_config_uint64 (config, "ProgressUpdateRate", 10);
+  g_free (self->metrics_textfile);
+  self->metrics_textfile = get_config_str (config, "MetricsTextfile", NULL);
+  g_free (self->pkgcache_remote);
+  self->pkgcache_remote = get_config_str (config, "PkgcacheRemote", NULL);
+  self->idle_cache_budget = get_config_uint64 (config, "IdleCacheBudget", 0);
+  self->countme = get_config_bool (config, "Countme", FALSE);
 
   gboolean changed = FALSE;
 
@@ -539,6 +656,132 @@ idle_update_status (void *data)
   return TRUE;
 }
 
+/* Lower the CPU and I/O priority of the calling thread as far as they go,
+ * so that a deferred cleanup only uses otherwise idle resources. */
+static void
+set_idle_priority (void)
+{
+  const pid_t tid = syscall (SYS_gettid);
+  if (syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT)
+      < 0)
+    sd_journal_print (LOG_WARNING, "Failed to set idle I/O priority: %s", g_strerror (errno));
+  if (setpriority (PRIO_PROCESS, tid, 19) < 0)
+    sd_journal_print (LOG_WARNING, "Failed to set CPU priority: %s", g_strerror (errno));
+}
+
+/* Prune the repo, on our own sysroot as transactions do. If something else
+ * holds the sysroot lock, @out_retry is set and we try again when we're next
+ * idle. */
+static gboolean
+run_deferred_cleanup (const char *sysroot_path, gboolean *out_retry, GCancellable *cancellable,
+                      GError **error)
+{
+  *out_retry = FALSE;
+  g_autoptr (GFile) path = g_file_new_for_path (sysroot_path);
+  g_autoptr (OstreeSysroot) sysroot = ostree_sysroot_new (path);
+  if (!ostree_sysroot_initialize (sysroot, error))
+    return FALSE;
+  ostree_sysroot_set_mount_namespace_in_use (sysroot);
+  if (!ostree_sysroot_load (sysroot, cancellable, error))
+    return FALSE;
+
+  gboolean lock_acquired = FALSE;
+  if (!ostree_sysroot_try_lock (sysroot, &lock_acquired, error))
+    return FALSE;
+  if (!lock_acquired)
+    {
+      *out_retry = TRUE;
+      return TRUE;
+    }
+
+  guint64 freed_space = 0;
+  const gboolean ret = rpmostree_syscore_prune (sysroot, ostree_sysroot_repo (sysroot),
+                                                &freed_space, cancellable, error);
+  ostree_sysroot_unlock (sysroot);
+  if (!ret)
+    return FALSE;
+
+  g_autofree char *freed_space_str = g_format_size_full (freed_space, G_FORMAT_SIZE_DEFAULT);
+  sd_journal_print (LOG_INFO, "Deferred cleanup freed %s", freed_space_str);
+  return TRUE;
+}
+
+static gboolean
+on_deferred_cleanup_done (void *data)
+{
+  g_autoptr (GThread) thread = static_cast<GThread *> (data);
+  RpmostreedDaemon *self = _daemon_instance;
+
+  /* Unless rpmostreed_daemon_finish_deferred_cleanup() beat us to it */
+  if (self && self->deferred_cleanup_thread == thread)
+    {
+      g_thread_join (util::move_nullify (self->deferred_cleanup_thread));
+      g_clear_object (&self->deferred_cleanup_cancellable);
+      update_status (self);
+    }
+  return FALSE;
+}
+
+static gpointer
+deferred_cleanup_thread (gpointer data)
+{
+  auto self = static_cast<RpmostreedDaemon *> (data);
+
+  set_idle_priority ();
+
+  g_autoptr (GError) local_error = NULL;
+  gboolean retry = FALSE;
+  if (!run_deferred_cleanup (self->sysroot_path, &retry, self->deferred_cleanup_cancellable,
+                             &local_error))
+    {
+      if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        retry = TRUE;
+      else
+        sd_journal_print (LOG_WARNING, "Deferred cleanup failed: %s", local_error->message);
+    }
+  if (retry)
+    g_atomic_int_set (&self->deferred_cleanup_pending, TRUE);
+
+  g_idle_add (on_deferred_cleanup_done, g_thread_ref (g_thread_self ()));
+  return NULL;
+}
+
+/* Called from the transaction thread once a deployment's cleanup has
+ * left the prune for later; see rpmostree_syscore_deploy_cleanup(). */
+void
+rpmostreed_daemon_defer_cleanup (RpmostreedDaemon *self)
+{
+  g_atomic_int_set (&self->deferred_cleanup_pending, TRUE);
+}
+
+static void
+maybe_start_deferred_cleanup (RpmostreedDaemon *self)
+{
+  if (self->deferred_cleanup_thread
+      || !g_atomic_int_compare_and_exchange (&self->deferred_cleanup_pending, TRUE, FALSE))
+    return;
+
+  sd_journal_print (LOG_INFO, "Starting deferred cleanup");
+  self->deferred_cleanup_cancellable = g_cancellable_new ();
+  self->deferred_cleanup_thread
+      = g_thread_new ("rpmostreed-cleanup", deferred_cleanup_thread, self);
+}
+
+/* Cancel any deferred cleanup, and wait for it to stop. This must be
+ * called before taking the sysroot lock for a transaction. Cancelling
+ * only leaves unreachable objects behind, which the next prune
+ * gets. */
+void
+rpmostreed_daemon_finish_deferred_cleanup (RpmostreedDaemon *self)
+{
+  if (!self->deferred_cleanup_thread)
+    return;
+
+  g_cancellable_cancel (self->deferred_cleanup_cancellable);
+  g_thread_join (util::move_nullify (self->deferred_cleanup_thread));
+  g_clear_object (&self->deferred_cleanup_cancellable);
+}
+
 static gboolean
 on_idle_exit (void *data)
 {
@@ -546,6 +789,14 @@ on_idle_exit (void *data)
 
   g_clear_pointer (&self->idle_exit_source, (GDestroyNotify)g_source_unref);
 
+  /* Let a deferred cleanup finish; we'll come back here once it has */
+  if (self->deferred_cleanup_thread)
+    {
+      g_source_remove (self->rerender_status_id);
+      self->rerender_status_id = 0;
+      return FALSE;
+    }
+
   sd_notifyf (0, "STATUS=Exiting due to idle");
   self->running = FALSE;
   g_main_context_wakeup (NULL);
@@ -553,6 +804,47 @@ on_idle_exit (void *data)
   return FALSE;
 }
 
+/* How long we wait once idle before trimming, so that e.g. a status right
+ * after a transaction still finds the caches warm */
+#define IDLE_TRIM_DELAY_SECS 30
+
+static guint64
+get_rss_kb (void)
+{
+  g_autofree char *status
+      = glnx_file_get_contents_utf8_at (AT_FDCWD, "/proc/self/status", NULL, NULL, NULL);
+  const char *rss = status ? strstr (status, "\nVmRSS:") : NULL;
+  return rss ? g_ascii_strtoull (rss + strlen ("\nVmRSS:"), NULL, 10) : 0;
+}
+
+/* Without an idle exit, whatever the last transactions left behind would stay
+ * resident for good. So once we've been idle for a bit: shrink the caches to
+ * IdleCacheBudget, then hand the memory freed by those and the transactions
+ * (which glibc keeps in the arenas of the threads that used it) back to the
+ * kernel. Only done once per idle period. */
+static gboolean
+on_idle_trim (void *data)
+{
+  auto self = static_cast<RpmostreedDaemon *> (data);
+
+  /* It'll be done soon enough; come back afterwards */
+  if (self->deferred_cleanup_thread)
+    return G_SOURCE_CONTINUE;
+  self->idle_trim_id = 0;
+
+  self->idle_trim_rss_before = get_rss_kb ();
+  rpmostreed_sysroot_trim_caches (rpmostreed_sysroot_get (), self->idle_cache_budget);
+  malloc_trim (0);
+  self->idle_trim_rss_after = get_rss_kb ();
+  self->idle_trimmed = TRUE;
+  sd_journal_print (LOG_INFO,
+                    "Trimmed memory while idle; RSS %" G_GUINT64_FORMAT " kB -> %" G_GUINT64_FORMAT
+                    " kB",
+                    self->idle_trim_rss_before, self->idle_trim_rss_after);
+  update_status (self);
+  return G_SOURCE_REMOVE;
+}
+
 static void
 update_status (RpmostreedDaemon *self)
 {
@@ -571,6 +863,30 @@ update_status (RpmostreedDaemon *self)
         have_active_txn = TRUE;
     }
 
+  if (!have_active_txn && n_clients == 0)
+    maybe_start_deferred_cleanup (self);
+  else if (self->deferred_cleanup_thread)
+    g_cancellable_cancel (self->deferred_cleanup_cancellable);
+
+  if (!have_active_txn && n_clients == 0)
+    {
+      if (!self->idle_trimmed && self->idle_trim_id == 0)
+        self->idle_trim_id = g_timeout_add_seconds (IDLE_TRIM_DELAY_SECS, on_idle_trim, self);
+    }
+  else
+    {
+      if (self->idle_trim_id > 0)
+        g_source_remove (self->idle_trim_id);
+      self->idle_trim_id = 0;
+      self->idle_trimmed = FALSE;
+    }
+  g_autofree char *trim_status
+      = self->idle_trimmed ? g_strdup_printf ("; trimmed rss %" G_GUINT64_FORMAT
+                                              " -> %" G_GUINT64_FORMAT " kB",
+                                              self->idle_trim_rss_before,
+                                              self->idle_trim_rss_after)
+                           : g_strdup ("");
+
   if (!getenv ("RPMOSTREE_DEBUG_DISABLE_DAEMON_IDLE_EXIT") && self->idle_exit_timeout > 0)
     currently_idle = !have_active_txn && n_clients == 0;
 
@@ -612,9 +928,11 @@ update_status (RpmostreedDaemon *self)
         timeout_micros = 0;
 
       g_assert (currently_idle && self->idle_exit_source);
-      sd_notifyf (0, "STATUS=clients=%u; idle exit in %" G_GUINT64_FORMAT " seconds", n_clients,
-                  timeout_micros / G_USEC_PER_SEC);
+      sd_notifyf (0, "STATUS=clients=%u; idle exit in %" G_GUINT64_FORMAT " seconds%s", n_clients,
+                  timeout_micros / G_USEC_PER_SEC, trim_status);
     }
+  else
+    sd_notifyf (0, "STATUS=clients=%u; idle%s", n_clients, trim_status);
 }
 
 gboolean
@@ -753,6 +1071,7 @@ rpmostreed_daemon_remove_client (RpmostreedDaemon *self, const char *client)
   g_dbus_connection_signal_unsubscribe (self->connection, clientdata->name_watch_id);
   g_autofree char *clientstr = rpmostree_client_to_string (clientdata);
   g_hash_table_remove (self->bus_clients, client);
+  rpmostreed_sysroot_forget_authorizations (rpmostreed_sysroot_get (), client);
   const guint remaining = g_hash_table_size (self->bus_clients);
   sd_journal_print (LOG_INFO, "%s vanished; remaining=%u", clientstr, remaining);
   update_status (self);
@@ -38,6 +38,10 @@ G_BEGIN_DECLS
 #define RPMOSTREE_DRIVER_SD_UNIT "driver-sd-unit"
 #define RPMOSTREE_DRIVER_NAME "driver-name"
 
+/* Snapshot of the sysroot's deployment details cache, so that a daemon
+ * restart (e.g. after an idle exit) doesn't need to reload every commit */
+#define RPMOSTREE_DEPLOYMENT_CACHE RPMOSTREE_RUN_DIR "deployment-cache.gv"
+
 GType rpmostreed_daemon_get_type (void) G_GNUC_CONST;
 RpmostreedDaemon *rpmostreed_daemon_get (void);
 GDBusConnection *rpmostreed_daemon_connection (void);
@@ -57,9 +61,21 @@ void rpmostreed_daemon_publish (RpmostreedDaemon *self, const gchar *path, gbool
 void rpmostreed_daemon_unpublish (RpmostreedDaemon *self, const gchar *path, gpointer thing);
 gboolean rpmostreed_daemon_reload_config (RpmostreedDaemon *self, gboolean *out_changed,
                                           GError **error);
+void rpmostreed_daemon_defer_cleanup (RpmostreedDaemon *self);
+void rpmostreed_daemon_finish_deferred_cleanup (RpmostreedDaemon *self);
 
 RpmostreedAutomaticUpdatePolicy rpmostreed_get_automatic_update_policy (RpmostreedDaemon *self);
 gboolean rpmostreed_get_lock_layering (RpmostreedDaemon *self);
+gboolean rpmostreed_get_incremental_layering (RpmostreedDaemon *self);
+gboolean rpmostreed_get_deferred_cleanup (RpmostreedDaemon *self);
+gboolean rpmostreed_get_low_memory (RpmostreedDaemon *self);
+guint rpmostreed_get_progress_update_rate (RpmostreedDaemon *self);
+const char *rpmostreed_get_metrics_textfile (RpmostreedDaemon *self);
+const char *rpmostreed_get_pkgcache_remote (RpmostreedDaemon *self);
+gboolean rpmostreed_get_countme (RpmostreedDaemon *self);
+
+gboolean rpmostreed_read_automatic_update_policy (RpmostreedAutomaticUpdatePolicy *out_policy,
+                                                  GError **error);
 
 G_END_DECLS
 
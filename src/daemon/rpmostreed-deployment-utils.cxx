@@ -23,9 +23,11 @@
 
 #include "rpmostree-core.h"
 #include "rpmostree-cxxrs.h"
+#include "rpmostree-metrics.h"
 #include "rpmostree-origin.h"
 #include "rpmostree-package-variants.h"
 #include "rpmostree-rpm-util.h"
+#include "rpmostree-scripts.h"
 #include "rpmostree-sysroot-core.h"
 #include "rpmostree-types.h"
 #include "rpmostree-util.h"
@@ -127,6 +129,7 @@ filter_commit_meta (GVariant *commit_meta)
   g_variant_dict_init (&dict, commit_meta);
   /* just remove keys for now, later we may want to define a specific list of keys to keep */
   g_variant_dict_remove (&dict, "rpmostree.rpmdb.pkglist");
+  g_variant_dict_remove (&dict, RPMOSTREE_TRANSFILETRIGGERS_INDEX_KEY);
   g_variant_dict_remove (&dict, "rpmostree.advisories");
   /* these layered commit keys are already promoted up, so just remove them to avoid duplicating and
    * because they can get quite verbose */
@@ -140,28 +143,21 @@ filter_commit_meta (GVariant *commit_meta)
   return g_variant_dict_end (&dict);
 }
 
-gboolean
-rpmostreed_deployment_generate_variant (OstreeSysroot *sysroot, OstreeDeployment *deployment,
-                                        const char *booted_id, OstreeRepo *repo, gboolean filter,
-                                        GVariant **out_variant, GError **error)
+/* Everything in the deployment variant which only depends on the commit:
+ * returns a (s@a{sv}) of the base checksum and the keys to merge in. This is
+ * the bulk of the cost of generating the variant, and since commits are
+ * immutable, it can be cached by checksum. */
+static gboolean
+generate_commit_details (OstreeRepo *repo, OstreeDeployment *deployment, gboolean filter,
+                         GVariant **out_details, GError **error)
 {
   g_autoptr (GVariantDict) dict = g_variant_dict_new (NULL);
-
-  ROSCXX_TRY (deployment_populate_variant (*sysroot, *deployment, *dict), error);
   const gchar *csum = ostree_deployment_get_csum (deployment);
   /* Load the commit object */
   g_autoptr (GVariant) commit = NULL;
   if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_COMMIT, csum, &commit, error))
     return FALSE;
 
-  /* And the origin */
-  g_autoptr (RpmOstreeOrigin) origin = rpmostree_origin_parse_deployment (deployment, error);
-  if (!origin)
-    return FALSE;
-
-  auto r = rpmostree_origin_get_refspec (origin);
-  const char *refspec = r.refspec.c_str ();
-
   gboolean is_layered = FALSE;
   g_autofree char *base_checksum = NULL;
   g_auto (GStrv) layered_pkgs = NULL;
@@ -209,6 +205,72 @@ rpmostreed_deployment_generate_variant (OstreeSysroot *sysroot, OstreeDeployment
   }
   variant_add_commit_details (dict, NULL, commit);
 
+  g_variant_dict_insert (dict, "packages", "^as", layered_pkgs);
+  g_variant_dict_insert (dict, "modules", "^as", layered_modules);
+  g_variant_dict_insert_value (dict, "base-removals", removed_base_pkgs);
+  g_variant_dict_insert_value (dict, "base-local-replacements", replaced_base_local_pkgs);
+  g_variant_dict_insert_value (dict, "base-remote-replacements", replaced_base_remote_pkgs);
+
+  *out_details = g_variant_ref_sink (
+      g_variant_new ("(s@a{sv})", base_checksum, g_variant_dict_end (dict)));
+  return TRUE;
+}
+
+/* If @commit_cache is provided, it's used to look up and store the
+ * commit-derived part of the variant, keyed by checksum. Since that part
+ * depends on @filter, the same cache must always be used with the same value.
+ */
+gboolean
+rpmostreed_deployment_generate_variant (OstreeSysroot *sysroot, OstreeDeployment *deployment,
+                                        const char *booted_id, OstreeRepo *repo, gboolean filter,
+                                        GHashTable *commit_cache, GVariant **out_variant,
+                                        GError **error)
+{
+  g_autoptr (GVariantDict) dict = g_variant_dict_new (NULL);
+
+  ROSCXX_TRY (deployment_populate_variant (*sysroot, *deployment, *dict), error);
+  const gchar *csum = ostree_deployment_get_csum (deployment);
+
+  g_autoptr (GVariant) details = NULL;
+  if (commit_cache)
+    {
+      auto cached = static_cast<GVariant *> (g_hash_table_lookup (commit_cache, csum));
+      if (cached)
+        details = g_variant_ref (cached);
+      rpmostree_metrics_count_cache (RPMOSTREE_METRIC_CACHE_DEPLOYMENT_COMMIT, cached ? 1 : 0,
+                                     cached ? 0 : 1);
+    }
+  if (!details)
+    {
+      if (!generate_commit_details (repo, deployment, filter, &details, error))
+        return FALSE;
+      if (commit_cache)
+        g_hash_table_replace (commit_cache, g_strdup (csum), g_variant_ref (details));
+    }
+
+  const char *base_checksum = NULL;
+  g_autoptr (GVariant) details_dict = NULL;
+  g_variant_get (details, "(&s@a{sv})", &base_checksum, &details_dict);
+  {
+    GVariantIter iter;
+    g_variant_iter_init (&iter, details_dict);
+    const char *key;
+    GVariant *value;
+    while (g_variant_iter_next (&iter, "{&sv}", &key, &value))
+      {
+        g_variant_dict_insert_value (dict, key, value);
+        g_variant_unref (value);
+      }
+  }
+
+  /* And the origin */
+  g_autoptr (RpmOstreeOrigin) origin = rpmostree_origin_parse_deployment (deployment, error);
+  if (!origin)
+    return FALSE;
+
+  auto r = rpmostree_origin_get_refspec (origin);
+  const char *refspec = r.refspec.c_str ();
+
   switch (r.kind)
     {
     case rpmostreecxx::RefspecType::Container:
@@ -265,12 +327,6 @@ rpmostreed_deployment_generate_variant (OstreeSysroot *sysroot, OstreeDeployment
       break;
     }
 
-  g_variant_dict_insert (dict, "packages", "^as", layered_pkgs);
-  g_variant_dict_insert (dict, "modules", "^as", layered_modules);
-  g_variant_dict_insert_value (dict, "base-removals", removed_base_pkgs);
-  g_variant_dict_insert_value (dict, "base-local-replacements", replaced_base_local_pkgs);
-  g_variant_dict_insert_value (dict, "base-remote-replacements", replaced_base_remote_pkgs);
-
   *out_variant = g_variant_dict_end (dict);
   return TRUE;
 }
@@ -539,27 +595,64 @@ rpm_diff_variant_new (RpmDiff *diff)
   return g_variant_dict_end (&dict);
 }
 
-static DnfPackage *
-find_package (DnfSack *sack, gboolean newer, RpmOstreePackage *pkg)
+/* Look up all the names of @pkgs (RpmOstreePackage) in @sack with a single
+ * query, rather than one per package; returns the non-source packages found,
+ * as a map of name -> array of DnfPackage. */
+static GHashTable *
+query_packages_by_name (DnfSack *sack, GPtrArray *pkgs)
 {
+  g_autoptr (GPtrArray) names = g_ptr_array_new ();
+  for (guint i = 0; i < pkgs->len; i++)
+    {
+      auto pkg = static_cast<RpmOstreePackage *> (pkgs->pdata[i]);
+      g_ptr_array_add (names, (char *)rpm_ostree_package_get_name (pkg));
+    }
+  g_ptr_array_add (names, NULL);
+
   hy_autoquery HyQuery query = hy_query_create (sack);
-  hy_query_filter (query, HY_PKG_NAME, HY_EQ, rpm_ostree_package_get_name (pkg));
-  if (newer)
+  hy_query_filter_in (query, HY_PKG_NAME, HY_EQ, (const char **)names->pdata);
+  hy_query_filter (query, HY_PKG_ARCH, HY_NEQ, "src");
+  g_autoptr (GPtrArray) results = hy_query_run (query);
+
+  /* The names are owned by the sack's string pool */
+  GHashTable *by_name = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                               (GDestroyNotify)g_ptr_array_unref);
+  for (guint i = 0; i < results->len; i++)
     {
-      hy_query_filter (query, HY_PKG_EVR, HY_GT, rpm_ostree_package_get_evr (pkg));
-      hy_query_filter (query, HY_PKG_ARCH, HY_NEQ, "src");
-      hy_query_filter_latest (query, TRUE);
+      auto pkg = static_cast<DnfPackage *> (results->pdata[i]);
+      const char *name = dnf_package_get_name (pkg);
+      auto name_pkgs = static_cast<GPtrArray *> (g_hash_table_lookup (by_name, name));
+      if (!name_pkgs)
+        {
+          name_pkgs = g_ptr_array_new_with_free_func ((GDestroyNotify)g_object_unref);
+          g_hash_table_insert (by_name, (char *)name, name_pkgs);
+        }
+      g_ptr_array_add (name_pkgs, g_object_ref (pkg));
     }
-  else
+  return by_name;
+}
+
+/* The newest package in @by_name (from query_packages_by_name()) with the
+ * name of @pkg and a greater EVR, of any arch, if any. */
+static DnfPackage *
+find_newer_package (DnfSack *sack, GHashTable *by_name, RpmOstreePackage *pkg)
+{
+  auto name_pkgs = static_cast<GPtrArray *> (
+      g_hash_table_lookup (by_name, rpm_ostree_package_get_name (pkg)));
+  if (!name_pkgs)
+    return NULL;
+
+  const char *evr = rpm_ostree_package_get_evr (pkg);
+  DnfPackage *newest = NULL;
+  for (guint i = 0; i < name_pkgs->len; i++)
     {
-      /* we want an exact match */
-      hy_query_filter (query, HY_PKG_NEVRA, HY_EQ, rpm_ostree_package_get_nevra (pkg));
+      auto candidate = static_cast<DnfPackage *> (name_pkgs->pdata[i]);
+      if (dnf_sack_evr_cmp (sack, dnf_package_get_evr (candidate), evr) <= 0)
+        continue;
+      if (!newest || rpmostree_pkg_array_compare (&candidate, &newest) > 0)
+        newest = candidate;
     }
-  g_autoptr (GPtrArray) pkgs = hy_query_run (query);
-  if (pkgs->len == 0)
-    return NULL; /* canonicalize to NULL */
-  g_ptr_array_sort (pkgs, (GCompareFunc)rpmostree_pkg_array_compare);
-  return (DnfPackage *)g_object_ref (pkgs->pdata[pkgs->len - 1]);
+  return newest ? (DnfPackage *)g_object_ref (newest) : NULL;
 }
 
 /* For all layered pkgs, check if there are newer versions in the rpmmd. Add diff to
@@ -596,12 +689,13 @@ rpmmd_diff_guess (OstreeRepo *repo, const char *base_checksum, const char *layer
    * effort and use the rpmdb of new_checksum if we already have it somehow, though that's
    * probably not the common case */
 
+  g_autoptr (GHashTable) by_name = query_packages_by_name (sack, all_layered_pkgs);
   g_autoptr (GPtrArray) newer_packages
       = g_ptr_array_new_with_free_func ((GDestroyNotify)g_object_unref);
   for (guint i = 0; i < all_layered_pkgs->len; i++)
     {
       auto pkg = static_cast<RpmOstreePackage *> (all_layered_pkgs->pdata[i]);
-      g_autoptr (DnfPackage) newer_pkg = find_package (sack, TRUE, pkg);
+      g_autoptr (DnfPackage) newer_pkg = find_newer_package (sack, by_name, pkg);
       if (!newer_pkg)
         continue;
 
@@ -622,20 +716,29 @@ static GPtrArray *
 rpm_ostree_pkgs_to_dnf (DnfSack *sack, GPtrArray *rpm_ostree_pkgs)
 {
   g_autoptr (GPtrArray) dnf_pkgs = g_ptr_array_new_with_free_func ((GDestroyNotify)g_object_unref);
+  if (rpm_ostree_pkgs->len == 0)
+    return util::move_nullify (dnf_pkgs);
 
+  g_autoptr (GHashTable) by_name = query_packages_by_name (sack, rpm_ostree_pkgs);
   const guint n = rpm_ostree_pkgs->len;
   for (guint i = 0; i < n; i++)
     {
       auto pkg = static_cast<RpmOstreePackage *> (rpm_ostree_pkgs->pdata[i]);
-      hy_autoquery HyQuery query = hy_query_create (sack);
-      hy_query_filter (query, HY_PKG_NAME, HY_EQ, rpm_ostree_package_get_name (pkg));
-      hy_query_filter (query, HY_PKG_EVR, HY_EQ, rpm_ostree_package_get_evr (pkg));
-      hy_query_filter (query, HY_PKG_ARCH, HY_EQ, rpm_ostree_package_get_arch (pkg));
-      g_autoptr (GPtrArray) pkgs = hy_query_run (query);
-
-      /* 0 --> ostree stream is out of sync with rpmmd repos probably? */
-      if (pkgs->len > 0)
-        g_ptr_array_add (dnf_pkgs, g_object_ref (pkgs->pdata[0]));
+      auto name_pkgs = static_cast<GPtrArray *> (
+          g_hash_table_lookup (by_name, rpm_ostree_package_get_name (pkg)));
+      /* none --> ostree stream is out of sync with rpmmd repos probably? */
+      for (guint j = 0; name_pkgs && j < name_pkgs->len; j++)
+        {
+          auto candidate = static_cast<DnfPackage *> (name_pkgs->pdata[j]);
+          if (dnf_sack_evr_cmp (sack, dnf_package_get_evr (candidate),
+                                rpm_ostree_package_get_evr (pkg))
+                  == 0
+              && g_str_equal (dnf_package_get_arch (candidate), rpm_ostree_package_get_arch (pkg)))
+            {
+              g_ptr_array_add (dnf_pkgs, g_object_ref (candidate));
+              break;
+            }
+        }
     }
 
   return util::move_nullify (dnf_pkgs);
@@ -856,3 +959,71 @@ rpmostreed_update_generate_variant (OstreeDeployment *booted_deployment,
 
   return TRUE;
 }
+
+/* Read the update cached by the last automatic update check. If there is
+ * none, or if it was computed for a different booted commit than
+ * @booted_deployment's, @out_cached_update is set to %NULL; in the latter
+ * case, @out_outdated is set too, and the caller may delete the cache. */
+gboolean
+rpmostreed_read_cached_update (OstreeDeployment *booted_deployment, GVariant **out_cached_update,
+                               gboolean *out_outdated, GError **error)
+{
+  *out_cached_update = NULL;
+  *out_outdated = FALSE;
+
+  glnx_autofd int fd = -1;
+  g_autoptr (GError) local_error = NULL;
+  if (!glnx_openat_rdonly (AT_FDCWD, RPMOSTREE_AUTOUPDATES_CACHE_FILE, TRUE, &fd, &local_error))
+    {
+      if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        return g_propagate_error (error, util::move_nullify (local_error)), FALSE;
+      return TRUE; /* Note early return */
+    }
+
+  /* sanity check there isn't something fishy going on before even reading it in */
+  struct stat stbuf;
+  if (!glnx_fstat (fd, &stbuf, error))
+    return FALSE;
+
+  if (!rpmostree_check_size_within_limit (stbuf.st_size, OSTREE_MAX_METADATA_SIZE,
+                                          RPMOSTREE_AUTOUPDATES_CACHE_FILE, error))
+    return FALSE;
+
+  /* The file is only ever replaced or deleted, never rewritten in place, so
+   * the mapping stays valid as long as the variant is alive. */
+  g_autoptr (GMappedFile) mfile = g_mapped_file_new_from_fd (fd, FALSE, error);
+  if (!mfile)
+    return glnx_prefix_error (error, "Mapping %s", RPMOSTREE_AUTOUPDATES_CACHE_FILE);
+  g_autoptr (GBytes) data = g_mapped_file_get_bytes (mfile);
+
+  /* We wrote it ourselves, so it's normally in normal form already; checking
+   * that once here lets all the lookups after that skip validation. */
+  g_autoptr (GVariant) cached_update
+      = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE_VARDICT, data, FALSE));
+  if (g_variant_is_normal_form (cached_update))
+    {
+      g_variant_unref (cached_update);
+      cached_update
+          = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE_VARDICT, data, TRUE));
+    }
+  else
+    {
+      GVariant *normal = g_variant_get_normal_form (cached_update);
+      g_variant_unref (cached_update);
+      cached_update = normal;
+    }
+
+  /* check if cache is still valid -- see rpmostreed_update_generate_variant() */
+  g_auto (GVariantDict) dict;
+  g_variant_dict_init (&dict, cached_update);
+  const char *state = NULL;
+  if (!g_variant_dict_lookup (&dict, "update-sha256", "&s", &state)
+      || !g_str_equal (state, ostree_deployment_get_csum (booted_deployment)))
+    {
+      *out_outdated = TRUE;
+      return TRUE;
+    }
+
+  *out_cached_update = util::move_nullify (cached_update);
+  return TRUE;
+}
@@ -35,8 +35,8 @@ GVariant *rpmostreed_deployment_generate_blank_variant (void);
 gboolean rpmostreed_deployment_generate_variant (OstreeSysroot *sysroot,
                                                  OstreeDeployment *deployment,
                                                  const char *booted_id, OstreeRepo *repo,
-                                                 gboolean filter, GVariant **out_variant,
-                                                 GError **error);
+                                                 gboolean filter, GHashTable *commit_cache,
+                                                 GVariant **out_variant, GError **error);
 
 GVariant *rpmostreed_commit_generate_cached_details_variant (OstreeDeployment *deployment,
                                                              OstreeRepo *repo, const char *refspec,
@@ -47,4 +47,8 @@ gboolean rpmostreed_update_generate_variant (OstreeDeployment *booted_deployment
                                              DnfSack *sack, GVariant **out_update,
                                              GCancellable *cancellable, GError **error);
 
+gboolean rpmostreed_read_cached_update (OstreeDeployment *booted_deployment,
+                                        GVariant **out_cached_update, gboolean *out_outdated,
+                                        GError **error);
+
 G_END_DECLS
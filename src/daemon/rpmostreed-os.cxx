@@ -24,22 +24,23 @@
 
 #include "rpmostree-core.h"
 #include "rpmostree-origin.h"
+#include "rpmostree-package-pack.h"
 #include "rpmostree-package-variants.h"
 #include "rpmostree-sysroot-core.h"
+#include "rpmostree-trace.h"
 #include "rpmostree-util.h"
 #include "rpmostreed-daemon.h"
 #include "rpmostreed-deployment-utils.h"
 #include "rpmostreed-errors.h"
 #include "rpmostreed-os.h"
+#include "rpmostreed-search-index.h"
 #include "rpmostreed-sysroot.h"
 #include "rpmostreed-transaction-types.h"
 #include "rpmostreed-transaction.h"
 #include "rpmostreed-utils.h"
 
-#include <libdnf/hy-util.cpp>
-
 #include <set>
-#include <vector>
+#include <string>
 
 typedef struct _RpmostreedOSClass RpmostreedOSClass;
 
@@ -48,6 +49,19 @@ struct _RpmostreedOS
   RPMOSTreeOSSkeleton parent_instance;
   gboolean on_session_bus;
   guint signal_id;
+
+  /* A loaded DnfContext kept around for package queries; see
+   * os_create_dnf_context_simple() */
+  DnfContext *warm_dnfctx;
+  char *warm_dnfctx_config_key;
+  char *warm_dnfctx_metadata_key;
+  RpmostreedSearchIndex *warm_search_index; /* Built lazily from warm_dnfctx */
+
+  /* The auto-updates cache as last read, and the file it was read from, so
+   * that reloads can skip it while it doesn't change */
+  GVariant *cached_update;
+  struct stat cached_update_stbuf;
+  gboolean have_cached_update_stbuf;
 };
 
 struct _RpmostreedOSClass
@@ -84,11 +98,10 @@ sysroot_changed (RpmostreedSysroot *sysroot, gpointer user_data)
 }
 
 static gboolean
-os_authorize_method (GDBusInterfaceSkeleton *interface, GDBusMethodInvocation *invocation)
+os_check_authorization (GDBusInterfaceSkeleton *interface, GDBusMethodInvocation *invocation)
 {
   RpmostreedSysroot *sysroot = rpmostreed_sysroot_get ();
   const gchar *method_name = g_dbus_method_invocation_get_method_name (invocation);
-  const gchar *sender = g_dbus_method_invocation_get_sender (invocation);
   GVariant *parameters = g_dbus_method_invocation_get_parameters (invocation);
   g_autoptr (GPtrArray) actions = g_ptr_array_new ();
   gboolean authorized = FALSE;
@@ -104,25 +117,20 @@ os_authorize_method (GDBusInterfaceSkeleton *interface, GDBusMethodInvocation *i
   if (authorized)
     return TRUE;
 
-  g_autoptr (PolkitAuthority) authority
-      = rpmostreed_sysroot_get_polkit_authority (sysroot, &local_error);
-  if (!authority)
-    {
-      g_assert (local_error);
-      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                                             "Failed to load polkit: %s", local_error->message);
-      return FALSE;
-    }
-
+  /* Only these don't change anything, so their authorization can be reused */
+  gboolean cacheable = FALSE;
   if (g_strcmp0 (method_name, "GetDeploymentsRpmDiff") == 0
       || g_strcmp0 (method_name, "GetCachedDeployRpmDiff") == 0
-      || g_strcmp0 (method_name, "DownloadDeployRpmDiff") == 0
       || g_strcmp0 (method_name, "GetCachedUpdateRpmDiff") == 0
-      || g_strcmp0 (method_name, "DownloadUpdateRpmDiff") == 0
-      || g_strcmp0 (method_name, "GetCachedRebaseRpmDiff") == 0
-      || g_strcmp0 (method_name, "DownloadRebaseRpmDiff") == 0
-      || g_strcmp0 (method_name, "RefreshMd") == 0)
-
+      || g_strcmp0 (method_name, "GetCachedRebaseRpmDiff") == 0)
+    {
+      g_ptr_array_add (actions, (void *)"org.projectatomic.rpmostree1.repo-refresh");
+      cacheable = TRUE;
+    }
+  else if (g_strcmp0 (method_name, "DownloadDeployRpmDiff") == 0
+           || g_strcmp0 (method_name, "DownloadUpdateRpmDiff") == 0
+           || g_strcmp0 (method_name, "DownloadRebaseRpmDiff") == 0
+           || g_strcmp0 (method_name, "RefreshMd") == 0)
     {
       g_ptr_array_add (actions, (void *)"org.projectatomic.rpmostree1.repo-refresh");
     }
@@ -147,7 +155,9 @@ os_authorize_method (GDBusInterfaceSkeleton *interface, GDBusMethodInvocation *i
   else if (g_strcmp0 (method_name, "GetDeploymentBootConfig") == 0
            || g_strcmp0 (method_name, "ListRepos") == 0
            || g_strcmp0 (method_name, "WhatProvides") == 0
-           || g_strcmp0 (method_name, "GetPackages") == 0 || g_strcmp0 (method_name, "Search") == 0)
+           || g_strcmp0 (method_name, "GetPackages") == 0 || g_strcmp0 (method_name, "Search") == 0
+           || g_strcmp0 (method_name, "WhatProvidesBatch") == 0
+           || g_strcmp0 (method_name, "GetPackagesBatch") == 0)
     {
       /* Note: early return here because no need authentication
        * for these methods
@@ -251,27 +261,12 @@ os_authorize_method (GDBusInterfaceSkeleton *interface, GDBusMethodInvocation *i
       authorized = FALSE;
     }
 
-  for (guint i = 0; i < actions->len; i++)
+  if (actions->len > 0)
     {
-      auto action = static_cast<const gchar *> (g_ptr_array_index (actions, i));
-      glnx_unref_object PolkitSubject *subject = polkit_system_bus_name_new (sender);
-      glnx_unref_object PolkitAuthorizationResult *result = NULL;
-      g_autoptr (GError) error = NULL;
-
-      result = polkit_authority_check_authorization_sync (
-          authority, subject, action, NULL, POLKIT_CHECK_AUTHORIZATION_FLAGS_ALLOW_USER_INTERACTION,
-          NULL, &error);
-      if (result == NULL)
-        {
-          g_assert (error);
-          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                                                 "Authorization error: %s", error->message);
-          return FALSE;
-        }
-
-      authorized = polkit_authorization_result_get_is_authorized (result);
-      if (!authorized)
-        break;
+      g_ptr_array_add (actions, NULL);
+      return rpmostreed_sysroot_check_authorization (sysroot, interface, invocation,
+                                                     (const char *const *)actions->pdata, TRUE,
+                                                     cacheable, "OS");
     }
 
   if (!authorized)
@@ -284,6 +279,61 @@ os_authorize_method (GDBusInterfaceSkeleton *interface, GDBusMethodInvocation *i
   return authorized;
 }
 
+/* Returns FALSE if @method_name doesn't start a transaction */
+static gboolean
+get_txn_priority (const char *method_name, RpmostreedTxnPriority *out_priority)
+{
+  static const struct
+  {
+    const char *method_name;
+    RpmostreedTxnPriority priority;
+  } txn_methods[] = {
+    { "AutomaticUpdateTrigger", RPMOSTREED_TXN_PRIORITY_AUTOMATIC },
+    { "RefreshMd", RPMOSTREED_TXN_PRIORITY_QUERY },
+    { "DownloadUpdateRpmDiff", RPMOSTREED_TXN_PRIORITY_QUERY },
+    { "DownloadRebaseRpmDiff", RPMOSTREED_TXN_PRIORITY_QUERY },
+    { "DownloadDeployRpmDiff", RPMOSTREED_TXN_PRIORITY_QUERY },
+    { "Deploy", RPMOSTREED_TXN_PRIORITY_INTERACTIVE },
+    { "Upgrade", RPMOSTREED_TXN_PRIORITY_INTERACTIVE },
+    { "Rebase", RPMOSTREED_TXN_PRIORITY_INTERACTIVE },
+    { "Rollback", RPMOSTREED_TXN_PRIORITY_INTERACTIVE },
+    { "ClearRollbackTarget", RPMOSTREED_TXN_PRIORITY_INTERACTIVE },
+    { "PkgChange", RPMOSTREED_TXN_PRIORITY_INTERACTIVE },
+    { "UpdateDeployment", RPMOSTREED_TXN_PRIORITY_INTERACTIVE },
+    { "SetInitramfsState", RPMOSTREED_TXN_PRIORITY_INTERACTIVE },
+    { "InitramfsEtc", RPMOSTREED_TXN_PRIORITY_INTERACTIVE },
+    { "KernelArgs", RPMOSTREED_TXN_PRIORITY_INTERACTIVE },
+    { "Cleanup", RPMOSTREED_TXN_PRIORITY_INTERACTIVE },
+    { "ModifyYumRepo", RPMOSTREED_TXN_PRIORITY_INTERACTIVE },
+    { "FinalizeDeployment", RPMOSTREED_TXN_PRIORITY_INTERACTIVE },
+  };
+  for (guint i = 0; i < G_N_ELEMENTS (txn_methods); i++)
+    {
+      if (g_str_equal (method_name, txn_methods[i].method_name))
+        {
+          *out_priority = txn_methods[i].priority;
+          return TRUE;
+        }
+    }
+  return FALSE;
+}
+
+static gboolean
+os_authorize_method (GDBusInterfaceSkeleton *interface, GDBusMethodInvocation *invocation)
+{
+  rpmostree_trace_mark ("dbus-method", g_dbus_method_invocation_get_method_name (invocation));
+  if (!os_check_authorization (interface, invocation))
+    return FALSE;
+
+  /* If another transaction is running, wait our turn rather than fail */
+  RpmostreedTxnPriority priority;
+  if (get_txn_priority (g_dbus_method_invocation_get_method_name (invocation), &priority)
+      && rpmostreed_sysroot_queue_txn (rpmostreed_sysroot_get (), interface, invocation, priority))
+    return FALSE;
+
+  return TRUE;
+}
+
 static void
 os_dispose (GObject *object)
 {
@@ -301,6 +351,12 @@ os_dispose (GObject *object)
 
   self->signal_id = 0;
 
+  g_clear_object (&self->warm_dnfctx);
+  g_clear_pointer (&self->warm_dnfctx_config_key, g_free);
+  g_clear_pointer (&self->warm_dnfctx_metadata_key, g_free);
+  g_clear_pointer (&self->warm_search_index, rpmostreed_search_index_free);
+  g_clear_pointer (&self->cached_update, g_variant_unref);
+
   G_OBJECT_CLASS (rpmostreed_os_parent_class)->dispose (object);
 }
 
@@ -354,23 +410,115 @@ new_variant_diff_result (GVariant *diff, GVariant *details)
   return g_variant_new ("(@a(sua{sv})@a{sv})", diff, details);
 }
 
-/* ----------------------------------------------------------------------------------------------------
+/* The rpm diff queries need to check out and load rpmdbs, which can take a
+ * while. Rather than blocking the main loop (and with it, any running
+ * transaction's signals and every other client), they run on a worker
+ * thread, and several can be in flight alongside a transaction. Anything
+ * that reads the sysroot is resolved up front on the main thread; the worker
+ * only reads immutable commits from the repo and the deployment objects it
+ * holds a ref to.
  */
+typedef struct
+{
+  OstreeRepo *repo;
+  char *from_rev;
+  char *to_rev;
+  /* If set, also generate the cached details for this deployment */
+  OstreeDeployment *base_deployment;
+  char *refspec;
+  char *checksum; /* allow-none */
+} DiffQuery;
 
-static gboolean
-get_deployments_rpm_diff (const char *arg_deployid0, const char *arg_deployid1,
-                          GVariant **out_value, GError **error)
+static void
+diff_query_free (DiffQuery *query)
 {
-  g_autoptr (GCancellable) cancellable = NULL;
-  RpmostreedSysroot *global_sysroot;
-  OstreeSysroot *ot_sysroot = NULL;
-  OstreeRepo *ot_repo = NULL;
+  g_clear_object (&query->repo);
+  g_free (query->from_rev);
+  g_free (query->to_rev);
+  g_clear_object (&query->base_deployment);
+  g_free (query->refspec);
+  g_free (query->checksum);
+  g_free (query);
+}
+
+static DiffQuery *
+diff_query_new (OstreeRepo *repo, const char *from_rev, const char *to_rev)
+{
+  DiffQuery *query = g_new0 (DiffQuery, 1);
+  query->repo = (OstreeRepo *)g_object_ref (repo);
+  query->from_rev = g_strdup (from_rev);
+  query->to_rev = g_strdup (to_rev);
+  return query;
+}
+
+static void
+diff_query_thread (GTask *task, gpointer source_object, gpointer task_data,
+                   GCancellable *cancellable)
+{
+  auto query = static_cast<DiffQuery *> (task_data);
+  auto guard = rpmostreecxx::rpmostreed_daemon_tokio_enter (rpmostreed_daemon_get ());
+  GError *local_error = NULL;
+
   g_autoptr (GVariant) value = NULL;
+  if (!rpm_ostree_db_diff_variant (query->repo, query->from_rev, query->to_rev, FALSE, &value,
+                                   cancellable, &local_error))
+    {
+      g_task_return_error (task, local_error);
+      return;
+    }
 
-  global_sysroot = rpmostreed_sysroot_get ();
+  GVariant *result = NULL;
+  if (query->base_deployment)
+    {
+      g_autoptr (GVariant) details = rpmostreed_commit_generate_cached_details_variant (
+          query->base_deployment, query->repo, query->refspec, query->checksum, &local_error);
+      if (!details)
+        {
+          g_task_return_error (task, local_error);
+          return;
+        }
+      result = new_variant_diff_result (value, details);
+    }
+  else
+    result = g_variant_new ("(@a(sua{sv}))", value);
 
-  ot_sysroot = rpmostreed_sysroot_get_root (global_sysroot);
-  ot_repo = rpmostreed_sysroot_get_repo (global_sysroot);
+  g_task_return_pointer (task, g_variant_ref_sink (result), (GDestroyNotify)g_variant_unref);
+}
+
+static void
+diff_query_done (GObject *source_object, GAsyncResult *result, gpointer user_data)
+{
+  auto invocation = static_cast<GDBusMethodInvocation *> (user_data);
+  GError *local_error = NULL;
+  g_autoptr (GVariant) value
+      = static_cast<GVariant *> (g_task_propagate_pointer (G_TASK (result), &local_error));
+  if (!value)
+    g_dbus_method_invocation_take_error (invocation, local_error);
+  else
+    g_dbus_method_invocation_return_value (invocation, value);
+}
+
+/* Takes ownership of @query; the invocation is completed from the main thread
+ * once the query finishes. */
+static gboolean
+os_run_diff_query (RPMOSTreeOS *interface, GDBusMethodInvocation *invocation, DiffQuery *query)
+{
+  g_autoptr (GTask) task = g_task_new (interface, NULL, diff_query_done, invocation);
+  g_task_set_task_data (task, query, (GDestroyNotify)diff_query_free);
+  g_task_run_in_thread (task, diff_query_thread);
+  return TRUE;
+}
+
+/* ----------------------------------------------------------------------------------------------------
+ */
+
+static gboolean
+get_deployments_rpm_diff (const char *arg_deployid0, const char *arg_deployid1,
+                          DiffQuery **out_query, GError **error)
+{
+  RpmostreedSysroot *global_sysroot = rpmostreed_sysroot_get ();
+  OstreeSysroot *ot_sysroot = rpmostreed_sysroot_get_root (global_sysroot);
+  OstreeRepo *ot_repo = rpmostreed_sysroot_get_repo (global_sysroot);
 
   rust::Str deploy_id0 (arg_deployid0 ?: "");
   CXX_TRY_VAR (ref0, rpmostreecxx::deployment_checksum_for_id (*ot_sysroot, deploy_id0), error);
@@ -378,11 +526,7 @@ get_deployments_rpm_diff (const char *arg_deployid0, const char *arg_deployid1,
   rust::Str deploy_id1 (arg_deployid1 ?: "");
   CXX_TRY_VAR (ref1, rpmostreecxx::deployment_checksum_for_id (*ot_sysroot, deploy_id1), error);
 
-  if (!rpm_ostree_db_diff_variant (ot_repo, ref0.c_str (), ref1.c_str (), FALSE, &value,
-                                   cancellable, error))
-    return FALSE;
-
-  *out_value = util::move_nullify (value);
+  *out_query = diff_query_new (ot_repo, ref0.c_str (), ref1.c_str ());
   return TRUE;
 }
 
@@ -391,29 +535,22 @@ os_handle_get_deployments_rpm_diff (RPMOSTreeOS *interface, GDBusMethodInvocatio
                                     const char *arg_deployid0, const char *arg_deployid1)
 {
   GError *local_error = NULL;
-  g_autoptr (GVariant) value = NULL;
+  DiffQuery *query = NULL;
 
-  gboolean is_ok = get_deployments_rpm_diff (arg_deployid0, arg_deployid1, &value, &local_error);
-  if (!is_ok)
+  if (!get_deployments_rpm_diff (arg_deployid0, arg_deployid1, &query, &local_error))
     return os_throw_dbus_invocation_error (invocation, &local_error);
 
-  g_assert (value != NULL);
-  g_dbus_method_invocation_return_value (invocation, g_variant_new ("(@a(sua{sv}))", value));
-
-  return TRUE;
+  return os_run_diff_query (interface, invocation, query);
 }
 
 static gboolean
-get_cached_update_rpm_diff (const gchar *name, const char *arg_deployid, GVariant **out_value,
-                            GVariant **out_details, GError **error)
+get_cached_update_rpm_diff (const gchar *name, const char *arg_deployid, DiffQuery **out_query,
+                            GError **error)
 {
   RpmostreedSysroot *global_sysroot;
   g_autoptr (RpmOstreeOrigin) origin = NULL;
   OstreeSysroot *ot_sysroot = NULL;
   OstreeRepo *ot_repo = NULL;
-  GCancellable *cancellable = NULL;
-  g_autoptr (GVariant) value = NULL;
-  g_autoptr (GVariant) details = NULL;
 
   global_sysroot = rpmostreed_sysroot_get ();
 
@@ -431,17 +568,11 @@ get_cached_update_rpm_diff (const gchar *name, const char *arg_deployid, GVarian
     return FALSE;
 
   auto r = rpmostree_origin_get_refspec (origin);
-  if (!rpm_ostree_db_diff_variant (ot_repo, ostree_deployment_get_csum (base_deployment),
-                                   r.refspec.c_str (), FALSE, &value, cancellable, error))
-    return FALSE;
-
-  details = rpmostreed_commit_generate_cached_details_variant (base_deployment, ot_repo,
-                                                               r.refspec.c_str (), NULL, error);
-  if (!details)
-    return FALSE;
-
-  *out_value = util::move_nullify (value);
-  *out_details = util::move_nullify (details);
+  DiffQuery *query = diff_query_new (ot_repo, ostree_deployment_get_csum (base_deployment),
+                                     r.refspec.c_str ());
+  query->base_deployment = (OstreeDeployment *)g_object_ref (base_deployment);
+  query->refspec = g_strdup (r.refspec.c_str ());
+  *out_query = query;
   return TRUE;
 }
 
@@ -450,20 +581,14 @@ os_handle_get_cached_update_rpm_diff (RPMOSTreeOS *interface, GDBusMethodInvocat
                                       const char *arg_deployid)
 {
   GError *local_error = NULL;
-  g_autoptr (GVariant) value = NULL;
-  g_autoptr (GVariant) details = NULL;
+  DiffQuery *query = NULL;
 
   const gchar *name = rpmostree_os_get_name (interface);
 
-  gboolean is_ok = get_cached_update_rpm_diff (name, arg_deployid, &value, &details, &local_error);
-  if (!is_ok)
+  if (!get_cached_update_rpm_diff (name, arg_deployid, &query, &local_error))
     return os_throw_dbus_invocation_error (invocation, &local_error);
 
-  g_assert (value != NULL);
-  g_assert (details != NULL);
-  g_dbus_method_invocation_return_value (invocation, new_variant_diff_result (value, details));
-
-  return TRUE;
+  return os_run_diff_query (interface, invocation, query);
 }
 
 static gboolean refresh_cached_update (RpmostreedOS *, GError **error);
@@ -854,6 +979,9 @@ os_handle_refresh_md (RPMOSTreeOS *interface, GDBusMethodInvocation *invocation,
           flags |= RPMOSTREE_TRANSACTION_REFRESH_MD_FLAG_FORCE;
           force = TRUE;
         }
+      const gboolean prefetch = vardict_lookup_bool (&dict, "prefetch", FALSE);
+      if (prefetch)
+        flags |= RPMOSTREE_TRANSACTION_REFRESH_MD_FLAG_PREFETCH;
 
       transaction = rpmostreed_transaction_new_refresh_md (
           invocation, ot_sysroot, static_cast<RpmOstreeTransactionRefreshMdFlags> (flags), osname,
@@ -863,6 +991,8 @@ os_handle_refresh_md (RPMOSTreeOS *interface, GDBusMethodInvocation *invocation,
 
       if (force)
         g_string_append (title, " (force)");
+      if (prefetch)
+        g_string_append (title, " (prefetch)");
       rpmostreed_sysroot_set_txn_and_title (rsysroot, transaction, title->str);
     }
   g_assert (transaction != NULL);
@@ -910,10 +1040,90 @@ os_handle_modify_yum_repo (RPMOSTreeOS *interface, GDBusMethodInvocation *invoca
   return TRUE;
 }
 
+/* Checksum everything a client DnfContext is configured from: the deployments
+ * it's rooted in and the contents of the repo files it reads. */
+static char *
+compute_dnf_context_config_key (OstreeSysroot *sysroot, OstreeDeployment *cfg_merge_deployment,
+                                const char *deployment_root, GError **error)
+{
+  g_autoptr (GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_checksum_update (checksum, (const guint8 *)deployment_root, strlen (deployment_root) + 1);
+  g_autofree char *cfg_deployment_root
+      = rpmostree_get_deployment_root (sysroot, cfg_merge_deployment);
+  g_checksum_update (checksum, (const guint8 *)cfg_deployment_root,
+                     strlen (cfg_deployment_root) + 1);
+
+  g_autofree char *reposdir = g_build_filename (cfg_deployment_root, "etc/yum.repos.d", NULL);
+  if (!glnx_fstatat_allow_noent (AT_FDCWD, reposdir, NULL, 0, error))
+    return NULL;
+  if (errno == ENOENT)
+    return g_strdup (g_checksum_get_string (checksum));
+
+  g_auto (GLnxDirFdIterator) dfd_iter = {
+    FALSE,
+  };
+  if (!glnx_dirfd_iterator_init_at (AT_FDCWD, reposdir, TRUE, &dfd_iter, error))
+    return NULL;
+
+  std::set<std::string> repofiles;
+  while (TRUE)
+    {
+      struct dirent *dent = NULL;
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&dfd_iter, &dent, NULL, error))
+        return NULL;
+      if (!dent)
+        break;
+      if (dent->d_type == DT_REG && g_str_has_suffix (dent->d_name, ".repo"))
+        repofiles.insert (dent->d_name);
+    }
+
+  for (auto &name : repofiles)
+    {
+      g_autofree char *contents
+          = glnx_file_get_contents_utf8_at (dfd_iter.fd, name.c_str (), NULL, NULL, error);
+      if (!contents)
+        return NULL;
+      g_checksum_update (checksum, (const guint8 *)name.c_str (), name.size () + 1);
+      g_checksum_update (checksum, (const guint8 *)contents, strlen (contents) + 1);
+    }
+
+  return g_strdup (g_checksum_get_string (checksum));
+}
+
+/* Checksum the cached repomd.xml of each enabled repo in @dnfctx; this changes
+ * whenever the metadata is refreshed. */
+static char *
+compute_dnf_context_metadata_key (DnfContext *dnfctx)
+{
+  g_autoptr (GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  GPtrArray *repos = dnf_context_get_repos (dnfctx);
+  for (guint i = 0; i < repos->len; i++)
+    {
+      auto repo = static_cast<DnfRepo *> (repos->pdata[i]);
+      if ((dnf_repo_get_enabled (repo) & DNF_REPO_ENABLED_PACKAGES) == 0)
+        continue;
+      const char *id = dnf_repo_get_id (repo);
+      g_checksum_update (checksum, (const guint8 *)id, strlen (id) + 1);
+      g_autofree char *repomd
+          = g_build_filename (dnf_repo_get_location (repo), "repodata/repomd.xml", NULL);
+      g_autofree char *contents = NULL;
+      gsize len = 0;
+      /* A missing repomd just hashes as empty */
+      if (g_file_get_contents (repomd, &contents, &len, NULL))
+        g_checksum_update (checksum, (const guint8 *)contents, len);
+      g_checksum_update (checksum, (const guint8 *)"", 1);
+    }
+  return g_strdup (g_checksum_get_string (checksum));
+}
+
+/* Loading the sack is most of the cost of a package query, so we keep the
+ * last context around and hand it out again for as long as neither the
+ * configuration nor the repo metadata it was loaded from have changed. */
 static DnfContext *
 os_create_dnf_context_simple (RPMOSTreeOS *interface, gboolean with_sack, GCancellable *cancellable,
                               GError **error)
 {
+  RpmostreedOS *self = RPMOSTREED_OS (interface);
   glnx_unref_object OstreeSysroot *ot_sysroot = NULL;
   const gchar *os_name = rpmostree_os_get_name (interface);
 
@@ -932,6 +1142,20 @@ os_create_dnf_context_simple (RPMOSTreeOS *interface, gboolean with_sack, GCance
   else
     deployment_root = rpmostree_get_deployment_root (ot_sysroot, booted_deployment);
 
+  g_autofree char *config_key
+      = compute_dnf_context_config_key (ot_sysroot, cfg_merge_deployment, deployment_root, error);
+  if (!config_key)
+    return NULL;
+  if (self->warm_dnfctx && g_str_equal (config_key, self->warm_dnfctx_config_key))
+    {
+      g_autofree char *metadata_key = compute_dnf_context_metadata_key (self->warm_dnfctx);
+      if (g_str_equal (metadata_key, self->warm_dnfctx_metadata_key))
+        {
+          g_debug ("Reusing warm dnf context");
+          return static_cast<DnfContext *> (g_object_ref (self->warm_dnfctx));
+        }
+    }
+
   OstreeRepo *ot_repo = ostree_sysroot_repo (ot_sysroot);
   g_autoptr (RpmOstreeContext) ctx = rpmostree_context_new_client (ot_repo);
 
@@ -956,6 +1180,15 @@ os_create_dnf_context_simple (RPMOSTreeOS *interface, gboolean with_sack, GCance
     return NULL;
 
   DnfContext *dnfctx = rpmostree_context_get_dnf (ctx);
+  if (with_sack)
+    {
+      g_set_object (&self->warm_dnfctx, dnfctx);
+      g_clear_pointer (&self->warm_search_index, rpmostreed_search_index_free);
+      g_free (self->warm_dnfctx_config_key);
+      self->warm_dnfctx_config_key = util::move_nullify (config_key);
+      g_free (self->warm_dnfctx_metadata_key);
+      self->warm_dnfctx_metadata_key = compute_dnf_context_metadata_key (dnfctx);
+    }
   return static_cast<DnfContext *> (g_object_ref (dnfctx));
 }
 
@@ -1144,159 +1377,123 @@ os_handle_get_packages (RPMOSTreeOS *interface, GDBusMethodInvocation *invocatio
   return TRUE;
 }
 
-/* helper function to sort and search within a set of (const gchar *) */
-struct cstrless
-{
-  bool
-  operator() (const gchar *a, const gchar *b) const
-  {
-    return strcmp (a, b) < 0;
-  }
-};
-
-/* wrapper function to both query for packages and add them to the builder */
-static void
-query_results_to_builder (HyQuery query, GVariantBuilder *builder, const gchar *id,
-                          std::set<const gchar *, cstrless> *result_set)
+/* Write @data into a sealed memfd, for clients that asked for it */
+static gboolean
+package_batch_to_fd_list (GBytes *data, GUnixFDList **out_fd_list, GError **error)
 {
-  g_autoptr (GPtrArray) pkglist = hy_query_run (query);
-  for (guint i = 0; i < pkglist->len && (*result_set).size () < 50; i++)
-    {
-      auto pkg = static_cast<DnfPackage *> (g_ptr_array_index (pkglist, i));
-      if (!(*result_set).count (dnf_package_get_name (pkg)))
-        {
-          os_add_package_info_to_builder (pkg, builder, id);
-          (*result_set).insert (dnf_package_get_name (pkg));
-        }
-    }
+  gsize size;
+  auto buf = static_cast<const guint8 *> (g_bytes_get_data (data, &size));
+  rust::Slice<const uint8_t> dataslice{ buf, size };
+  CXX_TRY_VAR (memfd, rpmostreecxx::sealed_memfd ("rpm-ostree-package-batch", dataslice), error);
+  *out_fd_list = g_unix_fd_list_new_from_array (&memfd, 1);
+  return TRUE;
 }
 
-/* helper function to apply Name/Summary or HY_EQ/HY_SUBSTR filters on search term */
-static void
-apply_search_filter (HyQuery *query, int keyname, const gchar *const name, int cmp_type)
-{
-  if (!hy_is_glob_pattern (name))
-    {
-      hy_query_filter (*query, keyname, cmp_type | HY_ICASE, name);
-    }
-  else
-    {
-      hy_query_filter (*query, keyname, HY_GLOB | HY_ICASE, name);
-    }
-}
+typedef void (*PackageBatchCompleter) (RPMOSTreeOS *, GDBusMethodInvocation *, GUnixFDList *,
+                                       GVariant *);
 
-/* helper function to filter package query results */
-static void
-search_packages_by_filter (HyQuery query, GVariantBuilder *builder, const gchar *const *names,
-                           std::vector<int> keynames, const gchar *id)
+/* Shared implementation of WhatProvidesBatch and GetPackagesBatch: run one
+ * query per item of @queries against the same sack, and return the results
+ * keyed by query. */
+static gboolean
+os_handle_package_batch (RPMOSTreeOS *interface, GDBusMethodInvocation *invocation,
+                         const gchar *const *queries, GVariant *arg_options, gboolean provides,
+                         PackageBatchCompleter completer)
 {
-  std::set<const gchar *, cstrless> result_set;
-  hy_autoquery HyQuery intermediate_query = hy_query_clone (query);
-  hy_autoquery HyQuery final_query = hy_query_clone (query);
+  GError *local_error = NULL;
+  g_autoptr (GCancellable) cancellable = NULL;
 
-  // Must have at least one term
-  const char *first_term = names[0];
-  g_assert (first_term);
+  sd_journal_print (LOG_INFO, "Handling %s of %u queries for caller %s",
+                    g_dbus_method_invocation_get_method_name (invocation),
+                    g_strv_length ((char **)queries),
+                    g_dbus_method_invocation_get_sender (invocation));
 
-  int names_count = 0;
-  for (guint i = 0; names[i] != NULL; i++)
-    {
-      names_count++;
-    }
-  g_assert_cmpint (names_count, >, 0);
+  g_autoptr (DnfContext) dnfctx
+      = os_create_dnf_context_simple (interface, TRUE, cancellable, &local_error);
+  if (dnfctx == NULL)
+    return os_throw_dbus_invocation_error (invocation, &local_error);
+
+  g_autoptr (GVariantDict) options_dict = g_variant_dict_new (arg_options);
+  const gboolean packed = vardict_lookup_bool (options_dict, "packed", FALSE);
+  g_autoptr (RpmOstreePackagePackBuilder) pack_builder
+      = packed ? rpmostree_package_pack_builder_new () : NULL;
 
-  /* Name/Summary matches */
-  if (keynames.size () < 2)
+  hy_autoquery HyQuery query = hy_query_create (dnf_context_get_sack (dnfctx));
+  std::set<std::string> seen;
+  GVariantBuilder builder;
+  g_variant_builder_init (&builder, (const GVariantType *)"a{saa{sv}}");
+  for (guint i = 0; queries[i] != NULL; i++)
     {
+      /* Dictionary keys must be unique */
+      if (!seen.insert (queries[i]).second)
+        continue;
+
       hy_query_clear (query);
-      for (guint i = 0; names[i] != NULL; i++)
+      if (provides)
         {
-          apply_search_filter (&query, keynames[0], names[i], HY_EQ);
+          const char *query_provides[] = { queries[i], NULL };
+          hy_query_filter_provides_in (query, (gchar **)query_provides);
         }
-      query_results_to_builder (query, builder, id, &result_set);
+      else
+        hy_query_filter (query, HY_PKG_NAME, HY_EQ, queries[i]);
+      hy_query_filter_latest_per_arch (query, TRUE);
 
-      hy_query_clear (query);
-      for (guint i = 0; names[i] != NULL; i++)
+      g_autoptr (GPtrArray) pkglist = hy_query_run (query);
+      if (pack_builder)
         {
-          apply_search_filter (&query, keynames[0], names[i], HY_SUBSTR);
+          rpmostree_package_pack_builder_add_query (pack_builder, queries[i]);
+          for (guint j = 0; j < pkglist->len; j++)
+            rpmostree_package_pack_builder_add_package (
+                pack_builder, static_cast<DnfPackage *> (g_ptr_array_index (pkglist, j)));
+          continue;
         }
-      query_results_to_builder (query, builder, id, &result_set);
-    }
-
-  /* Name AND Summary matches for more than one search term */
-  /* =========================================================================================
-  For each search term, apply a query with the keyname filter (Name or Summary) and unions the
-  results. This allows multi-term searches to return matches when search terms are found in
-  either the Name or Summary of a package. After this, return the intersection of the results
-  for each search term to filter out results that do not contain all matching terms.
-  ========================================================================================= */
-  else if (keynames.size () >= 2 && names_count >= 2)
-    {
-
-      for (guint i = 0; names[i] != NULL; i++)
+      GVariantBuilder pkgs_builder;
+      g_variant_builder_init (&pkgs_builder, (const GVariantType *)"aa{sv}");
+      for (guint j = 0; j < pkglist->len; j++)
         {
-          hy_query_clear (intermediate_query);
-          for (guint j = 0; j < keynames.size (); j++)
-            {
-              hy_query_clear (query);
-              apply_search_filter (&query, keynames[j], names[i], HY_EQ);
-
-              if (j != 0)
-                {
-                  hy_query_union (intermediate_query, query);
-                }
-              else
-                {
-                  hy_query_clear (intermediate_query);
-                  intermediate_query = hy_query_clone (query);
-                }
-
-              hy_query_clear (query);
-              apply_search_filter (&query, keynames[j], names[i], HY_SUBSTR);
-              hy_query_union (intermediate_query, query);
-            }
-
-          if (i != 0)
-            {
-              hy_query_intersection (final_query, intermediate_query);
-            }
-          else
-            {
-              hy_query_clear (final_query);
-              final_query = hy_query_clone (intermediate_query);
-            }
+          auto pkg = static_cast<DnfPackage *> (g_ptr_array_index (pkglist, j));
+          os_add_package_info_to_builder (pkg, &pkgs_builder, NULL);
         }
-      query_results_to_builder (final_query, builder, id, &result_set);
+      g_variant_builder_add (&builder, "{s@aa{sv}}", queries[i],
+                             g_variant_builder_end (&pkgs_builder));
     }
+  g_autoptr (GVariant) results = g_variant_ref_sink (g_variant_builder_end (&builder));
 
-  /* Name AND Summary matches for only one search term */
-  /* =========================================================================================
-  For the case of a single search term, return the intersection of both Name and Summary matches
-  of the search term (instead of the union for multi-term searches).
-  ========================================================================================= */
-  else if (keynames.size () >= 2 && names_count < 2)
+  if (!packed && !vardict_lookup_bool (options_dict, "return-fd", FALSE))
     {
-      for (guint i = 0; i < keynames.size (); i++)
-        {
-          hy_query_clear (query);
-          apply_search_filter (&query, keynames[i], first_term, HY_EQ);
-          intermediate_query = hy_query_clone (query);
+      completer (interface, invocation, NULL, results);
+      return TRUE;
+    }
+
+  g_autoptr (GBytes) data = NULL;
+  if (pack_builder)
+    data = rpmostree_package_pack_builder_end (pack_builder);
+  else
+    data = g_variant_get_data_as_bytes (results);
+  g_autoptr (GUnixFDList) fd_list = NULL;
+  if (!package_batch_to_fd_list (data, &fd_list, &local_error))
+    return os_throw_dbus_invocation_error (invocation, &local_error);
+  completer (interface, invocation, fd_list, g_variant_new_array (G_VARIANT_TYPE ("{saa{sv}}"),
+                                                                  NULL, 0));
+  return TRUE;
+}
 
-          hy_query_clear (query);
-          apply_search_filter (&query, keynames[i], first_term, HY_SUBSTR);
-          hy_query_union (intermediate_query, query);
+static gboolean
+os_handle_what_provides_batch (RPMOSTreeOS *interface, GDBusMethodInvocation *invocation,
+                               GUnixFDList *fd_list, const gchar *const *provides,
+                               GVariant *arg_options)
+{
+  return os_handle_package_batch (interface, invocation, provides, arg_options, TRUE,
+                                  rpmostree_os_complete_what_provides_batch);
+}
 
-          if (i != 0)
-            {
-              hy_query_intersection (final_query, intermediate_query);
-            }
-          else
-            {
-              final_query = hy_query_clone (intermediate_query);
-            }
-        }
-      query_results_to_builder (final_query, builder, id, &result_set);
-    }
+static gboolean
+os_handle_get_packages_batch (RPMOSTreeOS *interface, GDBusMethodInvocation *invocation,
+                              GUnixFDList *fd_list, const gchar *const *names,
+                              GVariant *arg_options)
+{
+  return os_handle_package_batch (interface, invocation, names, arg_options, FALSE,
+                                  rpmostree_os_complete_get_packages_batch);
 }
 
 static gboolean
@@ -1316,24 +1513,39 @@ os_handle_search (RPMOSTreeOS *interface, GDBusMethodInvocation *invocation,
       return TRUE;
     }
 
+  RpmostreedOS *self = RPMOSTREED_OS (interface);
   g_autoptr (DnfContext) dnfctx
       = os_create_dnf_context_simple (interface, TRUE, cancellable, &local_error);
   if (dnfctx == NULL)
     return os_throw_dbus_invocation_error (invocation, &local_error);
 
-  hy_autoquery HyQuery query = hy_query_create (dnf_context_get_sack (dnfctx));
+  /* The index lives as long as the warm context it was built from */
+  g_assert (dnfctx == self->warm_dnfctx);
+  if (!self->warm_search_index)
+    self->warm_search_index = rpmostreed_search_index_new (dnf_context_get_sack (dnfctx));
 
   GVariantBuilder builder;
   g_variant_builder_init (&builder, (const GVariantType *)"aa{sv}");
 
-  std::vector<int> keynames_a = { HY_PKG_NAME, HY_PKG_SUMMARY };
-  search_packages_by_filter (query, &builder, names, keynames_a, "match_group_a");
-
-  std::vector<int> keynames_b = { HY_PKG_NAME };
-  search_packages_by_filter (query, &builder, names, keynames_b, "match_group_b");
-
-  std::vector<int> keynames_c = { HY_PKG_SUMMARY };
-  search_packages_by_filter (query, &builder, names, keynames_c, "match_group_c");
+  const struct
+  {
+    RpmostreedSearchFields fields;
+    const char *id;
+  } match_groups[] = {
+    { static_cast<RpmostreedSearchFields> (RPMOSTREED_SEARCH_FIELD_NAME
+                                           | RPMOSTREED_SEARCH_FIELD_SUMMARY),
+      "match_group_a" },
+    { RPMOSTREED_SEARCH_FIELD_NAME, "match_group_b" },
+    { RPMOSTREED_SEARCH_FIELD_SUMMARY, "match_group_c" },
+  };
+  for (guint i = 0; i < G_N_ELEMENTS (match_groups); i++)
+    {
+      g_autoptr (GPtrArray) pkgs = rpmostreed_search_index_search (
+          self->warm_search_index, names, match_groups[i].fields, 50);
+      for (guint j = 0; j < pkgs->len; j++)
+        os_add_package_info_to_builder (static_cast<DnfPackage *> (pkgs->pdata[j]), &builder,
+                                        match_groups[i].id);
+    }
 
   GVariant *pkgs_result = g_variant_builder_end (&builder);
   g_dbus_method_invocation_return_value (invocation, g_variant_new ("(@aa{sv})", pkgs_result));
@@ -1656,7 +1868,6 @@ os_handle_get_cached_rebase_rpm_diff (RPMOSTreeOS *interface, GDBusMethodInvocat
                                       const char *arg_refspec, const char *const *arg_packages)
 {
   RpmostreedSysroot *global_sysroot;
-  g_autoptr (GCancellable) cancellable = NULL;
   OstreeSysroot *ot_sysroot = NULL;
   OstreeRepo *ot_repo = NULL;
   const gchar *name;
@@ -1664,8 +1875,6 @@ os_handle_get_cached_rebase_rpm_diff (RPMOSTreeOS *interface, GDBusMethodInvocat
   g_autoptr (RpmOstreeOrigin) origin = NULL;
   g_autofree gchar *comp_ref = NULL;
   GError *local_error = NULL;
-  g_autoptr (GVariant) value = NULL;
-  g_autoptr (GVariant) details = NULL;
 
   /* TODO: Totally ignoring packages for now */
 
@@ -1691,18 +1900,11 @@ os_handle_get_cached_rebase_rpm_diff (RPMOSTreeOS *interface, GDBusMethodInvocat
   if (!rpmostreed_refspec_parse_partial (arg_refspec, r.refspec.c_str (), &comp_ref, &local_error))
     return os_throw_dbus_invocation_error (invocation, &local_error);
 
-  if (!rpm_ostree_db_diff_variant (ot_repo, ostree_deployment_get_csum (base_deployment), comp_ref,
-                                   FALSE, &value, cancellable, &local_error))
-    return os_throw_dbus_invocation_error (invocation, &local_error);
-
-  details = rpmostreed_commit_generate_cached_details_variant (base_deployment, ot_repo, comp_ref,
-                                                               NULL, &local_error);
-  if (!details)
-    return os_throw_dbus_invocation_error (invocation, &local_error);
-
-  g_dbus_method_invocation_return_value (invocation, new_variant_diff_result (value, details));
-
-  return TRUE;
+  DiffQuery *query
+      = diff_query_new (ot_repo, ostree_deployment_get_csum (base_deployment), comp_ref);
+  query->base_deployment = util::move_nullify (base_deployment);
+  query->refspec = util::move_nullify (comp_ref);
+  return os_run_diff_query (interface, invocation, query);
 }
 
 static gboolean
@@ -1747,12 +1949,10 @@ os_handle_download_rebase_rpm_diff (RPMOSTreeOS *interface, GDBusMethodInvocatio
 }
 
 static gboolean
-get_cached_deploy_rpm_diff (RPMOSTreeOS *interface, const char *arg_revision, GVariant **out_value,
-                            GVariant **out_details, GError **error)
+get_cached_deploy_rpm_diff (RPMOSTreeOS *interface, const char *arg_revision, DiffQuery **out_query,
+                            GError **error)
 {
   g_autoptr (GCancellable) cancellable = NULL;
-  g_autoptr (GVariant) value = NULL;
-  g_autoptr (GVariant) details = NULL;
 
   if (arg_revision == NULL)
     return glnx_throw (error, "Missing revision");
@@ -1794,17 +1994,11 @@ get_cached_deploy_rpm_diff (RPMOSTreeOS *interface, const char *arg_revision, GV
       return glnx_throw (error, "Invalid revision kind");
     }
 
-  if (!rpm_ostree_db_diff_variant (ot_repo, base_checksum, checksum, FALSE, &value, cancellable,
-                                   error))
-    return glnx_prefix_error (error, "Assembling diff");
-
-  details = rpmostreed_commit_generate_cached_details_variant (base_deployment, ot_repo,
-                                                               r.refspec.c_str (), checksum, error);
-  if (details == NULL)
-    return glnx_prefix_error (error, "Generating cached details");
-
-  *out_value = util::move_nullify (value);
-  *out_details = util::move_nullify (details);
+  DiffQuery *query = diff_query_new (ot_repo, base_checksum, checksum);
+  query->base_deployment = util::move_nullify (base_deployment);
+  query->refspec = g_strdup (r.refspec.c_str ());
+  query->checksum = util::move_nullify (checksum);
+  *out_query = query;
   return TRUE;
 }
 
@@ -1813,20 +2007,13 @@ os_handle_get_cached_deploy_rpm_diff (RPMOSTreeOS *interface, GDBusMethodInvocat
                                       const char *arg_revision, const char *const *arg_packages)
 {
   GError *local_error = NULL;
-  g_autoptr (GVariant) value = NULL;
-  g_autoptr (GVariant) details = NULL;
+  DiffQuery *query = NULL;
 
   /* XXX Ignoring arg_packages for now. */
-  gboolean is_ok
-      = get_cached_deploy_rpm_diff (interface, arg_revision, &value, &details, &local_error);
-  if (!is_ok)
+  if (!get_cached_deploy_rpm_diff (interface, arg_revision, &query, &local_error))
     return os_throw_dbus_invocation_error (invocation, &local_error);
 
-  g_assert (value != NULL);
-  g_assert (details != NULL);
-  g_dbus_method_invocation_return_value (invocation, new_variant_diff_result (value, details));
-
-  return TRUE;
+  return os_run_diff_query (interface, invocation, query);
 }
 
 static gboolean
@@ -1883,42 +2070,46 @@ refresh_cached_update_impl (RpmostreedOS *self, GVariant **out_cached_update, GE
   if (!booted || !g_str_equal (osname, ostree_deployment_get_osname (booted)))
     return TRUE; /* Note early return */
 
-  glnx_autofd int fd = -1;
-  g_autoptr (GError) local_error = NULL;
-  if (!glnx_openat_rdonly (AT_FDCWD, RPMOSTREE_AUTOUPDATES_CACHE_FILE, TRUE, &fd, &local_error))
+  /* The file is always atomically replaced, so if it's still the same inode
+   * with the same mtime, what we read last time still holds. The booted
+   * commit it's checked against can't change under us either. */
+  struct stat stbuf;
+  if (!glnx_fstatat_allow_noent (AT_FDCWD, RPMOSTREE_AUTOUPDATES_CACHE_FILE, &stbuf, 0, error))
+    return FALSE;
+  if (errno == ENOENT)
     {
-      if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
-        return g_propagate_error (error, util::move_nullify (local_error)), FALSE;
+      g_clear_pointer (&self->cached_update, g_variant_unref);
+      self->have_cached_update_stbuf = FALSE;
+      return TRUE; /* Note early return */
+    }
+  const struct stat *prev = &self->cached_update_stbuf;
+  if (self->have_cached_update_stbuf && prev->st_dev == stbuf.st_dev
+      && prev->st_ino == stbuf.st_ino && prev->st_size == stbuf.st_size
+      && prev->st_mtim.tv_sec == stbuf.st_mtim.tv_sec
+      && prev->st_mtim.tv_nsec == stbuf.st_mtim.tv_nsec)
+    {
+      if (self->cached_update)
+        *out_cached_update = g_variant_ref (self->cached_update);
       return TRUE; /* Note early return */
     }
 
-  /* sanity check there isn't something fishy going on before even reading it in */
-  struct stat stbuf;
-  if (!glnx_fstat (fd, &stbuf, error))
-    return FALSE;
-
-  if (!rpmostree_check_size_within_limit (stbuf.st_size, OSTREE_MAX_METADATA_SIZE,
-                                          RPMOSTREE_AUTOUPDATES_CACHE_FILE, error))
-    return FALSE;
-
-  g_autoptr (GBytes) data = glnx_fd_readall_bytes (fd, NULL, error);
-  if (!data)
+  gboolean outdated = FALSE;
+  if (!rpmostreed_read_cached_update (booted, &cached_update, &outdated, error))
     return FALSE;
-
-  cached_update
-      = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE_VARDICT, data, FALSE));
-
-  /* check if cache is still valid -- see rpmostreed_update_generate_variant() */
-  g_auto (GVariantDict) dict;
-  g_variant_dict_init (&dict, cached_update);
-  auto state = static_cast<const char *> (vardict_lookup_ptr (&dict, "update-sha256", "&s"));
-  if (g_strcmp0 (state, ostree_deployment_get_csum (booted)) != 0)
+  g_clear_pointer (&self->cached_update, g_variant_unref);
+  self->have_cached_update_stbuf = FALSE;
+  if (outdated)
     {
       sd_journal_print (LOG_INFO, "Deleting outdated cached update for OS '%s'", osname);
-      g_clear_pointer (&cached_update, (GDestroyNotify)g_variant_unref);
       if (!glnx_unlinkat (AT_FDCWD, RPMOSTREE_AUTOUPDATES_CACHE_FILE, 0, error))
         return FALSE;
     }
+  else if (cached_update)
+    {
+      self->cached_update = g_variant_ref (cached_update);
+      self->cached_update_stbuf = stbuf;
+      self->have_cached_update_stbuf = TRUE;
+    }
 
   *out_cached_update = util::move_nullify (cached_update);
   return TRUE;
@@ -1936,6 +2127,27 @@ refresh_cached_update (RpmostreedOS *self, GError **error)
   return TRUE;
 }
 
+/* Reuses the variant the sysroot generated for its Deployments property if
+ * there is one, since those are all generated at once on reload. */
+static gboolean
+get_deployment_variant (OstreeSysroot *sysroot, OstreeDeployment *deployment,
+                        const char *booted_id, OstreeRepo *repo, GVariant **out_variant,
+                        GError **error)
+{
+  GVariant *variant
+      = rpmostreed_sysroot_lookup_deployment_variant (rpmostreed_sysroot_get (), deployment);
+  if (variant)
+    {
+      *out_variant = g_variant_ref (variant);
+      return TRUE;
+    }
+  if (!rpmostreed_deployment_generate_variant (sysroot, deployment, booted_id, repo, TRUE, NULL,
+                                               out_variant, error))
+    return FALSE;
+  g_variant_ref_sink (*out_variant);
+  return TRUE;
+}
+
 static gboolean
 rpmostreed_os_load_internals (RpmostreedOS *self, GError **error)
 {
@@ -1951,10 +2163,9 @@ rpmostreed_os_load_internals (RpmostreedOS *self, GError **error)
   g_autoptr (GVariant) booted_variant = NULL; /* Strong ref as we reuse it below */
   if (booted_deployment && g_strcmp0 (ostree_deployment_get_osname (booted_deployment), name) == 0)
     {
-      if (!rpmostreed_deployment_generate_variant (ot_sysroot, booted_deployment, booted_id,
-                                                   ot_repo, TRUE, &booted_variant, error))
+      if (!get_deployment_variant (ot_sysroot, booted_deployment, booted_id, ot_repo,
+                                   &booted_variant, error))
         return FALSE;
-      g_variant_ref_sink (booted_variant);
       auto bootedid_v = rpmostreecxx::deployment_generate_id (*booted_deployment);
       booted_id = g_strdup (bootedid_v.c_str ());
     }
@@ -1971,24 +2182,23 @@ rpmostreed_os_load_internals (RpmostreedOS *self, GError **error)
   g_autoptr (GVariant) default_variant = NULL;
   if (pending_deployment)
     {
-      if (!rpmostreed_deployment_generate_variant (ot_sysroot, pending_deployment, booted_id,
-                                                   ot_repo, TRUE, &default_variant, error))
+      if (!get_deployment_variant (ot_sysroot, pending_deployment, booted_id, ot_repo,
+                                   &default_variant, error))
         return FALSE;
-      g_variant_ref_sink (default_variant);
     }
   else
     default_variant = g_variant_ref (booted_variant); /* Default to booted */
   rpmostree_os_set_default_deployment (RPMOSTREE_OS (self), default_variant);
 
-  GVariant *rollback_variant = NULL; /* Floating */
+  g_autoptr (GVariant) rollback_variant = NULL;
   if (rollback_deployment)
     {
-      if (!rpmostreed_deployment_generate_variant (ot_sysroot, rollback_deployment, booted_id,
-                                                   ot_repo, TRUE, &rollback_variant, error))
+      if (!get_deployment_variant (ot_sysroot, rollback_deployment, booted_id, ot_repo,
+                                   &rollback_variant, error))
         return FALSE;
     }
   else
-    rollback_variant = rpmostreed_deployment_generate_blank_variant ();
+    rollback_variant = g_variant_ref_sink (rpmostreed_deployment_generate_blank_variant ());
   rpmostree_os_set_rollback_deployment (RPMOSTREE_OS (self), rollback_variant);
 
   if (!refresh_cached_update (self, error))
@@ -2016,6 +2226,8 @@ rpmostreed_os_iface_init (RPMOSTreeOSIface *iface)
   iface->handle_finalize_deployment = os_handle_finalize_deployment;
   iface->handle_what_provides = os_handle_what_provides;
   iface->handle_get_packages = os_handle_get_packages;
+  iface->handle_what_provides_batch = os_handle_what_provides_batch;
+  iface->handle_get_packages_batch = os_handle_get_packages_batch;
   iface->handle_search = os_handle_search;
   /* legacy cleanup API; superseded by Cleanup() */
   iface->handle_clear_rollback_target = os_handle_clear_rollback_target;
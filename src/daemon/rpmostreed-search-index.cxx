@@ -0,0 +1,275 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2 of the licence or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <fnmatch.h>
+#include <string.h>
+
+#include <algorithm>
+#include <iterator>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "rpmostree-util.h"
+#include "rpmostreed-search-index.h"
+
+/* Package indices, in sack order */
+typedef std::vector<guint32> PostingList;
+
+/* Trigrams are packed into the low 24 bits */
+#define TRIGRAM(s)                                                                                 \
+  (((guint32)(guchar)(s)[0] << 16) | ((guint32)(guchar)(s)[1] << 8) | (guchar)(s)[2])
+
+struct FieldIndex
+{
+  std::vector<std::string> folded; /* ASCII-lowercased value, per package */
+  std::unordered_map<std::string, PostingList> exact;
+  std::unordered_map<guint32, PostingList> trigrams;
+};
+
+struct _RpmostreedSearchIndex
+{
+  GPtrArray *pkgs; /* DnfPackage */
+  FieldIndex name;
+  FieldIndex summary;
+};
+
+typedef enum
+{
+  MATCH_EXACT,
+  MATCH_SUBSTR,
+} MatchType;
+
+/* Same as libdnf's hy_is_glob_pattern() */
+static gboolean
+is_glob_pattern (const char *pattern)
+{
+  return strpbrk (pattern, "*[?") != NULL;
+}
+
+static const char *
+package_field (DnfPackage *pkg, RpmostreedSearchFields field)
+{
+  const char *value = field == RPMOSTREED_SEARCH_FIELD_NAME ? dnf_package_get_name (pkg)
+                                                           : dnf_package_get_summary (pkg);
+  return value ?: "";
+}
+
+static void
+field_index_add (FieldIndex &field, guint32 i, const char *value)
+{
+  g_autofree char *folded = g_ascii_strdown (value, -1);
+  field.exact[folded].push_back (i);
+  const size_t len = strlen (folded);
+  for (size_t j = 0; j + 3 <= len; j++)
+    {
+      PostingList &list = field.trigrams[TRIGRAM (folded + j)];
+      /* A trigram can occur more than once in the same value */
+      if (list.empty () || list.back () != i)
+        list.push_back (i);
+    }
+  field.folded.emplace_back (folded);
+}
+
+/* Build the index for all packages in @sack. This is a single pass over the
+ * sack, which is much cheaper than the repeated scans it saves. */
+RpmostreedSearchIndex *
+rpmostreed_search_index_new (DnfSack *sack)
+{
+  auto index = new RpmostreedSearchIndex ();
+  hy_autoquery HyQuery query = hy_query_create (sack);
+  index->pkgs = hy_query_run (query);
+  index->name.folded.reserve (index->pkgs->len);
+  index->summary.folded.reserve (index->pkgs->len);
+  for (guint32 i = 0; i < index->pkgs->len; i++)
+    {
+      auto pkg = static_cast<DnfPackage *> (index->pkgs->pdata[i]);
+      field_index_add (index->name, i, package_field (pkg, RPMOSTREED_SEARCH_FIELD_NAME));
+      field_index_add (index->summary, i, package_field (pkg, RPMOSTREED_SEARCH_FIELD_SUMMARY));
+    }
+  g_debug ("Built search index of %u packages (%zu name, %zu summary trigrams)", index->pkgs->len,
+           index->name.trigrams.size (), index->summary.trigrams.size ());
+  return index;
+}
+
+void
+rpmostreed_search_index_free (RpmostreedSearchIndex *index)
+{
+  g_ptr_array_unref (index->pkgs);
+  delete index;
+}
+
+static PostingList
+intersect (const PostingList &a, const PostingList &b)
+{
+  PostingList result;
+  std::set_intersection (a.begin (), a.end (), b.begin (), b.end (), std::back_inserter (result));
+  return result;
+}
+
+static PostingList
+unite (const PostingList &a, const PostingList &b)
+{
+  PostingList result;
+  std::set_union (a.begin (), a.end (), b.begin (), b.end (), std::back_inserter (result));
+  return result;
+}
+
+/* The packages whose @field matches @term, ignoring case; this mirrors the
+ * HY_EQ/HY_SUBSTR/HY_GLOB filters with HY_ICASE. */
+static PostingList
+match_term (RpmostreedSearchIndex *index, RpmostreedSearchFields field, const char *term,
+            MatchType type)
+{
+  const FieldIndex &fidx = field == RPMOSTREED_SEARCH_FIELD_NAME ? index->name : index->summary;
+  PostingList result;
+
+  /* Globs can't use the index; fall back to scanning */
+  if (is_glob_pattern (term))
+    {
+      for (guint32 i = 0; i < index->pkgs->len; i++)
+        {
+          auto pkg = static_cast<DnfPackage *> (index->pkgs->pdata[i]);
+          if (fnmatch (term, package_field (pkg, field), FNM_CASEFOLD) == 0)
+            result.push_back (i);
+        }
+      return result;
+    }
+
+  g_autofree char *folded = g_ascii_strdown (term, -1);
+  if (type == MATCH_EXACT)
+    {
+      auto it = fidx.exact.find (folded);
+      if (it != fidx.exact.end ())
+        result = it->second;
+      return result;
+    }
+
+  const size_t len = strlen (folded);
+  if (len < 3)
+    {
+      /* Too short to have a trigram */
+      for (guint32 i = 0; i < fidx.folded.size (); i++)
+        {
+          if (strstr (fidx.folded[i].c_str (), folded))
+            result.push_back (i);
+        }
+      return result;
+    }
+
+  /* Every trigram of the term must be in the value; start from the rarest
+   * one to keep the intermediate lists small. */
+  std::vector<const PostingList *> lists;
+  for (size_t j = 0; j + 3 <= len; j++)
+    {
+      auto it = fidx.trigrams.find (TRIGRAM (folded + j));
+      if (it == fidx.trigrams.end ())
+        return result;
+      lists.push_back (&it->second);
+    }
+  std::sort (lists.begin (), lists.end (),
+             [] (const PostingList *a, const PostingList *b) { return a->size () < b->size (); });
+  PostingList candidates = *lists[0];
+  for (size_t j = 1; j < lists.size () && !candidates.empty (); j++)
+    candidates = intersect (candidates, *lists[j]);
+
+  /* Having all the trigrams doesn't mean they're contiguous */
+  for (guint32 i : candidates)
+    {
+      if (strstr (fidx.folded[i].c_str (), folded))
+        result.push_back (i);
+    }
+  return result;
+}
+
+/* Packages matching all @terms in @field */
+static PostingList
+match_all_terms (RpmostreedSearchIndex *index, RpmostreedSearchFields field,
+                 const char *const *terms, MatchType type)
+{
+  PostingList result = match_term (index, field, terms[0], type);
+  for (guint i = 1; terms[i] != NULL && !result.empty (); i++)
+    result = intersect (result, match_term (index, field, terms[i], type));
+  return result;
+}
+
+/* Add the packages in @matches to @out_pkgs, skipping names we already have,
+ * until we have @limit distinct names. */
+static void
+append_matches (RpmostreedSearchIndex *index, const PostingList &matches, guint limit,
+                std::set<std::string> &seen_names, GPtrArray *out_pkgs)
+{
+  for (guint32 i : matches)
+    {
+      if (seen_names.size () >= limit)
+        break;
+      auto pkg = static_cast<DnfPackage *> (index->pkgs->pdata[i]);
+      if (seen_names.insert (dnf_package_get_name (pkg)).second)
+        g_ptr_array_add (out_pkgs, g_object_ref (pkg));
+    }
+}
+
+/* Find packages matching @terms, returning at most one package per name and
+ * at most @limit names.
+ *
+ * With a single field, all the terms must match it; exact matches are
+ * returned before substring matches. With both fields, each term must match
+ * either the name or the summary, except that a single term must match both.
+ */
+GPtrArray *
+rpmostreed_search_index_search (RpmostreedSearchIndex *index, const char *const *terms,
+                                RpmostreedSearchFields fields, guint limit)
+{
+  g_assert (terms && terms[0]);
+  g_autoptr (GPtrArray) pkgs = g_ptr_array_new_with_free_func (g_object_unref);
+  std::set<std::string> seen_names;
+
+  if (fields == RPMOSTREED_SEARCH_FIELD_NAME || fields == RPMOSTREED_SEARCH_FIELD_SUMMARY)
+    {
+      append_matches (index, match_all_terms (index, fields, terms, MATCH_EXACT), limit,
+                      seen_names, pkgs);
+      append_matches (index, match_all_terms (index, fields, terms, MATCH_SUBSTR), limit,
+                      seen_names, pkgs);
+    }
+  else if (terms[1] == NULL)
+    {
+      PostingList matches
+          = intersect (match_term (index, RPMOSTREED_SEARCH_FIELD_NAME, terms[0], MATCH_SUBSTR),
+                       match_term (index, RPMOSTREED_SEARCH_FIELD_SUMMARY, terms[0], MATCH_SUBSTR));
+      append_matches (index, matches, limit, seen_names, pkgs);
+    }
+  else
+    {
+      PostingList matches;
+      for (guint i = 0; terms[i] != NULL; i++)
+        {
+          PostingList term_matches
+              = unite (match_term (index, RPMOSTREED_SEARCH_FIELD_NAME, terms[i], MATCH_SUBSTR),
+                       match_term (index, RPMOSTREED_SEARCH_FIELD_SUMMARY, terms[i], MATCH_SUBSTR));
+          matches = i == 0 ? std::move (term_matches) : intersect (matches, term_matches);
+          if (matches.empty ())
+            break;
+        }
+      append_matches (index, matches, limit, seen_names, pkgs);
+    }
+
+  return util::move_nullify (pkgs);
+}
@@ -0,0 +1,49 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2 of the licence or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+#include <libdnf/libdnf.h>
+
+G_BEGIN_DECLS
+
+typedef enum
+{
+  RPMOSTREED_SEARCH_FIELD_NAME = (1 << 0),
+  RPMOSTREED_SEARCH_FIELD_SUMMARY = (1 << 1),
+} RpmostreedSearchFields;
+
+/* An index over the names and summaries of every package in a sack, so that
+ * searches don't need to scan the whole sack for each term. It holds
+ * references to the packages, and so is only valid as long as the sack's
+ * metadata is; see os_create_dnf_context_simple().
+ */
+typedef struct _RpmostreedSearchIndex RpmostreedSearchIndex;
+
+RpmostreedSearchIndex *rpmostreed_search_index_new (DnfSack *sack);
+
+void rpmostreed_search_index_free (RpmostreedSearchIndex *index);
+
+GPtrArray *rpmostreed_search_index_search (RpmostreedSearchIndex *index,
+                                           const char *const *terms,
+                                           RpmostreedSearchFields fields, guint limit);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (RpmostreedSearchIndex, rpmostreed_search_index_free);
+
+G_END_DECLS
@@ -19,7 +19,11 @@
 #include "config.h"
 #include "ostree.h"
 
+#include "rpmostree-core.h"
 #include "rpmostree-cxxrs.h"
+#include "rpmostree-metrics.h"
+#include "rpmostree-rpm-util.h"
+#include "rpmostree-trace.h"
 #include "rpmostree-util.h"
 #include "rpmostreed-daemon.h"
 #include "rpmostreed-deployment-utils.h"
@@ -36,6 +40,7 @@
 #include <err.h>
 #include <gio/gunixinputstream.h>
 #include <gio/gunixoutputstream.h>
+#include <string.h>
 #include <systemd/sd-journal.h>
 #include <systemd/sd-login.h>
 
@@ -69,9 +74,17 @@ struct _RpmostreedSysroot
   OstreeSysroot *ot_sysroot;
   OstreeRepo *repo;
   struct stat repo_last_stat;
+  char *repo_last_state; /* See compute_repo_state() */
+  GVariant *status_snapshot; /* Built on demand; see handle_get_status_snapshot() */
   RpmostreedTransaction *transaction;
   guint close_transaction_timeout_id;
+  GQueue txn_queue; /* QueuedTxn, highest priority first */
+  guint txn_queue_idle_id;
   PolkitAuthority *authority;
+  /* Recent successful polkit checks of read-only methods; see
+   * rpmostreed_sysroot_check_authorization(). Maps sender to a table of
+   * action to expiry time. */
+  GHashTable *polkit_cache;
   gboolean on_session_bus;
 
   GHashTable *os_interfaces;
@@ -79,8 +92,62 @@ struct _RpmostreedSysroot
 
   GFileMonitor *monitor;
   guint sig_changed;
+
+  /* Commit-derived parts of the deployment variants, keyed by checksum; see
+   * rpmostreed_deployment_generate_variant(). Only holds current deployments. */
+  GHashTable *deployment_commit_cache;
+  /* The variants of the current deployments, as published in the Deployments
+   * property; see rpmostreed_sysroot_lookup_deployment_variant() */
+  GHashTable *deployment_variants;
+
+  /* Recently used sacks, keyed by commit; see rpmostreed_sysroot_get_refsack_for_commit() */
+  GMutex refsack_cache_lock;
+  GQueue refsack_cache; /* RefSackCacheEntry, most recently used first */
+  guint refsack_cache_n_packages;
 };
 
+/* Requests waiting for the active transaction to finish. Clients wait for the
+ * reply with a timeout of their own (5 minutes for the CLI), so we don't start
+ * anything that's been waiting close to that long; nobody would be watching. */
+#define TXN_QUEUE_MAX_ENTRIES 8
+#define TXN_QUEUE_MAX_WAIT_SECS 240
+
+typedef struct
+{
+  GDBusInterfaceSkeleton *skeleton;
+  GDBusMethodInvocation *invocation;
+  RpmostreedTxnPriority priority;
+  gint64 queued_time;
+} QueuedTxn;
+
+static void
+queued_txn_free (QueuedTxn *queued)
+{
+  g_clear_object (&queued->skeleton);
+  g_clear_object (&queued->invocation);
+  g_free (queued);
+}
+
+/* Bounds for the sack cache. A sack's memory use is roughly proportional to
+ * its number of packages, so we cap that as well as the number of sacks. */
+#define REFSACK_CACHE_MAX_ENTRIES 4
+#define REFSACK_CACHE_MAX_PACKAGES 20000
+
+typedef struct
+{
+  char *key;
+  RpmOstreeRefSack *rsack;
+  guint n_packages;
+} RefSackCacheEntry;
+
+static void
+refsack_cache_entry_free (RefSackCacheEntry *entry)
+{
+  g_free (entry->key);
+  rpmostree_refsack_unref (entry->rsack);
+  g_free (entry);
+}
+
 struct _RpmostreedSysrootClass
 {
   RPMOSTreeSysrootSkeletonClass parent_class;
@@ -134,6 +201,366 @@ handle_get_os (RPMOSTreeSysroot *object, GDBusMethodInvocation *invocation, cons
   return TRUE;
 }
 
+static GVariant *
+build_status_snapshot (RpmostreedSysroot *self)
+{
+  RPMOSTreeSysroot *sysroot = RPMOSTREE_SYSROOT (self);
+  g_auto (GVariantDict) dict;
+  g_variant_dict_init (&dict, NULL);
+
+  GVariant *deployments = rpmostree_sysroot_get_deployments (sysroot);
+  if (deployments)
+    g_variant_dict_insert_value (&dict, "deployments", deployments);
+  GVariant *txn = rpmostree_sysroot_get_active_transaction (sysroot);
+  if (txn)
+    g_variant_dict_insert_value (&dict, "transaction", txn);
+  g_variant_dict_insert (&dict, "automatic-update-policy", "s",
+                         rpmostree_sysroot_get_automatic_update_policy (sysroot) ?: "");
+
+  OstreeDeployment *booted = ostree_sysroot_get_booted_deployment (self->ot_sysroot);
+  if (booted)
+    {
+      auto os = static_cast<RPMOSTreeOS *> (
+          g_hash_table_lookup (self->os_interfaces, ostree_deployment_get_osname (booted)));
+      GVariant *cached_update = os ? rpmostree_os_get_cached_update (os) : NULL;
+      if (cached_update && rpmostree_os_get_has_cached_update_rpm_diff (os))
+        g_variant_dict_insert_value (&dict, "cached-update", cached_update);
+    }
+
+  return g_variant_dict_end (&dict);
+}
+
+static void
+invalidate_status_snapshot (RpmostreedSysroot *self)
+{
+  g_clear_pointer (&self->status_snapshot, g_variant_unref);
+}
+
+static void
+on_sysroot_updated (RpmostreedSysroot *self, gpointer user_data)
+{
+  invalidate_status_snapshot (self);
+}
+
+static gboolean
+handle_get_status_snapshot (RPMOSTreeSysroot *object, GDBusMethodInvocation *invocation)
+{
+  RpmostreedSysroot *self = RPMOSTREED_SYSROOT (object);
+
+  g_autoptr (GError) local_error = NULL;
+  if (!rpmostreed_sysroot_reload (self, &local_error))
+    {
+      g_dbus_method_invocation_take_error (invocation, util::move_nullify (local_error));
+      return TRUE;
+    }
+
+  if (!self->status_snapshot)
+    self->status_snapshot = g_variant_ref_sink (build_status_snapshot (self));
+  rpmostree_sysroot_complete_get_status_snapshot (object, invocation, self->status_snapshot);
+  return TRUE;
+}
+
+/* The fields of the deployment variants which are left out of the
+ * DeploymentSummaries property; see GetDeploymentDetails() */
+static const char *const deployment_detail_fields[] = {
+  "packages",
+  "modules",
+  "requested-packages",
+  "requested-local-packages",
+  "requested-local-fileoverride-packages",
+  "requested-modules",
+  "requested-modules-enabled",
+  "base-removals",
+  "requested-base-removals",
+  "base-local-replacements",
+  "base-remote-replacements",
+  "requested-base-local-replacements",
+  "requested-base-remote-replacements",
+  "base-commit-meta",
+  "layered-commit-meta",
+  NULL,
+};
+
+/* Returns @variant, a deployment variant, without the detail fields */
+static GVariant *
+deployment_variant_summarize (GVariant *variant)
+{
+  g_auto (GVariantDict) dict;
+  g_variant_dict_init (&dict, variant);
+  for (const char *const *it = deployment_detail_fields; *it; it++)
+    g_variant_dict_remove (&dict, *it);
+  return g_variant_dict_end (&dict);
+}
+
+static gboolean
+handle_get_deployment_details (RPMOSTreeSysroot *object, GDBusMethodInvocation *invocation,
+                               const char *arg_id, const char *const *arg_fields)
+{
+  RpmostreedSysroot *self = RPMOSTREED_SYSROOT (object);
+
+  for (const char *const *it = arg_fields; it && *it; it++)
+    {
+      if (!g_strv_contains (deployment_detail_fields, *it))
+        {
+          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
+                                                 G_DBUS_ERROR_INVALID_ARGS,
+                                                 "Unknown deployment field: %s", *it);
+          return TRUE;
+        }
+    }
+  if (!arg_fields || !*arg_fields)
+    arg_fields = deployment_detail_fields;
+
+  GVariant *variant = NULL;
+  if (self->deployment_variants)
+    {
+      GLNX_HASH_TABLE_FOREACH_V (self->deployment_variants, GVariant *, v)
+        {
+          const char *id = NULL;
+          if (g_variant_lookup (v, "id", "&s", &id) && g_str_equal (id, arg_id))
+            {
+              variant = v;
+              break;
+            }
+        }
+    }
+  if (!variant)
+    {
+      g_dbus_method_invocation_return_error (invocation, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                                             "Deployment not found: %s", arg_id);
+      return TRUE;
+    }
+
+  g_auto (GVariantDict) details;
+  g_variant_dict_init (&details, NULL);
+  for (const char *const *it = arg_fields; *it; it++)
+    {
+      g_autoptr (GVariant) value = g_variant_lookup_value (variant, *it, NULL);
+      if (value)
+        g_variant_dict_insert_value (&details, *it, value);
+    }
+  rpmostree_sysroot_complete_get_deployment_details (object, invocation,
+                                                     g_variant_dict_end (&details));
+  return TRUE;
+}
+
+static gboolean
+handle_get_metrics (RPMOSTreeSysroot *object, GDBusMethodInvocation *invocation)
+{
+  rpmostree_sysroot_complete_get_metrics (object, invocation, rpmostree_metrics_to_variant ());
+  return TRUE;
+}
+
+/* Returns a checksum of what the published deployment state depends on in
+ * the repo: the refs (for pending base commits) and the remotes (for GPG
+ * status). We also include the cached update written by upgrade checks,
+ * since it can change (e.g. new advisories) without any ref moving. Pulls
+ * and imports bump the repo mtime for every transaction, but until a ref
+ * moves, none of that is visible to clients. */
+static char *
+compute_repo_state (OstreeRepo *repo, GError **error)
+{
+  g_autoptr (GHashTable) refs = NULL;
+  if (!ostree_repo_list_refs_ext (repo, NULL, &refs, OSTREE_REPO_LIST_REFS_EXT_NONE, NULL, error))
+    return NULL;
+
+  g_autoptr (GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_autoptr (GList) refnames = g_list_sort (g_hash_table_get_keys (refs), (GCompareFunc)strcmp);
+  for (GList *l = refnames; l; l = l->next)
+    {
+      auto refname = static_cast<const char *> (l->data);
+      auto rev = static_cast<const char *> (g_hash_table_lookup (refs, refname));
+      g_checksum_update (checksum, (const guint8 *)refname, strlen (refname) + 1);
+      g_checksum_update (checksum, (const guint8 *)rev, strlen (rev) + 1);
+    }
+
+  g_auto (GStrv) remotes = ostree_repo_remote_list (repo, NULL);
+  for (char **it = remotes; it && *it; it++)
+    {
+      gboolean gpg_verify = FALSE;
+      if (!ostree_repo_remote_get_gpg_verify (repo, *it, &gpg_verify, error))
+        return NULL;
+      g_checksum_update (checksum, (const guint8 *)*it, strlen (*it) + 1);
+      g_checksum_update (checksum, (const guint8 *)(gpg_verify ? "1" : "0"), 1);
+    }
+
+  struct stat stbuf;
+  if (!glnx_fstatat_allow_noent (AT_FDCWD, RPMOSTREE_AUTOUPDATES_CACHE_FILE, &stbuf, 0, error))
+    return NULL;
+  if (errno == 0)
+    {
+      g_checksum_update (checksum, (const guint8 *)&stbuf.st_mtim, sizeof (stbuf.st_mtim));
+      g_checksum_update (checksum, (const guint8 *)&stbuf.st_size, sizeof (stbuf.st_size));
+    }
+
+  return g_strdup (g_checksum_get_string (checksum));
+}
+
+/* Entries are only ever for immutable commits; the version guards against the
+ * variant format changing across daemon updates. */
+#define DEPLOYMENT_CACHE_GVARIANT_FORMAT "(sa{s(sa{sv})})"
+
+/* Best effort: load the deployment details cache saved by a previous instance
+ * of the daemon. */
+static void
+load_deployment_cache (RpmostreedSysroot *self)
+{
+  g_autoptr (GError) local_error = NULL;
+  glnx_autofd int fd = -1;
+  if (!glnx_openat_rdonly (AT_FDCWD, RPMOSTREE_DEPLOYMENT_CACHE, TRUE, &fd, &local_error))
+    {
+      if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        sd_journal_print (LOG_WARNING, "Failed to open %s: %s", RPMOSTREE_DEPLOYMENT_CACHE,
+                          local_error->message);
+      return;
+    }
+  g_autoptr (GBytes) data = glnx_fd_readall_bytes (fd, NULL, &local_error);
+  if (!data)
+    {
+      sd_journal_print (LOG_WARNING, "Failed to read %s: %s", RPMOSTREE_DEPLOYMENT_CACHE,
+                        local_error->message);
+      return;
+    }
+  g_autoptr (GVariant) v = g_variant_ref_sink (
+      g_variant_new_from_bytes (G_VARIANT_TYPE (DEPLOYMENT_CACHE_GVARIANT_FORMAT), data, FALSE));
+  if (!g_variant_is_normal_form (v))
+    return;
+
+  const char *version = NULL;
+  g_autoptr (GVariant) entries = NULL;
+  g_variant_get (v, "(&s@a{s(sa{sv})})", &version, &entries);
+  if (!g_str_equal (version, PACKAGE_VERSION))
+    return;
+
+  GVariantIter iter;
+  g_variant_iter_init (&iter, entries);
+  const char *csum;
+  GVariant *details;
+  while (g_variant_iter_next (&iter, "{&s@(sa{sv})}", &csum, &details))
+    g_hash_table_replace (self->deployment_commit_cache, g_strdup (csum), details);
+  g_debug ("loaded %u cached deployment details",
+           g_hash_table_size (self->deployment_commit_cache));
+}
+
+/* Best effort, like load_deployment_cache() */
+static void
+save_deployment_cache (RpmostreedSysroot *self)
+{
+  g_auto (GVariantBuilder) builder;
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{s(sa{sv})}"));
+  GLNX_HASH_TABLE_FOREACH_KV (self->deployment_commit_cache, const char *, csum, GVariant *,
+                              details)
+    {
+      g_variant_builder_add (&builder, "{s@(sa{sv})}", csum, details);
+    }
+  g_autoptr (GVariant) v = g_variant_ref_sink (
+      g_variant_new ("(s@a{s(sa{sv})})", PACKAGE_VERSION, g_variant_builder_end (&builder)));
+
+  g_autoptr (GError) local_error = NULL;
+  if (!glnx_shutil_mkdir_p_at (AT_FDCWD, RPMOSTREE_RUN_DIR, 0755, NULL, &local_error)
+      || !glnx_file_replace_contents_at (
+          AT_FDCWD, RPMOSTREE_DEPLOYMENT_CACHE, (const guint8 *)g_variant_get_data (v),
+          g_variant_get_size (v), GLNX_FILE_REPLACE_NODATASYNC, NULL, &local_error))
+    sd_journal_print (LOG_WARNING, "Failed to write %s: %s", RPMOSTREE_DEPLOYMENT_CACHE,
+                      local_error->message);
+}
+
+/* A deployment whose variant is generated by a worker of
+ * generate_deployment_variants() */
+typedef struct
+{
+  OstreeDeployment *deployment;
+  GHashTable *commit_cache; /* Private to the job; merged back when done */
+  GVariant *variant;
+  GError *error;
+} DeploymentVariantJob;
+
+typedef struct
+{
+  RpmostreedSysroot *self;
+  const char *booted_id;
+} DeploymentVariantData;
+
+static void
+deployment_variant_worker (gpointer datap, gpointer user_data)
+{
+  auto job = static_cast<DeploymentVariantJob *> (datap);
+  auto data = static_cast<DeploymentVariantData *> (user_data);
+  /* For e.g. query_container_image_commit() */
+  auto guard = rpmostreecxx::rpmostreed_daemon_tokio_enter (rpmostreed_daemon_get ());
+  if (rpmostreed_deployment_generate_variant (data->self->ot_sysroot, job->deployment,
+                                              data->booted_id, data->self->repo, TRUE,
+                                              job->commit_cache, &job->variant, &job->error))
+    g_variant_ref_sink (job->variant);
+}
+
+/* Generate the variants of @deployments concurrently, since they don't
+ * depend on each other, and some parts (reading the commits, querying the
+ * state of container images) can be slow. The commit cache is only touched
+ * from this thread: each job starts with the entry for its own commit, and
+ * anything new is merged back once they're all done. */
+static gboolean
+generate_deployment_variants (RpmostreedSysroot *self, GPtrArray *deployments,
+                              const char *booted_id, GPtrArray **out_variants, GError **error)
+{
+  const guint n = deployments ? deployments->len : 0;
+  g_autofree DeploymentVariantJob *jobs = g_new0 (DeploymentVariantJob, n);
+  for (guint i = 0; i < n; i++)
+    {
+      auto deployment = static_cast<OstreeDeployment *> (deployments->pdata[i]);
+      jobs[i].deployment = deployment;
+      jobs[i].commit_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                    (GDestroyNotify)g_variant_unref);
+      const char *csum = ostree_deployment_get_csum (deployment);
+      auto details
+          = static_cast<GVariant *> (g_hash_table_lookup (self->deployment_commit_cache, csum));
+      if (details)
+        g_hash_table_insert (jobs[i].commit_cache, g_strdup (csum), g_variant_ref (details));
+    }
+
+  gboolean ret = TRUE;
+  if (n > 0)
+    {
+      DeploymentVariantData data = { self, booted_id };
+      GThreadPool *pool = g_thread_pool_new (deployment_variant_worker, &data,
+                                             MIN (n, g_get_num_processors ()), TRUE, error);
+      if (!pool)
+        ret = FALSE;
+      for (guint i = 0; ret && i < n; i++)
+        ret = g_thread_pool_push (pool, &jobs[i], error);
+      if (pool)
+        g_thread_pool_free (pool, FALSE, TRUE);
+    }
+
+  g_autoptr (GPtrArray) variants
+      = g_ptr_array_new_with_free_func ((GDestroyNotify)g_variant_unref);
+  for (guint i = 0; i < n; i++)
+    {
+      DeploymentVariantJob *job = &jobs[i];
+      if (ret && job->error)
+        {
+          g_propagate_prefixed_error (error, util::move_nullify (job->error),
+                                      "Reading deployment %u: ", i);
+          ret = FALSE;
+        }
+      if (ret)
+        {
+          g_ptr_array_add (variants, util::move_nullify (job->variant));
+          GLNX_HASH_TABLE_FOREACH_KV (job->commit_cache, const char *, csum, GVariant *, details)
+            g_hash_table_replace (self->deployment_commit_cache, g_strdup (csum),
+                                  g_variant_ref (details));
+        }
+      g_clear_pointer (&job->variant, g_variant_unref);
+      g_clear_error (&job->error);
+      g_hash_table_unref (job->commit_cache);
+    }
+  if (!ret)
+    return FALSE;
+
+  *out_variants = util::move_nullify (variants);
+  return TRUE;
+}
+
 static gboolean
 sysroot_populate_deployments_unlocked (RpmostreedSysroot *self, gboolean *out_changed,
                                        GError **error)
@@ -142,6 +569,7 @@ sysroot_populate_deployments_unlocked (RpmostreedSysroot *self, gboolean *out_ch
   if (out_changed)
     *out_changed = FALSE;
 
+  rpmostree_metrics_count (RPMOSTREE_METRIC_SYSROOT_RELOADS, 1);
   gboolean sysroot_changed;
   if (!ostree_sysroot_load_if_changed (self->ot_sysroot, &sysroot_changed, NULL, error))
     return FALSE;
@@ -150,19 +578,34 @@ sysroot_populate_deployments_unlocked (RpmostreedSysroot *self, gboolean *out_ch
   if (!glnx_fstat (ostree_repo_get_dfd (self->repo), &repo_new_stat, error))
     return FALSE;
 
-  const gboolean repo_changed
-      = !((self->repo_last_stat.st_mtim.tv_sec == repo_new_stat.st_mtim.tv_sec)
-          && (self->repo_last_stat.st_mtim.tv_nsec == repo_new_stat.st_mtim.tv_nsec));
-  if (repo_changed)
-    self->repo_last_stat = repo_new_stat;
+  /* The mtime is a cheap first check; if it moved, look at whether anything
+   * we publish actually depends on the change. */
+  gboolean repo_changed = FALSE;
+  if (!((self->repo_last_stat.st_mtim.tv_sec == repo_new_stat.st_mtim.tv_sec)
+        && (self->repo_last_stat.st_mtim.tv_nsec == repo_new_stat.st_mtim.tv_nsec)))
+    {
+      self->repo_last_stat = repo_new_stat;
+      g_autofree char *repo_state = compute_repo_state (self->repo, error);
+      if (!repo_state)
+        return FALSE;
+      if (g_strcmp0 (repo_state, self->repo_last_state) != 0)
+        {
+          repo_changed = TRUE;
+          g_free (self->repo_last_state);
+          self->repo_last_state = util::move_nullify (repo_state);
+        }
+    }
 
   if (!(sysroot_changed || repo_changed))
     return TRUE; /* Note early return */
 
   g_debug ("loading deployments");
+  rpmostree_metrics_count (RPMOSTREE_METRIC_SYSROOT_RELOADS_CHANGED, 1);
 
   GVariantBuilder builder;
   g_variant_builder_init (&builder, G_VARIANT_TYPE ("aa{sv}"));
+  GVariantBuilder summaries_builder;
+  g_variant_builder_init (&summaries_builder, G_VARIANT_TYPE ("aa{sv}"));
 
   g_autoptr (GHashTable) seen_osnames = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, NULL);
 
@@ -189,16 +632,45 @@ sysroot_populate_deployments_unlocked (RpmostreedSysroot *self, gboolean *out_ch
   /* Add deployment interfaces */
   g_autoptr (GPtrArray) deployments = ostree_sysroot_get_deployments (self->ot_sysroot);
 
+  /* Most changes (a new deployment, a pin, a pull) leave the commits of the
+   * existing deployments alone, so carry over their cached details; anything
+   * for a deployment that's gone is dropped with the old table. */
+  g_autoptr (GHashTable) prev_commit_cache = util::move_nullify (self->deployment_commit_cache);
+  self->deployment_commit_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                         (GDestroyNotify)g_variant_unref);
   for (guint i = 0; deployments != NULL && i < deployments->len; i++)
     {
-      auto deployment = static_cast<OstreeDeployment *> (deployments->pdata[i]);
-      GVariant *variant = NULL;
-      if (!rpmostreed_deployment_generate_variant (self->ot_sysroot, deployment, booted_id,
-                                                   self->repo, TRUE, &variant, error))
-        return glnx_prefix_error (error, "Reading deployment %u", i);
+      const char *csum
+          = ostree_deployment_get_csum (static_cast<OstreeDeployment *> (deployments->pdata[i]));
+      auto details = static_cast<GVariant *> (g_hash_table_lookup (prev_commit_cache, csum));
+      if (details)
+        g_hash_table_replace (self->deployment_commit_cache, g_strdup (csum),
+                              g_variant_ref (details));
+    }
+  const guint n_carried = g_hash_table_size (self->deployment_commit_cache);
 
+  g_autoptr (GPtrArray) variants = NULL;
+  if (!generate_deployment_variants (self, deployments, booted_id, &variants, error))
+    return FALSE;
+
+  /* Nothing is published until all of them are ready */
+  g_autoptr (GHashTable) deployment_variants = g_hash_table_new_full (
+      g_direct_hash, g_direct_equal, g_object_unref, (GDestroyNotify)g_variant_unref);
+  for (guint i = 0; i < variants->len; i++)
+    {
+      auto deployment = static_cast<OstreeDeployment *> (deployments->pdata[i]);
+      auto variant = static_cast<GVariant *> (variants->pdata[i]);
       g_variant_builder_add_value (&builder, variant);
+      g_variant_builder_add_value (&summaries_builder, deployment_variant_summarize (variant));
+      g_hash_table_insert (deployment_variants, g_object_ref (deployment), g_variant_ref (variant));
+    }
+  /* Before creating any new OS interfaces, which look these up */
+  g_clear_pointer (&self->deployment_variants, g_hash_table_unref);
+  self->deployment_variants = util::move_nullify (deployment_variants);
 
+  for (guint i = 0; i < variants->len; i++)
+    {
+      auto deployment = static_cast<OstreeDeployment *> (deployments->pdata[i]);
       const char *deployment_os = ostree_deployment_get_osname (deployment);
 
       /* Have we not seen this osname instance before?  If so, add it
@@ -235,6 +707,12 @@ sysroot_populate_deployments_unlocked (RpmostreedSysroot *self, gboolean *out_ch
     }
 
   rpmostree_sysroot_set_deployments (RPMOSTREE_SYSROOT (self), g_variant_builder_end (&builder));
+  rpmostree_sysroot_set_deployment_summaries (RPMOSTREE_SYSROOT (self),
+                                              g_variant_builder_end (&summaries_builder));
+
+  if (n_carried != g_hash_table_size (self->deployment_commit_cache)
+      || n_carried != g_hash_table_size (prev_commit_cache))
+    save_deployment_cache (self);
   g_debug ("finished deployments");
 
   if (out_changed)
@@ -433,6 +911,24 @@ sysroot_finalize (GObject *object)
   g_hash_table_unref (self->osexperimental_interfaces);
 
   g_clear_object (&self->monitor);
+  g_clear_pointer (&self->deployment_commit_cache, g_hash_table_unref);
+  g_clear_pointer (&self->deployment_variants, g_hash_table_unref);
+  g_free (self->repo_last_state);
+  g_clear_pointer (&self->status_snapshot, g_variant_unref);
+
+  g_queue_clear_full (&self->refsack_cache, (GDestroyNotify)refsack_cache_entry_free);
+  g_mutex_clear (&self->refsack_cache_lock);
+  g_clear_pointer (&self->polkit_cache, g_hash_table_unref);
+
+  if (self->txn_queue_idle_id > 0)
+    g_source_remove (self->txn_queue_idle_id);
+  while (!g_queue_is_empty (&self->txn_queue))
+    {
+      auto queued = static_cast<QueuedTxn *> (g_queue_pop_head (&self->txn_queue));
+      g_dbus_method_invocation_return_error (util::move_nullify (queued->invocation), G_IO_ERROR,
+                                             G_IO_ERROR_CANCELLED, "Daemon exiting");
+      queued_txn_free (queued);
+    }
 
   G_OBJECT_CLASS (rpmostreed_sysroot_parent_class)->finalize (object);
 }
@@ -449,6 +945,18 @@ rpmostreed_sysroot_init (RpmostreedSysroot *self)
       = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_object_unref);
 
   self->monitor = NULL;
+  self->deployment_commit_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                         (GDestroyNotify)g_variant_unref);
+
+  g_mutex_init (&self->refsack_cache_lock);
+  g_queue_init (&self->refsack_cache);
+  g_queue_init (&self->txn_queue);
+  self->polkit_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                              (GDestroyNotify)g_hash_table_unref);
+
+  /* The OS interfaces also reload on this, but the snapshot is only rebuilt
+   * when requested, so ordering doesn't matter. */
+  g_signal_connect (self, "updated", G_CALLBACK (on_sysroot_updated), NULL);
 }
 
 static gboolean
@@ -458,6 +966,7 @@ sysroot_authorize_method (GDBusInterfaceSkeleton *interface, GDBusMethodInvocati
   const gchar *method_name = g_dbus_method_invocation_get_method_name (invocation);
   const gchar *sender = g_dbus_method_invocation_get_sender (invocation);
   gboolean authorized = FALSE;
+  rpmostree_trace_mark ("dbus-method", method_name);
   g_autoptr (GError) local_error = NULL;
   const char *action = NULL;
 
@@ -479,9 +988,12 @@ sysroot_authorize_method (GDBusInterfaceSkeleton *interface, GDBusMethodInvocati
   // G_DBUS_MESSAGE_FLAGS_ALLOW_INTERACTIVE_AUTHORIZATION) > 0;
   bool allow_interactive_auth = true;
 
-  if (g_strcmp0 (method_name, "GetOS") == 0 || g_strcmp0 (method_name, "Reload") == 0)
+  if (g_strcmp0 (method_name, "GetOS") == 0 || g_strcmp0 (method_name, "Reload") == 0
+      || g_strcmp0 (method_name, "GetStatusSnapshot") == 0
+      || g_strcmp0 (method_name, "GetMetrics") == 0
+      || g_strcmp0 (method_name, "GetDeploymentDetails") == 0)
     {
-      /* GetOS() and Reload() are always allowed */
+      /* GetOS(), Reload() and the read-only getters are always allowed */
       authorized = TRUE;
     }
   else if (g_strcmp0 (method_name, "ReloadConfig") == 0)
@@ -522,35 +1034,9 @@ sysroot_authorize_method (GDBusInterfaceSkeleton *interface, GDBusMethodInvocati
   /* only ask polkit if we didn't already authorize it */
   if (!authorized && action != NULL)
     {
-      glnx_unref_object PolkitSubject *subject = polkit_system_bus_name_new (sender);
-      g_autoptr (GError) local_error = NULL;
-
-      g_autoptr (PolkitAuthority) authority
-          = rpmostreed_sysroot_get_polkit_authority (self, &local_error);
-      if (!authority)
-        {
-          g_assert (local_error);
-          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                                                 "Failed to load polkit: %s", local_error->message);
-          return FALSE;
-        }
-
-      int authflags = 0;
-      if (allow_interactive_auth)
-        authflags |= POLKIT_CHECK_AUTHORIZATION_FLAGS_ALLOW_USER_INTERACTION;
-      glnx_unref_object PolkitAuthorizationResult *result
-          = polkit_authority_check_authorization_sync (
-              self->authority, subject, action, NULL,
-              static_cast<PolkitCheckAuthorizationFlags> (authflags), NULL, &local_error);
-      if (result == NULL)
-        {
-          g_assert (local_error);
-          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                                                 "Authorization error: %s", local_error->message);
-          return FALSE;
-        }
-
-      authorized = polkit_authorization_result_get_is_authorized (result);
+      const char *actions[] = { action, NULL };
+      return rpmostreed_sysroot_check_authorization (self, interface, invocation, actions,
+                                                     allow_interactive_auth, FALSE, "Sysroot");
     }
 
   if (!authorized)
@@ -630,6 +1116,9 @@ rpmostreed_sysroot_iface_init (RPMOSTreeSysrootIface *iface)
   iface->handle_unregister_client = handle_unregister_client;
   iface->handle_reload = handle_reload;
   iface->handle_reload_config = handle_reload_config;
+  iface->handle_get_status_snapshot = handle_get_status_snapshot;
+  iface->handle_get_metrics = handle_get_metrics;
+  iface->handle_get_deployment_details = handle_get_deployment_details;
 }
 
 /**
@@ -659,6 +1148,7 @@ rpmostreed_sysroot_populate (RpmostreedSysroot *self, GCancellable *cancellable,
   if (!ostree_sysroot_get_repo (self->ot_sysroot, &self->repo, cancellable, error))
     return FALSE;
 
+  load_deployment_cache (self);
   if (!sysroot_populate_deployments_unlocked (self, NULL, error))
     return FALSE;
 
@@ -769,6 +1259,118 @@ on_txn_executed_changed (GObject *object, GParamSpec *pspec, gpointer user_data)
     }
 }
 
+/* Hand @invocation to the method handler of @skeleton, bypassing the
+ * authorization step; takes ownership of the invocation. */
+static void
+dispatch_invocation (GDBusInterfaceSkeleton *skeleton, GDBusMethodInvocation *invocation)
+{
+  GDBusInterfaceVTable *vtable = g_dbus_interface_skeleton_get_vtable (skeleton);
+  vtable->method_call (g_dbus_method_invocation_get_connection (invocation),
+                       g_dbus_method_invocation_get_sender (invocation),
+                       g_dbus_method_invocation_get_object_path (invocation),
+                       g_dbus_method_invocation_get_interface_name (invocation),
+                       g_dbus_method_invocation_get_method_name (invocation),
+                       g_dbus_method_invocation_get_parameters (invocation), invocation, skeleton);
+}
+
+static gboolean
+queued_txn_client_gone (QueuedTxn *queued)
+{
+  const char *sender = g_dbus_method_invocation_get_sender (queued->invocation);
+  if (!sender)
+    return FALSE; /* Peer to peer; the connection would have been closed */
+
+  g_autoptr (GVariant) reply = g_dbus_connection_call_sync (
+      g_dbus_method_invocation_get_connection (queued->invocation), "org.freedesktop.DBus",
+      "/org/freedesktop/DBus", "org.freedesktop.DBus", "NameHasOwner",
+      g_variant_new ("(s)", sender), G_VARIANT_TYPE ("(b)"), G_DBUS_CALL_FLAGS_NONE, -1, NULL,
+      NULL);
+  gboolean has_owner = TRUE;
+  if (reply)
+    g_variant_get (reply, "(b)", &has_owner);
+  return !has_owner;
+}
+
+/* Start queued requests until one of them creates a transaction. We do this
+ * by dispatching the method call to the interface as if it had just arrived;
+ * it was already authorized when it was queued. */
+static gboolean
+dispatch_queued_txns (gpointer user_data)
+{
+  auto self = static_cast<RpmostreedSysroot *> (user_data);
+  self->txn_queue_idle_id = 0;
+
+  while (self->transaction == NULL && !g_queue_is_empty (&self->txn_queue))
+    {
+      auto queued = static_cast<QueuedTxn *> (g_queue_pop_head (&self->txn_queue));
+      GDBusMethodInvocation *invocation = util::move_nullify (queued->invocation);
+      const char *method_name = g_dbus_method_invocation_get_method_name (invocation);
+      const gint64 waited_secs = (g_get_monotonic_time () - queued->queued_time) / G_USEC_PER_SEC;
+
+      if (waited_secs > TXN_QUEUE_MAX_WAIT_SECS)
+        {
+          g_dbus_method_invocation_return_error (invocation, G_IO_ERROR, G_IO_ERROR_TIMED_OUT,
+                                                 "Timed out waiting for transaction to finish");
+        }
+      else if (queued_txn_client_gone (queued))
+        {
+          sd_journal_print (LOG_INFO, "Dropping queued %s; client %s went away", method_name,
+                            g_dbus_method_invocation_get_sender (invocation));
+          g_object_unref (invocation);
+        }
+      else
+        {
+          sd_journal_print (LOG_INFO, "Starting queued %s after %" G_GINT64_FORMAT "s",
+                            method_name, waited_secs);
+          dispatch_invocation (queued->skeleton, invocation);
+        }
+      queued_txn_free (queued);
+    }
+
+  return G_SOURCE_REMOVE;
+}
+
+static gint
+compare_queued_txn_priority (gconstpointer a, gconstpointer b, gpointer user_data)
+{
+  auto queued = static_cast<const QueuedTxn *> (a);
+  auto incoming = static_cast<const QueuedTxn *> (b);
+  /* Go after everything of the same or higher priority */
+  return queued->priority >= incoming->priority ? -1 : 1;
+}
+
+/* Called when authorizing a method which starts a transaction. If another,
+ * incompatible transaction is active, take a ref to the invocation and
+ * queue it to be dispatched once that one finishes, rather than failing the
+ * call as busy. Returns TRUE if queued, in which case the call shouldn't be
+ * dispatched now.
+ */
+gboolean
+rpmostreed_sysroot_queue_txn (RpmostreedSysroot *self, GDBusInterfaceSkeleton *skeleton,
+                              GDBusMethodInvocation *invocation, RpmostreedTxnPriority priority)
+{
+  if (self->transaction == NULL
+      || rpmostreed_transaction_is_compatible (self->transaction, invocation))
+    return FALSE;
+  /* Let these fail with the usual errors */
+  if (rpmostreed_daemon_is_rebooting (rpmostreed_daemon_get ())
+      || g_queue_get_length (&self->txn_queue) >= TXN_QUEUE_MAX_ENTRIES)
+    return FALSE;
+
+  QueuedTxn *queued = g_new0 (QueuedTxn, 1);
+  queued->skeleton = (GDBusInterfaceSkeleton *)g_object_ref (skeleton);
+  queued->invocation = (GDBusMethodInvocation *)g_object_ref (invocation);
+  queued->priority = priority;
+  queued->queued_time = g_get_monotonic_time ();
+  g_queue_insert_sorted (&self->txn_queue, queued, compare_queued_txn_priority, NULL);
+
+  sd_journal_print (LOG_INFO, "Queued %s from %s behind active transaction (%u waiting)",
+                    g_dbus_method_invocation_get_method_name (invocation),
+                    g_dbus_method_invocation_get_sender (invocation),
+                    g_queue_get_length (&self->txn_queue));
+  return TRUE;
+}
+
 void
 rpmostreed_sysroot_set_txn (RpmostreedSysroot *self, RpmostreedTransaction *txn)
 {
@@ -804,7 +1406,12 @@ rpmostreed_sysroot_set_txn (RpmostreedSysroot *self, RpmostreedTransaction *txn)
       g_autoptr (GVariant) v = g_variant_ref_sink (g_variant_new ("(sss)", "", "", ""));
       rpmostree_sysroot_set_active_transaction ((RPMOSTreeSysroot *)self, v);
       rpmostree_sysroot_set_active_transaction_path ((RPMOSTreeSysroot *)self, "");
+
+      if (!g_queue_is_empty (&self->txn_queue) && self->txn_queue_idle_id == 0)
+        self->txn_queue_idle_id = g_idle_add (dispatch_queued_txns, self);
     }
+
+  invalidate_status_snapshot (self);
 }
 
 void
@@ -834,6 +1441,135 @@ rpmostreed_sysroot_get_repo (RpmostreedSysroot *self)
   return self->repo;
 }
 
+/* Returns the variant of @deployment as published in the Deployments
+ * property, or %NULL if it's not one of the deployments last loaded */
+GVariant *
+rpmostreed_sysroot_lookup_deployment_variant (RpmostreedSysroot *self,
+                                              OstreeDeployment *deployment)
+{
+  if (!self->deployment_variants)
+    return NULL;
+  return static_cast<GVariant *> (g_hash_table_lookup (self->deployment_variants, deployment));
+}
+
+static RpmOstreeRefSack *
+refsack_cache_lookup (RpmostreedSysroot *self, const char *key)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&self->refsack_cache_lock);
+  for (GList *l = self->refsack_cache.head; l; l = l->next)
+    {
+      auto entry = static_cast<RefSackCacheEntry *> (l->data);
+      if (g_str_equal (entry->key, key))
+        {
+          g_queue_unlink (&self->refsack_cache, l);
+          g_queue_push_head_link (&self->refsack_cache, l);
+          return rpmostree_refsack_ref (entry->rsack);
+        }
+    }
+  return NULL;
+}
+
+static void
+refsack_cache_insert (RpmostreedSysroot *self, const char *key, RpmOstreeRefSack *rsack)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&self->refsack_cache_lock);
+  for (GList *l = self->refsack_cache.head; l; l = l->next)
+    {
+      if (g_str_equal (static_cast<RefSackCacheEntry *> (l->data)->key, key))
+        return;
+    }
+
+  auto entry = g_new0 (RefSackCacheEntry, 1);
+  entry->key = g_strdup (key);
+  entry->rsack = rpmostree_refsack_ref (rsack);
+  entry->n_packages = dnf_sack_count (rsack->sack);
+  g_queue_push_head (&self->refsack_cache, entry);
+  self->refsack_cache_n_packages += entry->n_packages;
+
+  /* Evict the least recently used, but always keep the one we just added */
+  while (self->refsack_cache.length > 1
+         && (self->refsack_cache.length > REFSACK_CACHE_MAX_ENTRIES
+             || self->refsack_cache_n_packages > REFSACK_CACHE_MAX_PACKAGES))
+    {
+      auto evicted = static_cast<RefSackCacheEntry *> (g_queue_pop_tail (&self->refsack_cache));
+      self->refsack_cache_n_packages -= evicted->n_packages;
+      refsack_cache_entry_free (evicted);
+    }
+}
+
+/* Commits are immutable, so the sack for a given commit's rpmdb never
+ * changes. Rather than rebuilding it each time, keep the last few around.
+ * If @base is %TRUE, this is the sack for the base layer rpmdb, as with
+ * rpmostree_get_base_refsack_for_commit(). The returned sack is shared and
+ * must only be queried. */
+RpmOstreeRefSack *
+rpmostreed_sysroot_get_refsack_for_commit (RpmostreedSysroot *self, OstreeRepo *repo,
+                                           const char *rev, gboolean base,
+                                           GCancellable *cancellable, GError **error)
+{
+  g_autofree char *checksum = NULL;
+  if (!ostree_repo_resolve_rev (repo, rev, FALSE, &checksum, error))
+    return NULL;
+
+  g_autofree char *key = g_strconcat (base ? "base:" : "", checksum, NULL);
+  RpmOstreeRefSack *rsack = refsack_cache_lookup (self, key);
+  if (rsack)
+    return rsack;
+
+  g_autoptr (RpmOstreeRefSack) new_rsack
+      = base ? rpmostree_get_base_refsack_for_commit (repo, checksum, cancellable, error)
+             : rpmostree_get_refsack_for_commit (repo, checksum, cancellable, error);
+  if (!new_rsack)
+    return NULL;
+  refsack_cache_insert (self, key, new_rsack);
+  return util::move_nullify (new_rsack);
+}
+
+/* Like rpmostreed_sysroot_get_refsack_for_commit() for the deployment's
+ * commit, but if it isn't cached, read the rpmdb from the deployment root
+ * rather than checking it out. */
+RpmOstreeRefSack *
+rpmostreed_sysroot_get_refsack_for_deployment (RpmostreedSysroot *self, OstreeSysroot *sysroot,
+                                               OstreeDeployment *deployment, GError **error)
+{
+  const char *checksum = ostree_deployment_get_csum (deployment);
+  RpmOstreeRefSack *rsack = refsack_cache_lookup (self, checksum);
+  if (rsack)
+    return rsack;
+
+  g_autofree char *deployment_dirpath
+      = ostree_sysroot_get_deployment_dirpath (sysroot, deployment);
+  g_autoptr (RpmOstreeRefSack) new_rsack = rpmostree_get_refsack_for_commit_root (
+      ostree_sysroot_get_fd (sysroot), deployment_dirpath, ostree_sysroot_repo (sysroot),
+      checksum, error);
+  if (!new_rsack)
+    return NULL;
+  refsack_cache_insert (self, checksum, new_rsack);
+  return util::move_nullify (new_rsack);
+}
+
+static void polkit_cache_expire (RpmostreedSysroot *self);
+
+/* Called once the daemon has been idle for a while: evict the least recently
+ * used sacks until they hold at most @max_packages, and drop expired
+ * authorizations, which we'd otherwise only notice on the next lookup. */
+void
+rpmostreed_sysroot_trim_caches (RpmostreedSysroot *self, guint max_packages)
+{
+  {
+    g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&self->refsack_cache_lock);
+    while (!g_queue_is_empty (&self->refsack_cache)
+           && self->refsack_cache_n_packages > max_packages)
+      {
+        auto evicted = static_cast<RefSackCacheEntry *> (g_queue_pop_tail (&self->refsack_cache));
+        self->refsack_cache_n_packages -= evicted->n_packages;
+        refsack_cache_entry_free (evicted);
+      }
+  }
+
+  polkit_cache_expire (self);
+}
+
 // Default method that always authorizes a caller with uid 0 for anything.
 // systemd upstream today goes to a next level of getting the remote pid,
 // then from there gathering the capabilities
@@ -899,6 +1635,216 @@ rpmostreed_sysroot_get_polkit_authority (RpmostreedSysroot *self, GError **error
   return (PolkitAuthority *)g_object_ref (self->authority);
 }
 
+/* Successful checks for read-only methods are reused for this long, so that
+ * clients polling e.g. GetCachedUpdateRpmDiff don't cost a polkit round trip
+ * each time. */
+#define POLKIT_CACHE_TTL_SECS 10
+
+/* Set on invocations which passed an asynchronous polkit check, so that
+ * they're let through when dispatched again */
+#define POLKIT_AUTHORIZED_KEY "rpmostreed-polkit-authorized"
+
+typedef struct
+{
+  GDBusInterfaceSkeleton *skeleton;
+  GDBusMethodInvocation *invocation;
+  PolkitAuthority *authority;
+  PolkitSubject *subject;
+  char **actions;
+  guint next_action;
+  PolkitCheckAuthorizationFlags flags;
+  gboolean cacheable;
+  char *interface_desc;
+  gint64 start_time; /* of the current action's check, for the metrics */
+} PolkitCheck;
+
+static void
+polkit_check_free (PolkitCheck *check)
+{
+  g_clear_object (&check->skeleton);
+  g_clear_object (&check->invocation);
+  g_clear_object (&check->authority);
+  g_clear_object (&check->subject);
+  g_strfreev (check->actions);
+  g_free (check->interface_desc);
+  g_free (check);
+}
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (PolkitCheck, polkit_check_free)
+
+static gboolean
+polkit_cache_lookup (RpmostreedSysroot *self, const char *sender, const char *action)
+{
+  auto actions = static_cast<GHashTable *> (g_hash_table_lookup (self->polkit_cache, sender));
+  if (!actions)
+    return FALSE;
+  auto expiry = static_cast<gint64 *> (g_hash_table_lookup (actions, action));
+  if (!expiry)
+    return FALSE;
+  if (g_get_monotonic_time () < *expiry)
+    return TRUE;
+  g_hash_table_remove (actions, action);
+  if (g_hash_table_size (actions) == 0)
+    g_hash_table_remove (self->polkit_cache, sender);
+  return FALSE;
+}
+
+static void
+polkit_cache_insert (RpmostreedSysroot *self, const char *sender, const char *action)
+{
+  auto actions = static_cast<GHashTable *> (g_hash_table_lookup (self->polkit_cache, sender));
+  if (!actions)
+    {
+      actions = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+      g_hash_table_insert (self->polkit_cache, g_strdup (sender), actions);
+    }
+  gint64 *expiry = g_new (gint64, 1);
+  *expiry = g_get_monotonic_time () + POLKIT_CACHE_TTL_SECS * G_USEC_PER_SEC;
+  g_hash_table_replace (actions, g_strdup (action), expiry);
+}
+
+static void
+polkit_cache_expire (RpmostreedSysroot *self)
+{
+  const gint64 now = g_get_monotonic_time ();
+  GLNX_HASH_TABLE_FOREACH_IT (self->polkit_cache, it, const char *, sender, GHashTable *, actions)
+    {
+      GLNX_HASH_TABLE_FOREACH_IT (actions, action_it, const char *, action, gint64 *, expiry)
+        {
+          if (now >= *expiry)
+            g_hash_table_iter_remove (&action_it);
+        }
+      if (g_hash_table_size (actions) == 0)
+        g_hash_table_iter_remove (&it);
+    }
+}
+
+/* Drop the cached authorizations of @sender, e.g. because it went away */
+void
+rpmostreed_sysroot_forget_authorizations (RpmostreedSysroot *self, const char *sender)
+{
+  g_hash_table_remove (self->polkit_cache, sender);
+}
+
+static void polkit_check_next (PolkitCheck *check);
+
+static void
+on_polkit_check_done (GObject *src, GAsyncResult *res, gpointer user_data)
+{
+  g_autoptr (PolkitCheck) check = static_cast<PolkitCheck *> (user_data);
+  GDBusMethodInvocation *invocation = check->invocation;
+  const char *action = check->actions[check->next_action];
+  g_autoptr (GError) local_error = NULL;
+
+  glnx_unref_object PolkitAuthorizationResult *result
+      = polkit_authority_check_authorization_finish (check->authority, res, &local_error);
+  rpmostree_metrics_observe (RPMOSTREE_METRIC_POLKIT_CHECK,
+                             g_get_monotonic_time () - check->start_time);
+  if (result == NULL)
+    {
+      g_dbus_method_invocation_return_error (util::move_nullify (check->invocation), G_DBUS_ERROR,
+                                             G_DBUS_ERROR_FAILED, "Authorization error: %s",
+                                             local_error->message);
+      return;
+    }
+
+  if (!polkit_authorization_result_get_is_authorized (result))
+    {
+      const char *method_name = g_dbus_method_invocation_get_method_name (invocation);
+      g_dbus_method_invocation_return_error (
+          util::move_nullify (check->invocation), G_DBUS_ERROR, G_DBUS_ERROR_ACCESS_DENIED,
+          "rpmostreed %s operation %s not allowed for user", check->interface_desc, method_name);
+      return;
+    }
+
+  if (check->cacheable)
+    {
+      const char *sender = g_dbus_method_invocation_get_sender (invocation);
+      polkit_cache_insert (rpmostreed_sysroot_get (), sender, action);
+    }
+
+  check->next_action++;
+  if (check->actions[check->next_action] != NULL)
+    {
+      polkit_check_next (util::move_nullify (check));
+      return;
+    }
+
+  /* Go through the authorize method again, so that e.g. the transaction
+   * queue still applies; it lets us through this time. */
+  g_object_set_data (G_OBJECT (invocation), POLKIT_AUTHORIZED_KEY, GUINT_TO_POINTER (1));
+  GDBusInterfaceSkeletonClass *klass = G_DBUS_INTERFACE_SKELETON_GET_CLASS (check->skeleton);
+  if (klass->g_authorize_method (check->skeleton, invocation))
+    dispatch_invocation (check->skeleton, util::move_nullify (check->invocation));
+  else
+    /* The authorize method completed it or kept its own reference */
+    g_clear_object (&check->invocation);
+}
+
+/* Takes ownership of @check */
+static void
+polkit_check_next (PolkitCheck *check)
+{
+  check->start_time = g_get_monotonic_time ();
+  polkit_authority_check_authorization (check->authority, check->subject,
+                                        check->actions[check->next_action], NULL, check->flags,
+                                        NULL, on_polkit_check_done, check);
+}
+
+/* Check with polkit whether the sender of @invocation may perform all of
+ * @actions. Returns %TRUE if it's known to be allowed already. Otherwise, the
+ * check is done asynchronously rather than blocking the main loop on polkit,
+ * and %FALSE is returned: the invocation is then either failed, or dispatched
+ * again once authorized, in which case this returns %TRUE for it.
+ *
+ * Results are only cached for @cacheable (i.e. read-only) methods.
+ */
+gboolean
+rpmostreed_sysroot_check_authorization (RpmostreedSysroot *self,
+                                        GDBusInterfaceSkeleton *skeleton,
+                                        GDBusMethodInvocation *invocation,
+                                        const char *const *actions, gboolean allow_interaction,
+                                        gboolean cacheable, const char *interface_desc)
+{
+  g_assert (actions && actions[0]);
+
+  if (g_object_get_data (G_OBJECT (invocation), POLKIT_AUTHORIZED_KEY))
+    return TRUE;
+
+  const char *sender = g_dbus_method_invocation_get_sender (invocation);
+  if (cacheable)
+    {
+      gboolean all_cached = TRUE;
+      for (const char *const *it = actions; *it && all_cached; it++)
+        all_cached = polkit_cache_lookup (self, sender, *it);
+      if (all_cached)
+        return TRUE;
+    }
+
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (PolkitAuthority) authority
+      = rpmostreed_sysroot_get_polkit_authority (self, &local_error);
+  if (!authority)
+    {
+      g_assert (local_error);
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                                             "Failed to load polkit: %s", local_error->message);
+      return FALSE;
+    }
+
+  PolkitCheck *check = g_new0 (PolkitCheck, 1);
+  check->skeleton = (GDBusInterfaceSkeleton *)g_object_ref (skeleton);
+  check->invocation = (GDBusMethodInvocation *)g_object_ref (invocation);
+  check->authority = util::move_nullify (authority);
+  check->subject = polkit_system_bus_name_new (sender);
+  check->actions = g_strdupv ((char **)actions);
+  check->flags = allow_interaction ? POLKIT_CHECK_AUTHORIZATION_FLAGS_ALLOW_USER_INTERACTION
+                                   : POLKIT_CHECK_AUTHORIZATION_FLAGS_NONE;
+  check->cacheable = cacheable;
+  check->interface_desc = g_strdup (interface_desc);
+  polkit_check_next (check);
+  return FALSE;
+}
+
 gboolean
 rpmostreed_sysroot_is_on_session_bus (RpmostreedSysroot *self)
 {
@@ -19,6 +19,7 @@
 #pragma once
 
 #include "ostree.h"
+#include "rpmostree-refsack.h"
 #include "rpmostreed-types.h"
 #include <polkit/polkit.h>
 
@@ -31,6 +32,15 @@ G_BEGIN_DECLS
 
 #define SYSROOT_DEFAULT_PATH "/"
 
+/* Order in which transaction requests queued behind an active transaction
+ * are started; see rpmostreed_sysroot_queue_txn(). */
+typedef enum
+{
+  RPMOSTREED_TXN_PRIORITY_AUTOMATIC,   /* Background work, e.g. automatic updates */
+  RPMOSTREED_TXN_PRIORITY_INTERACTIVE, /* Requested by a user */
+  RPMOSTREED_TXN_PRIORITY_QUERY,       /* Short and non-mutating, e.g. refresh-md */
+} RpmostreedTxnPriority;
+
 GType rpmostreed_sysroot_get_type (void) G_GNUC_CONST;
 
 RpmostreedSysroot *rpmostreed_sysroot_get (void);
@@ -41,10 +51,20 @@ gboolean rpmostreed_sysroot_reload (RpmostreedSysroot *self, GError **error);
 
 OstreeSysroot *rpmostreed_sysroot_get_root (RpmostreedSysroot *self);
 OstreeRepo *rpmostreed_sysroot_get_repo (RpmostreedSysroot *self);
+GVariant *rpmostreed_sysroot_lookup_deployment_variant (RpmostreedSysroot *self,
+                                                        OstreeDeployment *deployment);
 gboolean rpmostreed_sysroot_authorize_direct (RpmostreedSysroot *self,
                                               GDBusMethodInvocation *invocation,
                                               gboolean *out_is_authorized, GError **error);
 PolkitAuthority *rpmostreed_sysroot_get_polkit_authority (RpmostreedSysroot *self, GError **error);
+gboolean rpmostreed_sysroot_check_authorization (RpmostreedSysroot *self,
+                                                 GDBusInterfaceSkeleton *skeleton,
+                                                 GDBusMethodInvocation *invocation,
+                                                 const char *const *actions,
+                                                 gboolean allow_interaction, gboolean cacheable,
+                                                 const char *interface_desc);
+void rpmostreed_sysroot_forget_authorizations (RpmostreedSysroot *self, const char *sender);
+void rpmostreed_sysroot_trim_caches (RpmostreedSysroot *self, guint max_packages);
 gboolean rpmostreed_sysroot_is_on_session_bus (RpmostreedSysroot *self);
 
 gboolean rpmostreed_sysroot_load_state (RpmostreedSysroot *self, GCancellable *cancellable,
@@ -57,6 +77,10 @@ gboolean rpmostreed_sysroot_prep_for_txn (RpmostreedSysroot *self,
 
 gboolean rpmostreed_sysroot_has_txn (RpmostreedSysroot *self);
 
+gboolean rpmostreed_sysroot_queue_txn (RpmostreedSysroot *self, GDBusInterfaceSkeleton *skeleton,
+                                       GDBusMethodInvocation *invocation,
+                                       RpmostreedTxnPriority priority);
+
 void rpmostreed_sysroot_finish_txn (RpmostreedSysroot *self, RpmostreedTransaction *txn);
 
 void rpmostreed_sysroot_set_txn (RpmostreedSysroot *self, RpmostreedTransaction *txn);
@@ -66,4 +90,15 @@ void rpmostreed_sysroot_set_txn_and_title (RpmostreedSysroot *self, RpmostreedTr
 
 void rpmostreed_sysroot_emit_update (RpmostreedSysroot *self);
 
+RpmOstreeRefSack *rpmostreed_sysroot_get_refsack_for_commit (RpmostreedSysroot *self,
+                                                             OstreeRepo *repo, const char *rev,
+                                                             gboolean base,
+                                                             GCancellable *cancellable,
+                                                             GError **error);
+
+RpmOstreeRefSack *rpmostreed_sysroot_get_refsack_for_deployment (RpmostreedSysroot *self,
+                                                                 OstreeSysroot *sysroot,
+                                                                 OstreeDeployment *deployment,
+                                                                 GError **error);
+
 G_END_DECLS
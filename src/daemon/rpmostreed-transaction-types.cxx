@@ -32,6 +32,7 @@
 #include "rpmostree-sysroot-core.h"
 #include "rpmostree-sysroot-upgrader.h"
 #include "rpmostree-util.h"
+#include "rpmostree-work-queue.h"
 #include "rpmostreed-daemon.h"
 #include "rpmostreed-deployment-utils.h"
 #include "rpmostreed-sysroot.h"
@@ -325,7 +326,7 @@ package_diff_transaction_execute (RpmostreedTransaction *transaction, GCancellab
       if (!apply_revision_override (transaction, repo, progress, origin, FALSE, self->revision,
                                     cancellable, error))
         return FALSE;
-      rpmostree_transaction_emit_progress_end (RPMOSTREE_TRANSACTION (transaction));
+      rpmostreed_transaction_emit_progress_end (transaction);
     }
   else if (upgrading)
     {
@@ -346,7 +347,7 @@ package_diff_transaction_execute (RpmostreedTransaction *transaction, GCancellab
     if (!rpmostree_sysroot_upgrader_pull_base (upgrader, "/usr/share/rpm", (OstreeRepoPullFlags)0,
                                                progress, &changed, cancellable, error))
       return FALSE;
-    rpmostree_transaction_emit_progress_end (RPMOSTREE_TRANSACTION (transaction));
+    rpmostreed_transaction_emit_progress_end (transaction);
   }
 
   if (!changed)
@@ -574,26 +575,85 @@ deploy_transaction_finalize (GObject *object)
   G_OBJECT_CLASS (deploy_transaction_parent_class)->finalize (object);
 }
 
-static gboolean
-import_local_rpm (OstreeRepo *repo, OstreeSePolicy *policy, int *fd, char **out_sha256_nevra,
-                  GCancellable *cancellable, GError **error)
+/* One of the fds passed for a local RPM install, and where its result goes */
+typedef struct
 {
-  auto flags = rpmostreecxx::rpm_importer_flags_new_empty ();
-  g_autoptr (RpmOstreeImporter) unpacker
-      = rpmostree_importer_new_take_fd (fd, repo, NULL, *flags, policy, cancellable, error);
-  if (unpacker == NULL)
-    return FALSE;
+  int fd;
+  guint index;
+  RpmOstreeImporter *importer;
+} LocalRpmImport;
+
+static void
+local_rpm_import_free (LocalRpmImport *import)
+{
+  glnx_close_fd (&import->fd);
+  g_clear_object (&import->importer);
+  g_free (import);
+}
 
+typedef struct
+{
+  OstreeRepo *repo;
+  OstreeSePolicy *policy;
+  GCancellable *cancellable;
+  RpmOstreeWorkQueue *queue;
+  GPtrArray *pkgs; /* sha256:nevra, in the order of the fd list */
+  GError *error;
+} LocalRpmImportsData;
+
+static void
+import_local_rpm_in_thread (GTask *task, gpointer source, gpointer task_data,
+                            GCancellable *cancellable)
+{
+  auto importer = static_cast<RpmOstreeImporter *> (source);
+  GError *local_error = NULL;
   g_autofree char *metadata_sha256 = NULL;
-  if (!rpmostree_importer_run (unpacker, NULL, &metadata_sha256, cancellable, error))
-    return FALSE;
+  if (!rpmostree_importer_run (importer, NULL, &metadata_sha256, cancellable, &local_error))
+    {
+      g_task_return_error (task, local_error);
+      return;
+    }
 
-  g_autofree char *nevra = rpmostree_importer_get_nevra (unpacker);
-  g_autofree char *sha256_nevra = g_strconcat (metadata_sha256, ":", nevra, NULL);
+  g_autofree char *nevra = rpmostree_importer_get_nevra (importer);
+  g_task_return_pointer (task, g_strconcat (metadata_sha256, ":", nevra, NULL), g_free);
+}
+
+static void
+on_local_rpm_import_done (GObject *obj, GAsyncResult *res, gpointer user_data)
+{
+  auto job = static_cast<RpmOstreeWorkQueueJob *> (user_data);
+  auto data = static_cast<LocalRpmImportsData *> (rpmostree_work_queue_job_get_user_data (job));
+  auto import = static_cast<LocalRpmImport *> (g_task_get_task_data (G_TASK (res)));
 
-  if (out_sha256_nevra)
-    *out_sha256_nevra = util::move_nullify (sha256_nevra);
+  auto sha256_nevra = static_cast<char *> (
+      g_task_propagate_pointer (G_TASK (res), data->error ? NULL : &data->error));
+  if (sha256_nevra)
+    data->pkgs->pdata[import->index] = sha256_nevra;
+  rpmostree_work_queue_job_done (job);
 
+  /* On failure, just let what's in flight finish */
+  if (!data->error)
+    (void)rpmostree_work_queue_dispatch (data->queue, &data->error);
+}
+
+static gboolean
+start_local_rpm_import (RpmOstreeWorkQueueJob *job, gpointer item, gpointer user_data,
+                        GError **error)
+{
+  auto data = static_cast<LocalRpmImportsData *> (user_data);
+  auto import = static_cast<LocalRpmImport *> (item);
+
+  auto flags = rpmostreecxx::rpm_importer_flags_new_empty ();
+  /* Transfer fd to import */
+  import->importer = rpmostree_importer_new_take_fd (&import->fd, data->repo, NULL, *flags,
+                                                     data->policy, data->cancellable, error);
+  if (import->importer == NULL)
+    return FALSE;
+
+  g_autoptr (GTask) task
+      = g_task_new (import->importer, data->cancellable, on_local_rpm_import_done, job);
+  g_task_set_task_data (task, import, NULL);
+  g_task_run_in_thread (task, import_local_rpm_in_thread);
   return TRUE;
 }
 
@@ -643,20 +703,41 @@ import_many_local_rpms (OstreeRepo *repo, GUnixFDList *fdl, GPtrArray **out_pkgs
   if (policy == NULL)
     return FALSE;
 
-  g_autoptr (GPtrArray) pkgs = g_ptr_array_new_with_free_func (g_free);
-
   g_autoptr (GPtrArray) fds = unixfdlist_to_ptrarray (fdl);
+  g_autoptr (GPtrArray) pkgs = g_ptr_array_new_full (fds->len, g_free);
+  g_ptr_array_set_size (pkgs, fds->len);
+
+  /* Import in parallel like we do for packages from repos, biggest first */
+  LocalRpmImportsData data = { repo, policy, cancellable, NULL, pkgs, NULL };
+  g_autoptr (RpmOstreeWorkQueue) queue
+      = rpmostree_work_queue_new ("local-import", g_get_num_processors (), start_local_rpm_import,
+                                  &data, (GDestroyNotify)local_rpm_import_free);
+  data.queue = queue;
   for (guint i = 0; i < fds->len; i++)
     {
+      LocalRpmImport *import = g_new0 (LocalRpmImport, 1);
       /* Steal fd from the ptrarray */
-      glnx_autofd int fd = GPOINTER_TO_INT (fds->pdata[i]);
+      import->fd = GPOINTER_TO_INT (fds->pdata[i]);
       fds->pdata[i] = GINT_TO_POINTER (-1);
-      g_autofree char *sha256_nevra = NULL;
-      /* Transfer fd to import */
-      if (!import_local_rpm (repo, policy, &fd, &sha256_nevra, cancellable, error))
-        return FALSE;
+      import->index = i;
+      struct stat stbuf;
+      if (!glnx_fstat (import->fd, &stbuf, error))
+        {
+          local_rpm_import_free (import);
+          return FALSE;
+        }
+      rpmostree_work_queue_push (queue, import, stbuf.st_size);
+    }
 
-      g_ptr_array_add (pkgs, util::move_nullify (sha256_nevra));
+  (void)rpmostree_work_queue_dispatch (queue, &data.error);
+  GMainContext *mainctx = g_main_context_get_thread_default ();
+  while (rpmostree_work_queue_get_n_running (queue) > 0)
+    g_main_context_iteration (mainctx, TRUE);
+  rpmostree_work_queue_log_stats (queue);
+  if (data.error)
+    {
+      g_propagate_error (error, util::move_nullify (data.error));
+      return FALSE;
     }
 
   if (!ostree_repo_commit_transaction (repo, NULL, cancellable, error))
@@ -686,6 +767,7 @@ get_sack_for_booted (OstreeSysroot *sysroot, OstreeRepo *repo, OstreeDeployment
   GLNX_AUTO_PREFIX_ERROR ("Loading sack", error);
 
   g_autoptr (RpmOstreeContext) ctx = rpmostree_context_new_client (repo);
+  rpmostree_context_set_countme (ctx, rpmostreed_get_countme (rpmostreed_daemon_get ()));
 
   g_autofree char *source_root = rpmostree_get_deployment_root (sysroot, booted_deployment);
   if (!rpmostree_context_setup (ctx, NULL, source_root, cancellable, error))
@@ -1143,7 +1225,7 @@ deploy_transaction_execute (RpmostreedTransaction *transaction, GCancellable *ca
                              OSTREE_REPO_PULL_FLAGS_NONE, progress, cancellable, error))
         return glnx_prefix_error (error, "Pulling commit %s from local repo", rev);
       ostree_async_progress_finish (progress);
-      rpmostree_transaction_emit_progress_end (RPMOSTREE_TRANSACTION (transaction));
+      rpmostreed_transaction_emit_progress_end (transaction);
 
       /* as far as the rest of the code is concerned, we're rebasing to :SHA256 now */
       g_clear_pointer (&self->refspec, g_free);
@@ -1170,7 +1252,7 @@ deploy_transaction_execute (RpmostreedTransaction *transaction, GCancellable *ca
                                     deploy_has_bool_option (self, "skip-branch-check"),
                                     self->revision, cancellable, error))
         return FALSE;
-      rpmostree_transaction_emit_progress_end (RPMOSTREE_TRANSACTION (transaction));
+      rpmostreed_transaction_emit_progress_end (transaction);
     }
   else
     {
@@ -1231,7 +1313,8 @@ deploy_transaction_execute (RpmostreedTransaction *transaction, GCancellable *ca
       if (!base_rsack)
         {
           const char *base = rpmostree_sysroot_upgrader_get_base (upgrader);
-          base_rsack = rpmostree_get_refsack_for_commit (repo, base, cancellable, error);
+          base_rsack = rpmostreed_sysroot_get_refsack_for_commit (
+              rpmostreed_sysroot_get (), repo, base, FALSE, cancellable, error);
           if (base_rsack == NULL)
             return FALSE;
         }
@@ -1459,7 +1542,7 @@ deploy_transaction_execute (RpmostreedTransaction *transaction, GCancellable *ca
       if (!rpmostree_sysroot_upgrader_pull_base (upgrader, NULL, (OstreeRepoPullFlags)flags,
                                                  progress, &base_changed, cancellable, error))
         return FALSE;
-      rpmostree_transaction_emit_progress_end (RPMOSTREE_TRANSACTION (transaction));
+      rpmostreed_transaction_emit_progress_end (transaction);
 
       if (base_changed)
         changed = TRUE;
@@ -1487,7 +1570,8 @@ deploy_transaction_execute (RpmostreedTransaction *transaction, GCancellable *ca
       if (!base_rsack)
         {
           const char *base = rpmostree_sysroot_upgrader_get_base (upgrader);
-          base_rsack = rpmostree_get_refsack_for_commit (repo, base, cancellable, error);
+          base_rsack = rpmostreed_sysroot_get_refsack_for_commit (
+              rpmostreed_sysroot_get (), repo, base, FALSE, cancellable, error);
           if (base_rsack == NULL)
             return FALSE;
         }
@@ -2253,6 +2337,16 @@ refresh_md_transaction_execute (RpmostreedTransaction *transaction, GCancellable
   OstreeSysroot *sysroot = rpmostreed_transaction_get_sysroot (transaction);
 
   const gboolean force = ((self->flags & RPMOSTREE_TRANSACTION_REFRESH_MD_FLAG_FORCE) > 0);
+  const gboolean prefetch = ((self->flags & RPMOSTREE_TRANSACTION_REFRESH_MD_FLAG_PREFETCH) > 0);
+
+  /* A prefetch is only there to have the metadata warm for the next
+   * update; it's not worth paying for on a metered connection. */
+  if (prefetch && g_network_monitor_get_network_metered (g_network_monitor_get_default ()))
+    {
+      rpmostree_output_message ("Network is metered; skipping metadata prefetch");
+      sd_journal_print (LOG_INFO, "Skipped rpm-md prefetch on metered network");
+      return TRUE;
+    }
 
   g_autoptr (OstreeDeployment) cfg_merge_deployment
       = ostree_sysroot_get_merge_deployment (sysroot, self->osname);
@@ -2265,6 +2359,7 @@ refresh_md_transaction_execute (RpmostreedTransaction *transaction, GCancellable
 
   OstreeRepo *repo = ostree_sysroot_repo (sysroot);
   g_autoptr (RpmOstreeContext) ctx = rpmostree_context_new_client (repo);
+  rpmostree_context_set_countme (ctx, rpmostreed_get_countme (rpmostreed_daemon_get ()));
 
   /* We could bypass rpmostree_context_setup() here and call dnf_context_setup() ourselves
    * since we're not actually going to perform any installation. Though it does provide us
@@ -2524,6 +2619,10 @@ finalize_deployment_transaction_execute (RpmostreedTransaction *transaction,
   if (!check_sd_inhibitor_locks (cancellable, error))
     return FALSE;
 
+  if (!rpmostree_syscore_verify_preinstalled_boot (sysroot, default_deployment, cancellable,
+                                                   error))
+    return FALSE;
+
   if (unlink (_OSTREE_SYSROOT_RUNSTATE_STAGED_LOCKED) < 0)
     {
       if (errno != ENOENT)
@@ -2617,6 +2716,44 @@ kernel_arg_transaction_finalize (GObject *object)
   G_OBJECT_CLASS (kernel_arg_transaction_parent_class)->finalize (object);
 }
 
+/* With "coalesce-staged", if the kargs were derived from those of the
+ * staged deployment, just change them in place there. This avoids assembling
+ * and staging a whole new deployment when nothing but kargs would differ;
+ * and /boot doesn't get touched until finalization anyway. */
+static gboolean
+kernel_arg_coalesce_staged (KernelArgTransaction *self, OstreeKernelArgs *kargs,
+                            gboolean *out_coalesced, GCancellable *cancellable, GError **error)
+{
+  OstreeSysroot *sysroot = rpmostreed_transaction_get_sysroot (RPMOSTREED_TRANSACTION (self));
+  *out_coalesced = FALSE;
+
+  OstreeDeployment *staged = ostree_sysroot_get_staged_deployment (sysroot);
+  if (!staged || !g_str_equal (ostree_deployment_get_osname (staged), self->osname))
+    return TRUE; /* Note early return */
+  /* The finalization lock is decided when staging */
+  if (vardict_lookup_bool (self->options, "lock-finalization", FALSE))
+    return TRUE; /* Note early return */
+  OstreeBootconfigParser *bootconfig = ostree_deployment_get_bootconfig (staged);
+  const char *staged_kargs
+      = bootconfig ? ostree_bootconfig_parser_get (bootconfig, "options") : NULL;
+  if (g_strcmp0 (staged_kargs, self->existing_kernel_args) != 0)
+    return TRUE; /* Note early return */
+
+  g_autofree char *kargs_str = ostree_kernel_args_to_string (kargs);
+  if (!ostree_sysroot_deployment_set_kargs_in_place (sysroot, staged, kargs_str, cancellable,
+                                                     error))
+    return FALSE;
+  /* So that the daemon reloads, as for finalize-deployment */
+  (void)rpmostree_syscore_bump_mtime (sysroot, NULL);
+
+  sd_journal_print (LOG_INFO, "Changed kernel arguments of staged deployment %s.%d in place",
+                    ostree_deployment_get_csum (staged),
+                    ostree_deployment_get_deployserial (staged));
+  rpmostree_output_message ("Updated kernel arguments of the staged deployment in place");
+  *out_coalesced = TRUE;
+  return TRUE;
+}
+
 static gboolean
 kernel_arg_apply (KernelArgTransaction *self, RpmOstreeSysrootUpgrader *upgrader,
                   OstreeKernelArgs *kargs, gboolean changed, GCancellable *cancellable,
@@ -2632,11 +2769,21 @@ kernel_arg_apply (KernelArgTransaction *self, RpmOstreeSysrootUpgrader *upgrader
       return TRUE;
     }
 
-  g_auto (GStrv) kargs_strv = ostree_kernel_args_to_strv (kargs);
-  rpmostree_sysroot_upgrader_set_kargs (upgrader, kargs_strv);
+  gboolean coalesced = FALSE;
+  if (vardict_lookup_bool (self->options, "coalesce-staged", FALSE))
+    {
+      if (!kernel_arg_coalesce_staged (self, kargs, &coalesced, cancellable, error))
+        return FALSE;
+    }
 
-  if (!rpmostree_sysroot_upgrader_deploy (upgrader, NULL, cancellable, error))
-    return FALSE;
+  if (!coalesced)
+    {
+      g_auto (GStrv) kargs_strv = ostree_kernel_args_to_strv (kargs);
+      rpmostree_sysroot_upgrader_set_kargs (upgrader, kargs_strv);
+
+      if (!rpmostree_sysroot_upgrader_deploy (upgrader, NULL, cancellable, error))
+        return FALSE;
+    }
 
   if (vardict_lookup_bool (self->options, "reboot", FALSE))
     {
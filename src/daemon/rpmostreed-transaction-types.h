@@ -90,6 +90,7 @@ RpmostreedTransaction *rpmostreed_transaction_new_apply_live (GDBusMethodInvocat
 typedef enum
 {
   RPMOSTREE_TRANSACTION_REFRESH_MD_FLAG_FORCE = (1 << 0),
+  RPMOSTREE_TRANSACTION_REFRESH_MD_FLAG_PREFETCH = (1 << 1),
 } RpmOstreeTransactionRefreshMdFlags;
 
 RpmostreedTransaction *
@@ -26,6 +26,9 @@
 #include <systemd/sd-login.h>
 
 #include "rpmostree-cxxrs.h"
+#include "rpmostree-metrics.h"
+#include "rpmostree-trace.h"
+#include "rpmostree-util.h"
 #include "rpmostreed-daemon.h"
 #include "rpmostreed-errors.h"
 #include "rpmostreed-sysroot.h"
@@ -55,6 +58,14 @@ struct _RpmostreedTransactionPrivate
 
   gint64 last_progress_journal;
 
+  /* Progress signals are rate limited per channel; the latest update that
+   * was held back is kept here until it's flushed. See progress_rate_limited(). */
+  gint64 last_download_progress;
+  GVariant *pending_download_progress;
+  gint64 last_percent_progress;
+  char *pending_percent_text;
+  guint pending_percent;
+
   gboolean redirect_output;
 
   GDBusServer *server;
@@ -214,6 +225,77 @@ transaction_owner_vanished_cb (GDBusConnection *connection, const char *name, gp
     }
 }
 
+/* Returns TRUE if an update on the channel last emitted at @last_emit
+ * should be held back; otherwise, records it as emitted now. */
+static gboolean
+progress_rate_limited (gint64 *last_emit)
+{
+  const guint rate = rpmostreed_get_progress_update_rate (rpmostreed_daemon_get ());
+  if (rate == 0)
+    return FALSE;
+  const gint64 now = g_get_monotonic_time ();
+  if (*last_emit > 0 && now - *last_emit < G_USEC_PER_SEC / rate)
+    return TRUE;
+  *last_emit = now;
+  return FALSE;
+}
+
+static void
+emit_download_progress (RPMOSTreeTransaction *transaction, GVariant *progress)
+{
+  g_autoptr (GVariant) arg_time = g_variant_get_child_value (progress, 0);
+  g_autoptr (GVariant) arg_outstanding = g_variant_get_child_value (progress, 1);
+  g_autoptr (GVariant) arg_metadata = g_variant_get_child_value (progress, 2);
+  g_autoptr (GVariant) arg_delta = g_variant_get_child_value (progress, 3);
+  g_autoptr (GVariant) arg_content = g_variant_get_child_value (progress, 4);
+  g_autoptr (GVariant) arg_transfer = g_variant_get_child_value (progress, 5);
+  rpmostree_transaction_emit_download_progress (transaction, arg_time, arg_outstanding,
+                                                arg_metadata, arg_delta, arg_content, arg_transfer);
+}
+
+/* Emit any progress updates that were held back, so that clients always see
+ * the final state before the next message or the end of a task. */
+static void
+transaction_flush_progress (RpmostreedTransaction *self)
+{
+  RpmostreedTransactionPrivate *priv = rpmostreed_transaction_get_private (self);
+  RPMOSTreeTransaction *transaction = RPMOSTREE_TRANSACTION (self);
+
+  if (priv->pending_download_progress)
+    {
+      g_autoptr (GVariant) progress = util::move_nullify (priv->pending_download_progress);
+      emit_download_progress (transaction, progress);
+    }
+  if (priv->pending_percent_text)
+    {
+      g_autofree char *text = util::move_nullify (priv->pending_percent_text);
+      rpmostree_transaction_emit_percent_progress (transaction, text, priv->pending_percent);
+    }
+}
+
+static void
+emit_percent_progress (RpmostreedTransaction *self, const char *text, guint percentage)
+{
+  RpmostreedTransactionPrivate *priv = rpmostreed_transaction_get_private (self);
+  if (progress_rate_limited (&priv->last_percent_progress))
+    {
+      g_free (priv->pending_percent_text);
+      priv->pending_percent_text = g_strdup (text);
+      priv->pending_percent = percentage;
+      return;
+    }
+  g_clear_pointer (&priv->pending_percent_text, g_free);
+  rpmostree_transaction_emit_percent_progress (RPMOSTREE_TRANSACTION (self), text, percentage);
+}
+
+/* Signals the end of a progress bar, after any updates still pending. */
+void
+rpmostreed_transaction_emit_progress_end (RpmostreedTransaction *self)
+{
+  transaction_flush_progress (self);
+  rpmostree_transaction_emit_progress_end (RPMOSTREE_TRANSACTION (self));
+}
+
 static void
 transaction_progress_changed_cb (OstreeAsyncProgress *progress, RPMOSTreeTransaction *transaction)
 {
@@ -243,6 +325,7 @@ transaction_progress_changed_cb (OstreeAsyncProgress *progress, RPMOSTreeTransac
         {
           g_print ("%s\n", status);
         }
+      transaction_flush_progress (self);
       rpmostree_transaction_emit_message (transaction, g_strdup (status));
       return;
     }
@@ -279,18 +362,23 @@ transaction_progress_changed_cb (OstreeAsyncProgress *progress, RPMOSTreeTransac
   g_autoptr (GVariant) arg_transfer
       = g_variant_ref_sink (g_variant_new ("(tt)", bytes_transferred, bytes_sec));
 
+  g_autoptr (GVariant) download_progress = g_variant_ref_sink (
+      g_variant_new ("(@(tt)@(uu)@(uuu)@(uuut)@(uu)@(tt))", arg_time, arg_outstanding,
+                     arg_metadata, arg_delta, arg_content, arg_transfer));
   if (emit_journal)
     {
-      g_autoptr (GVariant) progress = g_variant_ref_sink (
-          g_variant_new ("(@(tt)@(uu)@(uuu)@(uuut)@(uu)@(tt))", arg_time, arg_outstanding,
-                         arg_metadata, arg_delta, arg_content, arg_transfer));
-      auto msg = rpmostreecxx::client_render_download_progress (*progress);
+      auto msg = rpmostreecxx::client_render_download_progress (*download_progress);
       g_print ("%s\n", msg.c_str ());
     }
 
-  /* This sinks the floating GVariant refs (I think...). */
-  rpmostree_transaction_emit_download_progress (transaction, arg_time, arg_outstanding,
-                                                arg_metadata, arg_delta, arg_content, arg_transfer);
+  if (progress_rate_limited (&priv->last_download_progress))
+    {
+      g_clear_pointer (&priv->pending_download_progress, g_variant_unref);
+      priv->pending_download_progress = util::move_nullify (download_progress);
+      return;
+    }
+  g_clear_pointer (&priv->pending_download_progress, g_variant_unref);
+  emit_download_progress (transaction, download_progress);
 }
 
 static void
@@ -317,7 +405,7 @@ static void
 transaction_output_cb (RpmOstreeOutputType type, void *data, void *opaque)
 {
   RpmostreedTransaction *self = RPMOSTREED_TRANSACTION (opaque);
-  gboolean output_to_self = FALSE;
+  RpmostreedTransactionPrivate *priv = rpmostreed_transaction_get_private (self);
 
   // The API previously passed these each time, but now we retain them as
   // statics.
@@ -325,8 +413,9 @@ transaction_output_cb (RpmOstreeOutputType type, void *data, void *opaque)
   static bool progress_state_percent;
   static guint progress_state_n_items;
 
-  g_object_get (self, "output-to-self", &output_to_self, NULL);
-  if (output_to_self)
+  /* This is construct-only, so no need to go through g_object_get() for
+   * every event */
+  if (priv->redirect_output)
     {
       rpmostree_output_default_handler (type, data, NULL);
       return;
@@ -337,11 +426,17 @@ transaction_output_cb (RpmOstreeOutputType type, void *data, void *opaque)
   switch (type)
     {
     case RPMOSTREE_OUTPUT_MESSAGE:
-      rpmostree_transaction_emit_message (transaction, ((RpmOstreeOutputMessage *)data)->text);
+      {
+        auto msg = static_cast<RpmOstreeOutputMessage *> (data);
+        g_autofree char *text = g_strndup (msg->text, msg->len);
+        transaction_flush_progress (self);
+        rpmostree_transaction_emit_message (transaction, text);
+      }
       break;
     case RPMOSTREE_OUTPUT_PROGRESS_BEGIN:
       {
         auto begin = static_cast<RpmOstreeOutputProgressBegin *> (data);
+        transaction_flush_progress (self);
         g_clear_pointer (&progress_str, g_free);
         progress_state_percent = false;
         progress_state_n_items = 0;
@@ -380,11 +475,11 @@ transaction_output_cb (RpmOstreeOutputType type, void *data, void *opaque)
                                  : (update_c_float / nitems_percentage);
             g_autofree char *newtext
                 = g_strdup_printf ("%s (%u/%u)", progress_str, update->c, progress_state_n_items);
-            rpmostree_transaction_emit_percent_progress (transaction, newtext, percentage);
+            emit_percent_progress (self, newtext, percentage);
           }
         else
           {
-            rpmostree_transaction_emit_percent_progress (transaction, progress_str, update->c);
+            emit_percent_progress (self, progress_str, update->c);
           }
       }
       break;
@@ -397,10 +492,11 @@ transaction_output_cb (RpmOstreeOutputType type, void *data, void *opaque)
       {
         if (progress_state_percent || progress_state_n_items > 0)
           {
-            rpmostree_transaction_emit_progress_end (transaction);
+            rpmostreed_transaction_emit_progress_end (self);
           }
         else
           {
+            transaction_flush_progress (self);
             rpmostree_transaction_emit_task_end (transaction, "done");
           }
       }
@@ -418,6 +514,7 @@ transaction_execute_thread (GTask *task, gpointer source_object, gpointer task_d
   gboolean success = TRUE;
   GError *local_error = NULL;
   g_autoptr (GMainContext) mctx = g_main_context_new ();
+  const gint64 start_time = g_get_monotonic_time ();
 
   /* libostree iterates and calls quit on main loop
    * so we need to run in our own context.  Having a different
@@ -444,6 +541,7 @@ transaction_execute_thread (GTask *task, gpointer source_object, gpointer task_d
     {
       // This try/catch shouldn't be needed; every CXX call should be wrapped with the CXX macro.
       // But in case we regress on this, it's better to error out than crash.
+      rpmostreecxx::TraceSpan span ("transaction", G_OBJECT_TYPE_NAME (self));
       try
         {
           success = clazz->execute (self, cancellable, &local_error);
@@ -455,6 +553,10 @@ transaction_execute_thread (GTask *task, gpointer source_object, gpointer task_d
         }
     }
 
+  rpmostree_metrics_observe_transaction (
+      g_dbus_method_invocation_get_method_name (priv->invocation),
+      g_get_monotonic_time () - start_time, local_error == NULL);
+
   if (local_error != NULL)
     {
       /* Also log to journal in addition to the client, so it's recorded
@@ -510,6 +612,7 @@ transaction_execute_done_cb (GObject *source_object, GAsyncResult *result, gpoin
   g_debug ("%s (%p): Finished%s%s%s", G_OBJECT_TYPE_NAME (self), self,
            success ? "" : " (error: ", success ? "" : error_message, success ? "" : ")");
 
+  transaction_flush_progress (self);
   rpmostree_transaction_emit_finished (RPMOSTREE_TRANSACTION (self), success, error_message);
 
   /* Stash the Finished signal parameters in case we need
@@ -521,6 +624,15 @@ transaction_execute_done_cb (GObject *source_object, GAsyncResult *result, gpoin
   unlock_sysroot (self);
   g_object_notify (G_OBJECT (self), "executed");
 
+  const char *metrics_textfile = rpmostreed_get_metrics_textfile (rpmostreed_daemon_get ());
+  if (metrics_textfile && *metrics_textfile)
+    {
+      g_autoptr (GError) metrics_error = NULL;
+      if (!rpmostree_metrics_write_textfile (metrics_textfile, &metrics_error))
+        sd_journal_print (LOG_WARNING, "Failed to write %s: %s", metrics_textfile,
+                          metrics_error->message);
+    }
+
   transaction_maybe_emit_closed (self);
 }
 
@@ -593,6 +705,8 @@ transaction_dispose (GObject *object)
   g_clear_pointer (&priv->sysroot_path, g_free);
 
   g_clear_pointer (&priv->finished_params, (GDestroyNotify)g_variant_unref);
+  g_clear_pointer (&priv->pending_download_progress, g_variant_unref);
+  g_clear_pointer (&priv->pending_percent_text, g_free);
 
   G_OBJECT_CLASS (rpmostreed_transaction_parent_class)->dispose (object);
 }
@@ -734,6 +848,9 @@ transaction_initable_init (GInitable *initable, GCancellable *cancellable, GErro
 
       CXX_TRY (rpmostreecxx::failpoint ("transaction::lock"), error);
 
+      /* A deferred cleanup may be holding the lock */
+      rpmostreed_daemon_finish_deferred_cleanup (rpmostreed_daemon_get ());
+
       if (!ostree_sysroot_try_lock (priv->sysroot, &lock_acquired, error))
         return FALSE;
 
@@ -62,6 +62,7 @@ void rpmostreed_transaction_connect_download_progress (RpmostreedTransaction *tr
                                                        OstreeAsyncProgress *progress);
 void rpmostreed_transaction_connect_signature_progress (RpmostreedTransaction *transaction,
                                                         OstreeRepo *repo);
+void rpmostreed_transaction_emit_progress_end (RpmostreedTransaction *transaction);
 void rpmostreed_transaction_force_close (RpmostreedTransaction *transaction);
 
 G_END_DECLS
@@ -233,10 +233,107 @@ rpmostreed_repo_pull_ancestry (OstreeRepo *repo, const char *refspec,
   return TRUE;
 }
 
+/* Walking the history of long-lived refs means pulling many commits, so the
+ * commits seen on a walk are recorded in a per-refspec index of checksum to
+ * version ("" if none), which later lookups check first. Commits never
+ * change, so entries don't go stale, short of the ref being rewritten to no
+ * longer include them. */
+static char *
+version_index_path (const char *refspec)
+{
+  g_autofree char *name = g_compute_checksum_for_string (G_CHECKSUM_SHA256, refspec, -1);
+  return g_strconcat (RPMOSTREED_VERSION_INDEX_DIR "/", name, NULL);
+}
+
+/* Returns the index for @refspec; errors just mean an empty one */
+static GHashTable *
+version_index_load (OstreeRepo *repo, const char *refspec)
+{
+  GHashTable *index = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  g_autofree char *path = version_index_path (refspec);
+  glnx_autofd int fd = -1;
+  g_autoptr (GError) local_error = NULL;
+  if (!glnx_openat_rdonly (ostree_repo_get_dfd (repo), path, TRUE, &fd, &local_error))
+    {
+      if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        g_debug ("Ignoring version index for %s: %s", refspec, local_error->message);
+      return index;
+    }
+  g_autoptr (GBytes) data = glnx_fd_readall_bytes (fd, NULL, &local_error);
+  if (!data)
+    {
+      g_debug ("Ignoring version index for %s: %s", refspec, local_error->message);
+      return index;
+    }
+  g_autoptr (GVariant) v
+      = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE ("a{ss}"), data, FALSE));
+  if (!g_variant_is_normal_form (v))
+    {
+      g_debug ("Ignoring corrupted version index for %s", refspec);
+      return index;
+    }
+  GVariantIter iter;
+  const char *checksum, *version;
+  g_variant_iter_init (&iter, v);
+  while (g_variant_iter_next (&iter, "{&s&s}", &checksum, &version))
+    g_hash_table_insert (index, g_strdup (checksum), g_strdup (version));
+  return index;
+}
+
+static void
+version_index_store (OstreeRepo *repo, const char *refspec, GHashTable *index)
+{
+  g_auto (GVariantBuilder) builder;
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{ss}"));
+  GLNX_HASH_TABLE_FOREACH_KV (index, const char *, checksum, const char *, version)
+    g_variant_builder_add (&builder, "{ss}", checksum, version);
+  g_autoptr (GVariant) v = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  int repo_dfd = ostree_repo_get_dfd (repo);
+  g_autofree char *path = version_index_path (refspec);
+  g_autoptr (GError) local_error = NULL;
+  if (!glnx_shutil_mkdir_p_at (repo_dfd, RPMOSTREED_VERSION_INDEX_DIR, 0755, NULL, &local_error)
+      || !glnx_file_replace_contents_at (repo_dfd, path, (const guint8 *)g_variant_get_data (v),
+                                         g_variant_get_size (v), GLNX_FILE_REPLACE_NODATASYNC,
+                                         NULL, &local_error))
+    g_debug ("Not storing version index for %s: %s", refspec, local_error->message);
+}
+
+/* Returns the commit with @version in @index, or NULL if there's none, or
+ * more than one, in which case only walking the history tells which one is
+ * the most recent. */
+static const char *
+version_index_lookup (GHashTable *index, const char *version)
+{
+  const char *ret = NULL;
+  GLNX_HASH_TABLE_FOREACH_KV (index, const char *, checksum, const char *, commit_version)
+    {
+      if (!g_str_equal (commit_version, version))
+        continue;
+      if (ret != NULL)
+        return NULL;
+      ret = checksum;
+    }
+  return ret;
+}
+
+static void
+version_index_record (GHashTable *index, const char *checksum, GVariant *commit)
+{
+  if (!index || g_hash_table_contains (index, checksum))
+    return;
+  g_autoptr (GVariant) metadict = g_variant_get_child_value (commit, 0);
+  const char *version = NULL;
+  if (!g_variant_lookup (metadict, "version", "&s", &version))
+    version = "";
+  g_hash_table_insert (index, g_strdup (checksum), g_strdup (version));
+}
+
 typedef struct
 {
   const char *version;
   char *checksum;
+  GHashTable *index; /* allow-none */
 } VersionVisitorClosure;
 
 static gboolean
@@ -247,6 +344,8 @@ version_visitor (OstreeRepo *repo, const char *checksum, GVariant *commit, gpoin
   g_autoptr (GVariant) metadict = NULL;
   const char *version = NULL;
 
+  version_index_record (closure->index, checksum, commit);
+
   metadict = g_variant_get_child_value (commit, 0);
   if (g_variant_lookup (metadict, "version", "&s", &version))
     {
@@ -271,7 +370,8 @@ version_visitor (OstreeRepo *repo, const char *checksum, GVariant *commit, gpoin
  * @error: Error
  *
  * Tries to determine the commit checksum for @version on @refspec.
- * This may require pulling commit objects from a remote repository.
+ * This may require pulling commit objects from a remote repository,
+ * unless a previous lookup already came across it.
  *
  * Returns: %TRUE on success, %FALSE on failure
  */
@@ -280,15 +380,28 @@ rpmostreed_repo_lookup_version (OstreeRepo *repo, const char *refspec, const cha
                                 OstreeAsyncProgress *progress, GCancellable *cancellable,
                                 char **out_checksum, GError **error)
 {
-  VersionVisitorClosure closure = { version, NULL };
-
   g_assert (OSTREE_IS_REPO (repo));
   g_assert (refspec != NULL);
   g_assert (version != NULL);
 
+  g_autoptr (GHashTable) index = version_index_load (repo, refspec);
+  const char *indexed = version_index_lookup (index, version);
+  if (indexed != NULL)
+    {
+      sd_journal_print (LOG_INFO, "Found version %s of %s in index: %s", version, refspec,
+                        indexed);
+      if (out_checksum != NULL)
+        *out_checksum = g_strdup (indexed);
+      return TRUE;
+    }
+
+  VersionVisitorClosure closure = { version, NULL, index };
+  const guint n_indexed = g_hash_table_size (index);
   if (!rpmostreed_repo_pull_ancestry (repo, refspec, version_visitor, &closure, progress,
                                       cancellable, error))
     return FALSE;
+  if (g_hash_table_size (index) != n_indexed)
+    version_index_store (repo, refspec, index);
 
   g_autofree char *checksum = util::move_nullify (closure.checksum);
   if (checksum == NULL)
@@ -307,6 +420,7 @@ typedef struct
 {
   const char *wanted_checksum;
   gboolean found;
+  GHashTable *index;
 } ChecksumVisitorClosure;
 
 static gboolean
@@ -314,6 +428,7 @@ checksum_visitor (OstreeRepo *repo, const char *checksum, GVariant *commit, gpoi
                   gboolean *out_stop, GError **error)
 {
   auto closure = static_cast<ChecksumVisitorClosure *> (user_data);
+  version_index_record (closure->index, checksum, commit);
   *out_stop = closure->found = g_str_equal (checksum, closure->wanted_checksum);
   return TRUE;
 }
@@ -338,15 +453,21 @@ rpmostreed_repo_lookup_checksum (OstreeRepo *repo, const char *refspec, const ch
                                  OstreeAsyncProgress *progress, GCancellable *cancellable,
                                  GError **error)
 {
-  ChecksumVisitorClosure closure = { checksum, FALSE };
-
   g_assert (OSTREE_IS_REPO (repo));
   g_assert (refspec != NULL);
   g_assert (checksum != NULL);
 
+  g_autoptr (GHashTable) index = version_index_load (repo, refspec);
+  if (g_hash_table_contains (index, checksum))
+    return TRUE; /* Note early return */
+
+  ChecksumVisitorClosure closure = { checksum, FALSE, index };
+  const guint n_indexed = g_hash_table_size (index);
   if (!rpmostreed_repo_pull_ancestry (repo, refspec, checksum_visitor, &closure, progress,
                                       cancellable, error))
     return FALSE;
+  if (g_hash_table_size (index) != n_indexed)
+    version_index_store (repo, refspec, index);
 
   if (!closure.found)
     {
@@ -378,7 +499,7 @@ rpmostreed_repo_lookup_cached_version (OstreeRepo *repo, const char *refspec, co
                                        GCancellable *cancellable, char **out_checksum,
                                        GError **error)
 {
-  VersionVisitorClosure closure = { version, NULL };
+  VersionVisitorClosure closure = { version, NULL, NULL };
   g_autofree char *checksum = NULL;
 
   g_assert (OSTREE_IS_REPO (repo));
@@ -32,6 +32,10 @@ gboolean rpmostreed_refspec_parse_partial (const gchar *new_provided_refspec,
  *     be integrated into libostree, but it's still a bit premature to do
  *     so now.  Version integration in ostree needs more design work. */
 
+/* Per-refspec indexes of the commits seen by the lookups below, see
+ * rpmostreed_repo_lookup_version() */
+#define RPMOSTREED_VERSION_INDEX_DIR "extensions/rpmostree/version-index"
+
 typedef gboolean (*RpmostreedCommitVisitor) (OstreeRepo *repo, const char *checksum,
                                              GVariant *commit, gpointer user_data,
                                              gboolean *out_stop, GError **error);
@@ -54,6 +54,33 @@ rpm_ostree_db_query_all (OstreeRepo *repo, const char *ref, GCancellable *cancel
   return g_steal_pointer (&pkglist);
 }
 
+/**
+ * rpm_ostree_db_query_package_list:
+ * @repo: An OSTree repository
+ * @ref: A branch name or commit
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Like rpm_ostree_db_query_all(), but rather than creating an object for each
+ * package, returns a view over the package list as stored in the commit.
+ * This is much cheaper for callers which look at all the packages, or only
+ * a few of them.
+ *
+ * Returns: (transfer full): A package list, or %NULL on error
+ *
+ * Since: 2024.1
+ */
+RpmOstreePackageList *
+rpm_ostree_db_query_package_list (OstreeRepo *repo, const char *ref, GCancellable *cancellable,
+                                  GError **error)
+{
+  g_autoptr (GVariant) pkglist_v = NULL;
+  if (!_rpm_ostree_package_variant_list_for_commit (repo, ref, FALSE, &pkglist_v, cancellable,
+                                                    error))
+    return NULL;
+  return _rpm_ostree_package_list_new (pkglist_v);
+}
+
 /**
  * rpm_ostree_db_diff:
  * @repo: An OSTree repository
@@ -118,19 +145,21 @@ rpm_ostree_db_diff_ext (OstreeRepo *repo, const char *orig_ref, const char *new_
 
   const gboolean allow_noent = ((flags & RPM_OSTREE_DB_DIFF_EXT_ALLOW_NOENT) > 0);
 
-  g_autoptr (GPtrArray) orig_pkglist = NULL;
-  if (!_rpm_ostree_package_list_for_commit (repo, orig_ref, allow_noent, &orig_pkglist, cancellable,
-                                            error))
+  /* Work directly on the serialized lists; this only creates package objects
+   * for the packages which differ. */
+  g_autoptr (GVariant) orig_pkglist = NULL;
+  if (!_rpm_ostree_package_variant_list_for_commit (repo, orig_ref, allow_noent, &orig_pkglist,
+                                                    cancellable, error))
     {
       g_prefix_error (error, "Failed to load package list: ");
       return FALSE;
     }
 
-  g_autoptr (GPtrArray) new_pkglist = NULL;
+  g_autoptr (GVariant) new_pkglist = NULL;
   if (orig_pkglist)
     {
-      if (!_rpm_ostree_package_list_for_commit (repo, new_ref, allow_noent, &new_pkglist,
-                                                cancellable, error))
+      if (!_rpm_ostree_package_variant_list_for_commit (repo, new_ref, allow_noent, &new_pkglist,
+                                                        cancellable, error))
         {
           g_prefix_error (error, "Failed to load package list: ");
           return FALSE;
@@ -152,6 +181,9 @@ rpm_ostree_db_diff_ext (OstreeRepo *repo, const char *orig_ref, const char *new_
       return TRUE;
     }
 
-  return _rpm_ostree_diff_package_lists (orig_pkglist, new_pkglist, out_removed, out_added,
-                                         out_modified_old, out_modified_new, NULL);
+  g_autoptr (RpmOstreePackageList) orig_list = _rpm_ostree_package_list_new (orig_pkglist);
+  g_autoptr (RpmOstreePackageList) new_list = _rpm_ostree_package_list_new (new_pkglist);
+  _rpm_ostree_package_list_diff (orig_list, new_list, out_removed, out_added, out_modified_old,
+                                 out_modified_new);
+  return TRUE;
 }
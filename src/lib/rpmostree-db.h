@@ -28,6 +28,10 @@ G_BEGIN_DECLS
 _RPMOSTREE_EXTERN GPtrArray *rpm_ostree_db_query_all (OstreeRepo *repo, const char *ref,
                                                       GCancellable *cancellable, GError **error);
 
+_RPMOSTREE_EXTERN RpmOstreePackageList *
+rpm_ostree_db_query_package_list (OstreeRepo *repo, const char *ref, GCancellable *cancellable,
+                                  GError **error);
+
 _RPMOSTREE_EXTERN gboolean rpm_ostree_db_diff (OstreeRepo *repo, const char *orig_ref,
                                                const char *new_ref, GPtrArray **out_removed,
                                                GPtrArray **out_added, GPtrArray **out_modified_old,
@@ -29,12 +29,38 @@
 
 G_BEGIN_DECLS
 
+/* Where package lists of commits without rpmostree.rpmdb.pkglist are cached,
+ * relative to the repo */
+#define RPMOSTREE_PKGLIST_CACHE_DIR "extensions/rpmostree/pkglist-cache"
+
 RpmOstreePackage *_rpm_ostree_package_new_from_variant (GVariant *gv_nevra);
 
+RpmOstreePackageList *_rpm_ostree_package_list_new (GVariant *pkglist);
+
+RpmOstreePackageList *_rpm_ostree_package_list_new_unindexed (GVariant *pkglist);
+
+void _rpm_ostree_package_list_diff (RpmOstreePackageList *a, RpmOstreePackageList *b,
+                                    GPtrArray **out_unique_a, GPtrArray **out_unique_b,
+                                    GPtrArray **out_modified_a, GPtrArray **out_modified_b);
+
+typedef gboolean (*RpmOstreePackageListDiffFunc) (gint i_a, gint i_b, gpointer user_data);
+
+void _rpm_ostree_package_list_diff_foreach (RpmOstreePackageList *a, RpmOstreePackageList *b,
+                                            RpmOstreePackageListDiffFunc func,
+                                            gpointer user_data);
+
+int _rpm_ostree_package_list_cmp_at (RpmOstreePackageList *a, guint i_a, RpmOstreePackageList *b,
+                                     guint i_b);
+
+void _rpm_ostree_package_list_append_nevra (RpmOstreePackageList *list, guint i, GString *buf);
+
 gboolean _rpm_ostree_package_variant_list_for_commit (OstreeRepo *repo, const char *rev,
                                                       gboolean allow_noent, GVariant **out_pkglist,
                                                       GCancellable *cancellable, GError **error);
 
+gboolean _rpm_ostree_package_list_prefetch (OstreeRepo *repo, const char *const *revs,
+                                            GCancellable *cancellable, GError **error);
+
 gboolean _rpm_ostree_package_list_for_commit (OstreeRepo *repo, const char *rev,
                                               gboolean allow_noent, GPtrArray **out_pkglist,
                                               GCancellable *cancellable, GError **error);
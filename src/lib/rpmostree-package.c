@@ -207,6 +207,487 @@ _rpm_ostree_package_new_from_variant (GVariant *gv_nevra)
   return p;
 }
 
+/* The fields of each entry in a pkglist, in order */
+enum
+{
+  PKGLIST_NAME,
+  PKGLIST_EPOCH,
+  PKGLIST_VERSION,
+  PKGLIST_RELEASE,
+  PKGLIST_ARCH,
+  PKGLIST_N_FIELDS
+};
+
+struct RpmOstreePackageList
+{
+  gint refcount; /* atomic */
+  GVariant *pkglist;
+  guint n;
+  /* PKGLIST_N_FIELDS strings per package, borrowed from @pkglist; NULL if
+   * the entries are read from @pkglist as needed, see
+   * _rpm_ostree_package_list_new_unindexed(). */
+  const char **fields;
+};
+
+G_DEFINE_BOXED_TYPE (RpmOstreePackageList, rpm_ostree_package_list, rpm_ostree_package_list_ref,
+                     rpm_ostree_package_list_unref)
+
+static gint
+compare_pkglist_entries (gconstpointer a, gconstpointer b, gpointer user_data)
+{
+  const char *const *ea = a;
+  const char *const *eb = b;
+  return strcmp (ea[PKGLIST_NAME], eb[PKGLIST_NAME]);
+}
+
+/* Takes a ref on @pkglist, which must be of type a(sssss). It's normally
+ * already sorted, in which case this just records where the strings are. */
+RpmOstreePackageList *
+_rpm_ostree_package_list_new (GVariant *pkglist)
+{
+  RpmOstreePackageList *list = g_new0 (RpmOstreePackageList, 1);
+  list->refcount = 1;
+  list->pkglist = g_variant_ref (pkglist);
+  list->n = g_variant_n_children (pkglist);
+  list->fields = g_new (const char *, (gsize)list->n * PKGLIST_N_FIELDS);
+
+  gboolean sorted = TRUE;
+  GVariantIter iter;
+  g_variant_iter_init (&iter, pkglist);
+  for (guint i = 0; i < list->n; i++)
+    {
+      const char **entry = &list->fields[i * PKGLIST_N_FIELDS];
+      g_variant_iter_next (&iter, "(&s&s&s&s&s)", &entry[PKGLIST_NAME], &entry[PKGLIST_EPOCH],
+                           &entry[PKGLIST_VERSION], &entry[PKGLIST_RELEASE],
+                           &entry[PKGLIST_ARCH]);
+      const char **prev = entry - PKGLIST_N_FIELDS;
+      if (i > 0 && sorted && strcmp (entry[PKGLIST_NAME], prev[PKGLIST_NAME]) < 0)
+        sorted = FALSE;
+    }
+  if (!sorted)
+    g_qsort_with_data (list->fields, list->n, sizeof (const char *) * PKGLIST_N_FIELDS,
+                       compare_pkglist_entries, NULL);
+
+  return list;
+}
+
+/* Like _rpm_ostree_package_list_new(), but if @pkglist is already sorted,
+ * doesn't record where the strings are: each access reads the entry out of
+ * @pkglist instead, so walking even a huge list takes no memory beyond the
+ * variant itself. Lookups are a bit slower; meant for walking the list once.
+ * An unsorted @pkglist gets indexed as usual. */
+RpmOstreePackageList *
+_rpm_ostree_package_list_new_unindexed (GVariant *pkglist)
+{
+  const char *prev_name = NULL;
+  const char *name;
+  GVariantIter iter;
+  g_variant_iter_init (&iter, pkglist);
+  while (g_variant_iter_next (&iter, "(&s&s&s&s&s)", &name, NULL, NULL, NULL, NULL))
+    {
+      if (prev_name && strcmp (name, prev_name) < 0)
+        return _rpm_ostree_package_list_new (pkglist);
+      prev_name = name;
+    }
+
+  RpmOstreePackageList *list = g_new0 (RpmOstreePackageList, 1);
+  list->refcount = 1;
+  list->pkglist = g_variant_ref (pkglist);
+  list->n = g_variant_n_children (pkglist);
+  return list;
+}
+
+/* Sets @entry to the PKGLIST_N_FIELDS strings of package @i of @list, which
+ * stay valid as long as @list does. */
+static void
+package_list_get_entry (RpmOstreePackageList *list, guint i, const char **entry)
+{
+  if (list->fields)
+    {
+      memcpy (entry, &list->fields[i * PKGLIST_N_FIELDS], sizeof (const char *) * PKGLIST_N_FIELDS);
+      return;
+    }
+
+  /* The strings point into the data of @pkglist, not of the child */
+  g_variant_get_child (list->pkglist, i, "(&s&s&s&s&s)", &entry[PKGLIST_NAME],
+                       &entry[PKGLIST_EPOCH], &entry[PKGLIST_VERSION], &entry[PKGLIST_RELEASE],
+                       &entry[PKGLIST_ARCH]);
+}
+
+/**
+ * rpm_ostree_package_list_ref:
+ * @list: Package list
+ *
+ * Returns: (transfer full): @list
+ *
+ * Since: 2024.1
+ */
+RpmOstreePackageList *
+rpm_ostree_package_list_ref (RpmOstreePackageList *list)
+{
+  g_atomic_int_inc (&list->refcount);
+  return list;
+}
+
+/**
+ * rpm_ostree_package_list_unref:
+ * @list: Package list
+ *
+ * Since: 2024.1
+ */
+void
+rpm_ostree_package_list_unref (RpmOstreePackageList *list)
+{
+  if (!g_atomic_int_dec_and_test (&list->refcount))
+    return;
+  g_variant_unref (list->pkglist);
+  g_free (list->fields);
+  g_free (list);
+}
+
+/**
+ * rpm_ostree_package_list_get_length:
+ * @list: Package list
+ *
+ * Returns: The number of packages in @list
+ *
+ * Since: 2024.1
+ */
+guint
+rpm_ostree_package_list_get_length (RpmOstreePackageList *list)
+{
+  return list->n;
+}
+
+static const char *
+package_list_get_field (RpmOstreePackageList *list, guint i, guint field)
+{
+  g_return_val_if_fail (i < list->n, NULL);
+  if (list->fields)
+    return list->fields[i * PKGLIST_N_FIELDS + field];
+  const char *entry[PKGLIST_N_FIELDS];
+  package_list_get_entry (list, i, entry);
+  return entry[field];
+}
+
+/**
+ * rpm_ostree_package_list_get_name:
+ * @list: Package list
+ * @i: Index of a package
+ *
+ * Returns: (transfer none): The name of package @i
+ *
+ * Since: 2024.1
+ */
+const char *
+rpm_ostree_package_list_get_name (RpmOstreePackageList *list, guint i)
+{
+  return package_list_get_field (list, i, PKGLIST_NAME);
+}
+
+/**
+ * rpm_ostree_package_list_get_epoch:
+ * @list: Package list
+ * @i: Index of a package
+ *
+ * Returns: (transfer none): The epoch of package @i; "0" if it has none
+ *
+ * Since: 2024.1
+ */
+const char *
+rpm_ostree_package_list_get_epoch (RpmOstreePackageList *list, guint i)
+{
+  return package_list_get_field (list, i, PKGLIST_EPOCH);
+}
+
+/**
+ * rpm_ostree_package_list_get_version:
+ * @list: Package list
+ * @i: Index of a package
+ *
+ * Returns: (transfer none): The version of package @i
+ *
+ * Since: 2024.1
+ */
+const char *
+rpm_ostree_package_list_get_version (RpmOstreePackageList *list, guint i)
+{
+  return package_list_get_field (list, i, PKGLIST_VERSION);
+}
+
+/**
+ * rpm_ostree_package_list_get_release:
+ * @list: Package list
+ * @i: Index of a package
+ *
+ * Returns: (transfer none): The release of package @i
+ *
+ * Since: 2024.1
+ */
+const char *
+rpm_ostree_package_list_get_release (RpmOstreePackageList *list, guint i)
+{
+  return package_list_get_field (list, i, PKGLIST_RELEASE);
+}
+
+/**
+ * rpm_ostree_package_list_get_arch:
+ * @list: Package list
+ * @i: Index of a package
+ *
+ * Returns: (transfer none): The architecture of package @i
+ *
+ * Since: 2024.1
+ */
+const char *
+rpm_ostree_package_list_get_arch (RpmOstreePackageList *list, guint i)
+{
+  return package_list_get_field (list, i, PKGLIST_ARCH);
+}
+
+/**
+ * rpm_ostree_package_list_find:
+ * @list: Package list
+ * @name: A package name
+ *
+ * Look up a package by name. If there are several (e.g. multilib), they
+ * follow each other, and the index of the first is returned.
+ *
+ * Returns: The index of the first package named @name, or -1 if none
+ *
+ * Since: 2024.1
+ */
+gint
+rpm_ostree_package_list_find (RpmOstreePackageList *list, const char *name)
+{
+  guint lo = 0;
+  guint hi = list->n;
+  while (lo < hi)
+    {
+      const guint mid = lo + (hi - lo) / 2;
+      if (strcmp (package_list_get_field (list, mid, PKGLIST_NAME), name) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  if (lo < list->n && g_str_equal (package_list_get_field (list, lo, PKGLIST_NAME), name))
+    return lo;
+  return -1;
+}
+
+/**
+ * rpm_ostree_package_list_get_package:
+ * @list: Package list
+ * @i: Index of a package
+ *
+ * Returns: (transfer full): A new package object for package @i
+ *
+ * Since: 2024.1
+ */
+RpmOstreePackage *
+rpm_ostree_package_list_get_package (RpmOstreePackageList *list, guint i)
+{
+  g_return_val_if_fail (i < list->n, NULL);
+  const char *entry[PKGLIST_N_FIELDS];
+  package_list_get_entry (list, i, entry);
+  g_autoptr (GVariant) gv_nevra
+      = g_variant_ref_sink (g_variant_new ("(sssss)", entry[PKGLIST_NAME], entry[PKGLIST_EPOCH],
+                                           entry[PKGLIST_VERSION], entry[PKGLIST_RELEASE],
+                                           entry[PKGLIST_ARCH]));
+  return _rpm_ostree_package_new_from_variant (gv_nevra);
+}
+
+/* Like evr_cmp(), but on the separate fields of two entries, without
+ * formatting and parsing the EVRs. */
+static int
+package_list_evr_cmp (const char *const *a, const char *const *b)
+{
+  if (g_str_equal (a[PKGLIST_VERSION], b[PKGLIST_VERSION])
+      && g_str_equal (a[PKGLIST_RELEASE], b[PKGLIST_RELEASE])
+      && g_str_equal (a[PKGLIST_EPOCH], b[PKGLIST_EPOCH]))
+    return 0;
+
+  const guint64 epoch_a = g_ascii_strtoull (a[PKGLIST_EPOCH], NULL, 10);
+  const guint64 epoch_b = g_ascii_strtoull (b[PKGLIST_EPOCH], NULL, 10);
+  if (epoch_a != epoch_b)
+    return epoch_a < epoch_b ? -1 : 1;
+  int rc = rpmvercmp (a[PKGLIST_VERSION], b[PKGLIST_VERSION]);
+  if (rc != 0)
+    return rc;
+  return rpmvercmp (a[PKGLIST_RELEASE], b[PKGLIST_RELEASE]);
+}
+
+static inline gboolean
+package_list_next_has_different_name (RpmOstreePackageList *list, guint cur_i, const char *name)
+{
+  if (cur_i + 1 >= list->n)
+    return TRUE;
+  return !g_str_equal (name, package_list_get_field (list, cur_i + 1, PKGLIST_NAME));
+}
+
+/* Walks two package list views like _rpm_ostree_diff_package_lists(), and
+ * calls @func for each difference, in name order, with the indices of the
+ * packages; @i_a is -1 for packages only in @b, and vice versa. The walk
+ * stops early if @func returns %FALSE. */
+void
+_rpm_ostree_package_list_diff_foreach (RpmOstreePackageList *a, RpmOstreePackageList *b,
+                                       RpmOstreePackageListDiffFunc func, gpointer user_data)
+{
+  guint cur_a = 0;
+  guint cur_b = 0;
+  while (cur_a < a->n && cur_b < b->n)
+    {
+      const char *entry_a[PKGLIST_N_FIELDS];
+      const char *entry_b[PKGLIST_N_FIELDS];
+      package_list_get_entry (a, cur_a, entry_a);
+      package_list_get_entry (b, cur_b, entry_b);
+
+      int cmp = strcmp (entry_a[PKGLIST_NAME], entry_b[PKGLIST_NAME]);
+      if (cmp < 0)
+        {
+          if (!func (cur_a, -1, user_data))
+            return;
+          cur_a++;
+          continue;
+        }
+      else if (cmp > 0)
+        {
+          if (!func (-1, cur_b, user_data))
+            return;
+          cur_b++;
+          continue;
+        }
+
+      cmp = strcmp (entry_a[PKGLIST_ARCH], entry_b[PKGLIST_ARCH]);
+      const gboolean same_arch = cmp == 0;
+      /* see the comment in _rpm_ostree_diff_package_lists() about arch changes */
+      if ((same_arch && package_list_evr_cmp (entry_a, entry_b) != 0)
+          || (!same_arch && package_list_next_has_different_name (a, cur_a, entry_a[PKGLIST_NAME])
+              && package_list_next_has_different_name (b, cur_b, entry_b[PKGLIST_NAME])))
+        {
+          if (!func (cur_a, cur_b, user_data))
+            return;
+          cur_a++;
+          cur_b++;
+        }
+      else if (same_arch)
+        {
+          cur_a++;
+          cur_b++;
+        }
+      else if (cmp < 0)
+        {
+          if (!func (cur_a, -1, user_data))
+            return;
+          cur_a++;
+        }
+      else
+        {
+          if (!func (-1, cur_b, user_data))
+            return;
+          cur_b++;
+        }
+    }
+
+  for (; cur_a < a->n; cur_a++)
+    if (!func (cur_a, -1, user_data))
+      return;
+  for (; cur_b < b->n; cur_b++)
+    if (!func (-1, cur_b, user_data))
+      return;
+}
+
+/* Like rpm_ostree_package_cmp(), for two entries of the same name */
+int
+_rpm_ostree_package_list_cmp_at (RpmOstreePackageList *a, guint i_a, RpmOstreePackageList *b,
+                                 guint i_b)
+{
+  const char *entry_a[PKGLIST_N_FIELDS];
+  const char *entry_b[PKGLIST_N_FIELDS];
+  package_list_get_entry (a, i_a, entry_a);
+  package_list_get_entry (b, i_b, entry_b);
+  int ret = package_list_evr_cmp (entry_a, entry_b);
+  if (ret)
+    return ret;
+  return strcmp (entry_a[PKGLIST_ARCH], entry_b[PKGLIST_ARCH]);
+}
+
+/* Appends the NEVRA of package @i of @list to @buf, formatted as by
+ * rpm_ostree_package_get_nevra(), without creating a package object. */
+void
+_rpm_ostree_package_list_append_nevra (RpmOstreePackageList *list, guint i, GString *buf)
+{
+  const char *entry[PKGLIST_N_FIELDS];
+  package_list_get_entry (list, i, entry);
+  g_string_append (buf, entry[PKGLIST_NAME]);
+  g_string_append_c (buf, '-');
+  /* we follow the libdnf convention here of explicit 0 --> skip over */
+  if (!g_str_equal (entry[PKGLIST_EPOCH], "0"))
+    {
+      g_string_append (buf, entry[PKGLIST_EPOCH]);
+      g_string_append_c (buf, ':');
+    }
+  g_string_append (buf, entry[PKGLIST_VERSION]);
+  g_string_append_c (buf, '-');
+  g_string_append (buf, entry[PKGLIST_RELEASE]);
+  g_string_append_c (buf, '.');
+  g_string_append (buf, entry[PKGLIST_ARCH]);
+}
+
+typedef struct
+{
+  RpmOstreePackageList *a;
+  RpmOstreePackageList *b;
+  GPtrArray *unique_a;
+  GPtrArray *unique_b;
+  GPtrArray *modified_a;
+  GPtrArray *modified_b;
+} PackageListDiffData;
+
+static gboolean
+package_list_diff_add (gint i_a, gint i_b, gpointer user_data)
+{
+  PackageListDiffData *data = user_data;
+  if (i_a >= 0 && i_b >= 0)
+    {
+      g_ptr_array_add (data->modified_a, rpm_ostree_package_list_get_package (data->a, i_a));
+      g_ptr_array_add (data->modified_b, rpm_ostree_package_list_get_package (data->b, i_b));
+    }
+  else if (i_a >= 0)
+    g_ptr_array_add (data->unique_a, rpm_ostree_package_list_get_package (data->a, i_a));
+  else
+    g_ptr_array_add (data->unique_b, rpm_ostree_package_list_get_package (data->b, i_b));
+  return TRUE;
+}
+
+/* Same as _rpm_ostree_diff_package_lists(), but working directly on two
+ * package list views; package objects are only created for the packages
+ * which differ. */
+void
+_rpm_ostree_package_list_diff (RpmOstreePackageList *a, RpmOstreePackageList *b,
+                               GPtrArray **out_unique_a, GPtrArray **out_unique_b,
+                               GPtrArray **out_modified_a, GPtrArray **out_modified_b)
+{
+  g_autoptr (GPtrArray) unique_a = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr (GPtrArray) unique_b = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr (GPtrArray) modified_a = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr (GPtrArray) modified_b = g_ptr_array_new_with_free_func (g_object_unref);
+
+  PackageListDiffData data = { a, b, unique_a, unique_b, modified_a, modified_b };
+  _rpm_ostree_package_list_diff_foreach (a, b, package_list_diff_add, &data);
+
+  g_assert_cmpuint (modified_a->len, ==, modified_b->len);
+
+  if (out_unique_a)
+    *out_unique_a = g_steal_pointer (&unique_a);
+  if (out_unique_b)
+    *out_unique_b = g_steal_pointer (&unique_b);
+  if (out_modified_a)
+    *out_modified_a = g_steal_pointer (&modified_a);
+  if (out_modified_b)
+    *out_modified_b = g_steal_pointer (&modified_b);
+}
+
 static GVariant *
 get_commit_rpmdb_pkglist (GVariant *commit)
 {
@@ -216,6 +697,72 @@ get_commit_rpmdb_pkglist (GVariant *commit)
                                       G_VARIANT_TYPE ("a(sssss)"));
 }
 
+/* Commits from before we started writing rpmostree.rpmdb.pkglist need a trip
+ * through the shlib backend to read their rpmdb, which is slow. Since commits
+ * are immutable, we remember the result in the repo, keyed by checksum. */
+static GVariant *
+load_cached_pkglist (OstreeRepo *repo, const char *checksum, GCancellable *cancellable)
+{
+  const char *cachepath = glnx_strjoina (RPMOSTREE_PKGLIST_CACHE_DIR "/", checksum);
+  g_autoptr (GError) local_error = NULL;
+  glnx_autofd int fd = -1;
+  if (!glnx_openat_rdonly (ostree_repo_get_dfd (repo), cachepath, TRUE, &fd, &local_error))
+    {
+      if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        g_debug ("Ignoring package list cache %s: %s", cachepath, local_error->message);
+      return NULL;
+    }
+
+  g_autoptr (GBytes) data = glnx_fd_readall_bytes (fd, cancellable, &local_error);
+  if (!data)
+    {
+      g_debug ("Ignoring package list cache %s: %s", cachepath, local_error->message);
+      return NULL;
+    }
+  g_autoptr (GVariant) pkglist = g_variant_ref_sink (
+      g_variant_new_from_bytes (G_VARIANT_TYPE (RPMOSTREE_SHLIB_IPC_PKGLIST), data, FALSE));
+  /* It's only a cache; if it's corrupted, we'll just regenerate it */
+  if (!g_variant_is_normal_form (pkglist))
+    {
+      g_debug ("Ignoring corrupted package list cache %s", cachepath);
+      return NULL;
+    }
+  return g_steal_pointer (&pkglist);
+}
+
+/* This is best-effort: we're often run as a user who can't write to the repo. */
+static void
+store_cached_pkglist (OstreeRepo *repo, const char *checksum, GVariant *pkglist,
+                      GCancellable *cancellable)
+{
+  int repo_dfd = ostree_repo_get_dfd (repo);
+  g_autoptr (GError) local_error = NULL;
+  if (!glnx_shutil_mkdir_p_at (repo_dfd, RPMOSTREE_PKGLIST_CACHE_DIR, 0755, cancellable,
+                               &local_error)
+      || !glnx_file_replace_contents_at (
+          repo_dfd, glnx_strjoina (RPMOSTREE_PKGLIST_CACHE_DIR "/", checksum),
+          g_variant_get_data (pkglist), g_variant_get_size (pkglist),
+          GLNX_FILE_REPLACE_NODATASYNC, cancellable, &local_error))
+    g_debug ("Not caching package list for %s: %s", checksum, local_error->message);
+}
+
+/* Sets @out_pkglist to the embedded or cached pkglist for commit @checksum,
+ * or to %NULL if it needs to go through the shlib backend. */
+static gboolean
+load_pkglist_without_ipc (OstreeRepo *repo, const char *checksum, GVariant **out_pkglist,
+                          GCancellable *cancellable, GError **error)
+{
+  g_autoptr (GVariant) commit = NULL;
+  if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_COMMIT, checksum, &commit, error))
+    return FALSE;
+
+  g_autoptr (GVariant) pkglist_v = get_commit_rpmdb_pkglist (commit);
+  if (!pkglist_v)
+    pkglist_v = load_cached_pkglist (repo, checksum, cancellable);
+  *out_pkglist = g_steal_pointer (&pkglist_v);
+  return TRUE;
+}
+
 gboolean
 _rpm_ostree_package_variant_list_for_commit (OstreeRepo *repo, const char *rev,
                                              gboolean allow_noent, GVariant **out_pkglist,
@@ -226,13 +773,11 @@ _rpm_ostree_package_variant_list_for_commit (OstreeRepo *repo, const char *rev,
   if (!ostree_repo_resolve_rev (repo, rev, FALSE, &checksum, error))
     return FALSE;
 
-  g_autoptr (GVariant) commit = NULL;
-  if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_COMMIT, checksum, &commit, error))
-    return FALSE;
-
   /* If there's no commit metadata, we fallback to checking out the rpmdb from the commit
    * using the IPC mechanism. */
-  g_autoptr (GVariant) pkglist_v = get_commit_rpmdb_pkglist (commit);
+  g_autoptr (GVariant) pkglist_v = NULL;
+  if (!load_pkglist_without_ipc (repo, checksum, &pkglist_v, cancellable, error))
+    return FALSE;
   if (!pkglist_v)
     {
       /* Yeah we could extend the IPC to support sending a fd too but for
@@ -240,22 +785,71 @@ _rpm_ostree_package_variant_list_for_commit (OstreeRepo *repo, const char *rev,
        */
       int fd = ostree_repo_get_dfd (repo);
       g_autofree char *fdpath = g_strdup_printf ("/proc/self/fd/%d", fd);
-      char *args[] = { "packagelist-from-commit", (char *)rev, NULL };
+      char *args[] = { "packagelist-from-commit", checksum, NULL };
       g_autoptr (GVariant) maybe_pkglist_v
           = _rpmostree_shlib_ipc_send ("m" RPMOSTREE_SHLIB_IPC_PKGLIST, args, fdpath, error);
       if (!maybe_pkglist_v)
         return FALSE;
       pkglist_v = g_variant_get_maybe (maybe_pkglist_v);
-      if (!pkglist_v)
-        {
-          if (!allow_noent)
-            return glnx_throw (error, "No package database found");
-        }
+      if (pkglist_v)
+        store_cached_pkglist (repo, checksum, pkglist_v, cancellable);
+      else if (!allow_noent)
+        return glnx_throw (error, "No package database found");
     }
   *out_pkglist = g_steal_pointer (&pkglist_v);
   return TRUE;
 }
 
+/* Make sure the package lists of all of @revs can be loaded without going
+ * through the shlib backend, by fetching those which need it with a single
+ * call and adding them to the cache. Useful before walking many old commits.
+ */
+gboolean
+_rpm_ostree_package_list_prefetch (OstreeRepo *repo, const char *const *revs,
+                                   GCancellable *cancellable, GError **error)
+{
+  GLNX_AUTO_PREFIX_ERROR ("Prefetching package lists", error);
+  g_autoptr (GPtrArray) args = g_ptr_array_new_with_free_func (g_free);
+  g_ptr_array_add (args, g_strdup ("packagelist-from-commits"));
+  for (const char *const *it = revs; it && *it; it++)
+    {
+      g_autofree char *checksum = NULL;
+      if (!ostree_repo_resolve_rev (repo, *it, FALSE, &checksum, error))
+        return FALSE;
+      if (g_ptr_array_find_with_equal_func (args, checksum, g_str_equal, NULL))
+        continue;
+      g_autoptr (GVariant) pkglist_v = NULL;
+      if (!load_pkglist_without_ipc (repo, checksum, &pkglist_v, cancellable, error))
+        return FALSE;
+      if (!pkglist_v)
+        g_ptr_array_add (args, g_steal_pointer (&checksum));
+    }
+  if (args->len == 1)
+    return TRUE;
+  const guint n_commits = args->len - 1;
+  g_ptr_array_add (args, NULL);
+
+  int fd = ostree_repo_get_dfd (repo);
+  g_autofree char *fdpath = g_strdup_printf ("/proc/self/fd/%d", fd);
+  g_autoptr (GVariant) pkglists_v = _rpmostree_shlib_ipc_send (
+      "am" RPMOSTREE_SHLIB_IPC_PKGLIST, (char **)args->pdata, fdpath, error);
+  if (!pkglists_v)
+    return FALSE;
+  if (g_variant_n_children (pkglists_v) != n_commits)
+    return glnx_throw (error, "Expected %u package lists, got %" G_GSIZE_FORMAT, n_commits,
+                       g_variant_n_children (pkglists_v));
+
+  for (guint i = 0; i < n_commits; i++)
+    {
+      g_autoptr (GVariant) maybe_pkglist_v = g_variant_get_child_value (pkglists_v, i);
+      g_autoptr (GVariant) pkglist_v = g_variant_get_maybe (maybe_pkglist_v);
+      /* Commits without an rpmdb will just fail as usual when loaded */
+      if (pkglist_v)
+        store_cached_pkglist (repo, args->pdata[i + 1], pkglist_v, cancellable);
+    }
+  return TRUE;
+}
+
 /* Opportunistically try to use the new rpmostree.rpmdb.pkglist metadata, otherwise fall
  * back to commit rpmdb if available.
  *
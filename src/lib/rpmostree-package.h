@@ -50,4 +50,51 @@ const char *rpm_ostree_package_get_arch (RpmOstreePackage *p);
 _RPMOSTREE_EXTERN
 int rpm_ostree_package_cmp (RpmOstreePackage *p1, RpmOstreePackage *p2);
 
+/**
+ * RpmOstreePackageList:
+ *
+ * A read-only view over the package list of a commit, for looking at many
+ * packages without creating an object for each. Packages are sorted by name.
+ *
+ * Since: 2024.1
+ */
+typedef struct RpmOstreePackageList RpmOstreePackageList;
+
+#define RPM_OSTREE_TYPE_PACKAGE_LIST (rpm_ostree_package_list_get_type ())
+
+_RPMOSTREE_EXTERN
+GType rpm_ostree_package_list_get_type (void);
+
+_RPMOSTREE_EXTERN
+RpmOstreePackageList *rpm_ostree_package_list_ref (RpmOstreePackageList *list);
+
+_RPMOSTREE_EXTERN
+void rpm_ostree_package_list_unref (RpmOstreePackageList *list);
+
+_RPMOSTREE_EXTERN
+guint rpm_ostree_package_list_get_length (RpmOstreePackageList *list);
+
+_RPMOSTREE_EXTERN
+const char *rpm_ostree_package_list_get_name (RpmOstreePackageList *list, guint i);
+
+_RPMOSTREE_EXTERN
+const char *rpm_ostree_package_list_get_epoch (RpmOstreePackageList *list, guint i);
+
+_RPMOSTREE_EXTERN
+const char *rpm_ostree_package_list_get_version (RpmOstreePackageList *list, guint i);
+
+_RPMOSTREE_EXTERN
+const char *rpm_ostree_package_list_get_release (RpmOstreePackageList *list, guint i);
+
+_RPMOSTREE_EXTERN
+const char *rpm_ostree_package_list_get_arch (RpmOstreePackageList *list, guint i);
+
+_RPMOSTREE_EXTERN
+gint rpm_ostree_package_list_find (RpmOstreePackageList *list, const char *name);
+
+_RPMOSTREE_EXTERN
+RpmOstreePackage *rpm_ostree_package_list_get_package (RpmOstreePackageList *list, guint i);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (RpmOstreePackageList, rpm_ostree_package_list_unref)
+
 G_END_DECLS
@@ -0,0 +1,505 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Licensed under the GNU Lesser General Public License Version 2.1
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "rpmostree-checkout-plan.h"
+#include "rpmostree-util.h"
+
+/* Bump this when the format changes; plans with another version are rebuilt */
+#define CHECKOUT_PLAN_VERSION 1
+
+/* (version, entries, xattr sets). Each entry is (path, mode, uid, gid, size,
+ * xattrs index, content checksum, symlink target). Directories point at the
+ * xattrs of their dirmeta and have an empty checksum; files have no xattrs
+ * index. Entries are in dirtree order, so a directory always comes right before
+ * everything under it. */
+#define CHECKOUT_PLAN_GVARIANT_FORMAT "(ua(suuutuays)aa(ayay))"
+#define NO_XATTRS G_MAXUINT32
+
+typedef struct
+{
+  OstreeRepo *repo;
+  GVariantBuilder entries;
+  GPtrArray *xattr_sets;        /* GVariant a(ayay) */
+  GHashTable *dirmeta_to_index; /* dirmeta checksum -> xattr set index + 1 */
+} PlanBuilder;
+
+static GVariant *
+new_empty_bytes (void)
+{
+  return g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE, NULL, 0, 1);
+}
+
+static gboolean
+plan_add_dir (PlanBuilder *builder, GString *path, const char *dirtree_csum,
+              const char *dirmeta_csum, GCancellable *cancellable, GError **error)
+{
+  if (!g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
+
+  g_autoptr (GVariant) dirmeta = NULL;
+  if (!ostree_repo_load_variant (builder->repo, OSTREE_OBJECT_TYPE_DIR_META, dirmeta_csum,
+                                 &dirmeta, error))
+    return FALSE;
+  guint32 uid, gid, mode;
+  g_autoptr (GVariant) xattrs = NULL;
+  g_variant_get (dirmeta, "(uuu@a(ayay))", &uid, &gid, &mode, &xattrs);
+
+  guint xattrs_index
+      = GPOINTER_TO_UINT (g_hash_table_lookup (builder->dirmeta_to_index, dirmeta_csum));
+  if (xattrs_index == 0)
+    {
+      g_ptr_array_add (builder->xattr_sets, util::move_nullify (xattrs));
+      xattrs_index = builder->xattr_sets->len;
+      g_hash_table_insert (builder->dirmeta_to_index, g_strdup (dirmeta_csum),
+                           GUINT_TO_POINTER (xattrs_index));
+    }
+  g_variant_builder_add (&builder->entries, "(suuutu@ays)", path->len > 0 ? path->str : "/",
+                         GUINT32_FROM_BE (mode), GUINT32_FROM_BE (uid), GUINT32_FROM_BE (gid),
+                         (guint64)0, xattrs_index - 1, new_empty_bytes (), "");
+
+  g_autoptr (GVariant) dirtree = NULL;
+  if (!ostree_repo_load_variant (builder->repo, OSTREE_OBJECT_TYPE_DIR_TREE, dirtree_csum,
+                                 &dirtree, error))
+    return FALSE;
+  /* The plan is trusted later; make sure no name can escape the root */
+  if (!ostree_validate_structureof_dirtree (dirtree, error))
+    return FALSE;
+
+  const gsize base_len = path->len;
+  GVariantIter iter;
+  g_autoptr (GVariant) files = g_variant_get_child_value (dirtree, 0);
+  g_variant_iter_init (&iter, files);
+  while (TRUE)
+    {
+      const char *name;
+      g_autoptr (GVariant) csum_v = NULL;
+      if (!g_variant_iter_next (&iter, "(&s@ay)", &name, &csum_v))
+        break;
+      g_string_truncate (path, base_len);
+      g_string_append_c (path, '/');
+      g_string_append (path, name);
+
+      g_autofree char *csum = ostree_checksum_from_bytes_v (csum_v);
+      g_autoptr (GFileInfo) finfo = NULL;
+      if (!ostree_repo_load_file (builder->repo, csum, NULL, &finfo, NULL, cancellable, error))
+        return FALSE;
+      const gboolean is_symlink = g_file_info_get_file_type (finfo) == G_FILE_TYPE_SYMBOLIC_LINK;
+      g_variant_builder_add (&builder->entries, "(suuutu@ays)", path->str,
+                             g_file_info_get_attribute_uint32 (finfo, "unix::mode"),
+                             g_file_info_get_attribute_uint32 (finfo, "unix::uid"),
+                             g_file_info_get_attribute_uint32 (finfo, "unix::gid"),
+                             (guint64)(is_symlink ? 0 : g_file_info_get_size (finfo)), NO_XATTRS,
+                             csum_v, is_symlink ? g_file_info_get_symlink_target (finfo) : "");
+    }
+
+  g_autoptr (GVariant) dirs = g_variant_get_child_value (dirtree, 1);
+  g_variant_iter_init (&iter, dirs);
+  while (TRUE)
+    {
+      const char *name;
+      g_autoptr (GVariant) subtree_csum_v = NULL;
+      g_autoptr (GVariant) submeta_csum_v = NULL;
+      if (!g_variant_iter_next (&iter, "(&s@ay@ay)", &name, &subtree_csum_v, &submeta_csum_v))
+        break;
+      g_string_truncate (path, base_len);
+      g_string_append_c (path, '/');
+      g_string_append (path, name);
+
+      g_autofree char *subtree_csum = ostree_checksum_from_bytes_v (subtree_csum_v);
+      g_autofree char *submeta_csum = ostree_checksum_from_bytes_v (submeta_csum_v);
+      if (!plan_add_dir (builder, path, subtree_csum, submeta_csum, cancellable, error))
+        return FALSE;
+    }
+
+  g_string_truncate (path, base_len);
+  return TRUE;
+}
+
+static GVariant *
+build_plan (OstreeRepo *repo, const char *commit, GCancellable *cancellable, GError **error)
+{
+  GLNX_AUTO_PREFIX_ERROR ("Building checkout plan", error);
+
+  g_autoptr (GVariant) commit_v = NULL;
+  if (!ostree_repo_load_commit (repo, commit, &commit_v, NULL, error))
+    return NULL;
+  g_autoptr (GVariant) tree_csum_v = NULL;
+  g_autoptr (GVariant) meta_csum_v = NULL;
+  g_variant_get_child (commit_v, 6, "@ay", &tree_csum_v);
+  g_variant_get_child (commit_v, 7, "@ay", &meta_csum_v);
+  g_autofree char *tree_csum = ostree_checksum_from_bytes_v (tree_csum_v);
+  g_autofree char *meta_csum = ostree_checksum_from_bytes_v (meta_csum_v);
+
+  PlanBuilder builder = { repo };
+  g_variant_builder_init (&builder.entries, G_VARIANT_TYPE ("a(suuutuays)"));
+  g_autoptr (GPtrArray) xattr_sets = builder.xattr_sets
+      = g_ptr_array_new_with_free_func ((GDestroyNotify)g_variant_unref);
+  g_autoptr (GHashTable) dirmeta_to_index = builder.dirmeta_to_index
+      = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  g_autoptr (GString) path = g_string_new ("");
+  if (!plan_add_dir (&builder, path, tree_csum, meta_csum, cancellable, error))
+    {
+      g_variant_builder_clear (&builder.entries);
+      return NULL;
+    }
+
+  GVariant *entries = g_variant_builder_end (&builder.entries);
+  GVariant *xattrs = g_variant_new_array (G_VARIANT_TYPE ("a(ayay)"),
+                                          (GVariant **)xattr_sets->pdata, xattr_sets->len);
+  return g_variant_ref_sink (
+      g_variant_new ("(u@a(suuutuays)@aa(ayay))", CHECKOUT_PLAN_VERSION, entries, xattrs));
+}
+
+/* Returns the plan for @commit, building and saving it if we don't have one */
+static GVariant *
+load_plan (OstreeRepo *repo, const char *commit, GCancellable *cancellable, GError **error)
+{
+  const int repo_dfd = ostree_repo_get_dfd (repo);
+  const char *planpath = glnx_strjoina (RPMOSTREE_CHECKOUT_PLAN_DIR "/", commit);
+  glnx_autofd int fd = -1;
+  g_autoptr (GError) local_error = NULL;
+  if (glnx_openat_rdonly (repo_dfd, planpath, TRUE, &fd, &local_error))
+    {
+      g_autoptr (GBytes) data = glnx_fd_readall_bytes (fd, cancellable, error);
+      if (!data)
+        return NULL;
+      g_autoptr (GVariant) plan = g_variant_ref_sink (
+          g_variant_new_from_bytes (G_VARIANT_TYPE (CHECKOUT_PLAN_GVARIANT_FORMAT), data, FALSE));
+      guint32 version = 0;
+      if (g_variant_is_normal_form (plan))
+        g_variant_get_child (plan, 0, "u", &version);
+      if (version == CHECKOUT_PLAN_VERSION)
+        return util::move_nullify (plan);
+      /* It's only a cache; if it's corrupted or stale, start over */
+      g_debug ("Rebuilding checkout plan for %s", commit);
+    }
+  else if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+    {
+      g_propagate_error (error, util::move_nullify (local_error));
+      return NULL;
+    }
+
+  g_autoptr (GVariant) plan = build_plan (repo, commit, cancellable, error);
+  if (!plan)
+    return NULL;
+
+  if (!glnx_shutil_mkdir_p_at (repo_dfd, RPMOSTREE_CHECKOUT_PLAN_DIR, 0755, cancellable, error))
+    return NULL;
+  if (!glnx_file_replace_contents_at (
+          repo_dfd, planpath, (const guint8 *)g_variant_get_data (plan), g_variant_get_size (plan),
+          GLNX_FILE_REPLACE_NODATASYNC, cancellable, error))
+    return (GVariant *)glnx_prefix_error_null (error, "Writing checkout plan");
+
+  return util::move_nullify (plan);
+}
+
+/* Check out a single path the slow way, for anything the plan doesn't handle
+ * itself: conflicts with existing files, and files that need copying. */
+static gboolean
+checkout_one_via_ostree (OstreeRepo *repo, OstreeRepoCheckoutAtOptions *options,
+                         int destination_dfd, const char *dest, const char *commit,
+                         const char *path, GCancellable *cancellable, GError **error)
+{
+  OstreeRepoCheckoutAtOptions subopts = *options;
+  subopts.subpath = path;
+  /* We already ran the filter */
+  subopts.filter = NULL;
+  subopts.filter_user_data = NULL;
+  return ostree_repo_checkout_at (repo, &subopts, destination_dfd, dest, commit, cancellable,
+                                  error);
+}
+
+static gboolean
+checkout_dir (int dfd, const char *dest, guint32 mode, guint32 uid, guint32 gid, GVariant *xattrs,
+              OstreeRepoCheckoutAtOptions *options, GCancellable *cancellable, GError **error)
+{
+  if (mkdirat (dfd, dest, 0700) < 0)
+    {
+      if (errno != EEXIST || options->overwrite_mode == OSTREE_REPO_CHECKOUT_OVERWRITE_NONE)
+        return glnx_throw_errno_prefix (error, "mkdirat(%s)", dest);
+      /* Like ostree, we leave the metadata of existing directories alone */
+      struct stat stbuf;
+      if (!glnx_fstatat (dfd, dest, &stbuf, 0, error))
+        return FALSE;
+      if (!S_ISDIR (stbuf.st_mode))
+        return glnx_throw (error, "Not a directory: %s", dest);
+      return TRUE;
+    }
+
+  glnx_autofd int dir_fd = -1;
+  if (!glnx_opendirat (dfd, dest, FALSE, &dir_fd, error))
+    return FALSE;
+  if (options->mode != OSTREE_REPO_CHECKOUT_MODE_USER)
+    {
+      if (xattrs && !glnx_fd_set_all_xattrs (dir_fd, xattrs, cancellable, error))
+        return FALSE;
+      if (fchown (dir_fd, uid, gid) < 0)
+        return glnx_throw_errno_prefix (error, "fchown(%s)", dest);
+    }
+  if (fchmod (dir_fd, mode & 07777) < 0)
+    return glnx_throw_errno_prefix (error, "fchmod(%s)", dest);
+  return TRUE;
+}
+
+/* Hardlink @checksum into place; *out_conflict is set if something different
+ * is already there. */
+static gboolean
+checkout_link (int repo_dfd, const char *checksum, int dfd, const char *dest,
+               OstreeRepoCheckoutAtOptions *options, gboolean *out_conflict, GError **error)
+{
+  char objpath[sizeof ("objects/xx/.file") + OSTREE_SHA256_STRING_LEN];
+  snprintf (objpath, sizeof (objpath), "objects/%.2s/%s.file", checksum, checksum + 2);
+
+  *out_conflict = FALSE;
+  if (linkat (repo_dfd, objpath, dfd, dest, 0) == 0)
+    {
+      if (options->devino_to_csum_cache)
+        {
+          struct stat stbuf;
+          if (!glnx_fstatat (dfd, dest, &stbuf, AT_SYMLINK_NOFOLLOW, error))
+            return FALSE;
+          rpmostree_devino_cache_add (options->devino_to_csum_cache, stbuf.st_dev,
+                                      stbuf.st_ino, checksum);
+        }
+      return TRUE;
+    }
+  if (errno != EEXIST)
+    return glnx_throw_errno_prefix (error, "linkat(%s)", dest);
+  if (options->overwrite_mode == OSTREE_REPO_CHECKOUT_OVERWRITE_ADD_FILES)
+    return TRUE;
+
+  /* The common case for union checkouts: a package we already checked out has
+   * the very same object here */
+  struct stat objbuf, destbuf;
+  if (!glnx_fstatat (repo_dfd, objpath, &objbuf, AT_SYMLINK_NOFOLLOW, error))
+    return FALSE;
+  if (!glnx_fstatat (dfd, dest, &destbuf, AT_SYMLINK_NOFOLLOW, error))
+    return FALSE;
+  *out_conflict = !(objbuf.st_dev == destbuf.st_dev && objbuf.st_ino == destbuf.st_ino);
+  return TRUE;
+}
+
+static gboolean
+checkout_symlink (int dfd, const char *dest, const char *target,
+                  OstreeRepoCheckoutAtOptions *options, gboolean *out_conflict, GError **error)
+{
+  *out_conflict = FALSE;
+  if (symlinkat (target, dfd, dest) == 0)
+    return TRUE;
+  if (errno != EEXIST)
+    return glnx_throw_errno_prefix (error, "symlinkat(%s)", dest);
+  *out_conflict = options->overwrite_mode != OSTREE_REPO_CHECKOUT_OVERWRITE_ADD_FILES;
+  return TRUE;
+}
+
+static gboolean
+execute_plan (OstreeRepo *repo, GVariant *plan, OstreeRepoCheckoutAtOptions *options,
+              int destination_dfd, const char *destination_path, const char *commit,
+              GCancellable *cancellable, GError **error)
+{
+  const int repo_dfd = ostree_repo_get_dfd (repo);
+  /* In bare-user repos, symlinks are stored as regular files */
+  const gboolean link_symlinks = ostree_repo_get_mode (repo) != OSTREE_REPO_MODE_BARE_USER;
+  const gboolean dest_is_cwd = g_str_equal (destination_path, ".");
+
+  g_autoptr (GVariant) entries = g_variant_get_child_value (plan, 1);
+  g_autoptr (GVariant) xattr_sets = g_variant_get_child_value (plan, 2);
+  const gsize n_xattr_sets = g_variant_n_children (xattr_sets);
+  g_autoptr (GString) dest = g_string_new ("");
+  g_autofree char *skipped_dir = NULL;
+  gsize skipped_dir_len = 0;
+
+  GVariantIter iter;
+  g_variant_iter_init (&iter, entries);
+  for (gsize i = 0;; i++)
+    {
+      const char *path;
+      guint32 mode, uid, gid, xattrs_index;
+      guint64 size;
+      g_autoptr (GVariant) csum_v = NULL;
+      const char *target;
+      if (!g_variant_iter_next (&iter, "(&suuutu@ay&s)", &path, &mode, &uid, &gid, &size,
+                                &xattrs_index, &csum_v, &target))
+        break;
+
+      if (skipped_dir)
+        {
+          if (g_str_has_prefix (path, skipped_dir) && path[skipped_dir_len] == '/')
+            continue;
+          g_clear_pointer (&skipped_dir, g_free);
+        }
+
+      /* The first entry is the root, which isn't subject to the filter */
+      if (i > 0 && options->filter)
+        {
+          struct stat stbuf = {
+            0,
+          };
+          stbuf.st_mode = mode;
+          stbuf.st_uid = uid;
+          stbuf.st_gid = gid;
+          stbuf.st_size = size;
+          if (options->filter (repo, path, &stbuf, options->filter_user_data)
+              == OSTREE_REPO_CHECKOUT_FILTER_SKIP)
+            {
+              if (S_ISDIR (mode))
+                {
+                  skipped_dir = g_strdup (path);
+                  skipped_dir_len = strlen (path);
+                }
+              continue;
+            }
+        }
+
+      if (i == 0)
+        g_string_assign (dest, destination_path);
+      else if (dest_is_cwd)
+        g_string_assign (dest, path + 1);
+      else
+        {
+          g_string_assign (dest, destination_path);
+          g_string_append (dest, path);
+        }
+
+      if (S_ISDIR (mode))
+        {
+          if (!g_cancellable_set_error_if_cancelled (cancellable, error))
+            return FALSE;
+          if (xattrs_index >= n_xattr_sets)
+            return glnx_throw (error, "Invalid xattrs index in checkout plan for %s", commit);
+          g_autoptr (GVariant) xattrs = g_variant_get_child_value (xattr_sets, xattrs_index);
+          if (!checkout_dir (destination_dfd, dest->str, mode, uid, gid, xattrs, options,
+                             cancellable, error))
+            return FALSE;
+          continue;
+        }
+
+      const guchar *csum = ostree_checksum_bytes_peek_validate (csum_v, error);
+      if (!csum)
+        return FALSE;
+      char checksum[OSTREE_SHA256_STRING_LEN + 1];
+      ostree_checksum_inplace_from_bytes (csum, checksum);
+
+      gboolean conflict = FALSE;
+      if (S_ISLNK (mode) && !link_symlinks)
+        {
+          if (!checkout_symlink (destination_dfd, dest->str, target, options, &conflict, error))
+            return FALSE;
+        }
+      else if ((S_ISREG (mode) && size == 0 && options->force_copy_zerosized)
+               || (options->mode == OSTREE_REPO_CHECKOUT_MODE_USER
+                   && (mode & (S_ISUID | S_ISGID)) != 0))
+        conflict = TRUE; /* Needs a copy; let ostree deal with it */
+      else if (!checkout_link (repo_dfd, checksum, destination_dfd, dest->str, options, &conflict,
+                               error))
+        return FALSE;
+
+      if (conflict
+          && !checkout_one_via_ostree (repo, options, destination_dfd, dest->str, commit, path,
+                                       cancellable, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Like ostree_repo_checkout_at(), but for hardlink checkouts from bare repos,
+ * working from the commit's checkout plan. Only callers whose options are all
+ * handled are served that way; for everything else this is just
+ * ostree_repo_checkout_at(). */
+gboolean
+rpmostree_checkout_plan_checkout_at (OstreeRepo *repo, OstreeRepoCheckoutAtOptions *options,
+                                     int destination_dfd, const char *destination_path,
+                                     const char *commit, GCancellable *cancellable,
+                                     GError **error)
+{
+  const OstreeRepoMode repo_mode = ostree_repo_get_mode (repo);
+  const gboolean hardlinkable
+      = (repo_mode == OSTREE_REPO_MODE_BARE && options->mode == OSTREE_REPO_CHECKOUT_MODE_NONE)
+        || ((repo_mode == OSTREE_REPO_MODE_BARE_USER
+             || repo_mode == OSTREE_REPO_MODE_BARE_USER_ONLY)
+            && options->mode == OSTREE_REPO_CHECKOUT_MODE_USER);
+  if (!hardlinkable || !options->no_copy_fallback || options->force_copy || options->subpath
+      || options->sepolicy || options->process_whiteouts || options->process_passthrough_whiteouts
+      || options->bareuseronly_dirs || options->enable_fsync)
+    return ostree_repo_checkout_at (repo, options, destination_dfd, destination_path, commit,
+                                    cancellable, error);
+
+  g_autoptr (GVariant) plan = load_plan (repo, commit, cancellable, error);
+  if (!plan)
+    return FALSE;
+  return execute_plan (repo, plan, options, destination_dfd, destination_path, commit,
+                       cancellable, error);
+}
+
+/* Delete the plans for commits which are no longer in @repo. */
+gboolean
+rpmostree_checkout_plan_prune (OstreeRepo *repo, guint *out_n_pruned, GCancellable *cancellable,
+                               GError **error)
+{
+  GLNX_AUTO_PREFIX_ERROR ("Pruning checkout plans", error);
+  const int repo_dfd = ostree_repo_get_dfd (repo);
+  guint n_pruned = 0;
+
+  if (!glnx_fstatat_allow_noent (repo_dfd, RPMOSTREE_CHECKOUT_PLAN_DIR, NULL, 0, error))
+    return FALSE;
+  if (errno == ENOENT)
+    {
+      if (out_n_pruned)
+        *out_n_pruned = 0;
+      return TRUE;
+    }
+
+  g_auto (GLnxDirFdIterator) dfd_iter = {
+    FALSE,
+  };
+  if (!glnx_dirfd_iterator_init_at (repo_dfd, RPMOSTREE_CHECKOUT_PLAN_DIR, FALSE, &dfd_iter,
+                                    error))
+    return FALSE;
+  while (TRUE)
+    {
+      struct dirent *dent = NULL;
+      if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, cancellable, error))
+        return FALSE;
+      if (!dent)
+        break;
+
+      gboolean has_commit = FALSE;
+      if (ostree_validate_checksum_string (dent->d_name, NULL)
+          && !ostree_repo_has_object (repo, OSTREE_OBJECT_TYPE_COMMIT, dent->d_name, &has_commit,
+                                      cancellable, error))
+        return FALSE;
+      if (has_commit)
+        continue;
+      if (!glnx_unlinkat (dfd_iter.fd, dent->d_name, 0, error))
+        return FALSE;
+      n_pruned++;
+    }
+
+  if (out_n_pruned)
+    *out_n_pruned = n_pruned;
+  return TRUE;
+}
@@ -0,0 +1,47 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Licensed under the GNU Lesser General Public License Version 2.1
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#pragma once
+
+#include "libglnx.h"
+#include <gio/gio.h>
+#include <ostree.h>
+
+G_BEGIN_DECLS
+
+/* Where checkout plans live, relative to the repo */
+#define RPMOSTREE_CHECKOUT_PLAN_DIR "extensions/rpmostree/checkout-plans"
+
+/* A checkout plan is a flattened copy of a commit's dirtree and dirmeta
+ * objects, plus the metadata of each of its files: everything needed to
+ * hardlink the commit into place without walking the objects again. Plans
+ * are built the first time a commit is checked out and kept in the repo,
+ * keyed by commit checksum.
+ */
+
+gboolean rpmostree_checkout_plan_checkout_at (OstreeRepo *repo,
+                                              OstreeRepoCheckoutAtOptions *options,
+                                              int destination_dfd, const char *destination_path,
+                                              const char *commit, GCancellable *cancellable,
+                                              GError **error);
+
+gboolean rpmostree_checkout_plan_prune (OstreeRepo *repo, guint *out_n_pruned,
+                                        GCancellable *cancellable, GError **error);
+
+G_END_DECLS
@@ -41,6 +41,23 @@ rpmostree_container_rebuild (rpmostreecxx::Treefile &treefile, GCancellable *can
   g_autoptr (RpmOstreeContext) ctx = rpmostree_context_new_container ();
   rpmostree_context_set_treefile (ctx, treefile);
 
+  /* Derivation builds can point this at e.g. a `RUN --mount=type=cache` so
+   * that metadata and packages are only fetched once, rather than in every
+   * image build.  Since it's outside the image, we also keep the RPMs. */
+  const char *cachedir = g_getenv ("RPMOSTREE_CONTAINER_CACHEDIR");
+  if (cachedir && *cachedir)
+    {
+      DnfContext *dnfctx = rpmostree_context_get_dnf (ctx);
+      g_autofree char *repomd_dir = g_build_filename (cachedir, RPMOSTREE_DIR_CACHE_REPOMD, NULL);
+      g_autofree char *solv_dir = g_build_filename (cachedir, RPMOSTREE_DIR_CACHE_SOLV, NULL);
+      if (!glnx_shutil_mkdir_p_at (AT_FDCWD, repomd_dir, 0755, cancellable, error)
+          || !glnx_shutil_mkdir_p_at (AT_FDCWD, solv_dir, 0755, cancellable, error))
+        return glnx_prefix_error (error, "Preparing cache directory %s", cachedir);
+      dnf_context_set_cache_dir (dnfctx, repomd_dir);
+      dnf_context_set_solv_dir (dnfctx, solv_dir);
+      dnf_context_set_keep_cache (dnfctx, TRUE);
+    }
+
   glnx_autofd int rootfs_fd = -1;
   if (!glnx_opendirat (AT_FDCWD, "/", TRUE, &rootfs_fd, error))
     return FALSE;
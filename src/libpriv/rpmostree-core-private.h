@@ -25,10 +25,40 @@
 #include "libglnx.h"
 #include "rpmostree-core.h"
 #include "rpmostree-cxxrs.h"
+#include "rpmostree-digest-index.h"
+#include "rpmostree-label-cache.h"
 #include "rpmostree-output.h"
+#include "rpmostree-pkgcache-index.h"
+#include "rpmostree-scripts.h"
+#include "rpmostree-work-queue.h"
 
 G_BEGIN_DECLS
 
+/* State for adapting the number of concurrent imports at runtime, based on
+ * measured throughput; see tune_import_concurrency(). */
+typedef struct
+{
+  guint64 window_start; /* Monotonic time */
+  guint window_n;
+  guint64 window_bytes;
+  guint64 window_cpu_usec;
+  guint64 window_wall_usec;
+  double last_throughput; /* Bytes per second in the previous window */
+  int direction;
+} RpmOstreeConcurrencyTuner;
+
+typedef struct _RpmOstreeFilesRemoveMatcher RpmOstreeFilesRemoveMatcher;
+void rpmostree_files_remove_matcher_free (RpmOstreeFilesRemoveMatcher *matcher);
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (RpmOstreeFilesRemoveMatcher, rpmostree_files_remove_matcher_free);
+
+typedef struct
+{
+  const char *phase; /* Static string */
+  guint64 wall_usec;
+  guint64 bytes;
+  guint64 n_objects;
+} RpmOstreePhaseTiming;
+
 struct _RpmOstreeContext
 {
   GObject parent;
@@ -46,17 +76,27 @@ struct _RpmOstreeContext
   gboolean pkgcache_only;
   DnfContext *dnfctx;
   RpmOstreeContextDnfCachePolicy dnf_cache_policy;
+  guint dnf_max_cache_age; /* seconds; only for RPMOSTREE_CONTEXT_DNF_CACHE_NEVER */
+  gboolean lazy_filelists;
+  gboolean low_memory;
+  gboolean countme;
+  gboolean filelists_skipped; /* The sack was loaded without filelists because of the above */
   OstreeRepo *ostreerepo;
   OstreeRepo *pkgcache_repo;
+  OstreeRepo *shared_noarch_repo; /* See rpmostree_context_set_shared_noarch_repo() */
+  char *pkgcache_remote;          /* See rpmostree_context_set_pkgcache_remote() */
   gboolean enable_rofiles;
   OstreeRepoDevInoCache *devino_cache;
+  struct timespec devino_stamp; /* ctime at which the devino cache stopped growing */
   gboolean unprivileged;
   OstreeSePolicy *sepolicy;
+  RpmOstreeLabelCache *label_cache;
+  RpmOstreeDigestIndex *digest_index;
   char *passwd_dir;
 
-  guint async_index; /* Offset into array if applicable */
-  guint n_async_running;
-  guint n_async_max;
+  RpmOstreeWorkQueue *async_work_queue;
+  guint import_concurrency; /* Fixed number of concurrent imports; 0 for adaptive */
+  RpmOstreeConcurrencyTuner import_tuner;
   gboolean async_running;
   GCancellable *async_cancellable;
   std::unique_ptr<rpmostreecxx::Progress> async_progress;
@@ -68,19 +108,43 @@ struct _RpmOstreeContext
   GPtrArray *pkgs_to_relabel;
   guint n_async_pkgs_relabeled;
 
+  /* State for pipelining downloads with imports */
+  guint64 download_import_budget; /* Max bytes downloaded but not imported; 0 for unbounded */
+  guint max_downloads;
+  guint max_downloads_per_repo; /* 0 means use the repo config */
+  gboolean stream_downloads;
+  const char *stream_dir; /* Borrowed; tmpfs scratch dir for downloads, if streaming */
+  GPtrArray *async_download_batches;
+  GHashTable *async_busy_repos; /* set of DnfRepo */
+  guint n_async_downloads_running;
+  guint64 async_download_bytes_inflight;
+  guint64 async_download_bytes_pending;
+  GHashTable *async_downloaded_pkgs; /* set of DnfPackage */
+  guint n_async_pkgs_downloaded;
+
   GHashTable *pkgs_to_remove;  /* pkgname --> gv_nevra */
   GHashTable *pkgs_to_replace; /* source -> (new gv_nevra --> old gv_nevra) */
 
   GHashTable *fileoverride_pkgs; /* set of nevras */
+  GHashTable *layered_nevras;    /* set of nevras already in the tmprootfs, if relayering */
+  char *input_digest;            /* see rpmostree_context_set_input_digest() */
+  GHashTable *files_remove_matchers; /* pkgname -> RpmOstreeFilesRemoveMatcher, or NULL */
+  GHashTable *header_cache;          /* metarpm relpath -> parsed header */
+  GHashTable *deferred_ownership;    /* see rpmostree_context_get_deferred_ownership() */
 
   std::optional<rust::Box<rpmostreecxx::LockfileConfig> > lockfile;
   gboolean lockfile_strict;
+  gboolean lockfile_exact; /* Install exactly the locked packages; implies strict */
+  char *lockfile_digest; /* Of the lockfile contents and strictness */
 
   GLnxTmpDir tmpdir;
 
   gboolean kernel_changed;
 
   int tmprootfs_dfd; /* Borrowed */
+  char *base_commit; /* The commit tmprootfs_dfd was checked out from, if known */
+  RpmOstreeScriptTimings *script_timings;
+  GArray *phase_timings; /* RpmOstreePhaseTiming */
   GHashTable *rootfs_usrlinks;
   GLnxTmpDir repo_tmpdir; /* Used to assemble+commit if no base rootfs provided */
 };
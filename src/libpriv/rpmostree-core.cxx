@@ -25,6 +25,7 @@
 #include <libdnf/libdnf.h>
 #include <librepo/librepo.h>
 #include <rpm/rpmfi.h>
+#include <rpm/rpmfiles.h>
 #include <rpm/rpmlib.h>
 #include <rpm/rpmlog.h>
 #include <rpm/rpmmacro.h>
@@ -33,14 +34,17 @@
 #include <systemd/sd-journal.h>
 #include <utility>
 
+#include "rpmostree-checkout-plan.h"
 #include "rpmostree-core-private.h"
 #include "rpmostree-cxxrs.h"
 #include "rpmostree-importer.h"
 #include "rpmostree-kernel.h"
+#include "rpmostree-metrics.h"
 #include "rpmostree-output.h"
 #include "rpmostree-postprocess.h"
 #include "rpmostree-rpm-util.h"
 #include "rpmostree-scripts.h"
+#include "rpmostree-trace.h"
 
 #include "libdnf/nevra.hpp"
 #include "rpmostree-util.h"
@@ -54,7 +58,15 @@
 #define RPMOSTREE_MESSAGE_PKG_IMPORT                                                               \
   SD_ID128_MAKE (df, 8b, b5, 4f, 04, fa, 47, 08, ac, 16, 11, 1b, bf, 4b, a3, 52)
 
+/* When pipelining downloads and imports, this is the default cap on the
+ * number of bytes downloaded but not yet handed off to an importer. */
+#define RPMOSTREE_DEFAULT_DOWNLOAD_IMPORT_BUDGET (1024 * 1024 * 1024)
+
+/* The default for libdnf's per-repo max_parallel_downloads */
+#define RPMOSTREE_LIBDNF_DEFAULT_DOWNLOADS_PER_REPO 3
+
 static OstreeRepo *get_pkgcache_repo (RpmOstreeContext *self);
+static guint get_max_concurrent_repos (guint max_downloads, guint max_downloads_per_repo);
 
 static int
 compare_pkgs (gconstpointer ap, gconstpointer bp)
@@ -78,12 +90,19 @@ rpmostree_context_finalize (GObject *object)
   g_clear_object (&rctx->dnfctx);
 
   g_clear_pointer (&rctx->ref, g_free);
+  g_clear_pointer (&rctx->base_commit, g_free);
+  g_clear_pointer (&rctx->script_timings, rpmostree_script_timings_free);
+  g_clear_pointer (&rctx->phase_timings, g_array_unref);
 
   g_clear_object (&rctx->pkgcache_repo);
+  g_clear_object (&rctx->shared_noarch_repo);
+  g_clear_pointer (&rctx->pkgcache_remote, g_free);
   g_clear_object (&rctx->ostreerepo);
   g_clear_pointer (&rctx->devino_cache, (GDestroyNotify)ostree_repo_devino_cache_unref);
 
   g_clear_object (&rctx->sepolicy);
+  g_clear_pointer (&rctx->label_cache, rpmostree_label_cache_unref);
+  g_clear_pointer (&rctx->digest_index, rpmostree_digest_index_unref);
 
   g_clear_pointer (&rctx->passwd_dir, g_free);
 
@@ -92,10 +111,20 @@ rpmostree_context_finalize (GObject *object)
   g_clear_pointer (&rctx->pkgs_to_import, g_ptr_array_unref);
   g_clear_pointer (&rctx->pkgs_to_relabel, g_ptr_array_unref);
 
+  g_clear_pointer (&rctx->async_download_batches, g_ptr_array_unref);
+  g_clear_pointer (&rctx->async_downloaded_pkgs, g_hash_table_unref);
+  g_clear_pointer (&rctx->async_busy_repos, g_hash_table_unref);
+
   g_clear_pointer (&rctx->pkgs_to_remove, g_hash_table_unref);
   g_clear_pointer (&rctx->pkgs_to_replace, g_hash_table_unref);
 
   g_clear_pointer (&rctx->fileoverride_pkgs, g_hash_table_unref);
+  g_clear_pointer (&rctx->layered_nevras, g_hash_table_unref);
+  g_free (rctx->input_digest);
+  g_free (rctx->lockfile_digest);
+  g_clear_pointer (&rctx->files_remove_matchers, g_hash_table_unref);
+  g_clear_pointer (&rctx->header_cache, g_hash_table_unref);
+  g_clear_pointer (&rctx->deferred_ownership, g_hash_table_unref);
 
   (void)glnx_tmpdir_delete (&rctx->tmpdir, NULL, NULL);
   (void)glnx_tmpdir_delete (&rctx->repo_tmpdir, NULL, NULL);
@@ -119,6 +148,10 @@ rpmostree_context_init (RpmOstreeContext *self)
   self->dnf_cache_policy = RPMOSTREE_CONTEXT_DNF_CACHE_DEFAULT;
   self->enable_rofiles = TRUE;
   self->unprivileged = getuid () != 0;
+  self->download_import_budget = RPMOSTREE_DEFAULT_DOWNLOAD_IMPORT_BUDGET;
+  self->max_downloads = RPMOSTREE_DEFAULT_MAX_DOWNLOADS;
+  self->script_timings = rpmostree_script_timings_new ();
+  self->phase_timings = g_array_new (FALSE, FALSE, sizeof (RpmOstreePhaseTiming));
 }
 
 static void
@@ -345,12 +378,95 @@ rpmostree_context_set_pkgcache_only (RpmOstreeContext *self, gboolean pkgcache_o
   self->pkgcache_only = pkgcache_only;
 }
 
+/* Set the maximum number of bytes of downloaded RPMs that may be waiting for
+ * import in rpmostree_context_download_and_import(). A value of 0 means no
+ * limit; downloads will then proceed as fast as the network allows. */
+void
+rpmostree_context_set_download_import_budget (RpmOstreeContext *self, guint64 budget)
+{
+  self->download_import_budget = budget;
+}
+
+/* Set the number of packages to import in parallel. The default of 0 means
+ * to start with the number of processors, then adapt at runtime to the
+ * measured throughput, which helps when I/O rather than CPU is the
+ * bottleneck. */
+void
+rpmostree_context_set_import_concurrency (RpmOstreeContext *self, guint n)
+{
+  self->import_concurrency = n;
+}
+
+/* When pipelining downloads with imports, write the RPMs to a scratch
+ * directory on tmpfs instead of the repo's package cache, so that they never
+ * hit the disk; each is unlinked as soon as its import opens it. Memory use
+ * is bounded by the download/import budget, so this is ignored if it's
+ * unlimited. Packages from repos with gpgcheck enabled are still downloaded
+ * to the package cache, since libdnf verifies signatures from there. */
+void
+rpmostree_context_set_stream_downloads (RpmOstreeContext *self, gboolean stream)
+{
+  self->stream_downloads = stream;
+}
+
+/* Limit the number of concurrent connections used to download packages.
+ * @max_downloads_per_repo overrides libdnf's max_parallel_downloads for all
+ * repos, and must be set before rpmostree_context_setup(); 0 keeps the repo
+ * configuration. Packages are fetched from multiple repos at once as long as
+ * the total stays under @max_downloads. */
+void
+rpmostree_context_set_download_concurrency (RpmOstreeContext *self, guint max_downloads,
+                                            guint max_downloads_per_repo)
+{
+  self->max_downloads = max_downloads;
+  self->max_downloads_per_repo = max_downloads_per_repo;
+}
+
 void
 rpmostree_context_set_dnf_caching (RpmOstreeContext *self, RpmOstreeContextDnfCachePolicy policy)
 {
   self->dnf_cache_policy = policy;
 }
 
+/* With RPMOSTREE_CONTEXT_DNF_CACHE_NEVER, still reuse rpm-md which was
+ * fetched at most @seconds ago. This lets back-to-back composes against the
+ * same repos skip refetching metadata and go straight to the cached solv
+ * files. */
+void
+rpmostree_context_set_dnf_max_cache_age (RpmOstreeContext *self, guint seconds)
+{
+  self->dnf_max_cache_age = seconds;
+}
+
+/* Don't fetch or load the rpm-md filelists up front; they're by far the
+ * largest part of the metadata, and most file dependencies are on paths
+ * which the primary metadata already lists. If rpmostree_context_prepare()
+ * then fails on a file dependency, the filelists are fetched and the
+ * depsolve is retried. */
+void
+rpmostree_context_set_lazy_filelists (RpmOstreeContext *self, gboolean lazy)
+{
+  self->lazy_filelists = lazy;
+}
+
+/* Keep the sack small, at the cost of information we can do without: the
+ * updateinfo isn't loaded even when asked for, so no advisories are known. */
+void
+rpmostree_context_set_low_memory (RpmOstreeContext *self, gboolean low_memory)
+{
+  self->low_memory = low_memory;
+}
+
+/* Let libdnf send the Count Me flag with the metalink fetches of the repos
+ * configured with countme=1, as dnf would, rather than leave it to
+ * rpm-ostree-countme.service; that way the mirrors are only contacted once.
+ * Must be called before rpmostree_context_setup(). */
+void
+rpmostree_context_set_countme (RpmOstreeContext *self, gboolean countme)
+{
+  self->countme = countme;
+}
+
 /* Pick up repos dir and passwd from @cfg_deployment. */
 void
 rpmostree_context_configure_from_deployment (RpmOstreeContext *self, OstreeSysroot *sysroot,
@@ -402,6 +518,187 @@ get_pkgcache_repo (RpmOstreeContext *self)
   return self->pkgcache_repo ?: self->ostreerepo;
 }
 
+/* The imports of noarch packages are the same whatever the architecture, so
+ * composes for several of them can share these: with @repo set, the noarch
+ * packages missing from the pkgcache are copied from it rather than
+ * downloaded and imported again, and the ones imported are copied to it. The
+ * composes may run concurrently; ostree's repo locking covers that. */
+void
+rpmostree_context_set_shared_noarch_repo (RpmOstreeContext *self, OstreeRepo *repo)
+{
+  g_set_object (&self->shared_noarch_repo, repo);
+}
+
+static gboolean
+pkg_is_shareable (DnfPackage *pkg)
+{
+  return g_str_equal (dnf_package_get_arch (pkg), "noarch")
+         && g_strcmp0 (dnf_package_get_reponame (pkg), HY_CMDLINE_REPO_NAME) != 0;
+}
+
+/* Copy the imports of the shareable @packages in @src to @dest, where they
+ * aren't already (if @if_missing) or whatever @dest has, returning how many
+ * were copied. */
+static gboolean
+copy_noarch_imports (OstreeRepo *dest, OstreeRepo *src, GPtrArray *packages, gboolean if_missing,
+                     guint *out_n_copied, GCancellable *cancellable, GError **error)
+{
+  *out_n_copied = 0;
+  g_auto (RpmOstreeRepoAutoTransaction) txn = {
+    0,
+  };
+  for (guint i = 0; i < packages->len; i++)
+    {
+      auto pkg = static_cast<DnfPackage *> (packages->pdata[i]);
+      if (!pkg_is_shareable (pkg))
+        continue;
+      g_autofree char *cachebranch = rpmostree_get_cache_branch_pkg (pkg);
+      if (if_missing)
+        {
+          g_autofree char *dest_rev = NULL;
+          if (!ostree_repo_resolve_rev (dest, cachebranch, TRUE, &dest_rev, error))
+            return FALSE;
+          if (dest_rev)
+            continue;
+        }
+      g_autofree char *rev = NULL;
+      if (!ostree_repo_resolve_rev (src, cachebranch, TRUE, &rev, error))
+        return FALSE;
+      if (!rev)
+        continue;
+
+      if (!txn.initialized
+          && !rpmostree_repo_auto_transaction_start (&txn, dest, FALSE, cancellable, error))
+        return FALSE;
+      if (!rpmostree_repo_import_commit (dest, src, rev, cancellable, error))
+        return glnx_prefix_error (error, "Copying %s", cachebranch);
+      ostree_repo_transaction_set_ref (dest, NULL, cachebranch, rev);
+      (*out_n_copied)++;
+    }
+  if (txn.initialized)
+    {
+      if (!ostree_repo_commit_transaction (dest, NULL, cancellable, error))
+        return FALSE;
+      txn.initialized = FALSE;
+    }
+  return TRUE;
+}
+
+/* Before looking at what needs importing, pick up what other composes
+ * already imported; see rpmostree_context_set_shared_noarch_repo(). A stale
+ * copy is caught by find_pkg_in_ostree() like any other. */
+static gboolean
+fetch_shared_noarch_imports (RpmOstreeContext *self, GPtrArray *packages,
+                             GCancellable *cancellable, GError **error)
+{
+  OstreeRepo *repo = get_pkgcache_repo (self);
+  if (!self->shared_noarch_repo || !repo)
+    return TRUE;
+  guint n_copied = 0;
+  if (!copy_noarch_imports (repo, self->shared_noarch_repo, packages, TRUE, &n_copied,
+                            cancellable, error))
+    return glnx_prefix_error (error, "Fetching from shared noarch pkgcache");
+  if (n_copied > 0)
+    rpmostree_output_message ("Reusing %u noarch package%s from shared pkgcache", n_copied,
+                              _NS (n_copied));
+  return TRUE;
+}
+
+/* The imports are reproducible (the commit timestamp is the package's
+ * buildtime), so a build server can import the packages once and serve the
+ * pkgcache branches from an ostree remote of the pkgcache repo. With @remote
+ * set, the packages missing from the pkgcache which @remote has are pulled
+ * from it rather than downloaded and imported. @remote must be configured in
+ * the pkgcache repo and publish a summary listing the branches. */
+void
+rpmostree_context_set_pkgcache_remote (RpmOstreeContext *self, const char *remote)
+{
+  g_free (self->pkgcache_remote);
+  self->pkgcache_remote = g_strdup (remote);
+}
+
+static gboolean
+pull_pkgcache_branches (RpmOstreeContext *self, OstreeRepo *repo, GPtrArray *packages,
+                        guint *out_n_pulled, GCancellable *cancellable, GError **error)
+{
+  const char *remote = self->pkgcache_remote;
+  *out_n_pulled = 0;
+
+  g_autoptr (GHashTable) remote_refs = NULL;
+  if (!ostree_repo_remote_list_refs (repo, remote, &remote_refs, cancellable, error))
+    return FALSE;
+
+  g_autoptr (GPtrArray) branches = g_ptr_array_new_with_free_func (g_free);
+  for (guint i = 0; i < packages->len; i++)
+    {
+      auto pkg = static_cast<DnfPackage *> (packages->pdata[i]);
+      if (rpmostree_pkg_is_local (pkg)
+          || g_strcmp0 (dnf_package_get_reponame (pkg), HY_CMDLINE_REPO_NAME) == 0)
+        continue;
+      g_autofree char *cachebranch = rpmostree_get_cache_branch_pkg (pkg);
+      if (!g_hash_table_contains (remote_refs, cachebranch))
+        continue;
+      g_autofree char *rev = NULL;
+      if (!ostree_repo_resolve_rev (repo, cachebranch, TRUE, &rev, error))
+        return FALSE;
+      if (!rev)
+        g_ptr_array_add (branches, util::move_nullify (cachebranch));
+    }
+  if (branches->len == 0)
+    return TRUE;
+  g_ptr_array_add (branches, NULL);
+
+  g_auto (GVariantDict) options;
+  g_variant_dict_init (&options, NULL);
+  g_variant_dict_insert_value (&options, "refs",
+                               g_variant_new_strv ((const char *const *)branches->pdata, -1));
+  if (!ostree_repo_pull_with_options (repo, remote, g_variant_dict_end (&options), NULL,
+                                      cancellable, error))
+    return FALSE;
+
+  /* The pull wrote them as remote refs; make them local ones like an import
+   * would, so that they're pruned like any other once unused. */
+  for (guint i = 0; i < branches->len - 1; i++)
+    {
+      const char *cachebranch = static_cast<const char *> (branches->pdata[i]);
+      g_autofree char *rev = NULL;
+      g_autofree char *refspec = g_strconcat (remote, ":", cachebranch, NULL);
+      if (!ostree_repo_resolve_rev (repo, refspec, FALSE, &rev, error))
+        return FALSE;
+      if (!ostree_repo_set_ref_immediate (repo, NULL, cachebranch, rev, cancellable, error))
+        return FALSE;
+      if (!ostree_repo_set_ref_immediate (repo, remote, cachebranch, NULL, cancellable, error))
+        return FALSE;
+    }
+  *out_n_pulled = branches->len - 1;
+  return TRUE;
+}
+
+/* See rpmostree_context_set_pkgcache_remote(). This is only an optimization,
+ * so on failure we fall back to downloading. Like for the shared noarch
+ * pkgcache, find_pkg_in_ostree() then checks what was pulled like any other
+ * import, e.g. relabeling it if our policy differs from the build server's. */
+static void
+fetch_remote_pkgcache (RpmOstreeContext *self, GPtrArray *packages, GCancellable *cancellable)
+{
+  OstreeRepo *repo = get_pkgcache_repo (self);
+  if (!self->pkgcache_remote || !*self->pkgcache_remote || !repo)
+    return;
+
+  rpmostreecxx::TraceSpan span ("pkgcache-remote-pull", self->pkgcache_remote);
+  guint n_pulled = 0;
+  g_autoptr (GError) local_error = NULL;
+  if (!pull_pkgcache_branches (self, repo, packages, &n_pulled, cancellable, &local_error))
+    {
+      rpmostree_output_message ("Failed to pull from pkgcache remote %s: %s",
+                                self->pkgcache_remote, local_error->message);
+      return;
+    }
+  if (n_pulled > 0)
+    rpmostree_output_message ("Pulled %u package%s from pkgcache remote %s", n_pulled,
+                              _NS (n_pulled), self->pkgcache_remote);
+}
+
 /* I debated making this part of the treespec. Overall, I think it makes more
  * sense to define it outside since the policy to use depends on the context in
  * which the RpmOstreeContext is used, not something we can always guess on our
@@ -410,12 +707,37 @@ void
 rpmostree_context_set_sepolicy (RpmOstreeContext *self, OstreeSePolicy *sepolicy)
 {
   g_set_object (&self->sepolicy, sepolicy);
+  g_clear_pointer (&self->label_cache, rpmostree_label_cache_unref);
+}
+
+/* Load the cache of label lookups for our sepolicy, stored in the pkgcache
+ * repo; see rpmostree-label-cache.h. */
+static gboolean
+ensure_label_cache (RpmOstreeContext *self, GCancellable *cancellable, GError **error)
+{
+  if (self->label_cache || !self->sepolicy)
+    return TRUE;
+  OstreeRepo *repo = get_pkgcache_repo (self);
+  self->label_cache
+      = rpmostree_label_cache_new (self->sepolicy, ostree_repo_get_dfd (repo), cancellable, error);
+  return self->label_cache != NULL;
+}
+
+static gboolean
+ensure_digest_index (RpmOstreeContext *self, GCancellable *cancellable, GError **error)
+{
+  if (self->digest_index)
+    return TRUE;
+  self->digest_index = rpmostree_digest_index_new (get_pkgcache_repo (self), cancellable, error);
+  return self->digest_index != NULL;
 }
 
+/* Without rofiles, scripts can modify the checked out files in place, so the
+ * devino cache is then only trustworthy for files whose ctime predates the
+ * stamp; see rpmostree_context_get_devino_stamp(). */
 void
 rpmostree_context_set_devino_cache (RpmOstreeContext *self, OstreeRepoDevInoCache *devino_cache)
 {
-  g_assert (self->enable_rofiles);
   if (self->devino_cache)
     ostree_repo_devino_cache_unref (self->devino_cache);
   self->devino_cache = devino_cache ? ostree_repo_devino_cache_ref (devino_cache) : NULL;
@@ -424,10 +746,66 @@ rpmostree_context_set_devino_cache (RpmOstreeContext *self, OstreeRepoDevInoCach
 void
 rpmostree_context_disable_rofiles (RpmOstreeContext *self)
 {
-  g_assert (!self->devino_cache);
   self->enable_rofiles = FALSE;
 }
 
+/* Any change to a file checked out from the pkgcache after assembly finished
+ * checking out packages (a write, chmod, xattr change, or even a new link)
+ * gives it a ctime no earlier than this; files with an older ctime are still
+ * exactly what the devino cache says. Returns FALSE if there's no stamp. */
+gboolean
+rpmostree_context_get_devino_stamp (RpmOstreeContext *self, struct timespec *out_stamp)
+{
+  if (!self->devino_cache || self->devino_stamp.tv_sec == 0)
+    return FALSE;
+  *out_stamp = self->devino_stamp;
+  return TRUE;
+}
+
+/* When not running as root, the ownership, file caps and setuid bits from
+ * the RPM headers can't be applied on disk during assembly. They're recorded
+ * instead, as a map of committed path (relative, with etc/ as usr/etc/) to
+ * (uid, gid, mode, fcaps), for the commit to apply with
+ * rpmostree_deferred_ownership_apply(). Returns %NULL if there's nothing. */
+GHashTable *
+rpmostree_context_get_deferred_ownership (RpmOstreeContext *self)
+{
+  return self->deferred_ownership;
+}
+
+/* If @relpath is in @ownership, update @file_info (the mode only for regular
+ * files, as on disk) and return TRUE; @out_fcaps is then set to the file caps
+ * to apply, or %NULL. Safe to call from multiple threads. */
+gboolean
+rpmostree_deferred_ownership_apply (GHashTable *ownership, const char *relpath,
+                                    GFileInfo *file_info, const char **out_fcaps)
+{
+  relpath += strspn (relpath, "/");
+  auto entry = static_cast<GVariant *> (g_hash_table_lookup (ownership, relpath));
+  if (!entry)
+    return FALSE;
+
+  guint32 uid, gid, mode;
+  const char *fcaps;
+  g_variant_get (entry, "(uuu&s)", &uid, &gid, &mode, &fcaps);
+  g_file_info_set_attribute_uint32 (file_info, "unix::uid", uid);
+  g_file_info_set_attribute_uint32 (file_info, "unix::gid", gid);
+  if (S_ISREG (mode) && g_file_info_get_file_type (file_info) == G_FILE_TYPE_REGULAR)
+    g_file_info_set_attribute_uint32 (file_info, "unix::mode", mode);
+  if (out_fcaps)
+    *out_fcaps = fcaps[0] ? fcaps : NULL;
+  return TRUE;
+}
+
+/* A commit filter applying the #GHashTable @user_data of deferred ownership */
+OstreeRepoCommitFilterResult
+rpmostree_deferred_ownership_filter (OstreeRepo *repo, const char *path, GFileInfo *file_info,
+                                     gpointer user_data)
+{
+  rpmostree_deferred_ownership_apply (static_cast<GHashTable *> (user_data), path, file_info, NULL);
+  return OSTREE_REPO_COMMIT_FILTER_ALLOW;
+}
+
 DnfContext *
 rpmostree_context_get_dnf (RpmOstreeContext *self)
 {
@@ -672,7 +1050,41 @@ rpmostree_context_setup (RpmOstreeContext *self, const char *install_root, const
         dnf_context_set_rpm_macro (self->dnfctx, "_install_langs", instlangs.c_str ());
     }
 
-  if (!dnf_context_setup (self->dnfctx, cancellable, error))
+  if (self->max_downloads_per_repo > 0)
+    {
+      g_autofree char *val = g_strdup_printf ("%u", self->max_downloads_per_repo);
+      if (!dnf_conf_add_setopt ("*.max_parallel_downloads", DNF_CONF_COMMANDLINE, val, error))
+        return FALSE;
+    }
+
+  /* Setopts are global, so we only lift the override of new_base() for as
+   * long as it takes to load the repos. */
+  rust::Vec<rust::String> countme_repos;
+  if (self->countme)
+    {
+      CXX_TRY_VAR (ids, rpmostreecxx::countme_repo_ids (), error);
+      countme_repos = std::move (ids);
+      if (!countme_repos.empty ())
+        {
+          /* The counts are broken down by the User Agent */
+          CXX_TRY_VAR (ua, rpmostreecxx::countme_user_agent (), error);
+          dnf_context_set_user_agent (self->dnfctx, ua.c_str ());
+        }
+    }
+  for (auto &id : countme_repos)
+    {
+      g_autofree char *key = g_strdup_printf ("%s.countme", id.c_str ());
+      if (!dnf_conf_add_setopt (key, DNF_CONF_COMMANDLINE, "true", error))
+        return FALSE;
+    }
+
+  const gboolean setup_ok = dnf_context_setup (self->dnfctx, cancellable, error);
+  for (auto &id : countme_repos)
+    {
+      g_autofree char *key = g_strdup_printf ("%s.countme", id.c_str ());
+      dnf_conf_add_setopt (key, DNF_CONF_COMMANDLINE, "false", NULL);
+    }
+  if (!setup_ok)
     return FALSE;
 
   /* XXX: If we have modules to install, then we need libdnf to handle it, and
@@ -931,6 +1343,93 @@ checkout_pkg_metadata_by_nevra (RpmOstreeContext *self, const char *nevra, const
 }
 
 /* Initiate download of rpm-md */
+typedef struct
+{
+  GPtrArray *repos; /* DnfRepo */
+  GError **errors;  /* One per repo */
+  GMutex lock;
+  guint n_done;
+} RepoUpdateData;
+
+static void
+update_repo_worker (gpointer data, gpointer user_data)
+{
+  const guint i = GPOINTER_TO_UINT (data) - 1;
+  auto udata = static_cast<RepoUpdateData *> (user_data);
+  auto repo = static_cast<DnfRepo *> (udata->repos->pdata[i]);
+  g_autoptr (DnfState) hifstate = dnf_state_new ();
+  (void)dnf_repo_update (repo, DNF_REPO_UPDATE_FLAG_FORCE, hifstate, &udata->errors[i]);
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&udata->lock);
+  udata->n_done++;
+}
+
+/* Update the metadata of @repos several at a time, since that's mostly
+ * waiting on the network; each repo has its own librepo handle. Errors are
+ * reported in the order of @repos. */
+static gboolean
+update_repos_in_parallel (RpmOstreeContext *self, GPtrArray *repos, GError **error)
+{
+  const guint n_threads = MIN (
+      repos->len, get_max_concurrent_repos (self->max_downloads, self->max_downloads_per_repo));
+  RepoUpdateData udata = { repos, g_new0 (GError *, repos->len) };
+  g_mutex_init (&udata.lock);
+  auto free_udata = [&udata] () {
+    for (guint i = 0; i < udata.repos->len; i++)
+      g_clear_error (&udata.errors[i]);
+    g_free (udata.errors);
+    g_mutex_clear (&udata.lock);
+  };
+
+  {
+    g_autofree char *msg = g_strdup_printf ("Updating metadata for %u repos", repos->len);
+    auto progress = rpmostreecxx::progress_nitems_begin (repos->len, msg);
+    GThreadPool *pool = g_thread_pool_new (update_repo_worker, &udata, n_threads, TRUE, error);
+    if (!pool)
+      {
+        free_udata ();
+        return FALSE;
+      }
+    for (guint i = 0; i < repos->len; i++)
+      {
+        if (!g_thread_pool_push (pool, GUINT_TO_POINTER (i + 1), error))
+          {
+            g_thread_pool_free (pool, TRUE, TRUE);
+            free_udata ();
+            return FALSE;
+          }
+      }
+    /* Wait for the workers, updating progress as we go */
+    while (TRUE)
+      {
+        guint n_done;
+        {
+          g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&udata.lock);
+          n_done = udata.n_done;
+        }
+        progress->nitems_update (n_done);
+        if (n_done == repos->len)
+          break;
+        g_usleep (G_USEC_PER_SEC / 10);
+      }
+    g_thread_pool_free (pool, FALSE, TRUE);
+    progress->end ("");
+  }
+
+  for (guint i = 0; i < repos->len; i++)
+    {
+      if (udata.errors[i])
+        {
+          auto repo = static_cast<DnfRepo *> (repos->pdata[i]);
+          g_propagate_prefixed_error (error, util::move_nullify (udata.errors[i]),
+                                      "Updating rpm-md repo '%s': ", dnf_repo_get_id (repo));
+          free_udata ();
+          return FALSE;
+        }
+    }
+  free_udata ();
+  return TRUE;
+}
+
 gboolean
 rpmostree_context_download_metadata (RpmOstreeContext *self, DnfContextSetupSackFlags flags,
                                      GCancellable *cancellable, GError **error)
@@ -940,8 +1439,17 @@ rpmostree_context_download_metadata (RpmOstreeContext *self, DnfContextSetupSack
   /* https://github.com/rpm-software-management/libdnf/pull/416
    * https://github.com/projectatomic/rpm-ostree/issues/1127
    */
+  if (self->low_memory)
+    flags = static_cast<DnfContextSetupSackFlags> (
+        static_cast<int> (flags) & ~DNF_CONTEXT_SETUP_SACK_FLAG_LOAD_UPDATEINFO);
+
   if (flags & DNF_CONTEXT_SETUP_SACK_FLAG_SKIP_FILELISTS)
     dnf_context_set_enable_filelists (self->dnfctx, FALSE);
+  else if (self->lazy_filelists)
+    {
+      dnf_context_set_enable_filelists (self->dnfctx, FALSE);
+      self->filelists_skipped = TRUE;
+    }
 
   g_autoptr (GPtrArray) rpmmd_repos
       = rpmostree_get_enabled_rpmmd_repos (self->dnfctx, DNF_REPO_ENABLED_PACKAGES);
@@ -953,8 +1461,11 @@ rpmostree_context_download_metadata (RpmOstreeContext *self, DnfContextSetupSack
 
       /* this is essentially a no-op */
       g_autoptr (DnfState) hifstate = dnf_state_new ();
+      const gint64 sack_start_time = g_get_monotonic_time ();
       if (!dnf_context_setup_sack_with_flags (self->dnfctx, hifstate, flags, error))
         return FALSE;
+      rpmostree_metrics_observe (RPMOSTREE_METRIC_SACK_LOAD,
+                                 g_get_monotonic_time () - sack_start_time);
 
       /* Note early return; no repos to fetch. */
       return TRUE;
@@ -976,10 +1487,31 @@ rpmostree_context_download_metadata (RpmOstreeContext *self, DnfContextSetupSack
     }
   rpmostree_output_message ("%s", enabled_repos->str);
 
-  g_autoptr (GHashTable) updated_repos = g_hash_table_new (NULL, NULL);
-  /* Update each repo individually, and print its timestamp, so users can keep
-   * track of repo up-to-dateness more easily.
+  /* For the cache_age bits, see https://github.com/projectatomic/rpm-ostree/pull/1562
+   * AKA a7bbf5bc142d9dac5b1bfb86d0466944d38baa24
+   * We have our own cache age as we want to default to G_MAXUINT so we
+   * respect the repo's metadata_expire if set.  But the compose tree path
+   * also sets this to 0 to force expiry.
+   */
+  guint cache_age = G_MAXUINT - 1;
+  switch (self->dnf_cache_policy)
+    {
+    case RPMOSTREE_CONTEXT_DNF_CACHE_FOREVER:
+      cache_age = G_MAXUINT;
+      break;
+    case RPMOSTREE_CONTEXT_DNF_CACHE_DEFAULT:
+      /* Handled above */
+      break;
+    case RPMOSTREE_CONTEXT_DNF_CACHE_NEVER:
+      cache_age = self->dnf_max_cache_age;
+      break;
+    }
+
+  /* Find the repos whose metadata needs updating; we print each repo's
+   * timestamp below, so users can keep track of repo up-to-dateness more
+   * easily.
    */
+  g_autoptr (GPtrArray) stale_repos = g_ptr_array_new ();
   for (guint i = 0; i < rpmmd_repos->len; i++)
     {
       auto repo = static_cast<DnfRepo *> (rpmmd_repos->pdata[i]);
@@ -989,47 +1521,41 @@ rpmostree_context_download_metadata (RpmOstreeContext *self, DnfContextSetupSack
       if (g_cancellable_set_error_if_cancelled (cancellable, error))
         return FALSE;
 
-      /* For the cache_age bits, see https://github.com/projectatomic/rpm-ostree/pull/1562
-       * AKA a7bbf5bc142d9dac5b1bfb86d0466944d38baa24
-       * We have our own cache age as we want to default to G_MAXUINT so we
-       * respect the repo's metadata_expire if set.  But the compose tree path
-       * also sets this to 0 to force expiry.
-       */
-      guint cache_age = G_MAXUINT - 1;
-      switch (self->dnf_cache_policy)
-        {
-        case RPMOSTREE_CONTEXT_DNF_CACHE_FOREVER:
-          cache_age = G_MAXUINT;
-          break;
-        case RPMOSTREE_CONTEXT_DNF_CACHE_DEFAULT:
-          /* Handled above */
-          break;
-        case RPMOSTREE_CONTEXT_DNF_CACHE_NEVER:
-          cache_age = 0;
-          break;
-        }
       if (!dnf_repo_check (repo, cache_age, hifstate, NULL))
-        {
-          dnf_state_reset (hifstate);
-          auto msg = g_strdup_printf ("Updating metadata for '%s'", dnf_repo_get_id (repo));
-          auto progress = rpmostreecxx::progress_percent_begin (msg);
-          guint progress_sigid = g_signal_connect (hifstate, "percentage-changed",
-                                                   G_CALLBACK (on_hifstate_percentage_changed),
-                                                   (void *)progress.get ());
-          if (!dnf_repo_update (repo, DNF_REPO_UPDATE_FLAG_FORCE, hifstate, error))
-            return glnx_prefix_error (error, "Updating rpm-md repo '%s'", dnf_repo_get_id (repo));
-
-          g_hash_table_add (updated_repos, repo);
-
-          g_signal_handler_disconnect (hifstate, progress_sigid);
-          progress->end ("");
-        }
+        g_ptr_array_add (stale_repos, repo);
+    }
+
+  if (stale_repos->len == 1)
+    {
+      auto repo = static_cast<DnfRepo *> (stale_repos->pdata[0]);
+      g_autoptr (DnfState) hifstate = dnf_state_new ();
+      g_autofree char *msg
+          = g_strdup_printf ("Updating metadata for '%s'", dnf_repo_get_id (repo));
+      auto progress = rpmostreecxx::progress_percent_begin (msg);
+      guint progress_sigid
+          = g_signal_connect (hifstate, "percentage-changed",
+                              G_CALLBACK (on_hifstate_percentage_changed), (void *)progress.get ());
+      if (!dnf_repo_update (repo, DNF_REPO_UPDATE_FLAG_FORCE, hifstate, error))
+        return glnx_prefix_error (error, "Updating rpm-md repo '%s'", dnf_repo_get_id (repo));
+
+      g_signal_handler_disconnect (hifstate, progress_sigid);
+      progress->end ("");
     }
+  else if (stale_repos->len > 1)
+    {
+      if (!update_repos_in_parallel (self, stale_repos, error))
+        return FALSE;
+    }
+
+  g_autoptr (GHashTable) updated_repos = g_hash_table_new (NULL, NULL);
+  for (guint i = 0; i < stale_repos->len; i++)
+    g_hash_table_add (updated_repos, stale_repos->pdata[i]);
 
   if (g_cancellable_set_error_if_cancelled (cancellable, error))
     return FALSE;
 
-  /* The _setup_sack function among other things imports the metadata into libsolv */
+  /* The _setup_sack function among other things imports the metadata into libsolv;
+   * it's serial, since all the repos go into the one libsolv pool. */
   {
     g_autoptr (DnfState) hifstate = dnf_state_new ();
     auto progress = rpmostreecxx::progress_percent_begin ("Importing rpm-md");
@@ -1045,8 +1571,11 @@ rpmostree_context_download_metadata (RpmOstreeContext *self, DnfContextSetupSack
     /* This will check the metadata again, but it *should* hit the cache; down
      * the line we should really improve the libdnf API around all of this.
      */
+    const gint64 sack_start_time = g_get_monotonic_time ();
     if (!dnf_context_setup_sack_with_flags (self->dnfctx, hifstate, flags, error))
       return FALSE;
+    rpmostree_metrics_observe (RPMOSTREE_METRIC_SACK_LOAD,
+                               g_get_monotonic_time () - sack_start_time);
     g_signal_handler_disconnect (hifstate, progress_sigid);
   }
 
@@ -1132,25 +1661,6 @@ get_pkgcache_repodata_chksum_repr (GVariant *commit, char **out_chksum_repr, gbo
   return TRUE;
 }
 
-static gboolean
-commit_has_matching_repodata_chksum_repr (GVariant *commit, const char *expected,
-                                          gboolean *out_matches, GError **error)
-{
-  g_autofree char *chksum_repr = NULL;
-  if (!get_pkgcache_repodata_chksum_repr (commit, &chksum_repr, TRUE, error))
-    return FALSE;
-
-  /* never match pkgs unpacked with older versions that didn't embed chksum_repr */
-  if (chksum_repr == NULL)
-    {
-      *out_matches = FALSE;
-      return TRUE;
-    }
-
-  *out_matches = g_str_equal (expected, chksum_repr);
-  return TRUE;
-}
-
 static gboolean
 pkg_is_cached (DnfPackage *pkg)
 {
@@ -1167,50 +1677,74 @@ pkg_is_cached (DnfPackage *pkg)
   return g_file_test (dnf_package_get_filename (pkg), G_FILE_TEST_EXISTS);
 }
 
-/* Given @pkg, return its state in the pkgcache repo. It could be not present,
- * or present but have been imported with a different SELinux policy version
- * (and hence in need of relabeling).
- */
+/* Load the pkgcache index, if we have a pkgcache; it's only valid as long as
+ * the pkgcache refs don't change, so this is done for each pass over the
+ * packages. */
 static gboolean
-find_pkg_in_ostree (RpmOstreeContext *self, DnfPackage *pkg, OstreeSePolicy *sepolicy,
-                    gboolean *out_in_ostree, gboolean *out_selinux_match, GError **error)
+load_pkgcache_index (RpmOstreeContext *self, RpmOstreePkgcacheIndex **out_index,
+                     GCancellable *cancellable, GError **error)
 {
-  OstreeRepo *repo = get_pkgcache_repo (self);
-  /* Init output here, since we have several early returns */
-  *out_in_ostree = FALSE;
-  auto selinux_enabled = self->treefile_rs->get_selinux ();
-  /* If there's no sepolicy, then we always match */
-  *out_selinux_match = (sepolicy == NULL || !selinux_enabled);
-
+  *out_index = NULL;
   /* NB: we're not using a pkgcache yet in the compose path */
+  OstreeRepo *repo = get_pkgcache_repo (self);
   if (repo == NULL)
-    return TRUE; /* Note early return */
-
-  g_autofree char *cachebranch = rpmostree_get_cache_branch_pkg (pkg);
-  g_autofree char *cached_rev = NULL;
-  if (!ostree_repo_resolve_rev (repo, cachebranch, TRUE, &cached_rev, error))
-    return FALSE;
-
-  if (!cached_rev)
-    return TRUE; /* Note early return */
-
-  /* Below here prefix with the branch */
-  const char *errprefix = glnx_strjoina ("Loading pkgcache branch ", cachebranch);
-  GLNX_AUTO_PREFIX_ERROR (errprefix, error);
+    return TRUE;
+  *out_index = rpmostree_pkgcache_index_new (repo, cancellable, error);
+  return *out_index != NULL;
+}
 
-  g_autoptr (GVariant) commit = NULL;
-  OstreeRepoCommitState commitstate;
-  if (!ostree_repo_load_commit (repo, cached_rev, &commit, &commitstate, error))
-    return FALSE;
-  g_assert (commit);
+/* Load what @index doesn't know yet about @packages in parallel. Only the
+ * repo reads are done from threads; libdnf isn't thread-safe, so the cache
+ * branches are computed here, and the packages are then classified in order
+ * on this thread. */
+static gboolean
+prefetch_pkgcache_index (RpmOstreePkgcacheIndex *index, GPtrArray *packages,
+                         GCancellable *cancellable, GError **error)
+{
+  if (index == NULL)
+    return TRUE;
+  g_autoptr (GPtrArray) cachebranches = g_ptr_array_new_with_free_func (g_free);
+  for (guint i = 0; i < packages->len; i++)
+    g_ptr_array_add (cachebranches,
+                     rpmostree_get_cache_branch_pkg ((DnfPackage *)packages->pdata[i]));
+  return rpmostree_pkgcache_index_prefetch (index, cachebranches, cancellable, error);
+}
+
+/* It's only a cache, and the repo may not be writable for e.g. --dry-run */
+static void
+flush_pkgcache_index (RpmOstreePkgcacheIndex *index, GCancellable *cancellable)
+{
+  g_autoptr (GError) local_error = NULL;
+  if (index && !rpmostree_pkgcache_index_flush (index, cancellable, &local_error))
+    g_debug ("%s", local_error->message);
+}
+
+/* Given @pkg, return its state in the pkgcache repo, as recorded in @index.
+ * It could be not present, or present but have been imported with a different
+ * SELinux policy version (and hence in need of relabeling).
+ */
+static gboolean
+find_pkg_in_ostree (RpmOstreeContext *self, RpmOstreePkgcacheIndex *index, DnfPackage *pkg,
+                    OstreeSePolicy *sepolicy, gboolean *out_in_ostree,
+                    gboolean *out_selinux_match, GCancellable *cancellable, GError **error)
+{
+  /* Init output here, since we have several early returns */
+  *out_in_ostree = FALSE;
+  auto selinux_enabled = self->treefile_rs->get_selinux ();
+  /* If there's no sepolicy, then we always match */
+  *out_selinux_match = (sepolicy == NULL || !selinux_enabled);
 
-  /* If the commit is partial, then we need to redownload. This can happen if e.g. corrupted
-   * commit objects were deleted with `ostree fsck --delete`. */
-  if (commitstate & OSTREE_REPO_COMMIT_STATE_PARTIAL)
+  if (index == NULL)
     return TRUE; /* Note early return */
 
-  g_autoptr (GVariant) metadata = g_variant_get_child_value (commit, 0);
-  g_autoptr (GVariantDict) metadata_dict = g_variant_dict_new (metadata);
+  g_autofree char *cachebranch = rpmostree_get_cache_branch_pkg (pkg);
+  g_autoptr (RpmOstreePkgcacheEntry) entry = NULL;
+  if (!rpmostree_pkgcache_index_lookup (index, cachebranch, &entry, cancellable, error))
+    return FALSE;
+
+  /* Not imported, or the commit is partial and we need to redownload */
+  if (!entry)
+    return TRUE; /* Note early return */
 
   /* NB: we do an exception for LocalPackages here; we've already checked that
    * its cache is valid and matches what's in the origin. We never want to fetch
@@ -1222,12 +1756,9 @@ find_pkg_in_ostree (RpmOstreeContext *self, DnfPackage *pkg, OstreeSePolicy *sep
     {
       CXX_TRY_VAR (expected_chksum_repr, rpmostreecxx::get_repodata_chksum_repr (*pkg), error);
 
-      gboolean same_pkg_chksum = FALSE;
-      if (!commit_has_matching_repodata_chksum_repr (commit, expected_chksum_repr.c_str (),
-                                                     &same_pkg_chksum, error))
-        return FALSE;
-
-      if (!same_pkg_chksum)
+      /* never match pkgs unpacked with older versions that didn't embed chksum_repr */
+      if (entry->repodata_chksum_repr == NULL
+          || !g_str_equal (expected_chksum_repr.c_str (), entry->repodata_chksum_repr))
         return TRUE; /* Note early return */
 
       /* We need to handle things like the nodocs flag changing; in that case we
@@ -1235,25 +1766,24 @@ find_pkg_in_ostree (RpmOstreeContext *self, DnfPackage *pkg, OstreeSePolicy *sep
        */
       const bool global_nodocs = (self->treefile_rs && !self->treefile_rs->get_documentation ());
 
-      gboolean pkgcache_commit_is_nodocs;
-      if (!g_variant_dict_lookup (metadata_dict, "rpmostree.nodocs", "b",
-                                  &pkgcache_commit_is_nodocs))
-        pkgcache_commit_is_nodocs = FALSE;
-
       /* We treat a mismatch of documentation state as simply not being
        * imported at all.
        */
-      if (global_nodocs != (bool)pkgcache_commit_is_nodocs)
+      if (global_nodocs != (bool)entry->nodocs)
         return TRUE;
     }
 
-  /* We found an import, let's load the sepolicy state */
+  /* We found an import, let's check the sepolicy state */
   *out_in_ostree = TRUE;
   if (sepolicy && selinux_enabled)
     {
-      CXX_TRY_VAR (selinux_match, rpmostreecxx::commit_has_matching_sepolicy (*commit, *sepolicy),
-                   error);
-      *out_selinux_match = !!selinux_match;
+      const char *sepolicy_csum = ostree_sepolicy_get_csum (sepolicy);
+      if (!sepolicy_csum)
+        return glnx_throw (error, "SELinux enabled, but no policy found");
+      if (!entry->sepolicy_csum)
+        return glnx_throw (error, "Loading pkgcache branch %s: Missing metadata key %s",
+                           cachebranch, "rpmostree.sepolicy");
+      *out_selinux_match = g_str_equal (sepolicy_csum, entry->sepolicy_csum);
     }
 
   return TRUE;
@@ -1287,12 +1817,123 @@ rpmostree_set_repos_on_packages (DnfContext *dnfctx, GPtrArray *packages)
     }
 }
 
+/* Reorder @pkgs (in place) to roughly the order the transaction will use
+ * them in, going only by the rpm-md metadata: each package comes after those
+ * in @pkgs providing something it requires, with cycles broken and ties
+ * resolved in the original order. This is available before we have any
+ * headers, unlike librpm's ordering.
+ */
+static void
+order_packages_from_metadata (DnfSack *sack, GPtrArray *pkgs)
+{
+  const guint n = pkgs->len;
+  if (n < 2)
+    return;
+
+  g_autoptr (DnfPackageSet) pset = dnf_packageset_new (sack);
+  g_autoptr (GHashTable) id_to_index = g_hash_table_new (NULL, NULL);
+  for (guint i = 0; i < n; i++)
+    {
+      auto pkg = static_cast<DnfPackage *> (pkgs->pdata[i]);
+      dnf_packageset_add (pset, pkg);
+      g_hash_table_insert (id_to_index, GINT_TO_POINTER (dnf_package_get_id (pkg)),
+                           GUINT_TO_POINTER (i));
+    }
+
+  /* Many packages have the same requirements, so look each up once */
+  g_autoptr (GHashTable) providers_cache
+      = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_array_unref);
+  g_autoptr (GPtrArray) dependents
+      = g_ptr_array_new_with_free_func ((GDestroyNotify)g_array_unref);
+  g_autofree guint *n_deps = g_new0 (guint, n);
+  for (guint i = 0; i < n; i++)
+    g_ptr_array_add (dependents, g_array_new (FALSE, FALSE, sizeof (guint)));
+
+  for (guint i = 0; i < n; i++)
+    {
+      auto pkg = static_cast<DnfPackage *> (pkgs->pdata[i]);
+      g_autoptr (DnfReldepList) reqs = dnf_package_get_requires (pkg);
+      const int n_requires = reqs ? dnf_reldep_list_count (reqs) : 0;
+      for (int j = 0; j < n_requires; j++)
+        {
+          g_autoptr (DnfReldep) req = dnf_reldep_list_index (reqs, j);
+          const char *reqstr = dnf_reldep_to_string (req);
+          auto providers = static_cast<GArray *> (g_hash_table_lookup (providers_cache, reqstr));
+          if (!providers)
+            {
+              providers = g_array_new (FALSE, FALSE, sizeof (guint));
+              hy_autoquery HyQuery query = hy_query_create (sack);
+              hy_query_filter_package_in (query, HY_PKG, HY_EQ, pset);
+              hy_query_filter_reldep (query, HY_PKG_PROVIDES, req);
+              g_autoptr (GPtrArray) matches = hy_query_run (query);
+              for (guint k = 0; k < matches->len; k++)
+                {
+                  auto match = static_cast<DnfPackage *> (matches->pdata[k]);
+                  gpointer idx;
+                  if (g_hash_table_lookup_extended (id_to_index,
+                                                    GINT_TO_POINTER (dnf_package_get_id (match)),
+                                                    NULL, &idx))
+                    {
+                      guint provider = GPOINTER_TO_UINT (idx);
+                      g_array_append_val (providers, provider);
+                    }
+                }
+              g_hash_table_insert (providers_cache, g_strdup (reqstr), providers);
+            }
+          for (guint k = 0; k < providers->len; k++)
+            {
+              guint provider = g_array_index (providers, guint, k);
+              if (provider == i)
+                continue;
+              g_array_append_val (static_cast<GArray *> (dependents->pdata[provider]), i);
+              n_deps[i]++;
+            }
+        }
+    }
+
+  /* Kahn's algorithm, always taking the earliest ready package; if there are
+   * none (a dependency cycle), just take the earliest remaining one. */
+  g_autofree gboolean *done = g_new0 (gboolean, n);
+  g_autoptr (GPtrArray) ordered = g_ptr_array_new_full (n, g_object_unref);
+  for (guint n_done = 0; n_done < n; n_done++)
+    {
+      guint next = G_MAXUINT;
+      for (guint i = 0; i < n && next == G_MAXUINT; i++)
+        {
+          if (!done[i] && n_deps[i] == 0)
+            next = i;
+        }
+      for (guint i = 0; i < n && next == G_MAXUINT; i++)
+        {
+          if (!done[i])
+            next = i;
+        }
+      done[next] = TRUE;
+      g_ptr_array_add (ordered, g_object_ref (pkgs->pdata[next]));
+      auto next_dependents = static_cast<GArray *> (dependents->pdata[next]);
+      for (guint k = 0; k < next_dependents->len; k++)
+        {
+          guint dependent = g_array_index (next_dependents, guint, k);
+          if (n_deps[dependent] > 0)
+            n_deps[dependent]--;
+        }
+    }
+
+  for (guint i = 0; i < n; i++)
+    {
+      g_object_unref (pkgs->pdata[i]);
+      pkgs->pdata[i] = g_steal_pointer (&ordered->pdata[i]);
+    }
+  g_ptr_array_set_free_func (ordered, NULL);
+}
+
 /* determine of all the marked packages, which ones we'll need to download,
  * which ones we'll need to import, and which ones we'll need to relabel */
 static gboolean
 sort_packages (RpmOstreeContext *self, GPtrArray *packages, GCancellable *cancellable,
                GError **error)
 {
+  rpmostreecxx::TraceSpan span ("sort-packages");
   DnfContext *dnfctx = self->dnfctx;
 
   g_assert (!self->pkgs_to_download);
@@ -1307,6 +1948,16 @@ sort_packages (RpmOstreeContext *self, GPtrArray *packages, GCancellable *cancel
   /* make sure all the non-cached pkgs have their repos set */
   rpmostree_set_repos_on_packages (dnfctx, packages);
 
+  if (!fetch_shared_noarch_imports (self, packages, cancellable, error))
+    return FALSE;
+  fetch_remote_pkgcache (self, packages, cancellable);
+
+  g_autoptr (RpmOstreePkgcacheIndex) pkgcache_index = NULL;
+  if (!load_pkgcache_index (self, &pkgcache_index, cancellable, error))
+    return FALSE;
+  if (!prefetch_pkgcache_index (pkgcache_index, packages, cancellable, error))
+    return FALSE;
+
   for (guint i = 0; i < packages->len; i++)
     {
       auto pkg = static_cast<DnfPackage *> (packages->pdata[i]);
@@ -1330,10 +1981,12 @@ sort_packages (RpmOstreeContext *self, GPtrArray *packages, GCancellable *cancel
       {
         gboolean in_ostree = FALSE;
         gboolean selinux_match = FALSE;
-        gboolean cached = pkg_is_cached (pkg);
 
-        if (!find_pkg_in_ostree (self, pkg, self->sepolicy, &in_ostree, &selinux_match, error))
+        if (!find_pkg_in_ostree (self, pkgcache_index, pkg, self->sepolicy, &in_ostree,
+                                 &selinux_match, cancellable, error))
           return FALSE;
+        /* Only matters if we need to import it */
+        gboolean cached = !in_ostree && pkg_is_cached (pkg);
 
         if (is_locally_cached && !self->is_container)
           g_assert (in_ostree);
@@ -1348,6 +2001,12 @@ sort_packages (RpmOstreeContext *self, GPtrArray *packages, GCancellable *cancel
       }
     }
 
+  flush_pkgcache_index (pkgcache_index, cancellable);
+
+  /* Fetch the packages the transaction starts with first, so they're the
+   * first ones ready */
+  order_packages_from_metadata (dnf_context_get_sack (dnfctx), self->pkgs_to_download);
+
   return TRUE;
 }
 
@@ -1392,15 +2051,19 @@ gv_nevra_hash (gconstpointer v)
   return g_str_hash (g_variant_get_string (nevra, NULL));
 }
 
-static const char *
-get_pkgname_source (GHashTable *replaced_pkgnames, const char *pkgname)
+/* Invert @replaced_pkgnames (source to set of pkgnames) into a map of
+ * pkgname to source, so that finding the source of a base package is a single
+ * lookup rather than one per source. Both keys and values are borrowed. */
+static GHashTable *
+index_pkgname_sources (GHashTable *replaced_pkgnames)
 {
+  GHashTable *pkgname_sources = g_hash_table_new (g_str_hash, g_str_equal);
   GLNX_HASH_TABLE_FOREACH_KV (replaced_pkgnames, const char *, source, GHashTable *, pkgnames)
     {
-      if (g_hash_table_contains (pkgnames, pkgname))
-        return source;
+      GLNX_HASH_TABLE_FOREACH (pkgnames, const char *, pkgname)
+        g_hash_table_insert (pkgname_sources, (gpointer)pkgname, (gpointer)source);
     }
-  return NULL;
+  return pkgname_sources;
 }
 
 /* Before hy_goal_lock(), this function was the only way for us to make sure that libsolv
@@ -1414,7 +2077,8 @@ get_pkgname_source (GHashTable *replaced_pkgnames, const char *pkgname)
  */
 static gboolean
 check_goal_solution (RpmOstreeContext *self, GPtrArray *removed_pkgnames,
-                     GHashTable *replaced_pkgnames, GError **error)
+                     GHashTable *removed_pkgnames_set, GHashTable *pkgname_sources,
+                     GError **error)
 {
   HyGoal goal = dnf_context_get_goal (self->dnfctx);
   CXX_TRY (rpmostreecxx::failpoint ("core::check-goal-solution"), error);
@@ -1436,7 +2100,7 @@ check_goal_solution (RpmOstreeContext *self, GPtrArray *removed_pkgnames,
         const char *nevra = dnf_package_get_nevra (pkg);
 
         /* did we expect this package to be removed? */
-        if (rpmostree_str_ptrarray_contains (removed_pkgnames, name))
+        if (g_hash_table_contains (removed_pkgnames_set, name))
           g_hash_table_insert (self->pkgs_to_remove, g_strdup (name), gv_nevra_from_pkg (pkg));
         else
           g_ptr_array_add (forbidden, g_strdup (nevra));
@@ -1515,7 +2179,7 @@ check_goal_solution (RpmOstreeContext *self, GPtrArray *removed_pkgnames,
                              dnf_package_get_nevra (pkg));
 
         /* did we expect this base pkg to be replaced? */
-        const char *source = get_pkgname_source (replaced_pkgnames, name);
+        auto source = static_cast<const char *> (g_hash_table_lookup (pkgname_sources, name));
         if (source)
           {
             GHashTable *replacements
@@ -1646,6 +2310,47 @@ add_remaining_pkgcache_pkgs (RpmOstreeContext *self, GHashTable *already_added,
   return TRUE;
 }
 
+/* For exact lockfiles: check that every requirement of the locked packages is
+ * provided by a locked package, so that a broken lockfile gets a clear error
+ * rather than a solver problem. Everything else is excluded from the sack at
+ * this point, so plain provides queries only see locked packages. */
+static gboolean
+check_locked_packages_closure (RpmOstreeContext *self, GPtrArray *locked_pkgs, GError **error)
+{
+  DnfSack *sack = dnf_context_get_sack (self->dnfctx);
+  /* Many packages have the same requirements, so look each up once */
+  g_autoptr (GHashTable) satisfied = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_autoptr (GPtrArray) unsatisfied = g_ptr_array_new_with_free_func (g_free);
+  for (guint i = 0; i < locked_pkgs->len; i++)
+    {
+      auto pkg = static_cast<DnfPackage *> (locked_pkgs->pdata[i]);
+      g_autoptr (DnfReldepList) reqs = dnf_package_get_requires (pkg);
+      const int n_requires = reqs ? dnf_reldep_list_count (reqs) : 0;
+      for (int j = 0; j < n_requires; j++)
+        {
+          g_autoptr (DnfReldep) req = dnf_reldep_list_index (reqs, j);
+          const char *reqstr = dnf_reldep_to_string (req);
+          /* Provided by rpm itself */
+          if (g_str_has_prefix (reqstr, "rpmlib("))
+            continue;
+          if (g_hash_table_contains (satisfied, reqstr))
+            continue;
+          hy_autoquery HyQuery query = hy_query_create (sack);
+          hy_query_filter_reldep (query, HY_PKG_PROVIDES, req);
+          g_autoptr (DnfPackageSet) pset = hy_query_run_set (query);
+          if (dnf_packageset_count (pset) > 0)
+            g_hash_table_add (satisfied, g_strdup (reqstr));
+          else
+            g_ptr_array_add (unsatisfied, g_strdup_printf ("%s (required by %s)", reqstr,
+                                                          dnf_package_get_nevra (pkg)));
+        }
+    }
+  if (unsatisfied->len > 0)
+    return throw_package_list (error, "Requirements not provided by locked packages",
+                               unsatisfied);
+  return TRUE;
+}
+
 /* Return all the packages that match lockfile constraints. Multiple packages may be
  * returned per NEVRA so that libsolv can respect e.g. repo costs. */
 static gboolean
@@ -1729,10 +2434,42 @@ find_locked_packages (RpmOstreeContext *self, GPtrArray **out_pkgs, GError **err
 }
 
 /* Check for/download new rpm-md, then depsolve */
+/* Fetch the filelists skipped because of lazy_filelists, and set up a new
+ * sack and goal with them. */
+static gboolean
+reload_metadata_with_filelists (RpmOstreeContext *self, GCancellable *cancellable,
+                                GError **error)
+{
+  self->lazy_filelists = FALSE;
+  self->filelists_skipped = FALSE;
+  dnf_context_set_enable_filelists (self->dnfctx, TRUE);
+
+  g_autoptr (GPtrArray) rpmmd_repos
+      = rpmostree_get_enabled_rpmmd_repos (self->dnfctx, DNF_REPO_ENABLED_PACKAGES);
+  g_autoptr (GPtrArray) missing_repos = g_ptr_array_new ();
+  for (guint i = 0; i < rpmmd_repos->len; i++)
+    {
+      auto repo = static_cast<DnfRepo *> (rpmmd_repos->pdata[i]);
+      if (dnf_repo_get_filename_md (repo, "filelists") == NULL)
+        g_ptr_array_add (missing_repos, repo);
+    }
+  if (missing_repos->len > 0 && !update_repos_in_parallel (self, missing_repos, error))
+    return FALSE;
+
+  /* prepare() recreates this */
+  g_clear_pointer (&self->fileoverride_pkgs, g_hash_table_unref);
+  if (!rpmostree_context_download_metadata (self, DNF_CONTEXT_SETUP_SACK_FLAG_LOAD_UPDATEINFO,
+                                            cancellable, error))
+    return FALSE;
+  journal_rpmmd_info (self);
+  return TRUE;
+}
+
 gboolean
 rpmostree_context_prepare (RpmOstreeContext *self, GCancellable *cancellable, GError **error)
 {
   g_assert (!self->empty);
+  rpmostreecxx::TraceSpan span ("prepare");
 
   DnfContext *dnfctx = self->dnfctx;
 
@@ -1892,6 +2629,24 @@ rpmostree_context_prepare (RpmOstreeContext *self, GCancellable *cancellable, GE
           map_subtract (map, dnf_packageset_get_map (locked_pset));
           dnf_sack_add_excludes (sack, pset);
           dnf_packageset_free (pset);
+
+          /* In exact mode, the lockfile *is* the transaction: ask for each locked
+           * package directly, so that every solver decision is already made by
+           * a job and there's nothing left to search. The treefile packages
+           * below then just resolve to locked packages. */
+          if (self->lockfile_exact)
+            {
+              if (!check_locked_packages_closure (self, locked_pkgs, error))
+                return FALSE;
+              /* Install one package per NEVRA; the same one may be in several repos */
+              g_autoptr (GHashTable) nevras = g_hash_table_new (g_str_hash, g_str_equal);
+              for (guint i = 0; i < locked_pkgs->len; i++)
+                {
+                  auto pkg = static_cast<DnfPackage *> (locked_pkgs->pdata[i]);
+                  if (g_hash_table_add (nevras, (gpointer)dnf_package_get_nevra (pkg)))
+                    hy_goal_install (goal, pkg);
+                }
+            }
         }
       else
         {
@@ -2094,6 +2849,12 @@ rpmostree_context_prepare (RpmOstreeContext *self, GCancellable *cancellable, GE
   if (missing_pkgs && missing_pkgs->len > 0)
     return throw_package_list (error, "Packages not found", missing_pkgs);
 
+  /* From here on, only look up override sources and removals by pkgname */
+  g_autoptr (GHashTable) pkgname_sources = index_pkgname_sources (replaced_pkgnames);
+  g_autoptr (GHashTable) removed_pkgnames_set = g_hash_table_new (g_str_hash, g_str_equal);
+  for (guint i = 0; i < removed_pkgnames->len; i++)
+    g_hash_table_add (removed_pkgnames_set, removed_pkgnames->pdata[i]);
+
   /* And lock all the base packages we don't expect to be replaced. */
   {
     hy_autoquery HyQuery query = hy_query_create (sack);
@@ -2105,8 +2866,8 @@ rpmostree_context_prepare (RpmOstreeContext *self, GCancellable *cancellable, GE
         const char *pkgname = dnf_package_get_name (pkg);
         g_assert (pkgname);
 
-        if (rpmostree_str_ptrarray_contains (removed_pkgnames, pkgname)
-            || get_pkgname_source (replaced_pkgnames, pkgname) != NULL)
+        if (g_hash_table_contains (removed_pkgnames_set, pkgname)
+            || g_hash_table_contains (pkgname_sources, pkgname))
           continue;
         if (hy_goal_lock (goal, pkg, error) != 0)
           return glnx_prefix_error (error, "while locking pkg '%s'", pkgname);
@@ -2114,12 +2875,30 @@ rpmostree_context_prepare (RpmOstreeContext *self, GCancellable *cancellable, GE
   }
 
   auto actions = static_cast<DnfGoalActions> (DNF_INSTALL | DNF_ALLOW_UNINSTALL);
-  if (!self->treefile_rs->get_recommends ())
+  /* With an exact lockfile, weak deps were already decided when it was written */
+  if (!self->treefile_rs->get_recommends () || self->lockfile_exact)
     actions = static_cast<DnfGoalActions> (static_cast<int> (actions) | DNF_IGNORE_WEAK_DEPS);
   auto task = rpmostreecxx::progress_begin_task ("Resolving dependencies");
   /* XXX: consider a --allow-uninstall switch? */
-  if (!dnf_goal_depsolve (goal, actions, error)
-      || !check_goal_solution (self, removed_pkgnames, replaced_pkgnames, error))
+  g_autoptr (GError) local_error = NULL;
+  if (!dnf_goal_depsolve (goal, actions, &local_error))
+    {
+      /* Without the filelists, a dependency on a path outside of the primary
+       * metadata (e.g. /usr/libexec/foo) can't be resolved; that's the only
+       * case worth refetching them for. */
+      if (self->filelists_skipped && strstr (local_error->message, "nothing provides /"))
+        {
+          task->end ("");
+          rpmostree_output_message ("Dependencies need rpm-md filelists; retrying with them");
+          if (!reload_metadata_with_filelists (self, cancellable, error))
+            return FALSE;
+          return rpmostree_context_prepare (self, cancellable, error);
+        }
+      g_propagate_error (error, util::move_nullify (local_error));
+      return FALSE;
+    }
+  if (!check_goal_solution (self, removed_pkgnames, removed_pkgnames_set, pkgname_sources,
+                            error))
     return FALSE;
   g_clear_pointer (&self->pkgs, (GDestroyNotify)g_ptr_array_unref);
   self->pkgs = dnf_goal_get_packages (goal, DNF_PACKAGE_INFO_INSTALL, DNF_PACKAGE_INFO_UPDATE,
@@ -2157,11 +2936,37 @@ rpmostree_context_set_lockfile (RpmOstreeContext *self, char **lockfiles, gboole
   for (char **it = lockfiles; it && *it; it++)
     rs_lockfiles.push_back (std::string (*it));
   CXX_TRY_VAR (lockfile, rpmostreecxx::lockfile_read (rs_lockfiles), error);
+
+  /* For rpmostree_context_get_presolve_digest() */
+  g_autoptr (RpmOstreeHasher) checksum = rpmostree_hasher_new (G_CHECKSUM_SHA256);
+  for (char **it = lockfiles; it && *it; it++)
+    {
+      gsize len;
+      g_autofree char *contents = glnx_file_get_contents_utf8_at (AT_FDCWD, *it, &len, NULL, error);
+      if (!contents)
+        return FALSE;
+      rpmostree_hasher_update (checksum, (const guint8 *)contents, len + 1);
+    }
+  rpmostree_hasher_update (checksum, (const guint8 *)(strict ? "strict" : ""), strict ? 6 : 0);
+
   self->lockfile = std::move (lockfile);
   self->lockfile_strict = strict;
+  self->lockfile_digest = g_strdup (rpmostree_hasher_get_string (checksum));
   return TRUE;
 }
 
+/* Declare that the strict lockfile lists exactly the packages to install,
+ * i.e. it's the complete result of a previous depsolve. The solver then only
+ * has to confirm the locked set rather than search for a solution. Like
+ * rpmostree_context_set_lockfile(), this must be called *before*
+ * rpmostree_context_setup(). */
+void
+rpmostree_context_set_lockfile_exact (RpmOstreeContext *self)
+{
+  g_assert (self->lockfile && self->lockfile_strict);
+  self->lockfile_exact = TRUE;
+}
+
 /* XXX: push this into libdnf */
 static const char *
 convert_dnf_action_to_string (DnfStateAction action)
@@ -2191,7 +2996,7 @@ convert_dnf_action_to_string (DnfStateAction action)
  * This can be used to efficiently see if the goal has changed from a previous one.
  */
 gboolean
-rpmostree_dnf_add_checksum_goal (GChecksum *checksum, HyGoal goal, OstreeRepo *pkgcache,
+rpmostree_dnf_add_checksum_goal (RpmOstreeHasher *checksum, HyGoal goal, OstreeRepo *pkgcache,
                                  GError **error)
 {
   g_autoptr (GPtrArray) pkglist = dnf_goal_get_packages (
@@ -2204,7 +3009,7 @@ rpmostree_dnf_add_checksum_goal (GChecksum *checksum, HyGoal goal, OstreeRepo *p
       auto pkg = static_cast<DnfPackage *> (pkglist->pdata[i]);
       DnfStateAction action = dnf_package_get_action (pkg);
       const char *action_str = convert_dnf_action_to_string (action);
-      g_checksum_update (checksum, (guint8 *)action_str, strlen (action_str));
+      rpmostree_hasher_update (checksum, (guint8 *)action_str, strlen (action_str));
 
       /* For pkgs that were added from the pkgcache repo (e.g. local RPMs and replacement
        * overrides), make sure to pick up the SHA256 from the pkg metadata, rather than what
@@ -2231,13 +3036,13 @@ rpmostree_dnf_add_checksum_goal (GChecksum *checksum, HyGoal goal, OstreeRepo *p
 
           if (chksum_repr)
             {
-              g_checksum_update (checksum, (guint8 *)chksum_repr, strlen (chksum_repr));
+              rpmostree_hasher_update (checksum, (guint8 *)chksum_repr, strlen (chksum_repr));
               continue;
             }
         }
 
       CXX_TRY_VAR (chksum_repr, rpmostreecxx::get_repodata_chksum_repr (*pkg), error);
-      g_checksum_update (checksum, (guint8 *)chksum_repr.data (), chksum_repr.size ());
+      rpmostree_hasher_update (checksum, (guint8 *)chksum_repr.data (), chksum_repr.size ());
     }
 
   return TRUE;
@@ -2246,11 +3051,12 @@ rpmostree_dnf_add_checksum_goal (GChecksum *checksum, HyGoal goal, OstreeRepo *p
 char *
 rpmostree_context_get_state_digest (RpmOstreeContext *self, GChecksumType algo, GError **error)
 {
-  g_autoptr (GChecksum) state_checksum = g_checksum_new (algo);
+  g_autoptr (RpmOstreeHasher) state_checksum = rpmostree_hasher_new (algo);
   /* Hash in the treefile inputs (this includes all externals like postprocess, add-files,
    * etc... and the final flattened treefile -- see treefile.rs for more details). */
   CXX_TRY_VAR (tf_checksum, self->treefile_rs->get_checksum (*self->ostreerepo), error);
-  g_checksum_update (state_checksum, (const guint8 *)tf_checksum.data (), tf_checksum.size ());
+  rpmostree_hasher_update (state_checksum, (const guint8 *)tf_checksum.data (),
+                           tf_checksum.size ());
 
   if (!self->empty)
     {
@@ -2259,7 +3065,60 @@ rpmostree_context_get_state_digest (RpmOstreeContext *self, GChecksumType algo,
         return NULL;
     }
 
-  return g_strdup (g_checksum_get_string (state_checksum));
+  return g_strdup (rpmostree_hasher_get_string (state_checksum));
+}
+
+/* Hash the configuration and rpm-md metadata of the enabled repos into
+ * @checksum. Must be called after the metadata is downloaded. */
+void
+rpmostree_dnf_add_checksum_repos (RpmOstreeHasher *checksum, DnfContext *dnfctx)
+{
+  g_autoptr (GPtrArray) repos
+      = rpmostree_get_enabled_rpmmd_repos (dnfctx, DNF_REPO_ENABLED_PACKAGES);
+  for (guint i = 0; i < repos->len; i++)
+    {
+      auto repo = static_cast<DnfRepo *> (repos->pdata[i]);
+      const char *id = dnf_repo_get_id (repo);
+      rpmostree_hasher_update (checksum, (const guint8 *)id, strlen (id) + 1);
+      g_autofree char *repomd
+          = g_build_filename (dnf_repo_get_location (repo), "repodata/repomd.xml", NULL);
+      const char *files[] = { dnf_repo_get_filename (repo), repomd };
+      for (guint j = 0; j < G_N_ELEMENTS (files); j++)
+        {
+          g_autofree char *contents = NULL;
+          gsize len = 0;
+          /* A missing file just hashes as empty */
+          if (files[j] && g_file_get_contents (files[j], &contents, &len, NULL))
+            rpmostree_hasher_update (checksum, (const guint8 *)contents, len);
+          rpmostree_hasher_update (checksum, (const guint8 *)"", 1);
+        }
+    }
+}
+
+/* A digest of the inputs to the depsolve in prepare(): the treefile, any
+ * lockfile, the enabled rpm-md repos and our version. This is available
+ * before depsolving, and if it's unchanged, then so is the result of
+ * rpmostree_context_get_state_digest(). It doesn't cover packages from the
+ * pkgcache, so callers with those need to hash in where they come from. Must
+ * be called after the metadata is downloaded.
+ */
+char *
+rpmostree_context_get_presolve_digest (RpmOstreeContext *self, GChecksumType algo, GError **error)
+{
+  g_autoptr (RpmOstreeHasher) checksum = rpmostree_hasher_new (algo);
+  rpmostree_hasher_update (checksum, (const guint8 *)PACKAGE_VERSION, strlen (PACKAGE_VERSION) + 1);
+  CXX_TRY_VAR (tf_checksum, self->treefile_rs->get_checksum (*self->ostreerepo), error);
+  rpmostree_hasher_update (checksum, (const guint8 *)tf_checksum.data (), tf_checksum.size ());
+  const char *arch = dnf_context_get_base_arch (self->dnfctx);
+  rpmostree_hasher_update (checksum, (const guint8 *)arch, strlen (arch) + 1);
+  if (self->lockfile_digest)
+    rpmostree_hasher_update (checksum, (const guint8 *)self->lockfile_digest,
+                             strlen (self->lockfile_digest));
+  if (self->lockfile_exact)
+    rpmostree_hasher_update (checksum, (const guint8 *)"exact", 5);
+  rpmostree_hasher_update (checksum, (const guint8 *)"", 1);
+  rpmostree_dnf_add_checksum_repos (checksum, self->dnfctx);
+  return g_strdup (rpmostree_hasher_get_string (checksum));
 }
 
 static GHashTable *
@@ -2293,137 +3152,642 @@ gather_source_to_packages (GPtrArray *packages)
   return util::move_nullify (source_to_packages);
 }
 
-gboolean
-rpmostree_download_packages (GPtrArray *packages, GCancellable *cancellable, GError **error)
+static void
+on_download_cancelled (GCancellable *cancellable, gpointer user_data)
 {
-  guint progress_sigid;
-  g_autoptr (GHashTable) source_to_packages = gather_source_to_packages (packages);
-  GLNX_HASH_TABLE_FOREACH_KV (source_to_packages, DnfRepo *, src, GPtrArray *, src_packages)
-    {
-      glnx_unref_object DnfState *hifstate = dnf_state_new ();
-      auto msg = g_strdup_printf ("Downloading from '%s'", dnf_repo_get_id (src));
-      auto progress = rpmostreecxx::progress_percent_begin (msg);
-      progress_sigid
-          = g_signal_connect (hifstate, "percentage-changed",
-                              G_CALLBACK (on_hifstate_percentage_changed), (void *)progress.get ());
-      g_autofree char *target_dir
-          = g_build_filename (dnf_repo_get_location (src), "/packages/", NULL);
-      if (!glnx_shutil_mkdir_p_at (AT_FDCWD, target_dir, 0755, cancellable, error))
-        return FALSE;
+  g_cancellable_cancel (G_CANCELLABLE (user_data));
+}
 
-      if (!dnf_repo_download_packages (src, src_packages, target_dir, hifstate, error))
-        return glnx_prefix_error (error, "Downloading from '%s'", dnf_repo_get_id (src));
+/* Download @pkgs, which must all come from @src, into @target_dir, or the
+ * repo's package cache directory if %NULL. */
+static gboolean
+download_packages_from_repo (DnfRepo *src, GPtrArray *pkgs, const char *target_dir,
+                             DnfState *hifstate, GCancellable *cancellable, GError **error)
+{
+  g_autofree char *cache_dir = NULL;
+  if (!target_dir)
+    target_dir = cache_dir = g_build_filename (dnf_repo_get_location (src), "/packages/", NULL);
+  if (!glnx_shutil_mkdir_p_at (AT_FDCWD, target_dir, 0755, cancellable, error))
+    return FALSE;
 
-      g_signal_handler_disconnect (hifstate, progress_sigid);
-    }
+  /* libdnf checks the state's cancellable from librepo's progress callback,
+   * so this aborts the transfers in flight rather than after them. */
+  GCancellable *state_cancellable = dnf_state_get_cancellable (hifstate);
+  gulong cancel_id = 0;
+  if (cancellable && !state_cancellable)
+    dnf_state_set_cancellable (hifstate, cancellable);
+  else if (cancellable && state_cancellable != cancellable)
+    cancel_id = g_cancellable_connect (cancellable, G_CALLBACK (on_download_cancelled),
+                                       state_cancellable, NULL);
+  const gboolean downloaded = dnf_repo_download_packages (src, pkgs, target_dir, hifstate, error);
+  if (cancel_id)
+    g_cancellable_disconnect (cancellable, cancel_id);
+  if (!downloaded)
+    return glnx_prefix_error (error, "Downloading from '%s'", dnf_repo_get_id (src));
 
   return TRUE;
 }
 
-gboolean
-rpmostree_find_and_download_packages (const char *const *packages, const char *source,
-                                      const char *source_root, const char *repo_root,
-                                      GUnixFDList **out_fd_list, GCancellable *cancellable,
-                                      GError **error)
+/* A set of packages from a single repo which are downloaded together in a
+ * worker thread. */
+typedef struct
 {
-  CXX_TRY_VAR (parsed_source, rpmostreecxx::parse_override_source (source), error);
-
-  g_autoptr (RpmOstreeContext) ctx = rpmostree_context_new_base (NULL);
-  if (!rpmostree_context_setup (ctx, NULL, source_root, cancellable, error))
-    return glnx_prefix_error (error, "Setting up dnf context");
-
-  g_autofree char *reposdir = g_build_filename (repo_root ?: source_root, "etc/yum.repos.d", NULL);
-  dnf_context_set_repo_dir (ctx->dnfctx, reposdir);
-
-  if (!rpmostree_context_download_metadata (ctx, DNF_CONTEXT_SETUP_SACK_FLAG_SKIP_RPMDB,
-                                            cancellable, error))
-    return glnx_prefix_error (error, "Downloading metadata");
-
-  g_autoptr (GPtrArray) pkgs = g_ptr_array_new_with_free_func (g_object_unref);
-  DnfSack *sack = dnf_context_get_sack (rpmostree_context_get_dnf (ctx));
-  switch (parsed_source.kind)
-    {
-    case rpmostreecxx::OverrideReplacementType::Repo:
-      {
-        const char *repo = parsed_source.name.c_str ();
-        for (const char *const *it = packages; it && *it; it++)
-          {
-            g_auto (HySubject) subject = hy_subject_create (static_cast<const char *> (*it));
-            HyNevra nevra = NULL;
-            hy_autoquery HyQuery query = hy_subject_get_best_solution (
-                subject, sack, NULL, &nevra, FALSE, TRUE, FALSE, FALSE, FALSE);
-            hy_query_filter (query, HY_PKG_REPONAME, HY_EQ, repo);
-            hy_query_filter_num (query, HY_PKG_LATEST_PER_ARCH_BY_PRIORITY, HY_EQ, 1);
-            g_autoptr (GPtrArray) results = hy_query_run (query);
-            if (!results || results->len == 0)
-              return glnx_throw (error, "No matches for \"%s\" in repo '%s'", subject, repo);
-            g_ptr_array_add (pkgs, g_object_ref (results->pdata[0]));
-          }
-        break;
-      }
-    default:
-      return glnx_throw (error, "Unsupported source type used in '%s'", source);
-    }
+  DnfRepo *repo;
+  GPtrArray *pkgs;
+  guint64 size;
+  const char *target_dir; /* Borrowed; NULL for the package cache */
+  gboolean started;
+  gint percent; /* Updated atomically from the download thread */
+} RpmOstreeDownloadBatch;
 
-  rpmostree_set_repos_on_packages (rpmostree_context_get_dnf (ctx), pkgs);
-
-  if (!rpmostree_download_packages (pkgs, cancellable, error))
-    return glnx_prefix_error (error, "Downloading packages");
+static void
+rpmostree_download_batch_free (RpmOstreeDownloadBatch *batch)
+{
+  g_ptr_array_unref (batch->pkgs);
+  g_free (batch);
+}
 
-  g_autoptr (GUnixFDList) fd_list = g_unix_fd_list_new ();
-  for (unsigned int i = 0; i < pkgs->len; i++)
+/* Split @packages into per-repo batches of at most @max_batch_size bytes (but
+ * always at least one package). A @max_batch_size of 0 means one batch per
+ * repo. */
+static GPtrArray *
+gather_download_batches (GPtrArray *packages, guint64 max_batch_size)
+{
+  g_autoptr (GPtrArray) batches
+      = g_ptr_array_new_with_free_func ((GDestroyNotify)rpmostree_download_batch_free);
+  g_autoptr (GHashTable) source_to_packages = gather_source_to_packages (packages);
+  GLNX_HASH_TABLE_FOREACH_KV (source_to_packages, DnfRepo *, src, GPtrArray *, src_packages)
     {
-      DnfPackage *pkg = static_cast<DnfPackage *> (pkgs->pdata[i]);
-      const char *path = dnf_package_get_filename (pkg);
-
-      glnx_autofd int fd = -1;
-      if (!glnx_openat_rdonly (AT_FDCWD, path, TRUE, &fd, error))
-        return FALSE;
-
-      if (g_unix_fd_list_append (fd_list, fd, error) < 0)
-        return FALSE;
-
-      if (!rpmostree_pkg_is_local (pkg))
+      RpmOstreeDownloadBatch *batch = NULL;
+      for (guint i = 0; i < src_packages->len; i++)
         {
-          if (!glnx_unlinkat (AT_FDCWD, path, 0, error))
-            return FALSE;
+          auto pkg = static_cast<DnfPackage *> (src_packages->pdata[i]);
+          guint64 pkg_size = dnf_package_get_downloadsize (pkg);
+          if (batch && max_batch_size > 0 && batch->size + pkg_size > max_batch_size)
+            batch = NULL;
+          if (!batch)
+            {
+              batch = g_new0 (RpmOstreeDownloadBatch, 1);
+              batch->repo = src;
+              batch->pkgs = g_ptr_array_new ();
+              g_ptr_array_add (batches, batch);
+            }
+          g_ptr_array_add (batch->pkgs, pkg);
+          batch->size += pkg_size;
         }
     }
-
-  *out_fd_list = util::move_nullify (fd_list);
-  return TRUE;
+  return util::move_nullify (batches);
 }
 
-gboolean
-rpmostree_context_download (RpmOstreeContext *self, GCancellable *cancellable, GError **error)
+/* Find the first batch which hasn't been started and whose repo isn't
+ * busy. We only download from a given repo in one thread at a time;
+ * librepo already parallelizes connections within a repo. */
+static RpmOstreeDownloadBatch *
+next_download_batch (GPtrArray *batches, GHashTable *busy_repos)
 {
-  int n = self->pkgs_to_download->len;
-
-  if (n > 0)
+  for (guint i = 0; i < batches->len; i++)
     {
-      guint64 size = dnf_package_array_get_download_size (self->pkgs_to_download);
-      g_autofree char *sizestr = g_format_size (size);
-      rpmostree_output_message ("Will download: %u package%s (%s)", n, _NS (n), sizestr);
+      auto batch = static_cast<RpmOstreeDownloadBatch *> (batches->pdata[i]);
+      if (!batch->started && !g_hash_table_contains (busy_repos, batch->repo))
+        return batch;
     }
-  else
-    return TRUE;
+  return NULL;
+}
 
-  // For now just make this a warning for debugging https://github.com/coreos/rpm-ostree/issues/4565
-  // It may be that people are actually relying on this behavior too...
-  if (self->dnf_cache_policy == RPMOSTREE_CONTEXT_DNF_CACHE_FOREVER)
-    g_printerr ("warning: Found %u packages to download in cache-only mode\n",
-                self->pkgs_to_download->len);
-  return rpmostree_download_packages (self->pkgs_to_download, cancellable, error);
+/* Overall completion of @batches, weighted by size */
+static guint
+download_batches_get_percent (GPtrArray *batches)
+{
+  guint64 total = 0;
+  guint64 done = 0;
+  for (guint i = 0; i < batches->len; i++)
+    {
+      auto batch = static_cast<RpmOstreeDownloadBatch *> (batches->pdata[i]);
+      total += batch->size;
+      done += batch->size * g_atomic_int_get (&batch->percent) / 100;
+    }
+  if (total == 0)
+    return 100;
+  return (guint)(done * 100 / total);
 }
 
-static gboolean async_imports_mainctx_iter (gpointer user_data);
+static void
+on_batch_percentage_changed (DnfState *hifstate, guint percentage, gpointer user_data)
+{
+  auto batch = static_cast<RpmOstreeDownloadBatch *> (user_data);
+  g_atomic_int_set (&batch->percent, percentage);
+}
 
-/* Called on completion of an async import; runs on main thread */
 static void
-on_async_import_done (GObject *obj, GAsyncResult *res, gpointer user_data)
+download_batch_in_thread (GTask *task, gpointer source, gpointer task_data,
+                          GCancellable *cancellable)
 {
-  auto importer = (RpmOstreeImporter *)(obj);
-  auto self = static_cast<RpmOstreeContext *> (user_data);
+  g_autoptr (GError) local_error = NULL;
+  auto batch = static_cast<RpmOstreeDownloadBatch *> (task_data);
+  /* Progress is only recorded here; it's rendered from the main thread */
+  glnx_unref_object DnfState *hifstate = dnf_state_new ();
+  g_signal_connect (hifstate, "percentage-changed", G_CALLBACK (on_batch_percentage_changed),
+                    batch);
+  if (!download_packages_from_repo (batch->repo, batch->pkgs, batch->target_dir, hifstate,
+                                    cancellable, &local_error))
+    g_task_return_error (task, util::move_nullify (local_error));
+  else
+    {
+      g_atomic_int_set (&batch->percent, 100);
+      g_task_return_boolean (task, TRUE);
+    }
+}
+
+/* Start downloading @batch in a worker thread, marking its repo as busy */
+static void
+start_download_batch (RpmOstreeDownloadBatch *batch, GHashTable *busy_repos,
+                      GCancellable *cancellable, GAsyncReadyCallback callback, gpointer user_data)
+{
+  g_assert (!batch->started);
+  batch->started = TRUE;
+  g_hash_table_add (busy_repos, batch->repo);
+  g_autoptr (GTask) task = g_task_new (NULL, cancellable, callback, user_data);
+  /* Lifetime is owned by the caller's batch array */
+  g_task_set_task_data (task, batch, NULL);
+  g_task_run_in_thread (task, download_batch_in_thread);
+}
+
+/* Number of repos to download from concurrently so that we stay under
+ * @max_downloads total connections. */
+static guint
+get_max_concurrent_repos (guint max_downloads, guint max_downloads_per_repo)
+{
+  if (max_downloads_per_repo == 0)
+    max_downloads_per_repo = RPMOSTREE_LIBDNF_DEFAULT_DOWNLOADS_PER_REPO;
+  return MAX (1, max_downloads / max_downloads_per_repo);
+}
+
+typedef struct
+{
+  GPtrArray *batches;
+  GHashTable *busy_repos;
+  guint n_running;
+  guint max_running;
+  GCancellable *cancellable;
+  GError *error;
+  rpmostreecxx::Progress *progress;
+  guint last_percent;
+} RpmOstreeDownloadData;
+
+static void download_packages_iter (RpmOstreeDownloadData *data);
+
+/* Called on completion of a download batch; runs on main thread */
+static void
+on_download_batch_done (GObject *obj, GAsyncResult *res, gpointer user_data)
+{
+  auto data = static_cast<RpmOstreeDownloadData *> (user_data);
+  auto batch = static_cast<RpmOstreeDownloadBatch *> (g_task_get_task_data (G_TASK (res)));
+
+  g_hash_table_remove (data->busy_repos, batch->repo);
+  g_assert_cmpuint (data->n_running, >, 0);
+  data->n_running--;
+  if (!g_task_propagate_boolean (G_TASK (res), data->error ? NULL : &data->error))
+    {
+      if (data->cancellable)
+        g_cancellable_cancel (data->cancellable);
+    }
+
+  download_packages_iter (data);
+}
+
+static void
+download_packages_iter (RpmOstreeDownloadData *data)
+{
+  while (data->error == NULL && data->n_running < data->max_running)
+    {
+      auto batch = next_download_batch (data->batches, data->busy_repos);
+      if (!batch)
+        break;
+      start_download_batch (batch, data->busy_repos, data->cancellable, on_download_batch_done,
+                            data);
+      data->n_running++;
+    }
+}
+
+/* Periodically render the aggregate progress of a concurrent download; the
+ * worker threads only record their percentage. */
+static gboolean
+on_download_progress_timeout (gpointer user_data)
+{
+  auto data = static_cast<RpmOstreeDownloadData *> (user_data);
+  guint percent = download_batches_get_percent (data->batches);
+  if (percent != data->last_percent)
+    {
+      data->progress->percent_update (percent);
+      data->last_percent = percent;
+    }
+  return G_SOURCE_CONTINUE;
+}
+
+/* Download @packages, fetching from up to @max_concurrent_repos repos at
+ * once, with a single aggregated progress bar. */
+static gboolean
+download_packages_concurrently (GPtrArray *packages, guint max_concurrent_repos,
+                                GCancellable *cancellable, GError **error)
+{
+  g_autoptr (GPtrArray) batches = gather_download_batches (packages, 0);
+  if (batches->len == 0)
+    return TRUE;
+
+  g_autofree char *msg = NULL;
+  if (batches->len == 1)
+    {
+      auto batch = static_cast<RpmOstreeDownloadBatch *> (batches->pdata[0]);
+      msg = g_strdup_printf ("Downloading from '%s'", dnf_repo_get_id (batch->repo));
+    }
+  else
+    msg = g_strdup_printf ("Downloading from %u repos", batches->len);
+  auto progress = rpmostreecxx::progress_percent_begin (msg);
+
+  g_autoptr (GHashTable) busy_repos = g_hash_table_new (NULL, NULL);
+  RpmOstreeDownloadData data = {
+    batches, busy_repos, 0, MAX (1, max_concurrent_repos), cancellable, NULL, progress.get (), 0,
+  };
+
+  GMainContext *mainctx = g_main_context_get_thread_default ();
+  g_autoptr (GSource) progress_src = g_timeout_source_new (100);
+  g_source_set_callback (progress_src, on_download_progress_timeout, &data, NULL);
+  g_source_attach (progress_src, mainctx);
+
+  download_packages_iter (&data);
+  while (data.n_running > 0)
+    g_main_context_iteration (mainctx, TRUE);
+  g_source_destroy (progress_src);
+
+  if (data.error)
+    {
+      g_propagate_error (error, data.error);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+gboolean
+rpmostree_download_packages (GPtrArray *packages, GCancellable *cancellable, GError **error)
+{
+  return download_packages_concurrently (
+      packages,
+      get_max_concurrent_repos (RPMOSTREE_DEFAULT_MAX_DOWNLOADS,
+                                RPMOSTREE_LIBDNF_DEFAULT_DOWNLOADS_PER_REPO),
+      cancellable, error);
+}
+
+/* Resolve each of @packages to its latest match in @repo, appending them to
+ * @out_pkgs. Full NEVRAs, which is what `override replace --freeze` passes,
+ * are looked up in a single pass over the repo; anything else goes through
+ * the usual subject parsing. */
+static gboolean
+resolve_packages_in_repo (DnfSack *sack, const char *const *packages, const char *repo,
+                          GPtrArray *out_pkgs, GError **error)
+{
+  hy_autoquery HyQuery repo_query = hy_query_create (sack);
+  hy_query_filter (repo_query, HY_PKG_REPONAME, HY_EQ, repo);
+  g_autoptr (GPtrArray) repo_pkgs = hy_query_run (repo_query);
+  g_autoptr (GHashTable) nevra_to_pkg = g_hash_table_new (g_str_hash, g_str_equal);
+  for (guint i = 0; i < repo_pkgs->len; i++)
+    {
+      auto pkg = static_cast<DnfPackage *> (repo_pkgs->pdata[i]);
+      g_hash_table_insert (nevra_to_pkg, (gpointer)dnf_package_get_nevra (pkg), pkg);
+    }
+
+  for (const char *const *it = packages; it && *it; it++)
+    {
+      auto pkg = static_cast<DnfPackage *> (g_hash_table_lookup (nevra_to_pkg, *it));
+      if (pkg)
+        {
+          g_ptr_array_add (out_pkgs, g_object_ref (pkg));
+          continue;
+        }
+
+      g_auto (HySubject) subject = hy_subject_create (*it);
+      HyNevra nevra = NULL;
+      hy_autoquery HyQuery query = hy_subject_get_best_solution (subject, sack, NULL, &nevra, FALSE,
+                                                                 TRUE, FALSE, FALSE, FALSE);
+      hy_query_filter (query, HY_PKG_REPONAME, HY_EQ, repo);
+      hy_query_filter_num (query, HY_PKG_LATEST_PER_ARCH_BY_PRIORITY, HY_EQ, 1);
+      g_autoptr (GPtrArray) results = hy_query_run (query);
+      if (!results || results->len == 0)
+        return glnx_throw (error, "No matches for \"%s\" in repo '%s'", *it, repo);
+      g_ptr_array_add (out_pkgs, g_object_ref (results->pdata[0]));
+    }
+
+  return TRUE;
+}
+
+gboolean
+rpmostree_find_and_download_packages (const char *const *packages, const char *source,
+                                      const char *source_root, const char *repo_root,
+                                      GUnixFDList **out_fd_list, GCancellable *cancellable,
+                                      GError **error)
+{
+  CXX_TRY_VAR (parsed_source, rpmostreecxx::parse_override_source (source), error);
+
+  g_autoptr (RpmOstreeContext) ctx = rpmostree_context_new_base (NULL);
+  if (!rpmostree_context_setup (ctx, NULL, source_root, cancellable, error))
+    return glnx_prefix_error (error, "Setting up dnf context");
+
+  g_autofree char *reposdir = g_build_filename (repo_root ?: source_root, "etc/yum.repos.d", NULL);
+  dnf_context_set_repo_dir (ctx->dnfctx, reposdir);
+
+  if (!rpmostree_context_download_metadata (ctx, DNF_CONTEXT_SETUP_SACK_FLAG_SKIP_RPMDB,
+                                            cancellable, error))
+    return glnx_prefix_error (error, "Downloading metadata");
+
+  g_autoptr (GPtrArray) pkgs = g_ptr_array_new_with_free_func (g_object_unref);
+  DnfSack *sack = dnf_context_get_sack (rpmostree_context_get_dnf (ctx));
+  switch (parsed_source.kind)
+    {
+    case rpmostreecxx::OverrideReplacementType::Repo:
+      if (!resolve_packages_in_repo (sack, packages, parsed_source.name.c_str (), pkgs, error))
+        return FALSE;
+      break;
+    default:
+      return glnx_throw (error, "Unsupported source type used in '%s'", source);
+    }
+
+  rpmostree_set_repos_on_packages (rpmostree_context_get_dnf (ctx), pkgs);
+
+  /* RPMs which are already in the dnf cache (e.g. kept from an earlier
+   * download) are served as is; we only fetch, and then clean up, the rest. */
+  g_autoptr (GPtrArray) to_download = g_ptr_array_new ();
+  g_autoptr (GHashTable) downloaded = g_hash_table_new (g_str_hash, g_str_equal);
+  for (guint i = 0; i < pkgs->len; i++)
+    {
+      auto pkg = static_cast<DnfPackage *> (pkgs->pdata[i]);
+      const char *nevra = dnf_package_get_nevra (pkg);
+      if (pkg_is_cached (pkg) || g_hash_table_contains (downloaded, nevra))
+        continue;
+      g_hash_table_insert (downloaded, (gpointer)nevra, pkg);
+      g_ptr_array_add (to_download, pkg);
+    }
+
+  if (!rpmostree_download_packages (to_download, cancellable, error))
+    return glnx_prefix_error (error, "Downloading packages");
+
+  g_autoptr (GUnixFDList) fd_list = g_unix_fd_list_new ();
+  for (unsigned int i = 0; i < pkgs->len; i++)
+    {
+      DnfPackage *pkg = static_cast<DnfPackage *> (pkgs->pdata[i]);
+      const char *path = dnf_package_get_filename (pkg);
+
+      glnx_autofd int fd = -1;
+      if (!glnx_openat_rdonly (AT_FDCWD, path, TRUE, &fd, error))
+        return FALSE;
+
+      if (g_unix_fd_list_append (fd_list, fd, error) < 0)
+        return FALSE;
+    }
+
+  /* Only after all of them are open, since a package may be requested twice */
+  GLNX_HASH_TABLE_FOREACH_V (downloaded, DnfPackage *, pkg)
+    {
+      if (!glnx_unlinkat (AT_FDCWD, dnf_package_get_filename (pkg), 0, error))
+        return FALSE;
+    }
+
+  *out_fd_list = util::move_nullify (fd_list);
+  return TRUE;
+}
+
+/* Print a summary of what we're about to download; returns FALSE if there's
+ * nothing to do. */
+static gboolean
+print_download_summary (RpmOstreeContext *self)
+{
+  int n = self->pkgs_to_download->len;
+  if (n == 0)
+    return FALSE;
+
+  guint64 size = dnf_package_array_get_download_size (self->pkgs_to_download);
+  g_autofree char *sizestr = g_format_size (size);
+  rpmostree_output_message ("Will download: %u package%s (%s)", n, _NS (n), sizestr);
+
+  // For now just make this a warning for debugging https://github.com/coreos/rpm-ostree/issues/4565
+  // It may be that people are actually relying on this behavior too...
+  if (self->dnf_cache_policy == RPMOSTREE_CONTEXT_DNF_CACHE_FOREVER)
+    g_printerr ("warning: Found %u packages to download in cache-only mode\n",
+                self->pkgs_to_download->len);
+  return TRUE;
+}
+
+/* Also fetch @pkgs, which aren't part of the transaction, in
+ * rpmostree_context_download(); those already in the set or cached are
+ * skipped. */
+void
+rpmostree_context_add_downloads (RpmOstreeContext *self, GPtrArray *pkgs)
+{
+  g_assert (self->pkgs_to_download);
+  rpmostree_set_repos_on_packages (self->dnfctx, pkgs);
+
+  g_autoptr (GHashTable) queued = g_hash_table_new (g_str_hash, g_str_equal);
+  for (guint i = 0; i < self->pkgs_to_download->len; i++)
+    g_hash_table_add (queued, (gpointer)dnf_package_get_nevra (
+                                  static_cast<DnfPackage *> (self->pkgs_to_download->pdata[i])));
+  for (guint i = 0; i < pkgs->len; i++)
+    {
+      auto pkg = static_cast<DnfPackage *> (pkgs->pdata[i]);
+      if (pkg_is_cached (pkg) || !g_hash_table_add (queued, (gpointer)dnf_package_get_nevra (pkg)))
+        continue;
+      g_ptr_array_add (self->pkgs_to_download, g_object_ref (pkg));
+    }
+}
+
+gboolean
+rpmostree_context_download (RpmOstreeContext *self, GCancellable *cancellable, GError **error)
+{
+  if (!print_download_summary (self))
+    return TRUE;
+  rpmostreecxx::TraceSpan span ("download");
+  const gint64 start_time = g_get_monotonic_time ();
+  if (!download_packages_concurrently (
+          self->pkgs_to_download,
+          get_max_concurrent_repos (self->max_downloads, self->max_downloads_per_repo),
+          cancellable, error))
+    return FALSE;
+  const guint64 download_size = dnf_package_array_get_download_size (self->pkgs_to_download);
+  rpmostree_metrics_count (RPMOSTREE_METRIC_BYTES_DOWNLOADED, download_size);
+  rpmostree_context_add_phase_timing (self, "download", start_time, download_size,
+                                      self->pkgs_to_download->len);
+  return TRUE;
+}
+
+static gboolean async_imports_mainctx_iter (gpointer user_data);
+
+/* Whether @repo's packages are downloaded to the streaming scratch directory
+ * rather than the package cache; see rpmostree_context_set_stream_downloads().
+ * libdnf always looks for the RPM in the package cache when checking its
+ * signature, so those repos keep using it. */
+static gboolean
+repo_is_streamed (RpmOstreeContext *self, DnfRepo *repo)
+{
+  return self->stream_dir != NULL && !dnf_repo_get_gpgcheck (repo);
+}
+
+static gboolean
+pkg_is_streamed (RpmOstreeContext *self, DnfPackage *pkg)
+{
+  return self->async_downloaded_pkgs && g_hash_table_contains (self->async_downloaded_pkgs, pkg)
+         && repo_is_streamed (self, dnf_package_get_repo (pkg));
+}
+
+/* Rough estimate of how long a package will take to import. Most of the time
+ * goes into decompressing the payload and checksumming/writing the result,
+ * so this is the installed size plus the compressed size, which accounts for
+ * the higher per-byte cost of packages that compress well (i.e. typically
+ * xz rather than zstd). The rpm-md metadata doesn't tell us the payload
+ * compressor directly. */
+static guint64
+estimate_import_cost (DnfPackage *pkg)
+{
+  return dnf_package_get_size (pkg) + dnf_package_get_downloadsize (pkg);
+}
+
+/* Queue @pkg for import; the work queue starts the most expensive ones
+ * first, otherwise a large package late in solver order (e.g. firmware)
+ * ends up running alone at the end while every other worker sits idle. */
+static void
+queue_import (RpmOstreeContext *self, DnfPackage *pkg)
+{
+  rpmostree_work_queue_push (self->async_work_queue, g_object_ref (pkg),
+                             estimate_import_cost (pkg));
+}
+
+/* Called on completion of a pipelined download batch; runs on main thread */
+static void
+on_async_download_done (GObject *obj, GAsyncResult *res, gpointer user_data)
+{
+  auto self = static_cast<RpmOstreeContext *> (user_data);
+  auto batch = static_cast<RpmOstreeDownloadBatch *> (g_task_get_task_data (G_TASK (res)));
+
+  g_hash_table_remove (self->async_busy_repos, batch->repo);
+  g_assert_cmpuint (self->n_async_downloads_running, >, 0);
+  self->n_async_downloads_running--;
+  g_assert_cmpuint (self->async_download_bytes_inflight, >=, batch->size);
+  self->async_download_bytes_inflight -= batch->size;
+  if (!g_task_propagate_boolean (G_TASK (res), self->async_error ? NULL : &self->async_error))
+    {
+      if (self->async_cancellable)
+        g_cancellable_cancel (self->async_cancellable);
+    }
+  else
+    {
+      for (guint i = 0; i < batch->pkgs->len; i++)
+        queue_import (self, static_cast<DnfPackage *> (batch->pkgs->pdata[i]));
+      self->async_download_bytes_pending += batch->size;
+      self->n_async_pkgs_downloaded += batch->pkgs->len;
+      rpmostree_metrics_count (RPMOSTREE_METRIC_BYTES_DOWNLOADED, batch->size);
+      g_autofree char *sub_msg = g_strdup_printf (
+          "downloaded %u/%u", self->n_async_pkgs_downloaded, self->pkgs_to_download->len);
+      self->async_progress->set_sub_message (sub_msg);
+    }
+
+  async_imports_mainctx_iter (self);
+}
+
+/* Start more download batches if there are any, and we're under both the
+ * connection limits and the byte budget */
+static void
+maybe_start_async_downloads (RpmOstreeContext *self)
+{
+  if (!self->async_download_batches)
+    return;
+
+  const guint max_running = get_max_concurrent_repos (self->max_downloads,
+                                                     self->max_downloads_per_repo);
+  while (self->async_error == NULL && self->n_async_downloads_running < max_running)
+    {
+      auto batch = next_download_batch (self->async_download_batches, self->async_busy_repos);
+      if (!batch)
+        break;
+      /* Always allow a batch when nothing is pending, otherwise a batch bigger
+       * than the budget would never be fetched. */
+      guint64 pending = self->async_download_bytes_pending + self->async_download_bytes_inflight;
+      if (self->download_import_budget > 0 && pending > 0
+          && pending + batch->size > self->download_import_budget)
+        break;
+
+      start_download_batch (batch, self->async_busy_repos, self->async_cancellable,
+                            on_async_download_done, self);
+      self->n_async_downloads_running++;
+      self->async_download_bytes_inflight += batch->size;
+    }
+}
+
+/* Imports which spend less than this fraction of their time on the CPU are
+ * considered I/O bound. */
+#define RPMOSTREE_IMPORT_IO_BOUND_CPU_FRACTION 0.5
+
+/* Called after each import completes when the import concurrency is
+ * adaptive. Imports are CPU bound (decompression, checksumming) until the
+ * storage saturates, at which point adding writers only adds fsync and
+ * metadata contention. So after each window of completed imports, compare
+ * the throughput with the previous window and hill-climb: keep moving in the
+ * same direction while throughput improves and reverse when it drops. When
+ * it's flat, we go down if imports are mostly waiting on I/O, and up
+ * otherwise.
+ */
+static void
+tune_import_concurrency (RpmOstreeContext *self, const RpmOstreeImporterStats *stats)
+{
+  RpmOstreeConcurrencyTuner *tuner = &self->import_tuner;
+
+  tuner->window_n++;
+  tuner->window_bytes += stats->installed_size;
+  tuner->window_cpu_usec += stats->cpu_usec;
+  tuner->window_wall_usec += stats->wall_usec;
+  const guint cur = rpmostree_work_queue_get_max_running (self->async_work_queue);
+  if (tuner->window_n < MAX (cur, 4))
+    return;
+
+  const guint64 now = g_get_monotonic_time ();
+  const double elapsed_secs = MAX (now - tuner->window_start, 1) / (double)G_USEC_PER_SEC;
+  const double throughput = tuner->window_bytes / elapsed_secs;
+  const double cpu_fraction = tuner->window_wall_usec > 0 ? (double)tuner->window_cpu_usec
+                                                                / tuner->window_wall_usec
+                                                          : 1.0;
+  const gboolean io_bound = cpu_fraction < RPMOSTREE_IMPORT_IO_BOUND_CPU_FRACTION;
+
+  if (tuner->last_throughput <= 0 || ABS (throughput - tuner->last_throughput)
+                                         < tuner->last_throughput * 0.05)
+    tuner->direction = io_bound ? -1 : 1;
+  else if (throughput < tuner->last_throughput)
+    tuner->direction = -tuner->direction;
+
+  /* Additive increase, multiplicative decrease; we never go past the number
+   * of processors. */
+  const guint max = g_get_num_processors ();
+  guint n = cur;
+  if (tuner->direction > 0)
+    n = MIN (n + MAX (n / 8, 1), max);
+  else
+    n = MAX (n * 3 / 4, 1);
+  if (n != cur)
+    g_debug ("Import concurrency %u -> %u (%.1f MiB/s, cpu %.0f%%)", cur, n,
+             throughput / (1024 * 1024), cpu_fraction * 100);
+  rpmostree_work_queue_set_max_running (self->async_work_queue, n);
+
+  tuner->last_throughput = throughput;
+  tuner->window_start = now;
+  tuner->window_n = 0;
+  tuner->window_bytes = 0;
+  tuner->window_cpu_usec = 0;
+  tuner->window_wall_usec = 0;
+}
+
+/* Called on completion of an async import; runs on main thread */
+static void
+on_async_import_done (GObject *obj, GAsyncResult *res, gpointer user_data)
+{
+  auto importer = (RpmOstreeImporter *)(obj);
+  auto job = static_cast<RpmOstreeWorkQueueJob *> (user_data);
+  auto self = static_cast<RpmOstreeContext *> (rpmostree_work_queue_job_get_user_data (job));
+  rpmostree_work_queue_job_done (job);
   g_autofree char *rev = rpmostree_importer_run_async_finish (
       importer, res, self->async_error ? NULL : &self->async_error);
   if (!rev)
@@ -2432,18 +3796,23 @@ on_async_import_done (GObject *obj, GAsyncResult *res, gpointer user_data)
         g_cancellable_cancel (self->async_cancellable);
       g_assert (self->async_error != NULL);
     }
+  else if (self->import_concurrency == 0)
+    {
+      RpmOstreeImporterStats stats;
+      rpmostree_importer_get_stats (importer, &stats);
+      tune_import_concurrency (self, &stats);
+    }
 
   g_assert_cmpint (self->n_async_pkgs_imported, <, self->pkgs_to_import->len);
   self->n_async_pkgs_imported++;
-  g_assert_cmpint (self->n_async_running, >, 0);
-  self->n_async_running--;
   self->async_progress->nitems_update (self->n_async_pkgs_imported);
   async_imports_mainctx_iter (self);
 }
 
 /* Queue an asynchronous import of a package */
 static gboolean
-start_async_import_one_package (RpmOstreeContext *self, DnfPackage *pkg, GCancellable *cancellable,
+start_async_import_one_package (RpmOstreeContext *self, DnfPackage *pkg,
+                                RpmOstreeWorkQueueJob *job, GCancellable *cancellable,
                                 GError **error)
 {
   glnx_fd_close int fd = -1;
@@ -2460,12 +3829,34 @@ start_async_import_one_package (RpmOstreeContext *self, DnfPackage *pkg, GCancel
       &fd, ostreerepo, pkg, *importer_flags, self->sepolicy, cancellable, error);
   if (!unpacker)
     return glnx_prefix_error (error, "creating importer");
+  if (self->label_cache && ostree_sepolicy_get_name (self->sepolicy) != NULL)
+    rpmostree_importer_set_label_cache (unpacker, self->label_cache);
+  rpmostree_importer_set_digest_index (unpacker, self->digest_index);
 
-  rpmostree_importer_run_async (unpacker, cancellable, on_async_import_done, self);
+  rpmostree_importer_run_async (unpacker, cancellable, on_async_import_done, job);
 
   return TRUE;
 }
 
+/* Work queue callback to start importing a package */
+static gboolean
+start_queued_import (RpmOstreeWorkQueueJob *job, gpointer item, gpointer user_data,
+                     GError **error)
+{
+  auto self = static_cast<RpmOstreeContext *> (user_data);
+  auto pkg = static_cast<DnfPackage *> (item);
+  if (!start_async_import_one_package (self, pkg, job, self->async_cancellable, error))
+    return FALSE;
+  /* The downloaded RPM was consumed; it no longer counts against the budget */
+  if (self->async_downloaded_pkgs && g_hash_table_contains (self->async_downloaded_pkgs, pkg))
+    {
+      guint64 pkg_size = dnf_package_get_downloadsize (pkg);
+      g_assert_cmpuint (self->async_download_bytes_pending, >=, pkg_size);
+      self->async_download_bytes_pending -= pkg_size;
+    }
+  return TRUE;
+}
+
 /* First function run on mainloop, and called after completion as well. Ensures
  * that we have a bounded number of tasks concurrently executing until
  * finishing.
@@ -2475,20 +3866,14 @@ async_imports_mainctx_iter (gpointer user_data)
 {
   auto self = static_cast<RpmOstreeContext *> (user_data);
 
-  while (self->async_index < self->pkgs_to_import->len && self->n_async_running < self->n_async_max
-         && self->async_error == NULL)
-    {
-      auto pkg = static_cast<DnfPackage *> (self->pkgs_to_import->pdata[self->async_index]);
-      if (!start_async_import_one_package (self, pkg, self->async_cancellable, &self->async_error))
-        {
-          g_cancellable_cancel (self->async_cancellable);
-          break;
-        }
-      self->async_index++;
-      self->n_async_running++;
-    }
+  if (self->async_error == NULL
+      && !rpmostree_work_queue_dispatch (self->async_work_queue, &self->async_error))
+    g_cancellable_cancel (self->async_cancellable);
+
+  maybe_start_async_downloads (self);
 
-  if (self->n_async_running == 0)
+  if (rpmostree_work_queue_get_n_running (self->async_work_queue) == 0
+      && self->n_async_downloads_running == 0)
     {
       self->async_running = FALSE;
       g_main_context_wakeup (g_main_context_get_thread_default ());
@@ -2497,8 +3882,12 @@ async_imports_mainctx_iter (gpointer user_data)
   return FALSE;
 }
 
-gboolean
-rpmostree_context_import (RpmOstreeContext *self, GCancellable *cancellable, GError **error)
+/* Import all of pkgs_to_import. If @pipeline_downloads is set, then packages
+ * that need to be downloaded are fetched in the background and imported as
+ * they arrive; otherwise they must have all been downloaded already. */
+static gboolean
+import_packages (RpmOstreeContext *self, gboolean pipeline_downloads, GCancellable *cancellable,
+                 GError **error)
 {
   DnfContext *dnfctx = self->dnfctx;
   const int n = self->pkgs_to_import->len;
@@ -2508,9 +3897,19 @@ rpmostree_context_import (RpmOstreeContext *self, GCancellable *cancellable, GEr
   OstreeRepo *repo = get_pkgcache_repo (self);
   g_assert (repo != NULL);
 
+  const gint64 start_time = g_get_monotonic_time ();
+  /* When pipelined, the downloads are overlapped with and so part of this */
+  const char *phase = pipeline_downloads && self->pkgs_to_download->len > 0 ? "download-import"
+                                                                             : "import";
+
   if (!dnf_transaction_import_keys (dnf_context_get_transaction (dnfctx), error))
     return FALSE;
 
+  if (!ensure_label_cache (self, cancellable, error))
+    return FALSE;
+  if (!ensure_digest_index (self, cancellable, error))
+    return FALSE;
+
   g_auto (RpmOstreeRepoAutoTransaction) txn = {
     0,
   };
@@ -2518,15 +3917,68 @@ rpmostree_context_import (RpmOstreeContext *self, GCancellable *cancellable, GEr
   if (!rpmostree_repo_auto_transaction_start (&txn, repo, TRUE, cancellable, error))
     return FALSE;
 
+  g_clear_pointer (&self->async_download_batches, g_ptr_array_unref);
+  g_clear_pointer (&self->async_downloaded_pkgs, g_hash_table_unref);
+  g_clear_pointer (&self->async_busy_repos, g_hash_table_unref);
+  self->n_async_downloads_running = 0;
+  self->async_download_bytes_pending = 0;
+  self->async_download_bytes_inflight = 0;
+  self->n_async_pkgs_downloaded = 0;
+  g_auto (GLnxTmpDir) stream_tmpdir = {
+    0,
+  };
+  if (pipeline_downloads && self->pkgs_to_download->len > 0)
+    {
+      /* Use batches of a quarter of the budget so that a few can be in
+       * flight at once */
+      self->async_download_batches
+          = gather_download_batches (self->pkgs_to_download, self->download_import_budget / 4);
+      self->async_downloaded_pkgs = g_hash_table_new (NULL, NULL);
+      self->async_busy_repos = g_hash_table_new (NULL, NULL);
+      for (guint i = 0; i < self->pkgs_to_download->len; i++)
+        g_hash_table_add (self->async_downloaded_pkgs, self->pkgs_to_download->pdata[i]);
+
+      if (self->stream_downloads && self->download_import_budget == 0)
+        g_debug ("Not streaming downloads with an unlimited download budget");
+      else if (self->stream_downloads)
+        {
+          if (!glnx_mkdtempat (AT_FDCWD, "/dev/shm/rpmostree-pkgs-XXXXXX", 0700, &stream_tmpdir,
+                               error))
+            return glnx_prefix_error (error, "Creating download directory");
+          self->stream_dir = stream_tmpdir.path;
+          for (guint i = 0; i < self->async_download_batches->len; i++)
+            {
+              auto batch
+                  = static_cast<RpmOstreeDownloadBatch *> (self->async_download_batches->pdata[i]);
+              if (repo_is_streamed (self, batch->repo))
+                batch->target_dir = self->stream_dir;
+            }
+        }
+    }
+
+  /* Start out assuming we're CPU bound, so just use processors; unless
+   * fixed, this is then tuned as imports complete. */
+  const guint max_imports
+      = self->import_concurrency > 0 ? self->import_concurrency : g_get_num_processors ();
+  g_autoptr (RpmOstreeWorkQueue) queue = rpmostree_work_queue_new (
+      "import", max_imports, start_queued_import, self, g_object_unref);
+  self->async_work_queue = queue;
+  /* Everything not being downloaded is already available */
+  for (guint i = 0; i < self->pkgs_to_import->len; i++)
+    {
+      auto pkg = static_cast<DnfPackage *> (self->pkgs_to_import->pdata[i]);
+      if (!self->async_downloaded_pkgs || !g_hash_table_contains (self->async_downloaded_pkgs, pkg))
+        queue_import (self, pkg);
+    }
+
   self->async_running = TRUE;
-  self->async_index = 0;
-  self->n_async_running = 0;
-  /* We're CPU bound, so just use processors */
-  self->n_async_max = g_get_num_processors ();
+  self->import_tuner = {};
+  self->import_tuner.window_start = g_get_monotonic_time ();
   self->async_cancellable = cancellable;
 
-  self->async_progress
-      = rpmostreecxx::progress_nitems_begin (self->pkgs_to_import->len, "Importing packages");
+  self->async_progress = rpmostreecxx::progress_nitems_begin (
+      self->pkgs_to_import->len,
+      self->async_download_batches ? "Downloading and importing packages" : "Importing packages");
 
   /* Process imports */
   GMainContext *mainctx = g_main_context_get_thread_default ();
@@ -2540,6 +3992,12 @@ rpmostree_context_import (RpmOstreeContext *self, GCancellable *cancellable, GEr
   self->async_error = NULL;
   while (self->async_running)
     g_main_context_iteration (mainctx, TRUE);
+  g_clear_pointer (&self->async_download_batches, g_ptr_array_unref);
+  g_clear_pointer (&self->async_downloaded_pkgs, g_hash_table_unref);
+  g_clear_pointer (&self->async_busy_repos, g_hash_table_unref);
+  self->stream_dir = NULL;
+  rpmostree_work_queue_log_stats (queue);
+  self->async_work_queue = NULL;
   if (self->async_error)
     {
       g_propagate_error (error, util::move_nullify (self->async_error));
@@ -2554,13 +4012,50 @@ rpmostree_context_import (RpmOstreeContext *self, GCancellable *cancellable, GEr
     return FALSE;
   txn.initialized = FALSE;
 
+  if (self->label_cache && !rpmostree_label_cache_flush (self->label_cache, cancellable, error))
+    return FALSE;
+  if (!rpmostree_digest_index_flush (self->digest_index, cancellable, error))
+    return FALSE;
+
+  /* And let the composes for other architectures have them */
+  if (self->shared_noarch_repo)
+    {
+      guint n_copied = 0;
+      if (!copy_noarch_imports (self->shared_noarch_repo, repo, self->pkgs_to_import, FALSE,
+                                &n_copied, cancellable, error))
+        return glnx_prefix_error (error, "Updating shared noarch pkgcache");
+    }
+
   sd_journal_send ("MESSAGE_ID=" SD_ID128_FORMAT_STR,
                    SD_ID128_FORMAT_VAL (RPMOSTREE_MESSAGE_PKG_IMPORT), "MESSAGE=Imported %u pkg%s",
                    n, _NS (n), "IMPORTED_N_PKGS=%u", n, NULL);
 
+  rpmostree_metrics_count (RPMOSTREE_METRIC_PACKAGES_IMPORTED, n);
+  rpmostree_context_add_phase_timing (self, phase, start_time,
+                                      dnf_package_array_get_download_size (self->pkgs_to_import),
+                                      n);
   return TRUE;
 }
 
+gboolean
+rpmostree_context_import (RpmOstreeContext *self, GCancellable *cancellable, GError **error)
+{
+  return import_packages (self, FALSE, cancellable, error);
+}
+
+/* Like calling rpmostree_context_download() followed by
+ * rpmostree_context_import(), but packages are imported as soon as they
+ * are downloaded, so that the network and CPU are busy at the same time.
+ * See rpmostree_context_set_download_import_budget().
+ */
+gboolean
+rpmostree_context_download_and_import (RpmOstreeContext *self, GCancellable *cancellable,
+                                       GError **error)
+{
+  print_download_summary (self);
+  return import_packages (self, TRUE, cancellable, error);
+}
+
 /* Given a single package, verify its GPG signature (if enabled), open a file
  * descriptor for it, and delete the on-disk downloaded copy.
  */
@@ -2572,7 +4067,12 @@ rpmostree_context_consume_package (RpmOstreeContext *self, DnfPackage *pkg, int
   if (!dnf_transaction_gpgcheck_package (dnf_context_get_transaction (self->dnfctx), pkg, error))
     return FALSE;
 
-  g_autofree char *pkg_path = rpmostree_pkg_get_local_path (pkg);
+  g_autofree char *pkg_path = NULL;
+  if (pkg_is_streamed (self, pkg))
+    pkg_path = g_build_filename (self->stream_dir, glnx_basename (dnf_package_get_location (pkg)),
+                                 NULL);
+  else
+    pkg_path = rpmostree_pkg_get_local_path (pkg);
   glnx_autofd int fd = -1;
   if (!glnx_openat_rdonly (AT_FDCWD, pkg_path, TRUE, &fd, error))
     return FALSE;
@@ -2633,6 +4133,25 @@ ht_insert_path_for_nevra (GHashTable *ht, const char *nevra, char *path, gpointe
   g_hash_table_insert (paths, path, v);
 }
 
+/* A colored file installed by a package in the transaction */
+typedef struct
+{
+  const char *path; /* interned */
+  const char *nevra;
+  rpm_color_t color;
+  guint seq; /* order in the transaction, to keep the sort stable */
+} AddedFile;
+
+static gint
+added_file_compare (gconstpointer a, gconstpointer b)
+{
+  auto fa = static_cast<const AddedFile *> (a);
+  auto fb = static_cast<const AddedFile *> (b);
+  if (fa->path != fb->path)
+    return strcmp (fa->path, fb->path);
+  return (fa->seq > fb->seq) - (fa->seq < fb->seq);
+}
+
 /* This is a lighter version of calculations that librpm calls "file disposition".
  * Essentially, we determine which file removals/installations should be skipped. For
  * example:
@@ -2653,11 +4172,14 @@ handle_file_dispositions (RpmOstreeContext *self, int tmprootfs_dfd, rpmts ts,
 
   g_autoptr (GHashTable) pkgs_deleted = g_hash_table_new (g_direct_hash, g_direct_equal);
 
+  /* All the paths we keep are interned here, rather than strdup'd one by one;
+   * the tables below borrow from it, and equal paths are the same pointer. */
+  g_autoptr (GStringChunk) paths = g_string_chunk_new (64 * 1024);
+
   /* note these entries are *not* canonicalized for ostree conventions */
   g_autoptr (GHashTable) files_deleted = /* set{paths} */
-      g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
-  g_autoptr (GHashTable) files_added = /* map{nevra -> map{path -> color}} */
-      g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_hash_table_unref);
+      g_hash_table_new (g_str_hash, g_str_equal);
+  g_autoptr (GArray) files_added = g_array_new (FALSE, FALSE, sizeof (AddedFile));
 
   /* first pass to just collect added and removed files */
   const guint n_rpmts_elements = (guint)rpmtsNElements (ts);
@@ -2674,7 +4196,7 @@ handle_file_dispositions (RpmOstreeContext *self, int tmprootfs_dfd, rpmts ts,
       if (type == TR_REMOVED)
         {
           while (rpmfiNext (fi) >= 0)
-            g_hash_table_add (files_deleted, g_strdup (rpmfiFN (fi)));
+            g_hash_table_add (files_deleted, g_string_chunk_insert_const (paths, rpmfiFN (fi)));
         }
       else
         {
@@ -2685,14 +4207,25 @@ handle_file_dispositions (RpmOstreeContext *self, int tmprootfs_dfd, rpmts ts,
               rpm_color_t color = rpmfiFColor (fi);
               if (color)
                 {
-                  // Ownership is passed to the hash table
-                  char *fn = g_strdup (rpmfiFN (fi));
-                  ht_insert_path_for_nevra (files_added, nevra, fn, GUINT_TO_POINTER (color));
+                  AddedFile added = { g_string_chunk_insert_const (paths, rpmfiFN (fi)), nevra,
+                                      color, files_added->len };
+                  g_array_append_val (files_added, added);
                 }
             }
         }
     }
 
+  /* Group the added files by path, so that all the packages adding a path can
+   * be found with one lookup of its first entry */
+  g_array_sort (files_added, added_file_compare);
+  g_autoptr (GHashTable) files_added_index /* map{path -> index + 1} */
+      = g_hash_table_new (g_str_hash, g_str_equal);
+  for (guint i = files_added->len; i > 0; i--)
+    {
+      auto added = &g_array_index (files_added, AddedFile, i - 1);
+      g_hash_table_insert (files_added_index, (gpointer)added->path, GUINT_TO_POINTER (i));
+    }
+
   /* this we *do* canonicalize since we'll be comparing against ostree paths */
   g_autoptr (GHashTable) files_skip_add = /* map{nevra -> set{files}} */
       g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_hash_table_unref);
@@ -2701,14 +4234,12 @@ handle_file_dispositions (RpmOstreeContext *self, int tmprootfs_dfd, rpmts ts,
       = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 
   /* skip added files whose colors aren't in our rainbow */
-  GLNX_HASH_TABLE_FOREACH_KV (files_added, const char *, nevra, GHashTable *, paths)
+  for (guint i = 0; i < files_added->len; i++)
     {
-      GLNX_HASH_TABLE_FOREACH_KV (paths, const char *, path, gpointer, colorp)
-        {
-          rpm_color_t color = GPOINTER_TO_UINT (colorp);
-          if (ts_color && !(ts_color & color))
-            ht_insert_path_for_nevra (files_skip_add, nevra, canonicalize_rpmfi_path (path), NULL);
-        }
+      auto added = &g_array_index (files_added, AddedFile, i);
+      if (ts_color && !(ts_color & added->color))
+        ht_insert_path_for_nevra (files_skip_add, added->nevra,
+                                  canonicalize_rpmfi_path (added->path), NULL);
     }
 
   g_auto (rpmdbMatchIterator) it = rpmtsInitIterator (ts, RPMDBI_PACKAGES, NULL, 0);
@@ -2753,22 +4284,25 @@ handle_file_dispositions (RpmOstreeContext *self, int tmprootfs_dfd, rpmts ts,
             continue;
 
           /* check if any of the pkgs to install want to overwrite our file */
-          GLNX_HASH_TABLE_FOREACH_KV (files_added, const char *, nevra, GHashTable *, paths)
+          guint first = GPOINTER_TO_UINT (g_hash_table_lookup (files_added_index, fn));
+          if (first == 0)
+            continue;
+          const char *added_path = g_array_index (files_added, AddedFile, first - 1).path;
+          for (guint i = first - 1; i < files_added->len; i++)
             {
-              gpointer other_colorp = NULL;
-              if (!g_hash_table_lookup_extended (paths, fn, NULL, &other_colorp))
-                continue;
+              auto added = &g_array_index (files_added, AddedFile, i);
+              if (added->path != added_path)
+                break;
 
-              rpm_color_t other_color = GPOINTER_TO_UINT (other_colorp);
-              other_color &= ts_color;
+              rpm_color_t other_color = added->color & ts_color;
 
               /* see handleColorConflict() */
               if (color && other_color && (color != other_color))
                 {
                   /* do we already have the preferred color installed? */
                   if (color & ts_prefcolor)
-                    ht_insert_path_for_nevra (files_skip_add, nevra, canonicalize_rpmfi_path (fn),
-                                              NULL);
+                    ht_insert_path_for_nevra (files_skip_add, added->nevra,
+                                              canonicalize_rpmfi_path (fn), NULL);
                   else if (other_color & ts_prefcolor)
                     {
                       /* the new pkg is bringing our favourite color, give way now so we let
@@ -2782,40 +4316,33 @@ handle_file_dispositions (RpmOstreeContext *self, int tmprootfs_dfd, rpmts ts,
     }
 
   /* and finally, iterate over added pkgs only to search for duplicate files of
-   * differing rpm colors for which we have to pick one */
-  g_autoptr (GHashTable) path_to_nevra = g_hash_table_new (g_str_hash, g_str_equal);
-  g_autoptr (GHashTable) path_to_color = g_hash_table_new (g_str_hash, g_str_equal);
-  GLNX_HASH_TABLE_FOREACH_KV (files_added, const char *, nevra, GHashTable *, paths)
+   * differing rpm colors for which we have to pick one; the first package adding
+   * a path is the initial pick for it */
+  const AddedFile *picked = NULL;
+  for (guint i = 0; i < files_added->len; i++)
     {
-      GLNX_HASH_TABLE_FOREACH_KV (paths, const char *, path, gpointer, colorp)
+      auto added = &g_array_index (files_added, AddedFile, i);
+      if (!picked || picked->path != added->path)
         {
-          if (!g_hash_table_contains (path_to_nevra, path))
-            {
-              g_hash_table_insert (path_to_nevra, (gpointer)path, (gpointer)nevra);
-              g_hash_table_insert (path_to_color, (gpointer)path, colorp);
-              continue;
-            }
+          picked = added;
+          continue;
+        }
 
-          rpm_color_t color = GPOINTER_TO_UINT (colorp) & ts_color;
-          const char *other_nevra
-              = static_cast<const char *> (g_hash_table_lookup (path_to_nevra, path));
-          rpm_color_t other_color
-              = GPOINTER_TO_UINT (g_hash_table_lookup (path_to_color, path)) & ts_color;
+      rpm_color_t color = added->color & ts_color;
+      rpm_color_t other_color = picked->color & ts_color;
 
-          /* see handleColorConflict() */
-          if (color && other_color && (color != other_color))
+      /* see handleColorConflict() */
+      if (color && other_color && (color != other_color))
+        {
+          if (color & ts_prefcolor)
             {
-              if (color & ts_prefcolor)
-                {
-                  ht_insert_path_for_nevra (files_skip_add, other_nevra,
-                                            canonicalize_rpmfi_path (path), NULL);
-                  g_hash_table_insert (path_to_nevra, (gpointer)path, (gpointer)nevra);
-                  g_hash_table_insert (path_to_color, (gpointer)path, colorp);
-                }
-              else if (other_color & ts_prefcolor)
-                ht_insert_path_for_nevra (files_skip_add, nevra, canonicalize_rpmfi_path (path),
-                                          NULL);
+              ht_insert_path_for_nevra (files_skip_add, picked->nevra,
+                                        canonicalize_rpmfi_path (added->path), NULL);
+              picked = added;
             }
+          else if (other_color & ts_prefcolor)
+            ht_insert_path_for_nevra (files_skip_add, added->nevra,
+                                      canonicalize_rpmfi_path (added->path), NULL);
         }
     }
 
@@ -2824,17 +4351,136 @@ handle_file_dispositions (RpmOstreeContext *self, int tmprootfs_dfd, rpmts ts,
   return TRUE;
 }
 
+/* The treefile's remove-from-packages patterns for one package, compiled once.
+ * All of the patterns are combined into a single regex; and if they're all
+ * anchored with a literal prefix (e.g. ^/usr/share/doc/), we check those
+ * first, which rules out most paths without touching the regex engine. */
+struct _RpmOstreeFilesRemoveMatcher
+{
+  GRegex *regex;
+  GPtrArray *prefixes; /* NULL if some pattern has no literal prefix */
+};
+
+void
+rpmostree_files_remove_matcher_free (RpmOstreeFilesRemoveMatcher *matcher)
+{
+  g_clear_pointer (&matcher->regex, g_regex_unref);
+  g_clear_pointer (&matcher->prefixes, g_ptr_array_unref);
+  g_free (matcher);
+}
+
+/* Return the literal text that anything matching @pattern must start with, or
+ * NULL if it's not simply anchored. This is conservative: any alternation or
+ * escape means we give up. */
+static char *
+pattern_get_literal_prefix (const char *pattern)
+{
+  if (pattern[0] != '^' || strchr (pattern, '|') != NULL)
+    return NULL;
+  const char *start = pattern + 1;
+  const char *end = start + strcspn (start, ".[]()*+?{}\\^$");
+  /* A quantifier makes the preceding character optional */
+  if (end > start && (*end == '*' || *end == '?' || *end == '{'))
+    end--;
+  if (end == start)
+    return NULL;
+  return g_strndup (start, end - start);
+}
+
+static RpmOstreeFilesRemoveMatcher *
+files_remove_matcher_new (rust::Vec<rust::String> &patterns, GError **error)
+{
+  g_autoptr (RpmOstreeFilesRemoveMatcher) matcher = g_new0 (RpmOstreeFilesRemoveMatcher, 1);
+  matcher->prefixes = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr (GString) combined = g_string_new ("");
+  for (auto &pattern_rs : patterns)
+    {
+      std::string pattern (pattern_rs);
+      /* Validate each one on its own, for a better error message */
+      g_autoptr (GRegex) regex = g_regex_new (pattern.c_str (), G_REGEX_JAVASCRIPT_COMPAT,
+                                              static_cast<GRegexMatchFlags> (0), error);
+      if (!regex)
+        return (RpmOstreeFilesRemoveMatcher *)glnx_prefix_error_null (
+            error, "Compiling remove-from-packages pattern '%s'", pattern.c_str ());
+      if (combined->len > 0)
+        g_string_append_c (combined, '|');
+      g_string_append_printf (combined, "(?:%s)", pattern.c_str ());
+
+      if (matcher->prefixes)
+        {
+          char *prefix = pattern_get_literal_prefix (pattern.c_str ());
+          if (prefix)
+            g_ptr_array_add (matcher->prefixes, prefix);
+          else
+            g_clear_pointer (&matcher->prefixes, g_ptr_array_unref);
+        }
+    }
+  matcher->regex
+      = g_regex_new (combined->str, static_cast<GRegexCompileFlags> (G_REGEX_JAVASCRIPT_COMPAT
+                                                                    | G_REGEX_OPTIMIZE),
+                     static_cast<GRegexMatchFlags> (0), error);
+  if (!matcher->regex)
+    return (RpmOstreeFilesRemoveMatcher *)glnx_prefix_error_null (
+        error, "Compiling remove-from-packages patterns");
+  return util::move_nullify (matcher);
+}
+
+static gboolean
+files_remove_matcher_match (const RpmOstreeFilesRemoveMatcher *matcher, const char *path)
+{
+  if (matcher->prefixes)
+    {
+      gboolean found = FALSE;
+      for (guint i = 0; i < matcher->prefixes->len && !found; i++)
+        found = g_str_has_prefix (path, (const char *)matcher->prefixes->pdata[i]);
+      if (!found)
+        return FALSE;
+    }
+  return g_regex_match (matcher->regex, path, static_cast<GRegexMatchFlags> (0), NULL);
+}
+
+/* Returns the matcher for the files to remove from @pkg, or NULL if there
+ * are none; owned by the context. */
+static gboolean
+get_files_remove_matcher (RpmOstreeContext *self, DnfPackage *pkg,
+                          RpmOstreeFilesRemoveMatcher **out_matcher, GError **error)
+{
+  const char *name = dnf_package_get_name (pkg);
+  gpointer matcherp = NULL;
+  if (!self->files_remove_matchers)
+    self->files_remove_matchers
+        = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                 (GDestroyNotify)rpmostree_files_remove_matcher_free);
+  else if (g_hash_table_lookup_extended (self->files_remove_matchers, name, NULL, &matcherp))
+    {
+      *out_matcher = static_cast<RpmOstreeFilesRemoveMatcher *> (matcherp);
+      return TRUE;
+    }
+
+  auto patterns = self->treefile_rs->get_files_remove_regex (name);
+  RpmOstreeFilesRemoveMatcher *matcher = NULL;
+  if (!patterns.empty ())
+    {
+      matcher = files_remove_matcher_new (patterns, error);
+      if (!matcher)
+        return FALSE;
+    }
+  g_hash_table_insert (self->files_remove_matchers, g_strdup (name), matcher);
+  *out_matcher = matcher;
+  return TRUE;
+}
+
 typedef struct
 {
   GHashTable *files_skip;
-  GPtrArray *files_remove_regex;
+  const RpmOstreeFilesRemoveMatcher *files_remove;
 } FilterData;
 
 static OstreeRepoCheckoutFilterResult
 checkout_filter (OstreeRepo *self, const char *path, struct stat *st_buf, gpointer user_data)
 {
   GHashTable *files_skip = ((FilterData *)user_data)->files_skip;
-  GPtrArray *files_remove_regex = ((FilterData *)user_data)->files_remove_regex;
+  auto files_remove = ((FilterData *)user_data)->files_remove;
 
   if (files_skip && g_hash_table_size (files_skip) > 0)
     {
@@ -2842,17 +4488,10 @@ checkout_filter (OstreeRepo *self, const char *path, struct stat *st_buf, gpoint
         return OSTREE_REPO_CHECKOUT_FILTER_SKIP;
     }
 
-  if (files_remove_regex)
+  if (files_remove && files_remove_matcher_match (files_remove, path))
     {
-      for (guint i = 0; i < files_remove_regex->len; i++)
-        {
-          auto regex = static_cast<GRegex *> (g_ptr_array_index (files_remove_regex, i));
-          if (g_regex_match (regex, path, static_cast<GRegexMatchFlags> (0), NULL))
-            {
-              g_print ("Skipping file %s from checkout\n", path);
-              return OSTREE_REPO_CHECKOUT_FILTER_SKIP;
-            }
-        }
+      g_print ("Skipping file %s from checkout\n", path);
+      return OSTREE_REPO_CHECKOUT_FILTER_SKIP;
     }
 
   /* Hack for nsswitch.conf: the glibc.i686 copy is identical to the one in glibc.x86_64,
@@ -2867,7 +4506,8 @@ checkout_filter (OstreeRepo *self, const char *path, struct stat *st_buf, gpoint
 
 static gboolean
 checkout_package (OstreeRepo *repo, int dfd, const char *path, OstreeRepoDevInoCache *devino_cache,
-                  const char *pkg_commit, GHashTable *files_skip, GPtrArray *files_remove_regex,
+                  const char *pkg_commit, GHashTable *files_skip,
+                  const RpmOstreeFilesRemoveMatcher *files_remove,
                   OstreeRepoCheckoutOverwriteMode ovwmode, gboolean force_copy_zerosized,
                   GCancellable *cancellable, GError **error)
 {
@@ -2890,16 +4530,33 @@ checkout_package (OstreeRepo *repo, int dfd, const char *path, OstreeRepoDevInoC
   /* If called by `checkout_package_into_root()`, there may be files that need to be filtered. */
   FilterData filter_data = {
     files_skip,
-    files_remove_regex,
+    files_remove,
   };
   if ((files_skip && g_hash_table_size (files_skip) > 0)
-      || (files_remove_regex && files_remove_regex->len > 0))
+      || files_remove)
     {
       opts.filter = checkout_filter;
       opts.filter_user_data = &filter_data;
     }
 
-  return ostree_repo_checkout_at (repo, &opts, dfd, path, pkg_commit, cancellable, error);
+  return rpmostree_checkout_plan_checkout_at (repo, &opts, dfd, path, pkg_commit, cancellable,
+                                              error);
+}
+
+/* Everything needed before checking out @pkg into the root that must happen on
+ * the main thread; returns the files to remove, if any. */
+static gboolean
+prepare_package_checkout (RpmOstreeContext *self, DnfPackage *pkg,
+                          const RpmOstreeFilesRemoveMatcher **out_files_remove, GError **error)
+{
+  /* If called on compose-side, there may be files to remove from packages specified in the
+   * treefile. */
+  RpmOstreeFilesRemoveMatcher *files_remove = NULL;
+  if (!get_files_remove_matcher (self, pkg, &files_remove, error))
+    return FALSE;
+
+  *out_files_remove = files_remove;
+  return TRUE;
 }
 
 static gboolean
@@ -2908,44 +4565,18 @@ checkout_package_into_root (RpmOstreeContext *self, DnfPackage *pkg, int dfd, co
                             GHashTable *files_skip, OstreeRepoCheckoutOverwriteMode ovwmode,
                             GCancellable *cancellable, GError **error)
 {
-  /* If called on compose-side, there may be files to remove from packages specified in the
-   * treefile. */
-  g_autoptr (GPtrArray) files_remove_regex = NULL;
-  auto files_remove_regex_patterns
-      = self->treefile_rs->get_files_remove_regex (dnf_package_get_name (pkg));
-  files_remove_regex
-      = g_ptr_array_new_full (files_remove_regex_patterns.size (), (GDestroyNotify)g_regex_unref);
-  for (auto &pattern : files_remove_regex_patterns)
-    {
-      GRegex *regex = g_regex_new (pattern.c_str (), G_REGEX_JAVASCRIPT_COMPAT,
-                                   static_cast<GRegexMatchFlags> (0), NULL);
-      if (!regex)
-        return FALSE;
-      g_ptr_array_add (files_remove_regex, regex);
-    }
+  rpmostreecxx::TraceSpan span ("checkout", dnf_package_get_nevra (pkg));
+  const RpmOstreeFilesRemoveMatcher *files_remove = NULL;
+  if (!prepare_package_checkout (self, pkg, &files_remove, error))
+    return FALSE;
 
   OstreeRepo *pkgcache_repo = get_pkgcache_repo (self);
-
-  /* The below is currently TRUE only in the --unified-core path. We probably want to
-   * migrate that over to always use a separate cache repo eventually, which would allow us
-   * to completely drop the pkgcache_repo/ostreerepo dichotomy in the core. See:
-   * https://github.com/projectatomic/rpm-ostree/pull/1055 */
-  if (pkgcache_repo != self->ostreerepo)
-    {
-      if (!rpmostree_pull_content_only (self->ostreerepo, pkgcache_repo, pkg_commit, cancellable,
-                                        error))
-        {
-          g_prefix_error (error, "Linking cached content for %s: ", dnf_package_get_nevra (pkg));
-          return FALSE;
-        }
-    }
-
   GHashTable *pkg_files_skip = NULL;
   if (files_skip != NULL)
     pkg_files_skip
         = static_cast<GHashTable *> (g_hash_table_lookup (files_skip, dnf_package_get_nevra (pkg)));
   if (!checkout_package (pkgcache_repo, dfd, path, devino_cache, pkg_commit, pkg_files_skip,
-                         files_remove_regex, ovwmode, !self->enable_rofiles, cancellable, error))
+                         files_remove, ovwmode, !self->enable_rofiles, cancellable, error))
     return glnx_prefix_error (error, "Checkout %s", dnf_package_get_nevra (pkg));
 
   return TRUE;
@@ -3020,13 +4651,13 @@ compare_strlen (const void *a, const void *b, void *data)
   return 1;
 }
 
-/* Given a single package, remove its files (non-directories), unless they're
- * included in @files_skip.  Add its directories to @dirs_to_remove, which
- * are handled in a second pass.
+/* Queue the files and directories of a single package for deletion in
+ * @deletions (map{parent dir -> array{basenames}}), unless they're included
+ * in @files_skip. They're deleted by delete_queued_paths().
  */
 static gboolean
-delete_package_from_root (RpmOstreeContext *self, rpmte pkg, int rootfs_dfd, GHashTable *files_skip,
-                          GSequence *dirs_to_remove, GCancellable *cancellable, GError **error)
+queue_package_deletion (RpmOstreeContext *self, rpmte pkg, int rootfs_dfd, GHashTable *files_skip,
+                        GHashTable *deletions, GCancellable *cancellable, GError **error)
 {
   g_auto (rpmfiles) files = rpmteFiles (pkg);
   /* NB: new librpm uses RPMFI_ITER_BACK here to empty out dirs before deleting them using
@@ -3056,48 +4687,161 @@ delete_package_from_root (RpmOstreeContext *self, rpmte pkg, int rootfs_dfd, GHa
         fn = fn_owned;
       (void)fn_owned; /* Pacify static analysis */
 
-      /* Convert to ostree convention. */
-      auto translated = rpmostreecxx::translate_path_for_ostree (fn);
-      if (translated.size () != 0)
-        fn = translated.c_str ();
+      /* Convert to ostree convention; paths already in usr/ never need it, and
+       * they're most of them, so skip the trip through Rust for those. */
+      rust::String translated;
+      if (!g_str_has_prefix (fn, "usr/"))
+        {
+          translated = rpmostreecxx::translate_path_for_ostree (fn);
+          if (translated.size () != 0)
+            fn = translated.c_str ();
+        }
 
       /* for now, we only remove files from /usr */
       if (!g_str_has_prefix (fn, "usr/"))
         continue;
 
+      const char *slash = strrchr (fn, '/');
+      g_autofree char *dirname = g_strndup (fn, slash - fn);
+      auto names = static_cast<GPtrArray *> (g_hash_table_lookup (deletions, dirname));
+      if (!names)
+        {
+          names = g_ptr_array_new_with_free_func (g_free);
+          g_hash_table_insert (deletions, util::move_nullify (dirname), names);
+        }
+      g_ptr_array_add (names, g_strdup (slash + 1));
+    }
+
+  /* And finally, delete any automatically generated tmpfiles.d dropin. */
+  glnx_autofd int tmpfiles_dfd = -1;
+  if (!glnx_opendirat (rootfs_dfd, "usr/lib/rpm-ostree/tmpfiles.d", TRUE, &tmpfiles_dfd, error))
+    return FALSE;
+  g_autofree char *dropin = g_strdup_printf ("%s.conf", rpmteN (pkg));
+  if (!glnx_shutil_rm_rf_at (tmpfiles_dfd, dropin, cancellable, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+/* Delete the non-directories among @names in @dirname, relative to a single
+ * fd for it; the directories are added to @out_dirs. */
+static gboolean
+delete_paths_in_dir (int rootfs_dfd, const char *dirname, GPtrArray *names, GPtrArray *out_dirs,
+                     GError **error)
+{
+  glnx_autofd int dfd = glnx_opendirat_with_errno (rootfs_dfd, dirname, TRUE);
+  if (dfd < 0)
+    {
+      if (errno == ENOENT)
+        return TRUE;
+      return glnx_throw_errno_prefix (error, "opendir(%s)", dirname);
+    }
+
+  for (guint i = 0; i < names->len; i++)
+    {
+      auto name = static_cast<const char *> (names->pdata[i]);
+
       /* match librpm: check the actual file type on disk rather than the rpmdb */
       struct stat stbuf;
-      if (!glnx_fstatat_allow_noent (rootfs_dfd, fn, &stbuf, AT_SYMLINK_NOFOLLOW, error))
+      if (!glnx_fstatat_allow_noent (dfd, name, &stbuf, AT_SYMLINK_NOFOLLOW, error))
         return FALSE;
       if (errno == ENOENT)
         continue;
 
       /* Delete files first, we'll handle directories next */
       if (S_ISDIR (stbuf.st_mode))
-        g_sequence_insert_sorted (dirs_to_remove, g_strdup (fn), compare_strlen, NULL);
-      else
+        g_ptr_array_add (out_dirs, g_build_filename (dirname, name, NULL));
+      else if (unlinkat (dfd, name, 0) < 0)
         {
-          if (unlinkat (rootfs_dfd, fn, 0) < 0)
-            {
-              if (errno != ENOENT)
-                return glnx_throw_errno_prefix (error, "unlinkat(%s)", fn);
-            }
+          if (errno != ENOENT)
+            return glnx_throw_errno_prefix (error, "unlinkat(%s/%s)", dirname, name);
         }
     }
 
-  /* And finally, delete any automatically generated tmpfiles.d dropin. */
-  glnx_autofd int tmpfiles_dfd = -1;
-  if (!glnx_opendirat (rootfs_dfd, "usr/lib/rpm-ostree/tmpfiles.d", TRUE, &tmpfiles_dfd, error))
-    return FALSE;
-  g_autofree char *dropin = g_strdup_printf ("%s.conf", rpmteN (pkg));
-  if (!glnx_shutil_rm_rf_at (tmpfiles_dfd, dropin, cancellable, error))
+  return TRUE;
+}
+
+typedef struct
+{
+  int rootfs_dfd;
+  GHashTable *deletions;
+  GMutex lock;
+  GPtrArray *dirs; /* char* */
+  GError *error;   /* The first one */
+} DeletionData;
+
+static void
+delete_paths_worker (gpointer data, gpointer user_data)
+{
+  auto dirname = static_cast<const char *> (data);
+  auto ddata = static_cast<DeletionData *> (user_data);
+  auto names = static_cast<GPtrArray *> (g_hash_table_lookup (ddata->deletions, dirname));
+  g_autoptr (GPtrArray) dirs = g_ptr_array_new ();
+  g_autoptr (GError) local_error = NULL;
+  (void)delete_paths_in_dir (ddata->rootfs_dfd, dirname, names, dirs, &local_error);
+
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&ddata->lock);
+  for (guint i = 0; i < dirs->len; i++)
+    g_ptr_array_add (ddata->dirs, dirs->pdata[i]);
+  if (local_error && !ddata->error)
+    ddata->error = util::move_nullify (local_error);
+}
+
+/* Delete the files queued by queue_package_deletion(), a directory at a time
+ * and several directories in parallel; this is all metadata operations, which
+ * filesystems handle concurrently just fine. The directories themselves are
+ * added to @dirs_to_remove, for handle_package_deletion_directories(). */
+static gboolean
+delete_queued_paths (int rootfs_dfd, GHashTable *deletions, GSequence *dirs_to_remove,
+                     GError **error)
+{
+  const guint n_dirs = g_hash_table_size (deletions);
+  if (n_dirs == 0)
+    return TRUE;
+
+  g_autoptr (GPtrArray) dirs = g_ptr_array_new_with_free_func (g_free);
+  DeletionData ddata = { rootfs_dfd, deletions };
+  ddata.dirs = dirs;
+  g_mutex_init (&ddata.lock);
+
+  const guint n_threads = MIN (n_dirs, g_get_num_processors ());
+  GThreadPool *pool = g_thread_pool_new (delete_paths_worker, &ddata, n_threads, TRUE, error);
+  if (!pool)
+    {
+      g_mutex_clear (&ddata.lock);
+      return FALSE;
+    }
+  gboolean pushed = TRUE;
+  GLNX_HASH_TABLE_FOREACH (deletions, const char *, dirname)
+    {
+      if (!g_thread_pool_push (pool, (gpointer)dirname, error))
+        {
+          pushed = FALSE;
+          break;
+        }
+    }
+  /* Waits for the queued ones */
+  g_thread_pool_free (pool, FALSE, TRUE);
+  g_mutex_clear (&ddata.lock);
+
+  g_autoptr (GError) worker_error = ddata.error;
+  if (!pushed)
     return FALSE;
+  if (worker_error)
+    {
+      g_propagate_error (error, util::move_nullify (worker_error));
+      return FALSE;
+    }
 
+  /* Ownership moves to @dirs_to_remove */
+  g_ptr_array_set_free_func (dirs, NULL);
+  for (guint i = 0; i < dirs->len; i++)
+    g_sequence_insert_sorted (dirs_to_remove, dirs->pdata[i], compare_strlen, NULL);
   return TRUE;
 }
 
 /* Process the directories which we were queued up by
- * delete_package_from_root().  We ignore non-empty directories
+ * delete_queued_paths().  We ignore non-empty directories
  * since it's valid for a package being replaced to own a directory
  * to which dependent packages install files (e.g. systemd).
  */
@@ -3153,18 +4897,262 @@ break_hardlinks_at (int dfd, const char *dirpath, GCancellable *cancellable, GEr
   return TRUE;
 }
 
+/* Break the hardlinks of the rpmdb files librpm will write to with the
+ * backend it's using; any others (e.g. left over from another backend) can
+ * stay shared. For files that do need it, ostree_break_hardlink() copies
+ * with a reflink where the filesystem supports that.
+ */
+static gboolean
+break_rpmdb_hardlinks (int rootfs_dfd, GCancellable *cancellable, GError **error)
+{
+  static const char *const sqlite_files[]
+      = { "rpmdb.sqlite", "rpmdb.sqlite-wal", "rpmdb.sqlite-shm", NULL };
+  static const char *const ndb_files[] = { "Packages.db", "Index.db", NULL };
+
+  g_autofree char *backend = rpmExpand ("%{?_db_backend}", NULL);
+  const char *const *files;
+  if (g_str_equal (backend, "sqlite"))
+    files = sqlite_files;
+  else if (g_str_equal (backend, "ndb"))
+    files = ndb_files;
+  else
+    return break_hardlinks_at (rootfs_dfd, RPMOSTREE_RPMDB_LOCATION, cancellable, error);
+
+  glnx_autofd int rpmdb_dfd = -1;
+  if (!glnx_opendirat (rootfs_dfd, RPMOSTREE_RPMDB_LOCATION, TRUE, &rpmdb_dfd, error))
+    return FALSE;
+  for (const char *const *it = files; *it; it++)
+    {
+      if (!glnx_fstatat_allow_noent (rpmdb_dfd, *it, NULL, AT_SYMLINK_NOFOLLOW, error))
+        return FALSE;
+      if (errno == ENOENT)
+        continue;
+      if (!ostree_break_hardlink (rpmdb_dfd, *it, FALSE, cancellable, error))
+        return FALSE;
+    }
+  return TRUE;
+}
+
 typedef struct
 {
-  int tmpdir_dfd;
   const char *name;
   const char *evr;
   const char *arch;
 } RelabelTaskData;
 
+/* Return a copy of @xattrs (which may be %NULL) with the SELinux label set
+ * to @label, or removed if @label is %NULL. */
+static GVariant *
+replace_selinux_xattr (GVariant *xattrs, const char *label)
+{
+  g_auto (GVariantBuilder) builder;
+  g_variant_builder_init (&builder, (GVariantType *)"a(ayay)");
+  gboolean found = FALSE;
+  const guint n = xattrs ? g_variant_n_children (xattrs) : 0;
+  for (guint i = 0; i < n; i++)
+    {
+      const char *name = NULL;
+      g_autoptr (GVariant) value = NULL;
+      g_variant_get_child (xattrs, i, "(^&ay@ay)", &name, &value);
+      if (g_str_equal (name, "security.selinux"))
+        {
+          found = TRUE;
+          if (label)
+            g_variant_builder_add (&builder, "(@ay@ay)", g_variant_new_bytestring (name),
+                                   g_variant_new_bytestring (label));
+        }
+      else
+        g_variant_builder_add (&builder, "(@ay@ay)", g_variant_new_bytestring (name), value);
+    }
+  if (!found && label)
+    g_variant_builder_add (&builder, "(@ay@ay)", g_variant_new_bytestring ("security.selinux"),
+                           g_variant_new_bytestring (label));
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+/* Compute the xattrs for @path/@mode using @label_cache; if they differ from
+ * @xattrs, return them in @out_new_xattrs, otherwise set it to %NULL. */
+static gboolean
+relabel_xattrs (RpmOstreeLabelCache *label_cache, const char *path, guint32 mode,
+                GVariant *xattrs, GVariant **out_new_xattrs, GCancellable *cancellable,
+                GError **error)
+{
+  g_autofree char *label = NULL;
+  if (!rpmostree_label_cache_get_label (label_cache, path, mode, &label, cancellable, error))
+    return FALSE;
+
+  g_autoptr (GVariant) new_xattrs = replace_selinux_xattr (xattrs, label);
+  g_autoptr (GVariant) empty = NULL;
+  if (!xattrs)
+    xattrs = empty = g_variant_ref_sink (g_variant_new_array (G_VARIANT_TYPE ("(ayay)"), NULL, 0));
+  *out_new_xattrs = g_variant_equal (xattrs, new_xattrs) ? NULL : util::move_nullify (new_xattrs);
+  return TRUE;
+}
+
+/* Relabel the directory tree at @path (with contents @contents_csum and
+ * metadata @meta_csum) using @label_cache. Rather than checking
+ * out and recommitting everything, this walks the dirtree objects and only
+ * writes new file, dirmeta and dirtree objects where a label actually
+ * changed; everything else keeps its existing checksum. The resulting
+ * checksums are returned in @out_contents_csum and @out_meta_csum, and
+ * @n_changed is incremented for each relabeled file or directory.
+ */
+static gboolean
+relabel_dir_recurse (OstreeRepo *repo, RpmOstreeLabelCache *label_cache, GString *path,
+                     const char *contents_csum, const char *meta_csum, char **out_contents_csum,
+                     char **out_meta_csum, guint *n_changed, GCancellable *cancellable,
+                     GError **error)
+{
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
+
+  /* First the directory metadata */
+  g_autoptr (GVariant) dirmeta = NULL;
+  if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_DIR_META, meta_csum, &dirmeta, error))
+    return FALSE;
+  guint32 uid, gid, mode;
+  g_autoptr (GVariant) dir_xattrs = NULL;
+  g_variant_get (dirmeta, "(uuu@a(ayay))", &uid, &gid, &mode, &dir_xattrs);
+  g_autoptr (GVariant) new_dir_xattrs = NULL;
+  if (!relabel_xattrs (label_cache, path->str, GUINT32_FROM_BE (mode), dir_xattrs,
+                       &new_dir_xattrs, cancellable, error))
+    return FALSE;
+  g_autofree char *new_meta_csum = NULL;
+  if (new_dir_xattrs)
+    {
+      g_autoptr (GVariant) new_dirmeta
+          = g_variant_ref_sink (g_variant_new ("(uuu@a(ayay))", uid, gid, mode, new_dir_xattrs));
+      g_autofree guchar *csum_bin = NULL;
+      if (!ostree_repo_write_metadata (repo, OSTREE_OBJECT_TYPE_DIR_META, NULL, new_dirmeta,
+                                       &csum_bin, cancellable, error))
+        return FALSE;
+      new_meta_csum = ostree_checksum_from_bytes (csum_bin);
+      (*n_changed)++;
+    }
+  else
+    new_meta_csum = g_strdup (meta_csum);
+
+  /* Then the contents */
+  g_autoptr (GVariant) dirtree = NULL;
+  if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_DIR_TREE, contents_csum, &dirtree,
+                                 error))
+    return FALSE;
+
+  const gsize base_len = path->len;
+  gboolean dirtree_changed = FALSE;
+  g_auto (GVariantBuilder) files_builder;
+  g_variant_builder_init (&files_builder, (GVariantType *)"a(say)");
+  g_autoptr (GVariant) files = g_variant_get_child_value (dirtree, 0);
+  const guint n_files = g_variant_n_children (files);
+  for (guint i = 0; i < n_files; i++)
+    {
+      const char *name = NULL;
+      g_autoptr (GVariant) csum_v = NULL;
+      g_variant_get_child (files, i, "(&s@ay)", &name, &csum_v);
+      char file_csum[OSTREE_SHA256_STRING_LEN + 1];
+      ostree_checksum_inplace_from_bytes (ostree_checksum_bytes_peek (csum_v), file_csum);
+
+      if (base_len > 1)
+        g_string_append_c (path, '/');
+      g_string_append (path, name);
+
+      g_autoptr (GFileInfo) finfo = NULL;
+      g_autoptr (GVariant) xattrs = NULL;
+      if (!ostree_repo_load_file (repo, file_csum, NULL, &finfo, &xattrs, cancellable, error))
+        return FALSE;
+      g_autoptr (GVariant) new_xattrs = NULL;
+      if (!relabel_xattrs (label_cache, path->str,
+                           g_file_info_get_attribute_uint32 (finfo, "unix::mode"), xattrs,
+                           &new_xattrs, cancellable, error))
+        return FALSE;
+
+      if (new_xattrs)
+        {
+          /* Only now do we need the content */
+          g_autoptr (GInputStream) input = NULL;
+          if (!ostree_repo_load_file (repo, file_csum, &input, NULL, NULL, cancellable, error))
+            return FALSE;
+          g_autoptr (GInputStream) content = NULL;
+          guint64 content_len;
+          if (!ostree_raw_file_to_content_stream (input, finfo, new_xattrs, &content,
+                                                  &content_len, cancellable, error))
+            return FALSE;
+          g_autofree guchar *csum_bin = NULL;
+          if (!ostree_repo_write_content (repo, NULL, content, content_len, &csum_bin,
+                                          cancellable, error))
+            return FALSE;
+          g_autofree char *new_file_csum = ostree_checksum_from_bytes (csum_bin);
+          g_variant_builder_add (&files_builder, "(s@ay)", name,
+                                 ostree_checksum_to_bytes_v (new_file_csum));
+          dirtree_changed = TRUE;
+          (*n_changed)++;
+        }
+      else
+        g_variant_builder_add (&files_builder, "(s@ay)", name, csum_v);
+
+      g_string_truncate (path, base_len);
+    }
+
+  g_auto (GVariantBuilder) dirs_builder;
+  g_variant_builder_init (&dirs_builder, (GVariantType *)"a(sayay)");
+  g_autoptr (GVariant) dirs = g_variant_get_child_value (dirtree, 1);
+  const guint n_dirs = g_variant_n_children (dirs);
+  for (guint i = 0; i < n_dirs; i++)
+    {
+      const char *name = NULL;
+      g_autoptr (GVariant) subtree_csum_v = NULL;
+      g_autoptr (GVariant) submeta_csum_v = NULL;
+      g_variant_get_child (dirs, i, "(&s@ay@ay)", &name, &subtree_csum_v, &submeta_csum_v);
+      char subtree_csum[OSTREE_SHA256_STRING_LEN + 1];
+      ostree_checksum_inplace_from_bytes (ostree_checksum_bytes_peek (subtree_csum_v),
+                                          subtree_csum);
+      char submeta_csum[OSTREE_SHA256_STRING_LEN + 1];
+      ostree_checksum_inplace_from_bytes (ostree_checksum_bytes_peek (submeta_csum_v),
+                                          submeta_csum);
+
+      if (base_len > 1)
+        g_string_append_c (path, '/');
+      g_string_append (path, name);
+
+      g_autofree char *new_subtree_csum = NULL;
+      g_autofree char *new_submeta_csum = NULL;
+      if (!relabel_dir_recurse (repo, label_cache, path, subtree_csum, submeta_csum,
+                                &new_subtree_csum, &new_submeta_csum, n_changed, cancellable,
+                                error))
+        return FALSE;
+      if (!g_str_equal (subtree_csum, new_subtree_csum)
+          || !g_str_equal (submeta_csum, new_submeta_csum))
+        dirtree_changed = TRUE;
+      g_variant_builder_add (&dirs_builder, "(s@ay@ay)", name,
+                             ostree_checksum_to_bytes_v (new_subtree_csum),
+                             ostree_checksum_to_bytes_v (new_submeta_csum));
+
+      g_string_truncate (path, base_len);
+    }
+
+  g_autofree char *new_contents_csum = NULL;
+  if (dirtree_changed)
+    {
+      g_autoptr (GVariant) new_dirtree = g_variant_ref_sink (
+          g_variant_new ("(@a(say)@a(sayay))", g_variant_builder_end (&files_builder),
+                         g_variant_builder_end (&dirs_builder)));
+      g_autofree guchar *csum_bin = NULL;
+      if (!ostree_repo_write_metadata (repo, OSTREE_OBJECT_TYPE_DIR_TREE, NULL, new_dirtree,
+                                       &csum_bin, cancellable, error))
+        return FALSE;
+      new_contents_csum = ostree_checksum_from_bytes (csum_bin);
+    }
+  else
+    new_contents_csum = g_strdup (contents_csum);
+
+  *out_contents_csum = util::move_nullify (new_contents_csum);
+  *out_meta_csum = util::move_nullify (new_meta_csum);
+  return TRUE;
+}
+
 static gboolean
 relabel_in_thread_impl (RpmOstreeContext *self, const char *name, const char *evr, const char *arch,
-                        int tmpdir_dfd, gboolean *out_changed, GCancellable *cancellable,
-                        GError **error)
+                        gboolean *out_changed, GCancellable *cancellable, GError **error)
 {
   if (g_cancellable_set_error_if_cancelled (cancellable, error))
     return FALSE;
@@ -3172,7 +5160,7 @@ relabel_in_thread_impl (RpmOstreeContext *self, const char *name, const char *ev
   const char *nevra = glnx_strjoina (name, "-", evr, ".", arch);
   const char *errmsg = glnx_strjoina ("Relabeling ", nevra);
   GLNX_AUTO_PREFIX_ERROR (errmsg, error);
-  const char *pkg_dirname = nevra;
+  rpmostreecxx::TraceSpan span ("relabel", nevra);
 
   OstreeRepo *repo = get_pkgcache_repo (self);
   g_autofree char *cachebranch = rpmostree_get_cache_branch_for_n_evr_a (name, evr, arch);
@@ -3180,45 +5168,41 @@ relabel_in_thread_impl (RpmOstreeContext *self, const char *name, const char *ev
   if (!ostree_repo_resolve_rev (repo, cachebranch, FALSE, &commit_csum, error))
     return FALSE;
 
-  /* Compute the original content checksum */
-  g_autoptr (GVariant) orig_commit = NULL;
-  if (!ostree_repo_load_commit (repo, commit_csum, &orig_commit, NULL, error))
-    return FALSE;
-  g_autofree char *orig_content_checksum = rpmostree_commit_content_checksum (orig_commit);
-
-  /* checkout the pkg and relabel, breaking hardlinks */
-  g_autoptr (OstreeRepoDevInoCache) cache = ostree_repo_devino_cache_new ();
-
-  if (!checkout_package (repo, tmpdir_dfd, pkg_dirname, cache, commit_csum, NULL, NULL,
-                         OSTREE_REPO_CHECKOUT_OVERWRITE_NONE, FALSE, cancellable, error))
+  g_autoptr (GVariant) commit_var = NULL;
+  if (!ostree_repo_load_commit (repo, commit_csum, &commit_var, NULL, error))
     return FALSE;
 
-  /* write to the tree */
-  g_autoptr (OstreeRepoCommitModifier) modifier = ostree_repo_commit_modifier_new (
-      OSTREE_REPO_COMMIT_MODIFIER_FLAGS_CONSUME, NULL, NULL, NULL);
-  ostree_repo_commit_modifier_set_devino_cache (modifier, cache);
-  ostree_repo_commit_modifier_set_sepolicy (modifier, self->sepolicy);
+  /* Relabel the tree in place, only writing what changed */
+  g_autofree char *root_contents_csum = NULL;
+  g_autofree char *root_meta_csum = NULL;
+  {
+    g_autoptr (GVariant) contents_csum_v = NULL;
+    g_autoptr (GVariant) meta_csum_v = NULL;
+    g_variant_get_child (commit_var, 6, "@ay", &contents_csum_v);
+    g_variant_get_child (commit_var, 7, "@ay", &meta_csum_v);
+    g_autofree char *contents_csum = ostree_checksum_from_bytes_v (contents_csum_v);
+    g_autofree char *meta_csum = ostree_checksum_from_bytes_v (meta_csum_v);
+    g_autoptr (GString) path = g_string_new ("/");
+    guint n_changed = 0;
+    if (!relabel_dir_recurse (repo, self->label_cache, path, contents_csum, meta_csum,
+                              &root_contents_csum, &root_meta_csum, &n_changed, cancellable,
+                              error))
+      return FALSE;
+    /* Return whether or not we actually changed content */
+    *out_changed = n_changed > 0;
+  }
 
   g_autoptr (OstreeMutableTree) mtree = ostree_mutable_tree_new ();
-  if (!ostree_repo_write_dfd_to_mtree (repo, tmpdir_dfd, pkg_dirname, mtree, modifier, cancellable,
-                                       error))
-    return glnx_prefix_error (error, "Writing dfd");
-
+  ostree_mutable_tree_set_metadata_checksum (mtree, root_meta_csum);
+  ostree_mutable_tree_set_contents_checksum (mtree, root_contents_csum);
   g_autoptr (GFile) root = NULL;
   if (!ostree_repo_write_mtree (repo, mtree, &root, cancellable, error))
     return FALSE;
 
-  /* build metadata and commit */
-  g_autoptr (GVariant) commit_var = NULL;
-  g_autoptr (GVariantDict) meta_dict = NULL;
-
-  if (!ostree_repo_load_commit (repo, commit_csum, &commit_var, NULL, error))
-    return FALSE;
-
-  /* let's just copy the metadata from the previous commit and only change the
-   * rpmostree.sepolicy value */
+  /* build metadata and commit; let's just copy the metadata from the
+   * previous commit and only change the rpmostree.sepolicy value */
   g_autoptr (GVariant) meta = g_variant_get_child_value (commit_var, 0);
-  meta_dict = g_variant_dict_new (meta);
+  g_autoptr (GVariantDict) meta_dict = g_variant_dict_new (meta);
 
   g_variant_dict_insert (meta_dict, "rpmostree.sepolicy", "s",
                          ostree_sepolicy_get_csum (self->sepolicy));
@@ -3228,18 +5212,9 @@ relabel_in_thread_impl (RpmOstreeContext *self, const char *name, const char *ev
                                  OSTREE_REPO_FILE (root), &new_commit_csum, cancellable, error))
     return FALSE;
 
-  /* Compute new content checksum */
-  g_autoptr (GVariant) new_commit = NULL;
-  if (!ostree_repo_load_commit (repo, new_commit_csum, &new_commit, NULL, error))
-    return FALSE;
-  g_autofree char *new_content_checksum = rpmostree_commit_content_checksum (new_commit);
-
   /* Queue an update to the ref */
   ostree_repo_transaction_set_ref (repo, NULL, cachebranch, new_commit_csum);
 
-  /* Return whether or not we actually changed content */
-  *out_changed = !g_str_equal (orig_content_checksum, new_content_checksum);
-
   return TRUE;
 }
 
@@ -3251,21 +5226,20 @@ relabel_in_thread (GTask *task, gpointer source, gpointer task_data, GCancellabl
   auto tdata = static_cast<RelabelTaskData *> (task_data);
 
   gboolean changed = FALSE;
-  if (!relabel_in_thread_impl (self, tdata->name, tdata->evr, tdata->arch, tdata->tmpdir_dfd,
-                               &changed, cancellable, &local_error))
+  if (!relabel_in_thread_impl (self, tdata->name, tdata->evr, tdata->arch, &changed, cancellable,
+                               &local_error))
     g_task_return_error (task, util::move_nullify (local_error));
   else
     g_task_return_int (task, changed ? 1 : 0);
 }
 
 static void
-relabel_package_async (RpmOstreeContext *self, DnfPackage *pkg, int tmpdir_dfd,
-                       GCancellable *cancellable, GAsyncReadyCallback callback, gpointer user_data)
+relabel_package_async (RpmOstreeContext *self, DnfPackage *pkg, GCancellable *cancellable,
+                       GAsyncReadyCallback callback, gpointer user_data)
 {
   g_autoptr (GTask) task = g_task_new (self, cancellable, callback, user_data);
   RelabelTaskData *tdata = g_new (RelabelTaskData, 1);
   /* We can assume lifetime is greater than the task */
-  tdata->tmpdir_dfd = tmpdir_dfd;
   tdata->name = dnf_package_get_name (pkg);
   tdata->evr = dnf_package_get_evr (pkg);
   tdata->arch = dnf_package_get_arch (pkg);
@@ -3290,8 +5264,11 @@ typedef struct
 static void
 on_async_relabel_done (GObject *obj, GAsyncResult *res, gpointer user_data)
 {
-  auto data = static_cast<RpmOstreeAsyncRelabelData *> (user_data);
+  auto job = static_cast<RpmOstreeWorkQueueJob *> (user_data);
+  auto data
+      = static_cast<RpmOstreeAsyncRelabelData *> (rpmostree_work_queue_job_get_user_data (job));
   RpmOstreeContext *self = data->self;
+  rpmostree_work_queue_job_done (job);
   gssize n_relabeled
       = relabel_package_async_finish (self, res, self->async_error ? NULL : &self->async_error);
   if (n_relabeled < 0)
@@ -3309,10 +5286,24 @@ on_async_relabel_done (GObject *obj, GAsyncResult *res, gpointer user_data)
       data->n_changed_pkgs++;
     }
   self->async_progress->nitems_update (self->n_async_pkgs_relabeled);
-  if (self->n_async_pkgs_relabeled == self->pkgs_to_relabel->len)
+  if (self->async_error == NULL
+      && !rpmostree_work_queue_dispatch (self->async_work_queue, &self->async_error))
+    g_cancellable_cancel (self->async_cancellable);
+  if (rpmostree_work_queue_get_n_running (self->async_work_queue) == 0)
     self->async_running = FALSE;
 }
 
+/* Work queue callback to start relabeling a package */
+static gboolean
+start_queued_relabel (RpmOstreeWorkQueueJob *job, gpointer item, gpointer user_data,
+                      GError **error)
+{
+  auto data = static_cast<RpmOstreeAsyncRelabelData *> (user_data);
+  relabel_package_async (data->self, static_cast<DnfPackage *> (item),
+                         data->self->async_cancellable, on_async_relabel_done, job);
+  return TRUE;
+}
+
 static gboolean
 relabel_if_necessary (RpmOstreeContext *self, GCancellable *cancellable, GError **error)
 {
@@ -3329,20 +5320,18 @@ relabel_if_necessary (RpmOstreeContext *self, GCancellable *cancellable, GError
 
   g_assert (ostreerepo != NULL);
 
-  /* Prep a txn and tmpdir for all of the relabels */
-  g_auto (RpmOstreeRepoAutoTransaction) txn = {
-    0,
-  };
-  if (!rpmostree_repo_auto_transaction_start (&txn, ostreerepo, FALSE, cancellable, error))
+  if (!ensure_label_cache (self, cancellable, error))
     return FALSE;
 
-  g_auto (GLnxTmpDir) relabel_tmpdir = {
+  /* Prep a txn for all of the relabels */
+  g_auto (RpmOstreeRepoAutoTransaction) txn = {
     0,
   };
-  if (!glnx_mkdtempat (ostree_repo_get_dfd (ostreerepo), "tmp/rpm-ostree-relabel.XXXXXX", 0700,
-                       &relabel_tmpdir, error))
+  if (!rpmostree_repo_auto_transaction_start (&txn, ostreerepo, FALSE, cancellable, error))
     return FALSE;
 
+  const gint64 start_time = g_get_monotonic_time ();
+  guint64 relabel_bytes = 0;
   self->async_running = TRUE;
   self->async_cancellable = cancellable;
 
@@ -3350,20 +5339,32 @@ relabel_if_necessary (RpmOstreeContext *self, GCancellable *cancellable, GError
     self,
     0,
   };
+  /* Relabeling is mostly I/O, and after a policy change it can touch every
+   * package; bound what's in flight rather than handing them all to the
+   * thread pool at once. */
+  g_autoptr (RpmOstreeWorkQueue) queue = rpmostree_work_queue_new (
+      "relabel", g_get_num_processors (), start_queued_relabel, &data, g_object_unref);
   const guint n_to_relabel = self->pkgs_to_relabel->len;
-  self->async_progress = rpmostreecxx::progress_nitems_begin (n_to_relabel, "Relabeling");
   for (guint i = 0; i < n_to_relabel; i++)
     {
       auto pkg = static_cast<DnfPackage *> (self->pkgs_to_relabel->pdata[i]);
-      relabel_package_async (self, pkg, relabel_tmpdir.fd, cancellable, on_async_relabel_done,
-                             &data);
+      rpmostree_work_queue_push (queue, g_object_ref (pkg), dnf_package_get_size (pkg));
+      relabel_bytes += dnf_package_get_size (pkg);
     }
+  self->async_work_queue = queue;
+  self->async_progress = rpmostreecxx::progress_nitems_begin (n_to_relabel, "Relabeling");
 
   /* Wait for all of the relabeling to complete */
   GMainContext *mainctx = g_main_context_get_thread_default ();
   self->async_error = NULL;
+  if (!rpmostree_work_queue_dispatch (queue, &self->async_error))
+    g_cancellable_cancel (cancellable);
+  if (rpmostree_work_queue_get_n_running (queue) == 0)
+    self->async_running = FALSE;
   while (self->async_running)
     g_main_context_iteration (mainctx, TRUE);
+  rpmostree_work_queue_log_stats (queue);
+  self->async_work_queue = NULL;
   if (self->async_error)
     {
       g_propagate_error (error, util::move_nullify (self->async_error));
@@ -3377,6 +5378,9 @@ relabel_if_necessary (RpmOstreeContext *self, GCancellable *cancellable, GError
   if (!ostree_repo_commit_transaction (ostreerepo, NULL, cancellable, error))
     return FALSE;
 
+  if (!rpmostree_label_cache_flush (self->label_cache, cancellable, error))
+    return FALSE;
+
   sd_journal_send ("MESSAGE_ID=" SD_ID128_FORMAT_STR,
                    SD_ID128_FORMAT_VAL (RPMOSTREE_MESSAGE_SELINUX_RELABEL),
                    "MESSAGE=Relabeled %u/%u pkgs", data.n_changed_pkgs, n_to_relabel,
@@ -3385,6 +5389,8 @@ relabel_if_necessary (RpmOstreeContext *self, GCancellable *cancellable, GError
   g_clear_pointer (&self->pkgs_to_relabel, (GDestroyNotify)g_ptr_array_unref);
   self->n_async_pkgs_relabeled = 0;
 
+  rpmostree_metrics_count (RPMOSTREE_METRIC_PACKAGES_RELABELED, data.n_changed_pkgs);
+  rpmostree_context_add_phase_timing (self, "relabel", start_time, relabel_bytes, n_to_relabel);
   return TRUE;
 }
 
@@ -3399,6 +5405,12 @@ rpmostree_context_force_relabel (RpmOstreeContext *self, GCancellable *cancellab
       = dnf_goal_get_packages (dnf_context_get_goal (self->dnfctx), DNF_PACKAGE_INFO_INSTALL,
                                DNF_PACKAGE_INFO_UPDATE, DNF_PACKAGE_INFO_DOWNGRADE, -1);
 
+  g_autoptr (RpmOstreePkgcacheIndex) pkgcache_index = NULL;
+  if (!load_pkgcache_index (self, &pkgcache_index, cancellable, error))
+    return FALSE;
+  if (!prefetch_pkgcache_index (pkgcache_index, packages, cancellable, error))
+    return FALSE;
+
   for (guint i = 0; i < packages->len; i++)
     {
       auto pkg = static_cast<DnfPackage *> (packages->pdata[i]);
@@ -3408,13 +5420,16 @@ rpmostree_context_force_relabel (RpmOstreeContext *self, GCancellable *cancellab
 
       /* This logic is equivalent to that in sort_packages() */
       gboolean in_ostree, selinux_match;
-      if (!find_pkg_in_ostree (self, pkg, self->sepolicy, &in_ostree, &selinux_match, error))
+      if (!find_pkg_in_ostree (self, pkgcache_index, pkg, self->sepolicy, &in_ostree,
+                               &selinux_match, cancellable, error))
         return FALSE;
 
       if (in_ostree && !selinux_match)
         g_ptr_array_add (self->pkgs_to_relabel, g_object_ref (pkg));
     }
 
+  flush_pkgcache_index (pkgcache_index, cancellable);
+
   return relabel_if_necessary (self, cancellable, error);
 }
 
@@ -3456,17 +5471,127 @@ ts_callback (const void *h, const rpmCallbackType what, const rpm_loff_t amount,
   return NULL;
 }
 
+/* A header parsed from a metarpm; the file list is only built if needed */
+typedef struct
+{
+  Header hdr;
+  rpmfiles files;
+} RpmOstreeCachedHeader;
+
+static void
+cached_header_free (RpmOstreeCachedHeader *cached)
+{
+  headerFree (cached->hdr);
+  if (cached->files)
+    rpmfilesFree (cached->files);
+  g_free (cached);
+}
+
+/* Return the header and/or a fresh file iterator for the metarpm at @path.
+ * Headers are looked up several times over an assemble (ordering, scripts,
+ * file overrides, the rpmdb), so each is parsed once and cached. */
 static gboolean
 get_package_metainfo (RpmOstreeContext *self, const char *path, Header *out_header, rpmfi *out_fi,
                       GError **error)
 {
-  glnx_autofd int metadata_fd = -1;
-  if (!glnx_openat_rdonly (self->tmpdir.fd, path, TRUE, &metadata_fd, error))
-    return FALSE;
+  if (!self->header_cache)
+    self->header_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                (GDestroyNotify)cached_header_free);
+
+  auto cached
+      = static_cast<RpmOstreeCachedHeader *> (g_hash_table_lookup (self->header_cache, path));
+  if (!cached)
+    {
+      glnx_autofd int metadata_fd = -1;
+      if (!glnx_openat_rdonly (self->tmpdir.fd, path, TRUE, &metadata_fd, error))
+        return FALSE;
+
+      // We just care about reading the stuff librpm wants to put in the database, so no IMA etc.
+      auto flags = rpmostreecxx::rpm_importer_flags_new_empty ();
+      g_auto (Header) hdr = NULL;
+      if (!rpmostree_importer_read_metainfo (metadata_fd, *flags, &hdr, NULL, NULL, error))
+        return FALSE;
+      cached = g_new0 (RpmOstreeCachedHeader, 1);
+      cached->hdr = util::move_nullify (hdr);
+      g_hash_table_insert (self->header_cache, g_strdup (path), cached);
+    }
+
+  if (out_fi)
+    {
+      if (!cached->files)
+        cached->files
+            = rpmfilesNew (NULL, cached->hdr, RPMTAG_BASENAMES,
+                           RPMFI_NOHEADER | RPMFI_FLAGS_QUERY | RPMFI_NOFILESIGNATURES);
+      if (!cached->files)
+        return glnx_throw (error, "Failed to read file list from %s", path);
+      *out_fi = rpmfilesIter (cached->files, RPMFI_ITER_FWD);
+    }
+  if (out_header)
+    *out_header = headerLink (cached->hdr);
+  return TRUE;
+}
+
+/* Must have invoked rpmostree_context_prepare(). Prints what assembling
+ * the depsolved set is expected to cost, from the depsolve and the pkgcache
+ * alone, i.e. without downloading or importing anything. Scripts can only be
+ * counted for packages already in the pkgcache, since rpm-md doesn't say
+ * which packages have any. Sets @out_kernel_changed if a kernel package is
+ * part of the transaction.
+ */
+gboolean
+rpmostree_context_print_cost_estimate (RpmOstreeContext *self, gboolean *out_kernel_changed,
+                                       GCancellable *cancellable, GError **error)
+{
+  g_assert (self->pkgs_to_download);
+
+  g_autoptr (GHashTable) to_import = g_hash_table_new (NULL, NULL);
+  for (guint i = 0; i < self->pkgs_to_import->len; i++)
+    g_hash_table_add (to_import, self->pkgs_to_import->pdata[i]);
+
+  guint n_scripts = 0;
+  for (guint i = 0; i < self->pkgs->len; i++)
+    {
+      auto pkg = static_cast<DnfPackage *> (self->pkgs->pdata[i]);
+      if (g_hash_table_contains (to_import, pkg))
+        continue;
+      if (!checkout_pkg_metadata_by_dnfpkg (self, pkg, cancellable, error))
+        return FALSE;
+      g_autofree char *path = get_package_relpath (pkg);
+      g_auto (Header) hdr = NULL;
+      if (!get_package_metainfo (self, path, &hdr, NULL, error))
+        return FALSE;
+      n_scripts += rpmostree_script_count (pkg, hdr);
+    }
+
+  const char *kernel_names[] = { "kernel", "kernel-core", "kernel-rt", "kernel-rt-core", NULL };
+  g_autoptr (GPtrArray) changed = dnf_goal_get_packages (
+      dnf_context_get_goal (self->dnfctx), DNF_PACKAGE_INFO_INSTALL, DNF_PACKAGE_INFO_REINSTALL,
+      DNF_PACKAGE_INFO_DOWNGRADE, DNF_PACKAGE_INFO_UPDATE, DNF_PACKAGE_INFO_REMOVE,
+      DNF_PACKAGE_INFO_OBSOLETE, -1);
+  gboolean kernel_changed = FALSE;
+  for (guint i = 0; i < changed->len && !kernel_changed; i++)
+    kernel_changed = g_strv_contains (
+        kernel_names, dnf_package_get_name (static_cast<DnfPackage *> (changed->pdata[i])));
+
+  const guint n_download = self->pkgs_to_download->len;
+  g_autofree char *sizestr
+      = g_format_size (dnf_package_array_get_download_size (self->pkgs_to_download));
+  rpmostree_output_message ("Estimated cost:");
+  rpmostree_output_message ("  Download: %u package%s (%s)", n_download, _NS (n_download),
+                            sizestr);
+  rpmostree_output_message ("  Import: %u package%s", self->pkgs_to_import->len,
+                            _NS (self->pkgs_to_import->len));
+  rpmostree_output_message ("  Relabel: %u package%s", self->pkgs_to_relabel->len,
+                            _NS (self->pkgs_to_relabel->len));
+  if (self->pkgs_to_import->len > 0)
+    rpmostree_output_message ("  Scripts: %u, plus those of the %u package%s not yet imported",
+                              n_scripts, self->pkgs_to_import->len,
+                              _NS (self->pkgs_to_import->len));
+  else
+    rpmostree_output_message ("  Scripts: %u", n_scripts);
 
-  // We just care about reading the stuff librpm wants to put in the database, so no IMA etc.
-  auto flags = rpmostreecxx::rpm_importer_flags_new_empty ();
-  return rpmostree_importer_read_metainfo (metadata_fd, *flags, out_header, NULL, out_fi, error);
+  *out_kernel_changed = kernel_changed;
+  return TRUE;
 }
 
 typedef enum
@@ -3485,74 +5610,297 @@ rpmts_add_install (RpmOstreeContext *self, rpmts ts, DnfPackage *pkg,
   if (!get_package_metainfo (self, path, &hdr, NULL, error))
     return FALSE;
 
-  if (!(flags & RPMOSTREE_TS_FLAG_NOVALIDATE_SCRIPTS))
+  if (!(flags & RPMOSTREE_TS_FLAG_NOVALIDATE_SCRIPTS))
+    {
+      if (!rpmostree_script_txn_validate (pkg, hdr, cancellable, error))
+        return FALSE;
+    }
+
+  const gboolean is_upgrade = (flags & RPMOSTREE_TS_FLAG_UPGRADE) > 0;
+  if (rpmtsAddInstallElement (ts, hdr, pkg, is_upgrade, NULL) != 0)
+    return glnx_throw (error, "Failed to add install element for %s",
+                       dnf_package_get_filename (pkg));
+
+  return TRUE;
+}
+
+static gboolean
+rpmts_add_erase (RpmOstreeContext *self, rpmts ts, DnfPackage *pkg, GCancellable *cancellable,
+                 GError **error)
+{
+  /* NB: we're not running any %*un scriptlets right now */
+  g_auto (Header) hdr = get_rpmdb_pkg_header (ts, pkg, cancellable, error);
+  if (hdr == NULL)
+    return FALSE;
+
+  if (rpmtsAddEraseElement (ts, hdr, -1))
+    return glnx_throw (error, "Failed to add erase element for package '%s'",
+                       dnf_package_get_nevra (pkg));
+
+  return TRUE;
+}
+
+/* Look up the header for a package, and pass it
+ * to the script core to execute.
+ */
+static gboolean
+run_script_sync (RpmOstreeContext *self, int rootfs_dfd, GLnxTmpDir *var_lib_rpm_statedir,
+                 rpmostreecxx::BubblewrapSession &bwrap_session, DnfPackage *pkg,
+                 RpmOstreeScriptKind kind, RpmOstreeDeferredScripts *deferred, guint *out_n_run,
+                 GCancellable *cancellable, GError **error)
+{
+  g_auto (Header) hdr = NULL;
+  g_autofree char *path = get_package_relpath (pkg);
+
+  if (!get_package_metainfo (self, path, &hdr, NULL, error))
+    return FALSE;
+
+  if (!rpmostree_script_run_sync (pkg, hdr, kind, rootfs_dfd, var_lib_rpm_statedir,
+                                  self->enable_rofiles, &bwrap_session, self->script_timings,
+                                  deferred, out_n_run, cancellable, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+/* Whether @te requires something provided by one of the elements of @tes */
+static gboolean
+te_requires_any_of (rpmte te, GPtrArray *tes)
+{
+  rpmds requires = rpmteDS (te, RPMTAG_REQUIRENAME);
+  for (guint i = 0; i < tes->len; i++)
+    {
+      auto other = static_cast<rpmte> (tes->pdata[i]);
+      g_auto (rpmfiles) other_files = rpmteFiles (other);
+      rpmds provides = rpmteDS (other, RPMTAG_PROVIDENAME);
+      rpmdsInit (requires);
+      while (rpmdsNext (requires) >= 0)
+        {
+          const char *reqname = rpmdsN (requires);
+          if (*reqname == '/' && other_files && rpmfilesFindFN (other_files, reqname) >= 0)
+            return TRUE;
+          rpmdsInit (provides);
+          while (rpmdsNext (provides) >= 0)
+            {
+              if (g_str_equal (reqname, rpmdsN (provides)))
+                return TRUE;
+            }
+        }
+    }
+  return FALSE;
+}
+
+/* Run the %post scripts of the packages of @tes, concurrently */
+static gboolean
+run_post_script_batch (RpmOstreeContext *self, int rootfs_dfd, GLnxTmpDir *var_lib_rpm_statedir,
+                       rpmostreecxx::BubblewrapSession &bwrap_session, GPtrArray *tes,
+                       RpmOstreeDeferredScripts *deferred, guint *out_n_run,
+                       GCancellable *cancellable, GError **error)
+{
+  if (tes->len == 0)
+    return TRUE;
+
+  g_autoptr (GPtrArray) pkgs = g_ptr_array_new ();
+  g_autoptr (GPtrArray) hdrs = g_ptr_array_new_with_free_func ((GDestroyNotify)headerFree);
+  for (guint i = 0; i < tes->len; i++)
+    {
+      auto pkg = static_cast<DnfPackage *> (rpmteKey (static_cast<rpmte> (tes->pdata[i])));
+      g_autofree char *path = get_package_relpath (pkg);
+      Header hdr = NULL;
+      if (!get_package_metainfo (self, path, &hdr, NULL, error))
+        return FALSE;
+      g_ptr_array_add (pkgs, pkg);
+      g_ptr_array_add (hdrs, hdr);
+    }
+  g_ptr_array_set_size (tes, 0);
+
+  return rpmostree_script_run_batch_sync (pkgs, hdrs, RPMOSTREE_SCRIPT_POSTIN, rootfs_dfd,
+                                          var_lib_rpm_statedir, self->enable_rofiles,
+                                          &bwrap_session, self->script_timings, deferred,
+                                          out_n_run, cancellable, error);
+}
+
+/* Apply the ownership, fcaps and mode of the file at @fn (as in the RPM
+ * header) to the checkout; see apply_rpmfi_overrides() */
+static gboolean
+apply_rpmfi_override (RpmOstreeContext *self, int tmprootfs_dfd, DnfPackage *pkg, const char *fn,
+                      const char *user, const char *group, const char *fcaps, rpm_mode_t mode,
+                      gboolean is_ghost, rpmostreecxx::PasswdEntries &passwd_entries,
+                      gboolean *inout_emitted_nonusr_warning, GCancellable *cancellable,
+                      GError **error)
+{
+  const gboolean have_fcaps = fcaps[0] != '\0';
+
+  g_assert (fn != NULL);
+  fn += strspn (fn, "/");
+  g_assert (fn[0]);
+
+  /* Be sure we've canonicalized usr/ */
+  g_autofree char *fn_canonical = canonicalize_non_usrmove_path (self, fn);
+  if (fn_canonical)
+    fn = fn_canonical;
+
+  /* /run and /var paths have already been translated to tmpfiles during
+   * unpacking */
+  if (g_str_has_prefix (fn, "run/") || g_str_has_prefix (fn, "var/"))
+    return TRUE;
+  else if (g_str_has_prefix (fn, "etc/"))
+    {
+      /* Changing /etc is OK; note "normally" we maintain
+       * usr/etc but this runs right after %pre, where
+       * we're in the middle of running scripts.
+       */
+    }
+  else if (!g_str_has_prefix (fn, "usr/"))
+    {
+      /* TODO: query whether Fedora has anything in this category we care about */
+      if (!*inout_emitted_nonusr_warning)
+        {
+          sd_journal_print (LOG_WARNING, "Ignoring rpm mode for non-/usr content: %s", fn);
+          *inout_emitted_nonusr_warning = TRUE;
+        }
+      return TRUE;
+    }
+
+  struct stat stbuf;
+  if (fstatat (tmprootfs_dfd, fn, &stbuf, AT_SYMLINK_NOFOLLOW) != 0)
+    {
+      /* In the ghost case, we expect it to not exist */
+      if (errno == ENOENT && is_ghost)
+        return TRUE;
+      return glnx_throw_errno_prefix (error, "fstatat(%s)", fn);
+    }
+
+  if ((S_IFMT & stbuf.st_mode) != (S_IFMT & mode))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Inconsistent file type between RPM and checkout "
+                   "for file '%s' in package '%s'",
+                   fn, dnf_package_get_name (pkg));
+      return FALSE;
+    }
+
+  /* See rpmostree_context_get_deferred_ownership() */
+  const gboolean deferred = getuid () != 0;
+  if (!S_ISDIR (stbuf.st_mode) && !deferred)
     {
-      if (!rpmostree_script_txn_validate (pkg, hdr, cancellable, error))
-        return FALSE;
+      if (!ostree_break_hardlink (tmprootfs_dfd, fn, FALSE, cancellable, error))
+        return glnx_prefix_error (error, "Copyup %s", fn);
     }
 
-  const gboolean is_upgrade = (flags & RPMOSTREE_TS_FLAG_UPGRADE) > 0;
-  if (rpmtsAddInstallElement (ts, hdr, pkg, is_upgrade, NULL) != 0)
-    return glnx_throw (error, "Failed to add install element for %s",
-                       dnf_package_get_filename (pkg));
+  /* The %post of a package sorted earlier may have created the user or
+   * group; only then are the files reparsed. */
+  if ((!g_str_equal (user, "root") && !passwd_entries.contains_user (user))
+      || (!g_str_equal (group, "root") && !passwd_entries.contains_group (group)))
+    CXX_TRY (passwd_entries.refresh (tmprootfs_dfd), error);
 
-  return TRUE;
-}
+  uid_t uid = 0;
+  if (!g_str_equal (user, "root"))
+    {
+      if (!passwd_entries.contains_user (user))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Could not find user '%s' in passwd file", user);
+          return FALSE;
+        }
+      CXX_TRY_VAR (uidv, passwd_entries.lookup_user_id (user), error);
+      uid = std::move (uidv);
+    }
 
-static gboolean
-rpmts_add_erase (RpmOstreeContext *self, rpmts ts, DnfPackage *pkg, GCancellable *cancellable,
-                 GError **error)
-{
-  /* NB: we're not running any %*un scriptlets right now */
-  g_auto (Header) hdr = get_rpmdb_pkg_header (ts, pkg, cancellable, error);
-  if (hdr == NULL)
-    return FALSE;
+  gid_t gid = 0;
+  if (!g_str_equal (group, "root"))
+    {
+      if (!passwd_entries.contains_group (group))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Could not find group '%s' in group file", group);
+          return FALSE;
+        }
 
-  if (rpmtsAddEraseElement (ts, hdr, -1))
-    return glnx_throw (error, "Failed to add erase element for package '%s'",
-                       dnf_package_get_nevra (pkg));
+      CXX_TRY_VAR (gidv, passwd_entries.lookup_group_id (group), error);
+      gid = std::move (gidv);
+    }
 
-  return TRUE;
-}
+  if (deferred)
+    {
+      if (!self->deferred_ownership)
+        self->deferred_ownership = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                          (GDestroyNotify)g_variant_unref);
+      g_autofree char *relpath = g_str_has_prefix (fn, "etc/") ? g_strconcat ("usr/", fn, NULL)
+                                                               : g_strdup (fn);
+      g_hash_table_replace (self->deferred_ownership, util::move_nullify (relpath),
+                            g_variant_ref_sink (g_variant_new ("(uuus)", uid, gid, (guint32)mode,
+                                                               have_fcaps ? fcaps : "")));
+      return TRUE;
+    }
 
-/* Look up the header for a package, and pass it
- * to the script core to execute.
- */
-static gboolean
-run_script_sync (RpmOstreeContext *self, int rootfs_dfd, GLnxTmpDir *var_lib_rpm_statedir,
-                 DnfPackage *pkg, RpmOstreeScriptKind kind, guint *out_n_run,
-                 GCancellable *cancellable, GError **error)
-{
-  g_auto (Header) hdr = NULL;
-  g_autofree char *path = get_package_relpath (pkg);
+  if (fchownat (tmprootfs_dfd, fn, uid, gid, AT_SYMLINK_NOFOLLOW) != 0)
+    return glnx_throw_errno_prefix (error, "fchownat(%s)", fn);
 
-  if (!get_package_metainfo (self, path, &hdr, NULL, error))
-    return FALSE;
+  /* the chown clears away file caps, so reapply it here */
+  if (have_fcaps)
+    {
+      g_autoptr (GVariant) xattrs = rpmostree_fcap_to_xattr_variant (fcaps);
+      if (!glnx_dfd_name_set_all_xattrs (tmprootfs_dfd, fn, xattrs, cancellable, error))
+        return glnx_prefix_error (error, "%s", fn);
+    }
 
-  if (!rpmostree_script_run_sync (pkg, hdr, kind, rootfs_dfd, var_lib_rpm_statedir,
-                                  self->enable_rofiles, out_n_run, cancellable, error))
-    return FALSE;
+  /* also reapply chmod since e.g. at least the setuid gets taken off */
+  if (S_ISREG (mode))
+    {
+      g_assert (S_ISREG (stbuf.st_mode));
+      if (fchmodat (tmprootfs_dfd, fn, mode, 0) != 0)
+        return glnx_throw_errno_prefix (error, "fchmodat(%s)", fn);
+    }
 
   return TRUE;
 }
 
 static gboolean
 apply_rpmfi_overrides (RpmOstreeContext *self, int tmprootfs_dfd, DnfPackage *pkg,
-                       rpmostreecxx::PasswdEntries &passwd_entries, GCancellable *cancellable,
-                       GError **error)
+                       const char *pkg_commit, rpmostreecxx::PasswdEntries &passwd_entries,
+                       GCancellable *cancellable, GError **error)
 {
-  /* In an unprivileged case, we can't do this on the real filesystem. For `ex
-   * container`, we want to completely ignore uid/gid.
-   *
-   * TODO: For non-root `--unified-core` we need to do it as a commit modifier.
-   */
-  if (getuid () != 0)
+  /* In an unprivileged case, we can't do this on the real filesystem, so it's
+   * left to the commit; see rpmostree_context_get_deferred_ownership(). For
+   * `ex container`, we want to completely ignore uid/gid. */
+  if (getuid () != 0 && self->is_container)
     return TRUE; /* 🔚 Early return */
 
-  g_auto (rpmfi) fi = NULL;
   gboolean emitted_nonusr_warning = FALSE;
-  g_autofree char *path = get_package_relpath (pkg);
 
+  /* Normally the importer already recorded the handful of files that need
+   * this, so we don't have to walk the whole file list */
+  if (pkg_commit)
+    {
+      g_autoptr (GVariant) commit = NULL;
+      if (!ostree_repo_load_commit (get_pkgcache_repo (self), pkg_commit, &commit, NULL, error))
+        return FALSE;
+      g_autoptr (GVariant) metadata = g_variant_get_child_value (commit, 0);
+      g_autoptr (GVariant) overrides
+          = g_variant_lookup_value (metadata, RPMOSTREE_RPMFI_OVERRIDES_KEY,
+                                    G_VARIANT_TYPE (RPMOSTREE_RPMFI_OVERRIDES_FORMAT));
+      if (overrides)
+        {
+          GVariantIter iter;
+          g_variant_iter_init (&iter, overrides);
+          const char *fn, *user, *group, *fcaps;
+          guint32 mode;
+          gboolean is_ghost;
+          while (g_variant_iter_next (&iter, "(&s&s&s&sub)", &fn, &user, &group, &fcaps, &mode,
+                                      &is_ghost))
+            {
+              if (!apply_rpmfi_override (self, tmprootfs_dfd, pkg, fn, user, group, fcaps, mode,
+                                         is_ghost, passwd_entries, &emitted_nonusr_warning,
+                                         cancellable, error))
+                return FALSE;
+            }
+          return TRUE;
+        }
+    }
+
+  g_auto (rpmfi) fi = NULL;
+  g_autofree char *path = get_package_relpath (pkg);
   if (!get_package_metainfo (self, path, NULL, &fi, error))
     return FALSE;
 
@@ -3587,108 +5935,9 @@ apply_rpmfi_overrides (RpmOstreeContext *self, int tmprootfs_dfd, DnfPackage *pk
       if (!(S_ISREG (mode) || S_ISLNK (mode) || S_ISDIR (mode)))
         continue;
 
-      g_assert (fn != NULL);
-      fn += strspn (fn, "/");
-      g_assert (fn[0]);
-
-      /* Be sure we've canonicalized usr/ */
-      g_autofree char *fn_canonical = canonicalize_non_usrmove_path (self, fn);
-      if (fn_canonical)
-        fn = fn_canonical;
-
-      /* /run and /var paths have already been translated to tmpfiles during
-       * unpacking */
-      if (g_str_has_prefix (fn, "run/") || g_str_has_prefix (fn, "var/"))
-        continue;
-      else if (g_str_has_prefix (fn, "etc/"))
-        {
-          /* Changing /etc is OK; note "normally" we maintain
-           * usr/etc but this runs right after %pre, where
-           * we're in the middle of running scripts.
-           */
-        }
-      else if (!g_str_has_prefix (fn, "usr/"))
-        {
-          /* TODO: query whether Fedora has anything in this category we care about */
-          if (!emitted_nonusr_warning)
-            {
-              sd_journal_print (LOG_WARNING, "Ignoring rpm mode for non-/usr content: %s", fn);
-              emitted_nonusr_warning = TRUE;
-            }
-          continue;
-        }
-
-      struct stat stbuf;
-      if (fstatat (tmprootfs_dfd, fn, &stbuf, AT_SYMLINK_NOFOLLOW) != 0)
-        {
-          /* Not early loop skip; in the ghost case, we expect it to not
-           * exist.
-           */
-          if (errno == ENOENT && is_ghost)
-            continue;
-          return glnx_throw_errno_prefix (error, "fstatat(%s)", fn);
-        }
-
-      if ((S_IFMT & stbuf.st_mode) != (S_IFMT & mode))
-        {
-          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                       "Inconsistent file type between RPM and checkout "
-                       "for file '%s' in package '%s'",
-                       fn, dnf_package_get_name (pkg));
-          return FALSE;
-        }
-
-      if (!S_ISDIR (stbuf.st_mode))
-        {
-          if (!ostree_break_hardlink (tmprootfs_dfd, fn, FALSE, cancellable, error))
-            return glnx_prefix_error (error, "Copyup %s", fn);
-        }
-
-      uid_t uid = 0;
-      if (!g_str_equal (user, "root"))
-        {
-          if (!passwd_entries.contains_user (user))
-            {
-              g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                           "Could not find user '%s' in passwd file", user);
-              return FALSE;
-            }
-          CXX_TRY_VAR (uidv, passwd_entries.lookup_user_id (user), error);
-          uid = std::move (uidv);
-        }
-
-      gid_t gid = 0;
-      if (!g_str_equal (group, "root"))
-        {
-          if (!passwd_entries.contains_group (group))
-            {
-              g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                           "Could not find group '%s' in group file", group);
-              return FALSE;
-            }
-
-          CXX_TRY_VAR (gidv, passwd_entries.lookup_group_id (group), error);
-          gid = std::move (gidv);
-        }
-
-      if (fchownat (tmprootfs_dfd, fn, uid, gid, AT_SYMLINK_NOFOLLOW) != 0)
-        return glnx_throw_errno_prefix (error, "fchownat(%s)", fn);
-
-      /* the chown clears away file caps, so reapply it here */
-      if (have_fcaps)
-        {
-          g_autoptr (GVariant) xattrs = rpmostree_fcap_to_xattr_variant (fcaps);
-          if (!glnx_dfd_name_set_all_xattrs (tmprootfs_dfd, fn, xattrs, cancellable, error))
-            return glnx_prefix_error (error, "%s", fn);
-        }
-
-      /* also reapply chmod since e.g. at least the setuid gets taken off */
-      if (S_ISREG (mode))
-        {
-          g_assert (S_ISREG (stbuf.st_mode));
-          if (fchmodat (tmprootfs_dfd, fn, mode, 0) != 0)
-            return glnx_throw_errno_prefix (error, "fchmodat(%s)", fn);
-        }
+      if (!apply_rpmfi_override (self, tmprootfs_dfd, pkg, fn, user, group, fcaps, mode, is_ghost,
+                                 passwd_entries, &emitted_nonusr_warning, cancellable, error))
+        return FALSE;
     }
 
   return TRUE;
@@ -3733,9 +5982,60 @@ add_install (RpmOstreeContext *self, DnfPackage *pkg, rpmts ts, gboolean is_upgr
   return TRUE;
 }
 
+/* Load the index of base packages with file triggers from the base commit,
+ * if we know it and it has one. */
+static gboolean
+load_base_transfiletriggers_index (RpmOstreeContext *self, GVariant **out_index, GError **error)
+{
+  *out_index = NULL;
+  if (!self->base_commit || !self->ostreerepo)
+    return TRUE;
+
+  g_autoptr (GVariant) commit = NULL;
+  if (!ostree_repo_load_commit (self->ostreerepo, self->base_commit, &commit, NULL, error))
+    return FALSE;
+  g_autoptr (GVariant) metadata = g_variant_get_child_value (commit, 0);
+  g_autoptr (GVariantDict) metadata_dict = g_variant_dict_new (metadata);
+  *out_index = g_variant_dict_lookup_value (
+      metadata_dict, RPMOSTREE_TRANSFILETRIGGERS_INDEX_KEY,
+      G_VARIANT_TYPE (RPMOSTREE_TRANSFILETRIGGERS_INDEX_FORMAT));
+  return TRUE;
+}
+
+static gint
+compare_strings (gconstpointer a, gconstpointer b)
+{
+  return strcmp (*(const char *const *)a, *(const char *const *)b);
+}
+
+/* Return the sorted paths of the files the packages added by @ts install */
+static GPtrArray *
+get_added_file_paths (rpmts ts)
+{
+  g_autoptr (GPtrArray) paths = g_ptr_array_new_with_free_func (g_free);
+  const guint n = (guint)rpmtsNElements (ts);
+  for (guint i = 0; i < n; i++)
+    {
+      rpmte te = rpmtsElement (ts, i);
+      if (rpmteType (te) != TR_ADDED)
+        continue;
+      g_auto (rpmfiles) files = rpmteFiles (te);
+      g_auto (rpmfi) fi = rpmfilesIter (files, RPMFI_ITER_FWD);
+      while (rpmfiNext (fi) >= 0)
+        {
+          if (S_ISDIR (rpmfiFMode (fi)) || (rpmfiFFlags (fi) & RPMFILE_GHOST))
+            continue;
+          g_ptr_array_add (paths, g_strdup (rpmfiFN (fi)));
+        }
+    }
+  g_ptr_array_sort (paths, compare_strings);
+  return util::move_nullify (paths);
+}
+
 /* Run %transfiletriggerin */
 static gboolean
-run_all_transfiletriggers (RpmOstreeContext *self, rpmts ts, int rootfs_dfd, guint *out_n_run,
+run_all_transfiletriggers (RpmOstreeContext *self, rpmts ts, int rootfs_dfd,
+                           rpmostreecxx::BubblewrapSession &bwrap_session, guint *out_n_run,
                            GCancellable *cancellable, GError **error)
 {
   /* Triggers from base packages, but only if we already have an rpmdb,
@@ -3744,14 +6044,44 @@ run_all_transfiletriggers (RpmOstreeContext *self, rpmts ts, int rootfs_dfd, gui
   if (!glnx_fstatat_allow_noent (rootfs_dfd, RPMOSTREE_RPMDB_LOCATION, NULL, AT_SYMLINK_NOFOLLOW,
                                  error))
     return FALSE;
-  if (errno == 0)
+  const gboolean have_rpmdb = (errno == 0);
+  g_autoptr (GVariant) base_index = NULL;
+  if (have_rpmdb && !load_base_transfiletriggers_index (self, &base_index, error))
+    return FALSE;
+  /* When layering on a base, only feed the base triggers the files we added,
+   * rather than everything in their directories; the base itself was
+   * already handled when it was composed.
+   */
+  g_autoptr (GPtrArray) added_paths = have_rpmdb ? get_added_file_paths (ts) : NULL;
+  if (base_index)
+    {
+      /* Only read the headers of packages which have triggers */
+      GVariantIter iter;
+      g_variant_iter_init (&iter, base_index);
+      const char *name;
+      while (g_variant_iter_next (&iter, "(&s@as)", &name, NULL))
+        {
+          g_auto (rpmdbMatchIterator) mi = rpmtsInitIterator (ts, RPMDBI_NAME, name, 0);
+          Header hdr;
+          while (mi && (hdr = rpmdbNextIterator (mi)) != NULL)
+            {
+              if (!rpmostree_transfiletriggers_run_sync (hdr, rootfs_dfd, self->enable_rofiles,
+                                                         &bwrap_session, self->script_timings,
+                                                         added_paths, out_n_run, cancellable,
+                                                         error))
+                return FALSE;
+            }
+        }
+    }
+  else if (have_rpmdb)
     {
       g_auto (rpmdbMatchIterator) mi = rpmtsInitIterator (ts, RPMDBI_PACKAGES, NULL, 0);
       Header hdr;
       while ((hdr = rpmdbNextIterator (mi)) != NULL)
         {
           if (!rpmostree_transfiletriggers_run_sync (hdr, rootfs_dfd, self->enable_rofiles,
-                                                     out_n_run, cancellable, error))
+                                                     &bwrap_session, self->script_timings,
+                                                     added_paths, out_n_run, cancellable, error))
             return FALSE;
         }
     }
@@ -3769,13 +6099,108 @@ run_all_transfiletriggers (RpmOstreeContext *self, rpmts ts, int rootfs_dfd, gui
       if (!get_package_metainfo (self, path, &hdr, NULL, error))
         return FALSE;
 
-      if (!rpmostree_transfiletriggers_run_sync (hdr, rootfs_dfd, self->enable_rofiles, out_n_run,
-                                                 cancellable, error))
+      /* These are new, so they need to see every matching file, not just
+       * the ones added alongside them */
+      if (!rpmostree_transfiletriggers_run_sync (hdr, rootfs_dfd, self->enable_rofiles,
+                                                 &bwrap_session, self->script_timings, NULL,
+                                                 out_n_run, cancellable, error))
         return FALSE;
     }
   return TRUE;
 }
 
+/* Set the commit that the root directory given to
+ * rpmostree_context_set_tmprootfs_dfd() was checked out from, if any. This is
+ * optional, and lets us use metadata computed for it at compose time.
+ */
+/* Returns the RPMOSTREE_SCRIPTS_TIMING_KEY metadata for the scripts run so
+ * far, or NULL if there weren't any. */
+GVariant *
+rpmostree_context_get_script_timings (RpmOstreeContext *self)
+{
+  return rpmostree_script_timings_to_variant (self->script_timings);
+}
+
+/* Account the time since @start_time (from g_get_monotonic_time()) to
+ * @phase, which must be a static string, along with how much it processed.
+ * A phase may be entered more than once; the totals are reported. */
+void
+rpmostree_context_add_phase_timing (RpmOstreeContext *self, const char *phase, gint64 start_time,
+                                    guint64 bytes, guint64 n_objects)
+{
+  RpmOstreePhaseTiming *timing = NULL;
+  for (guint i = 0; i < self->phase_timings->len && !timing; i++)
+    {
+      auto t = &g_array_index (self->phase_timings, RpmOstreePhaseTiming, i);
+      if (g_str_equal (t->phase, phase))
+        timing = t;
+    }
+  if (!timing)
+    {
+      RpmOstreePhaseTiming empty = { phase, 0, 0, 0 };
+      g_array_append_val (self->phase_timings, empty);
+      const guint last = self->phase_timings->len - 1;
+      timing = &g_array_index (self->phase_timings, RpmOstreePhaseTiming, last);
+    }
+  timing->wall_usec += MAX (g_get_monotonic_time () - start_time, 0);
+  timing->bytes += bytes;
+  timing->n_objects += n_objects;
+}
+
+/* Returns the phases in the order they were first entered, or NULL if none
+ * were. */
+GVariant *
+rpmostree_context_get_phase_timings (RpmOstreeContext *self)
+{
+  if (self->phase_timings->len == 0)
+    return NULL;
+  g_auto (GVariantBuilder) builder;
+  g_variant_builder_init (&builder, (GVariantType *)"aa{sv}");
+  for (guint i = 0; i < self->phase_timings->len; i++)
+    {
+      auto t = &g_array_index (self->phase_timings, RpmOstreePhaseTiming, i);
+      g_auto (GVariantDict) dict;
+      g_variant_dict_init (&dict, NULL);
+      g_variant_dict_insert (&dict, "phase", "s", t->phase);
+      g_variant_dict_insert (&dict, "wall-ms", "t", t->wall_usec / 1000);
+      g_variant_dict_insert (&dict, "bytes", "t", t->bytes);
+      g_variant_dict_insert (&dict, "objects", "t", t->n_objects);
+      g_variant_builder_add_value (&builder, g_variant_dict_end (&dict));
+    }
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+void
+rpmostree_context_set_base_commit (RpmOstreeContext *self, const char *base_commit)
+{
+  g_free (self->base_commit);
+  self->base_commit = g_strdup (base_commit);
+}
+
+/* Declare that the root directory given to rpmostree_context_set_tmprootfs_dfd()
+ * already has the packages in @nevras layered, e.g. because it's a checkout of
+ * a previous layered commit. assemble() then leaves them alone, and only
+ * checks out and runs the scripts of the packages being added.
+ */
+void
+rpmostree_context_set_layered_nevras (RpmOstreeContext *self, GHashTable *nevras)
+{
+  g_clear_pointer (&self->layered_nevras, g_hash_table_unref);
+  self->layered_nevras = nevras ? g_hash_table_ref (nevras) : NULL;
+}
+
+/* Record @digest as the digest of the inputs this context was set up from
+ * in the client layering commit metadata, so that a later run with the
+ * same inputs can reuse the commit without a depsolve; see
+ * prep_local_assembly() in the sysroot upgrader.
+ */
+void
+rpmostree_context_set_input_digest (RpmOstreeContext *self, const char *digest)
+{
+  g_free (self->input_digest);
+  self->input_digest = g_strdup (digest);
+}
+
 /* Set the root directory fd used for assemble(); used
  * by the sysroot upgrader for the base tree.  This is optional;
  * assemble() will use a tmpdir if not provided.
@@ -3883,52 +6308,118 @@ process_ostree_layers (RpmOstreeContext *self, int rootfs_dfd, GCancellable *can
   return TRUE;
 }
 
+/* Whether we can write the rpmdb for @overlays with import_rpmdb_headers():
+ * that's only the case if we're starting from an empty rpmdb, and librpm
+ * wouldn't skip any of the files (which a transaction would record as not
+ * installed). */
 static gboolean
-write_rpmdb (RpmOstreeContext *self, int tmprootfs_dfd, GPtrArray *overlays,
-             GPtrArray *overrides_replace, GPtrArray *overrides_remove, gboolean have_fileoverride,
-             GCancellable *cancellable, GError **error)
+can_import_rpmdb_headers (int tmprootfs_dfd, GPtrArray *overrides_replace,
+                          GPtrArray *overrides_remove, gboolean *out_can_import, GError **error)
 {
-  auto task = rpmostreecxx::progress_begin_task ("Writing rpmdb");
+  *out_can_import = FALSE;
+  if (overrides_replace->len > 0 || overrides_remove->len > 0)
+    return TRUE;
 
-  if (!glnx_shutil_mkdir_p_at (tmprootfs_dfd, RPMOSTREE_RPMDB_LOCATION, 0755, cancellable, error))
+  g_autofree char *install_langs = rpmExpand ("%{?_install_langs}", NULL);
+  g_autofree char *netsharedpath = rpmExpand ("%{?_netsharedpath}", NULL);
+  if ((*install_langs && !g_str_equal (install_langs, "all")) || *netsharedpath)
+    return TRUE;
+
+  g_auto (GLnxDirFdIterator) dfd_iter = {
+    FALSE,
+  };
+  if (!glnx_dirfd_iterator_init_at (tmprootfs_dfd, RPMOSTREE_RPMDB_LOCATION, TRUE, &dfd_iter,
+                                    error))
     return FALSE;
+  struct dirent *dent = NULL;
+  if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, NULL, error))
+    return FALSE;
+  *out_can_import = (dent == NULL);
+  return TRUE;
+}
 
-  /* Now, we use the separate rpmdb ts which *doesn't* have a rootdir set,
-   * because if it did rpmtsRun() would try to chroot which it won't be able to
-   * if we're unprivileged, even though we're not trying to run %post scripts
-   * now.
-   *
-   * Instead, this rpmts has the dbpath as absolute.
-   */
-  {
-    g_autofree char *rpmdb_abspath = glnx_fdrel_abspath (tmprootfs_dfd, RPMOSTREE_RPMDB_LOCATION);
+/* Add the header of @pkg to the rpmdb of @txn, with the tags librpm would
+ * set when installing it. */
+static gboolean
+import_rpmdb_header (RpmOstreeContext *self, rpmtxn txn, DnfPackage *pkg, guint32 install_time,
+                     guint32 color, GError **error)
+{
+  g_auto (Header) hdr = NULL;
+  g_autofree char *path = get_package_relpath (pkg);
+  if (!get_package_metainfo (self, path, &hdr, NULL, error))
+    return FALSE;
 
-    /* if we were passed an existing tmprootfs, and that tmprootfs already has
-     * an rpmdb, we have to make sure to break its hardlinks as librpm mutates
-     * the db in place */
-    if (!break_hardlinks_at (tmprootfs_dfd, RPMOSTREE_RPMDB_LOCATION, cancellable, error))
-      return FALSE;
+  headerDel (hdr, RPMTAG_INSTALLTIME);
+  headerDel (hdr, RPMTAG_INSTALLTID);
+  headerDel (hdr, RPMTAG_INSTALLCOLOR);
+  headerDel (hdr, RPMTAG_FILESTATES);
+  headerPutUint32 (hdr, RPMTAG_INSTALLTIME, &install_time, 1);
+  headerPutUint32 (hdr, RPMTAG_INSTALLTID, &install_time, 1);
+  headerPutUint32 (hdr, RPMTAG_INSTALLCOLOR, &color, 1);
 
-    set_rpm_macro_define ("_dbpath", rpmdb_abspath);
-  }
+  struct rpmtd_s td;
+  if (headerGet (hdr, RPMTAG_BASENAMES, &td, HEADERGET_MINMEM))
+    {
+      const guint n_files = rpmtdCount (&td);
+      rpmtdFreeData (&td);
+      g_autofree char *states = g_new0 (char, n_files); /* All RPMFILE_STATE_NORMAL */
+      headerPutChar (hdr, RPMTAG_FILESTATES, states, n_files);
+    }
+  if (!headerIsEntry (hdr, RPMTAG_INSTPREFIXES)
+      && headerGet (hdr, RPMTAG_PREFIXES, &td, HEADERGET_MINMEM))
+    {
+      td.tag = RPMTAG_INSTPREFIXES;
+      headerPut (hdr, &td, HEADERPUT_DEFAULT);
+      rpmtdFreeData (&td);
+    }
 
-  g_auto (rpmts) rpmdb_ts = rpmtsCreate ();
-  /* Always call rpmtsSetRootDir() here so rpmtsRootDir() isn't NULL -- see rhbz#1613517 */
-  rpmtsSetRootDir (rpmdb_ts, "/");
-  rpmtsSetVSFlags (rpmdb_ts, _RPMVSF_NOSIGNATURES | _RPMVSF_NODIGESTS);
-  /* https://bugzilla.redhat.com/show_bug.cgi?id=1607223
-   * Newer librpm defaults to doing a full payload checksum, which we can't
-   * do at this point because we imported the RPMs into ostree commits, saving
-   * just the header in metadata - we don't have the exact original content to
-   * provide again.
-   */
-  rpmtsSetVfyLevel (rpmdb_ts, 0);
-  /* We're just writing the rpmdb, hence _JUSTDB. Also disable the librpm
-   * SELinux plugin since rpm-ostree (and ostree) have fundamentally better
-   * code.
-   */
-  rpmtsSetFlags (rpmdb_ts, RPMTRANS_FLAG_JUSTDB | RPMTRANS_FLAG_NOCONTEXTS);
+  if (rpmtsImportHeader (txn, hdr, 0) != RPMRC_OK)
+    return glnx_throw (error, "Failed to add %s to rpmdb", dnf_package_get_nevra (pkg));
+  return TRUE;
+}
+
+/* Write the headers of @overlays straight into the (empty) rpmdb, in a single
+ * database transaction; this fills in the same tags a JUSTDB transaction
+ * would, without librpm having to build and check a transaction which won't
+ * touch any files. File conflicts were already checked when we checked out
+ * the packages. */
+static gboolean
+import_rpmdb_headers (RpmOstreeContext *self, rpmts rpmdb_ts, GPtrArray *overlays,
+                      GError **error)
+{
+  if (rpmtsOpenDB (rpmdb_ts, O_RDWR | O_CREAT) != 0)
+    return glnx_throw (error, "Failed to open rpmdb");
+  rpmtxn txn = rpmtxnBegin (rpmdb_ts, RPMTXN_WRITE);
+  if (!txn)
+    return glnx_throw (error, "Failed to lock rpmdb");
+  rpmdb db = rpmtsGetRdb (rpmdb_ts);
+  /* Hold the write lock across all the headers, so it's all one database
+   * transaction rather than one for each */
+  rpmdbCtrl (db, RPMDB_CTRL_LOCK_RW);
+
+  const guint32 install_time = (guint32)time (NULL);
+  const guint32 color = rpmtsColor (rpmdb_ts);
+  gboolean ret = TRUE;
+  for (guint i = 0; i < overlays->len && ret; i++)
+    {
+      auto pkg = static_cast<DnfPackage *> (overlays->pdata[i]);
+      ret = import_rpmdb_header (self, txn, pkg, install_time, color, error);
+    }
+
+  rpmdbCtrl (db, RPMDB_CTRL_UNLOCK_RW);
+  rpmtxnEnd (txn);
+  if (rpmtsCloseDB (rpmdb_ts) != 0 && ret)
+    return glnx_throw (error, "Failed to close rpmdb");
+  return ret;
+}
 
+/* Write the rpmdb with a JUSTDB transaction; this is what we need when
+ * there's an existing rpmdb to update. */
+static gboolean
+run_rpmdb_ts (RpmOstreeContext *self, rpmts rpmdb_ts, GPtrArray *overlays,
+              GPtrArray *overrides_replace, GPtrArray *overrides_remove,
+              gboolean have_fileoverride, GCancellable *cancellable, GError **error)
+{
   TransactionData tdata = { 0, NULL };
   tdata.ctx = self;
   rpmtsSetNotifyCallback (rpmdb_ts, ts_callback, &tdata);
@@ -3992,6 +6483,71 @@ write_rpmdb (RpmOstreeContext *self, int tmprootfs_dfd, GPtrArray *overlays,
         return FALSE;
     }
 
+  return TRUE;
+}
+
+static gboolean
+write_rpmdb (RpmOstreeContext *self, int tmprootfs_dfd, GPtrArray *overlays,
+             GPtrArray *overrides_replace, GPtrArray *overrides_remove, gboolean have_fileoverride,
+             GCancellable *cancellable, GError **error)
+{
+  rpmostreecxx::TraceSpan span ("write-rpmdb");
+  auto task = rpmostreecxx::progress_begin_task ("Writing rpmdb");
+
+  if (!glnx_shutil_mkdir_p_at (tmprootfs_dfd, RPMOSTREE_RPMDB_LOCATION, 0755, cancellable, error))
+    return FALSE;
+
+  /* For a new rpmdb, we can skip the transaction and just add the headers */
+  gboolean can_import = FALSE;
+  if (!can_import_rpmdb_headers (tmprootfs_dfd, overrides_replace, overrides_remove, &can_import,
+                                 error))
+    return FALSE;
+
+  /* Now, we use the separate rpmdb ts which *doesn't* have a rootdir set,
+   * because if it did rpmtsRun() would try to chroot which it won't be able to
+   * if we're unprivileged, even though we're not trying to run %post scripts
+   * now.
+   *
+   * Instead, this rpmts has the dbpath as absolute.
+   */
+  {
+    g_autofree char *rpmdb_abspath = glnx_fdrel_abspath (tmprootfs_dfd, RPMOSTREE_RPMDB_LOCATION);
+
+    /* if we were passed an existing tmprootfs, and that tmprootfs already has
+     * an rpmdb, we have to make sure to break its hardlinks as librpm mutates
+     * the db in place */
+    if (!can_import && !break_rpmdb_hardlinks (tmprootfs_dfd, cancellable, error))
+      return FALSE;
+
+    set_rpm_macro_define ("_dbpath", rpmdb_abspath);
+  }
+
+  g_auto (rpmts) rpmdb_ts = rpmtsCreate ();
+  /* Always call rpmtsSetRootDir() here so rpmtsRootDir() isn't NULL -- see rhbz#1613517 */
+  rpmtsSetRootDir (rpmdb_ts, "/");
+  rpmtsSetVSFlags (rpmdb_ts, _RPMVSF_NOSIGNATURES | _RPMVSF_NODIGESTS);
+  /* https://bugzilla.redhat.com/show_bug.cgi?id=1607223
+   * Newer librpm defaults to doing a full payload checksum, which we can't
+   * do at this point because we imported the RPMs into ostree commits, saving
+   * just the header in metadata - we don't have the exact original content to
+   * provide again.
+   */
+  rpmtsSetVfyLevel (rpmdb_ts, 0);
+  /* We're just writing the rpmdb, hence _JUSTDB. Also disable the librpm
+   * SELinux plugin since rpm-ostree (and ostree) have fundamentally better
+   * code.
+   */
+  rpmtsSetFlags (rpmdb_ts, RPMTRANS_FLAG_JUSTDB | RPMTRANS_FLAG_NOCONTEXTS);
+
+  if (can_import)
+    {
+      if (!import_rpmdb_headers (self, rpmdb_ts, overlays, error))
+        return FALSE;
+    }
+  else if (!run_rpmdb_ts (self, rpmdb_ts, overlays, overrides_replace, overrides_remove,
+                          have_fileoverride, cancellable, error))
+    return FALSE;
+
   task->end ("");
 
   /* And finally revert the _dbpath setting because libsolv relies on it as well
@@ -4030,9 +6586,268 @@ ensure_tmprootfs_dfd (RpmOstreeContext *self, GError **error)
   return TRUE;
 }
 
+/* A package to check out as part of checkout_packages_parallel() */
+typedef struct
+{
+  DnfPackage *pkg;
+  const char *commit;
+  GHashTable *files_skip; /* Borrowed */
+  const RpmOstreeFilesRemoveMatcher *files_remove; /* Owned by the context */
+  OstreeRepoCheckoutOverwriteMode ovwmode;
+  OstreeRepoDevInoCache *devino_cache; /* Ours; merged into the context's when done */
+  guint n_files;
+  guint n_deps;          /* Number of packages we're still waiting for */
+  GPtrArray *dependents; /* Packages waiting for us */
+} CheckoutNode;
+
+static void
+checkout_node_free (CheckoutNode *node)
+{
+  g_clear_pointer (&node->devino_cache, ostree_repo_devino_cache_unref);
+  g_clear_pointer (&node->dependents, g_ptr_array_unref);
+  g_free (node);
+}
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (CheckoutNode, checkout_node_free);
+
+/* Who last touched a path, in transaction order */
+typedef struct
+{
+  CheckoutNode *writer; /* Last package with a non-directory here */
+  GPtrArray *dir_owners; /* Packages with a directory here since the writer */
+} CheckoutPathState;
+
+static void
+checkout_path_state_free (CheckoutPathState *state)
+{
+  g_clear_pointer (&state->dir_owners, g_ptr_array_unref);
+  g_free (state);
+}
+
+static void
+checkout_node_add_dep (CheckoutNode *node, CheckoutNode *dep, GHashTable *seen)
+{
+  if (!dep || dep == node || !g_hash_table_add (seen, dep))
+    return;
+  node->n_deps++;
+  g_ptr_array_add (dep->dependents, node);
+}
+
+/* Record that @node wants @path; as a directory, this only conflicts with non-directories,
+ * which is how most packages can share e.g. /usr/bin without being ordered. Otherwise it
+ * must come after everything before it which has this path, in either form. */
+static void
+checkout_node_add_path (CheckoutNode *node, GHashTable *paths, char *path, gboolean is_dir,
+                        GHashTable *seen)
+{
+  auto state = static_cast<CheckoutPathState *> (g_hash_table_lookup (paths, path));
+  if (!state)
+    {
+      state = g_new0 (CheckoutPathState, 1);
+      g_hash_table_insert (paths, path, state);
+    }
+  else
+    g_free (path);
+
+  checkout_node_add_dep (node, state->writer, seen);
+  if (is_dir)
+    {
+      if (!state->dir_owners)
+        state->dir_owners = g_ptr_array_new ();
+      g_ptr_array_add (state->dir_owners, node);
+    }
+  else
+    {
+      for (guint i = 0; state->dir_owners && i < state->dir_owners->len; i++)
+        checkout_node_add_dep (node, static_cast<CheckoutNode *> (state->dir_owners->pdata[i]),
+                               seen);
+      g_clear_pointer (&state->dir_owners, g_ptr_array_unref);
+      state->writer = node;
+    }
+}
+
+/* Build the graph of which packages must be checked out before which, based on the
+ * paths they contain. Packages which don't share any file (or where one has a
+ * directory and the other something else) are independent. The parent directory of
+ * each file is also considered a directory of that package, to catch e.g. one package
+ * making a symlink where another one puts files. */
+static void
+build_checkout_graph (rpmts ts, GHashTable *pkg_to_node)
+{
+  g_autoptr (GHashTable) paths = g_hash_table_new_full (
+      g_str_hash, g_str_equal, g_free, (GDestroyNotify)checkout_path_state_free);
+  const guint n_rpmts_elements = (guint)rpmtsNElements (ts);
+  for (guint i = 0; i < n_rpmts_elements; i++)
+    {
+      rpmte te = rpmtsElement (ts, i);
+      if (rpmteType (te) != TR_ADDED)
+        continue;
+      auto node = static_cast<CheckoutNode *> (g_hash_table_lookup (pkg_to_node, rpmteKey (te)));
+      if (!node)
+        continue;
+
+      g_autoptr (GHashTable) seen = g_hash_table_new (NULL, NULL);
+      g_auto (rpmfiles) files = rpmteFiles (te);
+      g_auto (rpmfi) fi = rpmfilesIter (files, RPMFI_ITER_FWD);
+      while (rpmfiNext (fi) >= 0)
+        {
+          char *path = canonicalize_rpmfi_path (rpmfiFN (fi));
+          const gboolean is_dir = S_ISDIR (rpmfiFMode (fi));
+          if (!is_dir)
+            {
+              node->n_files++;
+              checkout_node_add_path (node, paths, g_path_get_dirname (path), TRUE, seen);
+            }
+          checkout_node_add_path (node, paths, path, is_dir, seen);
+        }
+    }
+}
+
+typedef struct
+{
+  RpmOstreeContext *self;
+  rpmostreecxx::Progress *progress;
+  guint *n_done;
+} CheckoutParallelData;
+
+static void
+checkout_node_in_thread (GTask *task, gpointer source, gpointer task_data,
+                         GCancellable *cancellable)
+{
+  auto self = static_cast<RpmOstreeContext *> (source);
+  auto node = static_cast<CheckoutNode *> (task_data);
+  g_autoptr (GError) local_error = NULL;
+  if (!checkout_package (get_pkgcache_repo (self), self->tmprootfs_dfd, ".", node->devino_cache,
+                         node->commit, node->files_skip, node->files_remove, node->ovwmode,
+                         !self->enable_rofiles, cancellable, &local_error))
+    {
+      g_prefix_error (&local_error, "Checkout %s: ", dnf_package_get_nevra (node->pkg));
+      g_task_return_error (task, util::move_nullify (local_error));
+    }
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+/* OstreeRepoDevInoCache is a hash set of dev/ino/checksum entries owned by the
+ * table; there's no API to combine two, so move them over by hand. Workers each
+ * get their own, since ostree adds to it during checkout without locking. */
+static void
+merge_devino_cache (OstreeRepoDevInoCache *dest, OstreeRepoDevInoCache *src)
+{
+  GHashTableIter iter;
+  gpointer key;
+  g_hash_table_iter_init (&iter, (GHashTable *)src);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+      g_hash_table_iter_steal (&iter);
+      g_hash_table_add ((GHashTable *)dest, key);
+    }
+}
+
+static void
+on_checkout_node_done (GObject *obj, GAsyncResult *res, gpointer user_data)
+{
+  auto job = static_cast<RpmOstreeWorkQueueJob *> (user_data);
+  auto data = static_cast<CheckoutParallelData *> (rpmostree_work_queue_job_get_user_data (job));
+  RpmOstreeContext *self = data->self;
+  auto node = static_cast<CheckoutNode *> (g_task_get_task_data (G_TASK (res)));
+  rpmostree_work_queue_job_done (job);
+
+  if (!g_task_propagate_boolean (G_TASK (res), self->async_error ? NULL : &self->async_error))
+    {
+      if (self->async_cancellable)
+        g_cancellable_cancel (self->async_cancellable);
+    }
+  else
+    {
+      if (node->devino_cache)
+        merge_devino_cache (self->devino_cache, node->devino_cache);
+      (*data->n_done)++;
+      data->progress->nitems_update (*data->n_done);
+      for (guint i = 0; i < node->dependents->len; i++)
+        {
+          auto dependent = static_cast<CheckoutNode *> (node->dependents->pdata[i]);
+          g_assert_cmpuint (dependent->n_deps, >, 0);
+          if (--dependent->n_deps == 0)
+            rpmostree_work_queue_push (self->async_work_queue, dependent, dependent->n_files);
+        }
+    }
+
+  if (self->async_error == NULL
+      && !rpmostree_work_queue_dispatch (self->async_work_queue, &self->async_error))
+    g_cancellable_cancel (self->async_cancellable);
+  if (rpmostree_work_queue_get_n_running (self->async_work_queue) == 0)
+    self->async_running = FALSE;
+}
+
+/* Work queue callback to start checking out a package */
+static gboolean
+start_checkout_node (RpmOstreeWorkQueueJob *job, gpointer item, gpointer user_data,
+                     GError **error)
+{
+  auto data = static_cast<CheckoutParallelData *> (user_data);
+  RpmOstreeContext *self = data->self;
+  auto node = static_cast<CheckoutNode *> (item);
+  data->progress->set_sub_message (dnf_package_get_name (node->pkg));
+  g_autoptr (GTask) task = g_task_new (self, self->async_cancellable, on_checkout_node_done, job);
+  g_task_set_task_data (task, node, NULL);
+  g_task_run_in_thread (task, checkout_node_in_thread);
+  return TRUE;
+}
+
+/* Check out the packages in @nodes (a map from package to CheckoutNode) into the
+ * root, in parallel where their contents don't overlap. Packages which share paths
+ * are still checked out in transaction order, so the result is the same as doing
+ * them one at a time. */
+static gboolean
+checkout_packages_parallel (RpmOstreeContext *self, rpmts ts, GHashTable *nodes,
+                            rpmostreecxx::Progress &progress, guint *n_done,
+                            GCancellable *cancellable, GError **error)
+{
+  if (g_hash_table_size (nodes) == 0)
+    return TRUE;
+
+  build_checkout_graph (ts, nodes);
+
+  CheckoutParallelData data = { self, &progress, n_done };
+  /* Checkouts are mostly syscall latency rather than CPU, but it's still
+   * reasonable to scale with the machine. */
+  g_autoptr (RpmOstreeWorkQueue) queue = rpmostree_work_queue_new (
+      "checkout", g_get_num_processors (), start_checkout_node, &data, NULL);
+  GLNX_HASH_TABLE_FOREACH_V (nodes, CheckoutNode *, node)
+    {
+      if (node->n_deps == 0)
+        rpmostree_work_queue_push (queue, node, node->n_files);
+    }
+
+  self->async_work_queue = queue;
+  self->async_cancellable = cancellable;
+  self->async_running = TRUE;
+  self->async_error = NULL;
+  if (!rpmostree_work_queue_dispatch (queue, &self->async_error))
+    g_cancellable_cancel (cancellable);
+  if (rpmostree_work_queue_get_n_running (queue) == 0)
+    self->async_running = FALSE;
+  GMainContext *mainctx = g_main_context_get_thread_default ();
+  while (self->async_running)
+    g_main_context_iteration (mainctx, TRUE);
+  rpmostree_work_queue_log_stats (queue);
+  self->async_work_queue = NULL;
+  if (self->async_error)
+    {
+      g_propagate_error (error, util::move_nullify (self->async_error));
+      return FALSE;
+    }
+
+  /* The graph is acyclic since dependencies always come earlier in the
+   * transaction, so everything must have run. */
+  g_assert_cmpuint (rpmostree_work_queue_get_n_pending (queue), ==, 0);
+  return TRUE;
+}
+
 gboolean
 rpmostree_context_assemble (RpmOstreeContext *self, GCancellable *cancellable, GError **error)
 {
+  rpmostreecxx::TraceSpan span ("assemble");
   if (!ensure_tmprootfs_dfd (self, error))
     return FALSE;
   int tmprootfs_dfd = self->tmprootfs_dfd; /* Alias to avoid bigger diff */
@@ -4083,6 +6898,18 @@ rpmostree_context_assemble (RpmOstreeContext *self, GCancellable *cancellable, G
 
   g_autoptr (GPtrArray) overlays
       = dnf_goal_get_packages (dnf_context_get_goal (dnfctx), DNF_PACKAGE_INFO_INSTALL, -1);
+  if (self->layered_nevras)
+    {
+      g_autoptr (GPtrArray) new_overlays = g_ptr_array_new_with_free_func (g_object_unref);
+      for (guint i = 0; i < overlays->len; i++)
+        {
+          auto pkg = static_cast<DnfPackage *> (overlays->pdata[i]);
+          if (!g_hash_table_contains (self->layered_nevras, dnf_package_get_nevra (pkg)))
+            g_ptr_array_add (new_overlays, g_object_ref (pkg));
+        }
+      g_ptr_array_unref (overlays);
+      overlays = util::move_nullify (new_overlays);
+    }
 
   g_autoptr (GPtrArray) overrides_replace = dnf_goal_get_packages (
       dnf_context_get_goal (dnfctx), DNF_PACKAGE_INFO_UPDATE, DNF_PACKAGE_INFO_DOWNGRADE, -1);
@@ -4151,6 +6978,22 @@ rpmostree_context_assemble (RpmOstreeContext *self, GCancellable *cancellable, G
   g_assert (n_rpmts_elements > 0);
   guint n_rpmts_done = 0;
 
+  /* The below is currently TRUE only in the --unified-core path. We probably want to
+   * migrate that over to always use a separate cache repo eventually, which would allow us
+   * to completely drop the pkgcache_repo/ostreerepo dichotomy in the core. See:
+   * https://github.com/projectatomic/rpm-ostree/pull/1055 */
+  OstreeRepo *pkgcache_repo = get_pkgcache_repo (self);
+  if (pkgcache_repo != self->ostreerepo)
+    {
+      g_autoptr (GPtrArray) pkg_commits = g_ptr_array_new ();
+      GLNX_HASH_TABLE_FOREACH_V (pkg_to_ostree_commit, const char *, pkg_commit)
+        g_ptr_array_add (pkg_commits, (char *)pkg_commit);
+      if (!rpmostree_pull_content_only (self->ostreerepo, pkgcache_repo, pkg_commits, cancellable,
+                                        error))
+        return glnx_prefix_error (error, "Linking cached content");
+    }
+
+  const gint64 checkout_start_time = g_get_monotonic_time ();
   auto progress = rpmostreecxx::progress_nitems_begin (n_rpmts_elements, progress_msg);
 
   /* Okay so what's going on in Fedora with incestuous relationship
@@ -4183,6 +7026,8 @@ rpmostree_context_assemble (RpmOstreeContext *self, GCancellable *cancellable, G
     return FALSE;
 
   g_autoptr (GSequence) dirs_to_remove = g_sequence_new (g_free);
+  g_autoptr (GHashTable) deletions /* map{parent dir -> array{basenames}} */
+      = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_ptr_array_unref);
   for (guint i = 0; i < n_rpmts_elements; i++)
     {
       rpmte te = rpmtsElement (ordering_ts, i);
@@ -4204,18 +7049,25 @@ rpmostree_context_assemble (RpmOstreeContext *self, GCancellable *cancellable, G
             return FALSE;
         }
 
-      if (!delete_package_from_root (self, te, tmprootfs_dfd, files_skip_delete, dirs_to_remove,
-                                     cancellable, error))
+      if (!queue_package_deletion (self, te, tmprootfs_dfd, files_skip_delete, deletions,
+                                   cancellable, error))
         return FALSE;
       n_rpmts_done++;
       progress->nitems_update (n_rpmts_done);
     }
   g_clear_pointer (&files_skip_delete, g_hash_table_unref);
 
+  if (!delete_queued_paths (tmprootfs_dfd, deletions, dirs_to_remove, error))
+    return FALSE;
+  g_clear_pointer (&deletions, g_hash_table_unref);
+
   if (!handle_package_deletion_directories (tmprootfs_dfd, dirs_to_remove, cancellable, error))
     return FALSE;
   g_clear_pointer (&dirs_to_remove, g_sequence_free);
 
+  /* Check out the regular packages; independent ones in parallel */
+  g_autoptr (GHashTable) checkout_nodes
+      = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify)checkout_node_free);
   for (guint i = 0; i < n_rpmts_elements; i++)
     {
       rpmte te = rpmtsElement (ordering_ts, i);
@@ -4235,23 +7087,29 @@ rpmostree_context_assemble (RpmOstreeContext *self, GCancellable *cancellable, G
         /* we checkout those last */
         continue;
 
+      g_autoptr (CheckoutNode) node = g_new0 (CheckoutNode, 1);
+      node->pkg = pkg;
+      node->commit = static_cast<const char *> (g_hash_table_lookup (pkg_to_ostree_commit, pkg));
+      if (!prepare_package_checkout (self, pkg, &node->files_remove, error))
+        return FALSE;
+      if (files_skip_add)
+        node->files_skip = static_cast<GHashTable *> (
+            g_hash_table_lookup (files_skip_add, dnf_package_get_nevra (pkg)));
       /* The "setup" package currently contains /etc/passwd; in the treecompose
        * case we need to inject that beforehand, so use "add files" just for
        * that.
        */
-      OstreeRepoCheckoutOverwriteMode ovwmode
-          = (pkg == setup_package) ? OSTREE_REPO_CHECKOUT_OVERWRITE_ADD_FILES
-                                   : OSTREE_REPO_CHECKOUT_OVERWRITE_UNION_IDENTICAL;
-
-      progress->set_sub_message (dnf_package_get_name (pkg));
-      if (!checkout_package_into_root (
-              self, pkg, tmprootfs_dfd, ".", self->devino_cache,
-              static_cast<const char *> (g_hash_table_lookup (pkg_to_ostree_commit, pkg)),
-              files_skip_add, ovwmode, cancellable, error))
-        return FALSE;
-      n_rpmts_done++;
-      progress->nitems_update (n_rpmts_done);
+      node->ovwmode = (pkg == setup_package) ? OSTREE_REPO_CHECKOUT_OVERWRITE_ADD_FILES
+                                             : OSTREE_REPO_CHECKOUT_OVERWRITE_UNION_IDENTICAL;
+      if (self->devino_cache)
+        node->devino_cache = ostree_repo_devino_cache_new ();
+      node->dependents = g_ptr_array_new ();
+      g_hash_table_insert (checkout_nodes, pkg, util::move_nullify (node));
     }
+  if (!checkout_packages_parallel (self, ordering_ts, checkout_nodes, *progress, &n_rpmts_done,
+                                   cancellable, error))
+    return FALSE;
+  g_clear_pointer (&checkout_nodes, g_hash_table_unref);
   g_clear_pointer (&files_skip_add, g_hash_table_unref);
 
   /* And last, any fileoverride RPMs. These *must* be done last. */
@@ -4282,6 +7140,17 @@ rpmostree_context_assemble (RpmOstreeContext *self, GCancellable *cancellable, G
 
   progress->end ("");
 
+  {
+    guint64 checkout_bytes = 0;
+    GLNX_HASH_TABLE_FOREACH (pkg_to_ostree_commit, DnfPackage *, pkg)
+      checkout_bytes += dnf_package_get_installsize (pkg);
+    rpmostree_context_add_phase_timing (self, "checkout", checkout_start_time, checkout_bytes,
+                                        n_rpmts_done);
+  }
+
+  if (self->devino_cache && !rpmostree_ctime_stamp_at (tmprootfs_dfd, &self->devino_stamp, error))
+    return FALSE;
+
   /* Some packages expect to be able to make temporary files here
    * for obvious reasons, but we otherwise make `/var` read-only.
    */
@@ -4340,6 +7209,14 @@ rpmostree_context_assemble (RpmOstreeContext *self, GCancellable *cancellable, G
             }
         }
 
+      /* All the scripts share one set of rofiles-fuse mounts, rather than
+       * each setting up and tearing down its own. */
+      std::optional<rust::Box<rpmostreecxx::BubblewrapSession> > bwrap_session;
+      {
+        CXX_TRY_VAR (session, rpmostreecxx::bubblewrap_session_new (tmprootfs_dfd), error);
+        bwrap_session.emplace (std::move (session));
+      }
+
       /* We're technically deviating from RPM here by running all the %pre's
        * beforehand, rather than each package's %pre & %post in order. Though I
        * highly doubt this should cause any issues. The advantage of doing it
@@ -4347,6 +7224,7 @@ rpmostree_context_assemble (RpmOstreeContext *self, GCancellable *cancellable, G
        * before applying the overrides, rather than after each %pre.
        */
       {
+        const gint64 start_time = g_get_monotonic_time ();
         auto task = rpmostreecxx::progress_begin_task ("Running pre scripts");
         guint n_pre_scripts_run = 0;
         for (guint i = 0; i < n_rpmts_elements; i++)
@@ -4359,12 +7237,14 @@ rpmostree_context_assemble (RpmOstreeContext *self, GCancellable *cancellable, G
             g_assert (pkg);
 
             task->set_sub_message (dnf_package_get_name (pkg));
-            if (!run_script_sync (self, tmprootfs_dfd, &var_lib_rpm_statedir, pkg,
-                                  RPMOSTREE_SCRIPT_PREIN, &n_pre_scripts_run, cancellable, error))
+            if (!run_script_sync (self, tmprootfs_dfd, &var_lib_rpm_statedir, **bwrap_session, pkg,
+                                  RPMOSTREE_SCRIPT_PREIN, NULL, &n_pre_scripts_run, cancellable,
+                                  error))
               return FALSE;
           }
         auto msg = g_strdup_printf ("%u done", n_pre_scripts_run);
         task->end (msg);
+        rpmostree_context_add_phase_timing (self, "scripts", start_time, 0, n_pre_scripts_run);
       }
 
       /* Now undo our hack above */
@@ -4385,9 +7265,24 @@ rpmostree_context_assemble (RpmOstreeContext *self, GCancellable *cancellable, G
         }
 
       {
+        const gint64 start_time = g_get_monotonic_time ();
         auto task = rpmostreecxx::progress_begin_task ("Running post scripts");
         guint n_post_scripts_run = 0;
 
+        /* Packages whose %post may run alongside others; see the
+         * `parallel-post-scripts` treefile option. */
+        g_autoptr (GHashTable) parallel_post
+            = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+        if (self->treefile_rs)
+          {
+            for (auto &name : self->treefile_rs->get_parallel_post_scripts ())
+              g_hash_table_add (parallel_post, g_strdup (name.c_str ()));
+          }
+        const guint max_parallel = MAX (g_get_num_processors (), 1);
+        g_autoptr (GPtrArray) parallel_batch = g_ptr_array_new ();
+        /* Scripts like ldconfig only need to run once, after all the others */
+        g_autoptr (RpmOstreeDeferredScripts) deferred = rpmostree_deferred_scripts_new ();
+
         /* %post */
         for (guint i = 0; i < n_rpmts_elements; i++)
           {
@@ -4398,19 +7293,53 @@ rpmostree_context_assemble (RpmOstreeContext *self, GCancellable *cancellable, G
             auto pkg = (DnfPackage *)(rpmteKey (te));
             g_assert (pkg);
 
+            /* Scripts in a batch can't depend on each other; everything else
+             * waits for the batch before it, which keeps the transaction order */
+            const gboolean can_parallel
+                = g_hash_table_contains (parallel_post, dnf_package_get_name (pkg));
+            if (parallel_batch->len > 0
+                && (!can_parallel || parallel_batch->len >= max_parallel
+                    || te_requires_any_of (te, parallel_batch)))
+              {
+                if (!run_post_script_batch (self, tmprootfs_dfd, &var_lib_rpm_statedir,
+                                            **bwrap_session, parallel_batch, deferred,
+                                            &n_post_scripts_run, cancellable, error))
+                  return FALSE;
+              }
+
             task->set_sub_message (dnf_package_get_name (pkg));
-            if (!apply_rpmfi_overrides (self, tmprootfs_dfd, pkg, *passwd_entries, cancellable,
-                                        error))
+            auto pkg_commit
+                = static_cast<const char *> (g_hash_table_lookup (pkg_to_ostree_commit, pkg));
+            if (!apply_rpmfi_overrides (self, tmprootfs_dfd, pkg, pkg_commit, *passwd_entries,
+                                        cancellable, error))
               return glnx_prefix_error (error, "While applying overrides for pkg %s",
                                         dnf_package_get_name (pkg));
 
-            if (!run_script_sync (self, tmprootfs_dfd, &var_lib_rpm_statedir, pkg,
-                                  RPMOSTREE_SCRIPT_POSTIN, &n_post_scripts_run, cancellable, error))
+            if (can_parallel)
+              {
+                g_ptr_array_add (parallel_batch, te);
+                continue;
+              }
+
+            if (!run_script_sync (self, tmprootfs_dfd, &var_lib_rpm_statedir, **bwrap_session, pkg,
+                                  RPMOSTREE_SCRIPT_POSTIN, deferred, &n_post_scripts_run,
+                                  cancellable, error))
               return FALSE;
           }
+        if (!run_post_script_batch (self, tmprootfs_dfd, &var_lib_rpm_statedir, **bwrap_session,
+                                    parallel_batch, deferred, &n_post_scripts_run, cancellable,
+                                    error))
+          return FALSE;
+        task->set_sub_message ("deferred");
+        if (!rpmostree_deferred_scripts_run_sync (deferred, tmprootfs_dfd, &var_lib_rpm_statedir,
+                                                  self->enable_rofiles, &**bwrap_session,
+                                                  self->script_timings, cancellable, error))
+          return FALSE;
+        rpmostree_context_add_phase_timing (self, "scripts", start_time, 0, n_post_scripts_run);
       }
 
       {
+        const gint64 start_time = g_get_monotonic_time ();
         auto task = rpmostreecxx::progress_begin_task ("Running posttrans scripts");
         guint n_posttrans_scripts_run = 0;
 
@@ -4425,19 +7354,21 @@ rpmostree_context_assemble (RpmOstreeContext *self, GCancellable *cancellable, G
             g_assert (pkg);
 
             task->set_sub_message (dnf_package_get_name (pkg));
-            if (!run_script_sync (self, tmprootfs_dfd, &var_lib_rpm_statedir, pkg,
-                                  RPMOSTREE_SCRIPT_POSTTRANS, &n_posttrans_scripts_run, cancellable,
-                                  error))
+            if (!run_script_sync (self, tmprootfs_dfd, &var_lib_rpm_statedir, **bwrap_session, pkg,
+                                  RPMOSTREE_SCRIPT_POSTTRANS, NULL, &n_posttrans_scripts_run,
+                                  cancellable, error))
               return FALSE;
           }
 
         /* file triggers */
-        if (!run_all_transfiletriggers (self, ordering_ts, tmprootfs_dfd, &n_posttrans_scripts_run,
-                                        cancellable, error))
+        if (!run_all_transfiletriggers (self, ordering_ts, tmprootfs_dfd, **bwrap_session,
+                                        &n_posttrans_scripts_run, cancellable, error))
           return FALSE;
 
         auto msg = g_strdup_printf ("%u done", n_posttrans_scripts_run);
         task->end (msg);
+        rpmostree_context_add_phase_timing (self, "scripts", start_time, 0,
+                                            n_posttrans_scripts_run);
       }
 
       /* We want this to be the first error message if something went wrong
@@ -4447,6 +7378,9 @@ rpmostree_context_assemble (RpmOstreeContext *self, GCancellable *cancellable, G
       if (!rpmostree_deployment_sanitycheck_true (tmprootfs_dfd, cancellable, error))
         return FALSE;
 
+      /* Unmount before we undo the script setup */
+      bwrap_session.reset ();
+
       if (have_passwd)
         {
           ROSCXX_TRY (complete_rpm_layering (tmprootfs_dfd), error);
@@ -4480,9 +7414,11 @@ rpmostree_context_assemble (RpmOstreeContext *self, GCancellable *cancellable, G
 
   g_clear_pointer (&ordering_ts, rpmtsFree);
 
+  const gint64 rpmdb_start_time = g_get_monotonic_time ();
   if (!write_rpmdb (self, tmprootfs_dfd, overlays, overrides_replace, overrides_remove,
                     have_fileoverrides, cancellable, error))
     return glnx_prefix_error (error, "Writing rpmdb");
+  rpmostree_context_add_phase_timing (self, "rpmdb", rpmdb_start_time, 0, n_rpmts_elements);
 
   return rpmostree_context_assemble_end (self, cancellable, error);
 }
@@ -4515,6 +7451,38 @@ rpmostree_context_prepare_commit (RpmOstreeContext *self)
   g_clear_object (&self->dnfctx);
 }
 
+/* The rpmdb of a layered commit is the base's one with the goal applied, so
+ * rather than reading all of it back, apply the goal to the pkglist of
+ * @base_commit. Only base commits without one need the rpmdb walked. */
+static gboolean
+get_layered_pkglist (RpmOstreeContext *self, GVariant *base_commit, GVariant **out_pkglist,
+                     GCancellable *cancellable, GError **error)
+{
+  g_autoptr (GVariant) base_metadata = g_variant_get_child_value (base_commit, 0);
+  g_autoptr (GVariant) base_pkglist = g_variant_lookup_value (
+      base_metadata, "rpmostree.rpmdb.pkglist", G_VARIANT_TYPE ("a(sssss)"));
+  HyGoal goal = dnf_context_get_goal (self->dnfctx);
+  if (!base_pkglist || !goal)
+    return rpmostree_create_rpmdb_pkglist_variant (self->tmprootfs_dfd, ".", out_pkglist,
+                                                   cancellable, error);
+
+  g_autoptr (GPtrArray) added = dnf_goal_get_packages (
+      goal, DNF_PACKAGE_INFO_INSTALL, DNF_PACKAGE_INFO_UPDATE, DNF_PACKAGE_INFO_DOWNGRADE, -1);
+  g_autoptr (GPtrArray) removed
+      = dnf_goal_get_packages (goal, DNF_PACKAGE_INFO_REMOVE, DNF_PACKAGE_INFO_OBSOLETE, -1);
+  /* ...plus the base packages that the replacements update or downgrade */
+  for (guint i = 0; i < added->len; i++)
+    {
+      auto pkg = static_cast<DnfPackage *> (added->pdata[i]);
+      g_autoptr (GPtrArray) old = hy_goal_list_obsoleted_by_package (goal, pkg);
+      for (guint j = 0; j < old->len; j++)
+        g_ptr_array_add (removed, g_object_ref (old->pdata[j]));
+    }
+
+  *out_pkglist = rpmostree_pkglist_variant_apply_delta (base_pkglist, removed, added);
+  return TRUE;
+}
+
 gboolean
 rpmostree_context_commit (RpmOstreeContext *self, const char *parent,
                           RpmOstreeAssembleType assemble_type, char **out_commit,
@@ -4636,8 +7604,7 @@ rpmostree_context_commit (RpmOstreeContext *self, const char *parent,
 
         /* this is used by the db commands, and auto updates to diff against the base */
         g_autoptr (GVariant) rpmdb = NULL;
-        if (!rpmostree_create_rpmdb_pkglist_variant (self->tmprootfs_dfd, ".", &rpmdb, cancellable,
-                                                     error))
+        if (!get_layered_pkglist (self, commit, &rpmdb, cancellable, error))
           return FALSE;
         g_variant_builder_add (&metadata_builder, "{sv}", "rpmostree.rpmdb.pkglist", rpmdb);
 
@@ -4663,6 +7630,9 @@ rpmostree_context_commit (RpmOstreeContext *self, const char *parent,
 
     g_variant_builder_add (&metadata_builder, "{sv}", "rpmostree.state-sha512",
                            g_variant_new_string (state_checksum));
+    if (self->input_digest)
+      g_variant_builder_add (&metadata_builder, "{sv}", "rpmostree.input-sha512",
+                             g_variant_new_string (self->input_digest));
 
     rpmostree_context_prepare_commit (self);
 
@@ -4696,12 +7666,45 @@ rpmostree_context_commit (RpmOstreeContext *self, const char *parent,
               static_cast<int> (modflags) | OSTREE_REPO_COMMIT_MODIFIER_FLAGS_DEVINO_CANONICAL);
       }
 
-    commit_modifier = ostree_repo_commit_modifier_new (modflags, NULL, NULL, NULL);
+    /* Anything we couldn't chown during assembly. File caps aren't covered
+     * here; only unprivileged composes defer them, and those are committed by
+     * rpmostree_compose_commit(). */
+    if (self->deferred_ownership)
+      commit_modifier = ostree_repo_commit_modifier_new (
+          modflags, rpmostree_deferred_ownership_filter, self->deferred_ownership, NULL);
+    else
+      commit_modifier = ostree_repo_commit_modifier_new (modflags, NULL, NULL, NULL);
     if (final_sepolicy)
       ostree_repo_commit_modifier_set_sepolicy (commit_modifier, final_sepolicy);
 
+    /* With rofiles-fuse, scripts can't have changed any of the files in the
+     * cache. Otherwise, drop the ones they did change; the rest of the base
+     * and package content can still be committed without reading it. */
     if (self->devino_cache)
-      ostree_repo_commit_modifier_set_devino_cache (commit_modifier, self->devino_cache);
+      {
+        gboolean devino_valid = self->enable_rofiles;
+        struct timespec devino_stamp;
+        if (!devino_valid && rpmostree_context_get_devino_stamp (self, &devino_stamp))
+          {
+            if (!rpmostree_devino_cache_prune_changed_at (
+                    self->devino_cache, self->tmprootfs_dfd, ".", &devino_stamp, cancellable,
+                    error))
+              return FALSE;
+            devino_valid = TRUE;
+          }
+        /* Those are still the pkgcache objects, with their old ownership */
+        if (devino_valid && self->deferred_ownership)
+          {
+            GLNX_HASH_TABLE_FOREACH (self->deferred_ownership, const char *, relpath)
+              {
+                struct stat stbuf;
+                if (fstatat (self->tmprootfs_dfd, relpath, &stbuf, AT_SYMLINK_NOFOLLOW) == 0)
+                  rpmostree_devino_cache_remove (self->devino_cache, stbuf.st_dev, stbuf.st_ino);
+              }
+          }
+        if (devino_valid)
+          ostree_repo_commit_modifier_set_devino_cache (commit_modifier, self->devino_cache);
+      }
 
     mtree = ostree_mutable_tree_new ();
 
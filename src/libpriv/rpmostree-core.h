@@ -27,6 +27,7 @@
 
 #include "libglnx.h"
 #include "rpmostree-cxxrs.h"
+#include "rpmostree-hasher.h"
 
 // C++ APIs
 std::unique_ptr<rust::Vec<rpmostreecxx::StringMapping> >
@@ -95,6 +96,27 @@ typedef enum
 void rpmostree_context_set_dnf_caching (RpmOstreeContext *self,
                                         RpmOstreeContextDnfCachePolicy policy);
 
+void rpmostree_context_set_dnf_max_cache_age (RpmOstreeContext *self, guint seconds);
+
+void rpmostree_context_set_lazy_filelists (RpmOstreeContext *self, gboolean lazy);
+
+void rpmostree_context_set_low_memory (RpmOstreeContext *self, gboolean low_memory);
+
+void rpmostree_context_set_countme (RpmOstreeContext *self, gboolean countme);
+
+void rpmostree_context_set_download_import_budget (RpmOstreeContext *self, guint64 budget);
+
+void rpmostree_context_set_import_concurrency (RpmOstreeContext *self, guint n);
+
+void rpmostree_context_set_stream_downloads (RpmOstreeContext *self, gboolean stream);
+
+/* Default cap on the total number of connections across all repos when
+ * downloading packages from several repos at once. */
+#define RPMOSTREE_DEFAULT_MAX_DOWNLOADS 12
+
+void rpmostree_context_set_download_concurrency (RpmOstreeContext *self, guint max_downloads,
+                                                 guint max_downloads_per_repo);
+
 DnfContext *rpmostree_context_get_dnf (RpmOstreeContext *self);
 
 GVariant *rpmostree_context_get_rpmmd_repo_commit_metadata (RpmOstreeContext *self);
@@ -114,17 +136,32 @@ const char *rpmostree_context_get_ref (RpmOstreeContext *self);
 
 void rpmostree_context_set_repos (RpmOstreeContext *self, OstreeRepo *base_repo,
                                   OstreeRepo *pkgcache_repo);
+void rpmostree_context_set_shared_noarch_repo (RpmOstreeContext *self, OstreeRepo *repo);
+void rpmostree_context_set_pkgcache_remote (RpmOstreeContext *self, const char *remote);
 void rpmostree_context_set_devino_cache (RpmOstreeContext *self,
                                          OstreeRepoDevInoCache *devino_cache);
 void rpmostree_context_disable_rofiles (RpmOstreeContext *self);
+gboolean rpmostree_context_get_devino_stamp (RpmOstreeContext *self, struct timespec *out_stamp);
+GHashTable *rpmostree_context_get_deferred_ownership (RpmOstreeContext *self);
+gboolean rpmostree_deferred_ownership_apply (GHashTable *ownership, const char *relpath,
+                                             GFileInfo *file_info, const char **out_fcaps);
+OstreeRepoCommitFilterResult rpmostree_deferred_ownership_filter (OstreeRepo *repo,
+                                                                  const char *path,
+                                                                  GFileInfo *file_info,
+                                                                  gpointer user_data);
 void rpmostree_context_set_sepolicy (RpmOstreeContext *self, OstreeSePolicy *sepolicy);
 
-gboolean rpmostree_dnf_add_checksum_goal (GChecksum *checksum, HyGoal goal,
+gboolean rpmostree_dnf_add_checksum_goal (RpmOstreeHasher *checksum, HyGoal goal,
                                           OstreeRepo *pkgcache_repo, GError **error);
 
 char *rpmostree_context_get_state_digest (RpmOstreeContext *self, GChecksumType algo,
                                           GError **error);
 
+void rpmostree_dnf_add_checksum_repos (RpmOstreeHasher *checksum, DnfContext *dnfctx);
+
+char *rpmostree_context_get_presolve_digest (RpmOstreeContext *self, GChecksumType algo,
+                                             GError **error);
+
 gboolean rpmostree_pkgcache_find_pkg_header (OstreeRepo *pkgcache, const char *nevra,
                                              const char *expected_sha256, GVariant **out_header,
                                              GCancellable *cancellable, GError **error);
@@ -144,6 +181,8 @@ GPtrArray *rpmostree_context_get_packages_to_import (RpmOstreeContext *self);
 gboolean rpmostree_context_set_lockfile (RpmOstreeContext *self, char **lockfiles, gboolean strict,
                                          GError **error);
 
+void rpmostree_context_set_lockfile_exact (RpmOstreeContext *self);
+
 gboolean rpmostree_find_and_download_packages (const char *const *packages, const char *source,
                                                const char *source_root, const char *repo_root,
                                                GUnixFDList **out_fd_list, GCancellable *cancellable,
@@ -152,6 +191,7 @@ gboolean rpmostree_find_and_download_packages (const char *const *packages, cons
 gboolean rpmostree_download_packages (GPtrArray *packages, GCancellable *cancellable,
                                       GError **error);
 
+void rpmostree_context_add_downloads (RpmOstreeContext *self, GPtrArray *pkgs);
 gboolean rpmostree_context_download (RpmOstreeContext *self, GCancellable *cancellable,
                                      GError **error);
 
@@ -163,9 +203,16 @@ gboolean rpmostree_context_consume_package (RpmOstreeContext *self, DnfPackage *
 gboolean rpmostree_context_import (RpmOstreeContext *self, GCancellable *cancellable,
                                    GError **error);
 
+gboolean rpmostree_context_download_and_import (RpmOstreeContext *self, GCancellable *cancellable,
+                                                GError **error);
+
 gboolean rpmostree_context_force_relabel (RpmOstreeContext *self, GCancellable *cancellable,
                                           GError **error);
 
+gboolean rpmostree_context_print_cost_estimate (RpmOstreeContext *self,
+                                                gboolean *out_kernel_changed,
+                                                GCancellable *cancellable, GError **error);
+
 typedef enum
 {
   RPMOSTREE_ASSEMBLE_TYPE_SERVER_BASE,
@@ -173,7 +220,16 @@ typedef enum
 } RpmOstreeAssembleType;
 
 void rpmostree_context_set_tmprootfs_dfd (RpmOstreeContext *self, int dfd);
+void rpmostree_context_set_base_commit (RpmOstreeContext *self, const char *base_commit);
+void rpmostree_context_set_layered_nevras (RpmOstreeContext *self, GHashTable *nevras);
+void rpmostree_context_set_input_digest (RpmOstreeContext *self, const char *digest);
 int rpmostree_context_get_tmprootfs_dfd (RpmOstreeContext *self);
+GVariant *rpmostree_context_get_script_timings (RpmOstreeContext *self);
+
+void rpmostree_context_add_phase_timing (RpmOstreeContext *self, const char *phase,
+                                         gint64 start_time, guint64 bytes, guint64 n_objects);
+
+GVariant *rpmostree_context_get_phase_timings (RpmOstreeContext *self);
 
 gboolean rpmostree_context_get_kernel_changed (RpmOstreeContext *self);
 
@@ -19,6 +19,7 @@
 
 #include "rpmostree-db.h"
 #include "rpmostree-diff.hpp"
+#include "rpmostree-package-priv.h"
 #include "rpmostree-util.h"
 
 // Only used by Rust side.
@@ -63,6 +64,66 @@ rpmdb_diff (const OstreeRepo &repo, const std::string &from, const std::string &
   return std::make_unique<RPMDiff> (removed, added, modified_old, modified_new);
 }
 
+// Like rpmdb_diff(), but for each consecutive pair of @revs; this loads each
+// package list once, rather than once for each diff it's part of.
+std::unique_ptr<RPMDiffList>
+rpmdb_diff_series (const OstreeRepo &repo, const rust::Vec<rust::String> &revs,
+                   bool allow_noent)
+{
+  auto r = &const_cast<OstreeRepo &> (repo);
+  g_autoptr (GError) local_error = NULL;
+
+  g_autoptr (GPtrArray) rev_strs = g_ptr_array_new_with_free_func (g_free);
+  for (auto &rev : revs)
+    g_ptr_array_add (rev_strs, g_strdup (rev.c_str ()));
+  g_ptr_array_add (rev_strs, NULL);
+  /* Fetch all the lists which need the rpmdb in one go */
+  if (!_rpm_ostree_package_list_prefetch (r, (const char *const *)rev_strs->pdata, NULL,
+                                          &local_error))
+    util::throw_gerror (local_error);
+
+  auto diffs = std::make_unique<RPMDiffList> ();
+  g_autoptr (RpmOstreePackageList) prev = NULL;
+  for (guint i = 0; i < revs.size (); i++)
+    {
+      const char *rev = static_cast<const char *> (rev_strs->pdata[i]);
+      g_autoptr (GVariant) pkglist_v = NULL;
+      if (!_rpm_ostree_package_variant_list_for_commit (r, rev, allow_noent, &pkglist_v, NULL,
+                                                        &local_error))
+        {
+          g_prefix_error (&local_error, "Failed to load package list: ");
+          util::throw_gerror (local_error);
+        }
+      g_autoptr (RpmOstreePackageList) cur
+          = pkglist_v ? _rpm_ostree_package_list_new (pkglist_v) : NULL;
+
+      if (i > 0)
+        {
+          g_autoptr (GPtrArray) removed = NULL;
+          g_autoptr (GPtrArray) added = NULL;
+          g_autoptr (GPtrArray) modified_old = NULL;
+          g_autoptr (GPtrArray) modified_new = NULL;
+          if (prev && cur)
+            _rpm_ostree_package_list_diff (prev, cur, &removed, &added, &modified_old,
+                                           &modified_new);
+          else
+            {
+              /* A commit without a package list; only with allow_noent */
+              removed = g_ptr_array_new ();
+              added = g_ptr_array_new ();
+              modified_old = g_ptr_array_new ();
+              modified_new = g_ptr_array_new ();
+            }
+          diffs->push (std::make_unique<RPMDiff> (removed, added, modified_old, modified_new));
+        }
+
+      g_clear_pointer (&prev, rpm_ostree_package_list_unref);
+      prev = util::move_nullify (cur);
+    }
+
+  return diffs;
+}
+
 void
 RPMDiff::print () const
 {
@@ -21,6 +21,7 @@
 #include <memory>
 #include <sstream>
 #include <string>
+#include <vector>
 
 #include <ostree.h>
 
@@ -63,4 +64,32 @@ private:
 std::unique_ptr<RPMDiff> rpmdb_diff (const OstreeRepo &repo, const std::string &src,
                                      const std::string &dest, bool allow_noent);
 
+// The diffs between each pair of consecutive revisions in a series.
+class RPMDiffList final
+{
+public:
+  size_t
+  len () const
+  {
+    return diffs_.size ();
+  }
+  const RPMDiff &
+  get (size_t i) const
+  {
+    return *diffs_.at (i);
+  }
+  void
+  push (std::unique_ptr<RPMDiff> diff)
+  {
+    diffs_.push_back (std::move (diff));
+  }
+
+private:
+  std::vector<std::unique_ptr<RPMDiff> > diffs_;
+};
+
+std::unique_ptr<RPMDiffList> rpmdb_diff_series (const OstreeRepo &repo,
+                                                const rust::Vec<rust::String> &revs,
+                                                bool allow_noent);
+
 } /* namespace */
@@ -0,0 +1,231 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Licensed under the GNU Lesser General Public License Version 2.1
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "rpmostree-digest-index.h"
+#include "rpmostree-metrics.h"
+#include "rpmostree-util.h"
+
+/* Serialized as an array of (key, content checksum), both as bytes */
+#define DIGEST_INDEX_GVARIANT_FORMAT "a(ayay)"
+
+struct _RpmOstreeDigestIndex
+{
+  gint refcount; /* atomic */
+  OstreeRepo *repo;
+
+  GMutex lock;
+  GHashTable *checksums; /* key -> content checksum */
+  gboolean dirty;
+  guint n_hits;
+  guint n_misses;
+};
+
+static gboolean
+load_index (RpmOstreeDigestIndex *index, GCancellable *cancellable, GError **error)
+{
+  glnx_autofd int fd = -1;
+  g_autoptr (GError) local_error = NULL;
+  if (!glnx_openat_rdonly (ostree_repo_get_dfd (index->repo), RPMOSTREE_DIGEST_INDEX_PATH, TRUE,
+                           &fd, &local_error))
+    {
+      if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        return TRUE;
+      g_propagate_error (error, util::move_nullify (local_error));
+      return FALSE;
+    }
+
+  g_autoptr (GBytes) data = glnx_fd_readall_bytes (fd, cancellable, error);
+  if (!data)
+    return FALSE;
+  g_autoptr (GVariant) v = g_variant_ref_sink (
+      g_variant_new_from_bytes (G_VARIANT_TYPE (DIGEST_INDEX_GVARIANT_FORMAT), data, FALSE));
+  /* It's only a cache; if it's corrupted, start over */
+  if (!g_variant_is_normal_form (v))
+    {
+      g_debug ("Ignoring corrupted digest index");
+      return TRUE;
+    }
+
+  GVariantIter iter;
+  g_variant_iter_init (&iter, v);
+  while (TRUE)
+    {
+      g_autoptr (GVariant) key_v = NULL;
+      g_autoptr (GVariant) csum_v = NULL;
+      if (!g_variant_iter_next (&iter, "(@ay@ay)", &key_v, &csum_v))
+        break;
+      if (!ostree_checksum_bytes_peek (key_v) || !ostree_checksum_bytes_peek (csum_v))
+        continue;
+      g_hash_table_insert (index->checksums, ostree_checksum_from_bytes_v (key_v),
+                           ostree_checksum_from_bytes_v (csum_v));
+    }
+  return TRUE;
+}
+
+/* Create a digest index for @repo, loading the existing one if any. */
+RpmOstreeDigestIndex *
+rpmostree_digest_index_new (OstreeRepo *repo, GCancellable *cancellable, GError **error)
+{
+  g_autoptr (RpmOstreeDigestIndex) index = g_new0 (RpmOstreeDigestIndex, 1);
+  index->refcount = 1;
+  index->repo = (OstreeRepo *)g_object_ref (repo);
+  g_mutex_init (&index->lock);
+  index->checksums = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  if (!load_index (index, cancellable, error))
+    return (RpmOstreeDigestIndex *)glnx_prefix_error_null (error, "Loading digest index");
+
+  return util::move_nullify (index);
+}
+
+RpmOstreeDigestIndex *
+rpmostree_digest_index_ref (RpmOstreeDigestIndex *index)
+{
+  g_atomic_int_inc (&index->refcount);
+  return index;
+}
+
+void
+rpmostree_digest_index_unref (RpmOstreeDigestIndex *index)
+{
+  if (!g_atomic_int_dec_and_test (&index->refcount))
+    return;
+  g_debug ("Digest index: %u hits, %u misses", index->n_hits, index->n_misses);
+  rpmostree_metrics_count_cache (RPMOSTREE_METRIC_CACHE_DIGEST_INDEX, index->n_hits,
+                                 index->n_misses);
+  g_object_unref (index->repo);
+  g_mutex_clear (&index->lock);
+  g_hash_table_unref (index->checksums);
+  g_free (index);
+}
+
+/* Reduce everything that determines the content object for a regular file to
+ * a key; @digest is the hex digest from the RPM header, made with the
+ * PGPHASHALGO @digest_algo. */
+char *
+rpmostree_digest_index_make_key (int digest_algo, const char *digest, guint64 size, guint32 mode,
+                                 guint32 uid, guint32 gid, GVariant *xattrs)
+{
+  g_autoptr (RpmOstreeHasher) checksum = rpmostree_hasher_new (G_CHECKSUM_SHA256);
+  g_autofree char *header = g_strdup_printf ("%d:%s:%" G_GUINT64_FORMAT ":%u:%u:%u:", digest_algo,
+                                             digest, size, mode, uid, gid);
+  rpmostree_hasher_update (checksum, (const guint8 *)header, strlen (header));
+  if (xattrs)
+    {
+      g_autoptr (GVariant) normal = g_variant_get_normal_form (xattrs);
+      rpmostree_hasher_update (checksum, (const guint8 *)g_variant_get_data (normal),
+                               g_variant_get_size (normal));
+    }
+  return g_strdup (rpmostree_hasher_get_string (checksum));
+}
+
+/* Look up @key; *out_checksum is set to NULL if we don't have it, or if its
+ * object is gone. */
+gboolean
+rpmostree_digest_index_lookup (RpmOstreeDigestIndex *index, const char *key, char **out_checksum,
+                               GCancellable *cancellable, GError **error)
+{
+  g_autofree char *checksum = NULL;
+  {
+    g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&index->lock);
+    checksum = g_strdup ((const char *)g_hash_table_lookup (index->checksums, key));
+  }
+
+  gboolean has_object = FALSE;
+  if (checksum
+      && !ostree_repo_has_object (index->repo, OSTREE_OBJECT_TYPE_FILE, checksum, &has_object,
+                                  cancellable, error))
+    return FALSE;
+
+  {
+    g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&index->lock);
+    if (has_object)
+      index->n_hits++;
+    else
+      index->n_misses++;
+  }
+
+  *out_checksum = has_object ? util::move_nullify (checksum) : NULL;
+  return TRUE;
+}
+
+/* Record that @key was imported as the content object @checksum. */
+void
+rpmostree_digest_index_add (RpmOstreeDigestIndex *index, const char *key, const char *checksum)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&index->lock);
+  auto prev = static_cast<const char *> (g_hash_table_lookup (index->checksums, key));
+  if (prev && g_str_equal (prev, checksum))
+    return;
+  g_hash_table_replace (index->checksums, g_strdup (key), g_strdup (checksum));
+  index->dirty = TRUE;
+}
+
+/* Write the index back to the repo if anything was added, dropping entries
+ * whose objects were pruned. */
+gboolean
+rpmostree_digest_index_flush (RpmOstreeDigestIndex *index, GCancellable *cancellable,
+                              GError **error)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&index->lock);
+  if (!index->dirty)
+    return TRUE;
+
+  GLNX_AUTO_PREFIX_ERROR ("Writing digest index", error);
+
+  g_auto (GVariantBuilder) builder;
+  g_variant_builder_init (&builder, G_VARIANT_TYPE (DIGEST_INDEX_GVARIANT_FORMAT));
+  GHashTableIter iter;
+  gpointer keyp, checksump;
+  g_hash_table_iter_init (&iter, index->checksums);
+  while (g_hash_table_iter_next (&iter, &keyp, &checksump))
+    {
+      auto key = static_cast<const char *> (keyp);
+      auto checksum = static_cast<const char *> (checksump);
+      gboolean has_object = FALSE;
+      if (!ostree_repo_has_object (index->repo, OSTREE_OBJECT_TYPE_FILE, checksum, &has_object,
+                                   cancellable, error))
+        return FALSE;
+      if (!has_object)
+        {
+          g_hash_table_iter_remove (&iter);
+          continue;
+        }
+      g_variant_builder_add (&builder, "(@ay@ay)", ostree_checksum_to_bytes_v (key),
+                             ostree_checksum_to_bytes_v (checksum));
+    }
+  g_autoptr (GVariant) v = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  const int repo_dfd = ostree_repo_get_dfd (index->repo);
+  g_autofree char *dir = g_path_get_dirname (RPMOSTREE_DIGEST_INDEX_PATH);
+  if (!glnx_shutil_mkdir_p_at (repo_dfd, dir, 0755, cancellable, error))
+    return FALSE;
+  if (!glnx_file_replace_contents_at (repo_dfd, RPMOSTREE_DIGEST_INDEX_PATH,
+                                      (const guint8 *)g_variant_get_data (v),
+                                      g_variant_get_size (v), GLNX_FILE_REPLACE_NODATASYNC,
+                                      cancellable, error))
+    return FALSE;
+
+  index->dirty = FALSE;
+  return TRUE;
+}
@@ -0,0 +1,63 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Licensed under the GNU Lesser General Public License Version 2.1
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#pragma once
+
+#include "libglnx.h"
+#include <gio/gio.h>
+#include <ostree.h>
+
+G_BEGIN_DECLS
+
+/* Where the digest index lives, relative to the repo */
+#define RPMOSTREE_DIGEST_INDEX_PATH "extensions/rpmostree/digest-index"
+
+/* Maps a file as described by an RPM header (its digest, plus everything else
+ * that goes into the ostree object: mode, ownership and xattrs) to the
+ * checksum of the content object it was imported as; this lets the importer
+ * skip checksumming and writing files it has seen before. The caller reduces
+ * the description to a key with rpmostree_digest_index_make_key(). Entries
+ * whose object has since been pruned are ignored, and dropped on flush.
+ * Lookups are thread-safe.
+ */
+typedef struct _RpmOstreeDigestIndex RpmOstreeDigestIndex;
+
+RpmOstreeDigestIndex *rpmostree_digest_index_new (OstreeRepo *repo, GCancellable *cancellable,
+                                                  GError **error);
+
+RpmOstreeDigestIndex *rpmostree_digest_index_ref (RpmOstreeDigestIndex *index);
+
+void rpmostree_digest_index_unref (RpmOstreeDigestIndex *index);
+
+char *rpmostree_digest_index_make_key (int digest_algo, const char *digest, guint64 size,
+                                       guint32 mode, guint32 uid, guint32 gid, GVariant *xattrs);
+
+gboolean rpmostree_digest_index_lookup (RpmOstreeDigestIndex *index, const char *key,
+                                        char **out_checksum, GCancellable *cancellable,
+                                        GError **error);
+
+void rpmostree_digest_index_add (RpmOstreeDigestIndex *index, const char *key,
+                                 const char *checksum);
+
+gboolean rpmostree_digest_index_flush (RpmOstreeDigestIndex *index, GCancellable *cancellable,
+                                       GError **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (RpmOstreeDigestIndex, rpmostree_digest_index_unref);
+
+G_END_DECLS
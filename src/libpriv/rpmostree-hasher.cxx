@@ -0,0 +1,118 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Licensed under the GNU Lesser General Public License Version 2.1
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "config.h"
+
+#include <openssl/evp.h>
+#include <string.h>
+
+#include "rpmostree-hasher.h"
+
+struct _RpmOstreeHasher
+{
+  EVP_MD_CTX *ctx;     /* NULL if we're using the fallback */
+  GChecksum *fallback; /* NULL if we're using OpenSSL */
+  char *hexdigest;     /* set once finished */
+};
+
+static const EVP_MD *
+evp_md_for_type (GChecksumType type)
+{
+  switch (type)
+    {
+    case G_CHECKSUM_SHA1:
+      return EVP_sha1 ();
+    case G_CHECKSUM_SHA256:
+      return EVP_sha256 ();
+    case G_CHECKSUM_SHA512:
+      return EVP_sha512 ();
+    default:
+      return NULL;
+    }
+}
+
+RpmOstreeHasher *
+rpmostree_hasher_new (GChecksumType type)
+{
+  auto hasher = g_new0 (RpmOstreeHasher, 1);
+  const EVP_MD *md = evp_md_for_type (type);
+  if (md)
+    {
+      hasher->ctx = EVP_MD_CTX_new ();
+      /* This can fail e.g. if a FIPS policy disallows the digest */
+      if (hasher->ctx && EVP_DigestInit_ex (hasher->ctx, md, NULL) != 1)
+        g_clear_pointer (&hasher->ctx, EVP_MD_CTX_free);
+    }
+  if (!hasher->ctx)
+    hasher->fallback = g_checksum_new (type);
+  return hasher;
+}
+
+void
+rpmostree_hasher_free (RpmOstreeHasher *hasher)
+{
+  g_clear_pointer (&hasher->ctx, EVP_MD_CTX_free);
+  g_clear_pointer (&hasher->fallback, g_checksum_free);
+  g_free (hasher->hexdigest);
+  g_free (hasher);
+}
+
+/* As for g_checksum_update(), a negative @length means @data is NUL-terminated */
+void
+rpmostree_hasher_update (RpmOstreeHasher *hasher, const guchar *data, gssize length)
+{
+  g_return_if_fail (hasher->hexdigest == NULL);
+  if (hasher->fallback)
+    {
+      g_checksum_update (hasher->fallback, data, length);
+      return;
+    }
+  if (length < 0)
+    length = strlen ((const char *)data);
+  /* Like GChecksum there's no way to report errors, but this can't fail once
+   * initialized anyway */
+  if (EVP_DigestUpdate (hasher->ctx, data, length) != 1)
+    g_error ("EVP_DigestUpdate failed");
+}
+
+const char *
+rpmostree_hasher_get_string (RpmOstreeHasher *hasher)
+{
+  if (hasher->hexdigest)
+    return hasher->hexdigest;
+  if (hasher->fallback)
+    {
+      hasher->hexdigest = g_strdup (g_checksum_get_string (hasher->fallback));
+      return hasher->hexdigest;
+    }
+
+  guchar digest[EVP_MAX_MD_SIZE];
+  unsigned int len = 0;
+  if (EVP_DigestFinal_ex (hasher->ctx, digest, &len) != 1)
+    g_error ("EVP_DigestFinal_ex failed");
+  static const char hex[] = "0123456789abcdef";
+  hasher->hexdigest = static_cast<char *> (g_malloc (len * 2 + 1));
+  for (unsigned int i = 0; i < len; i++)
+    {
+      hasher->hexdigest[i * 2] = hex[digest[i] >> 4];
+      hasher->hexdigest[i * 2 + 1] = hex[digest[i] & 0xf];
+    }
+  hasher->hexdigest[len * 2] = '\0';
+  return hasher->hexdigest;
+}
@@ -0,0 +1,45 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Licensed under the GNU Lesser General Public License Version 2.1
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* A drop-in for GChecksum for the digests we compute ourselves (boot
+ * checksums, the state digest and inputhash, header checksums...). It goes
+ * through OpenSSL, which picks SHA-NI or the ARMv8 crypto extensions at
+ * runtime when the CPU has them; anything OpenSSL won't do falls back to
+ * GChecksum. Like GChecksum, it can't be updated once the string has been
+ * retrieved.
+ */
+typedef struct _RpmOstreeHasher RpmOstreeHasher;
+
+RpmOstreeHasher *rpmostree_hasher_new (GChecksumType type);
+
+void rpmostree_hasher_free (RpmOstreeHasher *hasher);
+
+void rpmostree_hasher_update (RpmOstreeHasher *hasher, const guchar *data, gssize length);
+
+const char *rpmostree_hasher_get_string (RpmOstreeHasher *hasher);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (RpmOstreeHasher, rpmostree_hasher_free);
+
+G_END_DECLS
@@ -0,0 +1,400 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Licensed under the GNU Lesser General Public License Version 2.1
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <zstd.h>
+
+#include "rpmostree-history-log.h"
+#include "rpmostree-util.h"
+
+G_STATIC_ASSERT (sizeof (RpmOstreeHistoryIndexHeader) == 24);
+G_STATIC_ASSERT (sizeof (RpmOstreeHistoryIndexEntry) == 96);
+G_STATIC_ASSERT (sizeof (RpmOstreeHistoryRecordHeader) == 16);
+
+#define PKGLIST_KEY "rpmostree.rpmdb.pkglist"
+
+/* Where each pkglist slot comes from in the deployment variant; for a
+ * non-layered deployment, the base commit is the deployment's own. */
+static const struct
+{
+  const char *meta_key;
+  const char *checksum_key;
+} pkglist_sources[RPMOSTREE_HISTORY_N_PKGLISTS] = {
+  { "base-commit-meta", "base-checksum" },
+  { "layered-commit-meta", "checksum" },
+};
+
+struct _RpmOstreeHistoryLog
+{
+  GMappedFile *index;
+  const RpmOstreeHistoryIndexEntry *entries; /* Mapped from index */
+  gsize n_entries;
+  int log_fd;
+};
+
+static gboolean
+pwrite_all (int fd, const void *buf, gsize len, guint64 offset, GError **error)
+{
+  auto p = static_cast<const guint8 *> (buf);
+  while (len > 0)
+    {
+      ssize_t n = TEMP_FAILURE_RETRY (pwrite (fd, p, len, offset));
+      if (n < 0)
+        return glnx_throw_errno_prefix (error, "pwrite");
+      p += n;
+      len -= n;
+      offset += n;
+    }
+  return TRUE;
+}
+
+static gboolean
+pread_all (int fd, void *buf, gsize len, guint64 offset, GError **error)
+{
+  auto p = static_cast<guint8 *> (buf);
+  while (len > 0)
+    {
+      ssize_t n = TEMP_FAILURE_RETRY (pread (fd, p, len, offset));
+      if (n < 0)
+        return glnx_throw_errno_prefix (error, "pread");
+      if (n == 0)
+        return glnx_throw (error, "Truncated history record");
+      p += n;
+      len -= n;
+      offset += n;
+    }
+  return TRUE;
+}
+
+/* Map @fd and check its header. A trailing partial entry, from an append
+ * which didn't complete, is ignored; the next append overwrites it. */
+static gboolean
+load_index (int fd, GMappedFile **out_mfile, guint64 *out_generation,
+            const RpmOstreeHistoryIndexEntry **out_entries, gsize *out_n_entries,
+            GError **error)
+{
+  g_autoptr (GMappedFile) mfile = g_mapped_file_new_from_fd (fd, FALSE, error);
+  if (!mfile)
+    return glnx_prefix_error (error, "Mapping history index");
+  const gsize size = g_mapped_file_get_length (mfile);
+  auto buf = reinterpret_cast<const guint8 *> (g_mapped_file_get_contents (mfile));
+  if (size < sizeof (RpmOstreeHistoryIndexHeader))
+    return glnx_throw (error, "History index too short");
+  auto header = reinterpret_cast<const RpmOstreeHistoryIndexHeader *> (buf);
+  if (memcmp (header->magic, RPMOSTREE_HISTORY_INDEX_MAGIC, sizeof (header->magic)) != 0)
+    return glnx_throw (error, "Invalid history index");
+  const guint32 version = GUINT32_FROM_LE (header->version);
+  if (version != RPMOSTREE_HISTORY_INDEX_VERSION)
+    return glnx_throw (error, "Unsupported history index version %u", version);
+
+  *out_generation = GUINT64_FROM_LE (header->generation);
+  *out_entries = reinterpret_cast<const RpmOstreeHistoryIndexEntry *> (header + 1);
+  *out_n_entries = (size - sizeof (*header)) / sizeof (RpmOstreeHistoryIndexEntry);
+  *out_mfile = util::move_nullify (mfile);
+  return TRUE;
+}
+
+/* Compress @value and write it as a record at *@inout_end */
+static gboolean
+write_record (int log_fd, GVariant *value, guint64 *inout_end, guint64 *out_offset,
+              GError **error)
+{
+  const gsize size = g_variant_get_size (value);
+  if (size > G_MAXUINT32)
+    return glnx_throw (error, "History record too large");
+  const gsize bound = ZSTD_compressBound (size);
+  g_autofree guint8 *buf
+      = static_cast<guint8 *> (g_malloc (sizeof (RpmOstreeHistoryRecordHeader) + bound));
+  const size_t compressed_size
+      = ZSTD_compress (buf + sizeof (RpmOstreeHistoryRecordHeader), bound,
+                       g_variant_get_data (value), size, ZSTD_CLEVEL_DEFAULT);
+  if (ZSTD_isError (compressed_size))
+    return glnx_throw (error, "Compressing history record: %s",
+                       ZSTD_getErrorName (compressed_size));
+
+  RpmOstreeHistoryRecordHeader header = {};
+  header.magic = GUINT32_TO_LE (RPMOSTREE_HISTORY_RECORD_MAGIC);
+  header.size = GUINT32_TO_LE (size);
+  header.compressed_size = GUINT32_TO_LE (compressed_size);
+  memcpy (buf, &header, sizeof (header));
+
+  const gsize total = sizeof (header) + compressed_size;
+  if (!pwrite_all (log_fd, buf, total, *inout_end, error))
+    return FALSE;
+  *out_offset = *inout_end;
+  *inout_end += total;
+  return TRUE;
+}
+
+static gboolean
+read_record (int log_fd, guint64 offset, const GVariantType *type, GVariant **out_value,
+             GError **error)
+{
+  RpmOstreeHistoryRecordHeader header;
+  if (!pread_all (log_fd, &header, sizeof (header), offset, error))
+    return FALSE;
+  if (GUINT32_FROM_LE (header.magic) != RPMOSTREE_HISTORY_RECORD_MAGIC)
+    return glnx_throw (error, "Invalid history record at offset %" G_GUINT64_FORMAT, offset);
+  const guint32 size = GUINT32_FROM_LE (header.size);
+  const guint32 compressed_size = GUINT32_FROM_LE (header.compressed_size);
+
+  g_autofree guint8 *compressed = static_cast<guint8 *> (g_malloc (compressed_size));
+  if (!pread_all (log_fd, compressed, compressed_size, offset + sizeof (header), error))
+    return FALSE;
+  g_autofree guint8 *buf = static_cast<guint8 *> (g_malloc (size));
+  const size_t n = ZSTD_decompress (buf, size, compressed, compressed_size);
+  if (ZSTD_isError (n))
+    return glnx_throw (error, "Decompressing history record: %s", ZSTD_getErrorName (n));
+  if (n != size)
+    return glnx_throw (error, "Invalid history record at offset %" G_GUINT64_FORMAT, offset);
+
+  g_autoptr (GBytes) data = g_bytes_new_take (util::move_nullify (buf), size);
+  *out_value = g_variant_ref_sink (g_variant_new_from_bytes (type, data, FALSE));
+  return TRUE;
+}
+
+/* Looks for a record of the pkglist of commit @checksum, newest first */
+static guint64
+find_pkglist (const RpmOstreeHistoryIndexEntry *entries, gsize n_entries,
+              const guint8 *checksum)
+{
+  for (gsize i = n_entries; i > 0; i--)
+    {
+      const RpmOstreeHistoryIndexEntry *entry = &entries[i - 1];
+      for (guint j = 0; j < RPMOSTREE_HISTORY_N_PKGLISTS; j++)
+        {
+          const guint64 offset = GUINT64_FROM_LE (entry->pkglist_offsets[j]);
+          if (offset != RPMOSTREE_HISTORY_NO_RECORD
+              && memcmp (entry->pkglist_checksums[j], checksum, OSTREE_SHA256_DIGEST_LEN) == 0)
+            return offset;
+        }
+    }
+  return RPMOSTREE_HISTORY_NO_RECORD;
+}
+
+/* Removes the pkglist from the @meta_key commit metadata in @dict, and
+ * returns it, if there's one. */
+static GVariant *
+take_pkglist (GVariantDict *dict, const char *meta_key)
+{
+  g_autoptr (GVariant) meta = g_variant_dict_lookup_value (dict, meta_key, G_VARIANT_TYPE_VARDICT);
+  if (!meta)
+    return NULL;
+  g_autoptr (GVariant) pkglist = g_variant_lookup_value (meta, PKGLIST_KEY, NULL);
+  if (!pkglist)
+    return NULL;
+
+  g_auto (GVariantDict) meta_dict = G_VARIANT_DICT_INIT (meta);
+  g_variant_dict_remove (&meta_dict, PKGLIST_KEY);
+  g_variant_dict_insert_value (dict, meta_key, g_variant_dict_end (&meta_dict));
+  return util::move_nullify (pkglist);
+}
+
+/* Add @deployment, as created at @timestamp, to the history log in @path. The
+ * caller is expected to hold the sysroot lock, so there's a single writer. */
+gboolean
+rpmostree_history_log_append (const char *path, guint64 timestamp, GVariant *deployment,
+                              GCancellable *cancellable, GError **error)
+{
+  GLNX_AUTO_PREFIX_ERROR ("Appending to history log", error);
+
+  if (!glnx_shutil_mkdir_p_at (AT_FDCWD, path, 0775, cancellable, error))
+    return FALSE;
+  glnx_autofd int dfd = -1;
+  if (!glnx_opendirat (AT_FDCWD, path, TRUE, &dfd, error))
+    return FALSE;
+
+  glnx_autofd int index_fd
+      = TEMP_FAILURE_RETRY (openat (dfd, RPMOSTREE_HISTORY_INDEX_NAME, O_RDWR | O_CREAT | O_CLOEXEC,
+                                    0644));
+  if (index_fd < 0)
+    return glnx_throw_errno_prefix (error, "openat(%s)", RPMOSTREE_HISTORY_INDEX_NAME);
+  struct stat stbuf;
+  if (!glnx_fstat (index_fd, &stbuf, error))
+    return FALSE;
+  /* Also covers a header write which didn't complete */
+  if (stbuf.st_size < (off_t)sizeof (RpmOstreeHistoryIndexHeader))
+    {
+      RpmOstreeHistoryIndexHeader header = {};
+      memcpy (header.magic, RPMOSTREE_HISTORY_INDEX_MAGIC, sizeof (header.magic));
+      header.version = GUINT32_TO_LE (RPMOSTREE_HISTORY_INDEX_VERSION);
+      if (!pwrite_all (index_fd, &header, sizeof (header), 0, error))
+        return FALSE;
+    }
+
+  g_autoptr (GMappedFile) mfile = NULL;
+  guint64 generation;
+  const RpmOstreeHistoryIndexEntry *entries;
+  gsize n_entries;
+  if (!load_index (index_fd, &mfile, &generation, &entries, &n_entries, error))
+    return FALSE;
+
+  g_autofree char *log_name = g_strdup_printf ("log.%" G_GUINT64_FORMAT, generation);
+  glnx_autofd int log_fd
+      = TEMP_FAILURE_RETRY (openat (dfd, log_name, O_RDWR | O_CREAT | O_CLOEXEC, 0644));
+  if (log_fd < 0)
+    return glnx_throw_errno_prefix (error, "openat(%s)", log_name);
+  /* Anything after the last indexed record is garbage from an interrupted
+   * append, which is fine to leave in place. */
+  const off_t log_end = lseek (log_fd, 0, SEEK_END);
+  if (log_end < 0)
+    return glnx_throw_errno_prefix (error, "lseek");
+  guint64 end = log_end;
+
+  g_auto (GVariantDict) dict = G_VARIANT_DICT_INIT (deployment);
+  RpmOstreeHistoryIndexEntry entry = {};
+  entry.timestamp = GUINT64_TO_LE (timestamp);
+  for (guint i = 0; i < RPMOSTREE_HISTORY_N_PKGLISTS; i++)
+    {
+      entry.pkglist_offsets[i] = GUINT64_TO_LE (RPMOSTREE_HISTORY_NO_RECORD);
+
+      const char *checksum = NULL;
+      if (!g_variant_dict_lookup (&dict, pkglist_sources[i].checksum_key, "&s", &checksum)
+          && i == 0)
+        g_variant_dict_lookup (&dict, "checksum", "&s", &checksum);
+      if (!checksum || !ostree_validate_checksum_string (checksum, NULL))
+        continue;
+      g_autoptr (GVariant) pkglist = take_pkglist (&dict, pkglist_sources[i].meta_key);
+      if (!pkglist)
+        continue;
+
+      ostree_checksum_inplace_to_bytes (checksum, entry.pkglist_checksums[i]);
+      guint64 offset = find_pkglist (entries, n_entries, entry.pkglist_checksums[i]);
+      if (offset == RPMOSTREE_HISTORY_NO_RECORD)
+        {
+          /* Boxed, since the type isn't implied by the index */
+          g_autoptr (GVariant) boxed = g_variant_ref_sink (g_variant_new_variant (pkglist));
+          if (!write_record (log_fd, boxed, &end, &offset, error))
+            return FALSE;
+        }
+      entry.pkglist_offsets[i] = GUINT64_TO_LE (offset);
+    }
+
+  g_autoptr (GVariant) stripped = g_variant_ref_sink (g_variant_dict_end (&dict));
+  guint64 offset;
+  if (!write_record (log_fd, stripped, &end, &offset, error))
+    return FALSE;
+  entry.offset = GUINT64_TO_LE (offset);
+  if (fdatasync (log_fd) < 0)
+    return glnx_throw_errno_prefix (error, "fdatasync");
+
+  /* And only now does the entry become visible */
+  const guint64 entry_offset
+      = sizeof (RpmOstreeHistoryIndexHeader) + n_entries * sizeof (RpmOstreeHistoryIndexEntry);
+  if (!pwrite_all (index_fd, &entry, sizeof (entry), entry_offset, error))
+    return FALSE;
+  if (fdatasync (index_fd) < 0)
+    return glnx_throw_errno_prefix (error, "fdatasync");
+
+  return TRUE;
+}
+
+/* Open the history log in @path for lookups; sets @out_log to NULL if there's
+ * none yet. */
+gboolean
+rpmostree_history_log_open (const char *path, RpmOstreeHistoryLog **out_log, GError **error)
+{
+  GLNX_AUTO_PREFIX_ERROR ("Opening history log", error);
+
+  *out_log = NULL;
+
+  g_autofree char *index_path = g_build_filename (path, RPMOSTREE_HISTORY_INDEX_NAME, NULL);
+  glnx_autofd int index_fd = -1;
+  g_autoptr (GError) local_error = NULL;
+  if (!glnx_openat_rdonly (AT_FDCWD, index_path, TRUE, &index_fd, &local_error))
+    {
+      if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        return g_propagate_error (error, util::move_nullify (local_error)), FALSE;
+      return TRUE; /* Note early return */
+    }
+
+  g_autoptr (RpmOstreeHistoryLog) log = g_new0 (RpmOstreeHistoryLog, 1);
+  log->log_fd = -1;
+  guint64 generation;
+  if (!load_index (index_fd, &log->index, &generation, &log->entries, &log->n_entries, error))
+    return FALSE;
+
+  g_autofree char *log_path = g_strdup_printf ("%s/log.%" G_GUINT64_FORMAT, path, generation);
+  if (!glnx_openat_rdonly (AT_FDCWD, log_path, TRUE, &log->log_fd, error))
+    return FALSE;
+
+  *out_log = util::move_nullify (log);
+  return TRUE;
+}
+
+void
+rpmostree_history_log_free (RpmOstreeHistoryLog *log)
+{
+  glnx_close_fd (&log->log_fd);
+  g_clear_pointer (&log->index, g_mapped_file_unref);
+  g_free (log);
+}
+
+/* Look up the deployment created at @timestamp, with its pkglists put back
+ * in; sets @out_deployment to NULL if it's not in the log. */
+gboolean
+rpmostree_history_log_lookup (RpmOstreeHistoryLog *log, guint64 timestamp,
+                              GVariant **out_deployment, GError **error)
+{
+  *out_deployment = NULL;
+
+  /* History is walked from the most recent entry, so search from the end */
+  const RpmOstreeHistoryIndexEntry *entry = NULL;
+  for (gsize i = log->n_entries; i > 0 && !entry; i--)
+    {
+      if (GUINT64_FROM_LE (log->entries[i - 1].timestamp) == timestamp)
+        entry = &log->entries[i - 1];
+    }
+  if (!entry)
+    return TRUE;
+
+  g_autoptr (GVariant) stripped = NULL;
+  if (!read_record (log->log_fd, GUINT64_FROM_LE (entry->offset), G_VARIANT_TYPE_VARDICT,
+                    &stripped, error))
+    return FALSE;
+
+  g_auto (GVariantDict) dict = G_VARIANT_DICT_INIT (stripped);
+  for (guint i = 0; i < RPMOSTREE_HISTORY_N_PKGLISTS; i++)
+    {
+      const guint64 offset = GUINT64_FROM_LE (entry->pkglist_offsets[i]);
+      if (offset == RPMOSTREE_HISTORY_NO_RECORD)
+        continue;
+      const char *meta_key = pkglist_sources[i].meta_key;
+      g_autoptr (GVariant) meta
+          = g_variant_dict_lookup_value (&dict, meta_key, G_VARIANT_TYPE_VARDICT);
+      if (!meta)
+        continue;
+
+      g_autoptr (GVariant) boxed = NULL;
+      if (!read_record (log->log_fd, offset, G_VARIANT_TYPE_VARIANT, &boxed, error))
+        return FALSE;
+      g_autoptr (GVariant) pkglist = g_variant_get_variant (boxed);
+      g_auto (GVariantDict) meta_dict = G_VARIANT_DICT_INIT (meta);
+      g_variant_dict_insert_value (&meta_dict, PKGLIST_KEY, pkglist);
+      g_variant_dict_insert_value (&dict, meta_key, g_variant_dict_end (&meta_dict));
+    }
+
+  *out_deployment = g_variant_ref_sink (g_variant_dict_end (&dict));
+  return TRUE;
+}
@@ -0,0 +1,90 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Licensed under the GNU Lesser General Public License Version 2.1
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#pragma once
+
+#include "libglnx.h"
+#include <gio/gio.h>
+#include <ostree.h>
+
+G_BEGIN_DECLS
+
+/* The history of deployments, as an append-only log of zstd-compressed
+ * records plus an index of fixed-size entries, both under the history dir:
+ *
+ *   index: RpmOstreeHistoryIndexHeader, RpmOstreeHistoryIndexEntry[]
+ *   log.<generation>: { RpmOstreeHistoryRecordHeader, zstd frame }*
+ *
+ * Each entry is the deployment variant with the rpmdb pkglists taken out of
+ * its commit metadata; those are stored as records of their own, once per
+ * commit checksum, since most deployments share them. The index stays small
+ * enough to be scanned in place, and looking up a deployment only reads its
+ * own records. Entries are only ever appended; pruning rewrites the log as
+ * the next generation and then replaces the index, see history_prune().
+ * All integers are little-endian.
+ */
+#define RPMOSTREE_HISTORY_INDEX_NAME "index"
+#define RPMOSTREE_HISTORY_INDEX_MAGIC "RPMOHIX\0"
+#define RPMOSTREE_HISTORY_INDEX_VERSION 1
+#define RPMOSTREE_HISTORY_RECORD_MAGIC 0x52485231 /* "RHR1" */
+#define RPMOSTREE_HISTORY_NO_RECORD G_MAXUINT64
+
+/* Pkglists come from the base commit and, if layered, the layered commit */
+#define RPMOSTREE_HISTORY_N_PKGLISTS 2
+
+typedef struct
+{
+  char magic[8];
+  guint32 version;
+  guint32 reserved;
+  guint64 generation;
+} RpmOstreeHistoryIndexHeader;
+
+typedef struct
+{
+  guint64 timestamp; /* deployment root ctime, as in DEPLOYMENT_TIMESTAMP */
+  guint64 offset;    /* of the deployment record */
+  guint64 pkglist_offsets[RPMOSTREE_HISTORY_N_PKGLISTS];
+  guint8 pkglist_checksums[RPMOSTREE_HISTORY_N_PKGLISTS][OSTREE_SHA256_DIGEST_LEN];
+} RpmOstreeHistoryIndexEntry;
+
+typedef struct
+{
+  guint32 magic;
+  guint32 size;            /* uncompressed */
+  guint32 compressed_size; /* of the frame that follows */
+  guint32 reserved;
+} RpmOstreeHistoryRecordHeader;
+
+gboolean rpmostree_history_log_append (const char *path, guint64 timestamp, GVariant *deployment,
+                                       GCancellable *cancellable, GError **error);
+
+typedef struct _RpmOstreeHistoryLog RpmOstreeHistoryLog;
+
+gboolean rpmostree_history_log_open (const char *path, RpmOstreeHistoryLog **out_log,
+                                     GError **error);
+
+void rpmostree_history_log_free (RpmOstreeHistoryLog *log);
+
+gboolean rpmostree_history_log_lookup (RpmOstreeHistoryLog *log, guint64 timestamp,
+                                       GVariant **out_deployment, GError **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (RpmOstreeHistoryLog, rpmostree_history_log_free);
+
+G_END_DECLS
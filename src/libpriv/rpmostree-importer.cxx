@@ -32,6 +32,7 @@
 #include "rpmostree-core.h"
 #include "rpmostree-importer.h"
 #include "rpmostree-rpm-util.h"
+#include "rpmostree-trace.h"
 #include "rpmostree-unpacker-core.h"
 #include "rpmostree-util.h"
 #include <archive.h>
@@ -43,11 +44,13 @@
 #include <rpm/rpmfiles.h>
 #include <rpm/rpmlib.h>
 #include <rpm/rpmlog.h>
+#include <rpm/rpmpgp.h>
 #include <rpm/rpmts.h>
 
 #include <optional>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 typedef GObjectClass RpmOstreeImporterClass;
 
@@ -56,12 +59,33 @@ struct RpmOstreeImporter
   GObject parent_instance;
   OstreeRepo *repo;
   OstreeSePolicy *sepolicy;
+  RpmOstreeLabelCache *label_cache;
+  RpmOstreeDigestIndex *digest_index;
   struct archive *archive;
   int fd;
   Header hdr;
   rpmfi fi;
   off_t cpio_offset;
   DnfPackage *pkg;
+  RpmOstreeImporterStats stats;
+
+  /* Ownership, fcaps and IMA from the header. The archive is in rpmfi order,
+   * so we find each entry's file by just advancing a cursor, and only need
+   * hash lookups for the odd entry which isn't where we expect it. */
+  rpmfiles files;                /* Borrowed from @fi */
+  guint8 *has_override;          /* Per rpmfi index */
+  GHashTable *overrides_by_path; /* rpm path -> rpmfi index + 1, for overridden files */
+  GHashTable *fi_by_path;        /* rpm path -> rpmfi index + 1; built on first miss */
+  int next_fi_index;             /* Where we expect the next archive entry */
+  int entry_fi_index;            /* rpmfi index of the archive entry being imported, or -1 */
+
+  /* Used with a digest index while importing */
+  gboolean use_digest_index;
+  GHashTable *digest_keys; /* imported path -> index key, to record once written */
+  GHashTable *deduped;     /* imported path -> content checksum, to add to the mtree */
+  /* The cached commit for another version of the package, if any */
+  GFile *prev_root;
+  GHashTable *prev_digests; /* rpm path -> digest, for its regular files */
 
   std::optional<rust::Box<rpmostreecxx::RpmImporter> > importer_rs;
 };
@@ -81,6 +105,15 @@ rpmostree_importer_finalize (GObject *object)
   glnx_close_fd (&self->fd);
   g_clear_object (&self->repo);
   g_clear_object (&self->sepolicy);
+  g_clear_pointer (&self->label_cache, rpmostree_label_cache_unref);
+  g_clear_pointer (&self->digest_index, rpmostree_digest_index_unref);
+  g_free (self->has_override);
+  g_clear_pointer (&self->overrides_by_path, g_hash_table_unref);
+  g_clear_pointer (&self->fi_by_path, g_hash_table_unref);
+  g_clear_pointer (&self->digest_keys, g_hash_table_unref);
+  g_clear_pointer (&self->deduped, g_hash_table_unref);
+  g_clear_object (&self->prev_root);
+  g_clear_pointer (&self->prev_digests, g_hash_table_unref);
 
   self->importer_rs.~optional ();
 
@@ -99,12 +132,13 @@ static void
 rpmostree_importer_init (RpmOstreeImporter *self)
 {
   self->fd = -1;
+  self->entry_fi_index = -1;
   self->importer_rs = std::nullopt;
 }
 
-gboolean
-rpmostree_importer_read_metainfo (int fd, rpmostreecxx::RpmImporterFlags &flags, Header *out_header,
-                                  gsize *out_cpio_offset, rpmfi *out_fi, GError **error)
+static gboolean
+read_metainfo (int fd, gboolean with_filesignatures, Header *out_header, gsize *out_cpio_offset,
+               rpmfi *out_fi, GError **error)
 {
   g_auto (rpmts) ts = NULL;
   g_auto (FD_t) rpmfd = NULL;
@@ -132,7 +166,7 @@ rpmostree_importer_read_metainfo (int fd, rpmostreecxx::RpmImporterFlags &flags,
   if (out_fi)
     {
       rpmfiFlags rpmfi_flags = RPMFI_NOHEADER | RPMFI_FLAGS_QUERY;
-      if (!flags.is_ima_enabled ())
+      if (!with_filesignatures)
         rpmfi_flags |= RPMFI_NOFILESIGNATURES;
       ret_fi = rpmfiNew (ts, ret_header, RPMTAG_BASENAMES, rpmfi_flags);
       ret_fi = rpmfiInit (ret_fi, 0);
@@ -147,6 +181,13 @@ rpmostree_importer_read_metainfo (int fd, rpmostreecxx::RpmImporterFlags &flags,
   return TRUE;
 }
 
+gboolean
+rpmostree_importer_read_metainfo (int fd, rpmostreecxx::RpmImporterFlags &flags, Header *out_header,
+                                  gsize *out_cpio_offset, rpmfi *out_fi, GError **error)
+{
+  return read_metainfo (fd, flags.is_ima_enabled (), out_header, out_cpio_offset, out_fi, error);
+}
+
 /*
  * ima_heck_zero_hdr: Check the signature for a zero header
  *
@@ -183,6 +224,9 @@ build_rpmfi_overrides (RpmOstreeImporter *self, GCancellable *cancellable, GErro
    * NODOCS, we gather a hashset of the files with doc flags.
    */
   const gboolean doc_files_are_filtered = (*self->importer_rs)->doc_files_are_filtered ();
+  self->files = rpmfiFiles (self->fi);
+  self->has_override = g_new0 (guint8, rpmfilesFC (self->files));
+  self->overrides_by_path = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
   while ((i = rpmfiNext (self->fi)) >= 0)
     {
       if (g_cancellable_set_error_if_cancelled (cancellable, error))
@@ -206,7 +250,9 @@ build_rpmfi_overrides (RpmOstreeImporter *self, GCancellable *cancellable, GErro
       const gboolean fcaps_is_unset = (fcaps == NULL || fcaps[0] == '\0');
       if (!(user_is_root && group_is_root && fcaps_is_unset) || have_ima)
         {
-          (*self->importer_rs)->rpmfi_overrides_insert (abs_filepath, i);
+          self->has_override[i] = TRUE;
+          g_hash_table_insert (self->overrides_by_path, g_strdup (abs_filepath),
+                               GINT_TO_POINTER (i + 1));
         }
 
       const gboolean is_doc = (fattrs & RPMFILE_DOC) > 0;
@@ -236,15 +282,10 @@ rpmostree_importer_new_take_fd (int *fd, OstreeRepo *repo, DnfPackage *pkg,
                                 rpmostreecxx::RpmImporterFlags &flags, OstreeSePolicy *sepolicy,
                                 GCancellable *cancellable, GError **error)
 {
-  RpmOstreeImporter *ret = NULL;
   g_auto (Header) hdr = NULL;
   g_auto (rpmfi) fi = NULL;
   gsize cpio_offset = 0;
 
-  g_autoptr (archive) ar = rpmostree_unpack_rpm2cpio (*fd, error);
-  if (ar == NULL)
-    return NULL;
-
   if (!rpmostree_importer_read_metainfo (*fd, flags, &hdr, &cpio_offset, &fi, error))
     return (RpmOstreeImporter *)glnx_prefix_error_null (error, "Reading metainfo");
   g_assert (hdr != NULL);
@@ -255,13 +296,16 @@ rpmostree_importer_new_take_fd (int *fd, OstreeRepo *repo, DnfPackage *pkg,
   g_assert (ostree_branch != NULL);
   CXX_TRY_VAR (importer_rs, rpmostreecxx::rpm_importer_new (pkg_name, ostree_branch, flags), error);
 
-  ret = (RpmOstreeImporter *)g_object_new (RPMOSTREE_TYPE_IMPORTER, NULL);
+  g_autoptr (RpmOstreeImporter) ret
+      = (RpmOstreeImporter *)g_object_new (RPMOSTREE_TYPE_IMPORTER, NULL);
+  ret->archive = rpmostree_unpack_rpm2cpio (*fd, &ret->stats.decompress_usec, error);
+  if (ret->archive == NULL)
+    return NULL;
   ret->importer_rs.emplace (std::move (importer_rs));
   ret->fd = glnx_steal_fd (fd);
   ret->repo = (OstreeRepo *)g_object_ref (repo);
   ret->sepolicy = (OstreeSePolicy *)(sepolicy ? g_object_ref (sepolicy) : NULL);
   ret->fi = util::move_nullify (fi);
-  ret->archive = util::move_nullify (ar);
   ret->hdr = util::move_nullify (hdr);
   ret->cpio_offset = cpio_offset;
   ret->pkg = (DnfPackage *)(pkg ? g_object_ref (pkg) : NULL);
@@ -270,7 +314,54 @@ rpmostree_importer_new_take_fd (int *fd, OstreeRepo *repo, DnfPackage *pkg,
     return (RpmOstreeImporter *)glnx_prefix_error_null (
         error, "Processing file-overrides for package %s", pkg_name);
 
-  return ret;
+  return util::move_nullify (ret);
+}
+
+/* Whether @relpath (without the leading '/') is file @ix, without building
+ * its path */
+static gboolean
+fi_path_equal (rpmfiles files, int ix, const char *relpath)
+{
+  const char *dn = rpmfilesDN (files, rpmfilesDI (files, ix));
+  const char *bn = rpmfilesBN (files, ix);
+  if (!dn || !bn || dn[0] != '/')
+    return FALSE;
+  dn++;
+  const size_t dnlen = strlen (dn);
+  return strncmp (relpath, dn, dnlen) == 0 && g_str_equal (relpath + dnlen, bn);
+}
+
+/* Find the rpmfi index for the archive entry @relpath, or -1 */
+static int
+find_entry_fi_index (RpmOstreeImporter *self, const char *relpath)
+{
+  while (relpath[0] == '.' && relpath[1] == '/')
+    relpath += 2;
+
+  const int n = rpmfilesFC (self->files);
+  int ix = self->next_fi_index;
+  /* Ghosts aren't in the payload */
+  while (ix < n && (rpmfilesFFlags (self->files, ix) & RPMFILE_GHOST))
+    ix++;
+  if (ix < n && fi_path_equal (self->files, ix, relpath))
+    {
+      self->next_fi_index = ix + 1;
+      return ix;
+    }
+
+  if (!self->fi_by_path)
+    {
+      self->fi_by_path = g_hash_table_new_full (g_str_hash, g_str_equal, free, NULL);
+      for (int i = 0; i < n; i++)
+        g_hash_table_insert (self->fi_by_path, rpmfilesFN (self->files, i),
+                             GINT_TO_POINTER (i + 1));
+    }
+  const char *abspath = glnx_strjoina ("/", relpath);
+  ix = GPOINTER_TO_INT (g_hash_table_lookup (self->fi_by_path, abspath)) - 1;
+  /* Pick the cursor back up from here */
+  if (ix >= 0)
+    self->next_fi_index = ix + 1;
+  return ix;
 }
 
 static void
@@ -280,10 +371,15 @@ get_rpmfi_override (RpmOstreeImporter *self, const char *abs_filepath, const cha
   g_assert (abs_filepath != NULL);
   g_assert (abs_filepath[0] == '/');
 
-  if (!(*self->importer_rs)->rpmfi_overrides_contains (abs_filepath))
+  /* Usually this is about the entry being imported */
+  int index;
+  if (self->entry_fi_index >= 0
+      && fi_path_equal (self->files, self->entry_fi_index, abs_filepath + 1))
+    index = self->entry_fi_index;
+  else
+    index = GPOINTER_TO_INT (g_hash_table_lookup (self->overrides_by_path, abs_filepath)) - 1;
+  if (index < 0 || !self->has_override[index])
     return;
-  int index = (*self->importer_rs)->rpmfi_overrides_get (abs_filepath);
-  g_assert (index >= 0);
 
   rpmfiInit (self->fi, index);
   int r = rpmfiNext (self->fi);
@@ -363,12 +459,41 @@ repo_metadata_for_package (DnfRepo *repo)
   return g_variant_builder_end (&builder);
 }
 
+/* Build the RPMOSTREE_RPMFI_OVERRIDES_KEY list, using the same criteria as
+ * apply_rpmfi_overrides() does when walking the header itself */
+static GVariant *
+build_rpmfi_overrides_variant (RpmOstreeImporter *self)
+{
+  g_auto (GVariantBuilder) builder;
+  g_variant_builder_init (&builder, G_VARIANT_TYPE (RPMOSTREE_RPMFI_OVERRIDES_FORMAT));
+  const int n_files = rpmfilesFC (self->files);
+  for (int i = 0; i < n_files; i++)
+    {
+      const char *user = rpmfilesFUser (self->files, i) ?: "root";
+      const char *group = rpmfilesFGroup (self->files, i) ?: "root";
+      const char *fcaps = rpmfilesFCaps (self->files, i) ?: "";
+      rpm_mode_t mode = rpmfilesFMode (self->files, i);
+      const gboolean has_non_bare_user_mode = (mode & (S_ISUID | S_ISGID | S_ISVTX)) > 0;
+      if (g_str_equal (user, "root") && g_str_equal (group, "root") && !has_non_bare_user_mode
+          && fcaps[0] == '\0')
+        continue;
+      if (!(S_ISREG (mode) || S_ISLNK (mode) || S_ISDIR (mode)))
+        continue;
+
+      g_autofree char *fn = rpmfilesFN (self->files, i);
+      const gboolean is_ghost = (rpmfilesFFlags (self->files, i) & RPMFILE_GHOST) > 0;
+      g_variant_builder_add (&builder, "(ssssub)", fn, user, group, fcaps, (guint32)mode,
+                             is_ghost);
+    }
+  return g_variant_builder_end (&builder);
+}
+
 static gboolean
 build_metadata_variant (RpmOstreeImporter *self, GVariant **out_variant, char **out_metadata_sha256,
                         GCancellable *cancellable, GError **error)
 {
   g_autofree char *metadata_sha256 = NULL;
-  g_autoptr (GChecksum) pkg_checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_autoptr (RpmOstreeHasher) pkg_checksum = rpmostree_hasher_new (G_CHECKSUM_SHA256);
   g_auto (GVariantBuilder) metadata_builder;
   g_variant_builder_init (&metadata_builder, (GVariantType *)"a{sv}");
 
@@ -388,10 +513,10 @@ build_metadata_variant (RpmOstreeImporter *self, GVariant **out_variant, char **
     g_variant_builder_add (&metadata_builder, "{sv}", "rpmostree.metadata",
                            g_variant_new_from_bytes ((GVariantType *)"ay", metadata, TRUE));
 
-    g_checksum_update (pkg_checksum, (const guint8 *)g_bytes_get_data (metadata, NULL),
-                       g_bytes_get_size (metadata));
+    rpmostree_hasher_update (pkg_checksum, (const guint8 *)g_bytes_get_data (metadata, NULL),
+                             g_bytes_get_size (metadata));
 
-    metadata_sha256 = g_strdup (g_checksum_get_string (pkg_checksum));
+    metadata_sha256 = g_strdup (rpmostree_hasher_get_string (pkg_checksum));
 
     g_variant_builder_add (&metadata_builder, "{sv}", "rpmostree.metadata_sha256",
                            g_variant_new_string (metadata_sha256));
@@ -415,15 +540,19 @@ build_metadata_variant (RpmOstreeImporter *self, GVariant **out_variant, char **
     g_variant_builder_add (&metadata_builder, "{sv}", "rpmostree.sepolicy",
                            g_variant_new_string (ostree_sepolicy_get_csum (self->sepolicy)));
 
+  g_variant_builder_add (&metadata_builder, "{sv}", RPMOSTREE_RPMFI_OVERRIDES_KEY,
+                         build_rpmfi_overrides_variant (self));
+
   /* let's be nice to our future selves just in case */
   g_variant_builder_add (&metadata_builder, "{sv}", "rpmostree.unpack_version",
                          g_variant_new_uint32 (1));
 
   /* Originally we just had unpack_version = 1, let's add a minor version for
-   * compatible increments.  Bumped 4 → 5 for timestamp, and 5 → 6 for docs.
+   * compatible increments.  Bumped 4 → 5 for timestamp, 5 → 6 for docs, and
+   * 6 → 7 for rpmfi_overrides.
    */
   g_variant_builder_add (&metadata_builder, "{sv}", "rpmostree.unpack_minor_version",
-                         g_variant_new_uint32 (6));
+                         g_variant_new_uint32 (7));
 
   if (self->pkg)
     {
@@ -461,6 +590,105 @@ typedef struct
   GError **error;
 } cb_data;
 
+static GVariant *xattr_cb (OstreeRepo *repo, const char *path, GFileInfo *file_info,
+                          gpointer user_data);
+
+/* Digests weaker than this aren't trusted to identify content */
+static gboolean
+digest_algo_is_strong (int algo)
+{
+  return algo == PGPHASHALGO_SHA256 || algo == PGPHASHALGO_SHA384 || algo == PGPHASHALGO_SHA512;
+}
+
+/* Return the content checksum of @path in the previous version's commit, if
+ * its object is what we'd write for @file_info and @xattrs; the caller has
+ * already checked that the header digests match. */
+static char *
+find_previous_object (RpmOstreeImporter *self, const char *path, GFileInfo *file_info,
+                      GVariant *xattrs)
+{
+  g_autoptr (GFile) f = g_file_resolve_relative_path (self->prev_root, path + 1);
+  if (g_file_query_file_type (f, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, NULL)
+      != G_FILE_TYPE_REGULAR)
+    return NULL;
+  g_autofree char *checksum = g_strdup (ostree_repo_file_get_checksum (OSTREE_REPO_FILE (f)));
+
+  g_autoptr (GFileInfo) prev_info = NULL;
+  g_autoptr (GVariant) prev_xattrs = NULL;
+  if (!ostree_repo_load_file (self->repo, checksum, NULL, &prev_info, &prev_xattrs, NULL, NULL))
+    return NULL;
+  const char *attrs[] = { "unix::mode", "unix::uid", "unix::gid" };
+  for (guint i = 0; i < G_N_ELEMENTS (attrs); i++)
+    {
+      if (g_file_info_get_attribute_uint32 (prev_info, attrs[i])
+          != g_file_info_get_attribute_uint32 (file_info, attrs[i]))
+        return NULL;
+    }
+  if (g_file_info_get_size (prev_info) != g_file_info_get_size (file_info)
+      || !g_variant_equal (prev_xattrs, xattrs))
+    return NULL;
+
+  return util::move_nullify (checksum);
+}
+
+/* For the regular file @path about to be imported as @file_info, check
+ * whether the digest index already knows its object; if so, it's queued to be
+ * added to the mtree directly and *out_skip is set. */
+static void
+check_digest_index (RpmOstreeImporter *self, const char *path, GFileInfo *file_info,
+                    gboolean *out_skip, cb_data *fdata)
+{
+  *out_skip = FALSE;
+  if (self->entry_fi_index < 0)
+    return;
+
+  rpmfiInit (self->fi, self->entry_fi_index);
+  if (rpmfiNext (self->fi) < 0)
+    return;
+  /* The archive refers to hardlinks by path, so leave those to ostree */
+  if (!S_ISREG (rpmfiFMode (self->fi)) || rpmfiFNlink (self->fi) != 1)
+    return;
+  /* Sanity check that the entry is the file we think it is; translation only
+   * ever changes the directory */
+  const char *basename = strrchr (path, '/') + 1;
+  if (!g_str_equal (rpmfiBN (self->fi), basename)
+      || (guint64)rpmfiFSize (self->fi) != (guint64)g_file_info_get_size (file_info))
+    return;
+  int algo = 0;
+  g_autofree char *digest = rpmfiFDigestHex (self->fi, &algo);
+  if (!digest || !*digest || !digest_algo_is_strong (algo))
+    return;
+
+  g_autoptr (GVariant) xattrs = xattr_cb (self->repo, path, file_info, fdata);
+  if (*fdata->error)
+    return;
+  g_autofree char *key = rpmostree_digest_index_make_key (
+      algo, digest, g_file_info_get_size (file_info),
+      g_file_info_get_attribute_uint32 (file_info, "unix::mode"),
+      g_file_info_get_attribute_uint32 (file_info, "unix::uid"),
+      g_file_info_get_attribute_uint32 (file_info, "unix::gid"), xattrs);
+
+  g_autofree char *checksum = NULL;
+  if (!rpmostree_digest_index_lookup (self->digest_index, key, &checksum, NULL, fdata->error))
+    return;
+  if (!checksum && self->prev_digests)
+    {
+      auto prev_digest = static_cast<const char *> (
+          g_hash_table_lookup (self->prev_digests, rpmfiFN (self->fi)));
+      if (prev_digest && g_str_equal (prev_digest, digest))
+        checksum = find_previous_object (self, path, file_info, xattrs);
+      if (checksum)
+        g_hash_table_insert (self->digest_keys, g_strdup (path), g_strdup (key));
+    }
+  if (checksum)
+    {
+      g_hash_table_insert (self->deduped, g_strdup (path), util::move_nullify (checksum));
+      *out_skip = TRUE;
+    }
+  else
+    g_hash_table_insert (self->digest_keys, g_strdup (path), util::move_nullify (key));
+}
+
 static OstreeRepoCommitFilterResult
 compose_filter_cb (OstreeRepo *repo, const char *path, GFileInfo *file_info, gpointer user_data)
 {
@@ -521,6 +749,15 @@ compose_filter_cb (OstreeRepo *repo, const char *path, GFileInfo *file_info, gpo
 
   (*self->importer_rs)->tweak_imported_file_info (*file_info);
 
+  if (self->use_digest_index && g_file_info_get_file_type (file_info) == G_FILE_TYPE_REGULAR
+      && *error == NULL)
+    {
+      gboolean skip = FALSE;
+      check_digest_index (self, path, file_info, &skip, (cb_data *)user_data);
+      if (skip)
+        return OSTREE_REPO_COMMIT_FILTER_SKIP;
+    }
+
   return OSTREE_REPO_COMMIT_FILTER_ALLOW;
 }
 
@@ -535,7 +772,8 @@ xattr_cb (OstreeRepo *repo, const char *path, GFileInfo *file_info, gpointer use
   g_assert (*path == '/');
   g_assert (user_data != NULL);
 
-  auto self = static_cast<RpmOstreeImporter *> (user_data);
+  RpmOstreeImporter *self = ((cb_data *)user_data)->self;
+  GError **error = ((cb_data *)user_data)->error;
   const char *fcaps = NULL;
 
   GVariant *imasig = NULL;
@@ -556,6 +794,11 @@ xattr_cb (OstreeRepo *repo, const char *path, GFileInfo *file_info, gpointer use
                              imasig);
     }
 
+  if (self->label_cache)
+    rpmostree_label_cache_add_xattr (self->label_cache, &builder, path,
+                                     g_file_info_get_attribute_uint32 (file_info, "unix::mode"),
+                                     error);
+
   return g_variant_ref_sink (g_variant_builder_end (&builder));
 }
 
@@ -571,6 +814,9 @@ handle_translate_pathname (OstreeRepo *_repo, const struct stat *_stbuf, const c
 
   auto self = static_cast<RpmOstreeImporter *> (user_data);
 
+  /* This is called first for each entry, so note which file it is */
+  self->entry_fi_index = find_entry_fi_index (self, path);
+
   auto translated = (*self->importer_rs)->handle_translate_pathname (path);
   if (translated.size () != 0)
     return g_strdup (translated.c_str ());
@@ -578,6 +824,307 @@ handle_translate_pathname (OstreeRepo *_repo, const struct stat *_stbuf, const c
     return NULL;
 }
 
+/* Files are looked up in the digest index only if the package uses a strong
+ * digest */
+static void
+prepare_digest_index (RpmOstreeImporter *self)
+{
+  if (!digest_algo_is_strong (rpmfiDigestAlgo (self->fi)))
+    return;
+
+  self->use_digest_index = TRUE;
+  self->digest_keys = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  self->deduped = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+}
+
+/* Find the most recent cached commit for another version of this package
+ * with the same arch, so that files which didn't change can be taken from it
+ * even if the digest index doesn't know them (yet). */
+static gboolean
+load_previous_version (RpmOstreeImporter *self, GCancellable *cancellable, GError **error)
+{
+  /* The branch for the package name, i.e. without the "<evr>.<arch>" */
+  auto branch = (*self->importer_rs)->ostree_branch ();
+  const char *last_slash = strrchr (branch.c_str (), '/');
+  g_assert (last_slash);
+  g_autofree char *prefix = g_strndup (branch.c_str (), last_slash - branch.c_str ());
+  const char *arch_suffix = strrchr (last_slash, '.');
+  g_assert (arch_suffix);
+
+  g_autoptr (GHashTable) refs = NULL;
+  if (!ostree_repo_list_refs_ext (self->repo, prefix, &refs, OSTREE_REPO_LIST_REFS_EXT_NONE,
+                                  cancellable, error))
+    return FALSE;
+
+  g_autoptr (GVariant) prev_commit = NULL;
+  g_autofree char *prev_rev = NULL;
+  GLNX_HASH_TABLE_FOREACH_KV (refs, const char *, ref, const char *, rev)
+    {
+      if (g_str_equal (ref, branch.c_str ()) || !g_str_has_suffix (ref, arch_suffix))
+        continue;
+      g_autoptr (GVariant) commit = NULL;
+      if (!ostree_repo_load_commit (self->repo, rev, &commit, NULL, error))
+        return FALSE;
+      if (prev_commit
+          && ostree_commit_get_timestamp (commit) <= ostree_commit_get_timestamp (prev_commit))
+        continue;
+      g_clear_pointer (&prev_commit, g_variant_unref);
+      prev_commit = util::move_nullify (commit);
+      g_free (prev_rev);
+      prev_rev = g_strdup (rev);
+    }
+  if (!prev_commit)
+    return TRUE;
+
+  g_autoptr (GVariant) metadata = g_variant_get_child_value (prev_commit, 0);
+  g_autoptr (GVariant) header_v
+      = g_variant_lookup_value (metadata, "rpmostree.metadata", G_VARIANT_TYPE ("ay"));
+  if (!header_v)
+    return TRUE;
+
+  /* librpm can only read the header from a file */
+  g_auto (GLnxTmpfile) tmpf = {
+    0,
+  };
+  if (!glnx_open_anonymous_tmpfile (O_RDWR | O_CLOEXEC, &tmpf, error))
+    return FALSE;
+  if (glnx_loop_write (tmpf.fd, g_variant_get_data (header_v), g_variant_get_size (header_v)) < 0)
+    return glnx_throw_errno_prefix (error, "write");
+  if (lseek (tmpf.fd, 0, SEEK_SET) < 0)
+    return glnx_throw_errno_prefix (error, "lseek");
+  g_auto (Header) prev_hdr = NULL;
+  g_auto (rpmfi) prev_fi = NULL;
+  if (!read_metainfo (tmpf.fd, FALSE, &prev_hdr, NULL, &prev_fi, error))
+    return FALSE;
+
+  g_autoptr (GHashTable) prev_digests
+      = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  while (rpmfiNext (prev_fi) >= 0)
+    {
+      if (!S_ISREG (rpmfiFMode (prev_fi)) || rpmfiFNlink (prev_fi) != 1)
+        continue;
+      int algo = 0;
+      g_autofree char *digest = rpmfiFDigestHex (prev_fi, &algo);
+      if (!digest || !*digest || !digest_algo_is_strong (algo))
+        continue;
+      g_hash_table_insert (prev_digests, g_strdup (rpmfiFN (prev_fi)), util::move_nullify (digest));
+    }
+
+  if (!ostree_repo_read_commit (self->repo, prev_rev, &self->prev_root, NULL, cancellable, error))
+    return FALSE;
+  self->prev_digests = util::move_nullify (prev_digests);
+  g_debug ("Comparing against cached commit %s for %s", prev_rev, prefix);
+  return TRUE;
+}
+
+/* Compute the xattrs for an object at @path which we're writing ourselves
+ * rather than through the commit modifier: those from xattr_cb(), plus the
+ * SELinux label that the modifier's policy would have added. */
+static gboolean
+get_object_xattrs (RpmOstreeImporter *self, const char *path, GFileInfo *file_info,
+                   cb_data *fdata, GVariant **out_xattrs, GCancellable *cancellable,
+                   GError **error)
+{
+  g_autoptr (GVariant) xattrs = xattr_cb (self->repo, path, file_info, fdata);
+  if (*fdata->error)
+    {
+      g_propagate_error (error, util::move_nullify (*fdata->error));
+      return FALSE;
+    }
+
+  /* With a label cache, xattr_cb already added it */
+  if (!self->label_cache && self->sepolicy && ostree_sepolicy_get_name (self->sepolicy))
+    {
+      g_autofree char *label = NULL;
+      if (!ostree_sepolicy_get_label (self->sepolicy, path,
+                                      g_file_info_get_attribute_uint32 (file_info, "unix::mode"),
+                                      &label, cancellable, error))
+        return FALSE;
+      if (!label)
+        return glnx_throw (error, "Failed to look up SELinux label for '%s'", path);
+
+      g_auto (GVariantBuilder) builder;
+      g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ayay)"));
+      GVariantIter iter;
+      g_variant_iter_init (&iter, xattrs);
+      GVariant *xattr;
+      while ((xattr = g_variant_iter_next_value (&iter)))
+        {
+          g_variant_builder_add_value (&builder, xattr);
+          g_variant_unref (xattr);
+        }
+      g_variant_builder_add (&builder, "(@ay@ay)", g_variant_new_bytestring ("security.selinux"),
+                             g_variant_new_bytestring (label));
+      g_variant_unref (xattrs);
+      xattrs = g_variant_ref_sink (g_variant_builder_end (&builder));
+    }
+
+  *out_xattrs = util::move_nullify (xattrs);
+  return TRUE;
+}
+
+/* Find the subdirectory @name of @dir, creating it the way
+ * ostree_repo_import_archive_to_mtree() autocreates parents if needed: as
+ * root-owned 0755, passed through the commit modifier callbacks. */
+static gboolean
+ensure_mtree_dir (RpmOstreeImporter *self, OstreeMutableTree *dir, const char *name,
+                  const char *path, cb_data *fdata, OstreeMutableTree **out_subdir,
+                  GCancellable *cancellable, GError **error)
+{
+  g_autofree char *file_csum = NULL;
+  g_autoptr (OstreeMutableTree) subdir = NULL;
+  g_autoptr (GError) local_error = NULL;
+  if (ostree_mutable_tree_lookup (dir, name, &file_csum, &subdir, &local_error))
+    {
+      if (!subdir)
+        return glnx_throw (error, "Not a directory: %s", path);
+      *out_subdir = util::move_nullify (subdir);
+      return TRUE;
+    }
+  if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+    {
+      g_propagate_error (error, util::move_nullify (local_error));
+      return FALSE;
+    }
+
+  g_autoptr (GFileInfo) file_info = g_file_info_new ();
+  g_file_info_set_file_type (file_info, G_FILE_TYPE_DIRECTORY);
+  g_file_info_set_attribute_uint32 (file_info, "unix::mode", S_IFDIR | 0755);
+  g_file_info_set_attribute_uint32 (file_info, "unix::uid", 0);
+  g_file_info_set_attribute_uint32 (file_info, "unix::gid", 0);
+  (void)compose_filter_cb (self->repo, path, file_info, fdata);
+  g_autoptr (GVariant) xattrs = NULL;
+  if (!get_object_xattrs (self, path, file_info, fdata, &xattrs, cancellable, error))
+    return FALSE;
+  g_autoptr (GVariant) dirmeta = ostree_create_directory_metadata (file_info, xattrs);
+  g_autofree guchar *csum = NULL;
+  if (!ostree_repo_write_metadata (self->repo, OSTREE_OBJECT_TYPE_DIR_META, NULL, dirmeta, &csum,
+                                   cancellable, error))
+    return FALSE;
+  g_autofree char *csum_str = ostree_checksum_from_bytes (csum);
+
+  if (!ostree_mutable_tree_ensure_dir (dir, name, &subdir, error))
+    return FALSE;
+  ostree_mutable_tree_set_metadata_checksum (subdir, csum_str);
+  *out_subdir = util::move_nullify (subdir);
+  return TRUE;
+}
+
+/* Walk (and create as needed) the directories leading to @path in @mtree,
+ * returning the parent directory of its last component. */
+static gboolean
+ensure_mtree_parent (RpmOstreeImporter *self, OstreeMutableTree *mtree, const char *path,
+                     cb_data *fdata, OstreeMutableTree **out_parent, GCancellable *cancellable,
+                     GError **error)
+{
+  g_autoptr (OstreeMutableTree) dir = (OstreeMutableTree *)g_object_ref (mtree);
+  g_auto (GStrv) components = g_strsplit (path + 1, "/", -1);
+  const guint n = g_strv_length (components);
+  g_autoptr (GString) dirpath = g_string_new ("");
+  for (guint i = 0; i + 1 < n; i++)
+    {
+      g_string_append_c (dirpath, '/');
+      g_string_append (dirpath, components[i]);
+      g_autoptr (OstreeMutableTree) subdir = NULL;
+      if (!ensure_mtree_dir (self, dir, components[i], dirpath->str, fdata, &subdir, cancellable,
+                             error))
+        return FALSE;
+      g_clear_object (&dir);
+      dir = util::move_nullify (subdir);
+    }
+  *out_parent = util::move_nullify (dir);
+  return TRUE;
+}
+
+/* Add the files we skipped importing because the digest index already had
+ * them, and record the ones we did import. */
+static gboolean
+finish_digest_index (RpmOstreeImporter *self, OstreeMutableTree *mtree, cb_data *fdata,
+                     GCancellable *cancellable, GError **error)
+{
+  GLNX_HASH_TABLE_FOREACH_KV (self->deduped, const char *, path, const char *, checksum)
+    {
+      g_autoptr (OstreeMutableTree) dir = NULL;
+      if (!ensure_mtree_parent (self, mtree, path, fdata, &dir, cancellable, error))
+        return FALSE;
+      if (!ostree_mutable_tree_replace_file (dir, glnx_basename (path), checksum, error))
+        return FALSE;
+    }
+
+  GLNX_HASH_TABLE_FOREACH_KV (self->digest_keys, const char *, path, const char *, key)
+    {
+      g_autoptr (OstreeMutableTree) dir = (OstreeMutableTree *)g_object_ref (mtree);
+      g_auto (GStrv) components = g_strsplit (path + 1, "/", -1);
+      const guint n = g_strv_length (components);
+      g_autofree char *checksum = NULL;
+      guint i = 0;
+      for (; i < n && dir; i++)
+        {
+          g_autoptr (OstreeMutableTree) subdir = NULL;
+          g_clear_pointer (&checksum, g_free);
+          if (!ostree_mutable_tree_lookup (dir, components[i], &checksum, &subdir, NULL))
+            break;
+          g_clear_object (&dir);
+          dir = util::move_nullify (subdir);
+        }
+      /* It may have been replaced by a later entry */
+      if (i == n && checksum)
+        rpmostree_digest_index_add (self->digest_index, key, checksum);
+    }
+
+  return TRUE;
+}
+
+/* Write the tmpfiles.d snippet generated from the package's /var and /run
+ * content directly into @mtree, labeled and filtered as if it had come from
+ * the archive. */
+static gboolean
+write_tmpfiles_to_mtree (RpmOstreeImporter *self, OstreeMutableTree *mtree, cb_data *fdata,
+                         GCancellable *cancellable, GError **error)
+{
+  auto content = (*self->importer_rs)->serialize_tmpfiles_content ();
+  auto pkg_name = (*self->importer_rs)->pkg_name ();
+  const char *path
+      = glnx_strjoina ("/usr/lib/rpm-ostree/tmpfiles.d/", pkg_name.c_str (), ".conf");
+
+  g_autoptr (GFileInfo) file_info = g_file_info_new ();
+  g_file_info_set_file_type (file_info, G_FILE_TYPE_REGULAR);
+  g_file_info_set_attribute_uint32 (file_info, "unix::mode", S_IFREG | 0644);
+  g_file_info_set_attribute_uint32 (file_info, "unix::uid", 0);
+  g_file_info_set_attribute_uint32 (file_info, "unix::gid", 0);
+  g_file_info_set_size (file_info, content.size ());
+  const auto filter_result = compose_filter_cb (self->repo, path, file_info, fdata);
+  if (*fdata->error)
+    {
+      g_propagate_error (error, util::move_nullify (*fdata->error));
+      return FALSE;
+    }
+  if (filter_result == OSTREE_REPO_COMMIT_FILTER_SKIP)
+    return TRUE;
+
+  g_autoptr (GVariant) xattrs = NULL;
+  if (!get_object_xattrs (self, path, file_info, fdata, &xattrs, cancellable, error))
+    return FALSE;
+
+  g_autoptr (GInputStream) input
+      = g_memory_input_stream_new_from_data (content.data (), content.size (), NULL);
+  g_autoptr (GInputStream) object_input = NULL;
+  guint64 object_length = 0;
+  if (!ostree_raw_file_to_content_stream (input, file_info, xattrs, &object_input, &object_length,
+                                          cancellable, error))
+    return FALSE;
+  g_autofree guchar *csum = NULL;
+  if (!ostree_repo_write_content (self->repo, NULL, object_input, object_length, &csum,
+                                  cancellable, error))
+    return FALSE;
+  g_autofree char *csum_str = ostree_checksum_from_bytes (csum);
+
+  g_autoptr (OstreeMutableTree) dir = NULL;
+  if (!ensure_mtree_parent (self, mtree, path, fdata, &dir, cancellable, error))
+    return FALSE;
+  return ostree_mutable_tree_replace_file (dir, glnx_basename (path), csum_str, error);
+}
+
 static gboolean
 import_rpm_to_repo (RpmOstreeImporter *self, char **out_csum, char **out_metadata_sha256,
                     GCancellable *cancellable, GError **error)
@@ -591,8 +1138,19 @@ import_rpm_to_repo (RpmOstreeImporter *self, char **out_csum, char **out_metadat
   int modifier_flags = OSTREE_REPO_COMMIT_MODIFIER_FLAGS_ERROR_ON_UNLABELED;
   g_autoptr (OstreeRepoCommitModifier) modifier = ostree_repo_commit_modifier_new (
       static_cast<OstreeRepoCommitModifierFlags> (modifier_flags), compose_filter_cb, &fdata, NULL);
-  ostree_repo_commit_modifier_set_xattr_callback (modifier, xattr_cb, NULL, self);
-  ostree_repo_commit_modifier_set_sepolicy (modifier, self->sepolicy);
+  ostree_repo_commit_modifier_set_xattr_callback (modifier, xattr_cb, NULL, &fdata);
+  /* With a label cache, xattr_cb does the labeling */
+  if (!self->label_cache)
+    ostree_repo_commit_modifier_set_sepolicy (modifier, self->sepolicy);
+
+  /* With a label cache (or no policy), xattr_cb computes all of the xattrs,
+   * so we can tell what a file's object would be before writing it. */
+  if (self->digest_index && (self->label_cache || !self->sepolicy))
+    {
+      prepare_digest_index (self);
+      if (self->use_digest_index && !load_previous_version (self, cancellable, error))
+        return glnx_prefix_error (error, "Loading previous version");
+    }
 
   OstreeRepoImportArchiveOptions opts = { 0 };
   opts.ignore_unsupported_content = TRUE;
@@ -612,41 +1170,19 @@ import_rpm_to_repo (RpmOstreeImporter *self, char **out_csum, char **out_metadat
       return FALSE;
     }
 
-  /* Handle any data we've accumulated to write to tmpfiles.d.
-   * I originally tried to do this entirely in memory but things
-   * like selinux labeling only happen as callbacks out of using
-   * the input dfd/archive paths...so let's just use a tempdir. (:sadface:)
-   */
-  g_auto (GLnxTmpDir) tmpdir = {
-    0,
-  };
-  if ((*self->importer_rs)->has_tmpfiles_entries ())
+  /* Past the archive; anything else isn't from it */
+  self->entry_fi_index = -1;
+  if (self->use_digest_index)
     {
-      auto content = (*self->importer_rs)->serialize_tmpfiles_content ();
-      auto pkg_name = (*self->importer_rs)->pkg_name ();
-
-      if (!glnx_mkdtemp ("rpm-ostree-import.XXXXXX", 0700, &tmpdir, error))
-        return FALSE;
-      if (!glnx_shutil_mkdir_p_at (tmpdir.fd, "usr/lib/rpm-ostree/tmpfiles.d", 0755, cancellable,
-                                   error))
-        return FALSE;
-      if (!glnx_file_replace_contents_at (
-              tmpdir.fd,
-              glnx_strjoina ("usr/lib/rpm-ostree/tmpfiles.d/", pkg_name.c_str (), ".conf"),
-              (guint8 *)content.data (), content.size (), GLNX_FILE_REPLACE_NODATASYNC, cancellable,
-              error))
-        return FALSE;
+      if (!finish_digest_index (self, mtree, &fdata, cancellable, error))
+        return glnx_prefix_error (error, "Adding files from digest index");
+    }
 
-      if (!ostree_repo_write_dfd_to_mtree (repo, tmpdir.fd, ".", mtree, modifier, cancellable,
-                                           error))
+  /* Handle any data we've accumulated to write to tmpfiles.d */
+  if ((*self->importer_rs)->has_tmpfiles_entries ())
+    {
+      if (!write_tmpfiles_to_mtree (self, mtree, &fdata, cancellable, error))
         return glnx_prefix_error (error, "Writing tmpfiles mtree");
-
-      /* check if any of the cbs set an error */
-      if (cb_error != NULL)
-        {
-          g_propagate_error (error, cb_error);
-          return FALSE;
-        }
     }
 
   g_autoptr (GFile) root = NULL;
@@ -675,6 +1211,16 @@ import_rpm_to_repo (RpmOstreeImporter *self, char **out_csum, char **out_metadat
   return TRUE;
 }
 
+/* CPU time consumed by the calling thread */
+static guint64
+get_thread_cpu_usec (void)
+{
+  struct timespec ts;
+  if (clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts) < 0)
+    return 0;
+  return (guint64)ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
 gboolean
 rpmostree_importer_run (RpmOstreeImporter *self, char **out_csum, char **out_metadata_sha256,
                         GCancellable *cancellable, GError **error)
@@ -683,7 +1229,10 @@ rpmostree_importer_run (RpmOstreeImporter *self, char **out_csum, char **out_met
     return FALSE;
 
   CXX_TRY (rpmostreecxx::failpoint ("rpm-importer::run"), error);
+  rpmostreecxx::TraceSpan span ("import", self->pkg ? dnf_package_get_nevra (self->pkg) : NULL);
 
+  const guint64 wall_start = g_get_monotonic_time ();
+  const guint64 cpu_start = get_thread_cpu_usec ();
   g_autofree char *metadata_sha256 = NULL;
   g_autofree char *csum = NULL;
   if (!import_rpm_to_repo (self, &csum, &metadata_sha256, cancellable, error))
@@ -691,6 +1240,10 @@ rpmostree_importer_run (RpmOstreeImporter *self, char **out_csum, char **out_met
       auto pkg_name = (*self->importer_rs)->pkg_name ();
       return glnx_prefix_error (error, "Importing package '%s'", pkg_name.c_str ());
     }
+  self->stats.installed_size = headerGetNumber (self->hdr, RPMTAG_LONGSIZE);
+  self->stats.wall_usec = g_get_monotonic_time () - wall_start;
+  self->stats.cpu_usec = get_thread_cpu_usec () - cpu_start;
+  self->stats.n_deduped = self->deduped ? g_hash_table_size (self->deduped) : 0;
 
   auto branch = (*self->importer_rs)->ostree_branch ();
   ostree_repo_transaction_set_ref (self->repo, NULL, branch.c_str (), csum);
@@ -740,4 +1293,30 @@ rpmostree_importer_get_nevra (RpmOstreeImporter *self)
       self->hdr,
       (RpmOstreePkgNevraFlags)(PKG_NEVRA_FLAGS_NAME | PKG_NEVRA_FLAGS_EPOCH_VERSION_RELEASE
                                | PKG_NEVRA_FLAGS_ARCH));
-}
\ No newline at end of file
+}
+
+/* Look up SELinux labels in @cache, rather than directly in the sepolicy
+ * (which must be the one the cache was created for). */
+void
+rpmostree_importer_set_label_cache (RpmOstreeImporter *self, RpmOstreeLabelCache *cache)
+{
+  g_assert (self->sepolicy);
+  g_clear_pointer (&self->label_cache, rpmostree_label_cache_unref);
+  self->label_cache = cache ? rpmostree_label_cache_ref (cache) : NULL;
+}
+
+/* Look up files in @index by their header digest, skipping the write for
+ * those already in the repo; and add the ones we import to it. */
+void
+rpmostree_importer_set_digest_index (RpmOstreeImporter *self, RpmOstreeDigestIndex *index)
+{
+  g_clear_pointer (&self->digest_index, rpmostree_digest_index_unref);
+  self->digest_index = index ? rpmostree_digest_index_ref (index) : NULL;
+}
+
+/* Only valid after a successful rpmostree_importer_run() */
+void
+rpmostree_importer_get_stats (RpmOstreeImporter *self, RpmOstreeImporterStats *out_stats)
+{
+  *out_stats = self->stats;
+}
@@ -23,11 +23,21 @@
 #include <ostree.h>
 
 #include "libglnx.h"
+#include "rpmostree-digest-index.h"
+#include "rpmostree-label-cache.h"
 #include <libdnf/libdnf.h>
 #include <rpm/rpmlib.h>
 
 G_BEGIN_DECLS
 
+/* Commit metadata listing the files whose ownership, file capabilities or
+ * setuid/setgid/sticky bits need to be applied when the package is
+ * installed, as (path, user, group, fcaps, mode, is-ghost); see
+ * apply_rpmfi_overrides(). Users and groups are "root" by default and fcaps
+ * may be "". Packages imported before this was recorded don't have it. */
+#define RPMOSTREE_RPMFI_OVERRIDES_KEY "rpmostree.rpmfi_overrides"
+#define RPMOSTREE_RPMFI_OVERRIDES_FORMAT "a(ssssub)"
+
 typedef struct RpmOstreeImporter RpmOstreeImporter;
 
 #define RPMOSTREE_TYPE_IMPORTER (rpmostree_importer_get_type ())
@@ -60,4 +70,20 @@ char *rpmostree_importer_run_async_finish (RpmOstreeImporter *self, GAsyncResult
 
 char *rpmostree_importer_get_nevra (RpmOstreeImporter *self);
 
+void rpmostree_importer_set_label_cache (RpmOstreeImporter *self, RpmOstreeLabelCache *cache);
+
+void rpmostree_importer_set_digest_index (RpmOstreeImporter *self, RpmOstreeDigestIndex *index);
+
+/* Measurements of a completed import, used to tune concurrency */
+typedef struct
+{
+  guint64 installed_size;  /* Total size of the package payload */
+  guint64 wall_usec;       /* Wall clock time spent importing */
+  guint64 cpu_usec;        /* CPU time of the importing thread; the rest is I/O */
+  guint64 decompress_usec; /* CPU time of the payload decompression thread */
+  guint n_deduped;         /* Files taken from the digest index rather than written */
+} RpmOstreeImporterStats;
+
+void rpmostree_importer_get_stats (RpmOstreeImporter *self, RpmOstreeImporterStats *out_stats);
+
 G_END_DECLS
@@ -33,10 +33,12 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <utime.h>
+#include <vector>
 
 #include "rpmostree-core.h"
 #include "rpmostree-cxxrs.h"
 #include "rpmostree-kernel.h"
+#include "rpmostree-rpm-util.h"
 #include "rpmostree-util.h"
 
 static const char usrlib_ostreeboot[] = "usr/lib/ostree-boot";
@@ -111,15 +113,13 @@ find_kernel_and_initramfs_in_bootdir (int rootfs_dfd, const char *bootdir, char
   return TRUE;
 }
 
-/* Given a directory @subpath, find the first child that is a directory
- * and contains a `vmlinuz` file, returning it in @out_subdir.  If there are multiple directories,
- * return an error.
+/* Given a directory @subpath, add each child that is a directory and contains
+ * a `vmlinuz` file to @out_subdirs.
  */
 static gboolean
-find_dir_with_vmlinuz (int rootfs_dfd, const char *subpath, char **out_subdir,
-                       GCancellable *cancellable, GError **error)
+list_dirs_with_vmlinuz (int rootfs_dfd, const char *subpath, GPtrArray *out_subdirs,
+                        GCancellable *cancellable, GError **error)
 {
-  g_autofree char *ret_subdir = NULL;
   g_auto (GLnxDirFdIterator) dfd_iter = {
     0,
   };
@@ -146,17 +146,33 @@ find_dir_with_vmlinuz (int rootfs_dfd, const char *subpath, char **out_subdir,
       if (errno == ENOENT)
         continue;
 
-      if (ret_subdir)
-        {
-          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                       "Multiple kernels (vmlinuz) found in: %s: %s %s", subpath,
-                       glnx_basename (ret_subdir), dent->d_name);
-          return FALSE;
-        }
-      ret_subdir = g_strconcat (subpath, "/", dent->d_name, NULL);
+      g_ptr_array_add (out_subdirs, g_strconcat (subpath, "/", dent->d_name, NULL));
+    }
+
+  return TRUE;
+}
+
+/* Like list_dirs_with_vmlinuz(), but for the single kernel case: return the
+ * directory in @out_subdir (NULL if there's none), or an error if there are
+ * multiple.
+ */
+static gboolean
+find_dir_with_vmlinuz (int rootfs_dfd, const char *subpath, char **out_subdir,
+                       GCancellable *cancellable, GError **error)
+{
+  g_autoptr (GPtrArray) subdirs = g_ptr_array_new_with_free_func (g_free);
+  if (!list_dirs_with_vmlinuz (rootfs_dfd, subpath, subdirs, cancellable, error))
+    return FALSE;
+  if (subdirs->len > 1)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Multiple kernels (vmlinuz) found in: %s: %s %s", subpath,
+                   glnx_basename ((char *)subdirs->pdata[0]),
+                   glnx_basename ((char *)subdirs->pdata[1]));
+      return FALSE;
     }
 
-  *out_subdir = util::move_nullify (ret_subdir);
+  *out_subdir = subdirs->len > 0 ? g_strdup ((char *)subdirs->pdata[0]) : NULL;
   return TRUE;
 }
 
@@ -301,6 +317,46 @@ rpmostree_find_kernel (int rootfs_dfd, GCancellable *cancellable, GError **error
   return g_variant_ref_sink (g_variant_new ("(sssms)", kver, bootdir, kernel_path, initramfs_path));
 }
 
+static gint
+compare_strings (gconstpointer a, gconstpointer b)
+{
+  return strcmp (*(const char *const *)a, *(const char *const *)b);
+}
+
+/* Like rpmostree_find_kernel(), but for trees which may carry more than one
+ * kernel (e.g. regular plus debug or rt) in /usr/lib/modules: returns a
+ * GVariant of the same (sssms) format for each, ordered by kver. The legacy
+ * locations aren't looked at, since they can only hold one kernel.
+ */
+GPtrArray *
+rpmostree_find_module_kernels (int rootfs_dfd, GCancellable *cancellable, GError **error)
+{
+  g_autoptr (GPtrArray) subdirs = g_ptr_array_new_with_free_func (g_free);
+  if (!glnx_fstatat_allow_noent (rootfs_dfd, "usr/lib/modules", NULL, 0, error))
+    return NULL;
+  if (errno == 0
+      && !list_dirs_with_vmlinuz (rootfs_dfd, "usr/lib/modules", subdirs, cancellable, error))
+    return NULL;
+  g_ptr_array_sort (subdirs, compare_strings);
+
+  g_autoptr (GPtrArray) ret = g_ptr_array_new_with_free_func ((GDestroyNotify)g_variant_unref);
+  for (guint i = 0; i < subdirs->len; i++)
+    {
+      auto bootdir = static_cast<const char *> (subdirs->pdata[i]);
+      g_autofree char *kernel_path = NULL;
+      g_autofree char *initramfs_path = NULL;
+      if (!find_kernel_and_initramfs_in_bootdir (rootfs_dfd, bootdir, NULL, &kernel_path,
+                                                 &initramfs_path, cancellable, error))
+        return NULL;
+      if (!kernel_path)
+        continue;
+      g_ptr_array_add (ret, g_variant_ref_sink (g_variant_new ("(sssms)", glnx_basename (bootdir),
+                                                               bootdir, kernel_path,
+                                                               initramfs_path)));
+    }
+  return util::move_nullify (ret);
+}
+
 /* Given a @rootfs_dfd and path to kernel/initramfs that live in
  * usr/lib/modules/$kver, possibly update @bootdir to use them. @bootdir should
  * be one of either /usr/lib/ostree-boot or /boot. If @only_if_found is set, we
@@ -355,13 +411,15 @@ copy_kernel_into (int rootfs_dfd, const char *kver, const char *boot_checksum_st
 
 /* Given a kernel path and a temporary initramfs, place them in their final
  * location. We handle /usr/lib/modules as well as the /usr/lib/ostree-boot and
- * /boot paths where we need to pre-compute their checksum.
+ * /boot paths where we need to pre-compute their checksum. If the caller
+ * already has that checksum (e.g. from rpmostree_run_dracut()), it can pass it
+ * as @boot_checksum so we don't read everything back.
  */
 gboolean
 rpmostree_finalize_kernel (int rootfs_dfd, const char *bootdir, const char *kver,
                            const char *kernel_path, GLnxTmpfile *initramfs_tmpf,
-                           RpmOstreeFinalizeKernelDestination dest, GCancellable *cancellable,
-                           GError **error)
+                           const char *boot_checksum, RpmOstreeFinalizeKernelDestination dest,
+                           GCancellable *cancellable, GError **error)
 {
   const char slash_bootdir[] = "boot";
   g_autofree char *modules_bootdir = g_build_filename ("usr/lib/modules", kver, NULL);
@@ -370,21 +428,29 @@ rpmostree_finalize_kernel (int rootfs_dfd, const char *bootdir, const char *kver
    * checksum"). We checksum the initramfs from the tmpfile fd (via mmap()) to
    * avoid writing it to disk in another temporary location.
    */
-  g_autoptr (GChecksum) boot_checksum = g_checksum_new (G_CHECKSUM_SHA256);
-  if (!_rpmostree_util_update_checksum_from_file (boot_checksum, rootfs_dfd, kernel_path,
-                                                  cancellable, error))
-    return FALSE;
+  g_autoptr (RpmOstreeHasher) checksum = NULL;
+  if (!boot_checksum)
+    {
+      checksum = rpmostree_hasher_new (G_CHECKSUM_SHA256);
+      if (!_rpmostree_util_update_checksum_from_file (checksum, rootfs_dfd, kernel_path,
+                                                      cancellable, error))
+        return FALSE;
+    }
 
   g_autofree char *initramfs_modules_path
       = g_build_filename (modules_bootdir, "initramfs.img", NULL);
 
   if (initramfs_tmpf && initramfs_tmpf->initialized)
     {
-      g_autoptr (GMappedFile) mfile = g_mapped_file_new_from_fd (initramfs_tmpf->fd, FALSE, error);
-      if (!mfile)
-        return glnx_prefix_error (error, "mmap(initramfs)");
-      g_checksum_update (boot_checksum, (guint8 *)g_mapped_file_get_contents (mfile),
-                         g_mapped_file_get_length (mfile));
+      if (checksum)
+        {
+          g_autoptr (GMappedFile) mfile
+              = g_mapped_file_new_from_fd (initramfs_tmpf->fd, FALSE, error);
+          if (!mfile)
+            return glnx_prefix_error (error, "mmap(initramfs)");
+          rpmostree_hasher_update (checksum, (guint8 *)g_mapped_file_get_contents (mfile),
+                                   g_mapped_file_get_length (mfile));
+        }
 
       /* Replace the initramfs */
       if (unlinkat (rootfs_dfd, initramfs_modules_path, 0) < 0)
@@ -396,15 +462,15 @@ rpmostree_finalize_kernel (int rootfs_dfd, const char *bootdir, const char *kver
                                  initramfs_modules_path, error))
         return glnx_prefix_error (error, "Linking initramfs");
     }
-  else
+  else if (checksum)
     {
       /* we're not replacing the initramfs; use built-in one */
-      if (!_rpmostree_util_update_checksum_from_file (boot_checksum, rootfs_dfd,
-                                                      initramfs_modules_path, cancellable, error))
+      if (!_rpmostree_util_update_checksum_from_file (checksum, rootfs_dfd, initramfs_modules_path,
+                                                      cancellable, error))
         return FALSE;
     }
 
-  const char *boot_checksum_str = g_checksum_get_string (boot_checksum);
+  const char *boot_checksum_str = checksum ? rpmostree_hasher_get_string (checksum) : boot_checksum;
 
   g_autofree char *kernel_modules_path = g_build_filename (modules_bootdir, "vmlinuz", NULL);
   /* It's possible the bootdir is already the modules directory; in that case,
@@ -449,6 +515,44 @@ rpmostree_finalize_kernel (int rootfs_dfd, const char *bootdir, const char *kver
   return TRUE;
 }
 
+/* Copies the initramfs from dracut's pipe into the tmpfile, adding it to the
+ * checksum on the way. */
+struct InitramfsCopy
+{
+  int pipe_fd; /* owned */
+  int out_fd;
+  RpmOstreeHasher *checksum;
+  GError *error;
+};
+
+static gpointer
+initramfs_copy_thread (gpointer data)
+{
+  auto copy = static_cast<InitramfsCopy *> (data);
+  const gsize bufsize = 128 * 1024;
+  g_autofree guint8 *buf = static_cast<guint8 *> (g_malloc (bufsize));
+  while (TRUE)
+    {
+      const ssize_t n = TEMP_FAILURE_RETRY (read (copy->pipe_fd, buf, bufsize));
+      if (n < 0)
+        {
+          glnx_throw_errno_prefix (&copy->error, "read(initramfs)");
+          break;
+        }
+      if (n == 0)
+        break;
+      rpmostree_hasher_update (copy->checksum, buf, n);
+      if (glnx_loop_write (copy->out_fd, buf, n) < 0)
+        {
+          glnx_throw_errno_prefix (&copy->error, "write(initramfs)");
+          break;
+        }
+    }
+  /* If we bailed out early, this makes dracut fail too rather than block */
+  glnx_close_fd (&copy->pipe_fd);
+  return NULL;
+}
+
 struct Unlinker
 {
   int rootfs_dfd;
@@ -457,61 +561,36 @@ struct Unlinker
   ~Unlinker () { (void)unlinkat (rootfs_dfd, path, 0); }
 };
 
-gboolean
-rpmostree_run_dracut (int rootfs_dfd, const char *const *argv, const char *kver,
-                      const char *rebuild_from_initramfs, gboolean use_root_etc,
-                      GLnxTmpDir *dracut_host_tmpdir, GLnxTmpfile *out_initramfs_tmpf,
-                      GCancellable *cancellable, GError **error)
+static const char rpmostree_dracut_wrapper_path[] = "usr/bin/rpmostree-dracut-wrapper";
+
+/* Shell wrapper around dracut to write to the O_TMPFILE fd. If dracut
+ * supports --stdout, it writes the image straight there; otherwise it goes
+ * through -f and an extra copy.
+ */
+static gboolean
+write_dracut_wrapper (int rootfs_dfd, GError **error)
 {
   auto destdir = rpmostreecxx::cliwrap_destdir ();
-  /* Shell wrapper around dracut to write to the O_TMPFILE fd;
-   * at some point in the future we should add --fd X instead of -f
-   * to dracut.
-   */
-  static const char rpmostree_dracut_wrapper_path[] = "usr/bin/rpmostree-dracut-wrapper";
   /* This also hardcodes a few arguments */
-  g_autofree char *rpmostree_dracut_wrapper
-      = g_strdup_printf ("#!/usr/bin/bash\n"
-                         "set -euo pipefail\n"
-                         "export PATH=%s:${PATH}\n"
-                         "extra_argv=; if (dracut --help; true) | grep -q -e --reproducible; then "
-                         "extra_argv=\"--reproducible\"; fi\n"
-                         "mkdir -p /tmp/dracut && dracut $extra_argv -v --add ostree "
-                         "--tmpdir=/tmp/dracut -f /tmp/initramfs.img \"$@\"\n"
-                         "cat /tmp/initramfs.img >/proc/self/fd/3\n",
-                         destdir.c_str ());
-  g_autoptr (GPtrArray) rebuild_argv = NULL;
+  g_autofree char *rpmostree_dracut_wrapper = g_strdup_printf (
+      "#!/usr/bin/bash\n"
+      "set -euo pipefail\n"
+      "export PATH=%s:${PATH}\n"
+      "dracut_help=$(dracut --help 2>&1 || true)\n"
+      "extra_argv=; if grep -q -e --reproducible <<< \"$dracut_help\"; then "
+      "extra_argv=\"--reproducible\"; fi\n"
+      "mkdir -p /tmp/dracut\n"
+      "if grep -q -e --stdout <<< \"$dracut_help\"; then\n"
+      "  dracut $extra_argv -v --add ostree --tmpdir=/tmp/dracut --stdout \"$@\" "
+      ">/proc/self/fd/3\n"
+      "else\n"
+      "  dracut $extra_argv -v --add ostree --tmpdir=/tmp/dracut -f /tmp/initramfs.img \"$@\"\n"
+      "  cat /tmp/initramfs.img >/proc/self/fd/3\n"
+      "fi\n",
+      destdir.c_str ());
   g_auto (GLnxTmpfile) tmpf = {
     0,
   };
-
-  /* We need to have /etc/passwd since dracut doesn't have altfiles
-   * today.  Though maybe in the future we should add it, but
-   * in the end we want to use systemd-sysusers of course.
-   **/
-  CXX_TRY_VAR (etc_guard, rpmostreecxx::prepare_tempetc_guard (rootfs_dfd), error);
-
-  CXX_TRY_VAR (have_passwd, rpmostreecxx::prepare_rpm_layering (rootfs_dfd, ""), error);
-
-  /* Note rebuild_from_initramfs now is only used as a fallback in the client-side regen
-   * path when we can't fetch the canonical initramfs args to use. */
-
-  if (rebuild_from_initramfs)
-    {
-      rebuild_argv = g_ptr_array_new ();
-      g_ptr_array_add (rebuild_argv, (char *)"--rebuild");
-      g_ptr_array_add (rebuild_argv, (char *)rebuild_from_initramfs);
-
-      /* In this case, any args specified in argv are *additional*
-       * to the rebuild from the base.
-       */
-      for (char **iter = (char **)argv; iter && *iter; iter++)
-        g_ptr_array_add (rebuild_argv, *iter);
-      g_ptr_array_add (rebuild_argv, NULL);
-      argv = (const char *const *)rebuild_argv->pdata;
-    }
-
-  /* First tempfile is just our shell script */
   if (!glnx_open_tmpfile_linkable_at (rootfs_dfd, "usr/bin", O_RDWR | O_CLOEXEC, &tmpf, error))
     return FALSE;
   if (glnx_loop_write (tmpf.fd, rpmostree_dracut_wrapper, strlen (rpmostree_dracut_wrapper)) < 0
@@ -521,15 +600,27 @@ rpmostree_run_dracut (int rootfs_dfd, const char *const *argv, const char *kver,
   if (!glnx_link_tmpfile_at (&tmpf, GLNX_LINK_TMPFILE_NOREPLACE, rootfs_dfd,
                              rpmostree_dracut_wrapper_path, error))
     return FALSE;
-  /* Close the fd now, otherwise an exec will fail */
-  glnx_tmpfile_clear (&tmpf);
-
-  auto unlinker = Unlinker{ .rootfs_dfd = rootfs_dfd, .path = rpmostree_dracut_wrapper_path };
+  /* The fd is closed when we return, otherwise an exec would fail */
+  return TRUE;
+}
 
-  /* Second tempfile is the initramfs contents.  Note we generate the tmpfile
+/* Run the dracut wrapper for @kver in a bwrap container, with the root
+ * already prepared by our callers.  @host_tmpdir_path, if given, is bound to
+ * dracut's tmpdir.
+ */
+static gboolean
+run_dracut_in_root (int rootfs_dfd, const char *const *argv, const char *kver,
+                    gboolean use_root_etc, const char *host_tmpdir_path,
+                    RpmOstreeHasher *checksum, GLnxTmpfile *out_initramfs_tmpf,
+                    GCancellable *cancellable, GError **error)
+{
+  /* The tempfile is the initramfs contents.  Note we generate the tmpfile
    * in . since in the current rpm-ostree design the temporary rootfs may not have tmp/
    * as a real mountpoint.
    */
+  g_auto (GLnxTmpfile) tmpf = {
+    0,
+  };
   if (!glnx_open_tmpfile_linkable_at (rootfs_dfd, ".", O_RDWR | O_CLOEXEC, &tmpf, error))
     return FALSE;
 
@@ -550,8 +641,8 @@ rpmostree_run_dracut (int rootfs_dfd, const char *const *argv, const char *kver,
    * (and print ugly messages) since we don't give it `CAP_MKNOD`. */
   bwrap->setenv ("DRACUT_NO_MKNOD", "1");
 
-  if (dracut_host_tmpdir)
-    bwrap->bind_readwrite (dracut_host_tmpdir->path, "/tmp/dracut");
+  if (host_tmpdir_path)
+    bwrap->bind_readwrite (host_tmpdir_path, "/tmp/dracut");
 
   /* Set up argv and run */
   bwrap->append_child_arg ((const char *)glnx_basename (rpmostree_dracut_wrapper_path));
@@ -564,13 +655,49 @@ rpmostree_run_dracut (int rootfs_dfd, const char *const *argv, const char *kver,
       bwrap->append_child_arg (kver);
     }
 
-  // Pass the tempfile to the child as fd 3
-  glnx_autofd int tmpf_child = fcntl (tmpf.fd, F_DUPFD_CLOEXEC, 3);
-  if (tmpf_child < 0)
-    return glnx_throw_errno_prefix (error, "fnctl");
-  bwrap->take_fd (glnx_steal_fd (&tmpf_child), 3);
+  /* If we're asked for a checksum of the image, dracut writes it to a pipe and
+   * we compute that while copying it into the tempfile, rather than reading
+   * the whole thing back afterwards. Otherwise, it writes to the tempfile
+   * directly. Either way, it's the child's fd 3. */
+  InitramfsCopy copy = { -1, tmpf.fd, checksum, NULL };
+  GThread *copy_thread = NULL;
+  if (checksum)
+    {
+      int pipefd[2];
+      if (pipe2 (pipefd, O_CLOEXEC) < 0)
+        return glnx_throw_errno_prefix (error, "pipe2");
+      copy.pipe_fd = pipefd[0];
+      bwrap->take_fd (pipefd[1], 3);
+      copy_thread = g_thread_new ("rpmostree-initramfs", initramfs_copy_thread, &copy);
+    }
+  else
+    {
+      glnx_autofd int tmpf_child = fcntl (tmpf.fd, F_DUPFD_CLOEXEC, 3);
+      if (tmpf_child < 0)
+        return glnx_throw_errno_prefix (error, "fnctl");
+      bwrap->take_fd (glnx_steal_fd (&tmpf_child), 3);
+    }
 
-  CXX_TRY (bwrap->run (*cancellable), error);
+  const gboolean run_ok = CXX (bwrap->run (*cancellable), error);
+  if (copy_thread)
+    {
+      /* The launcher holds on to the write end of the pipe; dropping it is
+       * what gives the copy thread EOF. */
+      {
+        auto done = std::move (bwrap);
+      }
+      g_thread_join (copy_thread);
+      if (copy.error)
+        {
+          if (run_ok)
+            g_propagate_error (error, copy.error);
+          else
+            g_error_free (copy.error);
+          return FALSE;
+        }
+    }
+  if (!run_ok)
+    return FALSE;
 
   /* For FIPS mode we need /dev/urandom pre-created because the FIPS
    * standards authors require that randomness is tested in a
@@ -580,7 +707,70 @@ rpmostree_run_dracut (int rootfs_dfd, const char *const *argv, const char *kver,
    * https://bugzilla.redhat.com/show_bug.cgi?id=1401444
    * https://bugzilla.redhat.com/show_bug.cgi?id=1380866
    * */
+  const off_t image_size = lseek (tmpf.fd, 0, SEEK_END);
+  if (image_size < 0)
+    return glnx_throw_errno_prefix (error, "lseek");
   CXX_TRY (rpmostreecxx::append_dracut_random_cpio (tmpf.fd), error);
+  /* That's small, so just read it back */
+  if (checksum)
+    {
+      struct stat stbuf;
+      if (!glnx_fstat (tmpf.fd, &stbuf, error))
+        return FALSE;
+      const gsize extra = stbuf.st_size - image_size;
+      g_autofree guint8 *buf = static_cast<guint8 *> (g_malloc (extra));
+      if (TEMP_FAILURE_RETRY (pread (tmpf.fd, buf, extra, image_size)) != (ssize_t)extra)
+        return glnx_throw_errno_prefix (error, "pread(initramfs)");
+      rpmostree_hasher_update (checksum, buf, extra);
+    }
+
+  *out_initramfs_tmpf = tmpf;
+  tmpf.initialized = FALSE; /* Transfer */
+  return TRUE;
+}
+
+gboolean
+rpmostree_run_dracut (int rootfs_dfd, const char *const *argv, const char *kver,
+                      const char *rebuild_from_initramfs, gboolean use_root_etc,
+                      GLnxTmpDir *dracut_host_tmpdir, RpmOstreeHasher *checksum,
+                      GLnxTmpfile *out_initramfs_tmpf, GCancellable *cancellable, GError **error)
+{
+  g_autoptr (GPtrArray) rebuild_argv = NULL;
+
+  /* We need to have /etc/passwd since dracut doesn't have altfiles
+   * today.  Though maybe in the future we should add it, but
+   * in the end we want to use systemd-sysusers of course.
+   **/
+  CXX_TRY_VAR (etc_guard, rpmostreecxx::prepare_tempetc_guard (rootfs_dfd), error);
+
+  CXX_TRY_VAR (have_passwd, rpmostreecxx::prepare_rpm_layering (rootfs_dfd, ""), error);
+
+  /* Note rebuild_from_initramfs now is only used as a fallback in the client-side regen
+   * path when we can't fetch the canonical initramfs args to use. */
+
+  if (rebuild_from_initramfs)
+    {
+      rebuild_argv = g_ptr_array_new ();
+      g_ptr_array_add (rebuild_argv, (char *)"--rebuild");
+      g_ptr_array_add (rebuild_argv, (char *)rebuild_from_initramfs);
+
+      /* In this case, any args specified in argv are *additional*
+       * to the rebuild from the base.
+       */
+      for (char **iter = (char **)argv; iter && *iter; iter++)
+        g_ptr_array_add (rebuild_argv, *iter);
+      g_ptr_array_add (rebuild_argv, NULL);
+      argv = (const char *const *)rebuild_argv->pdata;
+    }
+
+  if (!write_dracut_wrapper (rootfs_dfd, error))
+    return FALSE;
+  auto unlinker = Unlinker{ .rootfs_dfd = rootfs_dfd, .path = rpmostree_dracut_wrapper_path };
+
+  if (!run_dracut_in_root (rootfs_dfd, argv, kver, use_root_etc,
+                           dracut_host_tmpdir ? dracut_host_tmpdir->path : NULL, checksum,
+                           out_initramfs_tmpf, cancellable, error))
+    return FALSE;
 
   if (rebuild_from_initramfs)
     (void)unlinkat (rootfs_dfd, rebuild_from_initramfs, 0);
@@ -590,7 +780,318 @@ rpmostree_run_dracut (int rootfs_dfd, const char *const *argv, const char *kver,
 
   CXX_TRY (etc_guard->undo (), error);
 
+  return TRUE;
+}
+
+struct DracutJobRun
+{
+  int rootfs_dfd;
+  const char *const *argv;
+  const char *host_tmpdir_path;
+  RpmOstreeDracutJob *job;
+  GCancellable *cancellable;
+  GError *error;
+};
+
+static gpointer
+dracut_job_thread (gpointer data)
+{
+  auto run = static_cast<DracutJobRun *> (data);
+  const gint64 start_time = g_get_monotonic_time ();
+  (void)run_dracut_in_root (run->rootfs_dfd, run->argv, run->job->kver, FALSE,
+                            run->host_tmpdir_path, run->job->checksum, &run->job->initramfs_tmpf,
+                            run->cancellable, &run->error);
+  run->job->elapsed_secs = (g_get_monotonic_time () - start_time) / (double)G_USEC_PER_SEC;
+  return NULL;
+}
+
+/* Like rpmostree_run_dracut(), but generates the initramfs for each of @jobs
+ * (one per kernel) concurrently; the root is only prepared once for all of
+ * them.  Each run gets its own subdirectory of @dracut_host_tmpdir, so they
+ * share its filesystem without stepping on each other.
+ */
+gboolean
+rpmostree_run_dracut_jobs (int rootfs_dfd, const char *const *argv,
+                           GLnxTmpDir *dracut_host_tmpdir, RpmOstreeDracutJob *jobs,
+                           guint n_jobs, GCancellable *cancellable, GError **error)
+{
+  CXX_TRY_VAR (etc_guard, rpmostreecxx::prepare_tempetc_guard (rootfs_dfd), error);
+
+  CXX_TRY_VAR (have_passwd, rpmostreecxx::prepare_rpm_layering (rootfs_dfd, ""), error);
+
+  if (!write_dracut_wrapper (rootfs_dfd, error))
+    return FALSE;
+  auto unlinker = Unlinker{ .rootfs_dfd = rootfs_dfd, .path = rpmostree_dracut_wrapper_path };
+
+  g_autoptr (GPtrArray) tmpdir_paths = g_ptr_array_new_with_free_func (g_free);
+  for (guint i = 0; i < n_jobs; i++)
+    {
+      if (!glnx_ensure_dir (dracut_host_tmpdir->fd, jobs[i].kver, 0700, error))
+        return FALSE;
+      g_ptr_array_add (tmpdir_paths,
+                       g_build_filename (dracut_host_tmpdir->path, jobs[i].kver, NULL));
+    }
+
+  std::vector<DracutJobRun> runs (n_jobs);
+  g_autoptr (GPtrArray) threads = g_ptr_array_new ();
+  for (guint i = 0; i < n_jobs; i++)
+    {
+      runs[i] = { rootfs_dfd, argv, (const char *)tmpdir_paths->pdata[i], &jobs[i], cancellable,
+                  NULL };
+      /* No point in a thread for the common single kernel case */
+      if (n_jobs == 1)
+        dracut_job_thread (&runs[i]);
+      else
+        g_ptr_array_add (threads, g_thread_new ("rpmostree-dracut", dracut_job_thread, &runs[i]));
+    }
+  for (guint i = 0; i < threads->len; i++)
+    g_thread_join ((GThread *)threads->pdata[i]);
+
+  /* Report the first error, in kernel order */
+  gboolean ret = TRUE;
+  for (auto &run : runs)
+    {
+      if (!run.error)
+        continue;
+      if (ret)
+        g_propagate_prefixed_error (error, run.error, "Generating initramfs for %s: ",
+                                    run.job->kver);
+      else
+        g_error_free (run.error);
+      ret = FALSE;
+    }
+  if (!ret)
+    return FALSE;
+
+  if (have_passwd)
+    ROSCXX_TRY (complete_rpm_layering (rootfs_dfd), error);
+
+  CXX_TRY (etc_guard->undo (), error);
+
+  return TRUE;
+}
+
+/* Add everything under @path (names, modes, symlink targets and file
+ * contents) to @checksum, in a stable order. */
+static gboolean
+checksum_dir_recurse (RpmOstreeHasher *checksum, int dfd, const char *path,
+                      GCancellable *cancellable, GError **error)
+{
+  g_auto (GLnxDirFdIterator) dfd_iter = {
+    FALSE,
+  };
+  if (!glnx_dirfd_iterator_init_at (dfd, path, FALSE, &dfd_iter, error))
+    return FALSE;
+  g_autoptr (GPtrArray) names = g_ptr_array_new_with_free_func (g_free);
+  while (TRUE)
+    {
+      struct dirent *dent = NULL;
+      if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, cancellable, error))
+        return FALSE;
+      if (!dent)
+        break;
+      g_ptr_array_add (names, g_strdup (dent->d_name));
+    }
+  g_ptr_array_sort (names, compare_strings);
+
+  for (guint i = 0; i < names->len; i++)
+    {
+      auto name = static_cast<const char *> (names->pdata[i]);
+      struct stat stbuf;
+      if (!glnx_fstatat (dfd_iter.fd, name, &stbuf, AT_SYMLINK_NOFOLLOW, error))
+        return FALSE;
+      rpmostree_hasher_update (checksum, (const guint8 *)name, strlen (name) + 1);
+      guint32 mode = GUINT32_TO_BE (stbuf.st_mode);
+      rpmostree_hasher_update (checksum, (const guint8 *)&mode, sizeof (mode));
+      if (S_ISREG (stbuf.st_mode))
+        {
+          glnx_autofd int fd = -1;
+          if (!glnx_openat_rdonly (dfd_iter.fd, name, FALSE, &fd, error))
+            return FALSE;
+          g_autoptr (GBytes) data = glnx_fd_readall_bytes (fd, cancellable, error);
+          if (!data)
+            return FALSE;
+          gsize len;
+          auto buf = static_cast<const guint8 *> (g_bytes_get_data (data, &len));
+          rpmostree_hasher_update (checksum, buf, len);
+        }
+      else if (S_ISLNK (stbuf.st_mode))
+        {
+          g_autofree char *target = glnx_readlinkat_malloc (dfd_iter.fd, name, cancellable, error);
+          if (!target)
+            return FALSE;
+          rpmostree_hasher_update (checksum, (const guint8 *)target, strlen (target));
+        }
+      else if (S_ISDIR (stbuf.st_mode))
+        {
+          if (!checksum_dir_recurse (checksum, dfd_iter.fd, name, cancellable, error))
+            return FALSE;
+        }
+    }
+  return TRUE;
+}
+
+/* A digest of everything rpmostree_run_dracut() would use to generate the
+ * initramfs for @kver in @rootfs_dfd: the base commit, the packages in the
+ * tree (which is where all of /usr comes from), the arguments, and the
+ * real root's /etc if @use_root_etc. */
+char *
+rpmostree_initramfs_cache_key (int rootfs_dfd, const char *base_commit, const char *const *argv,
+                               const char *kver, gboolean use_root_etc, GCancellable *cancellable,
+                               GError **error)
+{
+  GLNX_AUTO_PREFIX_ERROR ("Computing initramfs cache key", error);
+  g_autoptr (RpmOstreeHasher) checksum = rpmostree_hasher_new (G_CHECKSUM_SHA256);
+  rpmostree_hasher_update (checksum, (const guint8 *)base_commit, strlen (base_commit) + 1);
+  rpmostree_hasher_update (checksum, (const guint8 *)kver, strlen (kver) + 1);
+  for (const char *const *it = argv; it && *it; it++)
+    rpmostree_hasher_update (checksum, (const guint8 *)*it, strlen (*it) + 1);
+  rpmostree_hasher_update (checksum, (const guint8 *)"", 1);
+
+  g_autoptr (GVariant) pkglist = NULL;
+  if (!rpmostree_create_rpmdb_pkglist_variant (rootfs_dfd, ".", &pkglist, cancellable, error))
+    return NULL;
+  rpmostree_hasher_update (checksum, (const guint8 *)g_variant_get_data (pkglist),
+                           g_variant_get_size (pkglist));
+
+  if (use_root_etc && !checksum_dir_recurse (checksum, AT_FDCWD, "/etc", cancellable, error))
+    return NULL;
+
+  return g_strdup (rpmostree_hasher_get_string (checksum));
+}
+
+/* An entry is the checksum of the initramfs object, optionally followed by
+ * the boot checksum it was installed with; since the key covers every
+ * package, the kernel is the same too. */
+static gboolean
+read_initramfs_cache_entry (int dfd, const char *path, char **out_csum, char **out_boot_checksum,
+                            GCancellable *cancellable, GError **error)
+{
+  g_autofree char *contents = glnx_file_get_contents_utf8_at (dfd, path, NULL, cancellable, error);
+  if (!contents)
+    return FALSE;
+  g_auto (GStrv) lines = g_strsplit (contents, "\n", 3);
+  *out_csum = g_strdup (lines[0] ?: "");
+  if (out_boot_checksum)
+    {
+      const char *boot_csum = lines[0] ? lines[1] : NULL;
+      *out_boot_checksum = (boot_csum && ostree_validate_checksum_string (boot_csum, NULL))
+                               ? g_strdup (boot_csum)
+                               : NULL;
+    }
+  return TRUE;
+}
+
+/* If we've already generated an initramfs for @key, and it's still in the
+ * repo, copy it to a new @out_initramfs_tmpf in @rootfs_dfd, and set
+ * @out_boot_checksum if we know it. Otherwise @out_initramfs_tmpf is left
+ * uninitialized. */
+gboolean
+rpmostree_initramfs_cache_lookup (OstreeRepo *repo, const char *key, int rootfs_dfd,
+                                  GLnxTmpfile *out_initramfs_tmpf, char **out_boot_checksum,
+                                  GCancellable *cancellable, GError **error)
+{
+  GLNX_AUTO_PREFIX_ERROR ("Looking up cached initramfs", error);
+  const char *path = glnx_strjoina (RPMOSTREE_INITRAMFS_CACHE_DIR "/", key);
+  const int repo_dfd = ostree_repo_get_dfd (repo);
+  if (!glnx_fstatat_allow_noent (repo_dfd, path, NULL, 0, error))
+    return FALSE;
+  if (errno == ENOENT)
+    return TRUE;
+  g_autofree char *csum = NULL;
+  g_autofree char *boot_checksum = NULL;
+  if (!read_initramfs_cache_entry (repo_dfd, path, &csum, &boot_checksum, cancellable, error))
+    return FALSE;
+  gboolean have_object = FALSE;
+  if (ostree_validate_checksum_string (csum, NULL)
+      && !ostree_repo_has_object (repo, OSTREE_OBJECT_TYPE_FILE, csum, &have_object, cancellable,
+                                  error))
+    return FALSE;
+  if (!have_object)
+    return TRUE;
+
+  g_autoptr (GInputStream) in = NULL;
+  if (!ostree_repo_load_file (repo, csum, &in, NULL, NULL, cancellable, error))
+    return FALSE;
+  g_auto (GLnxTmpfile) tmpf = {
+    0,
+  };
+  if (!glnx_open_tmpfile_linkable_at (rootfs_dfd, ".", O_RDWR | O_CLOEXEC, &tmpf, error))
+    return FALSE;
+  g_autoptr (GOutputStream) out = g_unix_output_stream_new (tmpf.fd, FALSE);
+  if (g_output_stream_splice (out, in, G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE, cancellable, error)
+      < 0)
+    return FALSE;
+
   *out_initramfs_tmpf = tmpf;
   tmpf.initialized = FALSE; /* Transfer */
+  *out_boot_checksum = util::move_nullify (boot_checksum);
+  return TRUE;
+}
+
+/* Record that the initramfs for @kver in @commit was generated from @key, and
+ * installed with @boot_checksum if set. */
+gboolean
+rpmostree_initramfs_cache_store (OstreeRepo *repo, const char *key, const char *commit,
+                                 const char *kver, const char *boot_checksum,
+                                 GCancellable *cancellable, GError **error)
+{
+  GLNX_AUTO_PREFIX_ERROR ("Caching initramfs", error);
+  g_autoptr (GFile) root = NULL;
+  if (!ostree_repo_read_commit (repo, commit, &root, NULL, cancellable, error))
+    return FALSE;
+  g_autofree char *path = g_build_filename ("usr/lib/modules", kver, "initramfs.img", NULL);
+  g_autoptr (GFile) f = g_file_resolve_relative_path (root, path);
+  if (g_file_query_file_type (f, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, cancellable)
+      != G_FILE_TYPE_REGULAR)
+    return TRUE;
+  g_autofree char *csum
+      = g_strconcat (ostree_repo_file_get_checksum (OSTREE_REPO_FILE (f)), "\n",
+                     boot_checksum ?: "", boot_checksum ? "\n" : "", NULL);
+
+  int repo_dfd = ostree_repo_get_dfd (repo); /* borrowed */
+  if (!glnx_shutil_mkdir_p_at (repo_dfd, RPMOSTREE_INITRAMFS_CACHE_DIR, 0755, cancellable, error))
+    return FALSE;
+  const char *cachepath = glnx_strjoina (RPMOSTREE_INITRAMFS_CACHE_DIR "/", key);
+  return glnx_file_replace_contents_at (repo_dfd, cachepath, (const guint8 *)csum, -1,
+                                        GLNX_FILE_REPLACE_NODATASYNC, cancellable, error);
+}
+
+/* Delete the entries whose initramfs objects have been pruned. */
+gboolean
+rpmostree_initramfs_cache_prune (OstreeRepo *repo, GCancellable *cancellable, GError **error)
+{
+  GLNX_AUTO_PREFIX_ERROR ("Pruning initramfs cache", error);
+  const int repo_dfd = ostree_repo_get_dfd (repo);
+  if (!glnx_fstatat_allow_noent (repo_dfd, RPMOSTREE_INITRAMFS_CACHE_DIR, NULL, 0, error))
+    return FALSE;
+  if (errno == ENOENT)
+    return TRUE;
+
+  g_auto (GLnxDirFdIterator) dfd_iter = {
+    FALSE,
+  };
+  if (!glnx_dirfd_iterator_init_at (repo_dfd, RPMOSTREE_INITRAMFS_CACHE_DIR, FALSE, &dfd_iter,
+                                    error))
+    return FALSE;
+  while (TRUE)
+    {
+      struct dirent *dent = NULL;
+      if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, cancellable, error))
+        return FALSE;
+      if (!dent)
+        break;
+      g_autofree char *csum = NULL;
+      if (!read_initramfs_cache_entry (dfd_iter.fd, dent->d_name, &csum, NULL, cancellable,
+                                       error))
+        return FALSE;
+      gboolean have_object = FALSE;
+      if (ostree_validate_checksum_string (csum, NULL)
+          && !ostree_repo_has_object (repo, OSTREE_OBJECT_TYPE_FILE, csum, &have_object,
+                                      cancellable, error))
+        return FALSE;
+      if (!have_object && !glnx_unlinkat (dfd_iter.fd, dent->d_name, 0, error))
+        return FALSE;
+    }
   return TRUE;
 }
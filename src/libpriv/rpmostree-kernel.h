@@ -22,6 +22,8 @@
 
 #include <ostree.h>
 
+#include "rpmostree-hasher.h"
+
 G_BEGIN_DECLS
 
 typedef enum
@@ -34,16 +36,54 @@ typedef enum
 
 GVariant *rpmostree_find_kernel (int rootfs_dfd, GCancellable *cancellable, GError **error);
 
+GPtrArray *rpmostree_find_module_kernels (int rootfs_dfd, GCancellable *cancellable,
+                                          GError **error);
+
 gboolean rpmostree_kernel_remove (int rootfs_dfd, GCancellable *cancellable, GError **error);
 
 gboolean rpmostree_finalize_kernel (int rootfs_dfd, const char *bootdir, const char *kver,
                                     const char *kernel_path, GLnxTmpfile *initramfs_tmpf,
+                                    const char *boot_checksum,
                                     RpmOstreeFinalizeKernelDestination dest,
                                     GCancellable *cancellable, GError **error);
 
 gboolean rpmostree_run_dracut (int rootfs_dfd, const char *const *argv, const char *kver,
                                const char *rebuild_from_initramfs, gboolean use_root_etc,
-                               GLnxTmpDir *dracut_host_tmpdir, GLnxTmpfile *out_initramfs_tmpf,
-                               GCancellable *cancellable, GError **error);
+                               GLnxTmpDir *dracut_host_tmpdir, RpmOstreeHasher *checksum,
+                               GLnxTmpfile *out_initramfs_tmpf, GCancellable *cancellable,
+                               GError **error);
+
+/* One initramfs to generate with rpmostree_run_dracut_jobs() */
+typedef struct
+{
+  const char *kver;
+  RpmOstreeHasher *checksum; /* Optional */
+  GLnxTmpfile initramfs_tmpf;
+  double elapsed_secs;
+} RpmOstreeDracutJob;
+
+gboolean rpmostree_run_dracut_jobs (int rootfs_dfd, const char *const *argv,
+                                    GLnxTmpDir *dracut_host_tmpdir, RpmOstreeDracutJob *jobs,
+                                    guint n_jobs, GCancellable *cancellable, GError **error);
+
+/* Where we map dracut inputs to the initramfs objects generated from them */
+#define RPMOSTREE_INITRAMFS_CACHE_DIR "extensions/rpmostree/initramfs-cache"
+
+char *rpmostree_initramfs_cache_key (int rootfs_dfd, const char *base_commit,
+                                     const char *const *argv, const char *kver,
+                                     gboolean use_root_etc, GCancellable *cancellable,
+                                     GError **error);
+
+gboolean rpmostree_initramfs_cache_lookup (OstreeRepo *repo, const char *key, int rootfs_dfd,
+                                           GLnxTmpfile *out_initramfs_tmpf,
+                                           char **out_boot_checksum, GCancellable *cancellable,
+                                           GError **error);
+
+gboolean rpmostree_initramfs_cache_store (OstreeRepo *repo, const char *key, const char *commit,
+                                          const char *kver, const char *boot_checksum,
+                                          GCancellable *cancellable, GError **error);
+
+gboolean rpmostree_initramfs_cache_prune (OstreeRepo *repo, GCancellable *cancellable,
+                                          GError **error);
 
 G_END_DECLS
\ No newline at end of file
@@ -0,0 +1,243 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Licensed under the GNU Lesser General Public License Version 2.1
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <sys/stat.h>
+
+#include "rpmostree-label-cache.h"
+#include "rpmostree-metrics.h"
+#include "rpmostree-util.h"
+
+/* Serialized as an array of (path, file type, label); an empty label means
+ * the policy has no label for that path. */
+#define LABEL_CACHE_GVARIANT_FORMAT "a(sus)"
+
+struct _RpmOstreeLabelCache
+{
+  gint refcount; /* atomic */
+  OstreeSePolicy *sepolicy;
+  int repo_dfd;
+  char *policy_csum; /* NULL if there's no policy to key on */
+
+  GMutex lock;
+  GHashTable *labels; /* "<type>:<path>" -> label, "" for unlabeled */
+  gboolean dirty;
+  guint n_hits;
+  guint n_misses;
+};
+
+static char *
+make_key (const char *path, guint32 mode)
+{
+  return g_strdup_printf ("%o:%s", mode & S_IFMT, path);
+}
+
+static gboolean
+load_cache (RpmOstreeLabelCache *cache, GCancellable *cancellable, GError **error)
+{
+  const char *cachepath = glnx_strjoina (RPMOSTREE_LABEL_CACHE_DIR "/", cache->policy_csum);
+  glnx_autofd int fd = -1;
+  g_autoptr (GError) local_error = NULL;
+  if (!glnx_openat_rdonly (cache->repo_dfd, cachepath, TRUE, &fd, &local_error))
+    {
+      if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        return TRUE;
+      g_propagate_error (error, util::move_nullify (local_error));
+      return FALSE;
+    }
+
+  g_autoptr (GBytes) data = glnx_fd_readall_bytes (fd, cancellable, error);
+  if (!data)
+    return FALSE;
+  g_autoptr (GVariant) v = g_variant_ref_sink (
+      g_variant_new_from_bytes (G_VARIANT_TYPE (LABEL_CACHE_GVARIANT_FORMAT), data, FALSE));
+  /* It's only a cache; if it's corrupted, start over */
+  if (!g_variant_is_normal_form (v))
+    {
+      g_debug ("Ignoring corrupted label cache %s", cachepath);
+      return TRUE;
+    }
+
+  GVariantIter iter;
+  g_variant_iter_init (&iter, v);
+  const char *path;
+  guint32 type;
+  const char *label;
+  while (g_variant_iter_next (&iter, "(&su&s)", &path, &type, &label))
+    g_hash_table_insert (cache->labels, make_key (path, type), g_strdup (label));
+  return TRUE;
+}
+
+/* Create a label cache for @sepolicy, loading any existing cache from the
+ * repo at @repo_dfd. */
+RpmOstreeLabelCache *
+rpmostree_label_cache_new (OstreeSePolicy *sepolicy, int repo_dfd, GCancellable *cancellable,
+                           GError **error)
+{
+  g_autoptr (RpmOstreeLabelCache) cache = g_new0 (RpmOstreeLabelCache, 1);
+  cache->refcount = 1;
+  cache->sepolicy = (OstreeSePolicy *)g_object_ref (sepolicy);
+  cache->repo_dfd = repo_dfd;
+  cache->policy_csum = g_strdup (ostree_sepolicy_get_csum (sepolicy));
+  g_mutex_init (&cache->lock);
+  cache->labels = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  if (cache->policy_csum && !load_cache (cache, cancellable, error))
+    return (RpmOstreeLabelCache *)glnx_prefix_error_null (error, "Loading label cache");
+
+  return util::move_nullify (cache);
+}
+
+RpmOstreeLabelCache *
+rpmostree_label_cache_ref (RpmOstreeLabelCache *cache)
+{
+  g_atomic_int_inc (&cache->refcount);
+  return cache;
+}
+
+void
+rpmostree_label_cache_unref (RpmOstreeLabelCache *cache)
+{
+  if (!g_atomic_int_dec_and_test (&cache->refcount))
+    return;
+  g_debug ("Label cache: %u hits, %u misses", cache->n_hits, cache->n_misses);
+  rpmostree_metrics_count_cache (RPMOSTREE_METRIC_CACHE_LABEL, cache->n_hits, cache->n_misses);
+  g_object_unref (cache->sepolicy);
+  g_free (cache->policy_csum);
+  g_mutex_clear (&cache->lock);
+  g_hash_table_unref (cache->labels);
+  g_free (cache);
+}
+
+/* Like ostree_sepolicy_get_label(), but consulting the cache first. */
+gboolean
+rpmostree_label_cache_get_label (RpmOstreeLabelCache *cache, const char *path, guint32 mode,
+                                 char **out_label, GCancellable *cancellable, GError **error)
+{
+  g_autofree char *key = make_key (path, mode);
+  {
+    g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&cache->lock);
+    auto label = static_cast<const char *> (g_hash_table_lookup (cache->labels, key));
+    if (label)
+      {
+        cache->n_hits++;
+        *out_label = *label ? g_strdup (label) : NULL;
+        return TRUE;
+      }
+    cache->n_misses++;
+  }
+
+  g_autofree char *label = NULL;
+  if (!ostree_sepolicy_get_label (cache->sepolicy, path, mode, &label, cancellable, error))
+    return FALSE;
+
+  {
+    g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&cache->lock);
+    g_hash_table_replace (cache->labels, util::move_nullify (key), g_strdup (label ?: ""));
+    cache->dirty = TRUE;
+  }
+
+  *out_label = util::move_nullify (label);
+  return TRUE;
+}
+
+/* For use in commit modifier xattr callbacks, which can't fail: add the label
+ * for @path to @builder. If there isn't one, or looking it up fails, @error
+ * is set (unless it already was); this mirrors
+ * OSTREE_REPO_COMMIT_MODIFIER_FLAGS_ERROR_ON_UNLABELED. */
+void
+rpmostree_label_cache_add_xattr (RpmOstreeLabelCache *cache, GVariantBuilder *builder,
+                                 const char *path, guint32 mode, GError **error)
+{
+  g_autoptr (GError) local_error = NULL;
+  g_autofree char *label = NULL;
+  if (!rpmostree_label_cache_get_label (cache, path, mode, &label, NULL, &local_error))
+    {
+      if (error && *error == NULL)
+        g_propagate_prefixed_error (error, util::move_nullify (local_error),
+                                    "Looking up SELinux label for '%s': ", path);
+      return;
+    }
+  if (!label)
+    {
+      if (error && *error == NULL)
+        glnx_throw (error, "Failed to look up SELinux label for '%s'", path);
+      return;
+    }
+  g_variant_builder_add (builder, "(@ay@ay)", g_variant_new_bytestring ("security.selinux"),
+                         g_variant_new_bytestring (label));
+}
+
+/* Write the cache back to the repo if anything was added, and prune the
+ * caches for any other policies. */
+gboolean
+rpmostree_label_cache_flush (RpmOstreeLabelCache *cache, GCancellable *cancellable,
+                             GError **error)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&cache->lock);
+  if (!cache->dirty || !cache->policy_csum)
+    return TRUE;
+
+  GLNX_AUTO_PREFIX_ERROR ("Writing label cache", error);
+
+  if (!glnx_shutil_mkdir_p_at (cache->repo_dfd, RPMOSTREE_LABEL_CACHE_DIR, 0755, cancellable,
+                               error))
+    return FALSE;
+
+  g_auto (GLnxDirFdIterator) dfd_iter = {
+    FALSE,
+  };
+  if (!glnx_dirfd_iterator_init_at (cache->repo_dfd, RPMOSTREE_LABEL_CACHE_DIR, FALSE, &dfd_iter,
+                                    error))
+    return FALSE;
+  while (TRUE)
+    {
+      struct dirent *dent = NULL;
+      if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, cancellable, error))
+        return FALSE;
+      if (!dent)
+        break;
+      if (!g_str_equal (dent->d_name, cache->policy_csum)
+          && !glnx_unlinkat (dfd_iter.fd, dent->d_name, 0, error))
+        return FALSE;
+    }
+
+  g_auto (GVariantBuilder) builder;
+  g_variant_builder_init (&builder, G_VARIANT_TYPE (LABEL_CACHE_GVARIANT_FORMAT));
+  GLNX_HASH_TABLE_FOREACH_KV (cache->labels, const char *, key, const char *, label)
+    {
+      const char *sep = strchr (key, ':');
+      g_assert (sep);
+      g_autofree char *type_str = g_strndup (key, sep - key);
+      guint32 type = (guint32)g_ascii_strtoull (type_str, NULL, 8);
+      g_variant_builder_add (&builder, "(sus)", sep + 1, type, label);
+    }
+  g_autoptr (GVariant) v = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  if (!glnx_file_replace_contents_at (dfd_iter.fd, cache->policy_csum,
+                                      (const guint8 *)g_variant_get_data (v),
+                                      g_variant_get_size (v), GLNX_FILE_REPLACE_NODATASYNC,
+                                      cancellable, error))
+    return FALSE;
+
+  cache->dirty = FALSE;
+  return TRUE;
+}
@@ -0,0 +1,56 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Licensed under the GNU Lesser General Public License Version 2.1
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#pragma once
+
+#include "libglnx.h"
+#include <gio/gio.h>
+#include <ostree.h>
+
+G_BEGIN_DECLS
+
+/* Where label caches live, relative to the repo */
+#define RPMOSTREE_LABEL_CACHE_DIR "extensions/rpmostree/label-cache"
+
+/* Remembers the SELinux label computed for each (path, file type) pair under
+ * a given policy, persisted in the repo and keyed by the policy checksum so
+ * that it's naturally invalidated by policy updates. Lookups are thread-safe.
+ */
+typedef struct _RpmOstreeLabelCache RpmOstreeLabelCache;
+
+RpmOstreeLabelCache *rpmostree_label_cache_new (OstreeSePolicy *sepolicy, int repo_dfd,
+                                                GCancellable *cancellable, GError **error);
+
+RpmOstreeLabelCache *rpmostree_label_cache_ref (RpmOstreeLabelCache *cache);
+
+void rpmostree_label_cache_unref (RpmOstreeLabelCache *cache);
+
+gboolean rpmostree_label_cache_get_label (RpmOstreeLabelCache *cache, const char *path,
+                                          guint32 mode, char **out_label,
+                                          GCancellable *cancellable, GError **error);
+
+void rpmostree_label_cache_add_xattr (RpmOstreeLabelCache *cache, GVariantBuilder *builder,
+                                      const char *path, guint32 mode, GError **error);
+
+gboolean rpmostree_label_cache_flush (RpmOstreeLabelCache *cache, GCancellable *cancellable,
+                                      GError **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (RpmOstreeLabelCache, rpmostree_label_cache_unref);
+
+G_END_DECLS
@@ -0,0 +1,240 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Licensed under the GNU Lesser General Public License Version 2.1
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "config.h"
+
+#include <map>
+#include <string>
+
+#include "libglnx.h"
+#include "rpmostree-metrics.h"
+#include "rpmostree-util.h"
+
+/* Upper bounds in seconds, as Prometheus histogram buckets; the last one is
+ * +Inf. Wide enough for both polkit checks and whole upgrades. */
+static const double histogram_bounds[]
+    = { 0.001, 0.01, 0.1, 0.5, 1, 5, 10, 30, 60, 300, 1800, G_MAXDOUBLE };
+#define N_BUCKETS G_N_ELEMENTS (histogram_bounds)
+
+typedef struct
+{
+  guint64 buckets[N_BUCKETS]; /* not cumulative */
+  guint64 count;
+  gint64 sum_usec;
+} Histogram;
+
+typedef struct
+{
+  Histogram duration;
+  guint64 n_failed;
+} TransactionMetrics;
+
+static const char *counter_names[] = { "bytes_downloaded", "packages_imported",
+                                       "packages_relabeled", "sysroot_reloads",
+                                       "sysroot_reloads_changed" };
+G_STATIC_ASSERT (G_N_ELEMENTS (counter_names) == RPMOSTREE_METRIC_N_COUNTERS);
+
+static const char *cache_names[]
+    = { "pkgcache_index", "label", "digest_index", "origin", "deployment_commit" };
+G_STATIC_ASSERT (G_N_ELEMENTS (cache_names) == RPMOSTREE_METRIC_N_CACHES);
+
+static const char *histogram_names[] = { "sack_load", "polkit_check" };
+G_STATIC_ASSERT (G_N_ELEMENTS (histogram_names) == RPMOSTREE_METRIC_N_HISTOGRAMS);
+
+static GMutex metrics_lock;
+static guint64 counters[RPMOSTREE_METRIC_N_COUNTERS];
+static guint64 cache_counts[RPMOSTREE_METRIC_N_CACHES][2]; /* hits, misses */
+static Histogram histograms[RPMOSTREE_METRIC_N_HISTOGRAMS];
+/* Keyed by D-Bus method name; ordered so the exported metrics are stable */
+static std::map<std::string, TransactionMetrics> transactions;
+
+static void
+histogram_observe (Histogram *histogram, gint64 duration_usec)
+{
+  const double secs = (double)duration_usec / G_USEC_PER_SEC;
+  guint i = 0;
+  while (i < N_BUCKETS - 1 && secs > histogram_bounds[i])
+    i++;
+  histogram->buckets[i]++;
+  histogram->count++;
+  histogram->sum_usec += duration_usec;
+}
+
+void
+rpmostree_metrics_count (RpmOstreeMetricCounter counter, guint64 n)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&metrics_lock);
+  counters[counter] += n;
+}
+
+void
+rpmostree_metrics_count_cache (RpmOstreeMetricCache cache, guint64 n_hits, guint64 n_misses)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&metrics_lock);
+  cache_counts[cache][0] += n_hits;
+  cache_counts[cache][1] += n_misses;
+}
+
+void
+rpmostree_metrics_observe (RpmOstreeMetricHistogram histogram, gint64 duration_usec)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&metrics_lock);
+  histogram_observe (&histograms[histogram], duration_usec);
+}
+
+void
+rpmostree_metrics_observe_transaction (const char *method, gint64 duration_usec,
+                                       gboolean success)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&metrics_lock);
+  auto &metrics = transactions[method];
+  histogram_observe (&metrics.duration, duration_usec);
+  if (!success)
+    metrics.n_failed++;
+}
+
+/* The cumulative count per bucket of "histogram-bounds", as at */
+static GVariant *
+histogram_buckets_to_variant (const Histogram *histogram)
+{
+  guint64 cumulative[N_BUCKETS];
+  guint64 total = 0;
+  for (guint i = 0; i < N_BUCKETS; i++)
+    cumulative[i] = total += histogram->buckets[i];
+  return g_variant_new_fixed_array (G_VARIANT_TYPE_UINT64, cumulative, N_BUCKETS,
+                                    sizeof (guint64));
+}
+
+/* The metrics as a{sv}: each counter as t, each cache as (tt) of hits and
+ * misses under "cache-<name>", each histogram as (tdat) of the count, the sum
+ * in seconds and the buckets, and "transactions" as a{s(tdatt)} of the
+ * duration histogram plus the number of failures, by method.
+ */
+GVariant *
+rpmostree_metrics_to_variant (void)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&metrics_lock);
+  g_auto (GVariantDict) dict;
+  g_variant_dict_init (&dict, NULL);
+
+  /* The last bound is +Inf, which isn't worth spelling out */
+  g_variant_dict_insert_value (&dict, "histogram-bounds",
+                               g_variant_new_fixed_array (G_VARIANT_TYPE_DOUBLE, histogram_bounds,
+                                                          N_BUCKETS - 1, sizeof (double)));
+  for (guint i = 0; i < RPMOSTREE_METRIC_N_COUNTERS; i++)
+    g_variant_dict_insert (&dict, counter_names[i], "t", counters[i]);
+  for (guint i = 0; i < RPMOSTREE_METRIC_N_CACHES; i++)
+    {
+      g_autofree char *key = g_strconcat ("cache-", cache_names[i], NULL);
+      g_variant_dict_insert (&dict, key, "(tt)", cache_counts[i][0], cache_counts[i][1]);
+    }
+  for (guint i = 0; i < RPMOSTREE_METRIC_N_HISTOGRAMS; i++)
+    g_variant_dict_insert (&dict, histogram_names[i], "(td@at)", histograms[i].count,
+                           (double)histograms[i].sum_usec / G_USEC_PER_SEC,
+                           histogram_buckets_to_variant (&histograms[i]));
+
+  GVariantBuilder builder;
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{s(tdatt)}"));
+  for (auto &[method, metrics] : transactions)
+    g_variant_builder_add (&builder, "{s(td@att)}", method.c_str (), metrics.duration.count,
+                           (double)metrics.duration.sum_usec / G_USEC_PER_SEC,
+                           histogram_buckets_to_variant (&metrics.duration), metrics.n_failed);
+  g_variant_dict_insert_value (&dict, "transactions", g_variant_builder_end (&builder));
+  return g_variant_dict_end (&dict);
+}
+
+static void
+append_histogram (GString *buf, const char *name, const char *labels, const Histogram *histogram)
+{
+  const char *sep = *labels ? "," : "";
+  guint64 total = 0;
+  for (guint i = 0; i < N_BUCKETS; i++)
+    {
+      total += histogram->buckets[i];
+      if (i == N_BUCKETS - 1)
+        g_string_append_printf (buf, "%s_bucket{%s%sle=\"+Inf\"} %" G_GUINT64_FORMAT "\n", name,
+                                labels, sep, total);
+      else
+        g_string_append_printf (buf, "%s_bucket{%s%sle=\"%g\"} %" G_GUINT64_FORMAT "\n", name,
+                                labels, sep, histogram_bounds[i], total);
+    }
+  const char *braces_open = *labels ? "{" : "";
+  const char *braces_close = *labels ? "}" : "";
+  g_string_append_printf (buf, "%s_sum%s%s%s %.6f\n", name, braces_open, labels, braces_close,
+                          (double)histogram->sum_usec / G_USEC_PER_SEC);
+  g_string_append_printf (buf, "%s_count%s%s%s %" G_GUINT64_FORMAT "\n", name, braces_open,
+                          labels, braces_close, histogram->count);
+}
+
+/* The metrics in the Prometheus text exposition format */
+char *
+rpmostree_metrics_to_prometheus (void)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&metrics_lock);
+  g_autoptr (GString) buf = g_string_new ("");
+
+  for (guint i = 0; i < RPMOSTREE_METRIC_N_COUNTERS; i++)
+    g_string_append_printf (buf,
+                            "# TYPE rpmostree_%s_total counter\n"
+                            "rpmostree_%s_total %" G_GUINT64_FORMAT "\n",
+                            counter_names[i], counter_names[i], counters[i]);
+
+  g_string_append (buf, "# TYPE rpmostree_cache_hits_total counter\n");
+  for (guint i = 0; i < RPMOSTREE_METRIC_N_CACHES; i++)
+    g_string_append_printf (buf, "rpmostree_cache_hits_total{cache=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                            cache_names[i], cache_counts[i][0]);
+  g_string_append (buf, "# TYPE rpmostree_cache_misses_total counter\n");
+  for (guint i = 0; i < RPMOSTREE_METRIC_N_CACHES; i++)
+    g_string_append_printf (buf,
+                            "rpmostree_cache_misses_total{cache=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                            cache_names[i], cache_counts[i][1]);
+
+  for (guint i = 0; i < RPMOSTREE_METRIC_N_HISTOGRAMS; i++)
+    {
+      g_autofree char *name = g_strdup_printf ("rpmostree_%s_seconds", histogram_names[i]);
+      g_string_append_printf (buf, "# TYPE %s histogram\n", name);
+      append_histogram (buf, name, "", &histograms[i]);
+    }
+
+  /* Method names are D-Bus member names, so they need no escaping */
+  g_string_append (buf, "# TYPE rpmostree_transaction_duration_seconds histogram\n");
+  for (auto &[method, metrics] : transactions)
+    {
+      g_autofree char *labels = g_strdup_printf ("method=\"%s\"", method.c_str ());
+      append_histogram (buf, "rpmostree_transaction_duration_seconds", labels, &metrics.duration);
+    }
+  g_string_append (buf, "# TYPE rpmostree_transaction_failures_total counter\n");
+  for (auto &[method, metrics] : transactions)
+    g_string_append_printf (buf,
+                            "rpmostree_transaction_failures_total{method=\"%s\"} %" G_GUINT64_FORMAT
+                            "\n",
+                            method.c_str (), metrics.n_failed);
+
+  return g_string_free (util::move_nullify (buf), FALSE);
+}
+
+/* Atomically replace @path, e.g. for node_exporter's textfile collector */
+gboolean
+rpmostree_metrics_write_textfile (const char *path, GError **error)
+{
+  g_autofree char *text = rpmostree_metrics_to_prometheus ();
+  return glnx_file_replace_contents_with_perms_at (AT_FDCWD, path, (const guint8 *)text, -1, 0644,
+                                                   (uid_t)-1, (gid_t)-1,
+                                                   GLNX_FILE_REPLACE_NODATASYNC, NULL, error);
+}
@@ -0,0 +1,73 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Licensed under the GNU Lesser General Public License Version 2.1
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Cumulative performance counters for the life of the process; the daemon
+ * exports them via the Sysroot GetMetrics() method, and optionally as a
+ * Prometheus textfile, see MetricsTextfile= in rpm-ostreed.conf. They're
+ * cheap enough to be updated unconditionally, from any thread.
+ */
+typedef enum
+{
+  RPMOSTREE_METRIC_BYTES_DOWNLOADED,
+  RPMOSTREE_METRIC_PACKAGES_IMPORTED,
+  RPMOSTREE_METRIC_PACKAGES_RELABELED,
+  RPMOSTREE_METRIC_SYSROOT_RELOADS,         /* every sysroot_populate_deployments_unlocked() */
+  RPMOSTREE_METRIC_SYSROOT_RELOADS_CHANGED, /* those which actually reloaded deployments */
+  RPMOSTREE_METRIC_N_COUNTERS
+} RpmOstreeMetricCounter;
+
+typedef enum
+{
+  RPMOSTREE_METRIC_CACHE_PKGCACHE_INDEX,
+  RPMOSTREE_METRIC_CACHE_LABEL,
+  RPMOSTREE_METRIC_CACHE_DIGEST_INDEX,
+  RPMOSTREE_METRIC_CACHE_ORIGIN,
+  RPMOSTREE_METRIC_CACHE_DEPLOYMENT_COMMIT,
+  RPMOSTREE_METRIC_N_CACHES
+} RpmOstreeMetricCache;
+
+typedef enum
+{
+  RPMOSTREE_METRIC_SACK_LOAD,
+  RPMOSTREE_METRIC_POLKIT_CHECK,
+  RPMOSTREE_METRIC_N_HISTOGRAMS
+} RpmOstreeMetricHistogram;
+
+void rpmostree_metrics_count (RpmOstreeMetricCounter counter, guint64 n);
+
+void rpmostree_metrics_count_cache (RpmOstreeMetricCache cache, guint64 n_hits, guint64 n_misses);
+
+void rpmostree_metrics_observe (RpmOstreeMetricHistogram histogram, gint64 duration_usec);
+
+void rpmostree_metrics_observe_transaction (const char *method, gint64 duration_usec,
+                                            gboolean success);
+
+GVariant *rpmostree_metrics_to_variant (void);
+
+char *rpmostree_metrics_to_prometheus (void);
+
+gboolean rpmostree_metrics_write_textfile (const char *path, GError **error);
+
+G_END_DECLS
@@ -21,22 +21,66 @@
 #include "config.h"
 
 #include "string.h"
+#include <memory>
+#include <string>
 #include <systemd/sd-journal.h>
+#include <unordered_map>
 
 #include "libglnx.h"
 #include "rpmostree-core.h"
+#include "rpmostree-metrics.h"
 #include "rpmostree-origin.h"
 #include "rpmostree-rpm-util.h"
 #include "rpmostree-util.h"
 
+typedef std::shared_ptr<rust::Box<rpmostreecxx::Treefile> > SharedTreefile;
+
 struct RpmOstreeOrigin
 {
   guint refcount;
 
-  /* this is the single source of truth */
-  std::optional<rust::Box<rpmostreecxx::Treefile> > treefile;
+  /* this is the single source of truth; it may be shared with other origins
+   * (see mutable_treefile()) */
+  SharedTreefile treefile;
+};
+
+/* Deployment origins are parsed over and over (for status, for the pkgcache
+ * refs, by the upgrader...), so we keep the parsed treefiles around, keyed by
+ * the deployment, along with a checksum of the keyfile they came from. */
+struct CachedOrigin
+{
+  std::string keyfile_checksum;
+  SharedTreefile treefile;
 };
 
+#define ORIGIN_CACHE_MAX_ENTRIES 32
+
+static GMutex origin_cache_lock;
+static std::unordered_map<std::string, CachedOrigin> origin_cache;
+
+static RpmOstreeOrigin *
+origin_new (SharedTreefile treefile)
+{
+  auto ret = new RpmOstreeOrigin ();
+  ret->refcount = 1;
+  ret->treefile = std::move (treefile);
+  return ret;
+}
+
+/* Treefiles are shared between origins copy-on-write: this gives @origin its
+ * own copy before it gets changed, if needed. */
+static rpmostreecxx::Treefile &
+mutable_treefile (RpmOstreeOrigin *origin)
+{
+  if (origin->treefile.use_count () > 1)
+    {
+      g_autoptr (GKeyFile) kf = rpmostreecxx::treefile_to_origin (**origin->treefile);
+      origin->treefile = std::make_shared<rust::Box<rpmostreecxx::Treefile> > (
+          rpmostreecxx::origin_to_treefile (*kf));
+    }
+  return **origin->treefile;
+}
+
 RpmOstreeOrigin *
 rpmostree_origin_ref (RpmOstreeOrigin *origin)
 {
@@ -53,8 +97,7 @@ rpmostree_origin_unref (RpmOstreeOrigin *origin)
   origin->refcount--;
   if (origin->refcount > 0)
     return;
-  origin->treefile.reset ();
-  g_free (origin);
+  delete origin;
 }
 
 RpmOstreeOrigin *
@@ -68,28 +111,49 @@ rpmostree_origin_parse_deployment (OstreeDeployment *deployment, GError **error)
                    ostree_deployment_get_deployserial (deployment));
       return NULL;
     }
-  return rpmostree_origin_parse_keyfile (origin, error);
+
+  g_autofree char *key = g_strdup_printf ("%s.%d", ostree_deployment_get_csum (deployment),
+                                          ostree_deployment_get_deployserial (deployment));
+  gsize len;
+  g_autofree char *data = g_key_file_to_data (origin, &len, NULL);
+  g_autofree char *checksum = g_compute_checksum_for_data (G_CHECKSUM_SHA256, (guint8 *)data, len);
+  {
+    g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&origin_cache_lock);
+    auto it = origin_cache.find (key);
+    if (it != origin_cache.end () && it->second.keyfile_checksum == checksum)
+      {
+        rpmostree_metrics_count_cache (RPMOSTREE_METRIC_CACHE_ORIGIN, 1, 0);
+        return origin_new (it->second.treefile);
+      }
+  }
+  rpmostree_metrics_count_cache (RPMOSTREE_METRIC_CACHE_ORIGIN, 0, 1);
+
+  g_autoptr (RpmOstreeOrigin) ret = rpmostree_origin_parse_keyfile (origin, error);
+  if (!ret)
+    return NULL;
+
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&origin_cache_lock);
+  /* Deployments come and go; don't bother with anything smarter than this */
+  if (origin_cache.size () >= ORIGIN_CACHE_MAX_ENTRIES && origin_cache.count (key) == 0)
+    origin_cache.clear ();
+  origin_cache[key] = CachedOrigin{ checksum, ret->treefile };
+  return util::move_nullify (ret);
 }
 
 RpmOstreeOrigin *
 rpmostree_origin_parse_keyfile (GKeyFile *origin, GError **error)
 {
-  g_autoptr (RpmOstreeOrigin) ret = NULL;
-  ret = g_new0 (RpmOstreeOrigin, 1);
-  ret->refcount = 1;
-  ret->treefile = ROSCXX_VAL (origin_to_treefile (*origin), error);
-  return util::move_nullify (ret);
+  auto treefile = ROSCXX_VAL (origin_to_treefile (*origin), error);
+  if (!treefile)
+    return NULL;
+  return origin_new (std::make_shared<rust::Box<rpmostreecxx::Treefile> > (std::move (*treefile)));
 }
 
-/* Mutability: getter */
+/* Mutability: getter; the copy shares the treefile until either is changed */
 RpmOstreeOrigin *
 rpmostree_origin_dup (RpmOstreeOrigin *origin)
 {
-  g_autoptr (GKeyFile) kf = rpmostreecxx::treefile_to_origin (**origin->treefile);
-  g_autoptr (GError) local_error = NULL;
-  RpmOstreeOrigin *ret = rpmostree_origin_parse_keyfile (kf, &local_error);
-  g_assert_no_error (local_error);
-  return ret;
+  return origin_new (origin->treefile);
 }
 
 /* Mutability: getter */
@@ -240,7 +304,7 @@ rpmostree_origin_dup_keyfile (RpmOstreeOrigin *origin)
 bool
 rpmostree_origin_initramfs_etc_files_track (RpmOstreeOrigin *origin, rust::Vec<rust::String> paths)
 {
-  return (*origin->treefile)->initramfs_etc_files_track (paths);
+  return mutable_treefile (origin).initramfs_etc_files_track (paths);
 }
 
 /* Mutability: setter */
@@ -248,14 +312,14 @@ bool
 rpmostree_origin_initramfs_etc_files_untrack (RpmOstreeOrigin *origin,
                                               rust::Vec<rust::String> paths)
 {
-  return (*origin->treefile)->initramfs_etc_files_untrack (paths);
+  return mutable_treefile (origin).initramfs_etc_files_untrack (paths);
 }
 
 /* Mutability: setter */
 bool
 rpmostree_origin_initramfs_etc_files_untrack_all (RpmOstreeOrigin *origin)
 {
-  return (*origin->treefile)->initramfs_etc_files_untrack_all ();
+  return mutable_treefile (origin).initramfs_etc_files_untrack_all ();
 }
 
 /* Mutability: setter */
@@ -263,14 +327,14 @@ void
 rpmostree_origin_set_regenerate_initramfs (RpmOstreeOrigin *origin, gboolean regenerate,
                                            rust::Vec<rust::String> args)
 {
-  (*origin->treefile)->set_initramfs_regenerate (regenerate, args);
+  mutable_treefile (origin).set_initramfs_regenerate (regenerate, args);
 }
 
 /* Mutability: setter */
 void
 rpmostree_origin_set_override_commit (RpmOstreeOrigin *origin, const char *checksum)
 {
-  (*origin->treefile)->set_override_commit (checksum ?: "");
+  mutable_treefile (origin).set_override_commit (checksum ?: "");
 }
 
 /* Mutability: getter */
@@ -284,7 +348,7 @@ rpmostree_origin_get_cliwrap (RpmOstreeOrigin *origin)
 void
 rpmostree_origin_set_cliwrap (RpmOstreeOrigin *origin, bool cliwrap)
 {
-  (*origin->treefile)->set_cliwrap (cliwrap);
+  mutable_treefile (origin).set_cliwrap (cliwrap);
 }
 
 /* Mutability: setter */
@@ -293,8 +357,8 @@ rpmostree_origin_set_rebase_custom (RpmOstreeOrigin *origin, const char *new_ref
                                     const char *custom_origin_url,
                                     const char *custom_origin_description)
 {
-  (*origin->treefile)
-      ->rebase (new_refspec, custom_origin_url ?: "", custom_origin_description ?: "");
+  mutable_treefile (origin).rebase (new_refspec, custom_origin_url ?: "",
+                                    custom_origin_description ?: "");
 }
 
 /* Mutability: setter */
@@ -317,7 +381,8 @@ gboolean
 rpmostree_origin_add_packages (RpmOstreeOrigin *origin, rust::Vec<rust::String> packages,
                                gboolean allow_existing, gboolean *out_changed, GError **error)
 {
-  CXX_TRY_VAR (changed, (*origin->treefile)->add_packages (packages, allow_existing), error);
+  CXX_TRY_VAR (changed, mutable_treefile (origin).add_packages (packages, allow_existing),
+               error);
   set_changed (out_changed, changed);
   return TRUE;
 }
@@ -327,7 +392,8 @@ gboolean
 rpmostree_origin_add_local_packages (RpmOstreeOrigin *origin, rust::Vec<rust::String> packages,
                                      gboolean allow_existing, gboolean *out_changed, GError **error)
 {
-  CXX_TRY_VAR (changed, (*origin->treefile)->add_local_packages (packages, allow_existing), error);
+  CXX_TRY_VAR (changed,
+               mutable_treefile (origin).add_local_packages (packages, allow_existing), error);
   set_changed (out_changed, changed);
   return TRUE;
 }
@@ -340,7 +406,8 @@ rpmostree_origin_add_local_fileoverride_packages (RpmOstreeOrigin *origin,
                                                   GError **error)
 {
   CXX_TRY_VAR (changed,
-               (*origin->treefile)->add_local_fileoverride_packages (packages, allow_existing),
+               mutable_treefile (origin).add_local_fileoverride_packages (packages,
+                                                                           allow_existing),
                error);
   set_changed (out_changed, changed);
   return TRUE;
@@ -351,7 +418,7 @@ gboolean
 rpmostree_origin_remove_packages (RpmOstreeOrigin *origin, rust::Vec<rust::String> packages,
                                   gboolean allow_noent, gboolean *out_changed, GError **error)
 {
-  CXX_TRY_VAR (changed, (*origin->treefile)->remove_packages (packages, allow_noent), error);
+  CXX_TRY_VAR (changed, mutable_treefile (origin).remove_packages (packages, allow_noent), error);
   set_changed (out_changed, changed);
   return TRUE;
 }
@@ -361,7 +428,7 @@ gboolean
 rpmostree_origin_add_modules (RpmOstreeOrigin *origin, rust::Vec<rust::String> modules,
                               gboolean enable_only)
 {
-  auto changed = (*origin->treefile)->add_modules (modules, enable_only);
+  auto changed = mutable_treefile (origin).add_modules (modules, enable_only);
   return changed;
 }
 
@@ -370,7 +437,7 @@ gboolean
 rpmostree_origin_remove_modules (RpmOstreeOrigin *origin, rust::Vec<rust::String> modules,
                                  gboolean enable_only)
 {
-  auto changed = (*origin->treefile)->remove_modules (modules, enable_only);
+  auto changed = mutable_treefile (origin).remove_modules (modules, enable_only);
   return changed;
 }
 
@@ -378,7 +445,7 @@ rpmostree_origin_remove_modules (RpmOstreeOrigin *origin, rust::Vec<rust::String
 gboolean
 rpmostree_origin_remove_all_packages (RpmOstreeOrigin *origin)
 {
-  auto changed = (*origin->treefile)->remove_all_packages ();
+  auto changed = mutable_treefile (origin).remove_all_packages ();
   return changed;
 }
 
@@ -387,7 +454,7 @@ gboolean
 rpmostree_origin_add_override_remove (RpmOstreeOrigin *origin, rust::Vec<rust::String> packages,
                                       GError **error)
 {
-  CXX_TRY ((*origin->treefile)->add_packages_override_remove (packages), error);
+  CXX_TRY (mutable_treefile (origin).add_packages_override_remove (packages), error);
   return TRUE;
 }
 
@@ -396,7 +463,7 @@ gboolean
 rpmostree_origin_add_override_replace_local (RpmOstreeOrigin *origin,
                                              rust::Vec<rust::String> packages, GError **error)
 {
-  CXX_TRY ((*origin->treefile)->add_packages_override_replace_local (packages), error);
+  CXX_TRY (mutable_treefile (origin).add_packages_override_replace_local (packages), error);
   return TRUE;
 }
 
@@ -405,21 +472,21 @@ rpmostree_origin_add_override_replace_local (RpmOstreeOrigin *origin,
 gboolean
 rpmostree_origin_remove_override_remove (RpmOstreeOrigin *origin, const char *package)
 {
-  auto changed = (*origin->treefile)->remove_package_override_remove (package);
+  auto changed = mutable_treefile (origin).remove_package_override_remove (package);
   return changed;
 }
 
 gboolean
 rpmostree_origin_remove_override_replace_local (RpmOstreeOrigin *origin, const char *package)
 {
-  auto changed = (*origin->treefile)->remove_package_override_replace_local (package);
+  auto changed = mutable_treefile (origin).remove_package_override_replace_local (package);
   return changed;
 }
 
 gboolean
 rpmostree_origin_remove_override_replace (RpmOstreeOrigin *origin, const char *package)
 {
-  auto changed = (*origin->treefile)->remove_package_override_replace (package);
+  auto changed = mutable_treefile (origin).remove_package_override_replace (package);
   return changed;
 }
 
@@ -427,7 +494,7 @@ rpmostree_origin_remove_override_replace (RpmOstreeOrigin *origin, const char *p
 gboolean
 rpmostree_origin_remove_all_overrides (RpmOstreeOrigin *origin)
 {
-  auto changed = (*origin->treefile)->remove_all_overrides ();
+  auto changed = mutable_treefile (origin).remove_all_overrides ();
   return changed;
 }
 
@@ -436,7 +503,7 @@ gboolean
 rpmostree_origin_merge_treefile (RpmOstreeOrigin *origin, const char *treefile,
                                  gboolean *out_changed, GError **error)
 {
-  CXX_TRY_VAR (changed, (*origin->treefile)->merge_treefile (treefile), error);
+  CXX_TRY_VAR (changed, mutable_treefile (origin).merge_treefile (treefile), error);
   set_changed (out_changed, changed);
   return TRUE;
 }
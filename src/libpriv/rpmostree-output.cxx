@@ -21,6 +21,7 @@
 #include <libglnx.h>
 #include <memory>
 #include <ostree.h>
+#include <string.h>
 
 #include "rpmostree-cxxrs.h"
 #include "rpmostree-output.h"
@@ -37,7 +38,10 @@ rpmostree_output_default_handler (RpmOstreeOutputType type, void *data, void *op
   switch (type)
     {
     case RPMOSTREE_OUTPUT_MESSAGE:
-      g_print ("%s\n", ((RpmOstreeOutputMessage *)data)->text);
+      {
+        auto msg = static_cast<RpmOstreeOutputMessage *> (data);
+        g_print ("%.*s\n", (int)msg->len, msg->text);
+      }
       break;
     case RPMOSTREE_OUTPUT_PROGRESS_BEGIN:
       {
@@ -58,14 +62,14 @@ rpmostree_output_default_handler (RpmOstreeOutputType type, void *data, void *op
       break;
     case RPMOSTREE_OUTPUT_PROGRESS_SUB_MESSAGE:
       {
-        auto msg = static_cast<const char *> (data);
-        rpmostreecxx::console_progress_set_sub_message (util::ruststr_or_empty (msg));
+        auto msg = static_cast<RpmOstreeOutputProgressSubMessage *> (data);
+        rpmostreecxx::console_progress_set_sub_message (rust::Str (msg->text, msg->len));
       }
       break;
     case RPMOSTREE_OUTPUT_PROGRESS_END:
       {
         auto end = static_cast<RpmOstreeOutputProgressEnd *> (data);
-        rpmostreecxx::console_progress_end (util::ruststr_or_empty (end->msg));
+        rpmostreecxx::console_progress_end (rust::Str (end->msg, end->len));
         break;
       }
     }
@@ -110,8 +114,12 @@ rpmostree_output_set_callback (OutputCallback cb, void *opaque)
 void
 rpmostree_output_message (const char *format, ...)
 {
-  g_autofree char *final_msg = strdup_vprintf (format);
-  RpmOstreeOutputMessage task = { final_msg };
+  /* Plenty of callers pass a plain string; don't copy those */
+  g_autofree char *final_msg = NULL;
+  const char *msg = format;
+  if (strchr (format, '%'))
+    msg = final_msg = strdup_vprintf (format);
+  RpmOstreeOutputMessage task = { msg, strlen (msg) };
   invoke_output (RPMOSTREE_OUTPUT_MESSAGE, &task);
 }
 
@@ -131,8 +139,7 @@ _output_alloc_serial (void)
 void
 output_message (const rust::Str msg)
 {
-  auto msg_c = std::string (msg);
-  RpmOstreeOutputMessage task = { msg_c.c_str () };
+  RpmOstreeOutputMessage task = { msg.data (), msg.length () };
   invoke_output (RPMOSTREE_OUTPUT_MESSAGE, &task);
 }
 
@@ -154,8 +161,8 @@ progress_begin_task (const rust::Str msg) noexcept
 void
 Progress::set_sub_message (const rust::Str msg)
 {
-  g_autofree char *msg_c = util::ruststr_dup_c_optempty (msg);
-  invoke_output (RPMOSTREE_OUTPUT_PROGRESS_SUB_MESSAGE, (void *)msg_c);
+  RpmOstreeOutputProgressSubMessage sub = { msg.data (), msg.length () };
+  invoke_output (RPMOSTREE_OUTPUT_PROGRESS_SUB_MESSAGE, &sub);
 }
 
 // Start working on a 0-n task.
@@ -205,8 +212,7 @@ void
 Progress::end (const rust::Str msg)
 {
   g_assert (!this->ended);
-  g_autofree char *final_msg = util::ruststr_dup_c_optempty (msg);
-  RpmOstreeOutputProgressEnd done = { final_msg };
+  RpmOstreeOutputProgressEnd done = { msg.data (), msg.length () };
   g_debug ("progress end serial=%" G_GUINT64_FORMAT, this->serial);
   invoke_output (RPMOSTREE_OUTPUT_PROGRESS_END, &done);
   this->ended = true;
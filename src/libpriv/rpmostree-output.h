@@ -84,9 +84,14 @@ void rpmostree_output_default_handler (RpmOstreeOutputType type, void *data, voi
 typedef void (*OutputCallback) (RpmOstreeOutputType, void *, void *);
 void rpmostree_output_set_callback (OutputCallback cb, void *);
 
+/* The strings in the output events are borrowed from the caller for the
+ * duration of the callback, and are not necessarily NUL-terminated; each one
+ * comes with its length. That way emitting e.g. a package name from Rust
+ * doesn't need to copy it. */
 typedef struct
 {
   const char *text;
+  gsize len;
 } RpmOstreeOutputMessage;
 
 void rpmostree_output_message (const char *format, ...) G_GNUC_PRINTF (1, 2);
@@ -111,10 +116,18 @@ typedef struct
   guint c;
 } RpmOstreeOutputProgressUpdate;
 
-/* End progress */
+/* Describe the item currently being worked on; may be empty */
+typedef struct
+{
+  const char *text;
+  gsize len;
+} RpmOstreeOutputProgressSubMessage;
+
+/* End progress; the message may be empty */
 typedef struct
 {
   const char *msg;
+  gsize len;
 } RpmOstreeOutputProgressEnd;
 
 G_END_DECLS
\ No newline at end of file
@@ -0,0 +1,222 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Licensed under the GNU Lesser General Public License Version 2.1
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "rpmostree-package-pack.h"
+#include "rpmostree-util.h"
+
+G_STATIC_ASSERT (sizeof (RpmOstreePackagePackHeader) == 24);
+G_STATIC_ASSERT (sizeof (RpmOstreePackageQueryRecord) == 16);
+G_STATIC_ASSERT (sizeof (RpmOstreePackageRecord) == 40);
+
+struct _RpmOstreePackagePackBuilder
+{
+  std::vector<RpmOstreePackageQueryRecord> queries;
+  std::vector<RpmOstreePackageRecord> packages;
+  std::string strtab;
+  std::unordered_map<std::string, guint32> strings;
+};
+
+RpmOstreePackagePackBuilder *
+rpmostree_package_pack_builder_new (void)
+{
+  auto builder = new RpmOstreePackagePackBuilder ();
+  builder->strtab.push_back ('\0');
+  builder->strings[""] = 0;
+  return builder;
+}
+
+void
+rpmostree_package_pack_builder_free (RpmOstreePackagePackBuilder *builder)
+{
+  delete builder;
+}
+
+/* Returns the offset of @str in the string table, adding it if needed */
+static guint32
+intern_string (RpmOstreePackagePackBuilder *builder, const char *str)
+{
+  if (!str)
+    return 0;
+  auto it = builder->strings.find (str);
+  if (it != builder->strings.end ())
+    return it->second;
+  const guint32 offset = builder->strtab.size ();
+  builder->strtab.append (str);
+  builder->strtab.push_back ('\0');
+  builder->strings.emplace (str, offset);
+  return offset;
+}
+
+/* Start the results for query @key; packages added after this belong to it */
+void
+rpmostree_package_pack_builder_add_query (RpmOstreePackagePackBuilder *builder, const char *key)
+{
+  RpmOstreePackageQueryRecord query = {};
+  query.key = intern_string (builder, key);
+  query.first_package = builder->packages.size ();
+  builder->queries.push_back (query);
+}
+
+void
+rpmostree_package_pack_builder_add_package (RpmOstreePackagePackBuilder *builder,
+                                            DnfPackage *pkg)
+{
+  g_assert (!builder->queries.empty ());
+  RpmOstreePackageRecord rec = {};
+  rec.epoch = dnf_package_get_epoch (pkg);
+  rec.name = intern_string (builder, dnf_package_get_name (pkg));
+  rec.version = intern_string (builder, dnf_package_get_version (pkg));
+  rec.arch = intern_string (builder, dnf_package_get_arch (pkg));
+  rec.nevra = intern_string (builder, dnf_package_get_nevra (pkg));
+  rec.evr = intern_string (builder, dnf_package_get_evr (pkg));
+  rec.summary = intern_string (builder, dnf_package_get_summary (pkg));
+  rec.reponame = intern_string (builder, dnf_package_get_reponame (pkg));
+  builder->packages.push_back (rec);
+  builder->queries.back ().n_packages++;
+}
+
+GBytes *
+rpmostree_package_pack_builder_end (RpmOstreePackagePackBuilder *builder)
+{
+  RpmOstreePackagePackHeader header = {};
+  memcpy (header.magic, RPMOSTREE_PACKAGE_PACK_MAGIC, sizeof (header.magic));
+  header.version = GUINT32_TO_LE (RPMOSTREE_PACKAGE_PACK_VERSION);
+  header.n_queries = GUINT32_TO_LE (builder->queries.size ());
+  header.n_packages = GUINT32_TO_LE (builder->packages.size ());
+  header.strtab_size = GUINT32_TO_LE (builder->strtab.size ());
+
+  for (auto &query : builder->queries)
+    {
+      query.key = GUINT32_TO_LE (query.key);
+      query.first_package = GUINT32_TO_LE (query.first_package);
+      query.n_packages = GUINT32_TO_LE (query.n_packages);
+    }
+  for (auto &rec : builder->packages)
+    {
+      rec.epoch = GUINT64_TO_LE (rec.epoch);
+      rec.name = GUINT32_TO_LE (rec.name);
+      rec.version = GUINT32_TO_LE (rec.version);
+      rec.arch = GUINT32_TO_LE (rec.arch);
+      rec.nevra = GUINT32_TO_LE (rec.nevra);
+      rec.evr = GUINT32_TO_LE (rec.evr);
+      rec.summary = GUINT32_TO_LE (rec.summary);
+      rec.reponame = GUINT32_TO_LE (rec.reponame);
+    }
+
+  const gsize queries_size = builder->queries.size () * sizeof (RpmOstreePackageQueryRecord);
+  const gsize packages_size = builder->packages.size () * sizeof (RpmOstreePackageRecord);
+  const gsize size = sizeof (header) + queries_size + packages_size + builder->strtab.size ();
+  auto buf = static_cast<guint8 *> (g_malloc (size));
+  guint8 *p = buf;
+  memcpy (p, &header, sizeof (header));
+  p += sizeof (header);
+  memcpy (p, builder->queries.data (), queries_size);
+  p += queries_size;
+  memcpy (p, builder->packages.data (), packages_size);
+  p += packages_size;
+  memcpy (p, builder->strtab.data (), builder->strtab.size ());
+  return g_bytes_new_take (buf, size);
+}
+
+/* Check that @data is well-formed, so that every offset in it can be used
+ * as is; the records are then accessed directly in @data. Note their fields
+ * are little-endian. */
+gboolean
+rpmostree_package_pack_init (RpmOstreePackagePack *pack, GBytes *data, GError **error)
+{
+  gsize size;
+  auto buf = static_cast<const guint8 *> (g_bytes_get_data (data, &size));
+  if (size < sizeof (RpmOstreePackagePackHeader))
+    return glnx_throw (error, "Packed package data too short");
+  auto header = reinterpret_cast<const RpmOstreePackagePackHeader *> (buf);
+  if (memcmp (header->magic, RPMOSTREE_PACKAGE_PACK_MAGIC, sizeof (header->magic)) != 0)
+    return glnx_throw (error, "Invalid packed package data");
+  const guint32 version = GUINT32_FROM_LE (header->version);
+  if (version != RPMOSTREE_PACKAGE_PACK_VERSION)
+    return glnx_throw (error, "Unsupported packed package data version %u", version);
+
+  const guint32 n_queries = GUINT32_FROM_LE (header->n_queries);
+  const guint32 n_packages = GUINT32_FROM_LE (header->n_packages);
+  const guint32 strtab_size = GUINT32_FROM_LE (header->strtab_size);
+  const guint64 expected_size = sizeof (RpmOstreePackagePackHeader)
+                                + (guint64)n_queries * sizeof (RpmOstreePackageQueryRecord)
+                                + (guint64)n_packages * sizeof (RpmOstreePackageRecord)
+                                + strtab_size;
+  if (expected_size != size)
+    return glnx_throw (error, "Packed package data has size %" G_GSIZE_FORMAT
+                              ", expected %" G_GUINT64_FORMAT, size, expected_size);
+
+  auto queries = reinterpret_cast<const RpmOstreePackageQueryRecord *> (header + 1);
+  auto packages = reinterpret_cast<const RpmOstreePackageRecord *> (queries + n_queries);
+  auto strtab = reinterpret_cast<const char *> (packages + n_packages);
+  /* With that, any offset inside the table is a NUL-terminated string */
+  if (strtab_size == 0 || strtab[strtab_size - 1] != '\0')
+    return glnx_throw (error, "Invalid packed package string table");
+
+  for (guint32 i = 0; i < n_queries; i++)
+    {
+      const guint64 end = (guint64)GUINT32_FROM_LE (queries[i].first_package)
+                          + GUINT32_FROM_LE (queries[i].n_packages);
+      if (GUINT32_FROM_LE (queries[i].key) >= strtab_size || end > n_packages)
+        return glnx_throw (error, "Invalid packed query %u", i);
+    }
+  for (guint32 i = 0; i < n_packages; i++)
+    {
+      const RpmOstreePackageRecord *rec = &packages[i];
+      const guint32 fields[] = { rec->name, rec->version, rec->arch,    rec->nevra,
+                                 rec->evr,  rec->summary, rec->reponame };
+      for (guint j = 0; j < G_N_ELEMENTS (fields); j++)
+        {
+          if (GUINT32_FROM_LE (fields[j]) >= strtab_size)
+            return glnx_throw (error, "Invalid packed package %u", i);
+        }
+    }
+
+  pack->data = g_bytes_ref (data);
+  pack->n_queries = n_queries;
+  pack->n_packages = n_packages;
+  pack->queries = queries;
+  pack->packages = packages;
+  pack->strtab = strtab;
+  pack->strtab_size = strtab_size;
+  return TRUE;
+}
+
+void
+rpmostree_package_pack_clear (RpmOstreePackagePack *pack)
+{
+  g_clear_pointer (&pack->data, g_bytes_unref);
+}
+
+/* @offset is a string field of a record, as stored */
+const char *
+rpmostree_package_pack_get_string (RpmOstreePackagePack *pack, guint32 offset)
+{
+  offset = GUINT32_FROM_LE (offset);
+  g_assert_cmpuint (offset, <, pack->strtab_size);
+  return pack->strtab + offset;
+}
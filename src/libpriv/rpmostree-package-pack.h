@@ -0,0 +1,110 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Licensed under the GNU Lesser General Public License Version 2.1
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#pragma once
+
+#include "libglnx.h"
+#include <gio/gio.h>
+#include <libdnf/libdnf.h>
+
+G_BEGIN_DECLS
+
+/* A packed alternative to a{saa{sv}} for the results of the batch package
+ * queries, which can be read in place without demarshalling. All integers
+ * are little-endian, and the layout is:
+ *
+ *   RpmOstreePackagePackHeader
+ *   RpmOstreePackageQueryRecord[n_queries]
+ *   RpmOstreePackageRecord[n_packages]
+ *   string table
+ *
+ * Strings are referenced by their byte offset in the string table, where
+ * they're stored NUL-terminated and deduplicated; offset 0 is always "".
+ * Each query owns a contiguous range of the package records.
+ */
+#define RPMOSTREE_PACKAGE_PACK_MAGIC "RPMOPKG\0"
+#define RPMOSTREE_PACKAGE_PACK_VERSION 1
+
+typedef struct
+{
+  char magic[8];
+  guint32 version;
+  guint32 n_queries;
+  guint32 n_packages;
+  guint32 strtab_size;
+} RpmOstreePackagePackHeader;
+
+typedef struct
+{
+  guint32 key;
+  guint32 first_package;
+  guint32 n_packages;
+  guint32 reserved;
+} RpmOstreePackageQueryRecord;
+
+typedef struct
+{
+  guint64 epoch;
+  guint32 name;
+  guint32 version;
+  guint32 arch;
+  guint32 nevra;
+  guint32 evr;
+  guint32 summary;
+  guint32 reponame;
+  guint32 reserved;
+} RpmOstreePackageRecord;
+
+typedef struct _RpmOstreePackagePackBuilder RpmOstreePackagePackBuilder;
+
+RpmOstreePackagePackBuilder *rpmostree_package_pack_builder_new (void);
+
+void rpmostree_package_pack_builder_free (RpmOstreePackagePackBuilder *builder);
+
+void rpmostree_package_pack_builder_add_query (RpmOstreePackagePackBuilder *builder,
+                                               const char *key);
+
+void rpmostree_package_pack_builder_add_package (RpmOstreePackagePackBuilder *builder,
+                                                 DnfPackage *pkg);
+
+GBytes *rpmostree_package_pack_builder_end (RpmOstreePackagePackBuilder *builder);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (RpmOstreePackagePackBuilder, rpmostree_package_pack_builder_free);
+
+/* A validated view into packed data; the records point into @data */
+typedef struct
+{
+  GBytes *data;
+  guint32 n_queries;
+  guint32 n_packages;
+  const RpmOstreePackageQueryRecord *queries;
+  const RpmOstreePackageRecord *packages;
+  const char *strtab;
+  guint32 strtab_size;
+} RpmOstreePackagePack;
+
+gboolean rpmostree_package_pack_init (RpmOstreePackagePack *pack, GBytes *data, GError **error);
+
+void rpmostree_package_pack_clear (RpmOstreePackagePack *pack);
+
+const char *rpmostree_package_pack_get_string (RpmOstreePackagePack *pack, guint32 offset);
+
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (RpmOstreePackagePack, rpmostree_package_pack_clear);
+
+G_END_DECLS
@@ -0,0 +1,441 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Licensed under the GNU Lesser General Public License Version 2.1
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "rpmostree-metrics.h"
+#include "rpmostree-pkgcache-index.h"
+#include "rpmostree-util.h"
+
+/* Serialized as the commit state stamp (see get_state_stamp()), then an array
+ * of (cache branch, commit, repodata chksum repr, sepolicy csum, nodocs)
+ * sorted by cache branch, so it can be searched in place. */
+#define PKGCACHE_INDEX_GVARIANT_FORMAT "(ta(saymsmsb))"
+#define PKGCACHE_INDEX_ENTRY_FORMAT "(saymsmsb)"
+
+struct _RpmOstreePkgcacheIndex
+{
+  gint refcount; /* atomic */
+  OstreeRepo *repo;
+  GHashTable *refs; /* cache branch -> commit */
+  guint64 state_stamp;
+  GMappedFile *mfile;
+  GVariant *entries; /* Mapped from mfile; NULL if none or stale */
+
+  GMutex lock;
+  GHashTable *added; /* cache branch -> RpmOstreePkgcacheEntry */
+  guint n_hits;
+  guint n_misses;
+};
+
+void
+rpmostree_pkgcache_entry_free (RpmOstreePkgcacheEntry *entry)
+{
+  g_free (entry->commit);
+  g_free (entry->repodata_chksum_repr);
+  g_free (entry->sepolicy_csum);
+  g_free (entry);
+}
+
+static RpmOstreePkgcacheEntry *
+pkgcache_entry_dup (const RpmOstreePkgcacheEntry *entry)
+{
+  auto copy = g_new0 (RpmOstreePkgcacheEntry, 1);
+  copy->commit = g_strdup (entry->commit);
+  copy->repodata_chksum_repr = g_strdup (entry->repodata_chksum_repr);
+  copy->sepolicy_csum = g_strdup (entry->sepolicy_csum);
+  copy->nodocs = entry->nodocs;
+  return copy;
+}
+
+/* Marking a commit partial (or no longer partial) means adding or removing a
+ * file in the repo's state/ directory, which changes its mtime. */
+static gboolean
+get_state_stamp (OstreeRepo *repo, guint64 *out_stamp, GError **error)
+{
+  struct stat stbuf;
+  if (!glnx_fstatat_allow_noent (ostree_repo_get_dfd (repo), "state", &stbuf, 0, error))
+    return FALSE;
+  if (errno == ENOENT)
+    *out_stamp = 0;
+  else
+    *out_stamp = (guint64)stbuf.st_mtim.tv_sec * G_GUINT64_CONSTANT (1000000000)
+                 + stbuf.st_mtim.tv_nsec;
+  return TRUE;
+}
+
+static gboolean
+load_index (RpmOstreePkgcacheIndex *index, GError **error)
+{
+  glnx_autofd int fd = -1;
+  g_autoptr (GError) local_error = NULL;
+  if (!glnx_openat_rdonly (ostree_repo_get_dfd (index->repo), RPMOSTREE_PKGCACHE_INDEX_PATH, TRUE,
+                           &fd, &local_error))
+    {
+      if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        return TRUE;
+      g_propagate_error (error, util::move_nullify (local_error));
+      return FALSE;
+    }
+
+  index->mfile = g_mapped_file_new_from_fd (fd, FALSE, error);
+  if (!index->mfile)
+    return FALSE;
+  g_autoptr (GBytes) data = g_mapped_file_get_bytes (index->mfile);
+  /* Not trusted, so any corruption just reads as default values here */
+  g_autoptr (GVariant) v = g_variant_ref_sink (
+      g_variant_new_from_bytes (G_VARIANT_TYPE (PKGCACHE_INDEX_GVARIANT_FORMAT), data, FALSE));
+  guint64 stamp;
+  g_variant_get_child (v, 0, "t", &stamp);
+  if (stamp != index->state_stamp)
+    {
+      g_debug ("Ignoring stale pkgcache index");
+      return TRUE;
+    }
+  index->entries = g_variant_get_child_value (v, 1);
+  return TRUE;
+}
+
+/* Create an index for the pkgcache in @repo, as of its current refs. */
+RpmOstreePkgcacheIndex *
+rpmostree_pkgcache_index_new (OstreeRepo *repo, GCancellable *cancellable, GError **error)
+{
+  GLNX_AUTO_PREFIX_ERROR ("Loading pkgcache index", error);
+
+  g_autoptr (RpmOstreePkgcacheIndex) index = g_new0 (RpmOstreePkgcacheIndex, 1);
+  index->refcount = 1;
+  index->repo = (OstreeRepo *)g_object_ref (repo);
+  g_mutex_init (&index->lock);
+  index->added = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                        (GDestroyNotify)rpmostree_pkgcache_entry_free);
+
+  /* One walk of the refs, rather than resolving each branch */
+  if (!ostree_repo_list_refs_ext (repo, "rpmostree/pkg", &index->refs,
+                                  OSTREE_REPO_LIST_REFS_EXT_NONE, cancellable, error))
+    return NULL;
+  if (!get_state_stamp (repo, &index->state_stamp, error))
+    return NULL;
+  if (!load_index (index, error))
+    return NULL;
+
+  return util::move_nullify (index);
+}
+
+RpmOstreePkgcacheIndex *
+rpmostree_pkgcache_index_ref (RpmOstreePkgcacheIndex *index)
+{
+  g_atomic_int_inc (&index->refcount);
+  return index;
+}
+
+void
+rpmostree_pkgcache_index_unref (RpmOstreePkgcacheIndex *index)
+{
+  if (!g_atomic_int_dec_and_test (&index->refcount))
+    return;
+  g_debug ("Pkgcache index: %u hits, %u misses", index->n_hits, index->n_misses);
+  rpmostree_metrics_count_cache (RPMOSTREE_METRIC_CACHE_PKGCACHE_INDEX, index->n_hits,
+                                 index->n_misses);
+  g_object_unref (index->repo);
+  g_clear_pointer (&index->refs, g_hash_table_unref);
+  g_clear_pointer (&index->entries, g_variant_unref);
+  g_clear_pointer (&index->mfile, g_mapped_file_unref);
+  g_mutex_clear (&index->lock);
+  g_hash_table_unref (index->added);
+  g_free (index);
+}
+
+static const char *
+entry_variant_get_branch (GVariant *entry_v)
+{
+  const char *branch;
+  g_variant_get_child (entry_v, 0, "&s", &branch);
+  return branch;
+}
+
+/* Binary search the mapped entries for @cachebranch */
+static RpmOstreePkgcacheEntry *
+lookup_mapped (RpmOstreePkgcacheIndex *index, const char *cachebranch)
+{
+  if (!index->entries)
+    return NULL;
+
+  gsize lo = 0;
+  gsize hi = g_variant_n_children (index->entries);
+  while (lo < hi)
+    {
+      const gsize mid = lo + (hi - lo) / 2;
+      g_autoptr (GVariant) entry_v = g_variant_get_child_value (index->entries, mid);
+      const int cmp = strcmp (cachebranch, entry_variant_get_branch (entry_v));
+      if (cmp < 0)
+        hi = mid;
+      else if (cmp > 0)
+        lo = mid + 1;
+      else
+        {
+          g_autoptr (GVariant) commit_v = NULL;
+          const char *repodata_chksum_repr;
+          const char *sepolicy_csum;
+          gboolean nodocs;
+          g_variant_get (entry_v, "(&s@ay&ms&msb)", NULL, &commit_v, &repodata_chksum_repr,
+                         &sepolicy_csum, &nodocs);
+          if (!ostree_checksum_bytes_peek (commit_v))
+            return NULL;
+          auto entry = g_new0 (RpmOstreePkgcacheEntry, 1);
+          entry->commit = ostree_checksum_from_bytes_v (commit_v);
+          entry->repodata_chksum_repr = g_strdup (repodata_chksum_repr);
+          entry->sepolicy_csum = g_strdup (sepolicy_csum);
+          entry->nodocs = nodocs;
+          return entry;
+        }
+    }
+  return NULL;
+}
+
+/* Load the entry for @rev from its commit; *out_entry is set to NULL if it's
+ * partial. */
+static gboolean
+load_entry (OstreeRepo *repo, const char *cachebranch, const char *rev,
+            RpmOstreePkgcacheEntry **out_entry, GError **error)
+{
+  const char *errprefix = glnx_strjoina ("Loading pkgcache branch ", cachebranch);
+  GLNX_AUTO_PREFIX_ERROR (errprefix, error);
+
+  g_autoptr (GVariant) commit = NULL;
+  OstreeRepoCommitState commitstate;
+  if (!ostree_repo_load_commit (repo, rev, &commit, &commitstate, error))
+    return FALSE;
+  g_assert (commit);
+
+  /* If the commit is partial, then we need to redownload. This can happen if e.g. corrupted
+   * commit objects were deleted with `ostree fsck --delete`. */
+  if (commitstate & OSTREE_REPO_COMMIT_STATE_PARTIAL)
+    {
+      *out_entry = NULL;
+      return TRUE;
+    }
+
+  g_autoptr (GVariant) metadata = g_variant_get_child_value (commit, 0);
+  g_autoptr (GVariantDict) metadata_dict = g_variant_dict_new (metadata);
+  g_autoptr (RpmOstreePkgcacheEntry) entry = g_new0 (RpmOstreePkgcacheEntry, 1);
+  entry->commit = g_strdup (rev);
+  if (!g_variant_dict_lookup (metadata_dict, "rpmostree.repodata_checksum", "s",
+                              &entry->repodata_chksum_repr))
+    entry->repodata_chksum_repr = NULL;
+  if (!g_variant_dict_lookup (metadata_dict, "rpmostree.sepolicy", "s", &entry->sepolicy_csum))
+    entry->sepolicy_csum = NULL;
+  if (!g_variant_dict_lookup (metadata_dict, "rpmostree.nodocs", "b", &entry->nodocs))
+    entry->nodocs = FALSE;
+
+  *out_entry = util::move_nullify (entry);
+  return TRUE;
+}
+
+/* Look up the commit @cachebranch points to; *out_entry is set to NULL if
+ * there's no such branch, or if its commit is partial. */
+gboolean
+rpmostree_pkgcache_index_lookup (RpmOstreePkgcacheIndex *index, const char *cachebranch,
+                                 RpmOstreePkgcacheEntry **out_entry, GCancellable *cancellable,
+                                 GError **error)
+{
+  *out_entry = NULL;
+  auto rev = static_cast<const char *> (g_hash_table_lookup (index->refs, cachebranch));
+  if (!rev)
+    return TRUE;
+
+  {
+    g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&index->lock);
+    auto added = static_cast<RpmOstreePkgcacheEntry *> (g_hash_table_lookup (index->added,
+                                                                             cachebranch));
+    if (added)
+      {
+        index->n_hits++;
+        *out_entry = pkgcache_entry_dup (added);
+        return TRUE;
+      }
+  }
+
+  g_autoptr (RpmOstreePkgcacheEntry) entry = lookup_mapped (index, cachebranch);
+  if (entry && g_str_equal (entry->commit, rev))
+    {
+      g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&index->lock);
+      index->n_hits++;
+      *out_entry = util::move_nullify (entry);
+      return TRUE;
+    }
+  g_clear_pointer (&entry, rpmostree_pkgcache_entry_free);
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
+  if (!load_entry (index->repo, cachebranch, rev, &entry, error))
+    return FALSE;
+
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&index->lock);
+  index->n_misses++;
+  if (entry)
+    {
+      g_hash_table_replace (index->added, g_strdup (cachebranch), pkgcache_entry_dup (entry));
+      *out_entry = util::move_nullify (entry);
+    }
+  return TRUE;
+}
+
+typedef struct
+{
+  RpmOstreePkgcacheIndex *index;
+  GCancellable *cancellable;
+} PrefetchData;
+
+static void
+prefetch_worker (gpointer datap, gpointer user_data)
+{
+  auto cachebranch = static_cast<const char *> (datap);
+  auto data = static_cast<PrefetchData *> (user_data);
+  g_autoptr (RpmOstreePkgcacheEntry) entry = NULL;
+  /* Errors are left for the lookup proper to report, in a deterministic order */
+  (void)rpmostree_pkgcache_index_lookup (data->index, cachebranch, &entry, data->cancellable,
+                                         NULL);
+}
+
+/* Load the commits for those of @cachebranches that aren't indexed yet, from
+ * a thread per core; with a cold page cache, that's where the time goes. The
+ * lookups afterwards then don't need to touch the repo. */
+gboolean
+rpmostree_pkgcache_index_prefetch (RpmOstreePkgcacheIndex *index, GPtrArray *cachebranches,
+                                   GCancellable *cancellable, GError **error)
+{
+  g_autoptr (GPtrArray) missing = g_ptr_array_new ();
+  for (guint i = 0; i < cachebranches->len; i++)
+    {
+      auto cachebranch = static_cast<const char *> (cachebranches->pdata[i]);
+      auto rev = static_cast<const char *> (g_hash_table_lookup (index->refs, cachebranch));
+      if (!rev)
+        continue;
+      {
+        g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&index->lock);
+        if (g_hash_table_contains (index->added, cachebranch))
+          continue;
+      }
+      g_autoptr (RpmOstreePkgcacheEntry) entry = lookup_mapped (index, cachebranch);
+      if (entry && g_str_equal (entry->commit, rev))
+        continue;
+      g_ptr_array_add (missing, (gpointer)cachebranch);
+    }
+  /* Not worth the threads */
+  if (missing->len < 2)
+    return TRUE;
+
+  PrefetchData data = { index, cancellable };
+  const guint n_threads = MIN (g_get_num_processors (), missing->len);
+  GThreadPool *pool = g_thread_pool_new (prefetch_worker, &data, n_threads, TRUE, error);
+  if (!pool)
+    return FALSE;
+  for (guint i = 0; i < missing->len; i++)
+    {
+      if (!g_thread_pool_push (pool, missing->pdata[i], error))
+        {
+          g_thread_pool_free (pool, TRUE, TRUE);
+          return FALSE;
+        }
+    }
+  g_thread_pool_free (pool, FALSE, TRUE);
+  g_debug ("Prefetched %u pkgcache commits with %u threads", missing->len, n_threads);
+  return TRUE;
+}
+
+static int
+compare_entry_variants (gconstpointer a, gconstpointer b)
+{
+  auto entry_a = *static_cast<GVariant *const *> (a);
+  auto entry_b = *static_cast<GVariant *const *> (b);
+  return strcmp (entry_variant_get_branch (entry_a), entry_variant_get_branch (entry_b));
+}
+
+/* Write the index back to the repo if any commits had to be loaded, dropping
+ * entries for branches that are gone or have moved. */
+gboolean
+rpmostree_pkgcache_index_flush (RpmOstreePkgcacheIndex *index, GCancellable *cancellable,
+                                GError **error)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&index->lock);
+  if (g_hash_table_size (index->added) == 0)
+    return TRUE;
+
+  GLNX_AUTO_PREFIX_ERROR ("Writing pkgcache index", error);
+
+  g_autoptr (GPtrArray) entries = g_ptr_array_new_with_free_func ((GDestroyNotify)g_variant_unref);
+  if (index->entries)
+    {
+      GVariantIter iter;
+      g_variant_iter_init (&iter, index->entries);
+      while (TRUE)
+        {
+          g_autoptr (GVariant) entry_v = g_variant_iter_next_value (&iter);
+          if (!entry_v)
+            break;
+          const char *branch = entry_variant_get_branch (entry_v);
+          if (g_hash_table_contains (index->added, branch))
+            continue;
+          auto rev = static_cast<const char *> (g_hash_table_lookup (index->refs, branch));
+          g_autoptr (GVariant) commit_v = g_variant_get_child_value (entry_v, 1);
+          if (!rev || !ostree_checksum_bytes_peek (commit_v))
+            continue;
+          g_autofree char *commit = ostree_checksum_from_bytes_v (commit_v);
+          if (!g_str_equal (commit, rev))
+            continue;
+          g_ptr_array_add (entries, util::move_nullify (entry_v));
+        }
+    }
+
+  GLNX_HASH_TABLE_FOREACH_KV (index->added, const char *, branch, RpmOstreePkgcacheEntry *, entry)
+    {
+      g_ptr_array_add (entries,
+                       g_variant_ref_sink (g_variant_new (
+                           "(s@aymsmsb)", branch,
+                           ostree_checksum_to_bytes_v (entry->commit), entry->repodata_chksum_repr,
+                           entry->sepolicy_csum, entry->nodocs)));
+    }
+  g_ptr_array_sort (entries, compare_entry_variants);
+
+  g_auto (GVariantBuilder) builder;
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a" PKGCACHE_INDEX_ENTRY_FORMAT));
+  for (guint i = 0; i < entries->len; i++)
+    g_variant_builder_add_value (&builder, static_cast<GVariant *> (entries->pdata[i]));
+  /* The stamp is from when we checked the commits, not now; if anything was
+   * marked partial since, the index will be ignored next time. */
+  g_autoptr (GVariant) v = g_variant_ref_sink (
+      g_variant_new ("(t@a" PKGCACHE_INDEX_ENTRY_FORMAT ")", index->state_stamp,
+                     g_variant_builder_end (&builder)));
+
+  const int repo_dfd = ostree_repo_get_dfd (index->repo);
+  g_autofree char *dir = g_path_get_dirname (RPMOSTREE_PKGCACHE_INDEX_PATH);
+  if (!glnx_shutil_mkdir_p_at (repo_dfd, dir, 0755, cancellable, error))
+    return FALSE;
+  if (!glnx_file_replace_contents_at (repo_dfd, RPMOSTREE_PKGCACHE_INDEX_PATH,
+                                      (const guint8 *)g_variant_get_data (v),
+                                      g_variant_get_size (v), GLNX_FILE_REPLACE_NODATASYNC,
+                                      cancellable, error))
+    return FALSE;
+
+  return TRUE;
+}
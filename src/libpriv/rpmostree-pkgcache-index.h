@@ -0,0 +1,73 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Licensed under the GNU Lesser General Public License Version 2.1
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#pragma once
+
+#include "libglnx.h"
+#include <gio/gio.h>
+#include <ostree.h>
+
+G_BEGIN_DECLS
+
+/* Where the pkgcache index lives, relative to the repo */
+#define RPMOSTREE_PKGCACHE_INDEX_PATH "extensions/rpmostree/pkgcache-index"
+
+/* What we need to know from a pkgcache commit to decide whether it can be
+ * used as is; see find_pkg_in_ostree(). */
+typedef struct
+{
+  char *commit;
+  char *repodata_chksum_repr; /* NULL for imports predating it */
+  char *sepolicy_csum;        /* NULL if not recorded */
+  gboolean nodocs;
+} RpmOstreePkgcacheEntry;
+
+/* Keeps the above for every cache branch, so that classifying the packages
+ * of a transaction doesn't need to load each of their commits. The index is
+ * checked against a snapshot of the pkgcache refs taken at creation, so it
+ * should be short-lived. Partial commits are never indexed, and the whole
+ * index is dropped if the repo's commit state changed since it was written,
+ * e.g. because `ostree fsck --delete` marked commits partial. Lookups are
+ * thread-safe.
+ */
+typedef struct _RpmOstreePkgcacheIndex RpmOstreePkgcacheIndex;
+
+RpmOstreePkgcacheIndex *rpmostree_pkgcache_index_new (OstreeRepo *repo, GCancellable *cancellable,
+                                                      GError **error);
+
+RpmOstreePkgcacheIndex *rpmostree_pkgcache_index_ref (RpmOstreePkgcacheIndex *index);
+
+void rpmostree_pkgcache_index_unref (RpmOstreePkgcacheIndex *index);
+
+gboolean rpmostree_pkgcache_index_lookup (RpmOstreePkgcacheIndex *index, const char *cachebranch,
+                                          RpmOstreePkgcacheEntry **out_entry,
+                                          GCancellable *cancellable, GError **error);
+
+gboolean rpmostree_pkgcache_index_prefetch (RpmOstreePkgcacheIndex *index, GPtrArray *cachebranches,
+                                            GCancellable *cancellable, GError **error);
+
+gboolean rpmostree_pkgcache_index_flush (RpmOstreePkgcacheIndex *index, GCancellable *cancellable,
+                                         GError **error);
+
+void rpmostree_pkgcache_entry_free (RpmOstreePkgcacheEntry *entry);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (RpmOstreePkgcacheIndex, rpmostree_pkgcache_index_unref);
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (RpmOstreePkgcacheEntry, rpmostree_pkgcache_entry_free);
+
+G_END_DECLS
@@ -43,9 +43,11 @@
 
 #include "rpmostree-core.h"
 #include "rpmostree-kernel.h"
+#include "rpmostree-label-cache.h"
 #include "rpmostree-output.h"
 #include "rpmostree-postprocess.h"
 #include "rpmostree-rpm-util.h"
+#include "rpmostree-trace.h"
 #include "rpmostree-util.h"
 
 typedef enum
@@ -80,6 +82,40 @@ rename_if_exists (int src_dfd, const char *from, int dest_dfd, const char *to, G
   return TRUE;
 }
 
+struct DepmodRun
+{
+  int rootfs_dfd;
+  const char *kver;
+  gboolean unified_core_mode;
+  GError *error;
+};
+
+static gboolean
+run_depmod_one (DepmodRun *run, GError **error)
+{
+  ROSCXX_TRY (run_depmod (run->rootfs_dfd, run->kver, run->unified_core_mode), error);
+  return TRUE;
+}
+
+static gpointer
+depmod_thread (gpointer data)
+{
+  auto run = static_cast<DepmodRun *> (data);
+  (void)run_depmod_one (run, &run->error);
+  return NULL;
+}
+
+struct DracutJobsCleanup
+{
+  std::vector<RpmOstreeDracutJob> &jobs;
+
+  ~DracutJobsCleanup ()
+  {
+    for (auto &job : jobs)
+      glnx_tmpfile_clear (&job.initramfs_tmpf);
+  }
+};
+
 /* Handle the kernel/initramfs, which can be in at least 2 different places:
  *  - /boot (CentOS, Fedora treecompose before we suppressed kernel.spec's %posttrans)
  *  - /usr/lib/modules (Fedora treecompose without kernel.spec's %posttrans)
@@ -132,40 +168,82 @@ process_kernel_and_initramfs (int rootfs_dfd, rpmostreecxx::Treefile &treefile,
   if (!rename_if_exists (rootfs_dfd, "boot", rootfs_dfd, "usr/lib/ostree-boot", error))
     return FALSE;
 
-  /* Find the kernel in the source root (at this point one of usr/lib/modules or
-   * usr/lib/ostree-boot)
-   */
-  g_autoptr (GVariant) kernelstate = rpmostree_find_kernel (rootfs_dfd, cancellable, error);
-  if (!kernelstate)
-    return FALSE;
-  const char *kernel_path;
-  const char *initramfs_path;
-  const char *kver;
-  const char *bootdir;
-  /* Used to optionally hardlink result of our dracut run */
-  g_variant_get (kernelstate, "(&s&s&sm&s)", &kver, &bootdir, &kernel_path, &initramfs_path);
+  RpmOstreePostprocessBootLocation boot_location = RPMOSTREE_POSTPROCESS_BOOT_LOCATION_NEW;
+  if (treefile.get_boot_location_is_modules ())
+    boot_location = RPMOSTREE_POSTPROCESS_BOOT_LOCATION_MODULES;
 
-  /* We generate our own initramfs with custom arguments, so if the RPM install
-   * generated one (should only happen on CentOS now), delete it.
+  /* Find the kernel in the source root (at this point one of usr/lib/modules or
+   * usr/lib/ostree-boot).  If everything is kept in usr/lib/modules, there may
+   * be several of them (e.g. regular plus debug or rt), which we handle all
+   * at once.
    */
-  if (initramfs_path)
+  g_autoptr (GPtrArray) kernels = NULL;
+  if (boot_location == RPMOSTREE_POSTPROCESS_BOOT_LOCATION_MODULES)
     {
-      g_assert_cmpstr (bootdir, ==, "usr/lib/ostree-boot");
-      g_assert_cmpint (*initramfs_path, !=, '/');
-      g_print ("Removing RPM-generated '%s'\n", initramfs_path);
-      if (!glnx_shutil_rm_rf_at (rootfs_dfd, initramfs_path, cancellable, error))
+      kernels = rpmostree_find_module_kernels (rootfs_dfd, cancellable, error);
+      if (!kernels)
         return FALSE;
-      initramfs_path = NULL;
+    }
+  if (kernels && kernels->len > 1)
+    g_print ("Found %u kernels\n", kernels->len);
+  else
+    {
+      g_autoptr (GVariant) kernelstate = rpmostree_find_kernel (rootfs_dfd, cancellable, error);
+      if (!kernelstate)
+        return FALSE;
+      g_clear_pointer (&kernels, g_ptr_array_unref);
+      kernels = g_ptr_array_new_with_free_func ((GDestroyNotify)g_variant_unref);
+      g_ptr_array_add (kernels, util::move_nullify (kernelstate));
     }
 
-  /* Ensure depmod (kernel modules index) is up to date; because on Fedora we
-   * suppress the kernel %posttrans we need to take care of this.
-   */
-  ROSCXX_TRY (run_depmod (rootfs_dfd, kver, unified_core_mode), error);
+  std::vector<DepmodRun> depmods (kernels->len);
+  g_autoptr (GPtrArray) depmod_threads = g_ptr_array_new ();
+  for (guint i = 0; i < kernels->len; i++)
+    {
+      const char *kver;
+      const char *bootdir;
+      const char *kernel_path;
+      const char *initramfs_path;
+      g_variant_get ((GVariant *)kernels->pdata[i], "(&s&s&sm&s)", &kver, &bootdir, &kernel_path,
+                     &initramfs_path);
+
+      /* We generate our own initramfs with custom arguments, so if the RPM install
+       * generated one (should only happen on CentOS now), delete it.
+       */
+      if (initramfs_path)
+        {
+          g_assert_cmpstr (bootdir, ==, "usr/lib/ostree-boot");
+          g_assert_cmpint (*initramfs_path, !=, '/');
+          g_print ("Removing RPM-generated '%s'\n", initramfs_path);
+          if (!glnx_shutil_rm_rf_at (rootfs_dfd, initramfs_path, cancellable, error))
+            return FALSE;
+        }
 
-  RpmOstreePostprocessBootLocation boot_location = RPMOSTREE_POSTPROCESS_BOOT_LOCATION_NEW;
-  if (treefile.get_boot_location_is_modules ())
-    boot_location = RPMOSTREE_POSTPROCESS_BOOT_LOCATION_MODULES;
+      /* Ensure depmod (kernel modules index) is up to date; because on Fedora we
+       * suppress the kernel %posttrans we need to take care of this.
+       */
+      depmods[i] = { rootfs_dfd, kver, unified_core_mode, NULL };
+      if (kernels->len == 1)
+        depmod_thread (&depmods[i]);
+      else
+        g_ptr_array_add (depmod_threads, g_thread_new ("rpmostree-depmod", depmod_thread,
+                                                       &depmods[i]));
+    }
+  for (guint i = 0; i < depmod_threads->len; i++)
+    g_thread_join ((GThread *)depmod_threads->pdata[i]);
+  gboolean depmod_ok = TRUE;
+  for (auto &depmod : depmods)
+    {
+      if (!depmod.error)
+        continue;
+      if (depmod_ok)
+        g_propagate_error (error, depmod.error);
+      else
+        g_error_free (depmod.error);
+      depmod_ok = FALSE;
+    }
+  if (!depmod_ok)
+    return FALSE;
 
   auto machineid_compat = treefile.get_machineid_compat ();
   if (machineid_compat)
@@ -204,11 +282,29 @@ process_kernel_and_initramfs (int rootfs_dfd, rpmostreecxx::Treefile &treefile,
     }
   g_ptr_array_add (dracut_argv, NULL);
 
-  g_auto (GLnxTmpfile) initramfs_tmpf = {
-    0,
-  };
+  /* Start each boot checksum with the kernel; dracut's output is added to it as
+   * it's written. */
+  g_autoptr (GPtrArray) boot_checksums
+      = g_ptr_array_new_with_free_func ((GDestroyNotify)rpmostree_hasher_free);
+  std::vector<RpmOstreeDracutJob> jobs (kernels->len);
+  auto jobs_cleanup = DracutJobsCleanup{ jobs };
+  for (guint i = 0; i < kernels->len; i++)
+    {
+      const char *kver;
+      const char *kernel_path;
+      g_variant_get ((GVariant *)kernels->pdata[i], "(&s&s&sm&s)", &kver, NULL, &kernel_path,
+                     NULL);
+      RpmOstreeHasher *boot_checksum = rpmostree_hasher_new (G_CHECKSUM_SHA256);
+      g_ptr_array_add (boot_checksums, boot_checksum);
+      if (!_rpmostree_util_update_checksum_from_file (boot_checksum, rootfs_dfd, kernel_path,
+                                                      cancellable, error))
+        return FALSE;
+      jobs[i].kver = kver;
+      jobs[i].checksum = boot_checksum;
+    }
   /* We use a tmpdir under the target root since dracut currently tries to copy
    * xattrs, including e.g. user.ostreemeta, which can't be copied to tmpfs.
+   * It's shared by all the dracut runs.
    */
   {
     g_auto (GLnxTmpDir) dracut_host_tmpd = {
@@ -216,15 +312,20 @@ process_kernel_and_initramfs (int rootfs_dfd, rpmostreecxx::Treefile &treefile,
     };
     if (!glnx_mkdtempat (rootfs_dfd, "rpmostree-dracut.XXXXXX", 0700, &dracut_host_tmpd, error))
       return FALSE;
-    if (!rpmostree_run_dracut (rootfs_dfd, (const char *const *)dracut_argv->pdata, kver, NULL,
-                               FALSE, &dracut_host_tmpd, &initramfs_tmpf, cancellable, error))
-      return FALSE;
-    /* No reason to have the initramfs not be world-readable since
-     * it's server-side generated and shouldn't contain any secrets.
-     * https://github.com/coreos/coreos-assembler/pull/372#issuecomment-467620937
-     */
-    if (!glnx_fchmod (initramfs_tmpf.fd, 0644, error))
+    if (!rpmostree_run_dracut_jobs (rootfs_dfd, (const char *const *)dracut_argv->pdata,
+                                    &dracut_host_tmpd, jobs.data (), jobs.size (), cancellable,
+                                    error))
       return FALSE;
+    for (auto &job : jobs)
+      {
+        /* No reason to have the initramfs not be world-readable since
+         * it's server-side generated and shouldn't contain any secrets.
+         * https://github.com/coreos/coreos-assembler/pull/372#issuecomment-467620937
+         */
+        if (!glnx_fchmod (job.initramfs_tmpf.fd, 0644, error))
+          return FALSE;
+        g_print ("Generated initramfs for %s in %.1fs\n", job.kver, job.elapsed_secs);
+      }
   }
 
   /* We always tell rpmostree_finalize_kernel() to skip /boot, since we'll do a
@@ -234,9 +335,19 @@ process_kernel_and_initramfs (int rootfs_dfd, rpmostreecxx::Treefile &treefile,
       = (boot_location == RPMOSTREE_POSTPROCESS_BOOT_LOCATION_MODULES)
             ? RPMOSTREE_FINALIZE_KERNEL_USRLIB_MODULES
             : RPMOSTREE_FINALIZE_KERNEL_USRLIB_OSTREEBOOT;
-  if (!rpmostree_finalize_kernel (rootfs_dfd, bootdir, kver, kernel_path, &initramfs_tmpf, fin_dest,
-                                  cancellable, error))
-    return FALSE;
+  for (guint i = 0; i < kernels->len; i++)
+    {
+      const char *kver;
+      const char *bootdir;
+      const char *kernel_path;
+      g_variant_get ((GVariant *)kernels->pdata[i], "(&s&s&sm&s)", &kver, &bootdir, &kernel_path,
+                     NULL);
+      if (!rpmostree_finalize_kernel (rootfs_dfd, bootdir, kver, kernel_path,
+                                      &jobs[i].initramfs_tmpf,
+                                      rpmostree_hasher_get_string (jobs[i].checksum), fin_dest,
+                                      cancellable, error))
+        return FALSE;
+    }
 
   /* We always ensure this exists as a mountpoint */
   if (!glnx_ensure_dir (rootfs_dfd, "boot", 0755, error))
@@ -356,6 +467,90 @@ postprocess_selinux_policy_store_location (int rootfs_dfd, GCancellable *cancell
   return TRUE;
 }
 
+/* Update @inout_newest with the mtime of @path and, if it's a directory, of
+ * everything below it. Missing paths are ignored. */
+static gboolean
+get_newest_mtime_at (int dfd, const char *path, struct timespec *inout_newest,
+                     GCancellable *cancellable, GError **error)
+{
+  struct stat stbuf;
+  if (!glnx_fstatat_allow_noent (dfd, path, &stbuf, AT_SYMLINK_NOFOLLOW, error))
+    return FALSE;
+  if (errno == ENOENT)
+    return TRUE;
+  if (stbuf.st_mtim.tv_sec > inout_newest->tv_sec
+      || (stbuf.st_mtim.tv_sec == inout_newest->tv_sec
+          && stbuf.st_mtim.tv_nsec > inout_newest->tv_nsec))
+    *inout_newest = stbuf.st_mtim;
+  if (!S_ISDIR (stbuf.st_mode))
+    return TRUE;
+
+  g_auto (GLnxDirFdIterator) dfd_iter = {
+    FALSE,
+  };
+  if (!glnx_dirfd_iterator_init_at (dfd, path, FALSE, &dfd_iter, error))
+    return FALSE;
+  while (TRUE)
+    {
+      struct dirent *dent = NULL;
+      if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, cancellable, error))
+        return FALSE;
+      if (!dent)
+        break;
+      if (!get_newest_mtime_at (dfd_iter.fd, dent->d_name, inout_newest, cancellable, error))
+        return FALSE;
+    }
+  return TRUE;
+}
+
+/* `semodule -nB` rebuilds the policy from scratch and is one of the slowest
+ * parts of postprocessing. Usually the selinux-policy scriptlets have already
+ * built it, and nothing it reads has changed since; in that case there's no
+ * need to do it again. Only trust a policy strictly newer than its inputs;
+ * checked out package content all shares the same timestamp. */
+static gboolean
+selinux_policy_needs_rebuild (int rootfs_dfd, gboolean *out_needed, GCancellable *cancellable,
+                              GError **error)
+{
+  *out_needed = TRUE;
+
+  g_autoptr (OstreeSePolicy) sepolicy = NULL;
+  if (!rpmostree_prepare_rootfs_get_sepolicy (rootfs_dfd, &sepolicy, cancellable, error))
+    return FALSE;
+  const char *name = ostree_sepolicy_get_name (sepolicy);
+  if (!name)
+    return TRUE;
+
+  struct timespec built = { 0, 0 };
+  const char *policy_dir = glnx_strjoina ("usr/etc/selinux/", name, "/policy");
+  if (!get_newest_mtime_at (rootfs_dfd, policy_dir, &built, cancellable, error))
+    return FALSE;
+  if (built.tv_sec == 0 && built.tv_nsec == 0)
+    return TRUE;
+
+  /* The module store (in either location), plus what genhomedircon reads */
+  const char *var_store = glnx_strjoina ("var/lib/selinux/", name);
+  const char *etc_store = glnx_strjoina ("usr/etc/selinux/", name, "/active");
+  const char *inputs[] = { var_store,
+                           etc_store,
+                           "usr/etc/selinux/semanage.conf",
+                           "usr/etc/selinux/config",
+                           "usr/etc/default/useradd",
+                           "usr/etc/login.defs",
+                           "usr/etc/passwd",
+                           "usr/etc/group" };
+  struct timespec changed = { 0, 0 };
+  for (guint i = 0; i < G_N_ELEMENTS (inputs); i++)
+    {
+      if (!get_newest_mtime_at (rootfs_dfd, inputs[i], &changed, cancellable, error))
+        return FALSE;
+    }
+
+  *out_needed = !(built.tv_sec > changed.tv_sec
+                  || (built.tv_sec == changed.tv_sec && built.tv_nsec > changed.tv_nsec));
+  return TRUE;
+}
+
 namespace rpmostreecxx
 {
 
@@ -385,15 +580,22 @@ postprocess_final (int rootfs_dfd, rpmostreecxx::Treefile &treefile, gboolean un
 
   if (selinux)
     {
-      g_print ("Recompiling policy\n");
+      gboolean needs_rebuild = TRUE;
+      if (!selinux_policy_needs_rebuild (rootfs_dfd, &needs_rebuild, cancellable, error))
+        return FALSE;
 
-      {
-        /* Now regenerate SELinux policy so that postprocess scripts from users and from us
-         * (e.g. the /etc/default/useradd incision) that affect it are baked in. */
-        rust::Vec child_argv = { rust::String ("semodule"), rust::String ("-nB") };
-        ROSCXX_TRY (bubblewrap_run_sync (rootfs_dfd, child_argv, false, (bool)unified_core_mode),
-                    error);
-      }
+      if (!needs_rebuild)
+        g_print ("SELinux policy is up to date\n");
+      else
+        {
+          g_print ("Recompiling policy\n");
+
+          /* Now regenerate SELinux policy so that postprocess scripts from users and from us
+           * (e.g. the /etc/default/useradd incision) that affect it are baked in. */
+          rust::Vec child_argv = { rust::String ("semodule"), rust::String ("-nB") };
+          ROSCXX_TRY (
+              bubblewrap_run_sync (rootfs_dfd, child_argv, false, (bool)unified_core_mode), error);
+        }
 
       /* Temporary workaround for https://github.com/openshift/os/issues/1036. */
       {
@@ -618,8 +820,22 @@ struct CommitThreadData
   OstreeRepo *repo;
   int rootfs_fd;
   OstreeMutableTree *mtree;
+  gboolean low_memory; /* See write_dir_bottom_up() */
+  char *root_contents_checksum;
+  char *root_metadata_checksum;
   OstreeSePolicy *sepolicy;
+  RpmOstreeLabelCache *label_cache; /* If set, labels are added by filter_xattrs_cb */
+  gboolean label_usr_etc_as_etc;
   OstreeRepoCommitModifier *commit_modifier;
+  OstreeRepoDevInoCache *devino_cache;
+  const struct timespec *devino_stamp; /* If set, cache entries changed since are stale */
+  GHashTable *ownership; /* See rpmostree_context_get_deferred_ownership() */
+  GHashTable *ownership_inodes; /* "dev:ino" of the files in @ownership */
+
+  /* filter_xattrs_cb() is also called from the prewrite workers */
+  GMutex lock;
+  GError *label_error;
+  GError *prewrite_error;
   gboolean success;
   GCancellable *cancellable;
   GError **error;
@@ -655,6 +871,60 @@ extend_ostree_xattrs (GVariantBuilder *builder, GVariant *vbytes)
     }
 }
 
+/* The path policy lookups are done for, for the rootfs-relative @relpath */
+static char *
+get_label_path (struct CommitThreadData *tdata, const char *relpath)
+{
+  if (tdata->label_usr_etc_as_etc
+      && (g_str_equal (relpath, "usr/etc") || g_str_has_prefix (relpath, "usr/etc/")))
+    return g_strconcat ("/", relpath + strlen ("usr/"), NULL);
+  return g_strconcat ("/", relpath, NULL);
+}
+
+/* Finish the xattrs for @relpath, adding the SELinux label if needed. */
+static GVariant *
+finish_xattrs (struct CommitThreadData *tdata, GVariantBuilder *builder, const char *relpath,
+               GFileInfo *file_info)
+{
+  /* The file caps which couldn't be set on disk replace any that are there */
+  const char *fcaps = NULL;
+  if (tdata->ownership
+      && rpmostree_deferred_ownership_apply (tdata->ownership, relpath, file_info, &fcaps)
+      && fcaps)
+    {
+      g_autoptr (GVariant) xattrs = g_variant_ref_sink (g_variant_builder_end (builder));
+      g_variant_builder_init (builder, G_VARIANT_TYPE ("a(ayay)"));
+      GVariantIter viter;
+      g_variant_iter_init (&viter, xattrs);
+      GVariant *key, *value;
+      while (g_variant_iter_loop (&viter, "(@ay@ay)", &key, &value))
+        {
+          if (!g_str_equal (g_variant_get_bytestring (key), "security.capability"))
+            g_variant_builder_add (builder, "(@ay@ay)", key, value);
+        }
+      g_autoptr (GVariant) fcap_xattrs = rpmostree_fcap_to_xattr_variant (fcaps);
+      g_variant_iter_init (&viter, fcap_xattrs);
+      while (g_variant_iter_loop (&viter, "(@ay@ay)", &key, &value))
+        g_variant_builder_add (builder, "(@ay@ay)", key, value);
+    }
+
+  if (tdata->label_cache)
+    {
+      g_autofree char *label_path = get_label_path (tdata, relpath);
+      g_autoptr (GError) local_error = NULL;
+      rpmostree_label_cache_add_xattr (tdata->label_cache, builder, label_path,
+                                       g_file_info_get_attribute_uint32 (file_info, "unix::mode"),
+                                       &local_error);
+      if (local_error)
+        {
+          g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&tdata->lock);
+          if (!tdata->label_error)
+            tdata->label_error = util::move_nullify (local_error);
+        }
+    }
+  return g_variant_ref_sink (g_variant_builder_end (builder));
+}
+
 /* Filters out all xattrs that aren't accepted. */
 static GVariant *
 filter_xattrs_cb (OstreeRepo *repo, const char *relpath, GFileInfo *file_info, gpointer user_data)
@@ -690,6 +960,7 @@ filter_xattrs_cb (OstreeRepo *repo, const char *relpath, GFileInfo *file_info, g
 
   if (g_file_info_get_file_type (file_info) != G_FILE_TYPE_DIRECTORY)
     {
+      g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&tdata->lock);
       tdata->n_processed += g_file_info_get_size (file_info);
       g_atomic_int_set (&tdata->percent, (gint)((100.0 * tdata->n_processed) / tdata->n_bytes));
     }
@@ -710,7 +981,9 @@ filter_xattrs_cb (OstreeRepo *repo, const char *relpath, GFileInfo *file_info, g
       if (g_str_equal (attrkey, "user.ostreemeta"))
         {
           extend_ostree_xattrs (&builder, value);
-          return g_variant_ref_sink (g_variant_builder_end (&builder));
+          g_variant_unref (key);
+          g_variant_unref (value);
+          return finish_xattrs (tdata, &builder, relpath, file_info);
         }
     }
 
@@ -739,7 +1012,354 @@ filter_xattrs_cb (OstreeRepo *repo, const char *relpath, GFileInfo *file_info, g
         }
     }
 
-  return g_variant_ref_sink (g_variant_builder_end (&builder));
+  return finish_xattrs (tdata, &builder, relpath, file_info);
+}
+
+/* Write the content object for the regular file at @relpath exactly as
+ * ostree_repo_write_dfd_to_mtree() would, and add it to the devino cache so
+ * that the (single-threaded) mtree walk just picks up the checksum. */
+static gboolean
+prewrite_file (struct CommitThreadData *tdata, const char *relpath, GError **error)
+{
+  glnx_autofd int fd = -1;
+  if (!glnx_openat_rdonly (tdata->rootfs_fd, relpath, FALSE, &fd, error))
+    return FALSE;
+  struct stat stbuf;
+  if (!glnx_fstat (fd, &stbuf, error))
+    return FALSE;
+
+  g_autoptr (GFileInfo) file_info = g_file_info_new ();
+  g_file_info_set_file_type (file_info, G_FILE_TYPE_REGULAR);
+  g_file_info_set_size (file_info, stbuf.st_size);
+  g_file_info_set_attribute_uint32 (file_info, "unix::uid", stbuf.st_uid);
+  g_file_info_set_attribute_uint32 (file_info, "unix::gid", stbuf.st_gid);
+  g_file_info_set_attribute_uint32 (file_info, "unix::mode", stbuf.st_mode);
+
+  g_autoptr (GVariant) xattrs = filter_xattrs_cb (tdata->repo, relpath, file_info, tdata);
+  g_autoptr (GInputStream) file_input = g_unix_input_stream_new (fd, FALSE);
+  g_autoptr (GInputStream) content_input = NULL;
+  guint64 content_len;
+  if (!ostree_raw_file_to_content_stream (file_input, file_info, xattrs, &content_input,
+                                          &content_len, tdata->cancellable, error))
+    return FALSE;
+  g_autofree guchar *csum = NULL;
+  if (!ostree_repo_write_content (tdata->repo, NULL, content_input, content_len, &csum,
+                                  tdata->cancellable, error))
+    return glnx_prefix_error (error, "Writing %s", relpath);
+
+  g_autofree char *checksum = ostree_checksum_from_bytes (csum);
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&tdata->lock);
+  rpmostree_devino_cache_add (tdata->devino_cache, stbuf.st_dev, stbuf.st_ino, checksum);
+  return TRUE;
+}
+
+/* Directories and symlinks aren't written ahead of time, but their labels
+ * can be; the mtree walk then finds them in the label cache. */
+static gboolean
+prelabel_path (struct CommitThreadData *tdata, const char *relpath, guint32 mode, GError **error)
+{
+  g_autofree char *label_path = get_label_path (tdata, relpath);
+  g_autofree char *label = NULL;
+  return rpmostree_label_cache_get_label (tdata->label_cache, label_path, mode, &label,
+                                          tdata->cancellable, error);
+}
+
+typedef struct
+{
+  char *relpath;
+  guint32 mode; /* Only the file type */
+} PrewriteItem;
+
+static void
+prewrite_file_worker (gpointer data, gpointer user_data)
+{
+  auto item = static_cast<PrewriteItem *> (data);
+  g_autofree char *relpath = item->relpath;
+  const guint32 mode = item->mode;
+  g_free (item);
+  auto tdata = static_cast<struct CommitThreadData *> (user_data);
+  {
+    g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&tdata->lock);
+    if (tdata->prewrite_error)
+      return;
+  }
+
+  g_autoptr (GError) local_error = NULL;
+  const gboolean ok = S_ISREG (mode) ? prewrite_file (tdata, relpath, &local_error)
+                                     : prelabel_path (tdata, relpath, mode, &local_error);
+  if (!ok)
+    {
+      g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&tdata->lock);
+      if (!tdata->prewrite_error)
+        tdata->prewrite_error = util::move_nullify (local_error);
+    }
+}
+
+static gboolean
+push_prewrite_item (GThreadPool *pool, char *relpath, guint32 mode, GError **error)
+{
+  PrewriteItem *item = g_new0 (PrewriteItem, 1);
+  item->relpath = relpath;
+  item->mode = mode;
+  return g_thread_pool_push (pool, item, error);
+}
+
+/* Queue every regular file under @relpath whose checksum we don't know yet,
+ * and with a label cache, every directory and symlink to be labeled; @seen
+ * catches hardlinks within the rootfs. */
+static gboolean
+queue_prewrite_files (struct CommitThreadData *tdata, GThreadPool *pool, GHashTable *seen,
+                      const char *relpath, GError **error)
+{
+  g_auto (GLnxDirFdIterator) dfd_iter = {
+    FALSE,
+  };
+  if (!glnx_dirfd_iterator_init_at (tdata->rootfs_fd, relpath, FALSE, &dfd_iter, error))
+    return FALSE;
+  while (TRUE)
+    {
+      struct dirent *dent = NULL;
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&dfd_iter, &dent, tdata->cancellable,
+                                                       error))
+        return FALSE;
+      if (!dent)
+        break;
+
+      g_autofree char *child = g_str_equal (relpath, ".")
+                                   ? g_strdup (dent->d_name)
+                                   : g_build_filename (relpath, dent->d_name, NULL);
+      if (dent->d_type == DT_DIR)
+        {
+          if (!queue_prewrite_files (tdata, pool, seen, child, error))
+            return FALSE;
+          if (tdata->label_cache
+              && !push_prewrite_item (pool, util::move_nullify (child), S_IFDIR, error))
+            return FALSE;
+          continue;
+        }
+      if (dent->d_type == DT_LNK)
+        {
+          if (tdata->label_cache
+              && !push_prewrite_item (pool, util::move_nullify (child), S_IFLNK, error))
+            return FALSE;
+          continue;
+        }
+      if (dent->d_type != DT_REG)
+        continue;
+
+      struct stat stbuf;
+      if (!glnx_fstatat (dfd_iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW, error))
+        return FALSE;
+      g_autofree char *key = g_strdup_printf ("%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT,
+                                              (guint64)stbuf.st_dev, (guint64)stbuf.st_ino);
+      if (tdata->ownership_inodes && g_hash_table_contains (tdata->ownership_inodes, key))
+        continue;
+      if (rpmostree_devino_cache_lookup (tdata->devino_cache, stbuf.st_dev, stbuf.st_ino))
+        {
+          const struct timespec *stamp = tdata->devino_stamp;
+          /* Still the pkgcache object it was checked out from; nothing to do */
+          if (!stamp || !rpmostree_stat_changed_since (&stbuf, stamp))
+            continue;
+          rpmostree_devino_cache_remove (tdata->devino_cache, stbuf.st_dev, stbuf.st_ino);
+        }
+      if (stbuf.st_nlink > 1 && !g_hash_table_add (seen, util::move_nullify (key)))
+        continue;
+      if (!push_prewrite_item (pool, util::move_nullify (child), S_IFREG, error))
+        return FALSE;
+    }
+  return TRUE;
+}
+
+/* Hashing, labeling and (for archive repos) compressing the file content
+ * dominates committing a rootfs, and ostree_repo_write_dfd_to_mtree() does
+ * all of it in one thread. So first write the content objects and look up
+ * the remaining labels across all cores.  The mtree is still built by ostree
+ * in one sorted walk, so the result is the same. */
+static gboolean
+prewrite_files (struct CommitThreadData *tdata, GError **error)
+{
+  g_autoptr (GHashTable) seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  GThreadPool *pool
+      = g_thread_pool_new (prewrite_file_worker, tdata, g_get_num_processors (), TRUE, error);
+  if (!pool)
+    return FALSE;
+  /* Always wait for the workers before returning */
+  gboolean queued = queue_prewrite_files (tdata, pool, seen, ".", error);
+  g_thread_pool_free (pool, !queued, TRUE);
+  if (!queued)
+    return FALSE;
+
+  if (tdata->prewrite_error)
+    {
+      g_propagate_error (error, util::move_nullify (tdata->prewrite_error));
+      return FALSE;
+    }
+  return TRUE;
+}
+
+static gint
+compare_strings (gconstpointer a, gconstpointer b)
+{
+  return strcmp (*(const char *const *)a, *(const char *const *)b);
+}
+
+/* Write the content object for the regular file or symlink @name in @dfd
+ * (at @relpath in the rootfs), as ostree_repo_write_dfd_to_mtree() would. */
+static gboolean
+write_leaf_content (struct CommitThreadData *tdata, int dfd, const char *name,
+                    const char *relpath, const struct stat *stbuf, char **out_checksum,
+                    GError **error)
+{
+  /* Which, after prewrite_files(), is almost all regular files */
+  if (S_ISREG (stbuf->st_mode))
+    {
+      const char *cached
+          = rpmostree_devino_cache_lookup (tdata->devino_cache, stbuf->st_dev, stbuf->st_ino);
+      if (cached)
+        {
+          *out_checksum = g_strdup (cached);
+          return TRUE;
+        }
+    }
+
+  g_autoptr (GFileInfo) file_info = g_file_info_new ();
+  glnx_autofd int fd = -1;
+  if (S_ISREG (stbuf->st_mode))
+    {
+      if (!glnx_openat_rdonly (dfd, name, FALSE, &fd, error))
+        return FALSE;
+      g_file_info_set_file_type (file_info, G_FILE_TYPE_REGULAR);
+      g_file_info_set_size (file_info, stbuf->st_size);
+    }
+  else
+    {
+      g_autofree char *target = glnx_readlinkat_malloc (dfd, name, tdata->cancellable, error);
+      if (!target)
+        return FALSE;
+      g_file_info_set_file_type (file_info, G_FILE_TYPE_SYMBOLIC_LINK);
+      g_file_info_set_size (file_info, 0);
+      g_file_info_set_symlink_target (file_info, target);
+    }
+  g_file_info_set_attribute_uint32 (file_info, "unix::uid", stbuf->st_uid);
+  g_file_info_set_attribute_uint32 (file_info, "unix::gid", stbuf->st_gid);
+  g_file_info_set_attribute_uint32 (file_info, "unix::mode", stbuf->st_mode);
+
+  g_autofree char *path = g_strconcat ("/", relpath, NULL);
+  if (tdata->ownership)
+    rpmostree_deferred_ownership_apply (tdata->ownership, path, file_info, NULL);
+  g_autoptr (GVariant) xattrs = filter_xattrs_cb (tdata->repo, path, file_info, tdata);
+  g_autoptr (GInputStream) file_input = NULL;
+  if (fd >= 0)
+    file_input = g_unix_input_stream_new (fd, FALSE);
+  g_autoptr (GInputStream) content_input = NULL;
+  guint64 content_len;
+  if (!ostree_raw_file_to_content_stream (file_input, file_info, xattrs, &content_input,
+                                          &content_len, tdata->cancellable, error))
+    return FALSE;
+  g_autofree guchar *csum = NULL;
+  if (!ostree_repo_write_content (tdata->repo, NULL, content_input, content_len, &csum,
+                                  tdata->cancellable, error))
+    return glnx_prefix_error (error, "Writing %s", relpath);
+  *out_checksum = ostree_checksum_from_bytes (csum);
+  return TRUE;
+}
+
+/* The low-memory alternative to ostree_repo_write_dfd_to_mtree(): write the
+ * dirtree and dirmeta objects for @relpath depth-first, children before their
+ * parent, and return their checksums. Only the entry names of the directories
+ * on the current path are held, rather than an OstreeMutableTree of the
+ * whole rootfs, so memory use follows the tree depth instead of the file
+ * count. The objects written are the same. */
+static gboolean
+write_dir_bottom_up (struct CommitThreadData *tdata, const char *relpath,
+                     char **out_contents_checksum, char **out_metadata_checksum, GError **error)
+{
+  if (g_cancellable_set_error_if_cancelled (tdata->cancellable, error))
+    return FALSE;
+
+  g_auto (GLnxDirFdIterator) dfd_iter = {
+    FALSE,
+  };
+  if (!glnx_dirfd_iterator_init_at (tdata->rootfs_fd, relpath, FALSE, &dfd_iter, error))
+    return FALSE;
+
+  /* Dirtree entries are sorted by name */
+  g_autoptr (GPtrArray) names = g_ptr_array_new_with_free_func (g_free);
+  while (TRUE)
+    {
+      struct dirent *dent = NULL;
+      if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, tdata->cancellable, error))
+        return FALSE;
+      if (!dent)
+        break;
+      g_ptr_array_add (names, g_strdup (dent->d_name));
+    }
+  g_ptr_array_sort (names, compare_strings);
+
+  g_auto (GVariantBuilder) files_builder;
+  g_variant_builder_init (&files_builder, G_VARIANT_TYPE ("a(say)"));
+  g_auto (GVariantBuilder) dirs_builder;
+  g_variant_builder_init (&dirs_builder, G_VARIANT_TYPE ("a(sayay)"));
+  for (guint i = 0; i < names->len; i++)
+    {
+      auto name = static_cast<const char *> (names->pdata[i]);
+      g_autofree char *child = g_str_equal (relpath, ".") ? g_strdup (name)
+                                                          : g_build_filename (relpath, name, NULL);
+      struct stat stbuf;
+      if (!glnx_fstatat (dfd_iter.fd, name, &stbuf, AT_SYMLINK_NOFOLLOW, error))
+        return FALSE;
+
+      if (S_ISDIR (stbuf.st_mode))
+        {
+          g_autofree char *contents_checksum = NULL;
+          g_autofree char *metadata_checksum = NULL;
+          if (!write_dir_bottom_up (tdata, child, &contents_checksum, &metadata_checksum, error))
+            return FALSE;
+          g_variant_builder_add (&dirs_builder, "(s@ay@ay)", name,
+                                 ostree_checksum_to_bytes_v (contents_checksum),
+                                 ostree_checksum_to_bytes_v (metadata_checksum));
+        }
+      else if (S_ISREG (stbuf.st_mode) || S_ISLNK (stbuf.st_mode))
+        {
+          g_autofree char *checksum = NULL;
+          if (!write_leaf_content (tdata, dfd_iter.fd, name, child, &stbuf, &checksum, error))
+            return FALSE;
+          g_variant_builder_add (&files_builder, "(s@ay)", name,
+                                 ostree_checksum_to_bytes_v (checksum));
+        }
+      else
+        return glnx_throw (error, "Unsupported file type for %s", child);
+    }
+
+  struct stat stbuf;
+  if (!glnx_fstat (dfd_iter.fd, &stbuf, error))
+    return FALSE;
+  g_autoptr (GFileInfo) dir_info = g_file_info_new ();
+  g_file_info_set_file_type (dir_info, G_FILE_TYPE_DIRECTORY);
+  g_file_info_set_attribute_uint32 (dir_info, "unix::uid", stbuf.st_uid);
+  g_file_info_set_attribute_uint32 (dir_info, "unix::gid", stbuf.st_gid);
+  g_file_info_set_attribute_uint32 (dir_info, "unix::mode", stbuf.st_mode);
+  g_autofree char *path = g_strconcat ("/", g_str_equal (relpath, ".") ? "" : relpath, NULL);
+  if (tdata->ownership)
+    rpmostree_deferred_ownership_apply (tdata->ownership, path, dir_info, NULL);
+  g_autoptr (GVariant) xattrs = filter_xattrs_cb (tdata->repo, path, dir_info, tdata);
+  g_autoptr (GVariant) dirmeta = ostree_create_directory_metadata (dir_info, xattrs);
+  g_autofree guchar *metadata_csum = NULL;
+  if (!ostree_repo_write_metadata (tdata->repo, OSTREE_OBJECT_TYPE_DIR_META, NULL, dirmeta,
+                                   &metadata_csum, tdata->cancellable, error))
+    return FALSE;
+
+  g_autoptr (GVariant) dirtree = g_variant_ref_sink (
+      g_variant_new ("(@a(say)@a(sayay))", g_variant_builder_end (&files_builder),
+                     g_variant_builder_end (&dirs_builder)));
+  g_autofree guchar *contents_csum = NULL;
+  if (!ostree_repo_write_metadata (tdata->repo, OSTREE_OBJECT_TYPE_DIR_TREE, NULL, dirtree,
+                                   &contents_csum, tdata->cancellable, error))
+    return FALSE;
+
+  *out_contents_checksum = ostree_checksum_from_bytes (contents_csum);
+  *out_metadata_checksum = ostree_checksum_from_bytes (metadata_csum);
+  return TRUE;
 }
 
 static gpointer
@@ -747,9 +1367,15 @@ write_dfd_thread (gpointer datap)
 {
   auto data = static_cast<struct CommitThreadData *> (datap);
 
-  data->success
-      = ostree_repo_write_dfd_to_mtree (data->repo, data->rootfs_fd, ".", data->mtree,
-                                        data->commit_modifier, data->cancellable, data->error);
+  if (!prewrite_files (data, data->error))
+    data->success = FALSE;
+  else if (data->low_memory)
+    data->success = write_dir_bottom_up (data, ".", &data->root_contents_checksum,
+                                         &data->root_metadata_checksum, data->error);
+  else
+    data->success = ostree_repo_write_dfd_to_mtree (data->repo, data->rootfs_fd, ".", data->mtree,
+                                                    data->commit_modifier, data->cancellable,
+                                                    data->error);
   g_atomic_int_inc (&data->done);
   g_main_context_wakeup (NULL);
   return NULL;
@@ -767,16 +1393,14 @@ on_progress_timeout (gpointer datap)
   return TRUE;
 }
 
-/* This is the server-side-only variant; see also the code in rpmostree-core.c
- * for all the other cases like client side layering and `ex container` for
- * buildroots.
- */
-gboolean
-rpmostree_compose_commit (int rootfs_fd, OstreeRepo *repo, const char *parent_revision,
-                          GVariant *src_metadata, GVariant *detached_metadata,
-                          const char *gpg_keyid, gboolean container, RpmOstreeSELinuxMode selinux,
-                          OstreeRepoDevInoCache *devino_cache, char **out_new_revision,
-                          GCancellable *cancellable, GError **error)
+/* Write @rootfs_fd (consuming it if @consume) to @repo as a tree labeled for
+ * @selinux, returning its root. With @low_memory, the tree is written by
+ * write_dir_bottom_up() instead, which never consumes. */
+static gboolean
+write_rootfs_tree (int rootfs_fd, OstreeRepo *repo, RpmOstreeSELinuxMode selinux,
+                   gboolean consume, gboolean low_memory, OstreeRepoDevInoCache *devino_cache,
+                   const struct timespec *devino_stamp, GHashTable *ownership, GFile **out_root,
+                   GCancellable *cancellable, GError **error)
 {
   int label_modifier_flags = 0;
   g_autoptr (OstreeSePolicy) sepolicy = NULL;
@@ -793,28 +1417,40 @@ rpmostree_compose_commit (int rootfs_fd, OstreeRepo *repo, const char *parent_re
   /* We may make this configurable if someone complains about including some
    * unlabeled content, but I think the fix for that is to ensure that policy is
    * labeling it.
-   *
-   * Also right now we unconditionally use the CONSUME flag, but this will need
-   * to change for the split compose/commit root patches.
    */
-  auto modifier_flags = static_cast<OstreeRepoCommitModifierFlags> (
-      OSTREE_REPO_COMMIT_MODIFIER_FLAGS_ERROR_ON_UNLABELED
-      | OSTREE_REPO_COMMIT_MODIFIER_FLAGS_CONSUME | label_modifier_flags);
+  int modifier_flags = OSTREE_REPO_COMMIT_MODIFIER_FLAGS_ERROR_ON_UNLABELED | label_modifier_flags;
+  if (consume)
+    modifier_flags |= OSTREE_REPO_COMMIT_MODIFIER_FLAGS_CONSUME;
   /* If changing this, also look at changing rpmostree-unpacker.c */
-  g_autoptr (OstreeRepoCommitModifier) commit_modifier
-      = ostree_repo_commit_modifier_new (modifier_flags, NULL, NULL, NULL);
+  g_autoptr (OstreeRepoCommitModifier) commit_modifier = ostree_repo_commit_modifier_new (
+      static_cast<OstreeRepoCommitModifierFlags> (modifier_flags),
+      ownership ? rpmostree_deferred_ownership_filter : NULL, ownership, NULL);
   struct CommitThreadData tdata = {
     0,
   };
   ostree_repo_commit_modifier_set_xattr_callback (commit_modifier, filter_xattrs_cb, NULL, &tdata);
 
+  /* Label lookups are mostly the same from one compose to the next, so use a
+   * cache in the repo rather than having ostree query the policy. */
+  g_autoptr (RpmOstreeLabelCache) label_cache = NULL;
   if (sepolicy && ostree_sepolicy_get_name (sepolicy) != NULL)
-    ostree_repo_commit_modifier_set_sepolicy (commit_modifier, sepolicy);
+    {
+      label_cache
+          = rpmostree_label_cache_new (sepolicy, ostree_repo_get_dfd (repo), cancellable, error);
+      if (!label_cache)
+        return FALSE;
+      tdata.label_cache = label_cache;
+      tdata.label_usr_etc_as_etc = (selinux == RPMOSTREE_SELINUX_MODE_V1);
+    }
   else if (selinux != RPMOSTREE_SELINUX_MODE_DISABLED)
     return glnx_throw (error, "SELinux enabled, but no policy found");
 
-  if (devino_cache)
-    ostree_repo_commit_modifier_set_devino_cache (commit_modifier, devino_cache);
+  /* Besides the checksums from the pkgcache checkouts, this gets the ones
+   * from prewrite_files() */
+  g_autoptr (OstreeRepoDevInoCache) owned_devino_cache = NULL;
+  if (!devino_cache)
+    devino_cache = owned_devino_cache = ostree_repo_devino_cache_new ();
+  ostree_repo_commit_modifier_set_devino_cache (commit_modifier, devino_cache);
 
   CXX_TRY_VAR (n_bytes, rpmostreecxx::directory_size (rootfs_fd, *cancellable), error);
 
@@ -822,9 +1458,37 @@ rpmostree_compose_commit (int rootfs_fd, OstreeRepo *repo, const char *parent_re
   tdata.repo = repo;
   tdata.rootfs_fd = rootfs_fd;
   tdata.mtree = mtree;
+  tdata.low_memory = low_memory;
   tdata.sepolicy = sepolicy;
   tdata.commit_modifier = commit_modifier;
+  tdata.devino_cache = devino_cache;
+  tdata.devino_stamp = owned_devino_cache ? NULL : devino_stamp;
+  tdata.ownership = ownership;
+
+  /* A file needing deferred ownership is still a pkgcache object, which may
+   * also be checked out at paths that don't. Keep all of those out of the
+   * devino cache, so that the mtree walk hashes them path by path through the
+   * filter. */
+  g_autoptr (GHashTable) ownership_inodes = NULL;
+  if (ownership)
+    {
+      ownership_inodes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+      GLNX_HASH_TABLE_FOREACH (ownership, const char *, relpath)
+        {
+          struct stat stbuf;
+          if (fstatat (rootfs_fd, relpath, &stbuf, AT_SYMLINK_NOFOLLOW) != 0
+              || !S_ISREG (stbuf.st_mode))
+            continue;
+          rpmostree_devino_cache_remove (devino_cache, stbuf.st_dev, stbuf.st_ino);
+          g_hash_table_add (ownership_inodes,
+                            g_strdup_printf ("%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT,
+                                             (guint64)stbuf.st_dev, (guint64)stbuf.st_ino));
+        }
+      tdata.ownership_inodes = ownership_inodes;
+    }
+  tdata.cancellable = cancellable;
   tdata.error = error;
+  g_mutex_init (&tdata.lock);
 
   {
     g_autoptr (GThread) commit_thread = g_thread_new ("commit", write_dfd_thread, &tdata);
@@ -843,13 +1507,52 @@ rpmostree_compose_commit (int rootfs_fd, OstreeRepo *repo, const char *parent_re
 
     tdata.progress->percent_update (100);
   }
+  g_mutex_clear (&tdata.lock);
+  g_autofree char *root_contents_checksum = util::move_nullify (tdata.root_contents_checksum);
+  g_autofree char *root_metadata_checksum = util::move_nullify (tdata.root_metadata_checksum);
 
   if (!tdata.success)
-    return glnx_prefix_error (error, "While writing rootfs to mtree");
+    {
+      g_clear_error (&tdata.label_error);
+      return glnx_prefix_error (error, "While writing rootfs to mtree");
+    }
+  if (tdata.label_error)
+    {
+      g_propagate_error (error, util::move_nullify (tdata.label_error));
+      return glnx_prefix_error (error, "While writing rootfs to mtree");
+    }
+  if (label_cache && !rpmostree_label_cache_flush (label_cache, cancellable, error))
+    return FALSE;
 
-  g_autoptr (GFile) root_tree = NULL;
-  if (!ostree_repo_write_mtree (repo, mtree, &root_tree, cancellable, error))
+  /* A tree that only has its checksums is returned as is */
+  if (low_memory)
+    {
+      g_clear_object (&mtree);
+      mtree = ostree_mutable_tree_new_from_checksum (repo, root_contents_checksum,
+                                                     root_metadata_checksum);
+    }
+  if (!ostree_repo_write_mtree (repo, mtree, out_root, cancellable, error))
     return glnx_prefix_error (error, "While writing tree");
+  return TRUE;
+}
+
+/* This is the server-side-only variant; see also the code in rpmostree-core.c
+ * for all the other cases like client side layering and `ex container` for
+ * buildroots.
+ */
+gboolean
+rpmostree_compose_commit (int rootfs_fd, OstreeRepo *repo, const char *parent_revision,
+                          GVariant *src_metadata, GVariant *detached_metadata,
+                          const char *gpg_keyid, gboolean container, RpmOstreeSELinuxMode selinux,
+                          gboolean low_memory, OstreeRepoDevInoCache *devino_cache,
+                          const struct timespec *devino_stamp, GHashTable *ownership,
+                          char **out_new_revision, GCancellable *cancellable, GError **error)
+{
+  rpmostreecxx::TraceSpan span ("compose-commit");
+  g_autoptr (GFile) root_tree = NULL;
+  if (!write_rootfs_tree (rootfs_fd, repo, selinux, TRUE, low_memory, devino_cache, devino_stamp,
+                          ownership, &root_tree, cancellable, error))
+    return FALSE;
 
   // Unfortunately these API takes GVariantDict, not GVariantBuilder, so convert
   g_autoptr (GVariantDict) metadata_dict = g_variant_dict_new (src_metadata);
@@ -888,3 +1591,23 @@ rpmostree_compose_commit (int rootfs_fd, OstreeRepo *repo, const char *parent_re
 
   return TRUE;
 }
+
+/* Commit @rootfs_fd as-is (without consuming it) with @metadata, labeled the
+ * same way rpmostree_compose_commit() would; for keeping intermediate states
+ * of a compose around. */
+gboolean
+rpmostree_compose_commit_snapshot (int rootfs_fd, OstreeRepo *repo, RpmOstreeSELinuxMode selinux,
+                                   OstreeRepoDevInoCache *devino_cache,
+                                   const struct timespec *devino_stamp, GHashTable *ownership,
+                                   GVariant *metadata, char **out_new_revision,
+                                   GCancellable *cancellable, GError **error)
+{
+  g_autoptr (GFile) root_tree = NULL;
+  if (!write_rootfs_tree (rootfs_fd, repo, selinux, FALSE, FALSE, devino_cache, devino_stamp,
+                          ownership, &root_tree, cancellable, error))
+    return FALSE;
+  if (!ostree_repo_write_commit (repo, NULL, "", "", metadata, (OstreeRepoFile *)root_tree,
+                                 out_new_revision, cancellable, error))
+    return glnx_prefix_error (error, "While writing commit");
+  return TRUE;
+}
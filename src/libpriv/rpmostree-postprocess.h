@@ -44,9 +44,19 @@ typedef enum
 gboolean rpmostree_compose_commit (int rootfs_dfd, OstreeRepo *repo, const char *parent,
                                    GVariant *metadata, GVariant *detached_metadata,
                                    const char *gpg_keyid, gboolean container,
-                                   RpmOstreeSELinuxMode selinux,
-                                   OstreeRepoDevInoCache *devino_cache, char **out_new_revision,
-                                   GCancellable *cancellable, GError **error);
+                                   RpmOstreeSELinuxMode selinux, gboolean low_memory,
+                                   OstreeRepoDevInoCache *devino_cache,
+                                   const struct timespec *devino_stamp, GHashTable *ownership,
+                                   char **out_new_revision, GCancellable *cancellable,
+                                   GError **error);
+
+gboolean rpmostree_compose_commit_snapshot (int rootfs_dfd, OstreeRepo *repo,
+                                            RpmOstreeSELinuxMode selinux,
+                                            OstreeRepoDevInoCache *devino_cache,
+                                            const struct timespec *devino_stamp,
+                                            GHashTable *ownership, GVariant *metadata,
+                                            char **out_new_revision,
+                                            GCancellable *cancellable, GError **error);
 
 G_END_DECLS
 
@@ -24,6 +24,7 @@
 #include "rpmostree-rpm-util.h"
 #include "rpmostree-util.h"
 #include <rpm/header.h>
+#include <rpm/rpmfiles.h>
 #include <rpm/rpmtag.h>
 #include <string.h>
 
@@ -101,6 +102,33 @@ RpmTs::packages_providing_file (const rust::Str path) const
   return ret;
 }
 
+// All the files installed by packages named @name. This is much cheaper in bulk
+// than querying packages_providing_file() for each path.
+rust::Vec<rust::String>
+RpmTs::package_files (const rust::Str name) const
+{
+  auto name_c = std::string (name);
+  g_auto (rpmdbMatchIterator) mi = rpmtsInitIterator (_ts->ts, RPMDBI_NAME, name_c.c_str (), 0);
+  rust::Vec<rust::String> ret;
+  if (mi == NULL)
+    return ret;
+  Header h;
+  while ((h = rpmdbNextIterator (mi)) != NULL)
+    {
+      g_auto (rpmfiles) files = rpmfilesNew (NULL, h, RPMTAG_BASENAMES, RPMFI_FLAGS_QUERY);
+      g_auto (rpmfi) fi = rpmfilesIter (files, RPMFI_ITER_FWD);
+      while (rpmfiNext (fi) >= 0)
+        {
+          // Match what's covered by RPMDBI_INSTFILENAMES
+          rpmfileState state = rpmfiFState (fi);
+          if (state == RPMFILE_STATE_NOTINSTALLED || state == RPMFILE_STATE_WRONGCOLOR)
+            continue;
+          ret.push_back (rust::String::lossy (rpmfiFN (fi)));
+        }
+    }
+  return ret;
+}
+
 std::unique_ptr<PackageMeta>
 RpmTs::package_meta (const rust::Str name) const
 {
@@ -86,6 +86,7 @@ public:
   ~RpmTs ();
   rpmts get_ts () const;
   rust::Vec<rust::String> packages_providing_file (const rust::Str path) const;
+  rust::Vec<rust::String> package_files (const rust::Str name) const;
   std::unique_ptr<PackageMeta> package_meta (const rust::Str package) const;
 
 private:
@@ -33,8 +33,10 @@
 #include <libglnx.h>
 #include <sys/capability.h>
 #include <sys/ioctl.h>
+#include <unistd.h>
 
 #include <rpm/rpmts.h>
+#include <rpm/rpmver.h>
 
 static inline void
 cleanup_rpmtdFreeData (rpmtd *tdp)
@@ -195,50 +197,45 @@ pkg_print_changed (Header opkg, Header npkg)
 #define CASENCMP_EQ(x, y, n) (g_ascii_strncasecmp (x, y, n) == 0)
 #define CASEFNMATCH_EQ(x, y) (fnmatch (x, y, FNM_CASEFOLD) == 0)
 
-/* find a common prefix length that doesn't need fnmatch */
-static size_t
-pat_fnmatch_prefix (const GPtrArray *patterns)
+/* A pattern as given on the command line, analyzed once rather than for
+ * every header we try it against. */
+typedef struct
 {
-  gsize ret = G_MAXSIZE;
-  int num = 0;
+  const char *pattern;
+  gsize prefixlen;  /* length of the leading part that doesn't need fnmatch */
+  gboolean literal; /* no glob characters at all, so a plain comparison does */
+} PkgPattern;
 
+static GArray *
+pkg_patterns_new (const GPtrArray *patterns)
+{
   if (!patterns)
-    return 0;
+    return NULL;
 
-  for (num = 0; num < patterns->len; num++)
+  GArray *ret = g_array_sized_new (FALSE, FALSE, sizeof (PkgPattern), patterns->len);
+  for (guint num = 0; num < patterns->len; num++)
     {
-      auto pat = static_cast<const char *> (patterns->pdata[num]);
-      gsize prefix = 0;
-
-      while (*pat)
-        {
-          if (*pat == ':')
-            break;
-          if (*pat == '-')
-            break;
-          if (*pat == '*')
-            break;
-          if (*pat == '?')
-            break;
-          if (*pat == '.')
-            break;
-          if (*pat == '[')
-            break;
-
-          ++prefix;
-          ++pat;
-        }
-
-      ret = MIN (ret, prefix);
+      PkgPattern pat = {
+        static_cast<const char *> (patterns->pdata[num]),
+      };
+      pat.prefixlen = strcspn (pat.pattern, ":-*?.[");
+      pat.literal = pat.pattern[strcspn (pat.pattern, "*?[\\")] == '\0';
+      g_array_append_val (ret, pat);
     }
-
   return ret;
 }
 
 static gboolean
-pat_fnmatch_match (Header pkg, const char *name, gsize patprefixlen, const GPtrArray *patterns)
+pkg_pattern_matches (const PkgPattern *pat, const char *str)
+{
+  if (pat->literal)
+    return g_ascii_strcasecmp (pat->pattern, str) == 0;
+  return CASEFNMATCH_EQ (pat->pattern, str);
+}
+
+static gboolean
+pat_fnmatch_match (Header pkg, const char *name, GArray *patterns)
 {
-  int num = 0;
   g_autofree char *pkg_na = NULL;
   g_autofree char *pkg_nevra = NULL;
   g_autofree char *pkg_nvr = NULL;
@@ -246,13 +243,17 @@ pat_fnmatch_match (Header pkg, const char *name, gsize patprefixlen, const GPtrA
   if (!patterns)
     return TRUE;
 
-  for (num = 0; num < patterns->len; num++)
+  for (guint num = 0; num < patterns->len; num++)
     {
-      auto pattern = static_cast<const char *> (patterns->pdata[num]);
+      const PkgPattern *pat = &g_array_index (patterns, PkgPattern, num);
 
-      if (patprefixlen && !CASENCMP_EQ (name, pattern, patprefixlen))
+      /* All the strings we match against start with the name */
+      if (pat->prefixlen && !CASENCMP_EQ (name, pat->pattern, pat->prefixlen))
         continue;
 
+      if (pkg_pattern_matches (pat, name))
+        return TRUE;
+
       if (!pkg_na)
         {
           pkg_nevra = pkg_nevra_strdup (pkg);
@@ -260,8 +261,8 @@ pat_fnmatch_match (Header pkg, const char *name, gsize patprefixlen, const GPtrA
           pkg_nvr = pkg_nvr_strdup (pkg);
         }
 
-      if (CASEFNMATCH_EQ (pattern, name) || CASEFNMATCH_EQ (pattern, pkg_nevra)
-          || CASEFNMATCH_EQ (pattern, pkg_na) || CASEFNMATCH_EQ (pattern, pkg_nvr) || FALSE)
+      if (pkg_pattern_matches (pat, pkg_nevra) || pkg_pattern_matches (pat, pkg_na)
+          || pkg_pattern_matches (pat, pkg_nvr))
         return TRUE;
     }
 
@@ -274,14 +275,37 @@ header_free_p (gpointer data)
   headerFree (static_cast<Header> (data));
 }
 
+/* What we sort and diff headers by, queried from the header once. The
+ * strings are owned by the header. */
+typedef struct
+{
+  Header h;
+  const char *name;
+  guint64 epoch;
+  const char *version;
+  const char *release;
+} RpmHeaderKey;
+
+/* Same ordering as rpmVersionCompare() */
+static int
+header_key_evr_cmp (const RpmHeaderKey *k1, const RpmHeaderKey *k2)
+{
+  if (k1->epoch != k2->epoch)
+    return k1->epoch < k2->epoch ? -1 : 1;
+  int cmp = rpmvercmp (k1->version, k2->version);
+  if (!cmp)
+    cmp = rpmvercmp (k1->release, k2->release);
+  return cmp;
+}
+
 static int
-header_cmp_p (gconstpointer gph1, gconstpointer gph2)
+header_key_cmp (gconstpointer a, gconstpointer b)
 {
-  auto h1 = (Header *)gph1;
-  auto h2 = (Header *)gph2;
-  int cmp = header_name_cmp (*h1, *h2);
+  auto k1 = static_cast<const RpmHeaderKey *> (a);
+  auto k2 = static_cast<const RpmHeaderKey *> (b);
+  int cmp = strcmp (k1->name, k2->name);
   if (!cmp)
-    cmp = rpmVersionCompare (*h1, *h2);
+    cmp = header_key_evr_cmp (k1, k2);
   return cmp;
 }
 
@@ -290,14 +314,13 @@ rpmhdrs_new (RpmOstreeRefTs *refts, const GPtrArray *patterns)
 {
   rpmdbMatchIterator iter;
   Header h1;
-  GPtrArray *hs = NULL;
   struct RpmHeaders *ret = NULL;
-  gsize patprefixlen = pat_fnmatch_prefix (patterns);
+  g_autoptr (GArray) pkg_patterns = pkg_patterns_new (patterns);
 
   /* iter = rpmtsInitIterator (ts, RPMTAG_NAME, "yum", 0); */
   iter = rpmtsInitIterator (refts->ts, RPMDBI_PACKAGES, NULL, 0);
 
-  hs = g_ptr_array_new_with_free_func (header_free_p);
+  GArray *keys = g_array_new (FALSE, FALSE, sizeof (RpmHeaderKey));
   while ((h1 = rpmdbNextIterator (iter)))
     {
       const char *name = headerGetString (h1, RPMTAG_NAME);
@@ -305,21 +328,28 @@ rpmhdrs_new (RpmOstreeRefTs *refts, const GPtrArray *patterns)
       if (g_str_equal (name, "gpg-pubkey"))
         continue; /* rpmdb abstraction leak */
 
-      if (!pat_fnmatch_match (h1, name, patprefixlen, patterns))
+      if (!pat_fnmatch_match (h1, name, pkg_patterns))
         continue;
 
-      h1 = headerLink (h1);
-      g_ptr_array_add (hs, h1);
+      RpmHeaderKey key = { headerLink (h1), name, headerGetNumber (h1, RPMTAG_EPOCH),
+                           headerGetString (h1, RPMTAG_VERSION),
+                           headerGetString (h1, RPMTAG_RELEASE) };
+      g_array_append_val (keys, key);
     }
   iter = rpmdbFreeIterator (iter);
   (void)iter;
 
-  g_ptr_array_sort (hs, header_cmp_p);
+  g_array_sort (keys, header_key_cmp);
+
+  GPtrArray *hs = g_ptr_array_new_full (keys->len, header_free_p);
+  for (guint i = 0; i < keys->len; i++)
+    g_ptr_array_add (hs, g_array_index (keys, RpmHeaderKey, i).h);
 
   ret = (struct RpmHeaders *)g_malloc0 (sizeof (struct RpmHeaders));
 
   ret->refts = rpmostree_refts_ref (refts);
   ret->hs = hs;
+  ret->keys = keys;
 
   return ret;
 }
@@ -332,6 +362,7 @@ rpmhdrs_free (struct RpmHeaders *hdrs)
 
   g_ptr_array_free (hdrs->hs, TRUE);
   hdrs->hs = NULL;
+  g_array_unref (hdrs->keys);
   rpmostree_refts_unref (hdrs->refts);
 
   g_free (hdrs);
@@ -379,7 +410,9 @@ rpmhdrs_diff (struct RpmHeaders *l1, struct RpmHeaders *l2)
       else
         {
           auto h2 = static_cast<Header> (l2->hs->pdata[n2]);
-          int cmp = header_name_cmp (h1, h2);
+          const RpmHeaderKey *k1 = &g_array_index (l1->keys, RpmHeaderKey, n1);
+          const RpmHeaderKey *k2 = &g_array_index (l2->keys, RpmHeaderKey, n2);
+          int cmp = strcmp (k1->name, k2->name);
 
           if (cmp > 0)
             {
@@ -393,7 +426,7 @@ rpmhdrs_diff (struct RpmHeaders *l1, struct RpmHeaders *l2)
             }
           else
             {
-              cmp = rpmVersionCompare (h1, h2);
+              cmp = header_key_evr_cmp (k1, k2);
               if (!cmp)
                 {
                   ++n1;
@@ -436,17 +469,17 @@ rpmhdrs_list (struct RpmHeaders *l1)
 char *
 rpmhdrs_rpmdbv (struct RpmHeaders *l1, GCancellable *cancellable, GError **error)
 {
-  g_autoptr (GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_autoptr (RpmOstreeHasher) checksum = rpmostree_hasher_new (G_CHECKSUM_SHA256);
   int num = 0;
   while (num < l1->hs->len)
     {
       auto pkg = static_cast<Header> (l1->hs->pdata[num++]);
       g_autofree char *envra = pkg_envra_strdup (pkg);
 
-      g_checksum_update (checksum, (guint8 *)envra, strlen (envra));
+      rpmostree_hasher_update (checksum, (guint8 *)envra, strlen (envra));
     }
 
-  return g_strdup_printf ("%u:%s", num, g_checksum_get_string (checksum));
+  return g_strdup_printf ("%u:%s", num, rpmostree_hasher_get_string (checksum));
 }
 
 /* glib? */
@@ -795,39 +828,104 @@ mk_rpmdb_compat_symlinks (int rootfs_dfd, GCancellable *cancellable, GError **er
   return TRUE;
 }
 
-/* Check out a copy of the rpmdb into @tmpdir */
+/* Check out the rpmdb from @ref into a new @out_tmpdir. For bare repos we
+ * can write to, the tmpdir is created in the repo's tmp/ so that the database
+ * files are hardlinked rather than copied; they're only ever opened
+ * read-only. Otherwise, fall back to a copy in the usual tmpdir. */
 static gboolean
-checkout_only_rpmdb (OstreeRepo *repo, const char *ref, const char *rpmdb, GLnxTmpDir *tmpdir,
-                     GCancellable *cancellable, GError **error)
+checkout_only_rpmdb (OstreeRepo *repo, const char *ref, const char *rpmdb,
+                     GLnxTmpDir *out_tmpdir, GCancellable *cancellable, GError **error)
 {
   GLNX_AUTO_PREFIX_ERROR ("rpmdb checkout", error);
   g_autofree char *commit = NULL;
   if (!ostree_repo_resolve_rev (repo, ref, FALSE, &commit, error))
     return FALSE;
 
-  /* Create intermediate dirs */
-  if (!glnx_shutil_mkdir_p_at (tmpdir->fd, "usr/share", 0777, cancellable, error))
-    return FALSE;
-
-  /* Check out the database (via copy) */
   OstreeRepoCheckoutAtOptions checkout_options = {
     (OstreeRepoCheckoutMode)0,
   };
   checkout_options.mode = OSTREE_REPO_CHECKOUT_MODE_USER;
   const char *subpath = glnx_strjoina ("/", rpmdb);
   checkout_options.subpath = subpath;
-  if (!ostree_repo_checkout_at (repo, &checkout_options, tmpdir->fd, RPMOSTREE_RPMDB_LOCATION,
+
+  const OstreeRepoMode repo_mode = ostree_repo_get_mode (repo);
+  gboolean hardlink = FALSE;
+  if (repo_mode == OSTREE_REPO_MODE_BARE_USER || repo_mode == OSTREE_REPO_MODE_BARE_USER_ONLY)
+    hardlink = TRUE;
+  else if (repo_mode == OSTREE_REPO_MODE_BARE && getuid () == 0)
+    {
+      checkout_options.mode = OSTREE_REPO_CHECKOUT_MODE_NONE;
+      hardlink = TRUE;
+    }
+
+  g_auto (GLnxTmpDir) tmpdir = {
+    0,
+  };
+  if (hardlink)
+    {
+      g_autoptr (GError) local_error = NULL;
+      if (!glnx_mkdtemp_at (ostree_repo_get_dfd (repo), "tmp/rpmostree-dbquery-XXXXXX", 0700,
+                            &tmpdir, &local_error))
+        {
+          g_debug ("Copying rpmdb: %s", local_error->message);
+          hardlink = FALSE;
+        }
+    }
+  if (!hardlink)
+    {
+      checkout_options.mode = OSTREE_REPO_CHECKOUT_MODE_USER;
+      if (!glnx_mkdtemp ("rpmostree-dbquery-XXXXXX", 0700, &tmpdir, error))
+        return FALSE;
+    }
+
+  /* Create intermediate dirs */
+  if (!glnx_shutil_mkdir_p_at (tmpdir.fd, "usr/share", 0777, cancellable, error))
+    return FALSE;
+
+  /* Check out the database (via hardlinks or copy, see above) */
+  if (!ostree_repo_checkout_at (repo, &checkout_options, tmpdir.fd, RPMOSTREE_RPMDB_LOCATION,
                                 commit, cancellable, error))
     return FALSE;
 
-  if (!mk_rpmdb_compat_symlinks (tmpdir->fd, cancellable, error))
+  if (!mk_rpmdb_compat_symlinks (tmpdir.fd, cancellable, error))
     return FALSE;
 
+  *out_tmpdir = tmpdir;
+  tmpdir.initialized = FALSE; /* Steal ownership */
   return TRUE;
 }
 
+/* Where libsolv caches of commit rpmdbs live, in a directory per commit
+ * checksum; the base layer rpmdb's is in a "base" subdirectory. */
+#define RPMOSTREE_SOLV_CACHE_DIR "extensions/rpmostree/solv-cache"
+
+/* Return the directory for the libsolv cache of @commit's rpmdb, creating
+ * it if needed, or %NULL if we can't write one. Parsing the rpmdb is most
+ * of the cost of loading a sack, and since the rpmdb of a commit never
+ * changes, libsolv's own format is safe to reuse. libdnf still checks that
+ * the cache matches the rpmdb it's given, and rebuilds it if not. */
+static char *
+get_solv_cachedir (OstreeRepo *repo, const char *commit, gboolean base)
+{
+  int repo_dfd = ostree_repo_get_dfd (repo);
+  g_autofree char *relpath
+      = g_strconcat (RPMOSTREE_SOLV_CACHE_DIR "/", commit, base ? "/base" : "", NULL);
+  g_autoptr (GError) local_error = NULL;
+  if (!glnx_shutil_mkdir_p_at (repo_dfd, relpath, 0755, NULL, &local_error))
+    {
+      g_debug ("Not caching sack for %s: %s", commit, local_error->message);
+      return NULL;
+    }
+  if (faccessat (repo_dfd, relpath, W_OK, 0) < 0)
+    return NULL;
+  return glnx_fdrel_abspath (repo_dfd, relpath);
+}
+
+/* If @solv_cachedir is set, the system repo is loaded from the libsolv
+ * cache there, or the cache is written after parsing the rpmdb. */
 static gboolean
-get_sack_for_root (int dfd, const char *path, DnfSack **out_sack, GError **error)
+get_sack_for_root (int dfd, const char *path, const char *solv_cachedir, DnfSack **out_sack,
+                   GError **error)
 {
   GLNX_AUTO_PREFIX_ERROR ("Loading sack", error);
   g_assert (out_sack != NULL);
@@ -838,11 +936,14 @@ get_sack_for_root (int dfd, const char *path, DnfSack **out_sack, GError **error
 
   g_autoptr (DnfSack) sack = dnf_sack_new ();
   dnf_sack_set_rootdir (sack, fullpath);
+  if (solv_cachedir)
+    dnf_sack_set_cachedir (sack, solv_cachedir);
 
   if (!dnf_sack_setup (sack, 0, error))
     return FALSE;
 
-  if (!dnf_sack_load_system_repo (sack, NULL, 0, error))
+  const int load_flags = solv_cachedir ? DNF_SACK_LOAD_FLAG_BUILD_CACHE : 0;
+  if (!dnf_sack_load_system_repo (sack, NULL, load_flags, error))
     return FALSE;
 
   *out_sack = util::move_nullify (sack);
@@ -855,19 +956,78 @@ RpmOstreeRefSack *
 rpmostree_get_refsack_for_root (int dfd, const char *path, GError **error)
 {
   g_autoptr (DnfSack) sack = NULL; /* NB: refsack adds a ref to it */
-  if (!get_sack_for_root (dfd, path, &sack, error))
+  if (!get_sack_for_root (dfd, path, NULL, &sack, error))
     return NULL;
   return rpmostree_refsack_new (sack, NULL);
 }
 
+/* Like rpmostree_get_refsack_for_root(), but where @dfd + @path is known to
+ * be a checkout of @commit (e.g. a deployment), so the sack can be loaded
+ * from the same cache as rpmostree_get_refsack_for_commit().
+ */
+RpmOstreeRefSack *
+rpmostree_get_refsack_for_commit_root (int dfd, const char *path, OstreeRepo *repo,
+                                       const char *commit, GError **error)
+{
+  g_autofree char *solv_cachedir = get_solv_cachedir (repo, commit, FALSE);
+  g_autoptr (DnfSack) sack = NULL; /* NB: refsack adds a ref to it */
+  if (!get_sack_for_root (dfd, path, solv_cachedir, &sack, error))
+    return NULL;
+  return rpmostree_refsack_new (sack, NULL);
+}
+
+/* Delete the libsolv caches for commits which are no longer in @repo. */
+gboolean
+rpmostree_solv_cache_prune (OstreeRepo *repo, GCancellable *cancellable, GError **error)
+{
+  GLNX_AUTO_PREFIX_ERROR ("Pruning sack caches", error);
+  const int repo_dfd = ostree_repo_get_dfd (repo);
+
+  if (!glnx_fstatat_allow_noent (repo_dfd, RPMOSTREE_SOLV_CACHE_DIR, NULL, 0, error))
+    return FALSE;
+  if (errno == ENOENT)
+    return TRUE;
+
+  g_auto (GLnxDirFdIterator) dfd_iter = {
+    FALSE,
+  };
+  if (!glnx_dirfd_iterator_init_at (repo_dfd, RPMOSTREE_SOLV_CACHE_DIR, FALSE, &dfd_iter, error))
+    return FALSE;
+  while (TRUE)
+    {
+      struct dirent *dent = NULL;
+      if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, cancellable, error))
+        return FALSE;
+      if (!dent)
+        break;
+
+      gboolean has_commit = FALSE;
+      if (ostree_validate_checksum_string (dent->d_name, NULL)
+          && !ostree_repo_has_object (repo, OSTREE_OBJECT_TYPE_COMMIT, dent->d_name, &has_commit,
+                                      cancellable, error))
+        return FALSE;
+      if (has_commit)
+        continue;
+      if (!glnx_shutil_rm_rf_at (dfd_iter.fd, dent->d_name, cancellable, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
 /* Given @dfd + @path, return a sack corresponding to the base layer (which is the same as
  * /usr/share/rpm if it's not a layered deployment.
  *
  * Note this function may return %TRUE without a sack if the deployment predates when we
  * started embedding RPMOSTREE_BASE_RPMDB.
+ *
+ * If @repo is set, @base_commit is the base commit of the deployment; its rpmdb is the
+ * same as the base rpmdb, so the sack is loaded from the same libsolv cache as
+ * rpmostree_get_refsack_for_commit() on it, rather than parsing the rpmdb.
  */
 gboolean
-rpmostree_get_base_refsack_for_root (int dfd, const char *path, RpmOstreeRefSack **out_sack,
+rpmostree_get_base_refsack_for_root (int dfd, const char *path, OstreeRepo *repo,
+                                     const char *base_commit, RpmOstreeRefSack **out_sack,
                                      GCancellable *cancellable, GError **error)
 {
   g_autofree char *subpath = g_build_filename (path, RPMOSTREE_BASE_RPMDB, NULL);
@@ -892,8 +1052,9 @@ rpmostree_get_base_refsack_for_root (int dfd, const char *path, RpmOstreeRefSack
   if (!mk_rpmdb_compat_symlinks (tmpdir.fd, cancellable, error))
     return FALSE;
 
+  g_autofree char *solv_cachedir = repo ? get_solv_cachedir (repo, base_commit, FALSE) : NULL;
   g_autoptr (DnfSack) sack = NULL; /* NB: refsack adds a ref to it */
-  if (!get_sack_for_root (tmpdir.fd, ".", &sack, error))
+  if (!get_sack_for_root (tmpdir.fd, ".", solv_cachedir, &sack, error))
     return FALSE;
 
   *out_sack = rpmostree_refsack_new (sack, &tmpdir);
@@ -906,17 +1067,19 @@ RpmOstreeRefSack *
 rpmostree_get_refsack_for_commit (OstreeRepo *repo, const char *ref, GCancellable *cancellable,
                                   GError **error)
 {
+  g_autofree char *commit = NULL;
+  if (!ostree_repo_resolve_rev (repo, ref, FALSE, &commit, error))
+    return NULL;
+
   g_auto (GLnxTmpDir) tmpdir = {
     0,
   };
-  if (!glnx_mkdtemp ("rpmostree-dbquery-XXXXXX", 0700, &tmpdir, error))
-    return NULL;
-
-  if (!checkout_only_rpmdb (repo, ref, RPMOSTREE_RPMDB_LOCATION, &tmpdir, cancellable, error))
+  if (!checkout_only_rpmdb (repo, commit, RPMOSTREE_RPMDB_LOCATION, &tmpdir, cancellable, error))
     return NULL;
 
+  g_autofree char *solv_cachedir = get_solv_cachedir (repo, commit, FALSE);
   g_autoptr (DnfSack) hsack = NULL; /* NB: refsack adds a ref to it */
-  if (!get_sack_for_root (tmpdir.fd, ".", &hsack, error))
+  if (!get_sack_for_root (tmpdir.fd, ".", solv_cachedir, &hsack, error))
     return NULL;
 
   /* Ownership of tmpdir is transferred */
@@ -930,21 +1093,24 @@ RpmOstreeRefSack *
 rpmostree_get_base_refsack_for_commit (OstreeRepo *repo, const char *ref, GCancellable *cancellable,
                                        GError **error)
 {
+  g_autofree char *commit = NULL;
+  if (!ostree_repo_resolve_rev (repo, ref, FALSE, &commit, error))
+    return NULL;
+
   g_auto (GLnxTmpDir) tmpdir = {
     0,
   };
-  if (!glnx_mkdtemp ("rpmostree-dbquery-XXXXXX", 0700, &tmpdir, error))
-    return NULL;
 
   /* This is a bit of a hack; we checkout the "base" dbpath as /usr/share/rpm in
    * a temporary root. Fixing this would require patching through new APIs into
    * libdnf → libsolv to teach it about a way to find a user-specified dbpath.
    */
-  if (!checkout_only_rpmdb (repo, ref, RPMOSTREE_BASE_RPMDB, &tmpdir, cancellable, error))
+  if (!checkout_only_rpmdb (repo, commit, RPMOSTREE_BASE_RPMDB, &tmpdir, cancellable, error))
     return NULL;
 
+  g_autofree char *solv_cachedir = get_solv_cachedir (repo, commit, TRUE);
   g_autoptr (DnfSack) hsack = NULL; /* NB: refsack adds a ref to it */
-  if (!get_sack_for_root (tmpdir.fd, ".", &hsack, error))
+  if (!get_sack_for_root (tmpdir.fd, ".", solv_cachedir, &hsack, error))
     return NULL;
 
   /* Ownership of tmpdir is transferred */
@@ -977,9 +1143,6 @@ rpmostree_get_refts_for_commit (OstreeRepo *repo, const char *ref, RpmOstreeRefT
   g_auto (GLnxTmpDir) tmpdir = {
     0,
   };
-  if (!glnx_mkdtemp ("rpmostree-dbquery-XXXXXX", 0700, &tmpdir, error))
-    return FALSE;
-
   if (!checkout_only_rpmdb (repo, ref, RPMOSTREE_RPMDB_LOCATION, &tmpdir, cancellable, error))
     return FALSE;
 
@@ -1276,6 +1439,125 @@ rpmostree_create_rpmdb_pkglist_variant (int dfd, const char *path, GVariant **ou
   return TRUE;
 }
 
+/* An entry of the pkglists above; the strings are borrowed */
+typedef struct
+{
+  const char *name;
+  guint64 epoch;
+  const char *version;
+  const char *release;
+  const char *arch;
+} PkglistEntry;
+
+static void
+pkglist_entry_from_pkg (DnfPackage *pkg, PkglistEntry *entry)
+{
+  entry->name = dnf_package_get_name (pkg);
+  entry->epoch = dnf_package_get_epoch (pkg);
+  entry->version = dnf_package_get_version (pkg);
+  entry->release = dnf_package_get_release (pkg);
+  entry->arch = dnf_package_get_arch (pkg);
+}
+
+/* Same ordering as rpmostree_pkg_array_compare(), i.e. dnf_package_cmp() */
+static int
+pkglist_entry_cmp (const PkglistEntry *a, const PkglistEntry *b)
+{
+  int cmp = strcmp (a->name, b->name);
+  if (cmp)
+    return cmp;
+  if (a->epoch != b->epoch)
+    return a->epoch < b->epoch ? -1 : 1;
+  cmp = rpmvercmp (a->version, b->version);
+  if (!cmp)
+    cmp = rpmvercmp (a->release, b->release);
+  if (!cmp)
+    cmp = strcmp (a->arch, b->arch);
+  return cmp;
+}
+
+static void
+pkglist_builder_add (GVariantBuilder *builder, const PkglistEntry *entry)
+{
+  g_autofree char *epoch = g_strdup_printf ("%" PRIu64, entry->epoch);
+  g_variant_builder_add (builder, "(sssss)", entry->name, epoch, entry->version, entry->release,
+                         entry->arch);
+}
+
+/* Return @base_pkglist (as created by rpmostree_create_rpmdb_pkglist_variant())
+ * with the #DnfPackage entries of @removed taken out and those of @added put
+ * in, sorted the same way; i.e. the pkglist of @base_pkglist's rpmdb after a
+ * transaction, without reading that rpmdb back. */
+GVariant *
+rpmostree_pkglist_variant_apply_delta (GVariant *base_pkglist, GPtrArray *removed,
+                                       GPtrArray *added)
+{
+  g_autoptr (GHashTable) removed_nevras
+      = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  for (guint i = 0; i < removed->len; i++)
+    g_hash_table_add (removed_nevras,
+                      g_strdup (dnf_package_get_nevra ((DnfPackage *)removed->pdata[i])));
+
+  g_autoptr (GPtrArray) sorted_added = g_ptr_array_new ();
+  for (guint i = 0; i < added->len; i++)
+    g_ptr_array_add (sorted_added, added->pdata[i]);
+  g_ptr_array_sort (sorted_added, (GCompareFunc)rpmostree_pkg_array_compare);
+
+  GVariantBuilder builder;
+  g_variant_builder_init (&builder, (GVariantType *)"a(sssss)");
+  const guint n_base = g_variant_n_children (base_pkglist);
+  guint i_base = 0;
+  guint i_added = 0;
+  while (i_base < n_base || i_added < sorted_added->len)
+    {
+      PkglistEntry base_entry = {
+        NULL,
+      };
+      gboolean have_base = FALSE;
+      if (i_base < n_base)
+        {
+          const char *epoch;
+          g_variant_get_child (base_pkglist, i_base, "(&s&s&s&s&s)", &base_entry.name, &epoch,
+                               &base_entry.version, &base_entry.release, &base_entry.arch);
+          base_entry.epoch = g_ascii_strtoull (epoch, NULL, 10);
+          have_base = TRUE;
+
+          /* Same format as dnf_package_get_nevra(), which omits a 0 epoch */
+          g_autofree char *nevra
+              = base_entry.epoch
+                    ? g_strdup_printf ("%s-%s:%s-%s.%s", base_entry.name, epoch,
+                                       base_entry.version, base_entry.release, base_entry.arch)
+                    : g_strdup_printf ("%s-%s-%s.%s", base_entry.name, base_entry.version,
+                                       base_entry.release, base_entry.arch);
+          if (g_hash_table_contains (removed_nevras, nevra))
+            {
+              i_base++;
+              continue;
+            }
+        }
+
+      PkglistEntry added_entry;
+      if (i_added < sorted_added->len)
+        {
+          pkglist_entry_from_pkg ((DnfPackage *)sorted_added->pdata[i_added], &added_entry);
+          const int cmp = have_base ? pkglist_entry_cmp (&base_entry, &added_entry) : 1;
+          if (cmp >= 0)
+            {
+              pkglist_builder_add (&builder, &added_entry);
+              i_added++;
+              /* A package can't be in the rpmdb twice */
+              if (cmp == 0)
+                i_base++;
+              continue;
+            }
+        }
+      pkglist_builder_add (&builder, &base_entry);
+      i_base++;
+    }
+
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
 namespace rpmostreecxx
 {
 rust::Vec<rust::String>
@@ -1625,9 +1907,28 @@ advisory_free (gpointer p)
     dnf_advisory_free (adv);
 }
 
+/* Sort by severity, then ID; this is the order clients display them in */
+static int
+compare_advisory_variants (gconstpointer ap, gconstpointer bp)
+{
+  GVariant *a = *((GVariant **)ap);
+  GVariant *b = *((GVariant **)bp);
+
+  guint32 asev, bsev;
+  g_variant_get_child (a, 2, "u", &asev);
+  g_variant_get_child (b, 2, "u", &bsev);
+  if (asev != bsev)
+    return asev < bsev ? -1 : 1;
+
+  const char *aid, *bid;
+  g_variant_get_child (a, 0, "&s", &aid);
+  g_variant_get_child (b, 0, "&s", &bid);
+  return strcmp (aid, bid);
+}
+
 /* Go through the list of @pkgs and check if there are any advisories open for them. If
  * no advisories are found, returns %NULL. Otherwise, returns a GVariant of the type
- * RPMOSTREE_UPDATE_ADVISORY_GVARIANT_FORMAT.
+ * RPMOSTREE_UPDATE_ADVISORY_GVARIANT_FORMAT, sorted by severity and then ID.
  */
 GVariant *
 rpmostree_advisories_variant (DnfSack *sack, GPtrArray *pkgs)
@@ -1635,11 +1936,26 @@ rpmostree_advisories_variant (DnfSack *sack, GPtrArray *pkgs)
   g_autoptr (GHashTable) advisories = g_hash_table_new_full (
       advisory_hash, advisory_equal, advisory_free, (GDestroyNotify)g_ptr_array_unref);
 
+  /* dnf_package_get_advisories() walks all of the updateinfo for every package
+   * it's asked about, and most packages don't have any security advisory. So
+   * first find those that do in a single pass, and only look up those. */
+  g_autoptr (GHashTable) sec_nevras = g_hash_table_new (g_str_hash, g_str_equal);
+  hy_autoquery HyQuery sec_query = hy_query_create (sack);
+  hy_query_filter (sec_query, HY_PKG_ADVISORY_TYPE, HY_EQ, "security");
+  g_autoptr (GPtrArray) sec_pkgs = hy_query_run (sec_query);
+  for (guint i = 0; i < sec_pkgs->len; i++)
+    {
+      auto pkg = static_cast<DnfPackage *> (sec_pkgs->pdata[i]);
+      g_hash_table_add (sec_nevras, (gpointer)dnf_package_get_nevra (pkg));
+    }
+
   /* libdnf provides pkg -> set of advisories, but we want advisory -> set of pkgs;
    * making sure we only keep the pkgs we actually care about */
   for (guint i = 0; i < pkgs->len; i++)
     {
       auto pkg = static_cast<DnfPackage *> (pkgs->pdata[i]);
+      if (!g_hash_table_contains (sec_nevras, dnf_package_get_nevra (pkg)))
+        continue;
       g_autoptr (GPtrArray) advisories_with_pkg = dnf_package_get_advisories (pkg, HY_EQ);
       for (guint j = 0; j < advisories_with_pkg->len; j++)
         {
@@ -1667,10 +1983,17 @@ rpmostree_advisories_variant (DnfSack *sack, GPtrArray *pkgs)
   if (g_hash_table_size (advisories) == 0)
     return NULL;
 
+  /* Sort here once, rather than in every client rendering it */
+  g_autoptr (GPtrArray) sorted
+      = g_ptr_array_new_full (g_hash_table_size (advisories), (GDestroyNotify)g_variant_unref);
+  GLNX_HASH_TABLE_FOREACH_KV (advisories, DnfAdvisory *, advisory, GPtrArray *, pkgs)
+    g_ptr_array_add (sorted, g_variant_ref_sink (advisory_variant_new (advisory, pkgs)));
+  g_ptr_array_sort (sorted, compare_advisory_variants);
+
   g_auto (GVariantBuilder) builder;
   g_variant_builder_init (&builder, RPMOSTREE_UPDATE_ADVISORY_GVARIANT_FORMAT);
-  GLNX_HASH_TABLE_FOREACH_KV (advisories, DnfAdvisory *, advisory, GPtrArray *, pkgs)
-    g_variant_builder_add_value (&builder, advisory_variant_new (advisory, pkgs));
+  for (guint i = 0; i < sorted->len; i++)
+    g_variant_builder_add_value (&builder, static_cast<GVariant *> (sorted->pdata[i]));
   return g_variant_ref_sink (g_variant_builder_end (&builder));
 }
 
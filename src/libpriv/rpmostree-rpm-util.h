@@ -49,6 +49,7 @@ struct RpmHeaders
 {
   RpmOstreeRefTs *refts; /* rpm transaction set the headers belong to */
   GPtrArray *hs;         /* list of rpm header objects from <rpm.h> = Header */
+  GArray *keys;          /* sort keys extracted from @hs, in the same order */
 };
 
 typedef struct RpmHeaders RpmHeaders;
@@ -101,7 +102,14 @@ RpmOstreeRefSack *rpmostree_get_refsack_for_commit (OstreeRepo *repo, const char
 
 RpmOstreeRefSack *rpmostree_get_refsack_for_root (int dfd, const char *path, GError **error);
 
-gboolean rpmostree_get_base_refsack_for_root (int dfd, const char *path,
+RpmOstreeRefSack *rpmostree_get_refsack_for_commit_root (int dfd, const char *path,
+                                                         OstreeRepo *repo, const char *commit,
+                                                         GError **error);
+
+gboolean rpmostree_solv_cache_prune (OstreeRepo *repo, GCancellable *cancellable, GError **error);
+
+gboolean rpmostree_get_base_refsack_for_root (int dfd, const char *path, OstreeRepo *repo,
+                                              const char *base_commit,
                                               RpmOstreeRefSack **out_sack,
                                               GCancellable *cancellable, GError **error);
 
@@ -155,6 +163,9 @@ GPtrArray *rpmostree_sack_get_sorted_packages (DnfSack *sack);
 gboolean rpmostree_create_rpmdb_pkglist_variant (int dfd, const char *path, GVariant **out_variant,
                                                  GCancellable *cancellable, GError **error);
 
+GVariant *rpmostree_pkglist_variant_apply_delta (GVariant *base_pkglist, GPtrArray *removed,
+                                                 GPtrArray *added);
+
 char *rpmostree_get_cache_branch_for_n_evr_a (const char *name, const char *evr, const char *arch);
 char *rpmostree_get_cache_branch_header (Header hdr);
 char *rpmostree_get_cache_branch_pkg (DnfPackage *pkg);
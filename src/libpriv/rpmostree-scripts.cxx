@@ -21,15 +21,21 @@
 #include "config.h"
 
 #include "libglnx.h"
+#include "rpmostree-core.h"
 #include "rpmostree-cxxrs.h"
 #include "rpmostree-output.h"
 #include "rpmostree-util.h"
 #include <err.h>
 #include <gio/gio.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/statvfs.h>
 #include <systemd/sd-journal.h>
 
 #include "rpmostree-rpm-util.h"
 #include "rpmostree-scripts.h"
+#include "rpmostree-trace.h"
 
 #define RPMOSTREE_MESSAGE_PREPOST                                                                  \
   SD_ID128_MAKE (42, d3, 72, 22, dc, a2, 4a, 3b, 9d, 30, ce, d4, bb, bc, ac, d2)
@@ -250,64 +256,164 @@ rpmostree_script_txn_validate (DnfPackage *package, Header hdr, GCancellable *ca
   return TRUE;
 }
 
-/* Print the output of a script, with each line prefixed with
- * the script identifier (e.g. foo.post: bla bla bla).
+/* Returns how many of the scripts we'd run for @package it has, i.e. of
+ * %prein, %post and %posttrans, not counting ignored ones. */
+guint
+rpmostree_script_count (DnfPackage *package, Header hdr)
+{
+  const KnownRpmScriptKind *kinds[] = { &pre_script, &post_script, &posttrans_script };
+  guint n = 0;
+  for (guint i = 0; i < G_N_ELEMENTS (kinds); i++)
+    {
+      if (headerGetString (hdr, kinds[i]->tag) == NULL)
+        continue;
+      if (!rpmostreecxx::script_is_ignored (dnf_package_get_name (package), kinds[i]->desc))
+        n++;
+    }
+  return n;
+}
+
+/* When running a batch of scripts with rpmostree_script_run_batch_sync(),
+ * everything but the scripts themselves is serialized by this lock, which
+ * the workers only drop while waiting for their script. */
+static GMutex script_batch_lock;
+static thread_local gboolean holding_script_batch_lock;
+
+/* How much of a script's output we keep for error messages; the rest is only
+ * streamed out. */
+#define SCRIPT_OUTPUT_TAIL_SIZE (8 * 1024)
+
+/* Prints the output of a script as it arrives, with each line prefixed with
+ * the script identifier (e.g. foo.post: bla bla bla), keeping just the tail.
  */
-static gboolean
-dump_buffered_output (const char *prefix, GLnxTmpfile *tmpf, GError **error)
+typedef struct
 {
-  /* The tmpf won't be initialized in the journal case */
-  if (!tmpf->initialized)
-    return TRUE;
-  if (lseek (tmpf->fd, 0, SEEK_SET) < 0)
-    return glnx_throw_errno_prefix (error, "lseek");
-  g_autoptr (FILE) buf = fdopen (tmpf->fd, "r");
-  if (!buf)
-    return glnx_throw_errno_prefix (error, "fdopen");
-  tmpf->fd = -1; /* Ownership of fd was transferred */
+  const char *prefix;
+  int fd;      /* Read side of the script's stdout/stderr */
+  int stop_fd; /* eventfd, written once the script has exited */
+  GString *line;
+  GString *tail;
+  GThread *thread;
+} ScriptOutputStream;
 
+static void
+script_output_stream_process (ScriptOutputStream *stream, const char *buf, gsize len)
+{
+  g_string_append_len (stream->tail, buf, len);
+  /* Trim in bulk rather than on every read */
+  if (stream->tail->len > 2 * SCRIPT_OUTPUT_TAIL_SIZE)
+    g_string_erase (stream->tail, 0, stream->tail->len - SCRIPT_OUTPUT_TAIL_SIZE);
+
+  while (len > 0)
+    {
+      const char *nl = static_cast<const char *> (memchr (buf, '\n', len));
+      const gsize seglen = nl ? (gsize)(nl - buf) : len;
+      g_string_append_len (stream->line, buf, seglen);
+      if (!nl)
+        break;
+      printf ("%s: %s\n", stream->prefix, stream->line->str);
+      g_string_truncate (stream->line, 0);
+      buf += seglen + 1;
+      len -= seglen + 1;
+    }
+}
+
+static gpointer
+script_output_stream_thread (gpointer data)
+{
+  auto stream = static_cast<ScriptOutputStream *> (data);
+  gboolean stopping = FALSE;
+  char buf[4096];
   while (TRUE)
     {
-      size_t len = 0;
-      ssize_t bytes_read = 0;
-      g_autofree char *line = NULL;
-      errno = 0;
-      if ((bytes_read = getline (&line, &len, buf)) == -1)
+      if (!stopping)
         {
-          if (errno != 0)
-            return glnx_throw_errno_prefix (error, "getline");
-          else
+          struct pollfd pfds[2] = { { stream->fd, POLLIN, 0 }, { stream->stop_fd, POLLIN, 0 } };
+          if (TEMP_FAILURE_RETRY (poll (pfds, G_N_ELEMENTS (pfds), -1)) < 0)
             break;
+          /* Other processes may still hold the pipe open (e.g. a daemon the
+           * script left behind), so once the script has exited, just drain
+           * what's there. */
+          if (pfds[1].revents & POLLIN)
+            {
+              stopping = TRUE;
+              const int flags = fcntl (stream->fd, F_GETFL);
+              if (flags < 0 || fcntl (stream->fd, F_SETFL, flags | O_NONBLOCK) < 0)
+                break;
+            }
+          else if (!(pfds[0].revents & (POLLIN | POLLHUP | POLLERR)))
+            continue;
         }
-      printf ("%s: %s", prefix, line);
-      if (bytes_read > 0 && line[bytes_read - 1] != '\n')
-        fputc ('\n', stdout);
+      const ssize_t n = TEMP_FAILURE_RETRY (read (stream->fd, buf, sizeof (buf)));
+      if (n <= 0)
+        break;
+      script_output_stream_process (stream, buf, n);
     }
+  return NULL;
+}
 
-  return TRUE;
+/* Start streaming; @out_child_fd is the fd to give the script for its
+ * stdout and stderr. */
+static ScriptOutputStream *
+script_output_stream_new (const char *prefix, int *out_child_fd, GError **error)
+{
+  int pipefd[2];
+  if (pipe2 (pipefd, O_CLOEXEC) < 0)
+    return (ScriptOutputStream *)glnx_null_throw_errno_prefix (error, "pipe2");
+  int stop_fd = eventfd (0, EFD_CLOEXEC);
+  if (stop_fd < 0)
+    {
+      glnx_close_fd (&pipefd[0]);
+      glnx_close_fd (&pipefd[1]);
+      return (ScriptOutputStream *)glnx_null_throw_errno_prefix (error, "eventfd");
+    }
+
+  ScriptOutputStream *stream = g_new0 (ScriptOutputStream, 1);
+  stream->prefix = prefix;
+  stream->fd = pipefd[0];
+  stream->stop_fd = stop_fd;
+  stream->line = g_string_new ("");
+  stream->tail = g_string_new ("");
+  stream->thread = g_thread_new ("rpmostree-script-output", script_output_stream_thread, stream);
+  *out_child_fd = pipefd[1];
+  return stream;
 }
 
-/* Since it doesn't make sense to fatally error if printing output fails, catch
- * any errors there and print.
- */
-static void
-dump_buffered_output_noerr (const char *prefix, GLnxTmpfile *tmpf)
+/* Call once the script has exited; prints any final partial line and
+ * returns the tail of the output. */
+static char *
+script_output_stream_finish (ScriptOutputStream *stream)
 {
-  g_autoptr (GError) local_error = NULL;
-  if (!dump_buffered_output (prefix, tmpf, &local_error))
-    g_printerr ("While writing output: %s\n", local_error->message);
+  const guint64 one = 1;
+  if (TEMP_FAILURE_RETRY (write (stream->stop_fd, &one, sizeof (one))) < 0)
+    err (1, "eventfd write");
+  g_thread_join (stream->thread);
+  if (stream->line->len > 0)
+    printf ("%s: %s\n", stream->prefix, stream->line->str);
+  fflush (stdout);
+
+  if (stream->tail->len > SCRIPT_OUTPUT_TAIL_SIZE)
+    g_string_erase (stream->tail, 0, stream->tail->len - SCRIPT_OUTPUT_TAIL_SIZE);
+  char *tail = g_string_free (stream->tail, FALSE);
+  g_string_free (stream->line, TRUE);
+  glnx_close_fd (&stream->fd);
+  glnx_close_fd (&stream->stop_fd);
+  g_free (stream);
+  return tail;
 }
 
 /* Lowest level script handler in this file; create a bwrap instance and run it
- * synchronously.
+ * synchronously. If @bwrap_session is provided, the instance shares its
+ * rofiles-fuse mounts, rather than setting up its own.
  */
 gboolean
 rpmostree_run_script_in_bwrap_container (int rootfs_fd, GLnxTmpDir *var_lib_rpm_statedir,
-                                         gboolean enable_fuse, const char *name,
-                                         const char *scriptdesc, const char *interp,
-                                         const char *script, const char *script_arg,
-                                         int provided_stdin_fd, GCancellable *cancellable,
-                                         GError **error)
+                                         gboolean enable_fuse,
+                                         rpmostreecxx::BubblewrapSession *bwrap_session,
+                                         const char *name, const char *scriptdesc,
+                                         const char *interp, const char *script,
+                                         const char *script_arg, int provided_stdin_fd,
+                                         GCancellable *cancellable, GError **error)
 {
   g_assert (name != NULL);
   g_assert (name[0] != '\0');
@@ -334,7 +440,11 @@ rpmostree_run_script_in_bwrap_container (int rootfs_fd, GLnxTmpDir *var_lib_rpm_
   rpmostreecxx::BubblewrapMutability mutability
       = (is_glibc_locales || !enable_fuse) ? rpmostreecxx::BubblewrapMutability::MutateFreely
                                            : rpmostreecxx::BubblewrapMutability::RoFiles;
-  CXX_TRY_VAR (bwrap, rpmostreecxx::bubblewrap_new_with_mutability (rootfs_fd, mutability), error);
+  CXX_TRY_VAR (bwrap,
+               bwrap_session
+                   ? bwrap_session->new_bwrap (mutability)
+                   : rpmostreecxx::bubblewrap_new_with_mutability (rootfs_fd, mutability),
+               error);
   /* Scripts can see a /var with compat links like alternatives */
   CXX_TRY (bwrap->setup_compat_var (), error);
 
@@ -385,7 +495,7 @@ rpmostree_run_script_in_bwrap_container (int rootfs_fd, GLnxTmpDir *var_lib_rpm_
   int stdin_fd = -1;
   int stdout_fd = -1;
   int stderr_fd = -1;
-  int buffered_output_fd_child = -1;
+  int output_fd_child = -1;
 
   if (provided_stdin_fd != -1)
     {
@@ -395,9 +505,7 @@ rpmostree_run_script_in_bwrap_container (int rootfs_fd, GLnxTmpDir *var_lib_rpm_
       bwrap->take_stdin_fd (stdin_fd);
     }
 
-  g_auto (GLnxTmpfile) buffered_output = {
-    0,
-  };
+  ScriptOutputStream *output_stream = NULL;
   const char *id = glnx_strjoina ("rpm-ostree(", pkg_script, ")");
   if (debugging_script || stdin_fd == STDIN_FILENO)
     {
@@ -430,13 +538,12 @@ rpmostree_run_script_in_bwrap_container (int rootfs_fd, GLnxTmpDir *var_lib_rpm_
         }
       else
         {
-          /* In the non-journal case we buffer so we can prefix output */
-          if (!glnx_open_anonymous_tmpfile (O_RDWR | O_CLOEXEC, &buffered_output, error))
+          /* In the non-journal case we stream it ourselves so we can prefix
+           * output */
+          output_stream = script_output_stream_new (pkg_script, &output_fd_child, error);
+          if (!output_stream)
             return FALSE;
-          buffered_output_fd_child = fcntl (buffered_output.fd, F_DUPFD_CLOEXEC, 3);
-          if (buffered_output_fd_child < 0)
-            return glnx_throw_errno_prefix (error, "fcntl");
-          bwrap->take_stdout_and_stderr_fd (buffered_output_fd_child);
+          bwrap->take_stdout_and_stderr_fd (output_fd_child);
         }
 
       const int script_child_fd = 5;
@@ -450,21 +557,218 @@ rpmostree_run_script_in_bwrap_container (int rootfs_fd, GLnxTmpDir *var_lib_rpm_
 
   g_assert (cancellable);
   g_autoptr (GError) local_error = NULL;
-  if (!CXX (bwrap->run (*cancellable), &local_error))
+  /* Let the other scripts in the batch get to this point while we wait */
+  if (holding_script_batch_lock)
+    g_mutex_unlock (&script_batch_lock);
+  const gboolean script_ok = CXX (bwrap->run (*cancellable), &local_error);
+  g_autofree char *output_tail
+      = output_stream ? script_output_stream_finish (output_stream) : NULL;
+  if (holding_script_batch_lock)
+    g_mutex_lock (&script_batch_lock);
+  if (!script_ok)
     {
-      dump_buffered_output_noerr (pkg_script, &buffered_output);
       /* If errors go to the journal, help the user/admin find them there */
       if (rpmostreecxx::running_in_systemd ())
         return glnx_throw (error, "%s; run `journalctl -t '%s'` for more information",
                            local_error->message, id);
+      else if (output_tail && *output_tail)
+        return glnx_throw (error, "%s; last output:\n%s", local_error->message,
+                           g_strchomp (output_tail));
       else
         return g_propagate_error (error, util::move_nullify (local_error)), FALSE;
     }
-  dump_buffered_output_noerr (pkg_script, &buffered_output);
 
   return TRUE;
 }
 
+struct _RpmOstreeScriptTimings
+{
+  GMutex lock;
+  GPtrArray *entries; /* GVariant a{sv} */
+};
+
+RpmOstreeScriptTimings *
+rpmostree_script_timings_new (void)
+{
+  RpmOstreeScriptTimings *timings = g_new0 (RpmOstreeScriptTimings, 1);
+  g_mutex_init (&timings->lock);
+  timings->entries = g_ptr_array_new_with_free_func ((GDestroyNotify)g_variant_unref);
+  return timings;
+}
+
+void
+rpmostree_script_timings_free (RpmOstreeScriptTimings *timings)
+{
+  g_mutex_clear (&timings->lock);
+  g_ptr_array_unref (timings->entries);
+  g_free (timings);
+}
+
+/* Returns the RPMOSTREE_SCRIPTS_TIMING_KEY metadata, or NULL if no scripts
+ * were run. */
+GVariant *
+rpmostree_script_timings_to_variant (RpmOstreeScriptTimings *timings)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&timings->lock);
+  if (timings->entries->len == 0)
+    return NULL;
+  g_auto (GVariantBuilder) builder;
+  g_variant_builder_init (&builder, (GVariantType *)"aa{sv}");
+  for (guint i = 0; i < timings->entries->len; i++)
+    g_variant_builder_add_value (&builder, static_cast<GVariant *> (timings->entries->pdata[i]));
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+/* What a script used. CPU time and max RSS come from RUSAGE_CHILDREN, so
+ * when scripts run concurrently they include the others that finished in
+ * the meantime, and max RSS is the peak of any script so far; the script
+ * where it goes up is the one responsible. The rootfs bytes are how much
+ * the filesystem holding it grew, which can be negative. */
+typedef struct
+{
+  gint64 start_usec;
+  struct rusage start_ru;
+  struct statvfs start_vfs;
+  gboolean have_vfs;
+
+  guint64 wall_ms;
+  guint64 cpu_ms;
+  guint64 max_rss_kb;
+  gint64 rootfs_bytes;
+} ScriptUsage;
+
+static guint64
+rusage_cpu_usec (const struct rusage *ru)
+{
+  return (ru->ru_utime.tv_sec + ru->ru_stime.tv_sec) * G_USEC_PER_SEC + ru->ru_utime.tv_usec
+         + ru->ru_stime.tv_usec;
+}
+
+static void
+script_usage_begin (int rootfs_fd, ScriptUsage *usage)
+{
+  memset (usage, 0, sizeof (*usage));
+  (void)getrusage (RUSAGE_CHILDREN, &usage->start_ru);
+  usage->have_vfs = fstatvfs (rootfs_fd, &usage->start_vfs) == 0;
+  usage->start_usec = g_get_monotonic_time ();
+}
+
+/* Compute the usage since script_usage_begin(), and add it to @timings if
+ * set. */
+static void
+script_usage_end (int rootfs_fd, ScriptUsage *usage, RpmOstreeScriptTimings *timings,
+                  const char *pkg_name, const char *scriptdesc)
+{
+  usage->wall_ms = (g_get_monotonic_time () - usage->start_usec) / 1000;
+  struct rusage ru;
+  if (getrusage (RUSAGE_CHILDREN, &ru) == 0)
+    {
+      usage->cpu_ms = (rusage_cpu_usec (&ru) - rusage_cpu_usec (&usage->start_ru)) / 1000;
+      usage->max_rss_kb = ru.ru_maxrss;
+    }
+  struct statvfs vfs;
+  if (usage->have_vfs && fstatvfs (rootfs_fd, &vfs) == 0)
+    usage->rootfs_bytes = ((gint64)usage->start_vfs.f_bfree - (gint64)vfs.f_bfree) * vfs.f_frsize;
+
+  if (!timings)
+    return;
+  g_auto (GVariantDict) dict;
+  g_variant_dict_init (&dict, NULL);
+  g_variant_dict_insert (&dict, "package", "s", pkg_name);
+  g_variant_dict_insert (&dict, "script", "s", scriptdesc);
+  g_variant_dict_insert (&dict, "wall-ms", "t", usage->wall_ms);
+  g_variant_dict_insert (&dict, "cpu-ms", "t", usage->cpu_ms);
+  g_variant_dict_insert (&dict, "max-rss-kb", "t", usage->max_rss_kb);
+  g_variant_dict_insert (&dict, "rootfs-bytes", "x", usage->rootfs_bytes);
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&timings->lock);
+  g_ptr_array_add (timings->entries, g_variant_ref_sink (g_variant_dict_end (&dict)));
+}
+
+struct _RpmOstreeDeferredScripts
+{
+  GMutex lock;
+  GPtrArray *commands; /* In the order first seen */
+  GHashTable *pkgs;    /* command -> GPtrArray of package names */
+};
+
+RpmOstreeDeferredScripts *
+rpmostree_deferred_scripts_new (void)
+{
+  RpmOstreeDeferredScripts *deferred = g_new0 (RpmOstreeDeferredScripts, 1);
+  g_mutex_init (&deferred->lock);
+  deferred->commands = g_ptr_array_new ();
+  deferred->pkgs
+      = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_ptr_array_unref);
+  return deferred;
+}
+
+void
+rpmostree_deferred_scripts_free (RpmOstreeDeferredScripts *deferred)
+{
+  g_mutex_clear (&deferred->lock);
+  g_ptr_array_unref (deferred->commands);
+  g_hash_table_unref (deferred->pkgs);
+  g_free (deferred);
+}
+
+static void
+deferred_scripts_add (RpmOstreeDeferredScripts *deferred, const char *command,
+                      const char *pkg_name)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&deferred->lock);
+  auto pkgs = static_cast<GPtrArray *> (g_hash_table_lookup (deferred->pkgs, command));
+  if (!pkgs)
+    {
+      char *key = g_strdup (command);
+      pkgs = g_ptr_array_new_with_free_func (g_free);
+      g_hash_table_insert (deferred->pkgs, key, pkgs);
+      g_ptr_array_add (deferred->commands, key);
+    }
+  g_ptr_array_add (pkgs, g_strdup (pkg_name));
+}
+
+/* Run each of the scripts collected in @deferred once, then forget them.
+ * These were already counted as run when they were deferred. */
+gboolean
+rpmostree_deferred_scripts_run_sync (RpmOstreeDeferredScripts *deferred, int rootfs_fd,
+                                     GLnxTmpDir *var_lib_rpm_statedir, gboolean enable_fuse,
+                                     rpmostreecxx::BubblewrapSession *bwrap_session,
+                                     RpmOstreeScriptTimings *timings, GCancellable *cancellable,
+                                     GError **error)
+{
+  for (guint i = 0; i < deferred->commands->len; i++)
+    {
+      auto command = static_cast<const char *> (deferred->commands->pdata[i]);
+      auto pkgs = static_cast<GPtrArray *> (g_hash_table_lookup (deferred->pkgs, command));
+      g_ptr_array_add (pkgs, NULL);
+      g_autofree char *pkgs_str = g_strjoinv (", ", (char **)pkgs->pdata);
+      const char *first_pkg = static_cast<const char *> (pkgs->pdata[0]);
+
+      ScriptUsage usage;
+      script_usage_begin (rootfs_fd, &usage);
+      if (!rpmostree_run_script_in_bwrap_container (rootfs_fd, var_lib_rpm_statedir, enable_fuse,
+                                                    bwrap_session, first_pkg, "%post",
+                                                    "/bin/sh", command, "1", -1, cancellable,
+                                                    error))
+        return glnx_prefix_error (error, "Running deferred %%post `%s` for %s", command,
+                                  pkgs_str);
+      script_usage_end (rootfs_fd, &usage, timings, first_pkg, "%post");
+
+      sd_journal_send ("MESSAGE_ID=" SD_ID128_FORMAT_STR,
+                       SD_ID128_FORMAT_VAL (RPMOSTREE_MESSAGE_PREPOST),
+                       "MESSAGE=Executed deferred %%post `%s` for %s in %" G_GUINT64_FORMAT " ms",
+                       command, pkgs_str, usage.wall_ms, "SCRIPT_TYPE=%%post", "PKG=%s",
+                       pkgs_str, "EXEC_TIME_MS=%" G_GUINT64_FORMAT, usage.wall_ms,
+                       "CPU_TIME_MS=%" G_GUINT64_FORMAT, usage.cpu_ms,
+                       "MAX_RSS_KB=%" G_GUINT64_FORMAT, usage.max_rss_kb,
+                       "ROOTFS_BYTES=%" G_GINT64_FORMAT, usage.rootfs_bytes, NULL);
+    }
+
+  g_ptr_array_set_size (deferred->commands, 0);
+  g_hash_table_remove_all (deferred->pkgs);
+  return TRUE;
+}
+
 /* Medium level script entrypoint; we already validated it exists and isn't
  * ignored. Here we mostly compute arguments/input, then proceed into the lower
  * level bwrap execution.
@@ -472,6 +776,8 @@ rpmostree_run_script_in_bwrap_container (int rootfs_fd, GLnxTmpDir *var_lib_rpm_
 static gboolean
 impl_run_rpm_script (const KnownRpmScriptKind *rpmscript, DnfPackage *pkg, Header hdr,
                      int rootfs_fd, GLnxTmpDir *var_lib_rpm_statedir, gboolean enable_fuse,
+                     rpmostreecxx::BubblewrapSession *bwrap_session,
+                     RpmOstreeScriptTimings *timings, RpmOstreeDeferredScripts *deferred,
                      GCancellable *cancellable, GError **error)
 {
   struct rpmtd_s td;
@@ -483,6 +789,7 @@ impl_run_rpm_script (const KnownRpmScriptKind *rpmscript, DnfPackage *pkg, Heade
   const char *script;
   const char *interp = (args && args[0]) ? args[0] : "/bin/sh";
   const char *pkg_scriptid = glnx_strjoina (dnf_package_get_name (pkg), ".", rpmscript->desc + 1);
+  rpmostreecxx::TraceSpan span ("script", pkg_scriptid);
   gboolean expand = (flags & RPMSCRIPT_FLAG_EXPAND) > 0;
   if (g_str_equal (interp, lua_builtin))
     {
@@ -536,6 +843,18 @@ impl_run_rpm_script (const KnownRpmScriptKind *rpmscript, DnfPackage *pkg, Heade
     script = script_owned = rpmExpand (script, NULL);
   (void)script_owned; /* Pacify static analysis */
 
+  if (deferred)
+    {
+      auto command = rpmostreecxx::script_deferred_command (interp, script);
+      if (!command.empty ())
+        {
+          g_debug ("Deferring %s for %s: %s", rpmscript->desc, dnf_package_get_name (pkg),
+                   command.c_str ());
+          deferred_scripts_add (deferred, command.c_str (), dnf_package_get_name (pkg));
+          return TRUE;
+        }
+    }
+
   /* http://ftp.rpm.org/max-rpm/s1-rpm-inside-scripts.html#S2-RPM-INSIDE-ERASE-TIME-SCRIPTS */
   const char *script_arg = NULL;
   switch (dnf_package_get_action (pkg))
@@ -561,20 +880,23 @@ impl_run_rpm_script (const KnownRpmScriptKind *rpmscript, DnfPackage *pkg, Heade
       break;
     }
 
-  guint64 start_time_ms = g_get_monotonic_time () / 1000;
+  ScriptUsage usage;
+  script_usage_begin (rootfs_fd, &usage);
   if (!rpmostree_run_script_in_bwrap_container (rootfs_fd, var_lib_rpm_statedir, enable_fuse,
-                                                dnf_package_get_name (pkg), rpmscript->desc, interp,
-                                                script, script_arg, -1, cancellable, error))
+                                                bwrap_session, dnf_package_get_name (pkg),
+                                                rpmscript->desc, interp, script, script_arg, -1,
+                                                cancellable, error))
     return glnx_prefix_error (error, "Running %s for %s", rpmscript->desc,
                               dnf_package_get_name (pkg));
-  guint64 end_time_ms = g_get_monotonic_time () / 1000;
-  guint64 elapsed_ms = end_time_ms - start_time_ms;
+  script_usage_end (rootfs_fd, &usage, timings, dnf_package_get_name (pkg), rpmscript->desc);
 
   sd_journal_send (
       "MESSAGE_ID=" SD_ID128_FORMAT_STR, SD_ID128_FORMAT_VAL (RPMOSTREE_MESSAGE_PREPOST),
       "MESSAGE=Executed %s for %s in %" G_GUINT64_FORMAT " ms", rpmscript->desc,
-      dnf_package_get_name (pkg), elapsed_ms, "SCRIPT_TYPE=%s", rpmscript->desc, "PKG=%s",
-      dnf_package_get_name (pkg), "EXEC_TIME_MS=%" G_GUINT64_FORMAT, elapsed_ms, NULL);
+      dnf_package_get_name (pkg), usage.wall_ms, "SCRIPT_TYPE=%s", rpmscript->desc, "PKG=%s",
+      dnf_package_get_name (pkg), "EXEC_TIME_MS=%" G_GUINT64_FORMAT, usage.wall_ms,
+      "CPU_TIME_MS=%" G_GUINT64_FORMAT, usage.cpu_ms, "MAX_RSS_KB=%" G_GUINT64_FORMAT,
+      usage.max_rss_kb, "ROOTFS_BYTES=%" G_GINT64_FORMAT, usage.rootfs_bytes, NULL);
 
   return TRUE;
 }
@@ -584,8 +906,10 @@ impl_run_rpm_script (const KnownRpmScriptKind *rpmscript, DnfPackage *pkg, Heade
  */
 static gboolean
 run_script (const KnownRpmScriptKind *rpmscript, DnfPackage *pkg, Header hdr, int rootfs_fd,
-            GLnxTmpDir *var_lib_rpm_statedir, gboolean enable_fuse, gboolean *out_did_run,
-            GCancellable *cancellable, GError **error)
+            GLnxTmpDir *var_lib_rpm_statedir, gboolean enable_fuse,
+            rpmostreecxx::BubblewrapSession *bwrap_session, RpmOstreeScriptTimings *timings,
+            RpmOstreeDeferredScripts *deferred, gboolean *out_did_run, GCancellable *cancellable,
+            GError **error)
 {
   rpmTagVal tagval = rpmscript->tag;
   rpmTagVal progtagval = rpmscript->progtag;
@@ -605,7 +929,7 @@ run_script (const KnownRpmScriptKind *rpmscript, DnfPackage *pkg, Header hdr, in
 
   *out_did_run = TRUE;
   return impl_run_rpm_script (rpmscript, pkg, hdr, rootfs_fd, var_lib_rpm_statedir, enable_fuse,
-                              cancellable, error);
+                              bwrap_session, timings, deferred, cancellable, error);
 }
 
 static gboolean
@@ -673,13 +997,49 @@ write_subdir (int dfd, const char *path, GString *prefix, FILE *f, guint *inout_
   return TRUE;
 }
 
+/* Write the paths in the sorted @changed_paths which are under @dir (with a
+ * trailing '/') to @f. */
+static gboolean
+write_matching_changed_paths (GPtrArray *changed_paths, const char *dir, FILE *f,
+                              guint *inout_n_matched, GError **error)
+{
+  /* Find the first path >= @dir; all the ones under it follow */
+  guint lo = 0;
+  guint hi = changed_paths->len;
+  while (lo < hi)
+    {
+      const guint mid = lo + (hi - lo) / 2;
+      if (strcmp (static_cast<const char *> (changed_paths->pdata[mid]), dir) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  g_autoptr (GString) buf = g_string_new ("");
+  for (guint i = lo; i < changed_paths->len; i++)
+    {
+      auto path = static_cast<const char *> (changed_paths->pdata[i]);
+      if (!g_str_has_prefix (path, dir))
+        break;
+      g_string_assign (buf, path);
+      if (!write_filename (f, buf, error))
+        return FALSE;
+      (*inout_n_matched)++;
+    }
+
+  return TRUE;
+}
+
 /* Given file trigger @pattern (really a subdirectory), traverse the
  * filesystem @rootfs_fd and write all matches as file names to @f.  Used
- * for %transfiletriggerin.
+ * for %transfiletriggerin. If @changed_paths is provided, only those of its
+ * (sorted, absolute) paths which match are written instead, like librpm
+ * does.
  */
 static gboolean
-find_and_write_matching_files (int rootfs_fd, const char *pattern, FILE *f, guint *out_n_matches,
-                               GCancellable *cancellable, GError **error)
+find_and_write_matching_files (int rootfs_fd, const char *pattern, GPtrArray *changed_paths,
+                               FILE *f, guint *out_n_matches, GCancellable *cancellable,
+                               GError **error)
 {
   GLNX_AUTO_PREFIX_ERROR ("Finding matches", error);
 
@@ -698,20 +1058,108 @@ find_and_write_matching_files (int rootfs_fd, const char *pattern, FILE *f, guin
     g_string_truncate (buf, buf->len - 1);
 
   guint n_pattern_matches = 0;
-  if (!write_subdir (rootfs_fd, pattern, buf, f, &n_pattern_matches, cancellable, error))
+  if (changed_paths)
+    {
+      g_string_append_c (buf, '/');
+      if (!write_matching_changed_paths (changed_paths, buf->str, f, &n_pattern_matches, error))
+        return glnx_prefix_error (error, "pattern '%s'", pattern);
+    }
+  else if (!write_subdir (rootfs_fd, pattern, buf, f, &n_pattern_matches, cancellable, error))
     return glnx_prefix_error (error, "pattern '%s'", pattern);
   *out_n_matches += n_pattern_matches;
 
   return TRUE;
 }
 
-/* Execute a supported script.  Note that @cancellable
- * does not currently kill a running script subprocess.
+/* Add the %transfiletriggerin patterns of @hdr to @builder, returning FALSE
+ * if there aren't any.
+ */
+static gboolean
+add_transfiletriggerin_patterns (Header hdr, GVariantBuilder *builder)
+{
+  headerGetFlags hgflags = HEADERGET_MINMEM;
+  struct rpmtd_s tname, tflags;
+  if (!headerGet (hdr, RPMTAG_TRANSFILETRIGGERNAME, &tname, hgflags))
+    return FALSE;
+  headerGet (hdr, RPMTAG_TRANSFILETRIGGERFLAGS, &tflags, hgflags);
+
+  gboolean found = FALSE;
+  const guint n_names = rpmtdCount (&tname);
+  for (guint j = 0; j < n_names; j++)
+    {
+      rpmFlags sense = 0;
+      if (rpmtdSetIndex (&tflags, j) >= 0)
+        sense = rpmtdGetNumber (&tflags);
+      if (!(sense & RPMSENSE_TRIGGERIN))
+        continue;
+      g_assert_cmpint (rpmtdSetIndex (&tname, j), ==, j);
+      const char *pattern = rpmtdGetString (&tname);
+      if (!pattern)
+        continue;
+      g_variant_builder_add (builder, "s", pattern);
+      found = TRUE;
+    }
+  rpmtdFreeData (&tname);
+  rpmtdFreeData (&tflags);
+  return found;
+}
+
+/* Build the RPMOSTREE_TRANSFILETRIGGERS_INDEX_KEY metadata for the rpmdb in
+ * @rootfs_fd. This is computed at compose time so that client-side layering
+ * only needs to read the headers of the few packages which have triggers,
+ * rather than walking the whole base rpmdb.
+ */
+gboolean
+rpmostree_transfiletriggers_build_index (int rootfs_fd, GVariant **out_index, GError **error)
+{
+  GLNX_AUTO_PREFIX_ERROR ("Building transfiletrigger index", error);
+
+  g_auto (GVariantBuilder) builder;
+  g_variant_builder_init (&builder, G_VARIANT_TYPE (RPMOSTREE_TRANSFILETRIGGERS_INDEX_FORMAT));
+
+  if (!glnx_fstatat_allow_noent (rootfs_fd, RPMOSTREE_RPMDB_LOCATION, NULL, AT_SYMLINK_NOFOLLOW,
+                                 error))
+    return FALSE;
+  if (errno == 0)
+    {
+      g_autofree char *rootfs_path = glnx_fdrel_abspath (rootfs_fd, ".");
+      g_auto (rpmts) ts = rpmtsCreate ();
+      rpmtsSetVSFlags (ts, _RPMVSF_NODIGESTS | _RPMVSF_NOSIGNATURES);
+      if (rpmtsSetRootDir (ts, rootfs_path) != 0)
+        return glnx_throw (error, "Failed to set rpm root to %s", rootfs_path);
+
+      /* Triggers are looked up by name, so only list each name once */
+      g_autoptr (GHashTable) seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+      g_auto (rpmdbMatchIterator) mi = rpmtsInitIterator (ts, RPMDBI_PACKAGES, NULL, 0);
+      Header hdr;
+      while (mi && (hdr = rpmdbNextIterator (mi)) != NULL)
+        {
+          const char *name = headerGetString (hdr, RPMTAG_NAME);
+          if (!name || g_hash_table_contains (seen, name))
+            continue;
+
+          g_auto (GVariantBuilder) patterns;
+          g_variant_builder_init (&patterns, G_VARIANT_TYPE_STRING_ARRAY);
+          if (!add_transfiletriggerin_patterns (hdr, &patterns))
+            continue;
+          g_variant_builder_add (&builder, "(sas)", name, &patterns);
+          g_hash_table_add (seen, g_strdup (name));
+        }
+    }
+
+  *out_index = g_variant_ref_sink (g_variant_builder_end (&builder));
+  return TRUE;
+}
+
+/* Execute a supported script.  If @cancellable is triggered, a running
+ * script subprocess is terminated (and killed if it doesn't exit promptly).
  */
 gboolean
 rpmostree_script_run_sync (DnfPackage *pkg, Header hdr, RpmOstreeScriptKind kind, int rootfs_fd,
-                           GLnxTmpDir *var_lib_rpm_statedir, gboolean enable_fuse, guint *out_n_run,
-                           GCancellable *cancellable, GError **error)
+                           GLnxTmpDir *var_lib_rpm_statedir, gboolean enable_fuse,
+                           rpmostreecxx::BubblewrapSession *bwrap_session,
+                           RpmOstreeScriptTimings *timings, RpmOstreeDeferredScripts *deferred,
+                           guint *out_n_run, GCancellable *cancellable, GError **error)
 {
   const KnownRpmScriptKind *scriptkind;
   switch (kind)
@@ -730,8 +1178,8 @@ rpmostree_script_run_sync (DnfPackage *pkg, Header hdr, RpmOstreeScriptKind kind
     }
 
   gboolean did_run = FALSE;
-  if (!run_script (scriptkind, pkg, hdr, rootfs_fd, var_lib_rpm_statedir, enable_fuse, &did_run,
-                   cancellable, error))
+  if (!run_script (scriptkind, pkg, hdr, rootfs_fd, var_lib_rpm_statedir, enable_fuse,
+                   bwrap_session, timings, deferred, &did_run, cancellable, error))
     return FALSE;
 
   if (did_run)
@@ -739,11 +1187,103 @@ rpmostree_script_run_sync (DnfPackage *pkg, Header hdr, RpmOstreeScriptKind kind
   return TRUE;
 }
 
+typedef struct
+{
+  DnfPackage *pkg;
+  Header hdr;
+  RpmOstreeScriptKind kind;
+  int rootfs_fd;
+  GLnxTmpDir *var_lib_rpm_statedir;
+  gboolean enable_fuse;
+  rpmostreecxx::BubblewrapSession *bwrap_session;
+  RpmOstreeScriptTimings *timings;
+  RpmOstreeDeferredScripts *deferred;
+  GCancellable *cancellable;
+  guint n_run;
+  GError *error;
+} ScriptBatchItem;
+
+static gpointer
+script_batch_worker (gpointer data)
+{
+  auto item = static_cast<ScriptBatchItem *> (data);
+  g_mutex_lock (&script_batch_lock);
+  holding_script_batch_lock = TRUE;
+  (void)rpmostree_script_run_sync (item->pkg, item->hdr, item->kind, item->rootfs_fd,
+                                   item->var_lib_rpm_statedir, item->enable_fuse,
+                                   item->bwrap_session, item->timings, item->deferred,
+                                   &item->n_run, item->cancellable, &item->error);
+  holding_script_batch_lock = FALSE;
+  g_mutex_unlock (&script_batch_lock);
+  return NULL;
+}
+
+/* Like rpmostree_script_run_sync(), but run the scripts of all of @pkgs (whose
+ * headers are @hdrs) at the same time; it's up to the caller to only pass
+ * packages which don't depend on each other. If any fail, the error of the
+ * first one in order is returned, once they've all finished.
+ */
+gboolean
+rpmostree_script_run_batch_sync (GPtrArray *pkgs, GPtrArray *hdrs, RpmOstreeScriptKind kind,
+                                 int rootfs_fd, GLnxTmpDir *var_lib_rpm_statedir,
+                                 gboolean enable_fuse,
+                                 rpmostreecxx::BubblewrapSession *bwrap_session,
+                                 RpmOstreeScriptTimings *timings,
+                                 RpmOstreeDeferredScripts *deferred, guint *out_n_run,
+                                 GCancellable *cancellable, GError **error)
+{
+  g_assert_cmpuint (pkgs->len, ==, hdrs->len);
+  if (pkgs->len == 1)
+    return rpmostree_script_run_sync (static_cast<DnfPackage *> (pkgs->pdata[0]),
+                                      static_cast<Header> (hdrs->pdata[0]), kind, rootfs_fd,
+                                      var_lib_rpm_statedir, enable_fuse, bwrap_session, timings,
+                                      deferred, out_n_run, cancellable, error);
+
+  g_autofree ScriptBatchItem *items = g_new0 (ScriptBatchItem, pkgs->len);
+  g_autoptr (GPtrArray) threads = g_ptr_array_new ();
+  for (guint i = 0; i < pkgs->len; i++)
+    {
+      ScriptBatchItem *item = &items[i];
+      item->pkg = static_cast<DnfPackage *> (pkgs->pdata[i]);
+      item->hdr = static_cast<Header> (hdrs->pdata[i]);
+      item->kind = kind;
+      item->rootfs_fd = rootfs_fd;
+      item->var_lib_rpm_statedir = var_lib_rpm_statedir;
+      item->enable_fuse = enable_fuse;
+      item->bwrap_session = bwrap_session;
+      item->timings = timings;
+      item->deferred = deferred;
+      item->cancellable = cancellable;
+      g_ptr_array_add (threads, g_thread_new ("rpmostree-script", script_batch_worker, item));
+    }
+
+  gboolean ret = TRUE;
+  for (guint i = 0; i < pkgs->len; i++)
+    {
+      g_thread_join (static_cast<GThread *> (threads->pdata[i]));
+      *out_n_run += items[i].n_run;
+      if (items[i].error && ret)
+        {
+          g_propagate_error (error, util::move_nullify (items[i].error));
+          ret = FALSE;
+        }
+      g_clear_error (&items[i].error);
+    }
+
+  return ret;
+}
+
 /* File triggers, as used by e.g. glib2.spec and vagrant.spec in Fedora. More
  * info at <http://rpm.org/user_doc/file_triggers.html>.
+ *
+ * If @changed_paths is non-NULL, it's the sorted list of files added by this
+ * transaction, and the triggers are only fed (and only run for) those;
+ * otherwise every file under the trigger directories is used.
  */
 gboolean
 rpmostree_transfiletriggers_run_sync (Header hdr, int rootfs_fd, gboolean enable_fuse,
+                                      rpmostreecxx::BubblewrapSession *bwrap_session,
+                                      RpmOstreeScriptTimings *timings, GPtrArray *changed_paths,
                                       guint *out_n_run, GCancellable *cancellable, GError **error)
 {
   const char *pkg_name = headerGetString (hdr, RPMTAG_NAME);
@@ -892,10 +1432,10 @@ rpmostree_transfiletriggers_run_sync (Header hdr, int rootfs_fd, gboolean enable
           if (j > 0)
             g_string_append (patterns_joined, ", ");
           g_string_append (patterns_joined, pattern);
-          if (!find_and_write_matching_files (rootfs_fd, pattern, tmpf_file, &n_matched,
-                                              cancellable, error))
+          if (!find_and_write_matching_files (rootfs_fd, pattern, changed_paths, tmpf_file,
+                                              &n_matched, cancellable, error))
             return FALSE;
-          if (n_matched == 0)
+          if (n_matched == 0 && !changed_paths)
             {
               /* This is probably a bug...let's log it */
               sd_journal_print (LOG_INFO, "No files matched %%transfiletriggerin(%s) for %s",
@@ -915,13 +1455,14 @@ rpmostree_transfiletriggers_run_sync (Header hdr, int rootfs_fd, gboolean enable
         return glnx_throw_errno_prefix (error, "lseek");
 
       /* Run it, and log the result */
-      guint64 start_time_ms = g_get_monotonic_time () / 1000;
-      if (!rpmostree_run_script_in_bwrap_container (rootfs_fd, NULL, enable_fuse, pkg_name,
-                                                    "%transfiletriggerin", interp, script, NULL,
-                                                    fileno (tmpf_file), cancellable, error))
+      ScriptUsage usage;
+      script_usage_begin (rootfs_fd, &usage);
+      if (!rpmostree_run_script_in_bwrap_container (rootfs_fd, NULL, enable_fuse, bwrap_session,
+                                                    pkg_name, "%transfiletriggerin", interp,
+                                                    script, NULL, fileno (tmpf_file), cancellable,
+                                                    error))
         return FALSE;
-      guint64 end_time_ms = g_get_monotonic_time () / 1000;
-      guint64 elapsed_ms = end_time_ms - start_time_ms;
+      script_usage_end (rootfs_fd, &usage, timings, pkg_name, "%transfiletriggerin");
 
       (*out_n_run)++;
 
@@ -929,11 +1470,13 @@ rpmostree_transfiletriggers_run_sync (Header hdr, int rootfs_fd, gboolean enable
                        SD_ID128_FORMAT_VAL (RPMOSTREE_MESSAGE_FILETRIGGER),
                        "MESSAGE=Executed %%transfiletriggerin(%s) for %s in %" G_GUINT64_FORMAT
                        " ms; %u matched files",
-                       pkg_name, patterns_joined->str, elapsed_ms, n_total_matched,
-                       "SCRIPT_TYPE=%%transfiletriggerin"
-                       "PKG=%s",
-                       pkg_name, "PATTERNS=%s", patterns_joined->str, "TRIGGER_N_MATCHES=%u",
-                       n_total_matched, "EXEC_TIME_MS=%" G_GUINT64_FORMAT, elapsed_ms, NULL);
+                       pkg_name, patterns_joined->str, usage.wall_ms, n_total_matched,
+                       "SCRIPT_TYPE=%%transfiletriggerin", "PKG=%s", pkg_name, "PATTERNS=%s",
+                       patterns_joined->str, "TRIGGER_N_MATCHES=%u", n_total_matched,
+                       "EXEC_TIME_MS=%" G_GUINT64_FORMAT, usage.wall_ms,
+                       "CPU_TIME_MS=%" G_GUINT64_FORMAT, usage.cpu_ms,
+                       "MAX_RSS_KB=%" G_GUINT64_FORMAT, usage.max_rss_kb,
+                       "ROOTFS_BYTES=%" G_GINT64_FORMAT, usage.rootfs_bytes, NULL);
     }
   return TRUE;
 }
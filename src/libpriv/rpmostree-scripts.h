@@ -31,6 +31,7 @@
 #include <rpm/rpmts.h>
 
 #include "libglnx.h"
+#include "rpmostree-cxxrs.h"
 
 G_BEGIN_DECLS
 
@@ -41,17 +42,76 @@ typedef enum
   RPMOSTREE_SCRIPT_POSTTRANS,
 } RpmOstreeScriptKind;
 
+/* Commit metadata recording how long each script took and what it used, as
+ * an array of dicts with keys "package", "script", "wall-ms", "cpu-ms",
+ * "max-rss-kb" and "rootfs-bytes". */
+#define RPMOSTREE_SCRIPTS_TIMING_KEY "rpmostree.scripts-timing"
+
+/* Collects the resource usage of each script run; adding to it is
+ * thread-safe. */
+typedef struct _RpmOstreeScriptTimings RpmOstreeScriptTimings;
+
+RpmOstreeScriptTimings *rpmostree_script_timings_new (void);
+
+void rpmostree_script_timings_free (RpmOstreeScriptTimings *timings);
+
+GVariant *rpmostree_script_timings_to_variant (RpmOstreeScriptTimings *timings);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (RpmOstreeScriptTimings, rpmostree_script_timings_free);
+
+/* The %post scripts which just regenerate a cache (e.g. ldconfig) are
+ * collected here rather than being run, so that each distinct one is only
+ * run once, after all the others. Adding to it is thread-safe. */
+typedef struct _RpmOstreeDeferredScripts RpmOstreeDeferredScripts;
+
+RpmOstreeDeferredScripts *rpmostree_deferred_scripts_new (void);
+
+void rpmostree_deferred_scripts_free (RpmOstreeDeferredScripts *deferred);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (RpmOstreeDeferredScripts, rpmostree_deferred_scripts_free);
+
+gboolean rpmostree_deferred_scripts_run_sync (RpmOstreeDeferredScripts *deferred, int rootfs_fd,
+                                              GLnxTmpDir *var_lib_rpm_statedir,
+                                              gboolean enable_rofiles,
+                                              rpmostreecxx::BubblewrapSession *bwrap_session,
+                                              RpmOstreeScriptTimings *timings,
+                                              GCancellable *cancellable, GError **error);
+
 gboolean rpmostree_script_txn_validate (DnfPackage *package, Header hdr, GCancellable *cancellable,
                                         GError **error);
 
+guint rpmostree_script_count (DnfPackage *package, Header hdr);
+
 gboolean rpmostree_script_run_sync (DnfPackage *pkg, Header hdr, RpmOstreeScriptKind kind,
                                     int rootfs_fd, GLnxTmpDir *var_lib_rpm_statedir,
-                                    gboolean enable_rofiles, guint *out_n_run,
+                                    gboolean enable_rofiles,
+                                    rpmostreecxx::BubblewrapSession *bwrap_session,
+                                    RpmOstreeScriptTimings *timings,
+                                    RpmOstreeDeferredScripts *deferred, guint *out_n_run,
                                     GCancellable *cancellable, GError **error);
 
+gboolean rpmostree_script_run_batch_sync (GPtrArray *pkgs, GPtrArray *hdrs,
+                                          RpmOstreeScriptKind kind, int rootfs_fd,
+                                          GLnxTmpDir *var_lib_rpm_statedir,
+                                          gboolean enable_rofiles,
+                                          rpmostreecxx::BubblewrapSession *bwrap_session,
+                                          RpmOstreeScriptTimings *timings,
+                                          RpmOstreeDeferredScripts *deferred, guint *out_n_run,
+                                          GCancellable *cancellable, GError **error);
+
 gboolean rpmostree_transfiletriggers_run_sync (Header hdr, int rootfs_fd, gboolean enable_rofiles,
-                                               guint *out_n_run, GCancellable *cancellable,
-                                               GError **error);
+                                               rpmostreecxx::BubblewrapSession *bwrap_session,
+                                               RpmOstreeScriptTimings *timings,
+                                               GPtrArray *changed_paths, guint *out_n_run,
+                                               GCancellable *cancellable, GError **error);
+
+/* Commit metadata listing the packages with %transfiletriggerin scripts, as
+ * an array of (name, trigger patterns) */
+#define RPMOSTREE_TRANSFILETRIGGERS_INDEX_KEY "rpmostree.rpmdb.transfiletriggers"
+#define RPMOSTREE_TRANSFILETRIGGERS_INDEX_FORMAT "a(sas)"
+
+gboolean rpmostree_transfiletriggers_build_index (int rootfs_fd, GVariant **out_index,
+                                                  GError **error);
 
 gboolean rpmostree_deployment_sanitycheck_true (int rootfs_fd, GCancellable *cancellable,
                                                 GError **error);
@@ -61,10 +121,11 @@ gboolean rpmostree_deployment_sanitycheck_rpmdb (int rootfs_fd, GPtrArray *overl
                                                  GError **error);
 
 gboolean rpmostree_run_script_in_bwrap_container (int rootfs_fd, GLnxTmpDir *var_lib_rpm_statedir,
-                                                  gboolean enable_fuse, const char *name,
-                                                  const char *scriptdesc, const char *interp,
-                                                  const char *script, const char *script_arg,
-                                                  int stdin_fd, GCancellable *cancellable,
-                                                  GError **error);
+                                                  gboolean enable_fuse,
+                                                  rpmostreecxx::BubblewrapSession *bwrap_session,
+                                                  const char *name, const char *scriptdesc,
+                                                  const char *interp, const char *script,
+                                                  const char *script_arg, int stdin_fd,
+                                                  GCancellable *cancellable, GError **error);
 
 G_END_DECLS
@@ -0,0 +1,136 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Licensed under the GNU Lesser General Public License Version 2.1
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "libglnx.h"
+#include "rpmostree-trace.h"
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#else
+#define DTRACE_PROBE2(provider, probe, a, b) ((void)0)
+#define DTRACE_PROBE3(provider, probe, a, b, c) ((void)0)
+#endif
+
+/* The RPMOSTREE_TRACE file, or -1; opened on first use. Events are each a
+ * single O_APPEND write, so the client and the daemon can share a file. */
+static int trace_fd = -1;
+
+static int
+get_trace_fd (void)
+{
+  static gsize initialized;
+  if (g_once_init_enter (&initialized))
+    {
+      const char *path = g_getenv ("RPMOSTREE_TRACE");
+      if (path && *path)
+        {
+          trace_fd = TEMP_FAILURE_RETRY (
+              open (path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | O_NOCTTY, 0644));
+          if (trace_fd < 0)
+            g_warning ("Failed to open RPMOSTREE_TRACE=%s: %s", path, g_strerror (errno));
+          /* The trace event format allows leaving the array unterminated,
+           * which is what lets us keep appending. */
+          struct stat stbuf;
+          if (trace_fd >= 0 && fstat (trace_fd, &stbuf) == 0 && stbuf.st_size == 0)
+            (void)glnx_loop_write (trace_fd, "[\n", 2);
+        }
+      g_once_init_leave (&initialized, 1);
+    }
+  return trace_fd;
+}
+
+static void
+append_json_string (GString *buf, const char *str)
+{
+  g_string_append_c (buf, '"');
+  for (const char *p = str; *p; p++)
+    {
+      if (*p == '"' || *p == '\\')
+        g_string_append_printf (buf, "\\%c", *p);
+      else if ((guchar)*p < 0x20)
+        g_string_append_printf (buf, "\\u%04x", (guchar)*p);
+      else
+        g_string_append_c (buf, *p);
+    }
+  g_string_append_c (buf, '"');
+}
+
+/* Writes a "complete" event if @phase is 'X', else an instant one */
+static void
+write_trace_event (char phase, const char *name, const char *arg, gint64 ts, gint64 dur)
+{
+  const int fd = get_trace_fd ();
+  if (fd < 0)
+    return;
+
+  g_autoptr (GString) buf = g_string_new ("{\"name\":");
+  append_json_string (buf, name);
+  g_string_append_printf (buf, ",\"cat\":\"rpm-ostree\",\"ph\":\"%c\",\"ts\":%" G_GINT64_FORMAT,
+                          phase, ts);
+  if (phase == 'X')
+    g_string_append_printf (buf, ",\"dur\":%" G_GINT64_FORMAT, dur);
+  else
+    g_string_append (buf, ",\"s\":\"t\"");
+  g_string_append_printf (buf, ",\"pid\":%d,\"tid\":%ld", (int)getpid (),
+                          (long)syscall (SYS_gettid));
+  if (*arg)
+    {
+      g_string_append (buf, ",\"args\":{\"arg\":");
+      append_json_string (buf, arg);
+      g_string_append_c (buf, '}');
+    }
+  g_string_append (buf, "},\n");
+  /* Best effort; tracing must not get in the way */
+  (void)glnx_loop_write (fd, buf->str, buf->len);
+}
+
+namespace rpmostreecxx
+{
+TraceSpan::TraceSpan (const char *name, const char *arg)
+{
+  this->name = name;
+  this->arg = arg ?: "";
+  this->start = g_get_monotonic_time ();
+  DTRACE_PROBE2 (rpm_ostree, span_start, this->name, this->arg);
+}
+
+TraceSpan::~TraceSpan ()
+{
+  const gint64 duration = g_get_monotonic_time () - this->start;
+  DTRACE_PROBE3 (rpm_ostree, span_end, this->name, this->arg, (guint64)duration);
+  write_trace_event ('X', this->name, this->arg, this->start, duration);
+}
+}
+
+/* An instant event, for things which aren't worth a span of their own */
+void
+rpmostree_trace_mark (const char *name, const char *arg)
+{
+  arg = arg ?: "";
+  DTRACE_PROBE2 (rpm_ostree, mark, name, arg);
+  write_trace_event ('i', name, arg, g_get_monotonic_time (), 0);
+}
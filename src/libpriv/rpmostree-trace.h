@@ -0,0 +1,66 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Licensed under the GNU Lesser General Public License Version 2.1
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#pragma once
+
+#include <glib.h>
+
+/* Trace points for the expensive phases of the core and the daemon. Each
+ * fires a USDT probe in the `rpm_ostree` provider when built with
+ * <sys/sdt.h>, so they can be watched on live hosts with e.g.:
+ *
+ *   bpftrace -e 'usdt:/usr/bin/rpm-ostree:rpm_ostree:span_end
+ *                { @[str(arg0)] = hist(arg2); }'
+ *
+ * The probes are:
+ *   span_start(const char *name, const char *arg)
+ *   span_end(const char *name, const char *arg, guint64 duration_usec)
+ *   mark(const char *name, const char *arg)
+ *
+ * where @arg is e.g. the package a span is for, or "". With
+ * RPMOSTREE_TRACE=PATH in the environment, the spans and marks are also
+ * appended to PATH as Chrome trace events, which Perfetto can load.
+ */
+
+// C++ APIs here
+namespace rpmostreecxx
+{
+// Covers the lifetime of the object; @name must be a static string, and @arg
+// must outlive the span.
+class TraceSpan
+{
+public:
+  TraceSpan (const char *name, const char *arg = NULL);
+  ~TraceSpan ();
+  TraceSpan (const TraceSpan &) = delete;
+  TraceSpan &operator= (const TraceSpan &) = delete;
+
+private:
+  const char *name;
+  const char *arg;
+  gint64 start;
+};
+}
+
+// C APIs
+G_BEGIN_DECLS
+
+void rpmostree_trace_mark (const char *name, const char *arg);
+
+G_END_DECLS
@@ -28,6 +28,7 @@
 #include "rpmostree-core.h"
 #include "rpmostree-rpm-util.h"
 #include "rpmostree-unpacker-core.h"
+#include "rpmostree-util.h"
 #include <gio/gunixinputstream.h>
 #include <grp.h>
 #include <pwd.h>
@@ -37,6 +38,9 @@
 #include <rpm/rpmts.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 
 /**
  * throw_libarchive_error:
@@ -65,20 +69,253 @@ throw_libarchive_error (struct archive *ar, GError **error, char const *prefix)
 
 typedef int (*archive_setup_func) (struct archive *);
 
+/* The compressed side is read in views (of the mapping) or reads (into a
+ * buffer) of this size */
+#define SOURCE_BLOCK_SIZE (1024 * 1024)
+
+/* Where rpmostree_unpack_rpm2cpio() reads the RPM from. Regular files are
+ * mapped and passed to libarchive directly, which saves both the syscall and
+ * the copy for every block; otherwise (e.g. pipes) we fall back to reading
+ * into a page-aligned buffer. */
+typedef struct
+{
+  int fd; /* Borrowed */
+  const guint8 *map;
+  gsize map_size;
+  gsize offset;
+  void *buf;
+} Rpm2CpioSource;
+
+static la_ssize_t
+rpm2cpio_source_read (struct archive *ar, void *data, const void **out_buf)
+{
+  auto source = static_cast<Rpm2CpioSource *> (data);
+
+  if (source->map)
+    {
+      const gsize n = MIN (source->map_size - source->offset, SOURCE_BLOCK_SIZE);
+      *out_buf = source->map + source->offset;
+      source->offset += n;
+      return n;
+    }
+
+  ssize_t n = TEMP_FAILURE_RETRY (read (source->fd, source->buf, SOURCE_BLOCK_SIZE));
+  if (n < 0)
+    {
+      archive_set_error (ar, errno, "read");
+      return -1;
+    }
+  *out_buf = source->buf;
+  return n;
+}
+
+static int
+rpm2cpio_source_close (struct archive *ar, void *data)
+{
+  auto source = static_cast<Rpm2CpioSource *> (data);
+  if (source->map)
+    (void)munmap ((void *)source->map, source->map_size);
+  free (source->buf);
+  g_free (source);
+  return ARCHIVE_OK;
+}
+
+/* Open @ar on @fd, starting at its current offset */
+static gboolean
+rpm2cpio_source_open (struct archive *ar, int fd, GError **error)
+{
+  Rpm2CpioSource *source = g_new0 (Rpm2CpioSource, 1);
+  source->fd = fd;
+
+  struct stat stbuf;
+  off_t offset = lseek (fd, 0, SEEK_CUR);
+  if (offset >= 0 && fstat (fd, &stbuf) == 0 && S_ISREG (stbuf.st_mode) && stbuf.st_size > 0
+      && offset <= stbuf.st_size)
+    {
+      void *map = mmap (NULL, stbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map != MAP_FAILED)
+        {
+          (void)madvise (map, stbuf.st_size, MADV_SEQUENTIAL);
+          source->map = static_cast<const guint8 *> (map);
+          source->map_size = stbuf.st_size;
+          source->offset = offset;
+        }
+    }
+  if (!source->map)
+    {
+      if (posix_memalign (&source->buf, sysconf (_SC_PAGESIZE), SOURCE_BLOCK_SIZE) != 0)
+        {
+          g_free (source);
+          return glnx_throw (error, "Failed to allocate read buffer");
+        }
+    }
+
+  /* Note the close callback is called (and frees the source) even if opening
+   * fails */
+  if (archive_read_open (ar, source, NULL, rpm2cpio_source_read, rpm2cpio_source_close)
+      != ARCHIVE_OK)
+    {
+      (void)throw_libarchive_error (ar, error, "Reading rpm2cpio");
+      return FALSE;
+    }
+  return TRUE;
+}
+
+/* Decompressed payload is passed along in chunks of this size... */
+#define PIPELINE_CHUNK_SIZE (128 * 1024)
+/* ...with at most this much waiting to be consumed */
+#define PIPELINE_MAX_QUEUED (8 * 1024 * 1024)
+
+/* The payload decompression side of rpmostree_unpack_rpm2cpio(). A thread
+ * decompresses via @raw, and the cpio archive we hand out reads from the
+ * queue of chunks it produces. */
+typedef struct
+{
+  struct archive *raw; /* Only used by the thread once it's started */
+  GThread *thread;
+
+  GMutex lock;
+  GCond cond;
+  GQueue chunks; /* GBytes */
+  gsize bytes_queued;
+  gboolean eof;
+  gboolean stop;
+  char *error;
+  guint64 *out_cpu_usec; /* Optional; set once the payload has been read */
+
+  GBytes *current; /* The chunk libarchive is currently reading */
+} Rpm2CpioPipeline;
+
+static guint64
+get_thread_cpu_usec (void)
+{
+  struct timespec ts;
+  if (clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts) < 0)
+    return 0;
+  return (guint64)ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+static gpointer
+rpm2cpio_pipeline_thread (gpointer data)
+{
+  auto pipeline = static_cast<Rpm2CpioPipeline *> (data);
+  const guint64 cpu_start = get_thread_cpu_usec ();
+
+  while (TRUE)
+    {
+      guint8 *buf = (guint8 *)g_malloc (PIPELINE_CHUNK_SIZE);
+      la_ssize_t n = archive_read_data (pipeline->raw, buf, PIPELINE_CHUNK_SIZE);
+
+      g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&pipeline->lock);
+      if (n <= 0)
+        {
+          g_free (buf);
+          if (n < 0)
+            {
+              const char *msg = archive_error_string (pipeline->raw);
+              pipeline->error = g_strdup (msg ?: "Decompressing payload failed");
+            }
+          if (pipeline->out_cpu_usec)
+            *pipeline->out_cpu_usec = get_thread_cpu_usec () - cpu_start;
+          pipeline->eof = TRUE;
+          g_cond_broadcast (&pipeline->cond);
+          break;
+        }
+      while (pipeline->bytes_queued >= PIPELINE_MAX_QUEUED && !pipeline->stop)
+        g_cond_wait (&pipeline->cond, &pipeline->lock);
+      if (pipeline->stop)
+        {
+          g_free (buf);
+          break;
+        }
+      g_queue_push_tail (&pipeline->chunks, g_bytes_new_take (buf, n));
+      pipeline->bytes_queued += n;
+      g_cond_broadcast (&pipeline->cond);
+    }
+
+  return NULL;
+}
+
+static la_ssize_t
+rpm2cpio_pipeline_read (struct archive *ar, void *data, const void **out_buf)
+{
+  auto pipeline = static_cast<Rpm2CpioPipeline *> (data);
+
+  /* Start on the first read rather than at setup, so the thread only exists
+   * once someone is consuming the archive */
+  if (!pipeline->thread)
+    pipeline->thread = g_thread_new ("rpm2cpio", rpm2cpio_pipeline_thread, pipeline);
+
+  g_clear_pointer (&pipeline->current, g_bytes_unref);
+
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&pipeline->lock);
+  while (g_queue_is_empty (&pipeline->chunks) && !pipeline->eof)
+    g_cond_wait (&pipeline->cond, &pipeline->lock);
+  /* Hand out everything that was decompressed before any error */
+  if (g_queue_is_empty (&pipeline->chunks))
+    {
+      if (pipeline->error)
+        {
+          archive_set_error (ar, ARCHIVE_ERRNO_MISC, "%s", pipeline->error);
+          return -1;
+        }
+      return 0;
+    }
+
+  pipeline->current = static_cast<GBytes *> (g_queue_pop_head (&pipeline->chunks));
+  gsize len;
+  *out_buf = g_bytes_get_data (pipeline->current, &len);
+  pipeline->bytes_queued -= len;
+  g_cond_broadcast (&pipeline->cond);
+  return len;
+}
+
+static int
+rpm2cpio_pipeline_close (struct archive *ar, void *data)
+{
+  auto pipeline = static_cast<Rpm2CpioPipeline *> (data);
+
+  if (pipeline->thread)
+    {
+      {
+        g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&pipeline->lock);
+        pipeline->stop = TRUE;
+        g_cond_broadcast (&pipeline->cond);
+      }
+      g_thread_join (pipeline->thread);
+    }
+
+  archive_read_free (pipeline->raw);
+  g_queue_clear_full (&pipeline->chunks, (GDestroyNotify)g_bytes_unref);
+  g_clear_pointer (&pipeline->current, g_bytes_unref);
+  g_free (pipeline->error);
+  g_mutex_clear (&pipeline->lock);
+  g_cond_clear (&pipeline->cond);
+  g_free (pipeline);
+  return ARCHIVE_OK;
+}
+
 /**
  * rpmostree_unpack_rpm2cpio:
  * @fd: An open file descriptor for an RPM package
+ * @out_decompress_usec: (optional): Set to the CPU time spent decompressing
  * @error: GError
  *
  * Parse CPIO content of @fd via libarchive.  Note that the CPIO data
  * does not capture all relevant filesystem content; for example,
  * filesystem capabilities are part of a separate header, etc.
+ *
+ * The payload is decompressed in a separate thread once reading starts, so
+ * that it overlaps with whatever the caller does with the entries (for us,
+ * checksumming and writing objects). If provided, @out_decompress_usec must
+ * stay valid for the lifetime of the archive; it's set once the end of the
+ * payload is reached.
  */
 struct archive *
-rpmostree_unpack_rpm2cpio (int fd, GError **error)
+rpmostree_unpack_rpm2cpio (int fd, guint64 *out_decompress_usec, GError **error)
 {
-  g_autoptr (archive) ar = archive_read_new ();
-  if (ar == NULL)
+  g_autoptr (archive) raw = archive_read_new ();
+  if (raw == NULL)
     return (struct archive *)glnx_null_throw (error,
                                               "Failed to initialize rpm2cpio archive object");
 
@@ -91,16 +328,39 @@ rpmostree_unpack_rpm2cpio (int fd, GError **error)
 #ifdef HAVE_LIBARCHIVE_ZSTD
             archive_read_support_filter_zstd,
 #endif
-            archive_read_support_format_cpio };
+            archive_read_support_format_raw };
 
     for (guint i = 0; i < G_N_ELEMENTS (archive_setup_funcs); i++)
       {
-        if (archive_setup_funcs[i](ar) != ARCHIVE_OK)
-          return throw_libarchive_error (ar, error, "Setting up rpm2cpio");
+        if (archive_setup_funcs[i](raw) != ARCHIVE_OK)
+          return throw_libarchive_error (raw, error, "Setting up rpm2cpio");
       }
   }
 
-  if (archive_read_open_fd (ar, fd, 10240) != ARCHIVE_OK)
+  if (!rpm2cpio_source_open (raw, fd, error))
+    return NULL;
+  /* The raw format has a single entry, the decompressed payload */
+  struct archive_entry *entry;
+  if (archive_read_next_header (raw, &entry) != ARCHIVE_OK)
+    return throw_libarchive_error (raw, error, "Reading rpm2cpio");
+
+  g_autoptr (archive) ar = archive_read_new ();
+  if (ar == NULL)
+    return (struct archive *)glnx_null_throw (error,
+                                              "Failed to initialize rpm2cpio archive object");
+  if (archive_read_support_format_cpio (ar) != ARCHIVE_OK)
+    return throw_libarchive_error (ar, error, "Setting up rpm2cpio");
+
+  Rpm2CpioPipeline *pipeline = g_new0 (Rpm2CpioPipeline, 1);
+  pipeline->raw = util::move_nullify (raw);
+  pipeline->out_cpu_usec = out_decompress_usec;
+  g_mutex_init (&pipeline->lock);
+  g_cond_init (&pipeline->cond);
+  g_queue_init (&pipeline->chunks);
+  /* Note the close callback is called (and frees the pipeline) even if
+   * opening fails */
+  if (archive_read_open (ar, pipeline, NULL, rpm2cpio_pipeline_read, rpm2cpio_pipeline_close)
+      != ARCHIVE_OK)
     return throw_libarchive_error (ar, error, "Reading rpm2cpio");
 
   return util::move_nullify (ar);
@@ -32,6 +32,6 @@ G_BEGIN_DECLS
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (archive, archive_read_free);
 
-struct archive *rpmostree_unpack_rpm2cpio (int fd, GError **error);
+struct archive *rpmostree_unpack_rpm2cpio (int fd, guint64 *out_decompress_usec, GError **error);
 
 G_END_DECLS
\ No newline at end of file
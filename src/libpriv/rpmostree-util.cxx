@@ -50,7 +50,7 @@ _rpmostree_vardict_lookup_value_required (GVariantDict *dict, const char *key,
 }
 
 gboolean
-_rpmostree_util_update_checksum_from_file (GChecksum *checksum, int dfd, const char *path,
+_rpmostree_util_update_checksum_from_file (RpmOstreeHasher *checksum, int dfd, const char *path,
                                            GCancellable *cancellable, GError **error)
 {
   glnx_autofd int fd = -1;
@@ -63,8 +63,8 @@ _rpmostree_util_update_checksum_from_file (GChecksum *checksum, int dfd, const c
   if (!mfile)
     return FALSE;
 
-  g_checksum_update (checksum, (guint8 *)g_mapped_file_get_contents (mfile),
-                     g_mapped_file_get_length (mfile));
+  rpmostree_hasher_update (checksum, (guint8 *)g_mapped_file_get_contents (mfile),
+                           g_mapped_file_get_length (mfile));
 
   return TRUE;
 }
@@ -279,89 +279,194 @@ rpmostree_checksum_version (GVariant *checksum)
   return g_strdup (ret);
 }
 
-static gboolean
-pull_content_only_recurse (OstreeRepo *dest, OstreeRepo *src, OstreeRepoCommitTraverseIter *iter,
-                           GCancellable *cancellable, GError **error)
+typedef struct
 {
-  gboolean done = FALSE;
+  OstreeRepo *dest;
+  OstreeRepo *src;
+  GCancellable *cancellable;
+  GMutex lock;
+  GError *error;
+  guint n_done;
+} ImportCommitData;
 
-  while (!done)
-    {
-      OstreeRepoCommitIterResult iterres
-          = ostree_repo_commit_traverse_iter_next (iter, cancellable, error);
+static void
+import_object_worker (gpointer data, gpointer user_data)
+{
+  g_autoptr (GVariant) objname = static_cast<GVariant *> (data);
+  auto idata = static_cast<ImportCommitData *> (user_data);
+  {
+    g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&idata->lock);
+    if (idata->error)
+      return;
+  }
 
-      switch (iterres)
-        {
-        case OSTREE_REPO_COMMIT_ITER_RESULT_ERROR:
-          return FALSE;
-        case OSTREE_REPO_COMMIT_ITER_RESULT_END:
-          done = TRUE;
-          break;
-        case OSTREE_REPO_COMMIT_ITER_RESULT_FILE:
-          {
-            char *name;
-            char *checksum;
+  const char *checksum;
+  OstreeObjectType objtype;
+  ostree_object_name_deserialize (objname, &checksum, &objtype);
+  g_autoptr (GError) local_error = NULL;
+  /* Both repos are ours, so there's no need to verify the objects again */
+  gboolean ok = ostree_repo_import_object_from_with_trust (
+      idata->dest, idata->src, objtype, checksum, TRUE, idata->cancellable, &local_error);
+
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&idata->lock);
+  if (!ok && !idata->error)
+    idata->error = util::move_nullify (local_error);
+  idata->n_done++;
+}
 
-            ostree_repo_commit_traverse_iter_get_file (iter, &name, &checksum);
+/* Import @objects (serialized object names) from @src into @dest from
+ * multiple threads; ostree hardlinks them if it can and copies otherwise.
+ * @n_total is only for the progress message. */
+static gboolean
+import_objects (OstreeRepo *dest, OstreeRepo *src, GPtrArray *objects, guint n_total,
+                GCancellable *cancellable, GError **error)
+{
+  if (objects->len == 0)
+    return TRUE;
 
-            if (!ostree_repo_import_object_from (dest, src, OSTREE_OBJECT_TYPE_FILE, checksum,
-                                                 cancellable, error))
-              return FALSE;
-          }
-          break;
-        case OSTREE_REPO_COMMIT_ITER_RESULT_DIR:
+  ImportCommitData idata = { dest, src, cancellable };
+  g_mutex_init (&idata.lock);
+  {
+    auto progress = rpmostreecxx::progress_nitems_begin (objects->len, "Importing objects");
+    GThreadPool *pool
+        = g_thread_pool_new (import_object_worker, &idata, g_get_num_processors (), TRUE, error);
+    if (!pool)
+      return FALSE;
+    for (guint i = 0; i < objects->len; i++)
+      {
+        if (!g_thread_pool_push (pool, g_variant_ref ((GVariant *)objects->pdata[i]), error))
           {
-            char *name;
-            char *content_checksum;
-            char *meta_checksum;
-            g_autoptr (GVariant) dirtree = NULL;
-            ostree_cleanup_repo_commit_traverse_iter OstreeRepoCommitTraverseIter subiter = {
-              0,
-            };
-
-            ostree_repo_commit_traverse_iter_get_dir (iter, &name, &content_checksum,
-                                                      &meta_checksum);
-
-            if (!ostree_repo_load_variant (src, OSTREE_OBJECT_TYPE_DIR_TREE, content_checksum,
-                                           &dirtree, error))
-              return FALSE;
-
-            if (!ostree_repo_commit_traverse_iter_init_dirtree (
-                    &subiter, src, dirtree, OSTREE_REPO_COMMIT_TRAVERSE_FLAG_NONE, error))
-              return FALSE;
-
-            if (!pull_content_only_recurse (dest, src, &subiter, cancellable, error))
-              return FALSE;
+            g_thread_pool_free (pool, TRUE, TRUE);
+            return FALSE;
           }
-          break;
+      }
+    /* Wait for the workers, updating progress as we go */
+    while (g_thread_pool_unprocessed (pool) > 0)
+      {
+        {
+          g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&idata.lock);
+          progress->nitems_update (idata.n_done);
         }
+        g_usleep (G_USEC_PER_SEC / 10);
+      }
+    g_thread_pool_free (pool, FALSE, TRUE);
+    g_autofree char *msg = g_strdup_printf ("%u of %u", objects->len, n_total);
+    progress->end (msg);
+  }
+  g_mutex_clear (&idata.lock);
+  if (idata.error)
+    {
+      g_propagate_error (error, util::move_nullify (idata.error));
+      return FALSE;
     }
-
   return TRUE;
 }
 
-/* Migrate only the content (.file) objects from src+src_commit into dest.
- * Used for package layering.
+/* Migrate only the content (.file) objects from @src_commits in @src into
+ * @dest; used for package layering, with all of the packages at once.  The
+ * objects they have in common are only looked at once, and the missing ones
+ * are imported by import_objects(), so typically hardlinked in parallel.
  */
 gboolean
-rpmostree_pull_content_only (OstreeRepo *dest, OstreeRepo *src, const char *src_commit,
+rpmostree_pull_content_only (OstreeRepo *dest, OstreeRepo *src, GPtrArray *src_commits,
                              GCancellable *cancellable, GError **error)
 {
-  g_autoptr (GVariant) commitdata = NULL;
-  ostree_cleanup_repo_commit_traverse_iter OstreeRepoCommitTraverseIter iter = {
+  g_autoptr (GHashTable) reachable = ostree_repo_traverse_new_reachable ();
+  for (guint i = 0; i < src_commits->len; i++)
+    {
+      auto commit = static_cast<const char *> (src_commits->pdata[i]);
+      if (!ostree_repo_traverse_commit_union (src, commit, 0, reachable, cancellable, error))
+        return glnx_prefix_error (error, "Traversing %s", commit);
+    }
+
+  guint n_files = 0;
+  g_autoptr (GPtrArray) missing = g_ptr_array_new_with_free_func ((GDestroyNotify)g_variant_unref);
+  GLNX_HASH_TABLE_FOREACH (reachable, GVariant *, objname)
+    {
+      const char *checksum;
+      OstreeObjectType objtype;
+      ostree_object_name_deserialize (objname, &checksum, &objtype);
+      if (objtype != OSTREE_OBJECT_TYPE_FILE)
+        continue;
+      n_files++;
+      gboolean have_object = FALSE;
+      if (!ostree_repo_has_object (dest, objtype, checksum, &have_object, cancellable, error))
+        return FALSE;
+      if (!have_object)
+        g_ptr_array_add (missing, g_variant_ref (objname));
+    }
+
+  return import_objects (dest, src, missing, n_files, cancellable, error);
+}
+
+/* Copy @commit (but not its parents) from @src into @dest, like a local pull
+ * but without going through the fetcher: only the objects missing from @dest
+ * are imported, which ostree hardlinks if it can and copies otherwise, and
+ * we do that from multiple threads. The commit object itself is written
+ * last, so an interrupted copy doesn't look complete. */
+gboolean
+rpmostree_repo_import_commit (OstreeRepo *dest, OstreeRepo *src, const char *commit,
+                              GCancellable *cancellable, GError **error)
+{
+  GLNX_AUTO_PREFIX_ERROR ("Importing commit", error);
+
+  OstreeRepoCommitState state;
+  gboolean have_commit = FALSE;
+  if (!ostree_repo_has_object (dest, OSTREE_OBJECT_TYPE_COMMIT, commit, &have_commit, cancellable,
+                               error))
+    return FALSE;
+  if (have_commit)
+    {
+      if (!ostree_repo_load_commit (dest, commit, NULL, &state, error))
+        return FALSE;
+      if (!(state & OSTREE_REPO_COMMIT_STATE_PARTIAL))
+        return TRUE;
+    }
+
+  g_autoptr (GHashTable) reachable = NULL;
+  if (!ostree_repo_traverse_commit (src, commit, 0, &reachable, cancellable, error))
+    return FALSE;
+
+  g_autoptr (GPtrArray) missing = g_ptr_array_new_with_free_func ((GDestroyNotify)g_variant_unref);
+  GLNX_HASH_TABLE_FOREACH (reachable, GVariant *, objname)
+    {
+      const char *checksum;
+      OstreeObjectType objtype;
+      ostree_object_name_deserialize (objname, &checksum, &objtype);
+      if (objtype == OSTREE_OBJECT_TYPE_COMMIT)
+        continue;
+      gboolean have_object = FALSE;
+      if (!ostree_repo_has_object (dest, objtype, checksum, &have_object, cancellable, error))
+        return FALSE;
+      if (!have_object)
+        g_ptr_array_add (missing, g_variant_ref (objname));
+    }
+
+  g_auto (RpmOstreeRepoAutoTransaction) txn = {
     0,
   };
-
-  if (!ostree_repo_load_commit (src, src_commit, &commitdata, NULL, error))
+  /* Keep whatever we did copy; it's all content-addressed */
+  if (!rpmostree_repo_auto_transaction_start (&txn, dest, TRUE, cancellable, error))
     return FALSE;
 
-  if (!ostree_repo_commit_traverse_iter_init_commit (&iter, src, commitdata,
-                                                     OSTREE_REPO_COMMIT_TRAVERSE_FLAG_NONE, error))
+  if (!import_objects (dest, src, missing, g_hash_table_size (reachable), cancellable, error))
     return FALSE;
 
-  if (!pull_content_only_recurse (dest, src, &iter, cancellable, error))
+  g_autoptr (GVariant) detached = NULL;
+  if (!ostree_repo_read_commit_detached_metadata (src, commit, &detached, cancellable, error))
+    return FALSE;
+  if (detached
+      && !ostree_repo_write_commit_detached_metadata (dest, commit, detached, cancellable, error))
+    return FALSE;
+  if (!ostree_repo_import_object_from_with_trust (dest, src, OSTREE_OBJECT_TYPE_COMMIT, commit,
+                                                  TRUE, cancellable, error))
+    return FALSE;
+  if (have_commit && !ostree_repo_mark_commit_partial (dest, commit, FALSE, error))
     return FALSE;
 
+  if (!ostree_repo_commit_transaction (dest, NULL, cancellable, error))
+    return FALSE;
+  txn.initialized = FALSE;
   return TRUE;
 }
 
@@ -689,7 +794,7 @@ rpmostree_decompose_sha256_nevra (const char **nevra, /* gets incremented */
 char *
 rpmostree_commit_content_checksum (GVariant *commit)
 {
-  g_autoptr (GChecksum) hasher = g_checksum_new (G_CHECKSUM_SHA256);
+  g_autoptr (RpmOstreeHasher) hasher = rpmostree_hasher_new (G_CHECKSUM_SHA256);
   char checksum[OSTREE_SHA256_STRING_LEN + 1];
   const guint8 *csum;
 
@@ -698,16 +803,16 @@ rpmostree_commit_content_checksum (GVariant *commit)
   g_variant_get_child (commit, 6, "@ay", &csum_bytes);
   csum = ostree_checksum_bytes_peek (csum_bytes);
   ostree_checksum_inplace_from_bytes (csum, checksum);
-  g_checksum_update (hasher, (guint8 *)checksum, OSTREE_SHA256_STRING_LEN);
+  rpmostree_hasher_update (hasher, (guint8 *)checksum, OSTREE_SHA256_STRING_LEN);
   g_clear_pointer (&csum_bytes, (GDestroyNotify)g_variant_unref);
 
   /* Hash meta checksum */
   g_variant_get_child (commit, 7, "@ay", &csum_bytes);
   csum = ostree_checksum_bytes_peek (csum_bytes);
   ostree_checksum_inplace_from_bytes (csum, checksum);
-  g_checksum_update (hasher, (guint8 *)checksum, OSTREE_SHA256_STRING_LEN);
+  rpmostree_hasher_update (hasher, (guint8 *)checksum, OSTREE_SHA256_STRING_LEN);
 
-  return g_strdup (g_checksum_get_string (hasher));
+  return g_strdup (rpmostree_hasher_get_string (hasher));
 }
 
 char *
@@ -904,67 +1009,6 @@ rpmostree_variant_diff_print_formatted (guint max_key_len, GVariant *upgraded, G
   variant_diff_print_singles (max_key_len, added, "Added");
 }
 
-static int
-pkg_cmp_end (RpmOstreePackage *a, RpmOstreePackage *b)
-{
-  if (!b)
-    return -1;
-  if (!a)
-    return +1;
-
-  return rpm_ostree_package_cmp (a, b);
-}
-
-/* Given the result of rpm_ostree_db_diff(), print it in diff format for scripts. */
-void
-rpmostree_diff_print (GPtrArray *removed, GPtrArray *added, GPtrArray *modified_old,
-                      GPtrArray *modified_new)
-{
-  g_assert_cmpuint (modified_old->len, ==, modified_new->len);
-
-  const guint an = added->len;
-  const guint rn = removed->len;
-  const guint mn = modified_old->len;
-
-  guint cur_a = 0;
-  guint cur_r = 0;
-  guint cur_m = 0;
-  while (cur_a < an || cur_r < rn || cur_m < mn)
-    {
-      auto pkg_a = (RpmOstreePackage *)(cur_a < an ? added->pdata[cur_a] : NULL);
-      auto pkg_r = (RpmOstreePackage *)(cur_r < rn ? removed->pdata[cur_r] : NULL);
-      auto pkg_m = (RpmOstreePackage *)(cur_m < mn ? modified_old->pdata[cur_m] : NULL);
-
-      if (pkg_cmp_end (pkg_m, pkg_r) < 0)
-        if (pkg_cmp_end (pkg_m, pkg_a) < 0)
-          { /* mod is first */
-            g_assert (pkg_m != NULL);
-            g_print ("!%s\n", rpm_ostree_package_get_nevra (pkg_m));
-            g_print ("=%s\n", rpm_ostree_package_get_nevra (
-                                  static_cast<RpmOstreePackage *> (modified_new->pdata[cur_m])));
-            cur_m++;
-          }
-        else
-          { /* add is first */
-            g_assert (pkg_a != NULL);
-            g_print ("+%s\n", rpm_ostree_package_get_nevra (pkg_a));
-            cur_a++;
-          }
-      else if (pkg_cmp_end (pkg_r, pkg_a) < 0)
-        { /* del is first */
-          g_assert (pkg_r != NULL);
-          g_print ("-%s\n", rpm_ostree_package_get_nevra (pkg_r));
-          cur_r++;
-        }
-      else
-        { /* add is first */
-          g_assert (pkg_a != NULL);
-          g_print ("+%s\n", rpm_ostree_package_get_nevra (pkg_a));
-          cur_a++;
-        }
-    }
-}
-
 /* Copy of ot_variant_bsearch_str() from libostree
  * @array: A GVariant array whose first element must be a string
  * @str: Search for this string
@@ -1020,6 +1064,94 @@ rpmostree_variant_bsearch_str (GVariant *array, const char *str, int *out_pos)
   return FALSE;
 }
 
+/* For doing many lookups against the same a(s...) array: the first string of
+ * each element, decoded once and kept sorted. The strings point into the
+ * variant's data. */
+typedef struct
+{
+  const char *str;
+  guint idx; /* Position in the array */
+} VariantStrIndexEntry;
+
+struct _RpmOstreeVariantStrIndex
+{
+  GVariant *array;
+  GArray *entries; /* VariantStrIndexEntry, sorted by str then idx */
+};
+
+static gint
+compare_variant_str_index_entries (gconstpointer a, gconstpointer b)
+{
+  auto ea = static_cast<const VariantStrIndexEntry *> (a);
+  auto eb = static_cast<const VariantStrIndexEntry *> (b);
+  int cmp = strcmp (ea->str, eb->str);
+  if (cmp != 0)
+    return cmp;
+  return ea->idx < eb->idx ? -1 : (ea->idx > eb->idx ? 1 : 0);
+}
+
+/* Build an index over @array, which must be of the form 'a(s...)'. Unlike
+ * rpmostree_variant_bsearch_str(), the array needn't be sorted. */
+RpmOstreeVariantStrIndex *
+rpmostree_variant_str_index_new (GVariant *array)
+{
+  const gsize n = g_variant_n_children (array);
+  auto index = g_new0 (RpmOstreeVariantStrIndex, 1);
+  index->array = g_variant_ref (array);
+  index->entries = g_array_sized_new (FALSE, FALSE, sizeof (VariantStrIndexEntry), n);
+
+  gboolean sorted = TRUE;
+  GVariantIter iter;
+  g_variant_iter_init (&iter, array);
+  for (guint i = 0; i < n; i++)
+    {
+      g_autoptr (GVariant) child = g_variant_iter_next_value (&iter);
+      VariantStrIndexEntry entry = { NULL, i };
+      g_variant_get_child (child, 0, "&s", &entry.str);
+      if (i > 0 && sorted
+          && strcmp (g_array_index (index->entries, VariantStrIndexEntry, i - 1).str, entry.str)
+                 > 0)
+        sorted = FALSE;
+      g_array_append_val (index->entries, entry);
+    }
+  if (!sorted)
+    g_array_sort (index->entries, compare_variant_str_index_entries);
+
+  return index;
+}
+
+void
+rpmostree_variant_str_index_free (RpmOstreeVariantStrIndex *index)
+{
+  g_variant_unref (index->array);
+  g_array_unref (index->entries);
+  g_free (index);
+}
+
+/* Like rpmostree_variant_bsearch_str(), but without decoding any children:
+ * if present, @out_pos is set to the position in the array of the earliest
+ * element whose first string is @str. */
+gboolean
+rpmostree_variant_str_index_lookup (RpmOstreeVariantStrIndex *index, const char *str,
+                                    int *out_pos)
+{
+  auto entries = reinterpret_cast<const VariantStrIndexEntry *> (index->entries->data);
+  guint lo = 0;
+  guint hi = index->entries->len;
+  while (lo < hi)
+    {
+      const guint mid = lo + (hi - lo) / 2;
+      if (strcmp (entries[mid].str, str) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  if (lo == index->entries->len || !g_str_equal (entries[lo].str, str))
+    return FALSE;
+  *out_pos = entries[lo].idx;
+  return TRUE;
+}
+
 const char *
 rpmostree_auto_update_policy_to_str (RpmostreedAutomaticUpdatePolicy policy, GError **error)
 {
@@ -1105,3 +1237,103 @@ rpmostree_cxx_string_vec_to_strv (rust::Vec<rust::String> &v)
   g_ptr_array_add (r, NULL);
   return (char **)g_ptr_array_free (util::move_nullify (r), FALSE);
 }
+
+/* This mirrors OstreeDevIno from ostree-repo-private.h; OstreeRepoDevInoCache
+ * is a GHashTable set of these, and there's no API to add to it. */
+typedef struct
+{
+  dev_t dev;
+  ino_t ino;
+  char checksum[OSTREE_SHA256_STRING_LEN + 1];
+} RpmOstreeDevIno;
+
+/* Record that the file at @dev/@ino has content object @checksum, so that
+ * committing it doesn't need to read it again. Not thread-safe. */
+void
+rpmostree_devino_cache_add (OstreeRepoDevInoCache *cache, dev_t dev, ino_t ino,
+                            const char *checksum)
+{
+  RpmOstreeDevIno *key = g_new (RpmOstreeDevIno, 1);
+  key->dev = dev;
+  key->ino = ino;
+  g_strlcpy (key->checksum, checksum, sizeof (key->checksum));
+  g_hash_table_add ((GHashTable *)cache, key);
+}
+
+const char *
+rpmostree_devino_cache_lookup (OstreeRepoDevInoCache *cache, dev_t dev, ino_t ino)
+{
+  RpmOstreeDevIno lookup = { dev, ino, { 0 } };
+  auto found = static_cast<RpmOstreeDevIno *> (g_hash_table_lookup ((GHashTable *)cache, &lookup));
+  return found ? found->checksum : NULL;
+}
+
+void
+rpmostree_devino_cache_remove (OstreeRepoDevInoCache *cache, dev_t dev, ino_t ino)
+{
+  RpmOstreeDevIno lookup = { dev, ino, { 0 } };
+  g_hash_table_remove ((GHashTable *)cache, &lookup);
+}
+
+/* Get the current time as the filesystem of @dfd would record it in a ctime;
+ * it's not the same as the system clock since the kernel uses a coarse one. */
+gboolean
+rpmostree_ctime_stamp_at (int dfd, struct timespec *out_stamp, GError **error)
+{
+  g_auto (GLnxTmpfile) tmpf = {
+    0,
+  };
+  if (!glnx_open_tmpfile_linkable_at (dfd, ".", O_RDWR | O_CLOEXEC, &tmpf, error))
+    return FALSE;
+  struct stat stbuf;
+  if (!glnx_fstat (tmpf.fd, &stbuf, error))
+    return FALSE;
+  *out_stamp = stbuf.st_ctim;
+  return TRUE;
+}
+
+/* Whether @stbuf's ctime is at or after @stamp, from rpmostree_ctime_stamp_at() */
+gboolean
+rpmostree_stat_changed_since (const struct stat *stbuf, const struct timespec *stamp)
+{
+  return stbuf->st_ctim.tv_sec > stamp->tv_sec
+         || (stbuf->st_ctim.tv_sec == stamp->tv_sec && stbuf->st_ctim.tv_nsec >= stamp->tv_nsec);
+}
+
+/* Drop the entries of @cache for files under @dfd/@path which changed since
+ * @stamp, e.g. because a script wrote to them in place; the others still have
+ * the content the cache says, so committing can skip reading them. */
+gboolean
+rpmostree_devino_cache_prune_changed_at (OstreeRepoDevInoCache *cache, int dfd, const char *path,
+                                         const struct timespec *stamp,
+                                         GCancellable *cancellable, GError **error)
+{
+  g_auto (GLnxDirFdIterator) dfd_iter = {
+    FALSE,
+  };
+  if (!glnx_dirfd_iterator_init_at (dfd, path, FALSE, &dfd_iter, error))
+    return FALSE;
+  while (TRUE)
+    {
+      struct dirent *dent = NULL;
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&dfd_iter, &dent, cancellable, error))
+        return FALSE;
+      if (!dent)
+        break;
+      if (dent->d_type == DT_DIR)
+        {
+          if (!rpmostree_devino_cache_prune_changed_at (cache, dfd_iter.fd, dent->d_name, stamp,
+                                                        cancellable, error))
+            return FALSE;
+          continue;
+        }
+      if (dent->d_type != DT_REG)
+        continue;
+      struct stat stbuf;
+      if (!glnx_fstatat (dfd_iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW, error))
+        return FALSE;
+      if (rpmostree_stat_changed_since (&stbuf, stamp))
+        rpmostree_devino_cache_remove (cache, stbuf.st_dev, stbuf.st_ino);
+    }
+  return TRUE;
+}
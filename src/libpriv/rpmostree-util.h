@@ -33,6 +33,7 @@
 #include <sys/wait.h>
 
 #include "libglnx.h"
+#include "rpmostree-hasher.h"
 #include "rpmostree-types.h"
 #include "rpmostree.h"
 #include "rust/cxx.h"
@@ -196,7 +197,7 @@ G_BEGIN_DECLS
 GVariant *_rpmostree_vardict_lookup_value_required (GVariantDict *dict, const char *key,
                                                     const GVariantType *fmt, GError **error);
 
-gboolean _rpmostree_util_update_checksum_from_file (GChecksum *checksum, int rootfs_dfd,
+gboolean _rpmostree_util_update_checksum_from_file (RpmOstreeHasher *checksum, int rootfs_dfd,
                                                     const char *path, GCancellable *cancellable,
                                                     GError **error);
 
@@ -209,8 +210,21 @@ gboolean rpmostree_check_size_within_limit (guint64 actual, guint64 limit, const
 
 char *rpmostree_checksum_version (GVariant *checksum);
 
-gboolean rpmostree_pull_content_only (OstreeRepo *dest, OstreeRepo *src, const char *src_commit,
+gboolean rpmostree_pull_content_only (OstreeRepo *dest, OstreeRepo *src, GPtrArray *src_commits,
                                       GCancellable *cancellable, GError **error);
+
+gboolean rpmostree_repo_import_commit (OstreeRepo *dest, OstreeRepo *src, const char *commit,
+                                       GCancellable *cancellable, GError **error);
+
+void rpmostree_devino_cache_add (OstreeRepoDevInoCache *cache, dev_t dev, ino_t ino,
+                                 const char *checksum);
+const char *rpmostree_devino_cache_lookup (OstreeRepoDevInoCache *cache, dev_t dev, ino_t ino);
+void rpmostree_devino_cache_remove (OstreeRepoDevInoCache *cache, dev_t dev, ino_t ino);
+gboolean rpmostree_ctime_stamp_at (int dfd, struct timespec *out_stamp, GError **error);
+gboolean rpmostree_stat_changed_since (const struct stat *stbuf, const struct timespec *stamp);
+gboolean rpmostree_devino_cache_prune_changed_at (OstreeRepoDevInoCache *cache, int dfd,
+                                                  const char *path, const struct timespec *stamp,
+                                                  GCancellable *cancellable, GError **error);
 const char *rpmostree_file_get_path_cached (GFile *file);
 
 static inline const char *
@@ -251,9 +265,6 @@ void rpmostree_variant_diff_print_formatted (guint max_key_len, GVariant *upgrad
                                              GVariant *downgraded, GVariant *removed,
                                              GVariant *added);
 
-void rpmostree_diff_print (GPtrArray *removed, GPtrArray *added, GPtrArray *modified_old,
-                           GPtrArray *modified_new);
-
 gboolean rpmostree_str_has_prefix_in_strv (const char *str, char **strv, int n);
 
 gboolean rpmostree_str_has_prefix_in_ptrarray (const char *str, GPtrArray *prefixes);
@@ -324,6 +335,17 @@ G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (RpmOstreeRepoAutoTransaction,
 
 gboolean rpmostree_variant_bsearch_str (GVariant *array, const char *str, int *out_pos);
 
+typedef struct _RpmOstreeVariantStrIndex RpmOstreeVariantStrIndex;
+
+RpmOstreeVariantStrIndex *rpmostree_variant_str_index_new (GVariant *array);
+
+void rpmostree_variant_str_index_free (RpmOstreeVariantStrIndex *index);
+
+gboolean rpmostree_variant_str_index_lookup (RpmOstreeVariantStrIndex *index, const char *str,
+                                             int *out_pos);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (RpmOstreeVariantStrIndex, rpmostree_variant_str_index_free)
+
 const char *rpmostree_auto_update_policy_to_str (RpmostreedAutomaticUpdatePolicy policy,
                                                  GError **error);
 
@@ -0,0 +1,259 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Licensed under the GNU Lesser General Public License Version 2.1
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "config.h"
+
+#include "rpmostree-work-queue.h"
+
+typedef struct
+{
+  gpointer item;
+  guint64 cost;
+  guint64 seq; /* Insertion order, to keep the sort stable */
+} WorkItem;
+
+struct _RpmOstreeWorkQueueJob
+{
+  RpmOstreeWorkQueue *queue;
+  gpointer item;
+  guint worker;
+  guint64 start_time;
+};
+
+struct _RpmOstreeWorkQueue
+{
+  char *name;
+  guint max_running;
+  RpmOstreeWorkQueueStartFunc start_func;
+  gpointer user_data;
+  GDestroyNotify item_free;
+
+  GArray *pending; /* WorkItem; sorted cheapest first, so we pop from the end */
+  gboolean pending_sorted;
+  guint64 next_seq;
+  guint n_running;
+
+  /* Per-worker accounting; a worker is a slot for one job in flight */
+  GArray *worker_busy;      /* gboolean */
+  GArray *worker_busy_usec; /* guint64 */
+  guint peak_running;
+  guint n_completed;
+  guint64 first_start_time;
+  guint64 last_done_time;
+  guint64 max_job_usec;
+};
+
+/* Create a queue which runs at most @max_running jobs at a time via
+ * @start_func. Items that were never started are freed with @item_free.
+ */
+RpmOstreeWorkQueue *
+rpmostree_work_queue_new (const char *name, guint max_running,
+                          RpmOstreeWorkQueueStartFunc start_func, gpointer user_data,
+                          GDestroyNotify item_free)
+{
+  RpmOstreeWorkQueue *queue = g_new0 (RpmOstreeWorkQueue, 1);
+  queue->name = g_strdup (name);
+  queue->max_running = MAX (max_running, 1);
+  queue->start_func = start_func;
+  queue->user_data = user_data;
+  queue->item_free = item_free;
+  queue->pending = g_array_new (FALSE, FALSE, sizeof (WorkItem));
+  queue->pending_sorted = TRUE;
+  queue->worker_busy = g_array_new (FALSE, TRUE, sizeof (gboolean));
+  queue->worker_busy_usec = g_array_new (FALSE, TRUE, sizeof (guint64));
+  return queue;
+}
+
+/* Jobs still in flight hold a pointer to the queue, so it's only valid to
+ * free it once they've all completed. */
+void
+rpmostree_work_queue_free (RpmOstreeWorkQueue *queue)
+{
+  g_assert_cmpuint (queue->n_running, ==, 0);
+  if (queue->item_free)
+    {
+      for (guint i = 0; i < queue->pending->len; i++)
+        queue->item_free (g_array_index (queue->pending, WorkItem, i).item);
+    }
+  g_array_unref (queue->pending);
+  g_array_unref (queue->worker_busy);
+  g_array_unref (queue->worker_busy_usec);
+  g_free (queue->name);
+  g_free (queue);
+}
+
+/* Add @item to the queue; items with the highest @cost are started first,
+ * and among equal costs, in the order they were pushed. Takes ownership.
+ */
+void
+rpmostree_work_queue_push (RpmOstreeWorkQueue *queue, gpointer item, guint64 cost)
+{
+  WorkItem witem = { item, cost, queue->next_seq++ };
+  g_array_append_val (queue->pending, witem);
+  queue->pending_sorted = FALSE;
+}
+
+/* Change the number of jobs allowed in flight; this takes effect on the next
+ * dispatch. Lowering it doesn't interrupt running jobs. */
+void
+rpmostree_work_queue_set_max_running (RpmOstreeWorkQueue *queue, guint max_running)
+{
+  queue->max_running = MAX (max_running, 1);
+}
+
+guint
+rpmostree_work_queue_get_max_running (RpmOstreeWorkQueue *queue)
+{
+  return queue->max_running;
+}
+
+guint
+rpmostree_work_queue_get_n_running (RpmOstreeWorkQueue *queue)
+{
+  return queue->n_running;
+}
+
+guint
+rpmostree_work_queue_get_n_pending (RpmOstreeWorkQueue *queue)
+{
+  return queue->pending->len;
+}
+
+static gint
+compare_work_items (gconstpointer a, gconstpointer b)
+{
+  auto wa = static_cast<const WorkItem *> (a);
+  auto wb = static_cast<const WorkItem *> (b);
+  /* Cheapest first, and for equal costs, latest first, since we pop from the
+   * end */
+  if (wa->cost != wb->cost)
+    return wa->cost < wb->cost ? -1 : 1;
+  if (wa->seq != wb->seq)
+    return wa->seq > wb->seq ? -1 : 1;
+  return 0;
+}
+
+static guint
+acquire_worker (RpmOstreeWorkQueue *queue)
+{
+  for (guint i = 0; i < queue->worker_busy->len; i++)
+    {
+      if (!g_array_index (queue->worker_busy, gboolean, i))
+        {
+          g_array_index (queue->worker_busy, gboolean, i) = TRUE;
+          return i;
+        }
+    }
+  gboolean busy = TRUE;
+  g_array_append_val (queue->worker_busy, busy);
+  g_array_set_size (queue->worker_busy_usec, queue->worker_busy->len);
+  return queue->worker_busy->len - 1;
+}
+
+/* Start pending items until we hit the limit of jobs in flight. If the start
+ * function fails, the error is returned and no further items are started.
+ */
+gboolean
+rpmostree_work_queue_dispatch (RpmOstreeWorkQueue *queue, GError **error)
+{
+  if (!queue->pending_sorted)
+    {
+      g_array_sort (queue->pending, compare_work_items);
+      queue->pending_sorted = TRUE;
+    }
+
+  while (queue->n_running < queue->max_running && queue->pending->len > 0)
+    {
+      WorkItem witem = g_array_index (queue->pending, WorkItem, queue->pending->len - 1);
+      g_array_set_size (queue->pending, queue->pending->len - 1);
+
+      RpmOstreeWorkQueueJob *job = g_new0 (RpmOstreeWorkQueueJob, 1);
+      job->queue = queue;
+      job->item = witem.item;
+      job->worker = acquire_worker (queue);
+      job->start_time = g_get_monotonic_time ();
+      if (queue->first_start_time == 0)
+        queue->first_start_time = job->start_time;
+      queue->n_running++;
+      queue->peak_running = MAX (queue->peak_running, queue->n_running);
+
+      if (!queue->start_func (job, witem.item, queue->user_data, error))
+        {
+          rpmostree_work_queue_job_done (job);
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+gpointer
+rpmostree_work_queue_job_get_user_data (RpmOstreeWorkQueueJob *job)
+{
+  return job->queue->user_data;
+}
+
+/* Mark @job as complete, freeing it and its item; returns how long it took
+ * in microseconds. This doesn't start any more work; call
+ * rpmostree_work_queue_dispatch() for that.
+ */
+guint64
+rpmostree_work_queue_job_done (RpmOstreeWorkQueueJob *job)
+{
+  RpmOstreeWorkQueue *queue = job->queue;
+  const guint64 now = g_get_monotonic_time ();
+  const guint64 elapsed = now - job->start_time;
+
+  g_assert_cmpuint (queue->n_running, >, 0);
+  queue->n_running--;
+  queue->n_completed++;
+  queue->last_done_time = now;
+  queue->max_job_usec = MAX (queue->max_job_usec, elapsed);
+  g_array_index (queue->worker_busy, gboolean, job->worker) = FALSE;
+  g_array_index (queue->worker_busy_usec, guint64, job->worker) += elapsed;
+
+  if (queue->item_free)
+    queue->item_free (job->item);
+  g_free (job);
+  return elapsed;
+}
+
+/* Log how the work was spread across workers. A worker that was busy for
+ * much less time than the total means we were short of work (or running
+ * more jobs than needed); a single slow job dominating the total means the
+ * critical path is that job. */
+void
+rpmostree_work_queue_log_stats (RpmOstreeWorkQueue *queue)
+{
+  if (queue->n_completed == 0)
+    return;
+
+  const double total_secs
+      = (queue->last_done_time - queue->first_start_time) / (double)G_USEC_PER_SEC;
+  guint64 busy_usec = 0;
+  for (guint i = 0; i < queue->worker_busy_usec->len; i++)
+    {
+      const guint64 worker_usec = g_array_index (queue->worker_busy_usec, guint64, i);
+      busy_usec += worker_usec;
+      g_debug ("%s: worker %u busy %.1fs", queue->name, i, worker_usec / (double)G_USEC_PER_SEC);
+    }
+  g_debug ("%s: %u jobs in %.1fs; max in flight %u, busy %.1fs, slowest %.1fs", queue->name,
+           queue->n_completed, total_secs, queue->peak_running,
+           busy_usec / (double)G_USEC_PER_SEC, queue->max_job_usec / (double)G_USEC_PER_SEC);
+}
@@ -0,0 +1,65 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Licensed under the GNU Lesser General Public License Version 2.1
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#pragma once
+
+#include "libglnx.h"
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* A queue of work items which are started, most expensive first, with a
+ * bounded number in flight at once. Everything here runs on the main thread;
+ * the start function is expected to kick off an async operation (usually a
+ * GTask in a thread) whose completion callback calls
+ * rpmostree_work_queue_job_done().
+ */
+typedef struct _RpmOstreeWorkQueue RpmOstreeWorkQueue;
+typedef struct _RpmOstreeWorkQueueJob RpmOstreeWorkQueueJob;
+
+typedef gboolean (*RpmOstreeWorkQueueStartFunc) (RpmOstreeWorkQueueJob *job, gpointer item,
+                                                 gpointer user_data, GError **error);
+
+RpmOstreeWorkQueue *rpmostree_work_queue_new (const char *name, guint max_running,
+                                              RpmOstreeWorkQueueStartFunc start_func,
+                                              gpointer user_data, GDestroyNotify item_free);
+
+void rpmostree_work_queue_free (RpmOstreeWorkQueue *queue);
+
+void rpmostree_work_queue_push (RpmOstreeWorkQueue *queue, gpointer item, guint64 cost);
+
+void rpmostree_work_queue_set_max_running (RpmOstreeWorkQueue *queue, guint max_running);
+
+guint rpmostree_work_queue_get_max_running (RpmOstreeWorkQueue *queue);
+
+guint rpmostree_work_queue_get_n_running (RpmOstreeWorkQueue *queue);
+
+guint rpmostree_work_queue_get_n_pending (RpmOstreeWorkQueue *queue);
+
+gboolean rpmostree_work_queue_dispatch (RpmOstreeWorkQueue *queue, GError **error);
+
+gpointer rpmostree_work_queue_job_get_user_data (RpmOstreeWorkQueueJob *job);
+
+guint64 rpmostree_work_queue_job_done (RpmOstreeWorkQueueJob *job);
+
+void rpmostree_work_queue_log_stats (RpmOstreeWorkQueue *queue);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (RpmOstreeWorkQueue, rpmostree_work_queue_free);
+
+G_END_DECLS
@@ -0,0 +1,75 @@
+#!/bin/bash
+set -euo pipefail
+
+# Runs the benchmarks in tests/bench against synthetic rpm-md repos at each
+# combination of $BENCH_SCALES packages and $BENCH_FILES files per package,
+# and writes the timings to $BENCH_OUTPUT as JSON. If $BENCH_BASELINE points
+# to such a file from an earlier run, fails if any phase got slower than
+# $BENCH_THRESHOLD times its baseline.
+
+dn=$(cd "$(dirname "$0")" && pwd)
+topsrcdir=$(cd "$dn/.." && pwd)
+commondir=$(cd "$dn/common" && pwd)
+export topsrcdir commondir
+
+# shellcheck source=common/libtest-core.sh
+. "${commondir}/libtest-core.sh"
+# shellcheck source=common/libbench.sh
+. "${commondir}/libbench.sh"
+
+read -r -a tests <<< "$(filter_tests "${topsrcdir}/tests/bench")"
+if [ ${#tests[*]} -eq 0 ]; then
+  echo "No tests selected; mistyped filter?"
+  exit 0
+fi
+
+BENCH_SCALES=${BENCH_SCALES:-100 1000 5000}
+BENCH_FILES=${BENCH_FILES:-1 20}
+BENCH_OUTPUT=$(realpath "${BENCH_OUTPUT:-bench-results.json}")
+BENCH_THRESHOLD=${BENCH_THRESHOLD:-1.2}
+
+outputdir="${topsrcdir}/bench-logs"
+rm -rf "${outputdir:?}"
+mkdir -p "${outputdir}"
+BENCH_RESULTS="${outputdir}/results.jsonl"
+touch "${BENCH_RESULTS}"
+export BENCH_RESULTS
+
+# re-use the fixture repos if they already exist; they're reproducible
+fixtures="$(pwd)/bench-cache"
+for n_pkgs in ${BENCH_SCALES}; do
+  for n_files in ${BENCH_FILES}; do
+    bench_build_repo "${fixtures}/${n_pkgs}x${n_files}" "${n_pkgs}" "${n_files}"
+  done
+done
+
+# Unlike the other test suites, these run one at a time so they don't skew
+# each other's timings.
+echo "Running ${#tests[*]} benchmarks; results outputting to ${outputdir}/"
+failed=0
+for n_pkgs in ${BENCH_SCALES}; do
+  for n_files in ${BENCH_FILES}; do
+    for test in "${tests[@]}"; do
+      if ! "${topsrcdir}/tests/bench/runtest.sh" "${outputdir}" \
+             "${fixtures}/${n_pkgs}x${n_files}" "${test}"; then
+        failed=1
+      fi
+    done
+  done
+done
+
+jq -s --arg version "$(rpm-ostree --version | sed -ne 's/^ *Version: //p' | tr -d "'")" \
+  --arg git "$(git -C "${topsrcdir}" describe --always --dirty 2>/dev/null || true)" \
+  --arg date "$(date -u +%Y-%m-%dT%H:%M:%SZ)" --arg host "$(uname -n)" \
+  --argjson ncpus "$(nproc)" \
+  '{version: $version, git: $git, date: $date, host: $host, ncpus: $ncpus, results: .}' \
+  "${BENCH_RESULTS}" > "${BENCH_OUTPUT}"
+echo "Wrote ${BENCH_OUTPUT}"
+
+if [ -n "${BENCH_BASELINE:-}" ]; then
+  if ! bench_compare "${BENCH_OUTPUT}" "${BENCH_BASELINE}" "${BENCH_THRESHOLD}"; then
+    echo "Some phases regressed against ${BENCH_BASELINE}"
+    failed=1
+  fi
+fi
+exit ${failed}
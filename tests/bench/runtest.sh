@@ -0,0 +1,52 @@
+#!/bin/bash
+set -euo pipefail
+
+if [ -n "${V:-}" ]; then
+  set -x
+fi
+
+outputdir=$1; shift
+fixture=$1; shift
+testname=$1; shift
+
+# e.g. 1000x20, for 1000 packages of 20 files each
+BENCH_FIXTURE=${fixture}
+BENCH_FIXTURE_NAME=$(basename "${fixture}")
+BENCH_N_PKGS=${BENCH_FIXTURE_NAME%x*}
+export BENCH_FIXTURE BENCH_FIXTURE_NAME BENCH_N_PKGS
+
+outputdir="${outputdir}/${testname}-${BENCH_FIXTURE_NAME}"
+mkdir -p "${outputdir}"
+export BENCH_OUTPUTDIR=${outputdir}
+
+# keep original stdout around; this propagates to the terminal
+exec 3>&1
+
+# but redirect everything else to a log file
+exec 1>"${outputdir}/output.log"
+exec 2>&1
+
+# seed output log with current date
+date
+
+if [ -n "${V:-}" ]; then
+  setpriv --pdeathsig SIGKILL -- tail -f "${outputdir}/output.log" >&3 &
+fi
+
+echo "EXEC: ${testname} (${BENCH_FIXTURE_NAME})" >&3
+
+# this will cause libtest.sh to allocate a tmpdir and cd to it
+export VMTESTS=1
+
+# shellcheck source=../common/libtest.sh disable=2154
+. "${commondir}/libtest.sh"
+
+if "${topsrcdir}/tests/bench/test-${testname}.sh"; then
+  echo "PASS: ${testname} (${BENCH_FIXTURE_NAME})" >&3
+else
+  echo "FAIL: ${testname} (${BENCH_FIXTURE_NAME})" >&3
+  if [ -z "${V:-}" ]; then
+    tail -n20 "${outputdir}/output.log" | sed "s/^/   ${testname}: /g" >&3
+  fi
+  exit 1
+fi
@@ -0,0 +1,40 @@
+#!/bin/bash
+set -euo pipefail
+
+# Times composing the FCOS config of tests/compose.sh plus every package of
+# the fixture, from scratch and then again with the package cache warm.
+
+. ${commondir}/libtest.sh
+. ${commondir}/libbench.sh
+
+set -x
+
+compose_cache=${BENCH_COMPOSE_CACHE:-${topsrcdir}/compose-cache}
+if ! test -d "${compose_cache}/config"; then
+  skip "No ${compose_cache}/config; run tests/compose.sh first to create it"
+fi
+if ! has_compose_privileges; then
+  skip "Composing needs uid 0 and CAP_SYS_ADMIN"
+fi
+
+git clone "file://${compose_cache}/config"
+cat > config/bench.repo <<EOF
+[bench]
+name=bench
+baseurl=file://${BENCH_FIXTURE}/yumrepo
+gpgcheck=0
+EOF
+bench_pkg_names "${BENCH_N_PKGS}" | jq -R . | jq -s . > pkgs.json
+jq --slurpfile pkgs pkgs.json '.repos += ["bench"] | .packages += $pkgs[0]' \
+  config/manifest.json > manifest.json.new
+mv manifest.json.new config/manifest.json
+
+ostree init --repo repo --mode=bare-user
+mkdir cache
+compose_argv="--unified-core --repo=repo --cachedir=cache config/manifest.json"
+# shellcheck disable=SC2086
+bench_time compose-tree "${BENCH_FIXTURE_NAME}" rpm-ostree compose tree ${compose_argv}
+# shellcheck disable=SC2086
+bench_time compose-tree-cached "${BENCH_FIXTURE_NAME}" \
+  rpm-ostree compose tree --force-nocache ${compose_argv}
+echo "ok compose"
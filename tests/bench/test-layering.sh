@@ -0,0 +1,44 @@
+#!/bin/bash
+set -euo pipefail
+
+# Times client-side layering of every package of the fixture in a fresh VM,
+# then replacing a tenth of them once they're part of the base.
+
+. ${commondir}/libtest.sh
+. ${commondir}/libvm.sh
+. ${commondir}/libbench.sh
+
+set -x
+
+vm_kola_spawn "${BENCH_OUTPUTDIR}/kola"
+
+vm_raw_rsync --delete "${BENCH_FIXTURE}/" "${VM}:/var/tmp/bench"
+vm_send_inline /etc/yum.repos.d/bench.repo <<EOF
+[bench]
+name=bench
+baseurl=file:///var/tmp/bench/yumrepo
+gpgcheck=0
+EOF
+
+fx=${BENCH_FIXTURE_NAME}
+pkgs=$(bench_pkg_names "${BENCH_N_PKGS}" | tr '\n' ' ')
+
+bench_time refresh-md "${fx}" vm_rpmostree refresh-md
+# shellcheck disable=SC2086
+bench_time install "${fx}" vm_rpmostree install ${pkgs}
+bench_time status "${fx}" vm_rpmostree status
+bench_time status-json "${fx}" vm_rpmostree status --json > /dev/null
+bench_time db-diff "${fx}" vm_rpmostree db diff
+echo "ok install"
+
+# Overrides only apply to base packages, so make the layered ones the base
+vm_cmd ostree refs "$(vm_get_deployment_info 0 checksum)" --create vmcheck_tmp/bench
+vm_rpmostree cleanup -p
+vm_ostree_commit_layered_as_base vmcheck_tmp/bench vmcheck
+vm_rpmostree upgrade
+vm_reboot
+
+bench_time override-replace "${fx}" \
+  vm_rpmostree override replace "/var/tmp/bench/replacements/*.rpm"
+bench_time cleanup "${fx}" vm_rpmostree cleanup -pr
+echo "ok override replace"
@@ -0,0 +1,160 @@
+# Source library for the benchmarks in tests/bench
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+# Fixed so that the fixture repos are byte-for-byte reproducible, which keeps
+# timings comparable across machines and runs.
+BENCH_SOURCE_DATE_EPOCH=1668643200
+
+# Prefix of the synthetic package names; pkg-N requires pkg-N/10, so that
+# there's a dependency tree to solve too.
+BENCH_PKG_PREFIX=bench-pkg
+
+# Writes the spec of a synthetic package to stdout
+# $1 - index of the package
+# $2 - number of files in it
+# $3 - version
+_bench_write_spec() {
+    local i=$1; shift
+    local n_files=$1; shift
+    local version=$1; shift
+    local name=${BENCH_PKG_PREFIX}-${i}
+    echo "Name: ${name}"
+    echo "Summary: ${name}"
+    echo "License: GPLv2+"
+    echo "Version: ${version}"
+    echo "Release: 1"
+    echo "BuildArch: noarch"
+    if [ "${i}" -gt 0 ]; then
+        echo "Requires: ${BENCH_PKG_PREFIX}-$((i / 10))"
+    fi
+    cat << EOF
+
+%description
+%{summary}
+
+%install
+mkdir -p %{buildroot}/usr/share/${name}
+for f in \$(seq ${n_files}); do
+  # a few KiB each, varying per file like real content
+  yes "${name}-${version} \${f}" | head -c \$((1024 * (f % 8 + 1))) \\
+    > %{buildroot}/usr/share/${name}/file-\${f}
+done
+
+%files
+/usr/share/${name}
+
+%changelog
+* Thu Nov 17 2022 Colin Walters <walters@verbum.org>
+- Dummy change to satisfy rpm timestamp clamping
+EOF
+}
+
+# Builds the spec $2 into the directory $1
+_bench_rpmbuild() {
+    local rpmdir=$1; shift
+    local spec=$1; shift
+    local specdir bn
+    specdir=$(dirname "${spec}")
+    bn=$(basename "${spec}" .spec)
+    SOURCE_DATE_EPOCH=${BENCH_SOURCE_DATE_EPOCH} rpmbuild -bb "${spec}" --quiet \
+        --define "_topdir ${specdir}" \
+        --define "_builddir ${specdir}/.build-${bn}" \
+        --define "_buildrootdir ${specdir}/.buildroot-${bn}" \
+        --define "_rpmdir ${rpmdir}" \
+        --define "_build_name_fmt %%{NAME}-%%{VERSION}-%%{RELEASE}.%%{ARCH}.rpm" \
+        --define "_buildhost rpm-ostree-bench" \
+        --define "use_source_date_epoch_as_buildtime 1" \
+        --define "clamp_mtime_to_source_date_epoch 1"
+}
+
+# Creates a synthetic rpm-md repo in $1/yumrepo, of $2 packages of $3 files
+# each. A version 2 of every tenth package is written to $1/replacements for
+# `override replace`. Nothing is done if the fixture already exists, since
+# the large ones take a while to build.
+bench_build_repo() {
+    local dest=$1; shift
+    local n_pkgs=$1; shift
+    local n_files=$1; shift
+
+    if [ -f "${dest}/.complete" ]; then
+        return
+    fi
+    rm -rf "${dest}"
+    mkdir -p "${dest}"/{specs,yumrepo,replacements}
+
+    echo "Building fixture repo of ${n_pkgs} packages of ${n_files} files in ${dest}"
+    local i
+    for i in $(seq 0 $((n_pkgs - 1))); do
+        _bench_write_spec "${i}" "${n_files}" 1.0 > "${dest}/specs/${BENCH_PKG_PREFIX}-${i}.spec"
+        if [ $((i % 10)) -eq 0 ]; then
+            _bench_write_spec "${i}" "${n_files}" 2.0 \
+                > "${dest}/specs/${BENCH_PKG_PREFIX}-${i}-2.spec"
+        fi
+    done
+
+    export -f _bench_rpmbuild
+    export BENCH_SOURCE_DATE_EPOCH
+    find "${dest}/specs" -name '*.spec' ! -name '*-2.spec' -print0 | \
+        xargs -0 -n 1 -P "$(ncpus)" bash -c '_bench_rpmbuild "$0" "$1"' "${dest}/yumrepo"
+    find "${dest}/specs" -name '*-2.spec' -print0 | \
+        xargs -0 -n 1 -P "$(ncpus)" bash -c '_bench_rpmbuild "$0" "$1"' "${dest}/replacements"
+    (cd "${dest}/yumrepo" && createrepo_c --no-database --quiet \
+        --revision "${BENCH_SOURCE_DATE_EPOCH}" --set-timestamp-to-revision .)
+    rm -rf "${dest}/specs"
+    touch "${dest}/.complete"
+}
+
+# Lists the names of the packages of a fixture with $1 packages
+bench_pkg_names() {
+    local n_pkgs=$1; shift
+    seq 0 $((n_pkgs - 1)) | sed -e "s/^/${BENCH_PKG_PREFIX}-/"
+}
+
+# Runs $3+ and records its wall-clock time as phase $1 of fixture $2 (of the
+# form <packages>x<files>) in ${BENCH_RESULTS}, one JSON object per line.
+bench_time() {
+    local phase=$1; shift
+    local fixture=$1; shift
+    local start end
+    echo "Timing ${phase} (${fixture}): $*"
+    start=$(date +%s%N)
+    "$@"
+    end=$(date +%s%N)
+    jq -nc --arg phase "${phase}" --arg fixture "${fixture}" \
+        --argjson seconds "$(((end - start) / 1000000)).0" \
+        '{phase: $phase, fixture: $fixture, seconds: ($seconds / 1000)}' >> "${BENCH_RESULTS}"
+}
+
+# Compares the results $1 against the baseline $2, both as written by
+# tests/bench.sh. Fails if any phase took more than $3 (e.g. 1.2) times as
+# long as in the baseline.
+bench_compare() {
+    local results=$1; shift
+    local baseline=$1; shift
+    local threshold=$1; shift
+    jq -nr --slurpfile r "${results}" --slurpfile b "${baseline}" \
+       --argjson threshold "${threshold}" '
+      ($b[0].results | map({key: "\(.fixture) \(.phase)", value: .seconds}) | from_entries)
+        as $base |
+      $r[0].results[] | select($base["\(.fixture) \(.phase)"] != null) |
+      $base["\(.fixture) \(.phase)"] as $prev |
+      (.seconds / ([$prev, 0.001] | max)) as $ratio |
+      "\(.fixture)\t\(.phase)\t\($prev)s\t\(.seconds)s\t\($ratio * 100 | round)%" +
+      (if $ratio > $threshold then "\tREGRESSION" else "" end)
+    ' | tee bench-compare.txt
+    ! grep -q REGRESSION bench-compare.txt
+}
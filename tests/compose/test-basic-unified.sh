@@ -232,3 +232,26 @@ if test -f extensions-changed; then
   fatal "found extensions-changed"
 fi
 echo "ok extensions no change"
+
+# The bottom-up tree writer should give the same tree shape as the mtree one
+runcompose --force-nocache --ex-low-memory-commit
+lowmemrev=$(ostree --repo="${repo}" rev-parse "${treeref}")
+for rev in "${newrev}" "${lowmemrev}"; do
+  ostree --repo="${repo}" ls -R "${rev}" | awk '{print $1, $2, $3, $5}' > "ls-${rev}.txt"
+done
+diff -u "ls-${newrev}.txt" "ls-${lowmemrev}.txt"
+ostree --repo="${repo}" fsck
+echo "ok --ex-low-memory-commit"
+
+# Composes with their own cachedirs share the noarch imports
+shared_noarch=${test_tmpdir}/shared-noarch-repo
+mkdir -p cache-arch1 cache-arch2
+runcompose --force-nocache --cachedir=${test_tmpdir}/cache-arch1 \
+  --ex-shared-noarch-pkgcache=${shared_noarch}
+ostree --repo=${shared_noarch} refs > shared-refs.txt
+assert_file_has_content shared-refs.txt '^rpmostree/pkg/.*noarch$'
+runcompose --force-nocache --cachedir=${test_tmpdir}/cache-arch2 \
+  --ex-shared-noarch-pkgcache=${shared_noarch} |& tee compose-shared.txt
+assert_file_has_content compose-shared.txt 'Reusing [0-9]* noarch packages from shared pkgcache'
+rm -rf cache-arch1 cache-arch2
+echo "ok --ex-shared-noarch-pkgcache"
@@ -106,6 +106,17 @@ assert_streq \
   "$(jq .packages versions.lock.new | sha256sum)"
 echo "ok strict mode sanity check"
 
+# and that exact mode, which skips the search, comes to the same result
+runcompose \
+  --ex-lockfile-exact \
+  --ex-lockfile="$PWD/versions.lock" \
+  --ex-write-lockfile-to="$PWD/versions.lock.new" \
+  --dry-run "${treefile}" |& tee out.txt
+assert_streq \
+  "$(jq .packages versions.lock | sha256sum)" \
+  "$(jq .packages versions.lock.new | sha256sum)"
+echo "ok exact mode sanity check"
+
 # check that trying to install a pkg that's not in the lockfiles fails
 build_rpm unlocked-pkg
 treefile_append "packages" '["unlocked-pkg"]'
@@ -140,6 +151,15 @@ if runcompose \
 fi
 assert_file_has_content err.txt 'Could not depsolve transaction'
 assert_file_has_content err.txt 'unlocked-pkg-dep-2.0-1.x86_64 .*filtered out by exclude filtering'
+if runcompose \
+    --ex-lockfile-exact \
+    --ex-lockfile="$PWD/versions.lock" \
+    --ex-lockfile="$PWD/override.lock" \
+    --dry-run "${treefile}" &>err.txt; then
+  fatal "compose unexpectedly succeeded"
+fi
+assert_file_has_content err.txt \
+  'Requirements not provided by locked packages: unlocked-pkg-dep (required by unlocked-pkg-2.0-1.x86_64)'
 treefile_remove "packages" '"unlocked-pkg"'
 echo "ok strict mode no unlocked pkg deps"
 
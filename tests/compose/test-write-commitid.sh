@@ -21,4 +21,8 @@ assert_streq "$(jq -r '.["ostree-commit"]' < compose.json)" "${commitid_txt}"
 for key in ostree-version rpm-ostree-inputhash ostree-content-bytes-written; do
     jq -r '.["'${key}'"]' compose.json >/dev/null
 done
+# Per-phase timings
+for phase in depsolve checkout rpmdb postprocess commit; do
+    jq -e '.["phase-timing"][] | select(.phase == "'${phase}'") | .["wall-ms"]' compose.json >/dev/null
+done
 echo "ok composejson"
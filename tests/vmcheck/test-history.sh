@@ -90,9 +90,15 @@ echo "ok uninstall"
 # and check history pruning since that's one bit we can't really test from the
 # unit tests
 
-vm_cmd find /var/lib/rpm-ostree/history | xargs -n 1 basename | sort -g > entries.txt
-if [ ! $(wc -l entries.txt) -gt 1 ]; then
-  assert_not_reached "Expected more than 1 entry, got $(cat entries.txt)"
+# The index is a 24 byte header followed by 96 byte entries
+history_index_entries() {
+  echo $(( ($(vm_cmd stat -c %s /var/lib/rpm-ostree/history/index) - 24) / 96 ))
+}
+
+vm_cmd journalctl -o json MESSAGE_ID=9bddbda177cd44d891b1b561a8a0ce9e | \
+  jq -r .DEPLOYMENT_TIMESTAMP | sort -g > entries.txt
+if [ ! $(history_index_entries) -gt 1 ]; then
+  assert_not_reached "Expected more than 1 entry, got $(history_index_entries)"
 fi
 
 # get the most recent entry
@@ -101,8 +107,16 @@ entry=$(tail -n 1 entries.txt)
 vm_cmd journalctl --vacuum-time=$((entry - 1))s
 vm_rpmostree cleanup -b
 
-vm_cmd ls -l /var/lib/rpm-ostree/history > entries.txt
-if [ $(wc -l entries.txt) != 1 ]; then
-  assert_not_reached "Expected only 1 entry, got $(cat entries.txt)"
+if [ $(history_index_entries) != 1 ]; then
+  assert_not_reached "Expected only 1 entry, got $(history_index_entries)"
 fi
+# Just the index and the compacted log are left
+vm_cmd ls /var/lib/rpm-ostree/history > files.txt
+assert_file_has_content files.txt '^index$'
+assert_file_has_content files.txt '^log\.[0-9][0-9]*$'
+if [ $(wc -l < files.txt) != 2 ]; then
+  assert_not_reached "Unexpected files in history dir: $(cat files.txt)"
+fi
+vm_rpmostree ex history > out.txt
+assert_not_file_has_content out.txt 'Missing history information'
 echo "ok prune"
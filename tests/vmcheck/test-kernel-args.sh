@@ -140,6 +140,13 @@ vm_rpmostree kargs --append=PACKAGE2=TEST2 | tee out.txt
 # check that kargs modifications are done offline
 assert_not_file_has_content out.txt 'Enabled rpm-md'
 echo "ok kargs work offline"
+vm_rpmostree kargs --append=COALESCED=TEST --delete=PACKAGE2=TEST2 --coalesce-staged | tee out.txt
+assert_file_has_content out.txt 'staged deployment in place'
+vm_rpmostree kargs > kargs.txt
+assert_file_has_content_literal kargs.txt 'COALESCED=TEST'
+assert_not_file_has_content_literal kargs.txt 'PACKAGE2=TEST2'
+vm_rpmostree kargs --append=PACKAGE2=TEST2 --delete=COALESCED=TEST --coalesce-staged
+echo "ok kargs coalesced into staged deployment"
 vm_reboot
 
 vm_cmd grep ^options /boot/loader/entries/ostree-2-$osname.conf > kargs.txt
@@ -125,6 +125,15 @@ vm_rpmostree db diff --format=diff \
 assert_file_has_content_literal 'db-diff.txt' "+foo-1.0-1.x86_64"
 echo "ok pkg-add foo"
 
+# The layered pkglist is derived from the base one and the transaction, so
+# check it against what actually ended up in the rpmdb
+root=$(vm_get_deployment_root 0)
+vm_cmd rpm -qa --dbpath=${root}/usr/share/rpm | grep -v '^gpg-pubkey-' | sort > rpmdb-nevras.txt
+vm_rpmostree db list $(vm_get_deployment_info 0 checksum) | grep '^ ' | \
+  sed -e 's/^ *//; s/-[0-9]*:/-/' | sort > pkglist-nevras.txt
+diff -u rpmdb-nevras.txt pkglist-nevras.txt
+echo "ok layered pkglist matches rpmdb"
+
 # Check that there are no pkglist entries in the --json output
 vm_assert_status_jq \
   '.deployments[0]["base-commit-meta"]|index("rpmostree.rpmdb.pkglist")|not' \
@@ -279,9 +279,11 @@ if vm_rpmostree install refresh-md-new-pkg --dry-run; then
 fi
 vm_rpmostree refresh-md -f | tee out.txt
 assert_file_has_content_literal out.txt "Updating metadata for 'vmcheck-http'"
-if ! vm_rpmostree install refresh-md-new-pkg --dry-run; then
+if ! vm_rpmostree install refresh-md-new-pkg --dry-run > out.txt; then
   assert_not_reached "failed to dry-run install new pkg from cached rpmmd?"
 fi
+assert_file_has_content_literal out.txt 'Download: 1 package'
+assert_file_has_content_literal out.txt 'Initramfs regeneration: no'
 vm_stop_httpd vmcheck
 echo "ok refresh-md"
 